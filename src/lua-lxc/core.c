@@ -36,6 +36,7 @@
 #define luaL_newlib(L,l) (lua_newtable(L), luaL_register(L,NULL,l))
 #define luaL_setfuncs(L,l,n) (assert(n==0), luaL_register(L,NULL,l))
 #define luaL_checkunsigned(L,n) luaL_checknumber(L,n)
+#define lua_rawlen(L,i) lua_objlen(L,i)
 #endif
 
 #ifdef NO_CHECK_UDATA
@@ -51,6 +52,7 @@
     (*(void **) (checkudata(L, i, tname)))
 
 #define CONTAINER_TYPENAME	"lxc.container"
+#define SAMPLER_TYPENAME	"lxc.sampler"
 
 static int container_new(lua_State *L)
 {
@@ -406,6 +408,236 @@ static luaL_Reg lxc_container_methods[] =
     {NULL, NULL}
 };
 
+/*
+ * The sampler holds a reference on each of its containers, so that
+ * they outlive it whatever the garbage collector does.
+ */
+struct sampler {
+    struct lxc_cgroup_stats *stats;
+    struct lxc_container **cs;
+    int nc;
+    char **keys;
+    int nk;
+    struct lxc_cgroup_sample *samples;
+};
+
+static int sampler_gc(lua_State *L)
+{
+    struct sampler *s = checkudata(L, 1, SAMPLER_TYPENAME);
+    int i;
+
+    lxc_cgroup_stats_free(s->stats);
+    s->stats = NULL;
+    for (i = 0; i < s->nc; i++)
+	lxc_container_put(s->cs[i]);
+    s->nc = 0;
+    for (i = 0; i < s->nk; i++)
+	free(s->keys[i]);
+    s->nk = 0;
+    free(s->cs);
+    free(s->keys);
+    free(s->samples);
+    s->cs = NULL;
+    s->keys = NULL;
+    s->samples = NULL;
+    return 0;
+}
+
+static int sampler_new(lua_State *L)
+{
+    struct sampler *s;
+    int i, nc, nk;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    nc = lua_rawlen(L, 1);
+    nk = lua_rawlen(L, 2);
+
+    s = lua_newuserdata(L, sizeof(*s));
+    memset(s, 0, sizeof(*s));
+    luaL_getmetatable(L, SAMPLER_TYPENAME);
+    lua_setmetatable(L, -2);
+
+    s->cs = calloc(nc + 1, sizeof(*s->cs));
+    s->keys = calloc(nk + 1, sizeof(*s->keys));
+    s->samples = calloc(nc * nk + 1, sizeof(*s->samples));
+    if (!s->cs || !s->keys || !s->samples)
+	return luaL_error(L, "out of memory");
+
+    for (i = 0; i < nc; i++) {
+	lua_rawgeti(L, 1, i + 1);
+	s->cs[i] = lua_unboxpointer(L, -1, CONTAINER_TYPENAME);
+	lua_pop(L, 1);
+	lxc_container_get(s->cs[i]);
+	s->nc++;
+    }
+    for (i = 0; i < nk; i++) {
+	lua_rawgeti(L, 2, i + 1);
+	s->keys[i] = strdup(luaL_checkstring(L, -1));
+	lua_pop(L, 1);
+	if (!s->keys[i])
+	    return luaL_error(L, "out of memory");
+	s->nk++;
+    }
+
+    s->stats = lxc_cgroup_stats_new(s->cs, nc, (const char **)s->keys, nk);
+    if (!s->stats)
+	lua_pushnil(L);
+    return 1;
+}
+
+/*
+ * Returns two lists with an entry for each container, the counters read
+ * and their change per second, each a table indexed by key.  Containers
+ * none of the counters could be read of, such as those not running, have
+ * no entry, other counters which could not be read are left out.
+ */
+static int sampler_sample(lua_State *L)
+{
+    struct sampler *s = checkudata(L, 1, SAMPLER_TYPENAME);
+    struct lxc_cgroup_sample *sample;
+    int i, j;
+
+    if (!s->stats || lxc_cgroup_stats_sample(s->stats, s->samples) < 0) {
+	lua_pushnil(L);
+	return 1;
+    }
+
+    lua_createtable(L, s->nc, 0);
+    lua_createtable(L, s->nc, 0);
+    for (i = 0; i < s->nc; i++) {
+	sample = &s->samples[i * s->nk];
+	for (j = 0; j < s->nk; j++)
+	    if (sample[j].valid)
+		break;
+	if (j == s->nk)
+	    continue;
+
+	lua_createtable(L, 0, s->nk);
+	lua_createtable(L, 0, s->nk);
+	for (j = 0; j < s->nk; j++) {
+	    if (!sample[j].valid)
+		continue;
+	    lua_pushnumber(L, (lua_Number)sample[j].value);
+	    lua_setfield(L, -3, s->keys[j]);
+	    lua_pushnumber(L, sample[j].rate);
+	    lua_setfield(L, -2, s->keys[j]);
+	}
+	lua_rawseti(L, -3, i + 1);
+	lua_rawseti(L, -3, i + 1);
+    }
+    return 2;
+}
+
+static luaL_Reg lxc_sampler_methods[] =
+{
+    {"sample",			sampler_sample},
+    {NULL, NULL}
+};
+
+static const struct {
+    const char *name;
+    int flag;
+} inventory_fields[] = {
+    {"state",		LXC_INVENTORY_STATE},
+    {"pid",		LXC_INVENTORY_PID},
+    {"groups",		LXC_INVENTORY_GROUPS},
+    {"autostart",	LXC_INVENTORY_AUTOSTART},
+    {"ipv4",		LXC_INVENTORY_IPV4},
+    {"ipv6",		LXC_INVENTORY_IPV6},
+    {"interfaces",	LXC_INVENTORY_INTERFACES},
+    {NULL, 0}
+};
+
+static void inventory_push_list(lua_State *L, char **values)
+{
+    int i;
+
+    lua_newtable(L);
+    for (i = 0; values && values[i]; i++) {
+	lua_pushstring(L, values[i]);
+	lua_rawseti(L, -2, i + 1);
+    }
+}
+
+/*
+ * Returns a list with a table for each container, sorted by name, with
+ * its name and the fields listed in the optional table of field names
+ * (all of inventory_fields by default).
+ */
+static int lxc_inventory(lua_State *L)
+{
+    const char *lxcpath = luaL_optstring(L, 1, NULL);
+    struct lxc_inventory *inv, *e;
+    int fields = LXC_INVENTORY_MAXFLAGS - 1;
+    int i, j, n;
+
+    if (!lua_isnoneornil(L, 2)) {
+	luaL_checktype(L, 2, LUA_TTABLE);
+	fields = 0;
+	n = lua_rawlen(L, 2);
+	for (i = 0; i < n; i++) {
+	    const char *name;
+
+	    lua_rawgeti(L, 2, i + 1);
+	    name = luaL_checkstring(L, -1);
+	    for (j = 0; inventory_fields[j].name; j++)
+		if (!strcmp(name, inventory_fields[j].name))
+		    break;
+	    if (inventory_fields[j].name)
+		fields |= inventory_fields[j].flag;
+	    else if (strcmp(name, "name"))
+		return luaL_error(L, "unknown field '%s'", name);
+	    lua_pop(L, 1);
+	}
+    }
+
+    n = lxc_get_inventory(lxcpath, fields, &inv);
+    if (n < 0) {
+	lua_pushnil(L);
+	return 1;
+    }
+
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; i++) {
+	e = &inv[i];
+	lua_createtable(L, 0, 8);
+	lua_pushstring(L, e->name);
+	lua_setfield(L, -2, "name");
+	if (fields & LXC_INVENTORY_STATE && e->state) {
+	    lua_pushstring(L, e->state);
+	    lua_setfield(L, -2, "state");
+	}
+	if (fields & LXC_INVENTORY_PID) {
+	    lua_pushinteger(L, e->init_pid);
+	    lua_setfield(L, -2, "pid");
+	}
+	if (fields & LXC_INVENTORY_GROUPS) {
+	    inventory_push_list(L, e->groups);
+	    lua_setfield(L, -2, "groups");
+	}
+	if (fields & LXC_INVENTORY_AUTOSTART) {
+	    lua_pushboolean(L, e->autostart);
+	    lua_setfield(L, -2, "autostart");
+	}
+	if (fields & LXC_INVENTORY_IPV4) {
+	    inventory_push_list(L, e->ipv4);
+	    lua_setfield(L, -2, "ipv4");
+	}
+	if (fields & LXC_INVENTORY_IPV6) {
+	    inventory_push_list(L, e->ipv6);
+	    lua_setfield(L, -2, "ipv6");
+	}
+	if (fields & LXC_INVENTORY_INTERFACES) {
+	    inventory_push_list(L, e->interfaces);
+	    lua_setfield(L, -2, "interfaces");
+	}
+	lua_rawseti(L, -2, i + 1);
+    }
+    lxc_inventory_free(inv, n);
+    return 1;
+}
+
 static int lxc_version_get(lua_State *L) {
     lua_pushstring(L, VERSION);
     return 1;
@@ -418,6 +650,50 @@ static int lxc_default_config_path_get(lua_State *L) {
     return 1;
 }
 
+static int lxc_api_stats_get(lua_State *L)
+{
+    struct lxc_api_stat *stats;
+    int i, j, n;
+
+    n = lxc_get_stats(&stats);
+    if (n < 0) {
+	lua_pushnil(L);
+	return 1;
+    }
+
+    lua_createtable(L, 0, n);
+    for (i = 0; i < n; i++) {
+	lua_createtable(L, 0, 4);
+	lua_pushnumber(L, stats[i].count);
+	lua_setfield(L, -2, "count");
+	lua_pushnumber(L, stats[i].total_ns);
+	lua_setfield(L, -2, "total_ns");
+	lua_pushnumber(L, stats[i].max_ns);
+	lua_setfield(L, -2, "max_ns");
+	lua_createtable(L, LXC_STATS_BUCKETS, 0);
+	for (j = 0; j < LXC_STATS_BUCKETS; j++) {
+	    lua_pushnumber(L, stats[i].buckets[j]);
+	    lua_rawseti(L, -2, j + 1);
+	}
+	lua_setfield(L, -2, "buckets");
+	lua_setfield(L, -2, stats[i].name);
+    }
+    free(stats);
+    return 1;
+}
+
+static int lxc_api_stats_enable(lua_State *L)
+{
+    lua_pushboolean(L, lxc_stats_enable(lua_toboolean(L, 1)));
+    return 1;
+}
+
+static int lxc_api_stats_reset(lua_State *L)
+{
+    lxc_stats_reset();
+    return 0;
+}
+
 static int cmd_get_config_item(lua_State *L)
 {
     int arg_cnt = lua_gettop(L);
@@ -458,6 +734,11 @@ static luaL_Reg lxc_lib_methods[] = {
     {"default_config_path_get",	lxc_default_config_path_get},
     {"cmd_get_config_item",	cmd_get_config_item},
     {"container_new",		container_new},
+    {"sampler_new",		sampler_new},
+    {"inventory",		lxc_inventory},
+    {"api_stats_get",		lxc_api_stats_get},
+    {"api_stats_enable",	lxc_api_stats_enable},
+    {"api_stats_reset",		lxc_api_stats_reset},
     {"usleep",			lxc_util_usleep},
     {"dirname",			lxc_util_dirname},
     {NULL, NULL}
@@ -491,5 +772,14 @@ LUALIB_API int luaopen_lxc_core(lua_State *L) {
     lua_settable(L, -3);
     lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
     lua_pop(L, 1);
+
+    luaL_newmetatable(L, SAMPLER_TYPENAME);
+    luaL_setfuncs(L, lxc_sampler_methods, 0);
+    lua_pushvalue(L, -1);  /* push metatable */
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, sampler_gc);
+    lua_settable(L, -3);
+    lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+    lua_pop(L, 1);
     return 1;
 }
@@ -377,6 +377,39 @@ function M.containers_running(names_only)
     return containers
 end
 
+-- return a sampler reading the cgroup files in keys of each
+-- container, see core.sampler_new
+function M.sampler_new(containers, keys)
+    local cores = {}
+
+    for i,ct in ipairs(containers) do
+	cores[i] = ct.core
+    end
+    return core.sampler_new(cores, keys)
+end
+
+-- return a table describing each container of lxcpath (the default one
+-- if nil), with the fields listed in fields, see core.inventory
+function M.inventory(lxcpath, fields)
+    return core.inventory(lxcpath, fields)
+end
+
+-- return the latency counters of this process by container method
+-- (and "cmd", "fork", "mem_lock" and "disk_lock"), each a table with
+-- count, total_ns, max_ns and buckets, see core.api_stats_get
+function M.api_stats_get()
+    return core.api_stats_get()
+end
+
+-- enable or disable the latency counters, return whether they were
+function M.api_stats_enable(enable)
+    return core.api_stats_enable(enable)
+end
+
+function M.api_stats_reset()
+    core.api_stats_reset()
+end
+
 function M.version_get()
     return core.version_get()
 end
@@ -31,6 +31,7 @@
 #include <sys/un.h>
 
 #include "log.h"
+#include "af_unix.h"
 
 lxc_log_define(lxc_af_unix, lxc);
 
@@ -71,7 +72,7 @@ int lxc_abstract_unix_open(const char *path, int type, int flags)
 		return -1;
 	}
 
-	if (type == SOCK_STREAM && listen(fd, 100)) {
+	if ((type == SOCK_STREAM || type == SOCK_SEQPACKET) && listen(fd, 100)) {
 		int tmp = errno;
 		close(fd);
 		errno = tmp;
@@ -95,13 +96,13 @@ int lxc_abstract_unix_close(int fd)
 	return 0;
 }
 
-int lxc_abstract_unix_connect(const char *path)
+int lxc_abstract_unix_connect(const char *path, int type)
 {
 	int fd;
 	size_t len;
 	struct sockaddr_un addr;
 
-	fd = socket(PF_UNIX, SOCK_STREAM, 0);
+	fd = socket(PF_UNIX, type | SOCK_CLOEXEC, 0);
 	if (fd < 0)
 		return -1;
 
@@ -131,143 +132,158 @@ int lxc_abstract_unix_connect(const char *path)
 	return fd;
 }
 
-int lxc_abstract_unix_send_fd(int fd, int sendfd, void *data, size_t size)
+/*
+ * With a SOCK_SEQPACKET socket all of @iov and the fds go as one message,
+ * which the peer gets whole with a single recvmsg().
+ */
+int lxc_abstract_unix_send_fds_iov(int fd, int *sendfds, int num_sendfds,
+				   struct iovec *iov, size_t iovlen)
 {
 	struct msghdr msg = { 0 };
-	struct iovec iov;
 	struct cmsghdr *cmsg;
-	char cmsgbuf[CMSG_SPACE(sizeof(int))];
-	char buf[1];
-	int *val;
+	char cmsgbuf[CMSG_SPACE(LXC_UNIX_MAX_FDS * sizeof(int))];
 
-	msg.msg_control = cmsgbuf;
-	msg.msg_controllen = sizeof(cmsgbuf);
+	if (num_sendfds < 0 || num_sendfds > LXC_UNIX_MAX_FDS) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	cmsg = CMSG_FIRSTHDR(&msg);
-	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-	cmsg->cmsg_level = SOL_SOCKET;
-	cmsg->cmsg_type = SCM_RIGHTS;
-	val = (int *)(CMSG_DATA(cmsg));
-	*val = sendfd;
+	if (num_sendfds) {
+		msg.msg_control = cmsgbuf;
+		msg.msg_controllen = CMSG_SPACE(num_sendfds * sizeof(int));
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_len = CMSG_LEN(num_sendfds * sizeof(int));
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		memcpy(CMSG_DATA(cmsg), sendfds, num_sendfds * sizeof(int));
+	}
 
 	msg.msg_name = NULL;
 	msg.msg_namelen = 0;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovlen;
+
+	return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+int lxc_abstract_unix_send_fds(int fd, int *sendfds, int num_sendfds,
+			       void *data, size_t size)
+{
+	struct iovec iov;
+	char buf[1];
+
+	if (num_sendfds < 1) {
+		errno = EINVAL;
+		return -1;
+	}
 
 	iov.iov_base = data ? data : buf;
 	iov.iov_len = data ? size : sizeof(buf);
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+	return lxc_abstract_unix_send_fds_iov(fd, sendfds, num_sendfds, &iov, 1);
+}
 
-	return sendmsg(fd, &msg, MSG_NOSIGNAL);
+int lxc_abstract_unix_send_fd(int fd, int sendfd, void *data, size_t size)
+{
+	return lxc_abstract_unix_send_fds(fd, &sendfd, 1, data, size);
 }
 
-int lxc_abstract_unix_recv_fd(int fd, int *recvfd, void *data, size_t size)
+int lxc_abstract_unix_recv_fds_iov(int fd, int *recvfds, int num_recvfds,
+				   struct iovec *iov, size_t iovlen)
 {
 	struct msghdr msg = { 0 };
-	struct iovec iov;
 	struct cmsghdr *cmsg;
-	char cmsgbuf[CMSG_SPACE(sizeof(int))];
-	char buf[1];
-	int ret, *val;
+	char cmsgbuf[CMSG_SPACE(LXC_UNIX_MAX_FDS * sizeof(int))];
+	int i, ret, n;
+
+	if (num_recvfds < 0 || num_recvfds > LXC_UNIX_MAX_FDS) {
+		errno = EINVAL;
+		return -1;
+	}
 
 	msg.msg_name = NULL;
 	msg.msg_namelen = 0;
-	msg.msg_control = cmsgbuf;
-	msg.msg_controllen = sizeof(cmsgbuf);
-
-	iov.iov_base = data ? data : buf;
-	iov.iov_len = data ? size : sizeof(buf);
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+	if (num_recvfds) {
+		msg.msg_control = cmsgbuf;
+		msg.msg_controllen = sizeof(cmsgbuf);
+	}
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovlen;
 
 	ret = recvmsg(fd, &msg, 0);
 	if (ret <= 0)
 		goto out;
 
-	cmsg = CMSG_FIRSTHDR(&msg);
-
-	/* if the message is wrong the variable will not be
+	/* if the message is wrong the variables will not be
 	 * filled and the peer will notified about a problem */
-	*recvfd = -1;
+	for (i = 0; i < num_recvfds; i++)
+		recvfds[i] = -1;
 
-	if (cmsg && cmsg->cmsg_len == CMSG_LEN(sizeof(int)) &&
-			cmsg->cmsg_level == SOL_SOCKET &&
+	cmsg = num_recvfds ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
 			cmsg->cmsg_type == SCM_RIGHTS) {
-		val = (int *) CMSG_DATA(cmsg);
-		*recvfd = *val;
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (n == num_recvfds) {
+			memcpy(recvfds, CMSG_DATA(cmsg), n * sizeof(int));
+		} else {
+			/* don't leak what we did get */
+			for (i = 0; i < n; i++)
+				close(((int *)CMSG_DATA(cmsg))[i]);
+		}
+	}
+
+	/* the rest of a datagram is gone, don't let it pass for whole */
+	if (msg.msg_flags & MSG_TRUNC) {
+		for (i = 0; i < num_recvfds; i++) {
+			if (recvfds[i] >= 0)
+				close(recvfds[i]);
+			recvfds[i] = -1;
+		}
+		errno = EMSGSIZE;
+		return -1;
 	}
 out:
 	return ret;
 }
 
-int lxc_abstract_unix_send_credential(int fd, void *data, size_t size)
+int lxc_abstract_unix_recv_fds(int fd, int *recvfds, int num_recvfds,
+			       void *data, size_t size)
 {
-	struct msghdr msg = { 0 };
 	struct iovec iov;
-	struct cmsghdr *cmsg;
-	struct ucred cred = {
-		.pid = getpid(),
-		.uid = getuid(),
-		.gid = getgid(),
-	};
-	char cmsgbuf[CMSG_SPACE(sizeof(cred))];
 	char buf[1];
 
-	msg.msg_control = cmsgbuf;
-	msg.msg_controllen = sizeof(cmsgbuf);
-
-	cmsg = CMSG_FIRSTHDR(&msg);
-	cmsg->cmsg_len = CMSG_LEN(sizeof(struct ucred));
-	cmsg->cmsg_level = SOL_SOCKET;
-	cmsg->cmsg_type = SCM_CREDENTIALS;
-	memcpy(CMSG_DATA(cmsg), &cred, sizeof(cred));
-
-	msg.msg_name = NULL;
-	msg.msg_namelen = 0;
+	if (num_recvfds < 1) {
+		errno = EINVAL;
+		return -1;
+	}
 
 	iov.iov_base = data ? data : buf;
 	iov.iov_len = data ? size : sizeof(buf);
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+	return lxc_abstract_unix_recv_fds_iov(fd, recvfds, num_recvfds, &iov, 1);
+}
 
-	return sendmsg(fd, &msg, MSG_NOSIGNAL);
+int lxc_abstract_unix_recv_fd(int fd, int *recvfd, void *data, size_t size)
+{
+	return lxc_abstract_unix_recv_fds(fd, recvfd, 1, data, size);
 }
 
-int lxc_abstract_unix_rcv_credential(int fd, void *data, size_t size)
+/*
+ * Whether the process at the other end of @fd may talk to us: root, or
+ * the same uid and gid as ours, when it connected.
+ *
+ * Returns 0 if so, -EACCES if not, < 0 with errno set on failure
+ */
+int lxc_abstract_unix_check_peer(int fd)
 {
-	struct msghdr msg = { 0 };
-	struct iovec iov;
-	struct cmsghdr *cmsg;
 	struct ucred cred;
-	char cmsgbuf[CMSG_SPACE(sizeof(cred))];
-	char buf[1];
-	int ret;
-
-	msg.msg_name = NULL;
-	msg.msg_namelen = 0;
-	msg.msg_control = cmsgbuf;
-	msg.msg_controllen = sizeof(cmsgbuf);
-
-	iov.iov_base = data ? data : buf;
-	iov.iov_len = data ? size : sizeof(buf);
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+	socklen_t len = sizeof(cred);
 
-	ret = recvmsg(fd, &msg, 0);
-	if (ret <= 0)
-		goto out;
-
-	cmsg = CMSG_FIRSTHDR(&msg);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+		return -1;
 
-	if (cmsg && cmsg->cmsg_len == CMSG_LEN(sizeof(struct ucred)) &&
-			cmsg->cmsg_level == SOL_SOCKET &&
-			cmsg->cmsg_type == SCM_CREDENTIALS) {
-		memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
-		if (cred.uid && (cred.uid != getuid() || cred.gid != getgid())) {
-			INFO("message denied for '%d/%d'", cred.uid, cred.gid);
-			return -EACCES;
-		}
+	if (cred.uid && (cred.uid != getuid() || cred.gid != getgid())) {
+		INFO("connection denied for '%d/%d'", cred.uid, cred.gid);
+		return -EACCES;
 	}
-out:
-	return ret;
+	return 0;
 }
@@ -24,12 +24,27 @@
 #ifndef __LXC_AF_UNIX_H
 #define __LXC_AF_UNIX_H
 
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* most fds passed along in a single message */
+#define LXC_UNIX_MAX_FDS 3
+
 extern int lxc_abstract_unix_open(const char *path, int type, int flags);
 extern int lxc_abstract_unix_close(int fd);
-extern int lxc_abstract_unix_connect(const char *path);
+extern int lxc_abstract_unix_connect(const char *path, int type);
 extern int lxc_abstract_unix_send_fd(int fd, int sendfd, void *data, size_t size);
 extern int lxc_abstract_unix_recv_fd(int fd, int *recvfd, void *data, size_t size);
-extern int lxc_abstract_unix_send_credential(int fd, void *data, size_t size);
-extern int lxc_abstract_unix_rcv_credential(int fd, void *data, size_t size);
+extern int lxc_abstract_unix_send_fds(int fd, int *sendfds, int num_sendfds,
+				      void *data, size_t size);
+/* all of @recvfds are set to -1 unless exactly @num_recvfds came along */
+extern int lxc_abstract_unix_recv_fds(int fd, int *recvfds, int num_recvfds,
+				      void *data, size_t size);
+extern int lxc_abstract_unix_send_fds_iov(int fd, int *sendfds, int num_sendfds,
+					  struct iovec *iov, size_t iovlen);
+/* a message which did not fit in @iov fails with EMSGSIZE */
+extern int lxc_abstract_unix_recv_fds_iov(int fd, int *recvfds, int num_recvfds,
+					  struct iovec *iov, size_t iovlen);
+extern int lxc_abstract_unix_check_peer(int fd);
 
 #endif
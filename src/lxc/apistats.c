@@ -0,0 +1,143 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "apistats.h"
+#include "lxccontainer.h"
+
+volatile bool lxc_stats_enabled;
+
+static struct lxc_api_stat stats[LXC_STAT_MAX];
+
+static const char *stat_names[LXC_STAT_MAX] = {
+#define X(name) [LXC_STAT_##name] = #name,
+	LXC_API_STATS_LIST(X)
+#undef X
+	[LXC_STAT_CMD] = "cmd",
+	[LXC_STAT_FORK] = "fork",
+	[LXC_STAT_MEM_LOCK] = "mem_lock",
+	[LXC_STAT_DISK_LOCK] = "disk_lock",
+};
+
+/* how many methods the thread is in, only the outermost one is counted */
+static __thread int api_depth;
+
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void count_fork(void)
+{
+	if (lxc_stats_enabled)
+		__sync_fetch_and_add(&stats[LXC_STAT_FORK].count, 1);
+}
+
+static void register_atfork(void)
+{
+	pthread_atfork(count_fork, NULL, NULL);
+}
+
+void lxc_stats_add(int id, uint64_t ns)
+{
+	struct lxc_api_stat *s = &stats[id];
+	uint64_t usec = ns / 1000, max;
+	int bucket = 0;
+
+	if (usec)
+		bucket = 64 - __builtin_clzll(usec);
+	if (bucket >= LXC_STATS_BUCKETS)
+		bucket = LXC_STATS_BUCKETS - 1;
+
+	__sync_fetch_and_add(&s->count, 1);
+	__sync_fetch_and_add(&s->total_ns, ns);
+	__sync_fetch_and_add(&s->buckets[bucket], 1);
+	max = s->max_ns;
+	while (ns > max && !__sync_bool_compare_and_swap(&s->max_ns, max, ns))
+		max = s->max_ns;
+}
+
+struct lxc_stats_timer lxc_stats_begin_slow(int id)
+{
+	struct lxc_stats_timer timer = { id, 0 };
+
+	if (id < LXC_STAT_API_MAX && api_depth++) {
+		/* nested, only keep track of the depth */
+		timer.id = LXC_STAT_MAX;
+		return timer;
+	}
+	timer.t0 = now_ns();
+	return timer;
+}
+
+void lxc_stats_end(struct lxc_stats_timer *timer)
+{
+	if (timer->id < 0)
+		return;
+	if (timer->id < LXC_STAT_API_MAX || timer->id == LXC_STAT_MAX)
+		api_depth--;
+	if (timer->id < LXC_STAT_MAX)
+		lxc_stats_add(timer->id, now_ns() - timer->t0);
+}
+
+bool lxc_stats_enable(bool enable)
+{
+	bool was = lxc_stats_enabled;
+
+	if (enable)
+		pthread_once(&atfork_once, register_atfork);
+	lxc_stats_enabled = enable;
+	return was;
+}
+
+void lxc_stats_reset(void)
+{
+	memset(stats, 0, sizeof(stats));
+}
+
+int lxc_get_stats(struct lxc_api_stat **ret)
+{
+	struct lxc_api_stat *s;
+	int i;
+
+	s = malloc(sizeof(stats));
+	if (!s)
+		return -1;
+	memcpy(s, stats, sizeof(stats));
+	for (i = 0; i < LXC_STAT_MAX; i++)
+		s[i].name = stat_names[i];
+	*ret = s;
+	return LXC_STAT_MAX;
+}
+
+__attribute__((constructor))
+static void lxc_stats_init(void)
+{
+	const char *v = getenv("LXC_STATS");
+
+	if (v && *v && strcmp(v, "0"))
+		lxc_stats_enable(true);
+}
@@ -0,0 +1,94 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef __LXC_APISTATS_H
+#define __LXC_APISTATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Per-process latency counters of the lxc_container methods and of a
+ * few internals, see lxc_get_stats().  They cost a load and a branch
+ * per call until lxc_stats_enable() is called, or if LXC_STATS is set
+ * in the environment.
+ */
+
+/* the lxc_container methods which are counted */
+#define LXC_API_STATS_LIST(X) \
+	X(is_defined) X(state) X(is_running) X(freeze) X(unfreeze) \
+	X(console) X(console_getfd) X(init_pid) X(load_config) \
+	X(want_daemonize) X(want_close_all_fds) X(start) X(startl) X(stop) \
+	X(config_file_name) X(wait) X(set_config_item) X(destroy) \
+	X(destroy_async) X(destroy_with_snapshots) X(rename) X(save_config) \
+	X(get_keys) X(create) X(createl) X(shutdown) X(reboot) \
+	X(clear_config) X(clear_config_item) X(get_config_item) \
+	X(get_running_config_item) X(get_cgroup_item) X(set_cgroup_item) \
+	X(get_config_path) X(set_config_path) X(clone) X(clone_many) \
+	X(get_interfaces) X(get_ips) X(attach) X(attach_run_wait) \
+	X(attach_run_waitl) X(attach_helper_run_wait) X(console_log) \
+	X(start_nowait) X(stop_nowait) X(snapshot) X(snapshot_list) \
+	X(snapshot_restore) X(snapshot_destroy) X(snapshot_destroy_all) \
+	X(may_control) X(add_device_node) X(remove_device_node) \
+	X(keep_cmd_connection) X(get_running_config_items) \
+	X(set_config_items) X(get_cgroup_items) X(get_net_stats) \
+	X(cache_state) X(add_device_nodes) X(remove_device_nodes) \
+	X(checkpoint) X(restore)
+
+enum lxc_stat_id {
+#define X(name) LXC_STAT_##name,
+	LXC_API_STATS_LIST(X)
+#undef X
+	LXC_STAT_API_MAX,
+	LXC_STAT_CMD = LXC_STAT_API_MAX,	/* lxc_cmd() round trips */
+	LXC_STAT_FORK,				/* fork()s, not timed */
+	LXC_STAT_MEM_LOCK,			/* wait in container_mem_lock() */
+	LXC_STAT_DISK_LOCK,			/* wait in container_disk_lock() */
+	LXC_STAT_MAX,
+};
+
+struct lxc_stats_timer {
+	int id;		/* -1 if not counted */
+	uint64_t t0;
+};
+
+extern volatile bool lxc_stats_enabled;
+
+extern struct lxc_stats_timer lxc_stats_begin_slow(int id);
+extern void lxc_stats_end(struct lxc_stats_timer *timer);
+extern void lxc_stats_add(int id, uint64_t ns);
+
+static inline struct lxc_stats_timer lxc_stats_begin(int id)
+{
+	struct lxc_stats_timer timer = { -1, 0 };
+
+	if (!lxc_stats_enabled)
+		return timer;
+	return lxc_stats_begin_slow(id);
+}
+
+/*
+ * Counts the rest of the enclosing block as a call to @id.  A method
+ * called from another one is only counted as part of the outer call.
+ */
+#define LXC_STATS_TIMER(id) \
+	struct lxc_stats_timer __lxc_stats_timer \
+		__attribute__((cleanup(lxc_stats_end))) = lxc_stats_begin(id)
+
+#define LXC_API_STATS(method) LXC_STATS_TIMER(LXC_STAT_##method)
+
+#endif
@@ -237,7 +237,8 @@ extern int lxc_arguments_parse(struct lxc_arguments *args,
 
 	/* Check the command options */
 
-	if (!args->name && strcmp(args->progname, "lxc-autostart") != 0) {
+	if (!args->name && strcmp(args->progname, "lxc-autostart") != 0 &&
+	    strcmp(args->progname, "lxc-top") != 0) {
 		lxc_error(args, "missing container name, use --name option");
 		return -1;
 	}
@@ -77,6 +77,7 @@ struct lxc_arguments {
 
 	/* for lxc-destroy */
 	int force;
+	int async;
 
 	/* close fds from parent? */
 	int close_all_fds;
@@ -87,12 +88,14 @@ struct lxc_arguments {
 	uint64_t fssize;
 	char *lvname, *vgname, *thinpool;
 	char *zfsroot, *lowerdir, *dir;
+	char *image;
 
 	/* auto-start */
 	int all;
 	int ignore_auto;
 	int list;
 	char *groups;
+	int jobs;
 
 	/* remaining arguments */
 	char *const *argv;
@@ -33,16 +33,20 @@
 #include <sys/prctl.h>
 #include <sys/mount.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/wait.h>
 #include <linux/unistd.h>
 #include <pwd.h>
+#include <signal.h>
 
 #if !HAVE_DECL_PR_CAPBSET_DROP
 #define PR_CAPBSET_DROP 24
 #endif
 
+#include "af_unix.h"
 #include "namespace.h"
+#include "start.h"
 #include "log.h"
 #include "attach.h"
 #include "caps.h"
@@ -135,25 +139,94 @@ static void lxc_proc_put_context_info(struct lxc_proc_context_info *ctx)
 	free(ctx);
 }
 
-static int lxc_attach_to_ns(pid_t pid, int which)
+struct lxc_attach_cache *lxc_attach_cache_new(void)
+{
+	struct lxc_attach_cache *cache;
+
+	cache = malloc(sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	cache->init_pid = -1;
+	cache->procfd = -1;
+	cache->clone_flags = -1;
+	cache->ctx = NULL;
+	return cache;
+}
+
+static void lxc_attach_cache_clear(struct lxc_attach_cache *cache)
+{
+	if (cache->procfd >= 0)
+		close(cache->procfd);
+	if (cache->ctx)
+		lxc_proc_put_context_info(cache->ctx);
+	cache->init_pid = -1;
+	cache->procfd = -1;
+	cache->clone_flags = -1;
+	cache->ctx = NULL;
+}
+
+void lxc_attach_cache_free(struct lxc_attach_cache *cache)
+{
+	if (!cache)
+		return;
+	lxc_attach_cache_clear(cache);
+	free(cache);
+}
+
+/*
+ * Make @cache that of the init @pid, dropping what it held unless it
+ * already was: like the namespace cache, a /proc/<pid> directory fd tells
+ * whether its process is still there even if the pid got reused.
+ */
+static void lxc_attach_cache_check(struct lxc_attach_cache *cache, pid_t pid)
+{
+	char path[MAXPATHLEN];
+	struct stat st;
+
+	if (cache->init_pid == pid && fstatat(cache->procfd, "ns", &st, 0) == 0)
+		return;
+
+	lxc_attach_cache_clear(cache);
+	snprintf(path, MAXPATHLEN, "/proc/%d", pid);
+	cache->procfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (cache->procfd >= 0)
+		cache->init_pid = pid;
+}
+
+/* free @ctx unless it belongs to @cache */
+static void attach_put_context_info(struct lxc_proc_context_info *ctx,
+				    struct lxc_attach_cache *cache)
+{
+	if (!cache || cache->ctx != ctx)
+		lxc_proc_put_context_info(ctx);
+}
+
+/*
+ * lxc_attach_to_ns: enter the namespaces of @pid selected by @which
+ *
+ * @nsfds, if not NULL, holds already opened fds of those namespaces,
+ * indexed by LXC_NS_*, which are used instead of opening /proc/@pid/ns.
+ */
+static int lxc_attach_to_ns(pid_t pid, int which, const int *nsfds)
 {
 	char path[MAXPATHLEN];
 	/* according to <http://article.gmane.org/gmane.linux.kernel.containers.lxc.devel/1429>,
 	 * the file for user namepsaces in /proc/$pid/ns will be called
 	 * 'user' once the kernel supports it
 	 */
-	static char *ns[] = { "user", "mnt", "pid", "uts", "ipc", "net" };
-	static int flags[] = {
-		CLONE_NEWUSER, CLONE_NEWNS, CLONE_NEWPID, CLONE_NEWUTS, CLONE_NEWIPC,
-		CLONE_NEWNET
+	/* the user namespace has to be entered first */
+	static const int order[] = {
+		LXC_NS_USER, LXC_NS_MNT, LXC_NS_PID, LXC_NS_UTS, LXC_NS_IPC,
+		LXC_NS_NET
 	};
-	static const int size = sizeof(ns) / sizeof(char *);
+	static const int size = sizeof(order) / sizeof(order[0]);
 	int fd[size];
 	int i, j, saved_errno;
 
 
 	snprintf(path, MAXPATHLEN, "/proc/%d/ns", pid);
-	if (access(path, X_OK)) {
+	if (!nsfds && access(path, X_OK)) {
 		ERROR("Does this kernel version support 'attach' ?");
 		return -1;
 	}
@@ -162,12 +235,17 @@ static int lxc_attach_to_ns(pid_t pid, int which)
 		/* ignore if we are not supposed to attach to that
 		 * namespace
 		 */
-		if (which != -1 && !(which & flags[i])) {
+		if (which != -1 && !(which & ns_info[order[i]].clone_flag)) {
 			fd[i] = -1;
 			continue;
 		}
 
-		snprintf(path, MAXPATHLEN, "/proc/%d/ns/%s", pid, ns[i]);
+		if (nsfds && nsfds[order[i]] >= 0) {
+			fd[i] = nsfds[order[i]];
+			continue;
+		}
+
+		snprintf(path, MAXPATHLEN, "/proc/%d/ns/%s", pid, ns_info[order[i]].proc_name);
 		fd[i] = open(path, O_RDONLY | O_CLOEXEC);
 		if (fd[i] < 0) {
 			saved_errno = errno;
@@ -176,7 +254,8 @@ static int lxc_attach_to_ns(pid_t pid, int which)
 			 * we return an error, so we don't leak them
 			 */
 			for (j = 0; j < i; j++)
-				close(fd[j]);
+				if (fd[j] >= 0)
+					close(fd[j]);
 
 			errno = saved_errno;
 			SYSERROR("failed to open '%s'", path);
@@ -189,14 +268,16 @@ static int lxc_attach_to_ns(pid_t pid, int which)
 			saved_errno = errno;
 
 			for (j = i; j < size; j++)
-				close(fd[j]);
+				if (fd[j] >= 0)
+					close(fd[j]);
 
 			errno = saved_errno;
-			SYSERROR("failed to set namespace '%s'", ns[i]);
+			SYSERROR("failed to set namespace '%s'", ns_info[order[i]].proc_name);
 			return -1;
 		}
 
-		close(fd[i]);
+		if (fd[i] >= 0)
+			close(fd[i]);
 	}
 
 	return 0;
@@ -597,12 +678,18 @@ static int attach_child_main(void* data);
 /* define default options if no options are supplied by the user */
 static lxc_attach_options_t attach_static_default_options = LXC_ATTACH_OPTIONS_DEFAULT;
 
+static bool attach_wants_seccomp(lxc_attach_options_t *options)
+{
+	return (options->namespaces & CLONE_NEWNS) &&
+	       (options->attach_flags & LXC_ATTACH_LSM);
+}
+
 static bool fetch_seccomp(const char *name, const char *lxcpath,
 		struct lxc_proc_context_info *i, lxc_attach_options_t *options)
 {
 	struct lxc_container *c;
 	
-	if (!(options->namespaces & CLONE_NEWNS) || !(options->attach_flags & LXC_ATTACH_LSM))
+	if (!attach_wants_seccomp(options))
 		return true;
 
 	c = lxc_container_new(name, lxcpath);
@@ -632,6 +719,19 @@ static signed long get_personality(const char *name, const char *lxcpath)
 }
 
 int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_function, void* exec_payload, lxc_attach_options_t* options, pid_t* attached_process)
+{
+	return lxc_attach_ns_fds(name, lxcpath, exec_function, exec_payload,
+				 options, attached_process, -1, NULL, NULL);
+}
+
+/*
+ * lxc_attach_ns_fds: like lxc_attach(), but @nsfds may hold fds of the
+ * namespaces of process @ns_pid, indexed by LXC_NS_*, which are used
+ * if @ns_pid still is the container's init.  The caller keeps ownership
+ * of @nsfds.  If @cache is not NULL, the context of the init is taken
+ * from it, or stored in it for the next attach.
+ */
+int lxc_attach_ns_fds(const char* name, const char* lxcpath, lxc_attach_exec_t exec_function, void* exec_payload, lxc_attach_options_t* options, pid_t* attached_process, pid_t ns_pid, const int *nsfds, struct lxc_attach_cache *cache)
 {
 	int ret, status;
 	pid_t init_pid, pid, attached_pid, expected;
@@ -649,22 +749,38 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 		ERROR("failed to get the init pid");
 		return -1;
 	}
+	if (init_pid != ns_pid)
+		nsfds = NULL;
 
-	init_ctx = lxc_proc_get_context_info(init_pid);
-	if (!init_ctx) {
-		ERROR("failed to get context of the init process, pid = %ld", (long)init_pid);
-		return -1;
+	if (cache) {
+		lxc_attach_cache_check(cache, init_pid);
+		if (cache->init_pid != init_pid)
+			cache = NULL;
 	}
 
-	personality = get_personality(name, lxcpath);
-	if (init_ctx->personality < 0) {
-		ERROR("Failed to get personality of the container");
-		lxc_proc_put_context_info(init_ctx);
-		return -1;
+	if (cache && cache->ctx) {
+		init_ctx = cache->ctx;
+	} else {
+		init_ctx = lxc_proc_get_context_info(init_pid);
+		if (!init_ctx) {
+			ERROR("failed to get context of the init process, pid = %ld", (long)init_pid);
+			return -1;
+		}
+
+		personality = get_personality(name, lxcpath);
+		if (init_ctx->personality < 0) {
+			ERROR("Failed to get personality of the container");
+			lxc_proc_put_context_info(init_ctx);
+			return -1;
+		}
+		init_ctx->personality = personality;
+
+		if (cache)
+			cache->ctx = init_ctx;
 	}
-	init_ctx->personality = personality;
 
-	if (!fetch_seccomp(name, lxcpath, init_ctx, options))
+	/* the policy is read once, by the first attach which needs it */
+	if (!init_ctx->container && !fetch_seccomp(name, lxcpath, init_ctx, options))
 		WARN("Failed to get seccomp policy");
 
 	cwd = getcwd(NULL, 0);
@@ -672,6 +788,8 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 	/* determine which namespaces the container was created with
 	 * by asking lxc-start, if necessary
 	 */
+	if (options->namespaces == -1 && cache && cache->clone_flags != -1)
+		options->namespaces = cache->clone_flags;
 	if (options->namespaces == -1) {
 		options->namespaces = lxc_cmd_get_clone_flags(name, lxcpath);
 		/* call failed */
@@ -679,9 +797,11 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 			ERROR("failed to automatically determine the "
 			      "namespaces which the container unshared");
 			free(cwd);
-			lxc_proc_put_context_info(init_ctx);
+			attach_put_context_info(init_ctx, cache);
 			return -1;
 		}
+		if (cache)
+			cache->clone_flags = options->namespaces;
 	}
 
 	/* create a socket pair for IPC communication; set SOCK_CLOEXEC in order
@@ -715,7 +835,7 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 	if (ret < 0) {
 		SYSERROR("could not set up required IPC mechanism for attaching");
 		free(cwd);
-		lxc_proc_put_context_info(init_ctx);
+		attach_put_context_info(init_ctx, cache);
 		return -1;
 	}
 
@@ -736,7 +856,7 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 	if (pid < 0) {
 		SYSERROR("failed to create first subprocess");
 		free(cwd);
-		lxc_proc_put_context_info(init_ctx);
+		attach_put_context_info(init_ctx, cache);
 		return -1;
 	}
 
@@ -807,7 +927,7 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 		/* now shut down communication with child, we're done */
 		shutdown(ipc_sockets[0], SHUT_RDWR);
 		close(ipc_sockets[0]);
-		lxc_proc_put_context_info(init_ctx);
+		attach_put_context_info(init_ctx, cache);
 
 		/* we're done, the child process should now execute whatever
 		 * it is that the user requested. The parent can now track it
@@ -825,7 +945,7 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 		close(ipc_sockets[0]);
 		if (to_cleanup_pid)
 			(void) wait_for_pid(to_cleanup_pid);
-		lxc_proc_put_context_info(init_ctx);
+		attach_put_context_info(init_ctx, cache);
 		return -1;
 	}
 
@@ -847,7 +967,7 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 	/* attach now, create another subprocess later, since pid namespaces
 	 * only really affect the children of the current process
 	 */
-	ret = lxc_attach_to_ns(init_pid, options->namespaces);
+	ret = lxc_attach_to_ns(init_pid, options->namespaces, nsfds);
 	if (ret < 0) {
 		ERROR("failed to enter the namespace");
 		shutdown(ipc_sockets[1], SHUT_RDWR);
@@ -1044,7 +1164,8 @@ static int attach_child_main(void* data)
 		}
 	}
 
-	if (init_ctx->container && init_ctx->container->lxc_conf &&
+	if (attach_wants_seccomp(options) &&
+			init_ctx->container && init_ctx->container->lxc_conf &&
 			lxc_seccomp_load(init_ctx->container->lxc_conf) != 0) {
 		ERROR("Loading seccomp policy");
 		rexit(-1);
@@ -1137,3 +1258,189 @@ int lxc_attach_run_shell(void* payload)
 	SYSERROR("failed to exec shell");
 	return -1;
 }
+
+/* request to the attach helper, followed by the @len bytes of @argc strings */
+struct attach_helper_req {
+	int argc;
+	int len;
+};
+
+/* the strings of a request may not take more than this */
+#define ATTACH_HELPER_MAX_ARGS (1024 * 1024)
+
+static int attach_helper_read(int fd, void *buf, size_t count)
+{
+	ssize_t ret;
+	size_t done = 0;
+
+	while (done < count) {
+		ret = lxc_read_nointr(fd, (char *)buf + done, count - done);
+		if (ret <= 0)
+			return -1;
+		done += ret;
+	}
+	return 0;
+}
+
+static int attach_helper_send(int fd, const void *buf, size_t count)
+{
+	ssize_t ret;
+	size_t done = 0;
+
+	while (done < count) {
+		ret = send(fd, (const char *)buf + done, count - done, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		done += ret;
+	}
+	return 0;
+}
+
+/* run the program of request @req, whose strings are in @buf, on @fds */
+static int attach_helper_exec(struct attach_helper_req *req, char *buf,
+			      int *fds)
+{
+	char **argv;
+	char *p = buf;
+	pid_t pid;
+	int i;
+
+	argv = malloc((req->argc + 1) * sizeof(*argv));
+	if (!argv)
+		return -1;
+	for (i = 0; i < req->argc; i++) {
+		argv[i] = p;
+		p += strlen(p) + 1;
+	}
+	argv[i] = NULL;
+
+	pid = fork();
+	if (pid < 0) {
+		free(argv);
+		return -1;
+	}
+
+	if (!pid) {
+		for (i = 0; i < 3; i++)
+			if (fds[i] != i)
+				dup2(fds[i], i);
+		for (i = 0; i < 3; i++)
+			if (fds[i] > 2)
+				close(fds[i]);
+		/* argv[0] is the program, the rest its argv */
+		execvp(argv[0], argv + 1);
+		SYSERROR("failed to exec '%s'", argv[0]);
+		_exit(127);
+	}
+
+	free(argv);
+	return lxc_wait_for_pid_status(pid);
+}
+
+/*
+ * lxc_attach_helper_main: main loop of the attach helper, as the exec
+ * function of an attach.  It runs the programs requested on its socket
+ * one after the other, and exits once the socket is closed.
+ */
+int lxc_attach_helper_main(void *payload)
+{
+	struct lxc_attach_helper_args *args = payload;
+	struct attach_helper_req req;
+	int fds[3], i, status;
+	char *buf;
+
+	close(args->peer);
+
+	for (;;) {
+		if (lxc_abstract_unix_recv_fds(args->sock, fds, 3, &req, sizeof(req)) != sizeof(req))
+			break;
+		if (fds[0] < 0 || req.argc < 2 || req.len <= 0 ||
+		    req.len > ATTACH_HELPER_MAX_ARGS)
+			break;
+
+		status = -1;
+		buf = malloc(req.len);
+		if (!buf || attach_helper_read(args->sock, buf, req.len) < 0) {
+			free(buf);
+			break;
+		}
+		/* the strings must all be there and terminated */
+		if (buf[req.len - 1] == '\0') {
+			int n = 0;
+
+			for (i = 0; i < req.len; i++)
+				if (buf[i] == '\0')
+					n++;
+			if (n == req.argc)
+				status = attach_helper_exec(&req, buf, fds);
+		}
+		free(buf);
+		for (i = 0; i < 3; i++)
+			close(fds[i]);
+
+		if (lxc_write_nointr(args->sock, &status, sizeof(status)) != sizeof(status))
+			break;
+	}
+
+	close(args->sock);
+	return 0;
+}
+
+/*
+ * lxc_attach_helper_run: run @program with @argv through @helper, with
+ * @stdfds as its stdin, stdout and stderr
+ *
+ * Returns the wait status of the program, -ENOTCONN if it could not be
+ * handed over to the helper, or another negative errno if the helper
+ * failed to answer.
+ */
+int lxc_attach_helper_run(struct lxc_attach_helper *helper,
+			  const char *program, const char * const argv[],
+			  const int *stdfds)
+{
+	struct attach_helper_req req;
+	int fds[3], i, status;
+	size_t len;
+	char *buf, *p;
+
+	len = strlen(program) + 1;
+	for (i = 0; argv[i]; i++)
+		len += strlen(argv[i]) + 1;
+	if (!argv[0] || len > ATTACH_HELPER_MAX_ARGS)
+		return -E2BIG;
+
+	buf = malloc(len);
+	if (!buf)
+		return -ENOMEM;
+	p = stpcpy(buf, program) + 1;
+	for (i = 0; argv[i]; i++)
+		p = stpcpy(p, argv[i]) + 1;
+	req.argc = i + 1;
+	req.len = len;
+
+	for (i = 0; i < 3; i++)
+		fds[i] = stdfds && stdfds[i] >= 0 ? stdfds[i] : i;
+
+	if (lxc_abstract_unix_send_fds(helper->sock, fds, 3, &req, sizeof(req)) != sizeof(req) ||
+	    attach_helper_send(helper->sock, buf, len) < 0) {
+		free(buf);
+		return -ENOTCONN;
+	}
+	free(buf);
+
+	if (attach_helper_read(helper->sock, &status, sizeof(status)) < 0)
+		return -EPIPE;
+	if (status < 0)
+		return -ECHILD;
+	return status;
+}
+
+void lxc_attach_helper_stop(struct lxc_attach_helper *helper)
+{
+	close(helper->sock);
+	/* it may be waiting for a program, which is left running */
+	kill(helper->pid, SIGKILL);
+	(void) wait_for_pid(helper->pid);
+}
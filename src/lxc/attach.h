@@ -24,6 +24,7 @@
 #ifndef __LXC_ATTACH_H
 #define __LXC_ATTACH_H
 
+#include <stdbool.h>
 #include <sys/types.h>
 #include <lxc/attach_options.h>
 
@@ -36,6 +37,45 @@ struct lxc_proc_context_info {
 	unsigned long long capability_mask;
 };
 
+/*
+ * Context of a container's init kept across attaches: its capabilities,
+ * lsm label and personality, the namespaces it was cloned with and the
+ * container's seccomp policy.  It is dropped when the init changes.
+ */
+struct lxc_attach_cache {
+	pid_t init_pid;
+	int procfd; /* /proc/<init_pid>, to notice the init going away */
+	int clone_flags;
+	struct lxc_proc_context_info *ctx;
+};
+
+extern struct lxc_attach_cache *lxc_attach_cache_new(void);
+extern void lxc_attach_cache_free(struct lxc_attach_cache *cache);
+
+/*
+ * A process attached to a container once, which then runs programs in
+ * the container for us: it gets their argv and stdio fds over @sock and
+ * answers with their wait status.
+ */
+struct lxc_attach_helper {
+	pid_t pid; /* the helper, a child of ours */
+	pid_t init_pid; /* init of the container when it was attached */
+	int sock;
+};
+
+/* lxc_attach_helper_main() runs the helper, @payload points to this */
+struct lxc_attach_helper_args {
+	int sock; /* helper's end of the socket pair */
+	int peer; /* our end, which the helper closes */
+};
+
+extern int lxc_attach_helper_main(void *payload);
+extern int lxc_attach_helper_run(struct lxc_attach_helper *helper,
+				 const char *program, const char * const argv[],
+				 const int *stdfds);
+extern void lxc_attach_helper_stop(struct lxc_attach_helper *helper);
+
 extern int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_function, void* exec_payload, lxc_attach_options_t* options, pid_t* attached_process);
+extern int lxc_attach_ns_fds(const char* name, const char* lxcpath, lxc_attach_exec_t exec_function, void* exec_payload, lxc_attach_options_t* options, pid_t* attached_process, pid_t ns_pid, const int *nsfds, struct lxc_attach_cache *cache);
 
 #endif
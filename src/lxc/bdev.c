@@ -37,11 +37,25 @@
 #include <errno.h>
 #include <sched.h>
 #include <sys/mount.h>
+#include <sys/file.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <libgen.h>
 #include <linux/loop.h>
+#include <linux/dm-ioctl.h>
 #include <dirent.h>
 #include <sys/prctl.h>
+#include <sys/vfs.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <time.h>
+#include <linux/netlink.h>
+
+#ifdef HAVE_LIBZFS_CORE
+#include <pthread.h>
+#include <libzfs_core.h>
+#include <libnvpair.h>
+#endif
 
 #include "lxc.h"
 #include "config.h"
@@ -53,6 +67,7 @@
 #include "namespace.h"
 #include "parse.h"
 #include "lxclock.h"
+#include "copytree.h"
 
 #ifndef BLKGETSIZE64
 #define BLKGETSIZE64 _IOR(0x12,114,size_t)
@@ -70,33 +85,9 @@ lxc_log_define(bdev, lxc);
 struct rsync_data_char {
 	char *src;
 	char *dest;
+	struct lxc_conf *conf;
 };
 
-static int do_rsync(const char *src, const char *dest)
-{
-	// call out to rsync
-	pid_t pid;
-	char *s;
-	size_t l;
-
-	pid = fork();
-	if (pid < 0)
-		return -1;
-	if (pid > 0)
-		return wait_for_pid(pid);
-
-	l = strlen(src) + 2;
-	s = malloc(l);
-	if (!s)
-		exit(1);
-	strcpy(s, src);
-	s[l-2] = '/';
-	s[l-1] = '\0';
-
-	execlp("rsync", "rsync", "-a", s, dest, (char *)NULL);
-	exit(1);
-}
-
 /*
  * return block size of dev->src in units of bytes
  */
@@ -179,6 +170,17 @@ static int mount_unknown_fs(const char *rootfs, const char *target,
 		.options = options,
 	};
 
+	const char *probed;
+	char fstype[16];
+
+	/* most of the time the superblock tells, and one mount does */
+	probed = lxc_probe_fstype(rootfs);
+	if (probed) {
+		strcpy(fstype, probed);
+		if (find_fstype_cb(fstype, &cbarg) == 1)
+			return 0;
+	}
+
 	/*
 	 * find the filesystem type with brute force:
 	 * first we check with /etc/filesystems, in case the modules
@@ -210,7 +212,8 @@ static int mount_unknown_fs(const char *rootfs, const char *target,
 	return -1;
 }
 
-static int do_mkfs(const char *path, const char *fstype)
+static int run_mkfs(const char *path, const char *fstype, const char *opt1,
+		const char *opt2)
 {
 	pid_t pid;
 
@@ -221,6 +224,8 @@ static int do_mkfs(const char *path, const char *fstype)
 	if (pid > 0)
 		return wait_for_pid(pid);
 
+	lxc_io_throttle();
+
 	// If the file is not a block device, we don't want mkfs to ask
 	// us about whether to proceed.
 	close(0);
@@ -229,10 +234,41 @@ static int do_mkfs(const char *path, const char *fstype)
 	open("/dev/zero", O_RDONLY);
 	open("/dev/null", O_RDWR);
 	open("/dev/null", O_RDWR);
-	execlp("mkfs", "mkfs", "-t", fstype, path, NULL);
+	if (opt2)
+		execlp("mkfs", "mkfs", "-t", fstype, opt1, opt2, path, NULL);
+	else if (opt1)
+		execlp("mkfs", "mkfs", "-t", fstype, opt1, path, NULL);
+	else
+		execlp("mkfs", "mkfs", "-t", fstype, path, NULL);
 	exit(1);
 }
 
+static int do_mkfs(const char *path, const char *fstype)
+{
+	return run_mkfs(path, fstype, NULL, NULL);
+}
+
+/*
+ * mkfs for a freshly created image file: nothing in it needs discarding,
+ * and ext* can initialize inode tables and journal lazily.  Falls back
+ * to the defaults for a mkfs which doesn't know the options.
+ */
+static int do_mkfs_fast(const char *path, const char *fstype)
+{
+	const char *opt1 = NULL, *opt2 = NULL;
+
+	if (strncmp(fstype, "ext", 3) == 0) {
+		opt1 = "-E";
+		opt2 = "lazy_itable_init=1,lazy_journal_init=1,nodiscard";
+	} else if (strcmp(fstype, "xfs") == 0 || strcmp(fstype, "btrfs") == 0) {
+		opt1 = "-K";
+	}
+
+	if (opt1 && run_mkfs(path, fstype, opt1, opt2) == 0)
+		return 0;
+	return do_mkfs(path, fstype);
+}
+
 static char *linkderef(char *path, char *dest)
 {
 	struct stat sbuf;
@@ -271,6 +307,7 @@ static int detect_fs(struct bdev *bdev, char *type, int len)
 	FILE *f;
 	char *sp1, *sp2, *sp3, *line = NULL;
 	char *srcdev;
+	const char *probed;
 
 	if (!bdev || !bdev->src || !bdev->dest)
 		return -1;
@@ -279,6 +316,14 @@ static int detect_fs(struct bdev *bdev, char *type, int len)
 	if (strcmp(bdev->type, "loop") == 0)
 		srcdev = bdev->src + 5;
 
+	probed = lxc_probe_fstype(srcdev);
+	if (probed) {
+		memset(type, 0, len);
+		strncpy(type, probed, len - 1);
+		INFO("detected fstype %s for %s", type, srcdev);
+		return strlen(type);
+	}
+
 	ret = pipe(p);
 	if (ret < 0)
 		return -1;
@@ -512,6 +557,91 @@ static int dir_create(struct bdev *bdev, const char *dest, const char *n,
 	return 0;
 }
 
+/*
+ * Put @staged in place of @path, which is moved to "@path.old" and
+ * returned in *@old.  Should the second rename fail, @path is put back.
+ */
+static int restore_swap(const char *path, const char *staged, char **old)
+{
+	char *o;
+
+	if (asprintf(&o, "%s.old", path) < 0)
+		return -1;
+	if (rename(path, o) < 0) {
+		SYSERROR("Failed to move %s to %s", path, o);
+		free(o);
+		return -1;
+	}
+	if (rename(staged, path) < 0) {
+		SYSERROR("Failed to move %s to %s", staged, path);
+		if (rename(o, path) < 0)
+			SYSERROR("Failed to move %s back to %s", o, path);
+		free(o);
+		return -1;
+	}
+	*old = o;
+	return 0;
+}
+
+static int copy_tree_wrapper(void *data)
+{
+	struct rsync_data_char *arg = data;
+
+	return lxc_copy_tree(arg->src, arg->dest);
+}
+
+/*
+ * Restore the tree @path from @src, reflinking the files where the
+ * filesystem can.  The copy is made beside @path, which is only
+ * replaced once it is complete.
+ */
+static int restore_tree(const char *path, const char *src, char **old)
+{
+	struct rsync_data_char data;
+	struct stat st;
+	char *staged;
+	int ret = -1;
+
+	if (stat(path, &st) < 0) {
+		SYSERROR("Failed to stat %s", path);
+		return -1;
+	}
+	if (asprintf(&staged, "%s.restore", path) < 0)
+		return -1;
+	/* left by a restore which was interrupted */
+	if (dir_exists(staged) && lxc_rmdir_onedev(staged, NULL) < 0) {
+		ERROR("Failed to remove %s", staged);
+		goto out;
+	}
+	if (mkdir(staged, st.st_mode & 07777) < 0 ||
+	    chown(staged, st.st_uid, st.st_gid) < 0) {
+		SYSERROR("Failed to create %s", staged);
+		goto out;
+	}
+
+	data.src = (char *)src;
+	data.dest = staged;
+	if (lxc_io_throttled(copy_tree_wrapper, &data) < 0) {
+		ERROR("Failed to copy %s to %s", src, staged);
+		lxc_rmdir_onedev(staged, NULL);
+		goto out;
+	}
+	if (restore_swap(path, staged, old) < 0) {
+		lxc_rmdir_onedev(staged, NULL);
+		goto out;
+	}
+	ret = 0;
+
+out:
+	free(staged);
+	return ret;
+}
+
+static int dir_restore(struct bdev *bdev, struct bdev *snap, char **old)
+{
+	return restore_tree(bdev->src, snap->src, old);
+}
+
 static const struct bdev_ops dir_ops = {
 	.detect = &dir_detect,
 	.mount = &dir_mount,
@@ -519,6 +649,7 @@ static const struct bdev_ops dir_ops = {
 	.clone_paths = &dir_clonepaths,
 	.destroy = &dir_destroy,
 	.create = &dir_create,
+	.restore = &dir_restore,
 	.can_snapshot = false,
 };
 
@@ -534,11 +665,65 @@ static const struct bdev_ops dir_ops = {
 // sake of flexibility let's always bind-mount.
 //
 
+#define ZFS_SUPER_MAGIC 0x2fc12fc1
+
+/*
+ * Find the dataset mounted on @path in our mountinfo, which is far
+ * cheaper than having zfs list every dataset on the host.
+ */
+static bool zfs_mounted_dataset(const char *path, char *dataset, size_t len)
+{
+	char *line = NULL, *mnt, *fstype, *src, *saveptr;
+	size_t sz = 0;
+	bool found = false;
+	FILE *f;
+	int i;
+
+	f = fopen("/proc/self/mountinfo", "r");
+	if (!f)
+		return false;
+	while (!found && getline(&line, &sz, f) != -1) {
+		/* id parent maj:min root mountpoint opts [tags] - type src */
+		mnt = NULL;
+		strtok_r(line, " ", &saveptr);
+		for (i = 0; i < 4; i++)
+			mnt = strtok_r(NULL, " ", &saveptr);
+		if (!mnt || strcmp(mnt, path) != 0)
+			continue;
+		while ((fstype = strtok_r(NULL, " ", &saveptr)) &&
+		       strcmp(fstype, "-") != 0)
+			;
+		fstype = strtok_r(NULL, " ", &saveptr);
+		src = strtok_r(NULL, " ", &saveptr);
+		if (!fstype || !src || strcmp(fstype, "zfs") != 0)
+			continue;
+		/* same layout as a line of zfs list: the dataset comes first */
+		if (snprintf(dataset, len, "%s %s", src, path) < len)
+			found = true;
+	}
+	free(line);
+	fclose(f);
+	return found;
+}
+
 static int zfs_list_entry(const char *path, char *output, size_t inlen)
 {
 	struct lxc_popen_FILE *f;
+	struct statfs sf;
 	int found=0;
 
+	if (zfs_mounted_dataset(path, output, inlen))
+		return 1;
+
+	/*
+	 * No need to ask zfs when there can't be any datasets, or when
+	 * path is on some other filesystem.
+	 */
+	if (access("/sys/module/zfs", F_OK) < 0)
+		return 0;
+	if (statfs(path, &sf) == 0 && sf.f_type != ZFS_SUPER_MAGIC)
+		return 0;
+
 	f = lxc_popen("zfs list 2> /dev/null");
 	if (f == NULL) {
 		SYSERROR("popen failed");
@@ -599,6 +784,81 @@ static int zfs_umount(struct bdev *bdev)
 	return umount(bdev->dest);
 }
 
+#ifdef HAVE_LIBZFS_CORE
+static pthread_once_t lzc_once = PTHREAD_ONCE_INIT;
+static int lzc_ret = -1;
+
+static void zfs_lzc_init(void)
+{
+	lzc_ret = libzfs_core_init();
+	if (lzc_ret != 0)
+		INFO("libzfs_core unavailable (%s), using the zfs command",
+			strerror(lzc_ret));
+}
+
+/*
+ * Snapshot @snap and clone it into @fs mounted on @mountpoint through
+ * libzfs_core, without running zfs three times.  Returns -ENOSYS if the
+ * library can't be used.
+ */
+static int zfs_lzc_snapshot_clone(const char *snap, const char *fs,
+		const char *mountpoint)
+{
+	nvlist_t *snaps, *props, *errlist = NULL;
+	int ret;
+
+	pthread_once(&lzc_once, zfs_lzc_init);
+	if (lzc_ret != 0)
+		return -ENOSYS;
+
+	snaps = fnvlist_alloc();
+	fnvlist_add_boolean(snaps, snap);
+
+	// if the snapshot exists, delete it
+	if (lzc_exists(snap)) {
+		ret = lzc_destroy_snaps(snaps, B_FALSE, &errlist);
+		if (errlist)
+			fnvlist_free(errlist);
+		errlist = NULL;
+		if (ret != 0) {
+			ERROR("Error destroying old snapshot %s: %s", snap,
+				strerror(ret));
+			fnvlist_free(snaps);
+			return -1;
+		}
+	}
+
+	ret = lzc_snapshot(snaps, NULL, &errlist);
+	if (errlist)
+		fnvlist_free(errlist);
+	fnvlist_free(snaps);
+	if (ret != 0) {
+		ERROR("Error creating snapshot %s: %s", snap, strerror(ret));
+		return -1;
+	}
+
+	props = fnvlist_alloc();
+	fnvlist_add_string(props, "mountpoint", mountpoint);
+	ret = lzc_clone(fs, snap, props);
+	fnvlist_free(props);
+	if (ret != 0) {
+		ERROR("Error cloning %s to %s: %s", snap, fs, strerror(ret));
+		return -1;
+	}
+
+	/* unlike zfs clone, the library leaves mounting it to us */
+	if (mkdir(mountpoint, 0755) < 0 && errno != EEXIST) {
+		SYSERROR("Error creating %s", mountpoint);
+		return -1;
+	}
+	if (mount(fs, mountpoint, "zfs", 0, "zfsutil") < 0) {
+		SYSERROR("Error mounting %s on %s", fs, mountpoint);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
 static int zfs_clone(const char *opath, const char *npath, const char *oname,
 			const char *nname, const char *lxcpath, int snapshot)
 {
@@ -650,6 +910,12 @@ static int zfs_clone(const char *opath, const char *npath, const char *oname,
 			return -1;
 		(void) snprintf(path2, MAXPATHLEN, "%s/%s", zfsroot, nname);
 
+#ifdef HAVE_LIBZFS_CORE
+		ret = zfs_lzc_snapshot_clone(path1, path2, option + 13);
+		if (ret != -ENOSYS)
+			return ret;
+#endif
+
 		// if the snapshot exists, delete it
 		if ((pid = fork()) < 0)
 			return -1;
@@ -738,6 +1004,80 @@ static int zfs_destroy(struct bdev *orig)
 	exit(1);
 }
 
+static int zfs_run(const char *op, const char *arg1, const char *arg2)
+{
+	pid_t pid;
+
+	if ((pid = fork()) < 0)
+		return -1;
+	if (pid)
+		return wait_for_pid(pid);
+	execlp("zfs", "zfs", op, arg1, arg2, NULL);
+	exit(1);
+}
+
+/*
+ * The dataset is <zfsroot>/<name>, mounted on <lxcpath>/<name>/rootfs,
+ * which moved along with the directory but still is its mountpoint.
+ */
+static int zfs_rename(struct bdev *bdev, const char *oldname,
+		const char *newname, const char *lxcpath)
+{
+	char output[MAXPATHLEN], dataset[MAXPATHLEN], option[MAXPATHLEN];
+	char path[MAXPATHLEN], *p, *src;
+	int ret;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/%s/rootfs", lxcpath, oldname);
+	if (ret < 0 || ret >= MAXPATHLEN || strcmp(bdev->src, path))
+		return 0;
+	if (!zfs_list_entry(bdev->src, output, MAXPATHLEN)) {
+		ERROR("zfs entry for %s not found", bdev->src);
+		return -1;
+	}
+	if ((p = index(output, ' ')) == NULL)
+		return -1;
+	*p = '\0';
+
+	ret = snprintf(path, MAXPATHLEN, "%s/%s/rootfs", lxcpath, newname);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	if (!(src = strdup(path)))
+		return -1;
+	ret = snprintf(option, MAXPATHLEN, "mountpoint=%s", path);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		goto err;
+
+	p = strrchr(output, '/');
+	if (p && strcmp(p + 1, oldname) == 0) {
+		ret = snprintf(dataset, MAXPATHLEN, "%.*s/%s",
+			       (int)(p - output), output, newname);
+		if (ret < 0 || ret >= MAXPATHLEN)
+			goto err;
+		if (zfs_run("rename", output, dataset) < 0) {
+			ERROR("Error renaming zfs dataset %s to %s", output,
+				dataset);
+			goto err;
+		}
+	} else {
+		strcpy(dataset, output);
+	}
+	if (zfs_run("set", option, dataset) < 0) {
+		ERROR("Error setting the mountpoint of %s to %s", dataset, path);
+		if (strcmp(dataset, output) &&
+		    zfs_run("rename", dataset, output) < 0)
+			ERROR("Error renaming %s back to %s", dataset, output);
+		goto err;
+	}
+
+	free(bdev->src);
+	bdev->src = src;
+	return 0;
+
+err:
+	free(src);
+	return -1;
+}
+
 static int zfs_create(struct bdev *bdev, const char *dest, const char *n,
 			struct bdev_specs *specs)
 {
@@ -783,6 +1123,7 @@ static const struct bdev_ops zfs_ops = {
 	.clone_paths = &zfs_clonepaths,
 	.destroy = &zfs_destroy,
 	.create = &zfs_create,
+	.rename = &zfs_rename,
 	.can_snapshot = true,
 };
 
@@ -884,13 +1225,88 @@ static int lvm_compare_lv_attr(const char *path, int pos, const char expected) {
 	return 0;
 }
 
+/*
+ * Ask device-mapper which target the active table of the block device
+ * @path starts with, e.g. "thin", the way dmsetup table would.  Returns 1
+ * and fills in @type if there is such a device, 0 if there isn't, which
+ * includes LVs which aren't active.
+ */
+static int dm_target_type(const char *path, char *type, size_t len)
+{
+	union {
+		struct dm_ioctl io;
+		char buf[sizeof(struct dm_ioctl) + 16384];
+	} u;
+	struct dm_target_spec *spec;
+	struct stat st;
+	int fd, ret;
+
+	if (stat(path, &st) < 0 || !S_ISBLK(st.st_mode))
+		return 0;
+
+	fd = open("/dev/mapper/control", O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	memset(&u.io, 0, sizeof(u.io));
+	u.io.version[0] = DM_VERSION_MAJOR;
+	u.io.data_size = sizeof(u);
+	u.io.data_start = sizeof(u.io);
+	u.io.flags = DM_STATUS_TABLE_FLAG;
+	u.io.dev = st.st_rdev;
+	ret = ioctl(fd, DM_TABLE_STATUS, &u.io);
+	close(fd);
+	if (ret < 0 || u.io.target_count < 1)
+		return 0;
+
+	spec = (struct dm_target_spec *)(u.buf + u.io.data_start);
+	snprintf(type, len, "%.*s", (int)sizeof(spec->target_type),
+		spec->target_type);
+	return 1;
+}
+
 static int lvm_is_thin_volume(const char *path)
 {
+	char type[DM_MAX_TYPE_NAME];
+
+	/* an active LV tells without running lvs */
+	if (dm_target_type(path, type, sizeof(type)))
+		return strcmp(type, "thin") == 0;
 	return lvm_compare_lv_attr(path, 6, 't');
 }
 
+/* append @name to @p doubling dashes, as device-mapper names LVs */
+static char *dm_name_escape(char *p, const char *name)
+{
+	for (; *name; name++) {
+		*p++ = *name;
+		if (*name == '-')
+			*p++ = '-';
+	}
+	return p;
+}
+
 static int lvm_is_thin_pool(const char *path)
 {
+	char type[DM_MAX_TYPE_NAME], *dmpath, *p, *vg, *lv;
+
+	/* /dev/$vg/$pool is active as /dev/mapper/$vg-$pool-tpool */
+	vg = alloca(strlen(path) + 1);
+	strcpy(vg, path);
+	lv = strrchr(vg, '/');
+	if (lv && lv != vg) {
+		*lv++ = '\0';
+		if ((p = strrchr(vg, '/')))
+			vg = p + 1;
+		dmpath = alloca(strlen("/dev/mapper/") + 2 * strlen(vg) +
+				2 * strlen(lv) + strlen("--tpool") + 1);
+		p = stpcpy(dmpath, "/dev/mapper/");
+		p = dm_name_escape(p, vg);
+		*p++ = '-';
+		p = dm_name_escape(p, lv);
+		strcpy(p, "-tpool");
+		if (dm_target_type(dmpath, type, sizeof(type)))
+			return strcmp(type, "thin-pool") == 0;
+	}
 	return lvm_compare_lv_attr(path, 0, 't');
 }
 
@@ -1111,6 +1527,46 @@ static int lvm_destroy(struct bdev *orig)
 	return wait_for_pid(pid);
 }
 
+/* an lv named after the container, /dev/$vg/$name, takes the new name */
+static int lvm_rename(struct bdev *bdev, const char *oldname,
+		const char *newname, const char *lxcpath)
+{
+	const char *lv = bdev->src;
+	char *src, *p;
+	size_t len;
+	pid_t pid;
+
+	if (strncmp(lv, "lvm:", 4) == 0)
+		lv += 4;
+	p = strrchr(lv, '/');
+	if (!p || strcmp(p + 1, oldname))
+		return 0;
+
+	len = p + 1 - bdev->src;
+	src = malloc(len + strlen(newname) + 1);
+	if (!src)
+		return -1;
+	memcpy(src, bdev->src, len);
+	strcpy(src + len, newname);
+
+	if ((pid = fork()) < 0) {
+		free(src);
+		return -1;
+	}
+	if (!pid) {
+		execlp("lvrename", "lvrename", lv, src + (lv - bdev->src), NULL);
+		exit(1);
+	}
+	if (wait_for_pid(pid) < 0) {
+		ERROR("Error renaming %s to %s", lv, newname);
+		free(src);
+		return -1;
+	}
+	free(bdev->src);
+	bdev->src = src;
+	return 0;
+}
+
 static int lvm_create(struct bdev *bdev, const char *dest, const char *n,
 			struct bdev_specs *specs)
 {
@@ -1178,6 +1634,7 @@ static const struct bdev_ops lvm_ops = {
 	.clone_paths = &lvm_clonepaths,
 	.destroy = &lvm_destroy,
 	.create = &lvm_create,
+	.rename = &lvm_rename,
 	.can_snapshot = true,
 };
 
@@ -1439,37 +1896,214 @@ out:
 	return ret;
 }
 
-static int btrfs_snapshot_wrapper(void *data)
-{
-	struct rsync_data_char *arg = data;
-	if (setgid(0) < 0) {
-		ERROR("Failed to setgid to 0");
-		return -1;
-	}
-	if (setgroups(0, NULL) < 0)
-		WARN("Failed to clear groups");
-	if (setuid(0) < 0) {
-		ERROR("Failed to setuid to 0");
-		return -1;
-	}
-	return btrfs_snapshot(arg->src, arg->dest);
-}
+#define BTRFS_ROOT_TREE_OBJECTID 1ULL
+#define BTRFS_FIRST_FREE_OBJECTID 256ULL
+#define BTRFS_ROOT_REF_KEY 156
+
+struct btrfs_ioctl_search_key {
+	unsigned long long tree_id;
+	unsigned long long min_objectid;
+	unsigned long long max_objectid;
+	unsigned long long min_offset;
+	unsigned long long max_offset;
+	unsigned long long min_transid;
+	unsigned long long max_transid;
+	unsigned int min_type;
+	unsigned int max_type;
+	unsigned int nr_items;
+	unsigned int unused;
+	unsigned long long unused1;
+	unsigned long long unused2;
+	unsigned long long unused3;
+	unsigned long long unused4;
+};
 
-static int btrfs_clonepaths(struct bdev *orig, struct bdev *new, const char *oldname,
-		const char *cname, const char *oldpath, const char *lxcpath, int snap,
-		uint64_t newsize, struct lxc_conf *conf)
+struct btrfs_ioctl_search_header {
+	unsigned long long transid;
+	unsigned long long objectid;
+	unsigned long long offset;
+	unsigned int type;
+	unsigned int len;
+};
+
+#define BTRFS_SEARCH_ARGS_BUFSIZE (4096 - sizeof(struct btrfs_ioctl_search_key))
+struct btrfs_ioctl_search_args {
+	struct btrfs_ioctl_search_key key;
+	char buf[BTRFS_SEARCH_ARGS_BUFSIZE];
+};
+
+#define BTRFS_INO_LOOKUP_PATH_MAX 4080
+struct btrfs_ioctl_ino_lookup_args {
+	unsigned long long treeid;
+	unsigned long long objectid;
+	char name[BTRFS_INO_LOOKUP_PATH_MAX];
+};
+
+struct btrfs_root_ref {
+	unsigned long long dirid;
+	unsigned long long sequence;
+	unsigned short name_len;
+} __attribute__ ((__packed__));
+
+#define BTRFS_IOC_TREE_SEARCH _IOWR(BTRFS_IOCTL_MAGIC, 17, \
+		struct btrfs_ioctl_search_args)
+#define BTRFS_IOC_INO_LOOKUP _IOWR(BTRFS_IOCTL_MAGIC, 18, \
+		struct btrfs_ioctl_ino_lookup_args)
+
+/*
+ * Paths relative to the subvolume at @path of the subvolumes nested right
+ * below it, found in the root tree rather than by walking the whole
+ * directory tree.  Returns NULL if they can't be looked up, the tree
+ * search takes CAP_SYS_ADMIN.
+ */
+static char **btrfs_nested_subvolumes(const char *path)
 {
-	if (!orig->dest || !orig->src)
-		return -1;
+	struct btrfs_ioctl_search_args args;
+	struct btrfs_ioctl_search_header sh;
+	struct btrfs_ioctl_ino_lookup_args ino;
+	struct btrfs_root_ref ref;
+	unsigned long long root;
+	char **list = NULL, *child;
+	size_t n = 0, cap = 0, off;
+	unsigned int i;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
 
-	if (strcmp(orig->type, "btrfs")) {
-		int len, ret;
-		if (snap) {
-			ERROR("btrfs snapshot from %s backing store is not supported",
-				orig->type);
-			return -1;
-		}
-		len = strlen(lxcpath) + strlen(cname) + strlen("rootfs") + 3;
+	/* the id of the subvolume itself */
+	memset(&ino, 0, sizeof(ino));
+	ino.objectid = BTRFS_FIRST_FREE_OBJECTID;
+	if (ioctl(fd, BTRFS_IOC_INO_LOOKUP, &ino) < 0)
+		goto err;
+	root = ino.treeid;
+
+	if (lxc_grow_array((void ***)&list, &cap, 1, 8) < 0)
+		goto err;
+
+	memset(&args, 0, sizeof(args));
+	args.key.tree_id = BTRFS_ROOT_TREE_OBJECTID;
+	args.key.min_objectid = args.key.max_objectid = root;
+	args.key.min_type = args.key.max_type = BTRFS_ROOT_REF_KEY;
+	args.key.max_offset = (unsigned long long)-1;
+	args.key.max_transid = (unsigned long long)-1;
+
+	for (;;) {
+		args.key.nr_items = 4096;
+		if (ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args) < 0)
+			goto err;
+		if (args.key.nr_items == 0)
+			break;
+
+		for (i = 0, off = 0; i < args.key.nr_items; i++) {
+			memcpy(&sh, args.buf + off, sizeof(sh));
+			off += sizeof(sh);
+			if (sh.type == BTRFS_ROOT_REF_KEY && sh.objectid == root) {
+				memcpy(&ref, args.buf + off, sizeof(ref));
+
+				/* where in this subvolume the child's directory is */
+				memset(&ino, 0, sizeof(ino));
+				ino.treeid = root;
+				ino.objectid = ref.dirid;
+				if (ioctl(fd, BTRFS_IOC_INO_LOOKUP, &ino) < 0)
+					goto err;
+
+				child = malloc(strlen(ino.name) + ref.name_len + 1);
+				if (!child)
+					goto err;
+				sprintf(child, "%s%.*s", ino.name, ref.name_len,
+					args.buf + off + sizeof(ref));
+				if (lxc_grow_array((void ***)&list, &cap, n + 2, 8) < 0) {
+					free(child);
+					goto err;
+				}
+				list[n++] = child;
+			}
+			off += sh.len;
+			args.key.min_offset = sh.offset + 1;
+		}
+		if (args.key.min_offset == 0)
+			break;
+	}
+
+	close(fd);
+	return list;
+
+err:
+	close(fd);
+	lxc_free_array((void **)list, free);
+	return NULL;
+}
+
+/*
+ * Snapshot @orig to @new along with the subvolumes nested in it, which a
+ * snapshot only has empty directories for.
+ */
+static int btrfs_snapshot_recursive(const char *orig, const char *new)
+{
+	char **children, **p, *o, *n;
+	int ret;
+
+	ret = btrfs_snapshot(orig, new);
+	if (ret < 0)
+		return ret;
+
+	children = btrfs_nested_subvolumes(orig);
+	if (!children)
+		return 0;
+	for (p = children; *p && ret == 0; p++) {
+		o = malloc(strlen(orig) + strlen(*p) + 2);
+		n = malloc(strlen(new) + strlen(*p) + 2);
+		if (!o || !n) {
+			free(o);
+			free(n);
+			ret = -1;
+			break;
+		}
+		sprintf(o, "%s/%s", orig, *p);
+		sprintf(n, "%s/%s", new, *p);
+		ret = btrfs_snapshot_recursive(o, n);
+		if (ret < 0)
+			ERROR("Error snapshotting nested subvolume %s", o);
+		free(o);
+		free(n);
+	}
+	lxc_free_array((void **)children, free);
+	return ret;
+}
+
+static int btrfs_snapshot_wrapper(void *data)
+{
+	struct rsync_data_char *arg = data;
+	if (setgid(0) < 0) {
+		ERROR("Failed to setgid to 0");
+		return -1;
+	}
+	if (setgroups(0, NULL) < 0)
+		WARN("Failed to clear groups");
+	if (setuid(0) < 0) {
+		ERROR("Failed to setuid to 0");
+		return -1;
+	}
+	return btrfs_snapshot_recursive(arg->src, arg->dest);
+}
+
+static int btrfs_clonepaths(struct bdev *orig, struct bdev *new, const char *oldname,
+		const char *cname, const char *oldpath, const char *lxcpath, int snap,
+		uint64_t newsize, struct lxc_conf *conf)
+{
+	if (!orig->dest || !orig->src)
+		return -1;
+
+	if (strcmp(orig->type, "btrfs")) {
+		int len, ret;
+		if (snap) {
+			ERROR("btrfs snapshot from %s backing store is not supported",
+				orig->type);
+			return -1;
+		}
+		len = strlen(lxcpath) + strlen(cname) + strlen("rootfs") + 3;
 		new->src = malloc(len);
 		if (!new->src)
 			return -1;
@@ -1492,7 +2126,7 @@ static int btrfs_clonepaths(struct bdev *orig, struct bdev *new, const char *old
 	if (snap) {
 		struct rsync_data_char sdata;
 		if (!am_unpriv())
-			return btrfs_snapshot(orig->dest, new->dest);
+			return btrfs_snapshot_recursive(orig->dest, new->dest);
 		sdata.dest = new->dest;
 		sdata.src = orig->dest;
 		return userns_exec_1(conf, btrfs_snapshot_wrapper, &sdata);
@@ -1506,11 +2140,10 @@ static int btrfs_clonepaths(struct bdev *orig, struct bdev *new, const char *old
 	return btrfs_subvolume_create(new->dest);
 }
 
-static int btrfs_destroy(struct bdev *orig)
+static int btrfs_subvolume_destroy(const char *path)
 {
 	int ret, fd = -1;
 	struct btrfs_ioctl_vol_args  args;
-	char *path = orig->src;
 	char *p, *newfull = strdup(path);
 
 	if (!newfull) {
@@ -1546,6 +2179,38 @@ static int btrfs_destroy(struct bdev *orig)
 	return ret;
 }
 
+/*
+ * A subvolume can't be deleted while others are nested in it, so those go
+ * first.  Deleting only unlinks them, the kernel reclaims their space in
+ * the background.
+ */
+static int btrfs_subvolume_destroy_recursive(const char *path)
+{
+	char **children, **p, *c;
+	int ret = 0;
+
+	children = btrfs_nested_subvolumes(path);
+	for (p = children; p && *p && ret == 0; p++) {
+		c = malloc(strlen(path) + strlen(*p) + 2);
+		if (!c) {
+			ret = -1;
+			break;
+		}
+		sprintf(c, "%s/%s", path, *p);
+		ret = btrfs_subvolume_destroy_recursive(c);
+		free(c);
+	}
+	lxc_free_array((void **)children, free);
+	if (ret < 0)
+		return ret;
+	return btrfs_subvolume_destroy(path);
+}
+
+static int btrfs_destroy(struct bdev *orig)
+{
+	return btrfs_subvolume_destroy_recursive(orig->src);
+}
+
 static int btrfs_create(struct bdev *bdev, const char *dest, const char *n,
 			struct bdev_specs *specs)
 {
@@ -1556,6 +2221,40 @@ static int btrfs_create(struct bdev *bdev, const char *dest, const char *n,
 	return btrfs_subvolume_create(bdev->dest);
 }
 
+/* a snapshot of the snapshot, swapped in for the subvolume */
+static int btrfs_restore(struct bdev *bdev, struct bdev *snap, char **old)
+{
+	char *staged;
+	int ret = -1;
+
+	if (btrfs_same_fs(snap->src, bdev->src) != 0)
+		return 1;
+	if (asprintf(&staged, "%s.restore", bdev->src) < 0)
+		return -1;
+	if (dir_exists(staged) &&
+	    btrfs_subvolume_destroy_recursive(staged) < 0) {
+		ERROR("Failed to remove %s", staged);
+		goto out;
+	}
+	if (btrfs_snapshot_recursive(snap->src, staged) < 0) {
+		ERROR("Failed to snapshot %s to %s", snap->src, staged);
+		goto out;
+	}
+	if (restore_swap(bdev->src, staged, old) < 0) {
+		btrfs_subvolume_destroy_recursive(staged);
+		goto out;
+	}
+	if (btrfs_subvolume_destroy_recursive(*old) < 0)
+		WARN("Failed to remove the subvolume %s", *old);
+	free(*old);
+	*old = NULL;
+	ret = 0;
+
+out:
+	free(staged);
+	return ret;
+}
+
 static const struct bdev_ops btrfs_ops = {
 	.detect = &btrfs_detect,
 	.mount = &btrfs_mount,
@@ -1563,6 +2262,7 @@ static const struct bdev_ops btrfs_ops = {
 	.clone_paths = &btrfs_clonepaths,
 	.destroy = &btrfs_destroy,
 	.create = &btrfs_create,
+	.restore = &btrfs_restore,
 	.can_snapshot = true,
 };
 
@@ -1576,7 +2276,14 @@ static int loop_detect(const char *path)
 	return 0;
 }
 
-static int find_free_loopdev(int *retfd, char *namep)
+#ifndef LOOP_CTL_GET_FREE
+#define LOOP_CTL_GET_FREE 0x4C82
+#endif
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+
+static int find_free_loopdev_scan(int *retfd, char *namep)
 {
 	struct dirent dirent, *direntp;
 	struct loop_info64 lo;
@@ -1616,9 +2323,38 @@ static int find_free_loopdev(int *retfd, char *namep)
 	return 0;
 }
 
+/*
+ * Ask the kernel for a free loop device, which it creates if need be,
+ * rather than probing every /dev/loop* node.
+ */
+static int find_free_loopdev(int *retfd, char *namep)
+{
+	int ctlfd, n, fd;
+
+	ctlfd = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+	if (ctlfd < 0)
+		return find_free_loopdev_scan(retfd, namep);
+	n = ioctl(ctlfd, LOOP_CTL_GET_FREE);
+	close(ctlfd);
+	if (n < 0) {
+		SYSERROR("Error getting a free loop device");
+		return find_free_loopdev_scan(retfd, namep);
+	}
+
+	snprintf(namep, 100, "/dev/loop%d", n);
+	fd = open(namep, O_RDWR);
+	if (fd < 0) {
+		/* no such node, e.g. /dev isn't a devtmpfs */
+		return find_free_loopdev_scan(retfd, namep);
+	}
+
+	*retfd = fd;
+	return 0;
+}
+
 static int loop_mount(struct bdev *bdev)
 {
-	int lfd, ffd = -1, ret = -1;
+	int lfd = -1, ffd = -1, ret = -1, tries;
 	struct loop_info64 lo;
 	char loname[100];
 
@@ -1626,26 +2362,41 @@ static int loop_mount(struct bdev *bdev)
 		return -22;
 	if (!bdev->src || !bdev->dest)
 		return -22;
-	if (find_free_loopdev(&lfd, loname) < 0)
-		return -22;
 
 	ffd = open(bdev->src + 5, O_RDWR);
 	if (ffd < 0) {
 		SYSERROR("Error opening backing file %s", bdev->src);
-		goto out;
+		return -22;
 	}
 
-	if (ioctl(lfd, LOOP_SET_FD, ffd) < 0) {
-		SYSERROR("Error attaching backing file to loop dev");
-		goto out;
+	/*
+	 * Someone else may attach the device we were handed before we do,
+	 * in which case we just ask for another one.
+	 */
+	for (tries = 0; ; tries++) {
+		if (find_free_loopdev(&lfd, loname) < 0)
+			goto out;
+		if (ioctl(lfd, LOOP_SET_FD, ffd) == 0)
+			break;
+		close(lfd);
+		lfd = -1;
+		if (errno != EBUSY || tries >= 100) {
+			SYSERROR("Error attaching backing file to loop dev");
+			goto out;
+		}
 	}
 	memset(&lo, 0, sizeof(lo));
 	lo.lo_flags = LO_FLAGS_AUTOCLEAR;
 	if (ioctl(lfd, LOOP_SET_STATUS64, &lo) < 0) {
 		SYSERROR("Error setting autoclear on loop dev");
+		ioctl(lfd, LOOP_CLR_FD, 0);
 		goto out;
 	}
 
+	/* the filesystem caches the data already, the backing file needn't */
+	if (ioctl(lfd, LOOP_SET_DIRECT_IO, 1) < 0)
+		DEBUG("Not using direct IO for %s", bdev->src);
+
 	ret = mount_unknown_fs(loname, bdev->dest, bdev->mntopts);
 	if (ret < 0)
 		ERROR("Error mounting %s", bdev->src);
@@ -1653,10 +2404,10 @@ static int loop_mount(struct bdev *bdev)
 		bdev->lofd = lfd;
 
 out:
-	if (ffd > -1)
-		close(ffd);
+	close(ffd);
 	if (ret < 0) {
-		close(lfd);
+		if (lfd > -1)
+			close(lfd);
 		bdev->lofd = -1;
 	}
 	return ret;
@@ -1681,20 +2432,22 @@ static int loop_umount(struct bdev *bdev)
 static int do_loop_create(const char *path, uint64_t size, const char *fstype)
 {
 	int fd, ret;
-	// create the new loopback file.
+	const char *prealloc;
+
+	// create the new loopback file, sparse unless asked otherwise.
 	fd = creat(path, S_IRUSR|S_IWUSR);
 	if (fd < 0)
 		return -1;
-	if (lseek(fd, size, SEEK_SET) < 0) {
-		SYSERROR("Error seeking to set new loop file size");
-		close(fd);
-		return -1;
-	}
-	if (write(fd, "1", 1) != 1) {
-		SYSERROR("Error creating new loop file");
+	if (ftruncate(fd, size) < 0) {
+		SYSERROR("Error setting new loop file size");
 		close(fd);
 		return -1;
 	}
+	prealloc = lxc_global_config_value("lxc.bdev.loop.prealloc");
+	if (prealloc && strcmp(prealloc, "1") == 0 &&
+	    fallocate(fd, 0, 0, size) < 0)
+		WARN("Error preallocating new loop file, leaving it sparse: %s",
+			strerror(errno));
 	ret = close(fd);
 	if (ret < 0) {
 		SYSERROR("Error closing new loop file");
@@ -1702,7 +2455,7 @@ static int do_loop_create(const char *path, uint64_t size, const char *fstype)
 	}
 
 	// create an fs in the loopback file
-	if (do_mkfs(path, fstype) < 0) {
+	if (do_mkfs_fast(path, fstype) < 0) {
 		ERROR("Error creating filesystem type %s on %s", fstype,
 			path);
 		return -1;
@@ -1827,6 +2580,48 @@ static int loop_destroy(struct bdev *orig)
 	return unlink(orig->src + 5);
 }
 
+/* a reflink of the image where the filesystem can, renamed over ours */
+static int loop_restore(struct bdev *bdev, struct bdev *snap, char **old)
+{
+	const char *path = bdev->src + 5, *src = snap->src + 5;
+	struct stat st;
+	char *staged;
+	int from, to = -1, ret = -1;
+
+	if (asprintf(&staged, "%s.restore", path) < 0)
+		return -1;
+	from = open(src, O_RDONLY | O_CLOEXEC);
+	if (from < 0 || fstat(from, &st) < 0) {
+		SYSERROR("Failed to open %s", src);
+		goto out;
+	}
+	to = open(staged, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		  st.st_mode & 07777);
+	if (to < 0) {
+		SYSERROR("Failed to create %s", staged);
+		goto out;
+	}
+	if (lxc_copy_fd(from, to, &st) < 0 || fsync(to) < 0) {
+		SYSERROR("Failed to copy %s to %s", src, staged);
+		unlink(staged);
+		goto out;
+	}
+	if (rename(staged, path) < 0) {
+		SYSERROR("Failed to move %s to %s", staged, path);
+		unlink(staged);
+		goto out;
+	}
+	ret = 0;
+
+out:
+	if (to >= 0)
+		close(to);
+	if (from >= 0)
+		close(from);
+	free(staged);
+	return ret;
+}
+
 static const struct bdev_ops loop_ops = {
 	.detect = &loop_detect,
 	.mount = &loop_mount,
@@ -1834,6 +2629,7 @@ static const struct bdev_ops loop_ops = {
 	.clone_paths = &loop_clonepaths,
 	.destroy = &loop_destroy,
 	.create = &loop_create,
+	.restore = &loop_restore,
 	.can_snapshot = false,
 };
 
@@ -1848,12 +2644,59 @@ static int overlayfs_detect(const char *path)
 	return 0;
 }
 
-//
-// XXXXXXX plain directory bind mount ops
-//
+/*
+ * An overlayfs rootfs is 'overlayfs:lower:upper', where lower may be
+ * several directories separated by colons, the topmost first, when
+ * snapshots were stacked on snapshots.  How many lowers a snapshot can
+ * have before its layers are squashed is lxc.bdev.overlayfs.layers.
+ */
+static int overlayfs_nlowers(const char *src)
+{
+	int n = 0;
+
+	for (src = strchr(src, ':'); src; src = strchr(src + 1, ':'))
+		n++;
+	return n - 1;
+}
+
+static bool overlayfs_can_stack(const char *src)
+{
+	const char *v = lxc_global_config_value("lxc.bdev.overlayfs.layers");
+	int max = v ? atoi(v) : 1;
+
+	return overlayfs_nlowers(src) < max;
+}
+
+/*
+ * The path of @name next to @path, in the same parent directory, like
+ * the work directory of an overlay next to its upper one.
+ */
+static char *sibling_path(const char *path, const char *name)
+{
+	char *sibling, *p;
+
+	sibling = malloc(strlen(path) + strlen(name) + 2);
+	if (!sibling)
+		return NULL;
+	strcpy(sibling, path);
+	p = strrchr(sibling, '/');
+	if (!p) {
+		free(sibling);
+		return NULL;
+	}
+	strcpy(p + 1, name);
+	return sibling;
+}
+
+/* Upstream overlay wants an empty work directory next to the upper one */
+static char *overlayfs_workdir(const char *upper)
+{
+	return sibling_path(upper, "olwork");
+}
+
 static int overlayfs_mount(struct bdev *bdev)
 {
-	char *options, *dup, *lower, *upper;
+	char *options, *dup, *lower, *upper, *work;
 	int len;
 	unsigned long mntflags;
 	char *mntdata;
@@ -1870,7 +2713,8 @@ static int overlayfs_mount(struct bdev *bdev)
 	strcpy(dup, bdev->src);
 	if (!(lower = index(dup, ':')))
 		return -22;
-	if (!(upper = index(++lower, ':')))
+	lower++;
+	if (!(upper = strrchr(lower, ':')))
 		return -22;
 	*upper = '\0';
 	upper++;
@@ -1883,28 +2727,60 @@ static int overlayfs_mount(struct bdev *bdev)
 	// TODO We should check whether bdev->src is a blockdev, and if so
 	// but for now, only support overlays of a basic directory
 
-	if (mntdata) {
-		len = strlen(lower) + strlen(upper) + strlen("upperdir=,lowerdir=,") + strlen(mntdata) + 1;
+	if (!strchr(lower, ':')) {
+		len = strlen(lower) + strlen(upper) +
+			strlen("upperdir=,lowerdir=,") +
+			(mntdata ? strlen(mntdata) : 0) + 1;
 		options = alloca(len);
-		ret = snprintf(options, len, "upperdir=%s,lowerdir=%s,%s", upper, lower, mntdata);
+		ret = snprintf(options, len, "upperdir=%s,lowerdir=%s%s%s",
+			upper, lower, mntdata ? "," : "",
+			mntdata ? mntdata : "");
+		if (ret < 0 || ret >= len) {
+			free(mntdata);
+			return -1;
+		}
+
+		ret = mount(lower, bdev->dest, "overlayfs",
+			MS_MGC_VAL | mntflags, options);
+		if (ret == 0 || errno != ENODEV)
+			goto out;
 	}
-	else {
-		len = strlen(lower) + strlen(upper) + strlen("upperdir=,lowerdir=") + 1;
-		options = alloca(len);
-		ret = snprintf(options, len, "upperdir=%s,lowerdir=%s", upper, lower);
+
+	/*
+	 * Kernels without the original overlayfs have the upstream one,
+	 * which is the only one to take several lower layers.
+	 */
+	work = overlayfs_workdir(upper);
+	if (!work || mkdir_p(work, 0755) < 0) {
+		ERROR("overlayfs: error creating the work directory for %s",
+			upper);
+		free(work);
+		free(mntdata);
+		return -1;
 	}
+	len = strlen(lower) + strlen(upper) + strlen(work) +
+		strlen("upperdir=,lowerdir=,workdir=,") +
+		(mntdata ? strlen(mntdata) : 0) + 1;
+	options = alloca(len);
+	ret = snprintf(options, len, "upperdir=%s,lowerdir=%s,workdir=%s%s%s",
+		upper, lower, work, mntdata ? "," : "",
+		mntdata ? mntdata : "");
+	free(work);
 	if (ret < 0 || ret >= len) {
 		free(mntdata);
 		return -1;
 	}
+	ret = mount(lower, bdev->dest, "overlay", MS_MGC_VAL | mntflags,
+		options);
 
-	ret = mount(lower, bdev->dest, "overlayfs", MS_MGC_VAL | mntflags, options);
+out:
 	if (ret < 0)
 		SYSERROR("overlayfs: error mounting %s onto %s options %s",
 			lower, bdev->dest, options);
 	else
 		INFO("overlayfs: mounted %s onto %s options %s",
 			lower, bdev->dest, options);
+	free(mntdata);
 	return ret;
 }
 
@@ -1919,6 +2795,8 @@ static int overlayfs_umount(struct bdev *bdev)
 
 static int rsync_delta(struct rsync_data_char *data)
 {
+	char *layers, *layer;
+
 	if (setgid(0) < 0) {
 		ERROR("Failed to setgid to 0");
 		return -1;
@@ -1929,10 +2807,20 @@ static int rsync_delta(struct rsync_data_char *data)
 		ERROR("Failed to setuid to 0");
 		return -1;
 	}
-	if (do_rsync(data->src, data->dest) < 0) {
-		ERROR("rsyncing %s to %s", data->src, data->dest);
-		return -1;
-	}
+	/* squash the layers in data->src, topmost first, from the bottom up */
+	layers = alloca(strlen(data->src) + 1);
+	strcpy(layers, data->src);
+	do {
+		layer = strrchr(layers, ':');
+		if (layer)
+			*layer++ = '\0';
+		else
+			layer = layers;
+		if (lxc_copy_layer(layer, data->dest) < 0) {
+			ERROR("copying %s to %s", layer, data->dest);
+			return -1;
+		}
+	} while (layer != layers);
 
 	return 0;
 }
@@ -1943,6 +2831,15 @@ static int rsync_delta_wrapper(void *data)
 	return rsync_delta(arg);
 }
 
+static int copy_delta(void *data)
+{
+	struct rsync_data_char *arg = data;
+
+	if (am_unpriv())
+		return userns_exec_1(arg->conf, rsync_delta_wrapper, arg);
+	return rsync_delta(arg);
+}
+
 static int overlayfs_clonepaths(struct bdev *orig, struct bdev *new, const char *oldname,
 		const char *cname, const char *oldpath, const char *lxcpath, int snap,
 		uint64_t newsize, struct lxc_conf *conf)
@@ -1999,16 +2896,18 @@ static int overlayfs_clonepaths(struct bdev *orig, struct bdev *new, const char
 		if (ret < 0 || ret >= len)
 			return -ENOMEM;
 	} else if (strcmp(orig->type, "overlayfs") == 0) {
-		// What exactly do we want to do here?
-		// I think we want to use the original lowerdir, with a
-		// private delta which is originally rsynced from the
-		// original delta
-		char *osrc, *odelta, *nsrc, *ndelta;
+		// Either the original delta becomes the topmost lower layer
+		// of the clone, which gets an empty delta of its own, or,
+		// when there are enough layers already, the clone gets the
+		// original lowest layer and a delta squashed from all the
+		// others.
+		char *osrc, *odelta, *nsrc, *ndelta, *base, *layers;
+		bool stack = overlayfs_can_stack(orig->src);
 		int len, ret;
 		if (!(osrc = strdup(orig->src)))
 			return -22;
 		nsrc = index(osrc, ':') + 1;
-		if (nsrc != osrc + 10 || (odelta = index(nsrc, ':')) == NULL) {
+		if (nsrc != osrc + 10 || (odelta = strrchr(nsrc, ':')) == NULL) {
 			free(osrc);
 			return -22;
 		}
@@ -2027,27 +2926,44 @@ static int overlayfs_clonepaths(struct bdev *orig, struct bdev *new, const char
 		}
 		if (am_unpriv() && chown_mapped_root(ndelta, conf) < 0)
 			WARN("Failed to update ownership of %s", ndelta);
+		len = strlen(nsrc) + strlen(odelta) + strlen(ndelta) + 13;
+		new->src = malloc(len);
+		if (!new->src) {
+			free(osrc);
+			free(ndelta);
+			return -ENOMEM;
+		}
+		if (stack) {
+			ret = snprintf(new->src, len, "overlayfs:%s:%s:%s",
+				odelta, nsrc, ndelta);
+			free(osrc);
+			free(ndelta);
+			if (ret < 0 || ret >= len)
+				return -ENOMEM;
+			return 0;
+		}
+
+		layers = alloca(len);
+		ret = snprintf(layers, len, "%s:%s", odelta, nsrc);
+		if (ret < 0 || ret >= len) {
+			free(osrc);
+			free(ndelta);
+			return -ENOMEM;
+		}
+		base = strrchr(layers, ':');
+		*base++ = '\0';
 		struct rsync_data_char rdata;
-		rdata.src = odelta;
+		rdata.src = layers;
 		rdata.dest = ndelta;
-		if (am_unpriv())
-			ret = userns_exec_1(conf, rsync_delta_wrapper, &rdata);
-		else
-			ret = rsync_delta(&rdata);
+		rdata.conf = conf;
+		ret = lxc_io_throttled(copy_delta, &rdata);
 		if (ret) {
 			free(osrc);
 			free(ndelta);
 			ERROR("copying overlayfs delta");
 			return -1;
 		}
-		len = strlen(nsrc) + strlen(ndelta) + 12;
-		new->src = malloc(len);
-		if (!new->src) {
-			free(osrc);
-			free(ndelta);
-			return -ENOMEM;
-		}
-		ret = snprintf(new->src, len, "overlayfs:%s:%s", nsrc, ndelta);
+		ret = snprintf(new->src, len, "overlayfs:%s:%s", base, ndelta);
 		free(osrc);
 		free(ndelta);
 		if (ret < 0 || ret >= len)
@@ -2060,77 +2976,571 @@ static int overlayfs_clonepaths(struct bdev *orig, struct bdev *new, const char
 		return -1;
 	}
 
-	return 0;
+	return 0;
+}
+
+static int overlayfs_destroy(struct bdev *orig)
+{
+	char *upper, *work;
+
+	if (strncmp(orig->src, "overlayfs:", 10) != 0)
+		return -22;
+	upper = strrchr(orig->src + 10, ':');
+	if (!upper)
+		return -22;
+	upper++;
+	work = overlayfs_workdir(upper);
+	if (work && dir_exists(work) && lxc_rmdir_onedev(work, NULL) < 0)
+		WARN("Failed to remove %s", work);
+	free(work);
+	return lxc_rmdir_onedev(upper, NULL);
+}
+
+/*
+ * to say 'lxc-create -t ubuntu -n o1 -B overlayfs' means you want
+ * $lxcpath/$lxcname/rootfs to have the created container, while all
+ * changes after starting the container are written to
+ * $lxcpath/$lxcname/delta0
+ */
+static int overlayfs_create(struct bdev *bdev, const char *dest, const char *n,
+			struct bdev_specs *specs)
+{
+	char *delta;
+	int ret, len = strlen(dest), newlen;
+
+	if (len < 8 || strcmp(dest+len-7, "/rootfs") != 0)
+		return -1;
+
+	if (!(bdev->dest = strdup(dest))) {
+		ERROR("Out of memory");
+		return -1;
+	}
+
+	delta = alloca(strlen(dest)+1);
+	strcpy(delta, dest);
+	strcpy(delta+len-6, "delta0");
+
+	if (mkdir_p(delta, 0755) < 0) {
+		ERROR("Error creating %s", delta);
+		return -1;
+	}
+
+	/* overlayfs:lower:upper */
+	newlen = (2 * len) + strlen("overlayfs:") + 2;
+	bdev->src = malloc(newlen);
+	if (!bdev->src) {
+		ERROR("Out of memory");
+		return -1;
+	}
+	ret = snprintf(bdev->src, newlen, "overlayfs:%s:%s", dest, delta);
+	if (ret < 0 || ret >= newlen)
+		return -1;
+
+	if (mkdir_p(bdev->dest, 0755) < 0) {
+		ERROR("Error creating %s", bdev->dest);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* the upper is all there is to restore, over the same lower layers */
+static int overlayfs_restore(struct bdev *bdev, struct bdev *snap, char **old)
+{
+	char *upper = strrchr(bdev->src, ':'), *supper = strrchr(snap->src, ':');
+
+	if (!upper || !supper || upper - bdev->src != supper - snap->src ||
+	    strncmp(bdev->src, snap->src, upper - bdev->src) != 0)
+		return 1;
+	return restore_tree(upper + 1, supper + 1, old);
+}
+
+static const struct bdev_ops overlayfs_ops = {
+	.detect = &overlayfs_detect,
+	.mount = &overlayfs_mount,
+	.umount = &overlayfs_umount,
+	.clone_paths = &overlayfs_clonepaths,
+	.destroy = &overlayfs_destroy,
+	.create = &overlayfs_create,
+	.restore = &overlayfs_restore,
+	.can_snapshot = true,
+};
+
+//
+// squashfs ops
+//
+
+/*
+ * A squashfs rootfs is 'squashfs:image:upper': a read-only image, which
+ * may be squashfs or erofs, under an overlay whose upper directory holds
+ * the changes of the container.  The image is attached to one loop
+ * device for the whole host, which all the containers made from it
+ * mount, so they share its superblock and page cache.  The loop device
+ * is set to autoclear, the kernel keeps count of its mounts and detaches
+ * it after the last one is gone.
+ */
+static int squashfs_detect(const char *path)
+{
+	if (strncmp(path, "squashfs:", 9) == 0)
+		return 1;
+	return 0;
+}
+
+/* split 'squashfs:image:upper' in place, NULL if it isn't one */
+static char *squashfs_split(char *src, char **upper)
+{
+	char *image, *p;
+
+	if (strncmp(src, "squashfs:", 9) != 0)
+		return NULL;
+	image = src + 9;
+	p = strrchr(image, ':');
+	if (!p || p == image || !p[1])
+		return NULL;
+	*p = '\0';
+	*upper = p + 1;
+	return image;
+}
+
+/* the loop device @image is attached to already, read-only, if any */
+static int squashfs_find_loopdev(struct stat *image, char *loname)
+{
+	struct dirent dirent, *direntp;
+	struct loop_info64 lo;
+	DIR *dir;
+	int fd = -1;
+
+	dir = opendir("/sys/block");
+	if (!dir)
+		return -1;
+	while (!readdir_r(dir, &dirent, &direntp)) {
+		if (!direntp)
+			break;
+		if (strncmp(direntp->d_name, "loop", 4) != 0)
+			continue;
+		snprintf(loname, 100, "/dev/%s", direntp->d_name);
+		fd = open(loname, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		/* one being cleared fails with ENXIO */
+		if (ioctl(fd, LOOP_GET_STATUS64, &lo) == 0 &&
+		    lo.lo_device == image->st_dev &&
+		    lo.lo_inode == image->st_ino &&
+		    lo.lo_offset == 0 && lo.lo_sizelimit == 0 &&
+		    (lo.lo_flags & LO_FLAGS_READ_ONLY) &&
+		    (lo.lo_flags & LO_FLAGS_AUTOCLEAR))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	closedir(dir);
+	return fd;
+}
+
+/*
+ * Open the loop device of @image, attaching it to a new one if it isn't
+ * yet.  The lock on the image keeps two containers from attaching it
+ * twice; the device can't be cleared while we hold it open.
+ */
+static int squashfs_get_loopdev(const char *image, char *loname)
+{
+	struct loop_info64 lo;
+	struct stat st;
+	int ffd, lfd = -1, tries;
+
+	ffd = open(image, O_RDONLY | O_CLOEXEC);
+	if (ffd < 0) {
+		SYSERROR("Error opening image %s", image);
+		return -1;
+	}
+	if (fstat(ffd, &st) < 0 || flock(ffd, LOCK_EX) < 0) {
+		SYSERROR("Error locking image %s", image);
+		goto out;
+	}
+
+	lfd = squashfs_find_loopdev(&st, loname);
+	if (lfd >= 0) {
+		DEBUG("Image %s is attached to %s already", image, loname);
+		goto out;
+	}
+
+	for (tries = 0; ; tries++) {
+		if (find_free_loopdev(&lfd, loname) < 0)
+			goto out;
+		if (ioctl(lfd, LOOP_SET_FD, ffd) == 0)
+			break;
+		close(lfd);
+		lfd = -1;
+		if (errno != EBUSY || tries >= 100) {
+			SYSERROR("Error attaching image %s to loop dev", image);
+			goto out;
+		}
+	}
+	memset(&lo, 0, sizeof(lo));
+	lo.lo_flags = LO_FLAGS_AUTOCLEAR;
+	if (ioctl(lfd, LOOP_SET_STATUS64, &lo) < 0) {
+		SYSERROR("Error setting autoclear on loop dev");
+		ioctl(lfd, LOOP_CLR_FD, 0);
+		close(lfd);
+		lfd = -1;
+		goto out;
+	}
+	if (ioctl(lfd, LOOP_SET_DIRECT_IO, 1) < 0)
+		DEBUG("Not using direct IO for %s", image);
+	INFO("Attached image %s to %s", image, loname);
+
+out:
+	/* the loop device keeps the file open, and so the lock with it */
+	flock(ffd, LOCK_UN);
+	close(ffd);
+	return lfd;
+}
+
+static int squashfs_mount(struct bdev *bdev)
+{
+	char *dup, *image, *upper, *lower = NULL, *ovlsrc = NULL;
+	char loname[100];
+	struct bdev ovl;
+	int lfd, ret = -1;
+
+	if (strcmp(bdev->type, "squashfs"))
+		return -22;
+	if (!bdev->src || !bdev->dest)
+		return -22;
+
+	dup = alloca(strlen(bdev->src) + 1);
+	strcpy(dup, bdev->src);
+	image = squashfs_split(dup, &upper);
+	if (!image)
+		return -22;
+
+	lower = sibling_path(upper, "image");
+	if (!lower || mkdir_p(lower, 0755) < 0) {
+		ERROR("squashfs: error creating the image mount point for %s",
+			upper);
+		free(lower);
+		return -1;
+	}
+
+	lfd = squashfs_get_loopdev(image, loname);
+	if (lfd < 0)
+		goto out;
+	ret = mount_unknown_fs(loname, lower, "ro");
+	/* the mount holds the device from now on */
+	close(lfd);
+	if (ret < 0) {
+		ERROR("squashfs: error mounting image %s", image);
+		goto out;
+	}
+
+	ovlsrc = malloc(strlen(lower) + strlen(upper) + strlen("overlayfs::") + 1);
+	if (!ovlsrc) {
+		umount(lower);
+		ret = -1;
+		goto out;
+	}
+	sprintf(ovlsrc, "overlayfs:%s:%s", lower, upper);
+	memset(&ovl, 0, sizeof(ovl));
+	ovl.type = "overlayfs";
+	ovl.src = ovlsrc;
+	ovl.dest = bdev->dest;
+	ovl.mntopts = bdev->mntopts;
+	ret = overlayfs_mount(&ovl);
+	if (ret < 0)
+		umount(lower);
+
+out:
+	free(ovlsrc);
+	free(lower);
+	return ret;
+}
+
+static int squashfs_umount(struct bdev *bdev)
+{
+	char *dup, *upper, *lower;
+	int ret;
+
+	if (strcmp(bdev->type, "squashfs"))
+		return -22;
+	if (!bdev->src || !bdev->dest)
+		return -22;
+
+	dup = alloca(strlen(bdev->src) + 1);
+	strcpy(dup, bdev->src);
+	if (!squashfs_split(dup, &upper))
+		return -22;
+
+	ret = umount(bdev->dest);
+	lower = sibling_path(upper, "image");
+	if (lower && umount(lower) < 0)
+		WARN("Failed to unmount the image at %s", lower);
+	free(lower);
+	return ret;
+}
+
+static int squashfs_clonepaths(struct bdev *orig, struct bdev *new, const char *oldname,
+		const char *cname, const char *oldpath, const char *lxcpath, int snap,
+		uint64_t newsize, struct lxc_conf *conf)
+{
+	struct rsync_data_char rdata;
+	char *dup, *image, *oupper, *nupper;
+	int len, ret;
+
+	if (strcmp(orig->type, "squashfs") != 0) {
+		ERROR("squashfs clone of %s container is not supported",
+			orig->type);
+		return -1;
+	}
+	if (!orig->src || !orig->dest)
+		return -1;
+
+	dup = alloca(strlen(orig->src) + 1);
+	strcpy(dup, orig->src);
+	image = squashfs_split(dup, &oupper);
+	if (!image)
+		return -22;
+
+	new->dest = dir_new_path(orig->dest, oldname, cname, oldpath, lxcpath);
+	if (!new->dest)
+		return -1;
+	if (mkdir_p(new->dest, 0755) < 0)
+		return -1;
+	if (am_unpriv() && chown_mapped_root(new->dest, conf) < 0)
+		WARN("Failed to update ownership of %s", new->dest);
+
+	// the image is shared, a snapshot or not, only the upper is copied
+	nupper = dir_new_path(oupper, oldname, cname, oldpath, lxcpath);
+	if (!nupper)
+		return -ENOMEM;
+	if (mkdir(nupper, 0755) < 0) {
+		SYSERROR("error: mkdir %s", nupper);
+		free(nupper);
+		return -1;
+	}
+	if (am_unpriv() && chown_mapped_root(nupper, conf) < 0)
+		WARN("Failed to update ownership of %s", nupper);
+
+	rdata.src = oupper;
+	rdata.dest = nupper;
+	rdata.conf = conf;
+	ret = lxc_io_throttled(copy_delta, &rdata);
+	if (ret) {
+		ERROR("copying squashfs upper %s", oupper);
+		free(nupper);
+		return -1;
+	}
+
+	len = strlen(image) + strlen(nupper) + strlen("squashfs::") + 1;
+	new->src = malloc(len);
+	if (!new->src) {
+		free(nupper);
+		return -ENOMEM;
+	}
+	ret = snprintf(new->src, len, "squashfs:%s:%s", image, nupper);
+	free(nupper);
+	if (ret < 0 || ret >= len)
+		return -ENOMEM;
+	return 0;
+}
+
+static int squashfs_destroy(struct bdev *orig)
+{
+	char *dup, *upper, *path;
+
+	dup = alloca(strlen(orig->src) + 1);
+	strcpy(dup, orig->src);
+	if (!squashfs_split(dup, &upper))
+		return -22;
+
+	// the image is left alone, other containers may be made from it
+	path = overlayfs_workdir(upper);
+	if (path && dir_exists(path) && lxc_rmdir_onedev(path, NULL) < 0)
+		WARN("Failed to remove %s", path);
+	free(path);
+	path = sibling_path(upper, "image");
+	if (path && dir_exists(path) && rmdir(path) < 0)
+		WARN("Failed to remove %s", path);
+	free(path);
+	return lxc_rmdir_onedev(upper, NULL);
+}
+
+static int run_cmd(char *const argv[])
+{
+	pid_t pid;
+
+	if ((pid = fork()) < 0) {
+		ERROR("error forking");
+		return -1;
+	}
+	if (pid > 0)
+		return wait_for_pid(pid);
+
+	lxc_io_throttle();
+	close(0);
+	open("/dev/null", O_RDONLY);
+	execvp(argv[0], argv);
+	SYSERROR("error executing %s", argv[0]);
+	exit(1);
 }
 
-static int overlayfs_destroy(struct bdev *orig)
+/*
+ * Turn the rootfs tarball @tarball into a squashfs image in @imagedir,
+ * unless it was already, and return the path of the image.  The image
+ * is named after the tarball's path, size and mtime, so that all the
+ * containers created from one tarball share one image.
+ */
+static char *squashfs_import(const char *tarball, const char *imagedir)
 {
-	char *upper;
+	char path[MAXPATHLEN], tmpimg[MAXPATHLEN], tmpdir[MAXPATHLEN];
+	char *tar[] = {"tar", "--numeric-owner", "-xpf", (char *)tarball,
+		       "-C", tmpdir, NULL};
+	char *mksquashfs[] = {"mksquashfs", tmpdir, tmpimg, "-noappend",
+			      "-quiet", NULL};
+	char *real, *image = NULL;
+	struct stat st;
+	uint64_t hash;
+	int ret;
 
-	if (strncmp(orig->src, "overlayfs:", 10) != 0)
-		return -22;
-	upper = index(orig->src + 10, ':');
-	if (!upper)
-		return -22;
-	upper++;
-	return lxc_rmdir_onedev(upper, NULL);
+	real = realpath(tarball, NULL);
+	if (!real || stat(real, &st) < 0) {
+		SYSERROR("Error opening %s", tarball);
+		free(real);
+		return NULL;
+	}
+	ret = snprintf(path, sizeof(path), "%s:%llu:%llu", real,
+		       (unsigned long long)st.st_size,
+		       (unsigned long long)st.st_mtime);
+	free(real);
+	if (ret < 0 || ret >= sizeof(path))
+		return NULL;
+	hash = fnv_64a_buf(path, ret, FNV1A_64_INIT);
+
+	ret = snprintf(path, sizeof(path), "%s/%016" PRIx64 ".squashfs",
+		       imagedir, hash);
+	if (ret < 0 || ret >= sizeof(path))
+		return NULL;
+	if (access(path, F_OK) == 0) {
+		INFO("Using image %s already imported from %s", path, tarball);
+		return strdup(path);
+	}
+
+	if (mkdir_p(imagedir, 0755) < 0) {
+		ERROR("Error creating %s", imagedir);
+		return NULL;
+	}
+	ret = snprintf(tmpdir, sizeof(tmpdir), "%s/.import.XXXXXX", imagedir);
+	if (ret < 0 || ret >= sizeof(tmpdir) || !mkdtemp(tmpdir)) {
+		SYSERROR("Error creating a directory to import %s", tarball);
+		return NULL;
+	}
+	ret = snprintf(tmpimg, sizeof(tmpimg), "%s.squashfs", tmpdir);
+	if (ret < 0 || ret >= sizeof(tmpimg))
+		goto out;
+
+	if (run_cmd(tar) < 0) {
+		ERROR("Error extracting %s", tarball);
+		goto out;
+	}
+	if (run_cmd(mksquashfs) < 0) {
+		ERROR("Error creating a squashfs image from %s", tarball);
+		unlink(tmpimg);
+		goto out;
+	}
+
+	// whoever imports it last wins, the images are the same
+	if (rename(tmpimg, path) < 0) {
+		SYSERROR("Error renaming %s to %s", tmpimg, path);
+		unlink(tmpimg);
+		goto out;
+	}
+	INFO("Imported %s as %s", tarball, path);
+	image = strdup(path);
+
+out:
+	if (lxc_rmdir_onedev(tmpdir, NULL) < 0)
+		WARN("Failed to remove %s", tmpdir);
+	return image;
 }
 
 /*
- * to say 'lxc-create -t ubuntu -n o1 -B overlayfs' means you want
- * $lxcpath/$lxcname/rootfs to have the created container, while all
- * changes after starting the container are written to
- * $lxcpath/$lxcname/delta0
+ * 'lxc-create -B squashfs --image=X' makes $lxcpath/$lxcname/rootfs the
+ * overlay of the image X, with changes written to $lxcpath/$lxcname/delta0.
+ * X is a squashfs or erofs image, used as is, or a rootfs tarball, which
+ * is imported once into $lxcpath/.images.
  */
-static int overlayfs_create(struct bdev *bdev, const char *dest, const char *n,
+static int squashfs_create(struct bdev *bdev, const char *dest, const char *n,
 			struct bdev_specs *specs)
 {
-	char *delta;
+	char *delta, *imagedir, *image, *p;
+	const char *fstype;
 	int ret, len = strlen(dest), newlen;
 
+	if (!specs || !specs->squashfs.image) {
+		ERROR("squashfs: an image or rootfs tarball is needed");
+		return -1;
+	}
 	if (len < 8 || strcmp(dest+len-7, "/rootfs") != 0)
 		return -1;
 
+	fstype = lxc_probe_fstype(specs->squashfs.image);
+	if (fstype && (strcmp(fstype, "squashfs") == 0 ||
+		       strcmp(fstype, "erofs") == 0)) {
+		image = realpath(specs->squashfs.image, NULL);
+		if (!image) {
+			SYSERROR("Error resolving %s", specs->squashfs.image);
+			return -1;
+		}
+	} else {
+		// $lxcpath/$lxcname/rootfs -> $lxcpath/.images
+		imagedir = alloca(len + strlen("/.images") + 1);
+		strcpy(imagedir, dest);
+		imagedir[len - 7] = '\0';
+		p = strrchr(imagedir, '/');
+		if (!p)
+			return -1;
+		strcpy(p, "/.images");
+		image = squashfs_import(specs->squashfs.image, imagedir);
+		if (!image)
+			return -1;
+	}
+
 	if (!(bdev->dest = strdup(dest))) {
 		ERROR("Out of memory");
+		free(image);
 		return -1;
 	}
 
-	delta = alloca(strlen(dest)+1);
+	delta = alloca(len + 1);
 	strcpy(delta, dest);
 	strcpy(delta+len-6, "delta0");
-
-	if (mkdir_p(delta, 0755) < 0) {
+	if (mkdir_p(delta, 0755) < 0 || mkdir_p(bdev->dest, 0755) < 0) {
 		ERROR("Error creating %s", delta);
+		free(image);
 		return -1;
 	}
 
-	/* overlayfs:lower:upper */
-	newlen = (2 * len) + strlen("overlayfs:") + 2;
+	/* squashfs:image:upper */
+	newlen = strlen(image) + len + strlen("squashfs::") + 1;
 	bdev->src = malloc(newlen);
 	if (!bdev->src) {
 		ERROR("Out of memory");
+		free(image);
 		return -1;
 	}
-	ret = snprintf(bdev->src, newlen, "overlayfs:%s:%s", dest, delta);
+	ret = snprintf(bdev->src, newlen, "squashfs:%s:%s", image, delta);
+	free(image);
 	if (ret < 0 || ret >= newlen)
 		return -1;
-
-	if (mkdir_p(bdev->dest, 0755) < 0) {
-		ERROR("Error creating %s", bdev->dest);
-		return -1;
-	}
-
 	return 0;
 }
 
-static const struct bdev_ops overlayfs_ops = {
-	.detect = &overlayfs_detect,
-	.mount = &overlayfs_mount,
-	.umount = &overlayfs_umount,
-	.clone_paths = &overlayfs_clonepaths,
-	.destroy = &overlayfs_destroy,
-	.create = &overlayfs_create,
+static const struct bdev_ops squashfs_ops = {
+	.detect = &squashfs_detect,
+	.mount = &squashfs_mount,
+	.umount = &squashfs_umount,
+	.clone_paths = &squashfs_clonepaths,
+	.destroy = &squashfs_destroy,
+	.create = &squashfs_create,
 	.can_snapshot = true,
 };
 
@@ -2311,7 +3721,7 @@ static int aufs_clonepaths(struct bdev *orig, struct bdev *new, const char *oldn
 			free(osrc);
 			return -ENOMEM;
 		}
-		if (do_rsync(odelta, ndelta) < 0) {
+		if (lxc_copy_tree(odelta, ndelta) < 0) {
 			free(osrc);
 			free(ndelta);
 			ERROR("copying aufs delta");
@@ -2427,6 +3837,121 @@ struct nbd_attach_data {
 	const char *path;
 };
 
+/* how long to give qemu-nbd to connect, and the kernel to find partitions */
+#define NBD_TIMEOUT_MS 5000
+
+/*
+ * Lazily populated images: a qcow2 overlay whose backing file is the
+ * image in the local content store.  qemu-nbd serves it through a
+ * copy-on-read filter, so the container starts at once and each block is
+ * fetched from the store the first time it is read, and kept in the
+ * overlay from then on.  Meanwhile the whole device is read at idle I/O
+ * priority, unless lxc.bdev.nbd.prefetch is 0, until nothing is left in
+ * the store which the container still needs.
+ */
+#define NBD_OVERLAY "rootdev.qcow2"
+#define NBD_PREFETCH_CHUNK (1024 * 1024)
+
+static uint64_t probe_be64(const unsigned char *p)
+{
+	return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+	       ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+	       ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+	       ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+}
+
+/* 1 if @path is a qcow2 image, 2 if it also has a backing file */
+static int nbd_probe_qcow2(const char *path)
+{
+	unsigned char hdr[16];
+	int fd, ret = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	if (pread(fd, hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+	    memcmp(hdr, "QFI\xfb", 4) == 0)
+		ret = probe_be64(hdr + 8) ? 2 : 1;
+	close(fd);
+	return ret;
+}
+
+/* the qemu-nbd --image-opts for @path behind a copy-on-read filter */
+static char *nbd_cor_opts(const char *path)
+{
+	const char *prefix = "driver=copy-on-read,file.driver=qcow2,"
+			     "file.file.driver=file,file.file.filename=";
+	char *opts, *p;
+
+	opts = malloc(strlen(prefix) + 2 * strlen(path) + 1);
+	if (!opts)
+		return NULL;
+	p = stpcpy(opts, prefix);
+	/* a comma in a value is doubled */
+	for (; *path; path++) {
+		if (*path == ',')
+			*p++ = ',';
+		*p++ = *path;
+	}
+	*p = '\0';
+	return opts;
+}
+
+/*
+ * Read all of @nbd once it is connected, which copies into the overlay
+ * what it still lacks.  Runs at idle priority, so the container's own
+ * reads go first, and drops what it read from the page cache.
+ */
+static int nbd_prefetch(const char *nbd)
+{
+	char pidpath[100], *buf;
+	int fd, i;
+	ssize_t n;
+	off_t off = 0;
+
+	if (syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		    IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0)
+		WARN("Failed to set idle I/O priority to prefetch %s", nbd);
+	if (setpriority(PRIO_PROCESS, 0, 19) < 0)
+		WARN("Failed to lower the priority to prefetch %s", nbd);
+
+	snprintf(pidpath, sizeof(pidpath), "/sys/block/%s/pid", nbd + 5);
+	for (i = 0; !file_exists(pidpath); i++) {
+		if (i * 100 >= NBD_TIMEOUT_MS)
+			return 1;
+		usleep(100 * 1000);
+	}
+
+	buf = malloc(NBD_PREFETCH_CHUNK);
+	if (!buf)
+		return 1;
+	fd = open(nbd, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		SYSERROR("Failed to open %s to prefetch it", nbd);
+		free(buf);
+		return 1;
+	}
+	while ((n = read(fd, buf, NBD_PREFETCH_CHUNK)) > 0) {
+		posix_fadvise(fd, off, n, POSIX_FADV_DONTNEED);
+		off += n;
+	}
+	if (n < 0 && errno != EINTR)
+		SYSERROR("Prefetching %s stopped after %lld bytes", nbd,
+			 (long long)off);
+	else
+		INFO("Prefetched %lld bytes of %s", (long long)off, nbd);
+	close(fd);
+	free(buf);
+	return n < 0;
+}
+
+static bool nbd_want_prefetch(void)
+{
+	const char *v = lxc_global_config_value("lxc.bdev.nbd.prefetch");
+
+	return !v || strcmp(v, "0") != 0;
+}
+
 static void nbd_detach(const char *path)
 {
 	int ret;
@@ -2451,11 +3976,12 @@ static int do_attach_nbd(void *d)
 {
 	struct nbd_attach_data *data = d;
 	const char *nbd, *path;
-	pid_t pid;
+	pid_t pid, qpid, prefetch = -1;
 	sigset_t mask;
-	int sfd;
+	int sfd, lazy;
 	ssize_t s;
 	struct signalfd_siginfo fdsi;
+	char *opts = NULL;
 
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGHUP);
@@ -2478,8 +4004,19 @@ static int do_attach_nbd(void *d)
 	if (prctl(PR_SET_PDEATHSIG, SIGHUP, 0, 0, 0) < 0)
 		SYSERROR("Error setting parent death signal for nbd watcher");
 
-	pid = fork();
-	if (pid) {
+	lazy = nbd_probe_qcow2(path) == 2;
+	if (lazy && !(opts = nbd_cor_opts(path)))
+		exit(1);
+
+	qpid = fork();
+	if (qpid && lazy && nbd_want_prefetch()) {
+		prefetch = fork();
+		if (prefetch == 0) {
+			close(sfd);
+			exit(nbd_prefetch(nbd));
+		}
+	}
+	if (qpid) {
 		for (;;) {
 			s = read(sfd, &fdsi, sizeof(struct signalfd_siginfo));
 			if (s != sizeof(struct signalfd_siginfo))
@@ -2487,15 +4024,23 @@ static int do_attach_nbd(void *d)
 
 			if (fdsi.ssi_signo == SIGHUP) {
 				/* container has exited */
+				if (prefetch > 0)
+					kill(prefetch, SIGKILL);
 				nbd_detach(nbd);
 				exit(0);
 			} else if (fdsi.ssi_signo == SIGCHLD) {
 				int status;
 				/* If qemu-nbd fails, or is killed by a signal,
 				 * then exit */
-				while (waitpid(-1, &status, WNOHANG) > 0) {
+				while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+					if (pid == prefetch) {
+						prefetch = -1;
+						continue;
+					}
 					if ((WIFEXITED(status) && WEXITSTATUS(status) != 0) ||
 							WIFSIGNALED(status)) {
+						if (prefetch > 0)
+							kill(prefetch, SIGKILL);
 						nbd_detach(nbd);
 						exit(1);
 					}
@@ -2508,59 +4053,190 @@ static int do_attach_nbd(void *d)
 	if (sigprocmask(SIG_UNBLOCK, &mask, NULL) == -1)
 		WARN("Warning: unblocking signals for nbd watcher");
 
-	execlp("qemu-nbd", "qemu-nbd", "-c", nbd, path, NULL);
+	if (lazy)
+		execlp("qemu-nbd", "qemu-nbd", "-c", nbd, "--image-opts", opts,
+		       NULL);
+	else
+		execlp("qemu-nbd", "qemu-nbd", "-c", nbd, path, NULL);
 	SYSERROR("Error executing qemu-nbd");
 	exit(1);
 }
 
-static bool clone_attach_nbd(const char *nbd, const char *path)
+static pid_t clone_attach_nbd(const char *nbd, const char *path)
 {
-	pid_t pid;
 	struct nbd_attach_data data;
 
 	data.nbd = nbd;
 	data.path = path;
 
-	pid = lxc_clone(do_attach_nbd, &data, CLONE_NEWPID);
-	if (pid < 0)
-		return false;
-	return true;
+	return lxc_clone(do_attach_nbd, &data, CLONE_NEWPID);
+}
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Wait up to @timeout_ms for @cond to return something else than 0, and
+ * return that, or 0 on timeout.  @cond is checked again whenever the
+ * kernel sends a uevent, which it does when a block device is connected
+ * or a partition appears, so this returns as soon as it is true.  Since
+ * not every condition has a uevent of its own, and we may not be allowed
+ * to listen for them, it is also checked every @interval_ms.
+ */
+static int wait_for_uevent(int (*cond)(void *), void *arg, int timeout_ms,
+		int interval_ms)
+{
+	struct sockaddr_nl addr;
+	struct pollfd pfd;
+	char buf[4096];
+	int64_t deadline = now_ms() + timeout_ms;
+	int fd, ret;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			NETLINK_KOBJECT_UEVENT);
+	if (fd >= 0) {
+		memset(&addr, 0, sizeof(addr));
+		addr.nl_family = AF_NETLINK;
+		addr.nl_groups = 1;
+		if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd < 0)
+		DEBUG("Not listening for uevents: %s", strerror(errno));
+
+	for (;;) {
+		int64_t left;
+
+		/* listening before checking, so nothing is missed in between */
+		ret = cond(arg);
+		if (ret)
+			break;
+		left = deadline - now_ms();
+		if (left <= 0)
+			break;
+		if (left > interval_ms)
+			left = interval_ms;
+		if (fd < 0) {
+			usleep(left * 1000);
+			continue;
+		}
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, left) > 0)
+			while (recv(fd, buf, sizeof(buf), 0) > 0)
+				;
+	}
+
+	if (fd >= 0)
+		close(fd);
+	return ret;
 }
 
-static bool nbd_busy(int idx)
+static int nbd_path_exists(void *arg)
 {
+	return file_exists(arg) ? 1 : 0;
+}
+
+struct nbd_connect_data {
+	int idx;
+	pid_t pid;
+};
+
+/*
+ * The device is connected once the kernel shows the pid of whoever set
+ * it up.  If instead our watcher exited, qemu-nbd failed, most likely
+ * because someone else took the device in the meantime.
+ */
+static int nbd_connected(void *arg)
+{
+	struct nbd_connect_data *data = arg;
 	char path[100];
 	int ret;
 
-	ret = snprintf(path, 100, "/sys/block/nbd%d/pid", idx);
+	ret = snprintf(path, 100, "/sys/block/nbd%d/pid", data->idx);
 	if (ret < 0 || ret >= 100)
-		return true;
-	return file_exists(path);
+		return -1;
+	if (file_exists(path))
+		return 1;
+	if (waitpid(data->pid, NULL, WNOHANG) == data->pid)
+		return -1;
+	return 0;
+}
+
+/*
+ * Return the lowest numbered nbd device above @after which is not in use,
+ * or -1 if there is none.  Those in use have a pid file in sysfs.
+ */
+static int nbd_find_free(int after)
+{
+	DIR *dir;
+	struct dirent *de;
+	char path[100], *end;
+	int idx, ret, best = -1;
+
+	dir = opendir("/sys/block");
+	if (!dir) {
+		SYSERROR("Failed to open /sys/block");
+		return -1;
+	}
+	while ((de = readdir(dir))) {
+		if (strncmp(de->d_name, "nbd", 3) != 0)
+			continue;
+		errno = 0;
+		idx = strtol(de->d_name + 3, &end, 10);
+		if (errno || end == de->d_name + 3 || *end)
+			continue;
+		if (idx <= after || (best >= 0 && idx >= best))
+			continue;
+		ret = snprintf(path, 100, "/sys/block/nbd%d/pid", idx);
+		if (ret < 0 || ret >= 100 || file_exists(path))
+			continue;
+		best = idx;
+	}
+	closedir(dir);
+	return best;
 }
 
 static bool attach_nbd(char *src, struct lxc_conf *conf)
 {
 	char *orig = alloca(strlen(src)+1), *p, path[50];
-	int i = 0;
+	struct nbd_connect_data data;
+	int i = -1, ret;
 
 	strcpy(orig, src);
 	/* if path is followed by a partition, drop that for now */
 	p = strchr(orig, ':');
 	if (p)
 		*p = '\0';
-	while (1) {
+	while ((i = nbd_find_free(i)) >= 0) {
 		sprintf(path, "/dev/nbd%d", i);
 		if (!file_exists(path))
+			continue;
+		data.idx = i;
+		data.pid = clone_attach_nbd(path, orig);
+		if (data.pid < 0)
 			return false;
-		if (nbd_busy(i)) {
-			i++;
+		ret = wait_for_uevent(nbd_connected, &data, NBD_TIMEOUT_MS, 100);
+		if (ret < 0) {
+			INFO("Failed to attach %s to %s, trying the next one",
+					orig, path);
 			continue;
 		}
-		if (!clone_attach_nbd(path, orig))
-			return false;
+		if (ret == 0)
+			WARN("%s was not connected after %d ms, going on",
+					path, NBD_TIMEOUT_MS);
 		conf->nbd_idx = i;
 		return true;
 	}
+	ERROR("No free nbd device for %s", orig);
+	return false;
 }
 
 static bool requires_nbd(const char *path)
@@ -2633,14 +4309,9 @@ static int nbd_get_partition(const char *src)
 
 static bool wait_for_partition(const char *path)
 {
-	int count = 0;
-	while (count < 5) {
-		if (file_exists(path))
-			return true;
-		sleep(1);
-		count++;
-	}
-	ERROR("Device %s did not show up after 5 seconds", path);
+	if (wait_for_uevent(nbd_path_exists, (void *)path, NBD_TIMEOUT_MS, 250))
+		return true;
+	ERROR("Device %s did not show up after %d ms", path, NBD_TIMEOUT_MS);
 	return false;
 }
 
@@ -2680,22 +4351,121 @@ static int nbd_mount(struct bdev *bdev)
 	return ret;
 }
 
+/*
+ * 'lxc-create -B nbd --image=X' makes $lxcpath/$lxcname/rootdev.qcow2 a
+ * new overlay of image X, which it reads lazily from, see NBD_OVERLAY.
+ * Creating it costs the same whatever the size of X.
+ */
 static int nbd_create(struct bdev *bdev, const char *dest, const char *n,
 			struct bdev_specs *specs)
 {
-	return -ENOSYS;
+	char *base, *overlay;
+	int ret, len = strlen(dest);
+
+	if (!specs || !specs->nbd.image) {
+		ERROR("nbd: an image to create the container from is needed");
+		return -ENOSYS;
+	}
+	if (len < 8 || strcmp(dest+len-7, "/rootfs") != 0)
+		return -1;
+
+	base = realpath(specs->nbd.image, NULL);
+	if (!base) {
+		SYSERROR("Error resolving %s", specs->nbd.image);
+		return -1;
+	}
+
+	// $lxcpath/$lxcname/rootfs -> $lxcpath/$lxcname/rootdev.qcow2
+	overlay = alloca(len + strlen(NBD_OVERLAY));
+	strcpy(overlay, dest);
+	strcpy(overlay + len - 6, NBD_OVERLAY);
+
+	char *argv[] = {"qemu-img", "create", "-q", "-f", "qcow2",
+			"-F", nbd_probe_qcow2(base) ? "qcow2" : "raw",
+			"-b", base, overlay, NULL};
+	ret = run_cmd(argv);
+	free(base);
+	if (ret < 0) {
+		ERROR("Error creating an overlay of %s", specs->nbd.image);
+		return -1;
+	}
+
+	if (!(bdev->dest = strdup(dest)) || mkdir_p(bdev->dest, 0755) < 0) {
+		ERROR("Error creating %s", dest);
+		return -1;
+	}
+	bdev->src = malloc(strlen(overlay) + 5);
+	if (!bdev->src)
+		return -1;
+	sprintf(bdev->src, "nbd:%s", overlay);
+	return 0;
+}
+
+/* the overlay of nbd:overlay[:partition], if lxc created it */
+static char *nbd_overlay_path(const char *src, char *buf, size_t len)
+{
+	const char *p;
+	int ret;
+
+	ret = snprintf(buf, len, "%s", src + 4);
+	if (ret < 0 || ret >= len)
+		return NULL;
+	p = strrchr(buf, '/');
+	if (!p || strncmp(p + 1, NBD_OVERLAY, strlen(NBD_OVERLAY)) != 0)
+		return NULL;
+	buf[p - buf + 1 + strlen(NBD_OVERLAY)] = '\0';
+	return buf;
 }
 
+/*
+ * A clone, snapshot or not, gets a copy of the overlay, which shares the
+ * backing image and holds only what was written or fetched so far.
+ */
 static int nbd_clonepaths(struct bdev *orig, struct bdev *new, const char *oldname,
 		const char *cname, const char *oldpath, const char *lxcpath, int snap,
 		uint64_t newsize, struct lxc_conf *conf)
 {
-	return -ENOSYS;
+	char opath[MAXPATHLEN], npath[MAXPATHLEN];
+	const char *part;
+	int ret;
+
+	if (strcmp(orig->type, "nbd") != 0 || !orig->src || !orig->dest)
+		return -ENOSYS;
+	if (!nbd_overlay_path(orig->src, opath, sizeof(opath))) {
+		ERROR("nbd: only containers created from an image can be cloned");
+		return -ENOSYS;
+	}
+	part = orig->src + 4 + strlen(opath);
+
+	ret = snprintf(npath, sizeof(npath), "%s/%s/%s", lxcpath, cname,
+		       NBD_OVERLAY);
+	if (ret < 0 || ret >= sizeof(npath))
+		return -1;
+	char *argv[] = {"cp", "--sparse=always", "--reflink=auto", opath,
+			npath, NULL};
+	if (run_cmd(argv) < 0) {
+		ERROR("Error copying %s to %s", opath, npath);
+		return -1;
+	}
+
+	new->dest = dir_new_path(orig->dest, oldname, cname, oldpath, lxcpath);
+	if (!new->dest || mkdir_p(new->dest, 0755) < 0)
+		return -1;
+	new->src = malloc(strlen(npath) + strlen(part) + 5);
+	if (!new->src)
+		return -1;
+	sprintf(new->src, "nbd:%s%s", npath, part);
+	return 0;
 }
 
+/* only the overlays lxc created are removed, never the image itself */
 static int nbd_destroy(struct bdev *orig)
 {
-	return -ENOSYS;
+	char path[MAXPATHLEN];
+
+	if (!nbd_overlay_path(orig->src, path, sizeof(path)))
+		return -ENOSYS;
+	return unlink(path);
 }
 
 static int nbd_umount(struct bdev *bdev)
@@ -2727,6 +4497,7 @@ static const struct bdev_type bdevs[] = {
 	{.name = "dir", .ops = &dir_ops,},
 	{.name = "aufs", .ops = &aufs_ops,},
 	{.name = "overlayfs", .ops = &overlayfs_ops,},
+	{.name = "squashfs", .ops = &squashfs_ops,},
 	{.name = "loop", .ops = &loop_ops,},
 	{.name = "nbd", .ops = &nbd_ops,},
 };
@@ -2744,6 +4515,25 @@ void bdev_put(struct bdev *bdev)
 	free(bdev);
 }
 
+int bdev_restore(struct bdev *bdev, struct bdev *snap, char **old)
+{
+	*old = NULL;
+	if (strcmp(bdev->type, snap->type) != 0 || !bdev->ops->restore)
+		return 1;
+	/* the copies would have to be made as the container's root */
+	if (am_unpriv())
+		return 1;
+	return bdev->ops->restore(bdev, snap, old);
+}
+
+int bdev_rename(struct bdev *bdev, const char *oldname, const char *newname,
+		const char *lxcpath)
+{
+	if (!bdev->ops->rename)
+		return 0;
+	return bdev->ops->rename(bdev, oldname, newname, lxcpath);
+}
+
 struct bdev *bdev_get(const char *type)
 {
 	int i;
@@ -2846,8 +4636,8 @@ static int rsync_rootfs(struct rsync_data *data)
 		ERROR("Failed to setuid to 0");
 		return -1;
 	}
-	if (do_rsync(orig->dest, new->dest) < 0) {
-		ERROR("rsyncing %s to %s", orig->src, new->src);
+	if (lxc_copy_tree(orig->dest, new->dest) < 0) {
+		ERROR("copying %s to %s", orig->src, new->src);
 		return -1;
 	}
 
@@ -2957,6 +4747,24 @@ struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
 	if (maybe_snap && keepbdevtype && !bdevtype && !orig->ops->can_snapshot)
 		snap = false;
 
+	/*
+	 * A directory which can be copied by reflinking its files gets a
+	 * copy rather than a snapshot: it costs about the same and doesn't
+	 * leave the clone depending on the original.
+	 */
+	if (snap && strcmp(orig->type, "dir") == 0 &&
+			(!bdevtype || strcmp(bdevtype, "dir") == 0)) {
+		char newdest[MAXPATHLEN];
+
+		ret = snprintf(newdest, MAXPATHLEN, "%s/%s/rootfs", lxcpath, cname);
+		if (ret > 0 && ret < MAXPATHLEN &&
+				lxc_copy_can_reflink(orig->dest, newdest)) {
+			INFO("reflinking %s instead of snapshotting it", orig->dest);
+			snap = false;
+			bdevtype = "dir";
+		}
+	}
+
 	/*
 	 * If newtype is NULL and snapshot is set, then use overlayfs
 	 */
@@ -2974,6 +4782,10 @@ struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
 			(strcmp(bdevtype, "aufs") == 0 ||
 			 strcmp(bdevtype, "overlayfs") == 0))
 		*needs_rdep = 1;
+	if (snap && strcmp(orig->type, "overlayfs") == 0 &&
+			(!bdevtype || strcmp(bdevtype, "overlayfs") == 0) &&
+			overlayfs_can_stack(orig->src))
+		*needs_rdep = 1;
 
 	new = bdev_get(bdevtype ? bdevtype : orig->type);
 	if (!new) {
@@ -3033,6 +4845,7 @@ struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
 		return new;
 	}
 
+	lxc_io_throttle();
 	data.orig = orig;
 	data.new = new;
 	if (am_unpriv())
@@ -3131,6 +4944,7 @@ bool rootfs_is_blockdev(struct lxc_conf *conf)
 		return false;
 	if (strcmp(q->name, "lvm") == 0 ||
 		strcmp(q->name, "loop") == 0 ||
+		strcmp(q->name, "squashfs") == 0 ||
 		strcmp(q->name, "nbd") == 0)
 		return true;
 	return false;
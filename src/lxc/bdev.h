@@ -24,7 +24,8 @@
 #ifndef __LXC_BDEV_H
 #define __LXC_BDEV_H
 /* blockdev operations for:
- * aufs, dir, raw, btrfs, overlayfs, aufs, lvm, loop, zfs, nbd (qcow2, raw, vdi, qed)
+ * aufs, dir, raw, btrfs, overlayfs, aufs, lvm, loop, zfs, nbd (qcow2, raw, vdi, qed),
+ * squashfs
  */
 
 #include "config.h"
@@ -46,6 +47,18 @@ struct bdev_ops {
 	int (*clone_paths)(struct bdev *orig, struct bdev *new, const char *oldname,
 			const char *cname, const char *oldpath, const char *lxcpath,
 			int snap, uint64_t newsize, struct lxc_conf *conf);
+	/*
+	 * make bdev a copy of snap, of the same type, in place.  What bdev
+	 * held is left at *old for the caller to remove, unless NULL.
+	 */
+	int (*restore)(struct bdev *bdev, struct bdev *snap, char **old);
+	/*
+	 * the container was renamed from oldname to newname in lxcpath, its
+	 * directory already moved: rename what else is named after it and
+	 * update src.  Unset when nothing outside the directory is.
+	 */
+	int (*rename)(struct bdev *bdev, const char *oldname,
+			const char *newname, const char *lxcpath);
 	bool can_snapshot;
 };
 
@@ -95,6 +108,21 @@ struct bdev *bdev_create(const char *dest, const char *type,
 			const char *cname, struct bdev_specs *specs);
 void bdev_put(struct bdev *bdev);
 
+/*
+ * Restore @snap over @bdev without destroying and cloning it: 0 if done,
+ * with *@old as for bdev_ops.restore, 1 if the backing store can't, or
+ * -1 on error, @bdev being left as it was.
+ */
+int bdev_restore(struct bdev *bdev, struct bdev *snap, char **old);
+
+/*
+ * After the directory of container @oldname in @lxcpath was renamed to
+ * @newname, rename its backing store along if it is named after it, as
+ * lvm and zfs ones are.  @bdev->src is then the new one.
+ */
+int bdev_rename(struct bdev *bdev, const char *oldname, const char *newname,
+		const char *lxcpath);
+
 /*
  * these are really for qemu-nbd support, as container shutdown
  * must explicitly request device detach.
@@ -30,6 +30,8 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/param.h>
@@ -121,6 +123,7 @@ struct cgfs_data {
 	const char *cgroup_pattern;
 	struct cgroup_meta_data *meta;
 	struct cgroup_process_info *info;
+	int nrtasks_fd; /* the cgroup counted by cgfs_nrtasks(), kept open */
 };
 
 lxc_log_define(lxc_cgfs, lxc);
@@ -136,10 +139,8 @@ static char *cgroup_to_absolute_path(struct cgroup_mount_point *mp, const char *
 static struct cgroup_process_info *find_info_for_subsystem(struct cgroup_process_info *info, const char *subsystem);
 static int do_cgroup_get(const char *cgroup_path, const char *sub_filename, char *value, size_t len);
 static int do_cgroup_set(const char *cgroup_path, const char *sub_filename, const char *value);
-static bool cgroup_devices_has_allow_or_deny(struct cgfs_data *d, char *v, bool for_allow);
 static int do_setup_cgroup_limits(struct cgfs_data *d, struct lxc_list *cgroup_settings, bool do_devices);
-static int cgroup_recursive_task_count(const char *cgroup_path);
-static int count_lines(const char *fn);
+static int cgroup_task_count_at(int dirfd);
 static int handle_cgroup_settings(struct cgroup_mount_point *mp, char *cgroup_path);
 static bool init_cpuset_if_needed(struct cgroup_mount_point *mp, const char *path);
 
@@ -153,76 +154,73 @@ static void lxc_cgroup_process_info_free_and_remove(struct cgroup_process_info *
 
 static struct cgroup_ops cgfs_ops;
 
-static int cgroup_rmdir(char *dirname)
+/*
+ * Remove cgroup @name below @parentfd along with all the cgroups below
+ * it.  Only directories are looked at, the files of a cgroup go away
+ * with it.
+ */
+static int cgroup_rmdir_at(int parentfd, const char *name)
 {
-	struct dirent dirent, *direntp;
+	struct dirent *direntp;
+	struct stat mystat;
 	int saved_errno = 0;
 	DIR *dir;
-	int ret, failed=0;
-	char pathname[MAXPATHLEN];
+	int fd, failed = 0;
 
-	dir = opendir(dirname);
-	if (!dir) {
-		ERROR("%s: failed to open %s", __func__, dirname);
+	fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || !(dir = fdopendir(fd))) {
+		SYSERROR("%s: failed to open %s", __func__, name);
+		if (fd >= 0)
+			close(fd);
 		return -1;
 	}
 
-	while (!readdir_r(dir, &dirent, &direntp)) {
-		struct stat mystat;
-		int rc;
-
-		if (!direntp)
-			break;
-
+	while ((direntp = readdir(dir))) {
 		if (!strcmp(direntp->d_name, ".") ||
 		    !strcmp(direntp->d_name, ".."))
 			continue;
 
-		rc = snprintf(pathname, MAXPATHLEN, "%s/%s", dirname, direntp->d_name);
-		if (rc < 0 || rc >= MAXPATHLEN) {
-			ERROR("pathname too long");
-			failed=1;
-			if (!saved_errno)
-				saved_errno = -ENOMEM;
-			continue;
-		}
-		ret = lstat(pathname, &mystat);
-		if (ret) {
-			SYSERROR("%s: failed to stat %s", __func__, pathname);
-			failed=1;
-			if (!saved_errno)
-				saved_errno = errno;
-			continue;
-		}
-		if (S_ISDIR(mystat.st_mode)) {
-			if (cgroup_rmdir(pathname) < 0) {
+		if (direntp->d_type == DT_UNKNOWN) {
+			if (fstatat(fd, direntp->d_name, &mystat,
+				    AT_SYMLINK_NOFOLLOW) < 0) {
+				SYSERROR("%s: failed to stat %s", __func__,
+					 direntp->d_name);
 				if (!saved_errno)
 					saved_errno = errno;
-				failed=1;
+				failed = 1;
+				continue;
 			}
+			if (!S_ISDIR(mystat.st_mode))
+				continue;
+		} else if (direntp->d_type != DT_DIR) {
+			continue;
 		}
-	}
 
-	if (rmdir(dirname) < 0) {
-		SYSERROR("%s: failed to delete %s", __func__, dirname);
-		if (!saved_errno)
-			saved_errno = errno;
-		failed=1;
+		if (cgroup_rmdir_at(fd, direntp->d_name) < 0) {
+			if (!saved_errno)
+				saved_errno = errno;
+			failed = 1;
+		}
 	}
+	closedir(dir);
 
-	ret = closedir(dir);
-	if (ret) {
-		SYSERROR("%s: failed to close directory %s", __func__, dirname);
+	if (unlinkat(parentfd, name, AT_REMOVEDIR) < 0) {
+		SYSERROR("%s: failed to delete %s", __func__, name);
 		if (!saved_errno)
 			saved_errno = errno;
-		failed=1;
+		failed = 1;
 	}
 
 	errno = saved_errno;
 	return failed ? -1 : 0;
 }
 
-static struct cgroup_meta_data *lxc_cgroup_load_meta()
+static int cgroup_rmdir(char *dirname)
+{
+	return cgroup_rmdir_at(AT_FDCWD, dirname);
+}
+
+static struct cgroup_meta_data *lxc_cgroup_read_meta(void)
 {
 	const char *cgroup_use = NULL;
 	char **cgroup_use_list = NULL;
@@ -241,7 +239,81 @@ static struct cgroup_meta_data *lxc_cgroup_load_meta()
 
 	md = lxc_cgroup_load_meta2((const char **)cgroup_use_list);
 	saved_errno = errno;
-	lxc_free_array((void **)cgroup_use_list, free);
+	free(cgroup_use_list);
+	errno = saved_errno;
+	return md;
+}
+
+/*
+ * The meta data is shared by the whole process, it only changes when
+ * cgroup hierarchies get mounted or unmounted.  Our mountinfo is kept
+ * open to learn about that: poll() reports POLLPRI on it when the mount
+ * table changed since the last poll.  A forked child or a process which
+ * moved to another mount namespace reads the meta data again.
+ */
+static pthread_mutex_t meta_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cgroup_meta_data *meta_cache;
+static int meta_cache_fd = -1;
+static pid_t meta_cache_pid;
+static ino_t meta_cache_ns;
+
+static ino_t mount_ns_ino(void)
+{
+	struct stat st;
+
+	if (stat("/proc/self/ns/mnt", &st) < 0)
+		return 0;
+	return st.st_ino;
+}
+
+/* called with meta_cache_lock held */
+static bool meta_cache_valid(void)
+{
+	struct pollfd pfd;
+
+	if (meta_cache_pid != getpid()) {
+		/* the fd may have been closed and reused since the fork */
+		meta_cache_fd = -1;
+		return false;
+	}
+	if (!meta_cache || meta_cache_fd < 0 || meta_cache_ns != mount_ns_ino())
+		return false;
+
+	pfd.fd = meta_cache_fd;
+	pfd.events = POLLPRI;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) == 0;
+}
+
+static struct cgroup_meta_data *lxc_cgroup_load_meta(void)
+{
+	struct cgroup_meta_data *md;
+	int saved_errno;
+
+	pthread_mutex_lock(&meta_cache_lock);
+	if (meta_cache_valid()) {
+		md = lxc_cgroup_get_meta(meta_cache);
+		goto out;
+	}
+
+	lxc_cgroup_put_meta(meta_cache);
+	meta_cache = NULL;
+	if (meta_cache_fd < 0 || meta_cache_pid != getpid() ||
+	    meta_cache_ns != mount_ns_ino()) {
+		if (meta_cache_fd >= 0)
+			close(meta_cache_fd);
+		/* open it first so that changes made while reading count */
+		meta_cache_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+		meta_cache_pid = getpid();
+		meta_cache_ns = mount_ns_ino();
+	}
+
+	md = lxc_cgroup_read_meta();
+	if (md && meta_cache_fd >= 0)
+		meta_cache = lxc_cgroup_get_meta(md);
+out:
+	saved_errno = errno;
+	pthread_mutex_unlock(&meta_cache_lock);
 	errno = saved_errno;
 	return md;
 }
@@ -488,7 +560,7 @@ static bool find_hierarchy_mountpts( struct cgroup_meta_data *meta_data, char **
 				break;
 			}
 		}
-		lxc_free_array((void **)subsystems, free);
+		free(subsystems);
 
 		r = lxc_grow_array((void ***)&meta_data->mount_points, &mount_point_capacity, mount_point_count + 1, 12);
 		if (r < 0)
@@ -591,7 +663,7 @@ out_error:
 
 static struct cgroup_meta_data *lxc_cgroup_get_meta(struct cgroup_meta_data *meta_data)
 {
-	meta_data->ref++;
+	__sync_fetch_and_add(&meta_data->ref, 1);
 	return meta_data;
 }
 
@@ -600,7 +672,7 @@ static struct cgroup_meta_data *lxc_cgroup_put_meta(struct cgroup_meta_data *met
 	size_t i;
 	if (!meta_data)
 		return NULL;
-	if (--meta_data->ref > 0)
+	if (__sync_sub_and_fetch(&meta_data->ref, 1) > 0)
 		return meta_data;
 	lxc_free_array((void **)meta_data->mount_points, (lxc_free_fn)lxc_cgroup_mount_point_free);
 	if (meta_data->hierarchies) {
@@ -1034,7 +1106,7 @@ static struct cgroup_process_info *lxc_cgroupfs_create(const char *name, const c
 	free(new_cgroup_paths);
 	free(new_cgroup_paths_sub);
 	free(path_so_far);
-	lxc_free_array((void **)cgroup_path_components, free);
+	free(cgroup_path_components);
 	return base_info;
 
 out_initial_error:
@@ -1043,11 +1115,343 @@ out_initial_error:
 	lxc_cgroup_process_info_free_and_remove(base_info);
 	lxc_free_array((void **)new_cgroup_paths, free);
 	lxc_free_array((void **)new_cgroup_paths_sub, free);
-	lxc_free_array((void **)cgroup_path_components, free);
+	free(cgroup_path_components);
 	errno = saved_errno;
 	return NULL;
 }
 
+/*
+ * The warm pool: with lxc.cgroup.pool set, up to that many empty cgroups
+ * are kept next to the containers' ones, already initialized like
+ * lxc_cgroupfs_create() would.  A starting container claims one by
+ * renaming it to its own name instead of creating its cgroups afresh.
+ *
+ * The pool only works for patterns ending in a single "%n" component
+ * without subgroup, and not along with the legacy ns cgroup.  An entry
+ * is created in the first hierarchy last, and claimed or removed by
+ * renaming or removing it there first, so that whoever manages to do
+ * that owns it in all the other hierarchies.
+ */
+#define CGROUP_POOL_PREFIX ".lxc-pool-"
+
+static int cgroup_pool_size(void)
+{
+	const char *v = lxc_global_config_value("lxc.cgroup.pool");
+
+	return v ? atoi(v) : 0;
+}
+
+/* the path components of @pattern before its final "%n" */
+static bool cgroup_pool_parent(const char *pattern, char **parent)
+{
+	char **parts, **p;
+	bool ret = false;
+
+	parts = lxc_normalize_path(pattern);
+	if (!parts || !parts[0])
+		goto out;
+	for (p = parts; p[1]; p++)
+		if (strstr(*p, "%n"))
+			goto out;
+	if (strcmp(*p, "%n"))
+		goto out;
+
+	*p = NULL;
+	*parent = lxc_string_join("/", (const char **)parts, false);
+	ret = *parent != NULL;
+out:
+	free(parts);
+	return ret;
+}
+
+/* the cgroup @leaf below @parent in the hierarchy of @info */
+static char *cgroup_pool_path(struct cgroup_process_info *info,
+			      const char *parent, const char *leaf)
+{
+	const char *parts[4];
+	int n = 0;
+
+	parts[n++] = !strcmp(info->cgroup_path, "/") ? "" : info->cgroup_path;
+	if (*parent)
+		parts[n++] = parent;
+	if (leaf)
+		parts[n++] = leaf;
+	parts[n] = NULL;
+	if (n == 1 && !*parts[0])
+		return strdup("/");
+	return lxc_string_join("/", parts, false);
+}
+
+static char *cgroup_pool_abs_path(struct cgroup_process_info *info,
+				  const char *parent, const char *leaf)
+{
+	char *path, *abs;
+
+	path = cgroup_pool_path(info, parent, leaf);
+	if (!path)
+		return NULL;
+	abs = cgroup_to_absolute_path(info->designated_mount_point, path, NULL);
+	free(path);
+	return abs;
+}
+
+/* the cgroups the pool of @pattern lives in, with their mount points */
+static struct cgroup_process_info *cgroup_pool_base(const char *pattern,
+		struct cgroup_meta_data *meta_data)
+{
+	struct cgroup_process_info *base_info, *info_ptr;
+
+	base_info = (pattern[0] == '/') ?
+		lxc_cgroup_process_info_get_init(meta_data) :
+		lxc_cgroup_process_info_get_self(meta_data);
+	if (!base_info)
+		return NULL;
+
+	for (info_ptr = base_info; info_ptr; info_ptr = info_ptr->next) {
+		if (lxc_string_in_array("ns", (const char **)info_ptr->hierarchy->subsystems))
+			goto err;
+		info_ptr->designated_mount_point = lxc_cgroup_find_mount_point(info_ptr->hierarchy, info_ptr->cgroup_path, true);
+		if (!info_ptr->designated_mount_point)
+			goto err;
+	}
+	return base_info;
+
+err:
+	lxc_cgroup_process_info_free(base_info);
+	return NULL;
+}
+
+/*
+ * Rename @from to @to in all hierarchies, putting back what was renamed
+ * already if that fails in one of them.
+ */
+static int cgroup_pool_rename(struct cgroup_process_info *base_info,
+			      const char *parent, const char *from,
+			      const char *to)
+{
+	struct cgroup_process_info *info_ptr, *undo;
+	char *oldpath, *newpath;
+	int r, saved_errno;
+
+	for (info_ptr = base_info; info_ptr; info_ptr = info_ptr->next) {
+		oldpath = cgroup_pool_abs_path(info_ptr, parent, from);
+		newpath = cgroup_pool_abs_path(info_ptr, parent, to);
+		r = (oldpath && newpath) ? rename(oldpath, newpath) : -1;
+		saved_errno = errno;
+		free(oldpath);
+		free(newpath);
+		if (r == 0)
+			continue;
+
+		for (undo = base_info; undo != info_ptr; undo = undo->next) {
+			oldpath = cgroup_pool_abs_path(undo, parent, to);
+			newpath = cgroup_pool_abs_path(undo, parent, from);
+			if (!oldpath || !newpath || rename(oldpath, newpath))
+				WARN("failed to return cgroup %s to the pool", from);
+			free(oldpath);
+			free(newpath);
+		}
+		errno = saved_errno;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Claim a cgroup from the pool for container @name.  Returns NULL if the
+ * pool is empty or unusable, or @name is taken, in which case the
+ * caller creates the cgroups the usual way.
+ */
+static struct cgroup_process_info *cgroup_pool_claim(const char *name,
+		const char *pattern, struct cgroup_meta_data *meta_data)
+{
+	struct cgroup_process_info *base_info, *info_ptr;
+	struct dirent *direntp;
+	char *parent = NULL, *dirpath, *path;
+	bool claimed = false;
+	DIR *dir;
+
+	if (!is_valid_cgroup(name))
+		return NULL;
+	base_info = cgroup_pool_base(pattern, meta_data);
+	if (!base_info)
+		return NULL;
+	if (!cgroup_pool_parent(pattern, &parent))
+		goto err;
+
+	dirpath = cgroup_pool_abs_path(base_info, parent, NULL);
+	if (!dirpath)
+		goto err;
+	dir = opendir(dirpath);
+	free(dirpath);
+	if (!dir)
+		goto err;
+	while ((direntp = readdir(dir))) {
+		if (strncmp(direntp->d_name, CGROUP_POOL_PREFIX,
+			    strlen(CGROUP_POOL_PREFIX)))
+			continue;
+		if (!cgroup_pool_rename(base_info, parent, direntp->d_name, name)) {
+			claimed = true;
+			break;
+		}
+		/* someone else claimed that one first */
+		if (errno != ENOENT)
+			break;
+	}
+	closedir(dir);
+	if (!claimed)
+		goto err;
+
+	for (info_ptr = base_info; info_ptr; info_ptr = info_ptr->next) {
+		path = cgroup_pool_path(info_ptr, parent, name);
+		if (!path)
+			goto err_remove;
+		free(info_ptr->cgroup_path);
+		info_ptr->cgroup_path = path;
+		if (lxc_grow_array((void ***)&info_ptr->created_paths, &info_ptr->created_paths_capacity, info_ptr->created_paths_count + 1, 8) < 0)
+			goto err_remove;
+		info_ptr->created_paths[info_ptr->created_paths_count] = strdup(path);
+		if (!info_ptr->created_paths[info_ptr->created_paths_count])
+			goto err_remove;
+		info_ptr->created_paths_count++;
+	}
+	free(parent);
+	DEBUG("claimed a pooled cgroup for %s", name);
+	return base_info;
+
+err_remove:
+	/* the claimed cgroups can't be returned now, so drop them */
+	for (info_ptr = base_info; info_ptr; info_ptr = info_ptr->next) {
+		path = cgroup_pool_abs_path(info_ptr, parent, name);
+		if (path)
+			rmdir(path);
+		free(path);
+	}
+err:
+	free(parent);
+	lxc_cgroup_process_info_free(base_info);
+	return NULL;
+}
+
+/* remove pooled cgroup @leaf from all hierarchies, unless it was claimed */
+static void cgroup_pool_remove(struct cgroup_process_info *base_info,
+			       const char *parent, const char *leaf)
+{
+	struct cgroup_process_info *info_ptr;
+	char *path;
+
+	for (info_ptr = base_info; info_ptr; info_ptr = info_ptr->next) {
+		path = cgroup_pool_abs_path(info_ptr, parent, leaf);
+		if (path && rmdir(path) < 0 && info_ptr == base_info) {
+			free(path);
+			return;
+		}
+		free(path);
+	}
+}
+
+/* create pooled cgroup @leaf, in the first hierarchy last */
+static bool cgroup_pool_add(struct cgroup_process_info **infos, int n,
+			    const char *parent, const char *leaf)
+{
+	struct cgroup_mount_point *mp;
+	char *path;
+	int i, j;
+	bool ok;
+
+	for (i = n - 1; i >= 0; i--) {
+		mp = infos[i]->designated_mount_point;
+		path = cgroup_pool_path(infos[i], parent, leaf);
+		ok = path && create_cgroup(mp, path) == 0;
+		if (ok && !init_cpuset_if_needed(mp, path)) {
+			remove_cgroup(mp, path, false);
+			ok = false;
+		}
+		free(path);
+		if (ok)
+			continue;
+
+		SYSERROR("failed to add cgroup %s to the pool", leaf);
+		for (j = i + 1; j < n; j++) {
+			path = cgroup_pool_path(infos[j], parent, leaf);
+			if (path)
+				remove_cgroup(infos[j]->designated_mount_point, path, false);
+			free(path);
+		}
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Bring the pool of @pattern back to @size cgroups, removing the excess
+ * if it was shrunk since.
+ */
+static void cgroup_pool_refill(const char *pattern,
+			       struct cgroup_meta_data *meta_data, int size)
+{
+	static unsigned int seq;
+	struct cgroup_process_info *base_info, *info_ptr, **infos = NULL;
+	struct dirent *direntp;
+	char *parent = NULL, *dirpath, *path, leaf[64];
+	int n = 0, count = 0;
+	DIR *dir;
+
+	base_info = cgroup_pool_base(pattern, meta_data);
+	if (!base_info)
+		return;
+	if (!cgroup_pool_parent(pattern, &parent))
+		goto out;
+
+	dirpath = cgroup_pool_abs_path(base_info, parent, NULL);
+	if (!dirpath)
+		goto out;
+	dir = opendir(dirpath);
+	free(dirpath);
+	if (!dir)
+		goto out;
+	while ((direntp = readdir(dir))) {
+		if (strncmp(direntp->d_name, CGROUP_POOL_PREFIX,
+			    strlen(CGROUP_POOL_PREFIX)))
+			continue;
+		if (++count > size)
+			cgroup_pool_remove(base_info, parent, direntp->d_name);
+	}
+	closedir(dir);
+	if (count >= size)
+		goto out;
+
+	for (info_ptr = base_info; info_ptr; info_ptr = info_ptr->next)
+		n++;
+	infos = malloc(n * sizeof(*infos));
+	if (!infos)
+		goto out;
+	n = 0;
+	for (info_ptr = base_info; info_ptr; info_ptr = info_ptr->next) {
+		path = cgroup_pool_path(info_ptr, parent, NULL);
+		if (!path)
+			goto out;
+		if (handle_cgroup_settings(info_ptr->designated_mount_point, path) < 0) {
+			free(path);
+			goto out;
+		}
+		free(path);
+		infos[n++] = info_ptr;
+	}
+
+	for (; count < size; count++) {
+		snprintf(leaf, sizeof(leaf), CGROUP_POOL_PREFIX "%d-%u",
+			 (int)getpid(), __sync_fetch_and_add(&seq, 1));
+		if (!cgroup_pool_add(infos, n, parent, leaf))
+			break;
+	}
+
+out:
+	free(infos);
+	free(parent);
+	lxc_cgroup_process_info_free(base_info);
+}
+
 static int lxc_cgroup_create_legacy(struct cgroup_process_info *base_info, const char *name, pid_t pid)
 {
 	struct cgroup_process_info *info_ptr;
@@ -1096,7 +1500,6 @@ static struct cgroup_process_info *lxc_cgroup_get_container_info(const char *nam
 		/* use the command interface to look for the cgroup */
 		path = lxc_cmd_get_cgroup_path(name, lxcpath, h->subsystems[0]);
 		if (!path) {
-			h->used = false;
 			WARN("Not attaching to cgroup %s unknown to %s %s", h->subsystems[0], lxcpath, name);
 			continue;
 		}
@@ -1183,35 +1586,65 @@ void lxc_cgroup_process_info_free(struct cgroup_process_info *info)
 	lxc_cgroup_process_info_free(next);
 }
 
-/* free process membership information and remove cgroups that were created */
-void lxc_cgroup_process_info_free_and_remove(struct cgroup_process_info *info)
+static void *cgroup_rmdir_thread(void *dirname)
 {
-	struct cgroup_process_info *next;
-	char **pp;
-	if (!info)
+	(void)cgroup_rmdir(dirname);
+	return NULL;
+}
+
+/*
+ * Remove the cgroups of @info in all hierarchies, each in a thread of
+ * its own so that deep trees don't add up.  As for a single cgroup,
+ * failing is not an error: perhaps we created the '/lxc' cgroup in this
+ * container but another container is still running (for example).
+ */
+static void cgroup_rmdir_all(struct cgroup_process_info *info)
+{
+	struct cgroup_process_info *info_ptr;
+	struct cgroup_mount_point *mp;
+	pthread_t *threads;
+	bool *started;
+	char **paths;
+	int i, n = 0;
+
+	for (info_ptr = info; info_ptr; info_ptr = info_ptr->next)
+		n++;
+	if (!n)
 		return;
-	next = info->next;
-	{
-		struct cgroup_mount_point *mp = info->designated_mount_point;
+	paths = alloca(n * sizeof(*paths));
+	threads = alloca(n * sizeof(*threads));
+	started = alloca(n * sizeof(*started));
+
+	for (i = 0, info_ptr = info; info_ptr; info_ptr = info_ptr->next, i++) {
+		started[i] = false;
+		mp = info_ptr->designated_mount_point;
 		if (!mp)
-			mp = lxc_cgroup_find_mount_point(info->hierarchy, info->cgroup_path, true);
-		if (mp)
-			/* ignore return value here, perhaps we created the
-			 * '/lxc' cgroup in this container but another container
-			 * is still running (for example)
-			 */
-			(void)remove_cgroup(mp, info->cgroup_path, true);
+			mp = lxc_cgroup_find_mount_point(info_ptr->hierarchy, info_ptr->cgroup_path, true);
+		paths[i] = mp ? cgroup_to_absolute_path(mp, info_ptr->cgroup_path, NULL) : NULL;
+		if (!paths[i])
+			continue;
+		/* the last one is done while waiting for the others */
+		if (i < n - 1 && !pthread_create(&threads[i], NULL,
+						 cgroup_rmdir_thread, paths[i]))
+			started[i] = true;
+		else
+			(void)cgroup_rmdir(paths[i]);
 	}
-	for (pp = info->created_paths; pp && *pp; pp++);
-	for ((void)(pp && --pp); info->created_paths && pp >= info->created_paths; --pp) {
-		free(*pp);
+
+	for (i = 0; i < n; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		free(paths[i]);
 	}
-	free(info->created_paths);
-	lxc_cgroup_put_meta(info->meta_ref);
-	free(info->cgroup_path);
-	free(info->cgroup_path_sub);
-	free(info);
-	lxc_cgroup_process_info_free_and_remove(next);
+}
+
+/* free process membership information and remove cgroups that were created */
+void lxc_cgroup_process_info_free_and_remove(struct cgroup_process_info *info)
+{
+	if (!info)
+		return;
+	cgroup_rmdir_all(info);
+	lxc_cgroup_process_info_free(info);
 }
 
 static char *lxc_cgroup_get_hierarchy_path_data(const char *subsystem, struct cgfs_data *d)
@@ -1273,24 +1706,6 @@ out1:
 	return result;
 }
 
-static int lxc_cgroup_set_data(const char *filename, const char *value, struct cgfs_data *d)
-{
-	char *subsystem = NULL, *p, *path;
-	int ret = -1;
-
-	subsystem = alloca(strlen(filename) + 1);
-	strcpy(subsystem, filename);
-	if ((p = index(subsystem, '.')) != NULL)
-		*p = '\0';
-
-	path = lxc_cgroup_get_hierarchy_abs_path_data(subsystem, d);
-	if (path) {
-		ret = do_cgroup_set(path, filename, value);
-		free(path);
-	}
-	return ret;
-}
-
 static int lxc_cgroupfs_set(const char *filename, const char *value, const char *name, const char *lxcpath)
 {
 	char *subsystem = NULL, *p, *path;
@@ -1545,19 +1960,27 @@ out_error:
 	return false;
 }
 
+/*
+ * Called every second by the utmp watcher while the container shuts down,
+ * so the cgroup is looked up and opened once and then counted through
+ * that fd.
+ */
 static int cgfs_nrtasks(void *hdata)
 {
 	struct cgfs_data *d = hdata;
 	struct cgroup_process_info *info;
 	struct cgroup_mount_point *mp = NULL;
 	char *abs_path = NULL;
-	int ret;
+	int fd;
 
 	if (!d) {
 		errno = ENOENT;
 		return -1;
 	}
 
+	if (d->nrtasks_fd >= 0)
+		goto count;
+
 	info = d->info;
 	if (!info) {
 		errno = ENOENT;
@@ -1576,9 +1999,19 @@ static int cgfs_nrtasks(void *hdata)
 	if (!abs_path)
 		return -1;
 
-	ret = cgroup_recursive_task_count(abs_path);
+	d->nrtasks_fd = open(abs_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 	free(abs_path);
-	return ret;
+	if (d->nrtasks_fd < 0)
+		return 0;
+
+count:
+	/* the walk below reads the directory from the shared offset */
+	if (lseek(d->nrtasks_fd, 0, SEEK_SET) < 0)
+		return -1;
+	fd = fcntl(d->nrtasks_fd, F_DUPFD_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	return cgroup_task_count_at(fd);
 }
 
 static struct cgroup_process_info *
@@ -1681,12 +2114,8 @@ out_error:
 static char **subsystems_from_mount_options(const char *mount_options,
 					    char **kernel_list)
 {
+	struct lxc_strv sv = LXC_STRV_INIT;
 	char *token, *str, *saveptr = NULL;
-	char **result = NULL;
-	size_t result_capacity = 0;
-	size_t result_count = 0;
-	int saved_errno;
-	int r;
 
 	str = alloca(strlen(mount_options)+1);
 	strcpy(str, mount_options);
@@ -1696,24 +2125,16 @@ static char **subsystems_from_mount_options(const char *mount_options,
 		 * with name= for named hierarchies
 		 */
 		if (!strncmp(token, "name=", 5) || lxc_string_in_array(token, (const char **)kernel_list)) {
-			r = lxc_grow_array((void ***)&result, &result_capacity, result_count + 1, 12);
-			if (r < 0)
-				goto out_free;
-			result[result_count + 1] = NULL;
-			result[result_count] = strdup(token);
-			if (!result[result_count])
-				goto out_free;
-			result_count++;
+			if (lxc_strv_add(&sv, token, strlen(token)) < 0) {
+				lxc_strv_free(&sv);
+				return NULL;
+			}
 		}
 	}
 
-	return result;
-
-out_free:
-	saved_errno = errno;
-	lxc_free_array((void**)result, free);
-	errno = saved_errno;
-	return NULL;
+	if (!sv.count)
+		return NULL;
+	return lxc_strv_finish(&sv);
 }
 
 static void lxc_cgroup_mount_point_free(struct cgroup_mount_point *mp)
@@ -1729,7 +2150,7 @@ static void lxc_cgroup_hierarchy_free(struct cgroup_hierarchy *h)
 {
 	if (!h)
 		return;
-	lxc_free_array((void **)h->subsystems, free);
+	free(h->subsystems);
 	free(h->all_mount_points);
 	free(h);
 }
@@ -1883,11 +2304,235 @@ static int do_cgroup_set(const char *cgroup_path, const char *sub_filename,
 	return ret;
 }
 
+/*
+ * While setting up the limits of a container, the cgroup directory of
+ * each subsystem is opened once and the file last written to is kept
+ * open, so runs of lines for the same file (typically devices.allow)
+ * become writes to a single fd.  The devices whitelist is read once and
+ * then kept up to date with what was written.
+ *
+ * @subsystems/@dirfds: the directories opened so far, -1 if it failed
+ * @file/@fd          : the file last written to
+ * @devices_read      : @devices_all and @devices hold the whitelist
+ * @devices_all       : the whitelist is "a *:* rwm"
+ * @devices           : the other entries of the whitelist
+ */
+struct cgroup_limits {
+	struct cgfs_data *d;
+	char **subsystems;
+	int *dirfds;
+	size_t count;
+	char *file;
+	int fd;
+	bool devices_read;
+	bool devices_all;
+	char **devices;
+	size_t devices_count;
+	size_t devices_capacity;
+};
+
+static void cgroup_limits_free(struct cgroup_limits *l)
+{
+	size_t i;
+
+	for (i = 0; i < l->count; i++) {
+		if (l->dirfds[i] >= 0)
+			close(l->dirfds[i]);
+		free(l->subsystems[i]);
+	}
+	free(l->subsystems);
+	free(l->dirfds);
+	if (l->fd >= 0)
+		close(l->fd);
+	free(l->file);
+	lxc_free_array((void **)l->devices, free);
+}
+
+static int cgroup_limits_dirfd(struct cgroup_limits *l, const char *filename)
+{
+	char *subsystem, *path, **subsystems;
+	size_t i, len;
+	int *dirfds;
+
+	len = strcspn(filename, ".");
+	for (i = 0; i < l->count; i++)
+		if (strlen(l->subsystems[i]) == len &&
+		    !strncmp(l->subsystems[i], filename, len))
+			return l->dirfds[i];
+
+	subsystem = strndup(filename, len);
+	if (!subsystem)
+		return -1;
+	subsystems = realloc(l->subsystems, (l->count + 1) * sizeof(*subsystems));
+	if (subsystems)
+		l->subsystems = subsystems;
+	dirfds = realloc(l->dirfds, (l->count + 1) * sizeof(*dirfds));
+	if (dirfds)
+		l->dirfds = dirfds;
+	if (!subsystems || !dirfds) {
+		free(subsystem);
+		return -1;
+	}
+
+	l->subsystems[l->count] = subsystem;
+	l->dirfds[l->count] = -1;
+	path = lxc_cgroup_get_hierarchy_abs_path_data(subsystem, l->d);
+	if (path) {
+		l->dirfds[l->count] = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (l->dirfds[l->count] < 0)
+			SYSERROR("failed to open %s", path);
+		free(path);
+	}
+	return l->dirfds[l->count++];
+}
+
+static int cgroup_limits_write(struct cgroup_limits *l, const char *filename,
+			       const char *value)
+{
+	size_t len = strlen(value);
+	int dirfd;
+
+	if (!l->file || strcmp(l->file, filename)) {
+		if (l->fd >= 0)
+			close(l->fd);
+		free(l->file);
+		l->file = NULL;
+
+		dirfd = cgroup_limits_dirfd(l, filename);
+		if (dirfd < 0)
+			return -1;
+		l->fd = openat(dirfd, filename, O_WRONLY | O_CLOEXEC);
+		if (l->fd < 0)
+			return -1;
+		l->file = strdup(filename);
+		if (!l->file)
+			return -1;
+	}
+
+	if (write(l->fd, value, len) != len)
+		return -1;
+	return 0;
+}
+
+static bool cgroup_limits_add_device(struct cgroup_limits *l, const char *v)
+{
+	char *copy;
+
+	copy = strdup(v);
+	if (!copy)
+		return false;
+	if (lxc_grow_array((void ***)&l->devices, &l->devices_capacity,
+			   l->devices_count + 2, 16) < 0) {
+		free(copy);
+		return false;
+	}
+	l->devices[l->devices_count++] = copy;
+	return true;
+}
+
+static void cgroup_limits_forget_devices(struct cgroup_limits *l)
+{
+	lxc_free_array((void **)l->devices, free);
+	l->devices = NULL;
+	l->devices_count = l->devices_capacity = 0;
+	l->devices_read = false;
+	l->devices_all = false;
+}
+
+static bool cgroup_limits_read_devices(struct cgroup_limits *l)
+{
+	FILE *devices_list;
+	char *line = NULL;
+	size_t sz = 0, len;
+	int dirfd, fd;
+	bool bret = true;
+
+	dirfd = cgroup_limits_dirfd(l, "devices");
+	if (dirfd < 0)
+		return false;
+	fd = openat(dirfd, "devices.list", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	devices_list = fdopen(fd, "r");
+	if (!devices_list) {
+		close(fd);
+		return false;
+	}
+
+	while (getline(&line, &sz, devices_list) != -1) {
+		len = strlen(line);
+		if (len > 0 && line[len-1] == '\n')
+			line[len-1] = '\0';
+		if (strcmp(line, "a *:* rwm") == 0)
+			l->devices_all = true;
+		else if (!cgroup_limits_add_device(l, line))
+			bret = false;
+	}
+	fclose(devices_list);
+	free(line);
+
+	if (!bret) {
+		cgroup_limits_forget_devices(l);
+		return false;
+	}
+	l->devices_read = true;
+	return true;
+}
+
+static bool is_all_devices(const char *v)
+{
+	return strcmp(v, "a") == 0 || strcmp(v, "a *:* rwm") == 0;
+}
+
+static bool cgroup_devices_has_allow_or_deny(struct cgroup_limits *l,
+					     const char *v, bool for_allow)
+{
+	size_t i;
+
+	// XXX FIXME if users could use something other than 'lxc.devices.deny = a'.
+	// not sure they ever do, but they *could*
+	// right now, I'm assuming they do NOT
+	if (!for_allow && !is_all_devices(v))
+		return false;
+
+	if (!l->devices_read && !cgroup_limits_read_devices(l))
+		return false;
+
+	if (l->devices_all)
+		return for_allow;
+	if (for_allow) {
+		for (i = 0; i < l->devices_count; i++)
+			if (strcmp(l->devices[i], v) == 0)
+				return true;
+	}
+	return !for_allow;
+}
+
+/* keep the whitelist in line with what the kernel made of the write */
+static void cgroup_devices_written(struct cgroup_limits *l, const char *v,
+				   bool for_allow)
+{
+	if (!l->devices_read)
+		return;
+
+	if (for_allow && is_all_devices(v)) {
+		cgroup_limits_forget_devices(l);
+		l->devices_all = l->devices_read = true;
+	} else if (!for_allow && is_all_devices(v)) {
+		cgroup_limits_forget_devices(l);
+		l->devices_read = true;
+	} else if (!for_allow || !cgroup_limits_add_device(l, v)) {
+		cgroup_limits_forget_devices(l);
+	}
+}
+
 static int do_setup_cgroup_limits(struct cgfs_data *d,
 			   struct lxc_list *cgroup_settings, bool do_devices)
 {
+	struct cgroup_limits l = { .d = d, .fd = -1 };
 	struct lxc_list *iterator;
 	struct lxc_cgroup *cg;
+	bool allow, deny;
 	int ret = -1;
 
 	if (lxc_list_empty(cgroup_settings))
@@ -1897,17 +2542,18 @@ static int do_setup_cgroup_limits(struct cgfs_data *d,
 		cg = iterator->elem;
 
 		if (do_devices == !strncmp("devices", cg->subsystem, 7)) {
-			if (strcmp(cg->subsystem, "devices.deny") == 0 &&
-					cgroup_devices_has_allow_or_deny(d, cg->value, false))
-				continue;
-			if (strcmp(cg->subsystem, "devices.allow") == 0 &&
-					cgroup_devices_has_allow_or_deny(d, cg->value, true))
+			deny = strcmp(cg->subsystem, "devices.deny") == 0;
+			allow = strcmp(cg->subsystem, "devices.allow") == 0;
+			if ((deny || allow) &&
+			    cgroup_devices_has_allow_or_deny(&l, cg->value, allow))
 				continue;
-			if (lxc_cgroup_set_data(cg->subsystem, cg->value, d)) {
+			if (cgroup_limits_write(&l, cg->subsystem, cg->value)) {
 				ERROR("Error setting %s to %s for %s",
 				      cg->subsystem, cg->value, d->name);
 				goto out;
 			}
+			if (deny || allow)
+				cgroup_devices_written(&l, cg->value, allow);
 		}
 
 		DEBUG("cgroup '%s' set to '%s'", cg->subsystem, cg->value);
@@ -1916,168 +2562,111 @@ static int do_setup_cgroup_limits(struct cgfs_data *d,
 	ret = 0;
 	INFO("cgroup has been setup");
 out:
+	cgroup_limits_free(&l);
 	return ret;
 }
 
-static bool cgroup_devices_has_allow_or_deny(struct cgfs_data *d,
-					     char *v, bool for_allow)
+/* count the lines of @name in @dirfd, reading it in large chunks */
+static int count_lines_at(int dirfd, const char *name)
 {
-	char *path;
-	FILE *devices_list;
-	char *line = NULL;
-	size_t sz = 0;
-	bool ret = !for_allow;
-	const char *parts[3] = {
-		NULL,
-		"devices.list",
-		NULL
-	};
-
-	// XXX FIXME if users could use something other than 'lxc.devices.deny = a'.
-	// not sure they ever do, but they *could*
-	// right now, I'm assuming they do NOT
-	if (!for_allow && strcmp(v, "a") != 0 && strcmp(v, "a *:* rwm") != 0)
-		return false;
+	char buf[65536], *p, *end;
+	ssize_t len;
+	int fd, n = 0;
 
-	parts[0] = (const char *)lxc_cgroup_get_hierarchy_abs_path_data("devices", d);
-	if (!parts[0])
-		return false;
-	path = lxc_string_join("/", parts, false);
-	if (!path) {
-		free((void *)parts[0]);
-		return false;
-	}
-
-	devices_list = fopen_cloexec(path, "r");
-	if (!devices_list) {
-		free(path);
-		return false;
-	}
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
 
-	while (getline(&line, &sz, devices_list) != -1) {
-		size_t len = strlen(line);
-		if (len > 0 && line[len-1] == '\n')
-			line[len-1] = '\0';
-		if (strcmp(line, "a *:* rwm") == 0) {
-			ret = for_allow;
-			goto out;
-		} else if (for_allow && strcmp(line, v) == 0) {
-			ret = true;
-			goto out;
+	while ((len = read(fd, buf, sizeof(buf))) != 0) {
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			n = -1;
+			break;
 		}
+		end = buf + len;
+		for (p = buf; (p = memchr(p, '\n', end - p)); p++)
+			n++;
 	}
-
-out:
-	fclose(devices_list);
-	free(line);
-	free(path);
-	return ret;
+	close(fd);
+	return n;
 }
 
-static int cgroup_recursive_task_count(const char *cgroup_path)
+/*
+ * Count the tasks of the cgroup open as @dirfd and of all its children,
+ * walking the tree relative to the directory fds.  Closes @dirfd.
+ */
+static int cgroup_task_count_at(int dirfd)
 {
-	DIR *d;
-	struct dirent *dent_buf;
 	struct dirent *dent;
-	ssize_t name_max;
-	int n = 0, r;
-
-	/* see man readdir_r(3) */
-	name_max = pathconf(cgroup_path, _PC_NAME_MAX);
-	if (name_max <= 0)
-		name_max = 255;
-	dent_buf = malloc(offsetof(struct dirent, d_name) + name_max + 1);
-	if (!dent_buf)
-		return -1;
+	struct stat st;
+	DIR *d;
+	int fd, n, r;
+	bool isdir;
 
-	d = opendir(cgroup_path);
+	d = fdopendir(dirfd);
 	if (!d) {
-		free(dent_buf);
-		return 0;
+		close(dirfd);
+		return -1;
 	}
 
-	while (readdir_r(d, dent_buf, &dent) == 0 && dent) {
-		const char *parts[3] = {
-			cgroup_path,
-			dent->d_name,
-			NULL
-		};
-		char *sub_path;
-		struct stat st;
+	n = count_lines_at(dirfd, "tasks");
+	if (n < 0)
+		n = 0;
 
+	while ((dent = readdir(d))) {
 		if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
 			continue;
-		sub_path = lxc_string_join("/", parts, false);
-		if (!sub_path) {
-			closedir(d);
-			free(dent_buf);
-			return -1;
-		}
-		r = stat(sub_path, &st);
-		if (r < 0) {
-			closedir(d);
-			free(dent_buf);
-			free(sub_path);
-			return -1;
-		}
-		if (S_ISDIR(st.st_mode)) {
-			r = cgroup_recursive_task_count(sub_path);
-			if (r >= 0)
-				n += r;
-		} else if (!strcmp(dent->d_name, "tasks")) {
-			r = count_lines(sub_path);
-			if (r >= 0)
-				n += r;
+		if (dent->d_type == DT_UNKNOWN) {
+			if (fstatat(dirfd, dent->d_name, &st, 0) < 0) {
+				closedir(d);
+				return -1;
+			}
+			isdir = S_ISDIR(st.st_mode);
+		} else {
+			isdir = dent->d_type == DT_DIR;
 		}
-		free(sub_path);
+		if (!isdir)
+			continue;
+
+		fd = openat(dirfd, dent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		r = cgroup_task_count_at(fd);
+		if (r >= 0)
+			n += r;
 	}
 	closedir(d);
-	free(dent_buf);
-
-	return n;
-}
 
-static int count_lines(const char *fn)
-{
-	FILE *f;
-	char *line = NULL;
-	size_t sz = 0;
-	int n = 0;
-
-	f = fopen_cloexec(fn, "r");
-	if (!f)
-		return -1;
-
-	while (getline(&line, &sz, f) != -1) {
-		n++;
-	}
-	free(line);
-	fclose(f);
 	return n;
 }
 
 static int handle_cgroup_settings(struct cgroup_mount_point *mp,
 				  char *cgroup_path)
 {
-	int r, saved_errno = 0;
-	char buf[2];
+	int r = 0, dirfd, saved_errno = 0;
+	char *path, buf[2];
+	struct stat sb;
 
-	mp->need_cpuset_init = false;
+	path = cgroup_to_absolute_path(mp, cgroup_path, NULL);
+	if (!path)
+		return -1;
+	dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	free(path);
+	if (dirfd < 0)
+		return -1;
 
 	/* If this is the memory cgroup, we want to enforce hierarchy.
 	 * But don't fail if for some reason we can't.
 	 */
 	if (lxc_string_in_array("memory", (const char **)mp->hierarchy->subsystems)) {
-		char *cc_path = cgroup_to_absolute_path(mp, cgroup_path, "/memory.use_hierarchy");
-		if (cc_path) {
-			r = lxc_read_from_file(cc_path, buf, 1);
-			if (r < 1 || buf[0] != '1') {
-				r = lxc_write_to_file(cc_path, "1", 1, false);
-				if (r < 0)
-					SYSERROR("failed to set memory.use_hierarchy to 1; continuing");
-			}
-			free(cc_path);
+		r = lxc_readat(dirfd, "memory.use_hierarchy", buf, sizeof(buf));
+		if (r < 1 || buf[0] != '1') {
+			r = lxc_writeat(dirfd, "memory.use_hierarchy", "1", 1);
+			if (r < 0)
+				SYSERROR("failed to set memory.use_hierarchy to 1; continuing");
 		}
+		r = 0;
 	}
 
 	/* if this is a cpuset hierarchy, we have to set cgroup.clone_children in
@@ -2085,111 +2674,82 @@ static int handle_cgroup_settings(struct cgroup_mount_point *mp,
 	 * and cpuset.cpus and then
 	 */
 	if (lxc_string_in_array("cpuset", (const char **)mp->hierarchy->subsystems)) {
-		char *cc_path = cgroup_to_absolute_path(mp, cgroup_path, "/cgroup.clone_children");
-		struct stat sb;
-
-		if (!cc_path)
-			return -1;
 		/* cgroup.clone_children is not available when running under
 		 * older kernel versions; in this case, we'll initialize
 		 * cpuset.cpus and cpuset.mems later, after the new cgroup
 		 * was created
 		 */
-		if (stat(cc_path, &sb) != 0 && errno == ENOENT) {
+		if (fstatat(dirfd, "cgroup.clone_children", &sb, 0) != 0 &&
+		    errno == ENOENT) {
 			mp->need_cpuset_init = true;
-			free(cc_path);
-			return 0;
-		}
-		r = lxc_read_from_file(cc_path, buf, 1);
-		if (r == 1 && buf[0] == '1') {
-			free(cc_path);
-			return 0;
+		} else if (lxc_readat(dirfd, "cgroup.clone_children", buf, sizeof(buf)) != 1 ||
+			   buf[0] != '1') {
+			r = lxc_writeat(dirfd, "cgroup.clone_children", "1", 1);
+			saved_errno = errno;
 		}
-		r = lxc_write_to_file(cc_path, "1", 1, false);
-		saved_errno = errno;
-		free(cc_path);
-		errno = saved_errno;
-		return r < 0 ? -1 : 0;
 	}
-	return 0;
-}
 
-static int cgroup_read_from_file(const char *fn, char buf[], size_t bufsize)
-{
-	int ret = lxc_read_from_file(fn, buf, bufsize);
-	if (ret < 0) {
-		SYSERROR("failed to read %s", fn);
-		return ret;
-	}
-	if (ret == bufsize) {
-		if (bufsize > 0) {
-			/* obviously this wasn't empty */
-			buf[bufsize-1] = '\0';
-			return ret;
-		}
-		/* Callers don't do this, but regression/sanity check */
-		ERROR("%s: was not expecting 0 bufsize", __func__);
-		return -1;
-	}
-	buf[ret] = '\0';
-	return ret;
+	close(dirfd);
+	errno = saved_errno;
+	return r < 0 ? -1 : 0;
 }
 
 static bool do_init_cpuset_file(struct cgroup_mount_point *mp,
 				const char *path, const char *name)
 {
 	char value[1024];
-	char *childfile, *parentfile = NULL, *tmp;
-	int ret;
+	char *childdir;
+	int childfd, parentfd = -1, ret;
 	bool ok = false;
 
-	childfile = cgroup_to_absolute_path(mp, path, name);
-	if (!childfile)
+	childdir = cgroup_to_absolute_path(mp, path, NULL);
+	if (!childdir)
 		return false;
+	childfd = open(childdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (childfd < 0) {
+		SYSERROR("failed to open %s", childdir);
+		goto out;
+	}
 
 	/* don't overwrite a non-empty value in the file */
-	ret = cgroup_read_from_file(childfile, value, sizeof(value));
-	if (ret < 0)
+	ret = lxc_readat(childfd, name, value, sizeof(value));
+	if (ret < 0) {
+		SYSERROR("failed to read %s/%s", childdir, name);
 		goto out;
+	}
 	if (value[0] != '\0' && value[0] != '\n') {
 		ok = true;
 		goto out;
 	}
 
-	/* path to the same name in the parent cgroup */
-	parentfile = strdup(path);
-	if (!parentfile)
-		goto out;
-
-	tmp = strrchr(parentfile, '/');
-	if (!tmp)
-		goto out;
-	if (tmp == parentfile)
-		tmp++; /* keep the '/' at the start */
-	*tmp = '\0';
-	tmp = parentfile;
-	parentfile = cgroup_to_absolute_path(mp, tmp, name);
-	free(tmp);
-	if (!parentfile)
+	/* the same name in the parent cgroup */
+	parentfd = openat(childfd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (parentfd < 0) {
+		SYSERROR("failed to open the parent of %s", childdir);
 		goto out;
+	}
 
 	/* copy from parent to child cgroup */
-	ret = cgroup_read_from_file(parentfile, value, sizeof(value));
-	if (ret < 0)
+	ret = lxc_readat(parentfd, name, value, sizeof(value));
+	if (ret < 0) {
+		SYSERROR("failed to read %s in the parent of %s", name, childdir);
 		goto out;
-	if (ret == sizeof(value)) {
+	}
+	if (ret == sizeof(value) - 1) {
 		/* If anyone actually sees this error, we can address it */
 		ERROR("parent cpuset value too long");
 		goto out;
 	}
-	ok = (lxc_write_to_file(childfile, value, strlen(value), false) >= 0);
+	ok = (lxc_writeat(childfd, name, value, ret) >= 0);
 	if (!ok)
-		SYSERROR("failed writing %s", childfile);
+		SYSERROR("failed writing %s/%s", childdir, name);
 
 out:
-	if (parentfile)
-		free(parentfile);
-	free(childfile);
+	if (parentfd >= 0)
+		close(parentfd);
+	if (childfd >= 0)
+		close(childfd);
+	free(childdir);
 	return ok;
 }
 
@@ -2204,8 +2764,8 @@ static bool init_cpuset_if_needed(struct cgroup_mount_point *mp,
 	if (!mp->need_cpuset_init)
 		return true;
 
-	return (do_init_cpuset_file(mp, path, "/cpuset.cpus") &&
-		do_init_cpuset_file(mp, path, "/cpuset.mems") );
+	return (do_init_cpuset_file(mp, path, "cpuset.cpus") &&
+		do_init_cpuset_file(mp, path, "cpuset.mems") );
 }
 
 struct cgroup_ops *cgfs_ops_init(void)
@@ -2222,6 +2782,7 @@ static void *cgfs_init(const char *name)
 		return NULL;
 
 	memset(d, 0, sizeof(*d));
+	d->nrtasks_fd = -1;
 	d->name = strdup(name);
 	if (!d->name)
 		goto err1;
@@ -2253,13 +2814,20 @@ err1:
 static void cgfs_destroy(void *hdata)
 {
 	struct cgfs_data *d = hdata;
+	int size;
 
 	if (!d)
 		return;
+	if (d->nrtasks_fd >= 0)
+		close(d->nrtasks_fd);
 	if (d->name)
 		free(d->name);
 	if (d->info)
 		lxc_cgroup_process_info_free_and_remove(d->info);
+	/* top the pool up while no container is waiting for it */
+	size = cgroup_pool_size();
+	if (size > 0 && d->meta)
+		cgroup_pool_refill(d->cgroup_pattern, d->meta, size);
 	if (d->meta)
 		lxc_cgroup_put_meta(d->meta);
 	free(d);
@@ -2274,7 +2842,11 @@ static inline bool cgfs_create(void *hdata)
 	if (!d)
 		return false;
 	md = d->meta;
-	i = lxc_cgroupfs_create(d->name, d->cgroup_pattern, md, NULL);
+	i = NULL;
+	if (cgroup_pool_size() > 0)
+		i = cgroup_pool_claim(d->name, d->cgroup_pattern, md);
+	if (!i)
+		i = lxc_cgroupfs_create(d->name, d->cgroup_pattern, md, NULL);
 	if (!i)
 		return false;
 	d->info = i;
@@ -2319,6 +2891,15 @@ static const char *cgfs_get_cgroup(void *hdata, const char *subsystem)
 	return lxc_cgroup_get_hierarchy_path_data(subsystem, d);
 }
 
+static char *cgfs_get_abs_path(void *hdata, const char *subsystem)
+{
+	struct cgfs_data *d = hdata;
+
+	if (!d)
+		return NULL;
+	return lxc_cgroup_get_hierarchy_abs_path_data(subsystem, d);
+}
+
 static bool cgfs_unfreeze(void *hdata)
 {
 	struct cgfs_data *d = hdata;
@@ -2338,6 +2919,28 @@ static bool cgfs_unfreeze(void *hdata)
 	return ret == 0;
 }
 
+/* the freezer hierarchy has every task, frozen they can't fork away */
+static bool cgfs_kill(void *hdata)
+{
+	struct cgfs_data *d = hdata;
+	char *cgabspath, *cgrelpath;
+	int ret;
+
+	if (!d)
+		return false;
+
+	cgrelpath = lxc_cgroup_get_hierarchy_path_data("freezer", d);
+	cgabspath = lxc_cgroup_find_abs_path("freezer", cgrelpath, true, NULL);
+	if (!cgabspath)
+		return false;
+
+	if (do_cgroup_set(cgabspath, "freezer.state", "FROZEN") < 0)
+		WARN("failed to freeze %s, killing its tasks as they are", cgabspath);
+	ret = lxc_cgroup_kill_tree(cgabspath);
+	free(cgabspath);
+	return ret == 0;
+}
+
 static bool cgroupfs_setup_limits(void *hdata, struct lxc_list *cgroup_conf,
 				  bool with_devices)
 {
@@ -2383,9 +2986,12 @@ static struct cgroup_ops cgfs_ops = {
 	.enter = cgfs_enter,
 	.create_legacy = cgfs_create_legacy,
 	.get_cgroup = cgfs_get_cgroup,
+	.get_abs_path = cgfs_get_abs_path,
 	.get = lxc_cgroupfs_get,
 	.set = lxc_cgroupfs_set,
+	.get_path = lxc_cgroup_get_hierarchy_abs_path,
 	.unfreeze = cgfs_unfreeze,
+	.kill = cgfs_kill,
 	.setup_limits = cgroupfs_setup_limits,
 	.name = "cgroupfs",
 	.attach = lxc_cgroupfs_attach,
@@ -0,0 +1,977 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * cgroup driver for hosts which only have the unified (cgroup2) hierarchy.
+ * A container gets a single cgroup there, which its init enters once, and
+ * the controllers reach it through the cgroup.subtree_control of its
+ * ancestors.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/mount.h>
+
+#include "commands.h"
+#include "list.h"
+#include "conf.h"
+#include "utils.h"
+#include "log.h"
+#include "cgroup.h"
+
+lxc_log_define(lxc_cgfs2, lxc);
+
+/*
+ * @name          : the container name
+ * @cgroup_pattern: lxc.cgroup.pattern, or "%n"
+ * @cgroup_path   : the container's cgroup, e.g. "/lxc/c1"
+ * @created       : the cgroups we created on the way, deepest last
+ */
+struct cgfs2_data {
+	char *name;
+	const char *cgroup_pattern;
+	char *cgroup_path;
+	char **created;
+	size_t created_count;
+	size_t created_capacity;
+	int nrtasks_fd; /* the cgroup counted by cgfs2_nrtasks(), kept open */
+};
+
+static struct cgroup_ops cgfs2_ops;
+
+/* where the unified hierarchy is mounted, and which cgroup is mounted there */
+static char *cg2_mountpoint;
+static char *cg2_mount_root;
+
+/* absolute path of @cgroup with @file appended, if not NULL */
+static char *cg2_path(const char *cgroup, const char *file)
+{
+	size_t rootlen = strlen(cg2_mount_root), len;
+	char *path;
+
+	if (strcmp(cg2_mount_root, "/")) {
+		if (strncmp(cgroup, cg2_mount_root, rootlen) ||
+		    (cgroup[rootlen] && cgroup[rootlen] != '/')) {
+			ERROR("cgroup %s is not below %s", cgroup, cg2_mount_root);
+			return NULL;
+		}
+		cgroup += rootlen;
+	}
+	while (*cgroup == '/')
+		cgroup++;
+
+	len = strlen(cg2_mountpoint) + strlen(cgroup) + (file ? strlen(file) : 0) + 3;
+	path = malloc(len);
+	if (!path)
+		return NULL;
+	snprintf(path, len, "%s%s%s%s%s", cg2_mountpoint, *cgroup ? "/" : "",
+		 cgroup, file ? "/" : "", file ? file : "");
+	return path;
+}
+
+/* the unified cgroup of @pid, from its "0::" line */
+static char *cg2_pid_cgroup(const char *pid)
+{
+	char fn[MAXPATHLEN], *line = NULL, *result = NULL;
+	size_t sz = 0, len;
+	FILE *f;
+
+	snprintf(fn, sizeof(fn), "/proc/%s/cgroup", pid);
+	f = fopen_cloexec(fn, "r");
+	if (!f)
+		return NULL;
+	while (getline(&line, &sz, f) != -1) {
+		if (strncmp(line, "0::", 3))
+			continue;
+		len = strlen(line);
+		if (len > 0 && line[len-1] == '\n')
+			line[len-1] = '\0';
+		result = strdup(line + 3);
+		break;
+	}
+	free(line);
+	fclose(f);
+	return result;
+}
+
+/*
+ * Find the unified hierarchy, giving up if any v1 hierarchy is around:
+ * the controllers would be bound there and the cgroupfs driver is needed.
+ */
+static bool cg2_detect(void)
+{
+	char *line = NULL, *p, *fields[5], *self;
+	size_t sz = 0;
+	bool found = false;
+	FILE *f;
+	int i;
+
+	f = fopen_cloexec("/proc/self/cgroup", "r");
+	if (!f)
+		return false;
+	while (getline(&line, &sz, f) != -1) {
+		if (strncmp(line, "0::", 3)) {
+			fclose(f);
+			free(line);
+			return false;
+		}
+		found = true;
+	}
+	fclose(f);
+	if (!found) {
+		free(line);
+		return false;
+	}
+
+	self = cg2_pid_cgroup("self");
+	if (!self) {
+		free(line);
+		return false;
+	}
+
+	/* layout of /proc/self/mountinfo:
+	 *   id parent maj:min root mountpoint options ... - fstype source opts
+	 */
+	f = fopen_cloexec("/proc/self/mountinfo", "r");
+	if (!f) {
+		free(self);
+		free(line);
+		return false;
+	}
+	while (!cg2_mountpoint && getline(&line, &sz, f) != -1) {
+		p = strstr(line, " - cgroup2 ");
+		if (!p)
+			continue;
+		*p = '\0';
+		for (i = 0, p = line; i < 5 && p; i++) {
+			fields[i] = p;
+			p = strchr(p, ' ');
+			if (p)
+				*p++ = '\0';
+		}
+		if (i < 5)
+			continue;
+		/* the mount has to show our cgroup */
+		if (strcmp(fields[3], "/") &&
+		    (strncmp(self, fields[3], strlen(fields[3])) ||
+		     (self[strlen(fields[3])] && self[strlen(fields[3])] != '/')))
+			continue;
+		cg2_mountpoint = strdup(fields[4]);
+		cg2_mount_root = strdup(fields[3]);
+		if (!cg2_mountpoint || !cg2_mount_root) {
+			free(cg2_mountpoint);
+			free(cg2_mount_root);
+			cg2_mountpoint = cg2_mount_root = NULL;
+			break;
+		}
+	}
+	fclose(f);
+	free(self);
+	free(line);
+	return cg2_mountpoint != NULL;
+}
+
+struct cgroup_ops *cgfs2_ops_init(void)
+{
+	if (!cg2_detect())
+		return NULL;
+	INFO("unified cgroup hierarchy found at %s", cg2_mountpoint);
+	return &cgfs2_ops;
+}
+
+static void *cgfs2_init(const char *name)
+{
+	struct cgfs2_data *d;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return NULL;
+	d->nrtasks_fd = -1;
+	d->name = strdup(name);
+	if (!d->name) {
+		free(d);
+		return NULL;
+	}
+
+	/* as for cgroupfs: the system pattern for root, else below our own */
+	if (geteuid() == 0)
+		d->cgroup_pattern = lxc_global_config_value("lxc.cgroup.pattern");
+	if (!d->cgroup_pattern)
+		d->cgroup_pattern = "%n";
+	return d;
+}
+
+/* remove @path and whatever cgroups the container created below it */
+static int cg2_rmdir_recursive(const char *path)
+{
+	struct dirent *dent;
+	char sub[MAXPATHLEN];
+	int ret, failed = 0;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir)
+		return errno == ENOENT ? 0 : -1;
+	while ((dent = readdir(dir))) {
+		if (dent->d_type != DT_DIR || !strcmp(dent->d_name, ".") ||
+		    !strcmp(dent->d_name, ".."))
+			continue;
+		ret = snprintf(sub, sizeof(sub), "%s/%s", path, dent->d_name);
+		if (ret < 0 || ret >= sizeof(sub) || cg2_rmdir_recursive(sub) < 0)
+			failed = 1;
+	}
+	closedir(dir);
+
+	if (rmdir(path) < 0 && errno != ENOENT) {
+		SYSERROR("failed to remove cgroup %s", path);
+		return -1;
+	}
+	return failed ? -1 : 0;
+}
+
+static void cg2_remove_created(struct cgfs2_data *d)
+{
+	bool leaf = true;
+	char *path;
+
+	while (d->created_count) {
+		d->created_count--;
+		path = cg2_path(d->created[d->created_count], NULL);
+		/* the parents we made only go if no other container uses them */
+		if (path && leaf)
+			cg2_rmdir_recursive(path);
+		else if (path && rmdir(path) < 0 && errno != ENOTEMPTY &&
+			 errno != EBUSY && errno != ENOENT)
+			SYSERROR("failed to remove cgroup %s", path);
+		free(path);
+		free(d->created[d->created_count]);
+		d->created[d->created_count] = NULL;
+		leaf = false;
+	}
+}
+
+static void cgfs2_destroy(void *hdata)
+{
+	struct cgfs2_data *d = hdata;
+
+	if (!d)
+		return;
+	if (d->nrtasks_fd >= 0)
+		close(d->nrtasks_fd);
+	cg2_remove_created(d);
+	free(d->created);
+	free(d->cgroup_path);
+	free(d->name);
+	free(d);
+}
+
+/*
+ * Make the controllers @cgroup has available to its children as well.
+ * All at once if possible, else one by one: a single controller which
+ * cannot be enabled makes the kernel refuse the whole write.
+ */
+static void cg2_delegate(const char *cgroup)
+{
+	char *path, buf[1024], ctl[1024], *tok, *saveptr;
+	size_t off = 0;
+	int dirfd, ret;
+
+	path = cg2_path(cgroup, NULL);
+	if (!path)
+		return;
+	dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0)
+		goto out;
+	ret = lxc_readat(dirfd, "cgroup.controllers", buf, sizeof(buf));
+	if (ret <= 0)
+		goto out;
+
+	for (tok = strtok_r(buf, " \n", &saveptr); tok;
+	     tok = strtok_r(NULL, " \n", &saveptr)) {
+		ret = snprintf(ctl + off, sizeof(ctl) - off, "%s+%s",
+			       off ? " " : "", tok);
+		if (ret < 0 || ret >= sizeof(ctl) - off)
+			break;
+		off += ret;
+	}
+	if (!off)
+		goto out;
+
+	if (lxc_writeat(dirfd, "cgroup.subtree_control", ctl, off) < 0) {
+		if (errno == EBUSY)
+			WARN("cannot delegate controllers from %s, it has processes",
+			     cgroup);
+		for (tok = strtok_r(ctl, " ", &saveptr); tok;
+		     tok = strtok_r(NULL, " ", &saveptr))
+			if (lxc_writeat(dirfd, "cgroup.subtree_control", tok,
+					strlen(tok)) < 0)
+				DEBUG("failed to enable %s in %s", tok + 1, path);
+	}
+out:
+	if (dirfd >= 0)
+		close(dirfd);
+	free(path);
+}
+
+static bool cg2_add_created(struct cgfs2_data *d, const char *cgroup)
+{
+	char *copy;
+
+	copy = strdup(cgroup);
+	if (!copy)
+		return false;
+	if (lxc_grow_array((void ***)&d->created, &d->created_capacity,
+			   d->created_count + 2, 4) < 0) {
+		free(copy);
+		return false;
+	}
+	d->created[d->created_count++] = copy;
+	return true;
+}
+
+/*
+ * Create the cgroups of the pattern below our own cgroup, or below the
+ * one of init for absolute patterns.  Components holding the container
+ * name get a -1, -2, ... suffix if they exist already.
+ */
+static bool cgfs2_create(void *hdata)
+{
+	struct cgfs2_data *d = hdata;
+	char **components = NULL, **p, *cgroup = NULL, *next, *comp, *path;
+	char suffixed[MAXPATHLEN];
+	bool has_name, exists, bret = false;
+	unsigned suffix;
+	int ret;
+
+	if (!d)
+		return false;
+	if (!strstr(d->cgroup_pattern, "%n")) {
+		ERROR("Invalid cgroup path pattern: '%s'; contains no %%n for specifying container name", d->cgroup_pattern);
+		return false;
+	}
+
+	cgroup = cg2_pid_cgroup(d->cgroup_pattern[0] == '/' ? "1" : "self");
+	if (!cgroup) {
+		ERROR("failed to find the unified cgroup to create %s in", d->name);
+		return false;
+	}
+	components = lxc_normalize_path(d->cgroup_pattern);
+	if (!components)
+		goto out;
+
+	for (p = components; *p; p++) {
+		has_name = strstr(*p, "%n") != NULL;
+		cg2_delegate(cgroup);
+		for (suffix = 0; suffix < 100; suffix++) {
+			if (suffix) {
+				ret = snprintf(suffixed, sizeof(suffixed), "%s-%u",
+					       d->name, suffix);
+				if (ret < 0 || ret >= sizeof(suffixed))
+					goto out;
+			}
+			comp = has_name ? lxc_string_replace("%n",
+						suffix ? suffixed : d->name, *p) : *p;
+			if (!comp)
+				goto out;
+			next = lxc_append_paths(strcmp(cgroup, "/") ? cgroup : "", comp);
+			if (comp != *p)
+				free(comp);
+			if (!next)
+				goto out;
+
+			path = cg2_path(next, NULL);
+			if (!path) {
+				free(next);
+				goto out;
+			}
+			ret = mkdir(path, 0755);
+			if (ret < 0 && (errno != EEXIST || has_name)) {
+				exists = errno == EEXIST;
+				if (!exists)
+					SYSERROR("failed to create cgroup %s", path);
+				free(path);
+				free(next);
+				if (!exists)
+					goto out;
+				continue;
+			}
+			free(path);
+			if (!ret && !cg2_add_created(d, next)) {
+				free(next);
+				goto out;
+			}
+			break;
+		}
+		if (suffix == 100) {
+			ERROR("cgroup error?  100 cgroups with this name already running");
+			goto out;
+		}
+		free(cgroup);
+		cgroup = next;
+	}
+
+	d->cgroup_path = cgroup;
+	cgroup = NULL;
+	bret = true;
+out:
+	if (!bret)
+		cg2_remove_created(d);
+	free(cgroup);
+	free(components);
+	return bret;
+}
+
+static bool cg2_enter(const char *cgroup, pid_t pid)
+{
+	char *path, pidstr[25];
+	int len, ret;
+
+	path = cg2_path(cgroup, "cgroup.procs");
+	if (!path)
+		return false;
+	len = snprintf(pidstr, sizeof(pidstr), "%d", pid);
+	ret = lxc_write_to_file(path, pidstr, len, false);
+	if (ret < 0)
+		SYSERROR("failed to move %d into %s", pid, path);
+	free(path);
+	return ret == 0;
+}
+
+static bool cgfs2_enter(void *hdata, pid_t pid)
+{
+	struct cgfs2_data *d = hdata;
+
+	if (!d || !d->cgroup_path)
+		return false;
+	return cg2_enter(d->cgroup_path, pid);
+}
+
+static const char *cgfs2_get_cgroup(void *hdata, const char *subsystem)
+{
+	struct cgfs2_data *d = hdata;
+
+	if (!d)
+		return NULL;
+	/* every controller lives in the one cgroup */
+	return d->cgroup_path;
+}
+
+static char *cgfs2_get_abs_path(void *hdata, const char *subsystem)
+{
+	struct cgfs2_data *d = hdata;
+
+	if (!d || !d->cgroup_path)
+		return NULL;
+	return cg2_path(d->cgroup_path, NULL);
+}
+
+static char *cgfs2_get_path(const char *subsystem, const char *name,
+			    const char *lxcpath)
+{
+	char *cgroup, *path;
+
+	cgroup = lxc_cmd_get_cgroup_path(name, lxcpath, subsystem);
+	if (!cgroup)
+		return NULL;
+	path = cg2_path(cgroup, NULL);
+	free(cgroup);
+	return path;
+}
+
+/*
+ * freezer.state is emulated with cgroup.freeze and the frozen key of
+ * cgroup.events, so lxc_freeze() and lxc_unfreeze() keep working.
+ */
+static int cg2_freezer_state(const char *dir, char *value, size_t len)
+{
+	char buf[256];
+	const char *state = "THAWED\n";
+	int dirfd, ret;
+
+	dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0)
+		return -1;
+	ret = lxc_readat(dirfd, "cgroup.freeze", buf, sizeof(buf));
+	if (ret > 0 && buf[0] == '1') {
+		state = "FREEZING\n";
+		ret = lxc_readat(dirfd, "cgroup.events", buf, sizeof(buf));
+		if (ret >= 0 && strstr(buf, "frozen 1"))
+			state = "FROZEN\n";
+	}
+	close(dirfd);
+	if (ret < 0)
+		return -1;
+
+	ret = strlen(state);
+	if (!value || !len)
+		return ret;
+	snprintf(value, len, "%s", state);
+	return ret < len ? ret : len - 1;
+}
+
+static int cgfs2_get(const char *filename, char *value, size_t len,
+		     const char *name, const char *lxcpath)
+{
+	char *subsystem, *p, *dir, *path;
+	int ret;
+
+	subsystem = alloca(strlen(filename) + 1);
+	strcpy(subsystem, filename);
+	if ((p = strchr(subsystem, '.')) != NULL)
+		*p = '\0';
+
+	dir = cgfs2_get_path(subsystem, name, lxcpath);
+	if (!dir)
+		return -1;
+	if (!strcmp(filename, "freezer.state")) {
+		ret = cg2_freezer_state(dir, value, len);
+		free(dir);
+		return ret;
+	}
+	path = lxc_append_paths(dir, filename);
+	free(dir);
+	if (!path)
+		return -1;
+	ret = lxc_read_from_file(path, value, len);
+	free(path);
+	return ret;
+}
+
+static int cgfs2_set(const char *filename, const char *value,
+		     const char *name, const char *lxcpath)
+{
+	char *subsystem, *p, *dir, *path;
+	int ret;
+
+	subsystem = alloca(strlen(filename) + 1);
+	strcpy(subsystem, filename);
+	if ((p = strchr(subsystem, '.')) != NULL)
+		*p = '\0';
+
+	if (!strcmp(filename, "freezer.state")) {
+		filename = "cgroup.freeze";
+		value = strcmp(value, "FROZEN") ? "0" : "1";
+	}
+
+	dir = cgfs2_get_path(subsystem, name, lxcpath);
+	if (!dir)
+		return -1;
+	path = lxc_append_paths(dir, filename);
+	free(dir);
+	if (!path)
+		return -1;
+	ret = lxc_write_to_file(path, value, strlen(value), false);
+	free(path);
+	return ret;
+}
+
+static bool cgfs2_unfreeze(void *hdata)
+{
+	struct cgfs2_data *d = hdata;
+	char *path;
+	int ret;
+
+	if (!d || !d->cgroup_path)
+		return false;
+	path = cg2_path(d->cgroup_path, "cgroup.freeze");
+	if (!path)
+		return false;
+	/* not lxc_write_to_file(), O_CREAT makes a missing file EACCES */
+	ret = lxc_writeat(AT_FDCWD, path, "0", 1);
+	/* kernels before 5.2 can't freeze, so nothing is frozen */
+	if (ret < 0 && errno == ENOENT)
+		ret = 0;
+	if (ret < 0)
+		SYSERROR("failed to thaw %s", path);
+	free(path);
+	return ret == 0;
+}
+
+/*
+ * cgroup.kill (Linux 5.14) kills the whole subtree in the kernel, no task
+ * can escape through a fork.  Before it, the freezer (5.2) keeps them from
+ * forking while they are killed one by one.
+ */
+static bool cgfs2_kill(void *hdata)
+{
+	struct cgfs2_data *d = hdata;
+	char *path;
+	int ret;
+
+	if (!d || !d->cgroup_path)
+		return false;
+	path = cg2_path(d->cgroup_path, "cgroup.kill");
+	if (!path)
+		return false;
+	ret = lxc_writeat(AT_FDCWD, path, "1", 1);
+	if (ret == 0 || errno != ENOENT) {
+		if (ret < 0)
+			SYSERROR("failed to write %s", path);
+		free(path);
+		return ret == 0;
+	}
+	free(path);
+
+	path = cg2_path(d->cgroup_path, "cgroup.freeze");
+	if (!path)
+		return false;
+	if (lxc_writeat(AT_FDCWD, path, "1", 1) < 0)
+		DEBUG("can't freeze %s, killing its tasks as they are", path);
+	free(path);
+	path = cg2_path(d->cgroup_path, NULL);
+	if (!path)
+		return false;
+	ret = lxc_cgroup_kill_tree(path);
+	free(path);
+	return ret == 0;
+}
+
+/*
+ * All the limits go into the one directory, opened once.  The unified
+ * hierarchy has no devices files (device access is controlled by eBPF
+ * programs there), so devices rules can't be applied.
+ */
+static bool cgfs2_setup_limits(void *hdata, struct lxc_list *cgroup_settings,
+			       bool do_devices)
+{
+	struct cgfs2_data *d = hdata;
+	struct lxc_list *iterator;
+	struct lxc_cgroup *cg;
+	bool bret = false, warned = false;
+	char *path;
+	int dirfd;
+
+	if (lxc_list_empty(cgroup_settings))
+		return true;
+	if (!d || !d->cgroup_path)
+		return false;
+
+	path = cg2_path(d->cgroup_path, NULL);
+	if (!path)
+		return false;
+	dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0) {
+		SYSERROR("failed to open %s", path);
+		free(path);
+		return false;
+	}
+
+	lxc_list_for_each(iterator, cgroup_settings) {
+		cg = iterator->elem;
+		if (do_devices != !strncmp("devices", cg->subsystem, 7))
+			continue;
+		if (do_devices) {
+			if (!warned)
+				WARN("devices cgroup rules are not supported on the unified hierarchy, ignoring them");
+			warned = true;
+			continue;
+		}
+
+		if (lxc_writeat(dirfd, cg->subsystem, cg->value,
+				strlen(cg->value)) < 0) {
+			ERROR("Error setting %s to %s for %s: %s", cg->subsystem,
+			      cg->value, d->name, strerror(errno));
+			goto out;
+		}
+		DEBUG("cgroup '%s' set to '%s'", cg->subsystem, cg->value);
+	}
+
+	bret = true;
+	INFO("cgroup limits have been setup");
+out:
+	close(dirfd);
+	free(path);
+	return bret;
+}
+
+struct cg2_chown_data {
+	const char *path;
+};
+
+/* runs as root of the container's user namespace */
+static int cg2_chown_wrapper(void *data)
+{
+	struct cg2_chown_data *arg = data;
+	const char *files[] = { "", "cgroup.procs", "cgroup.threads",
+				"cgroup.subtree_control", NULL };
+	char fn[MAXPATHLEN];
+	int i, ret;
+
+	if (setresgid(0,0,0) < 0)
+		SYSERROR("Failed to setgid to 0");
+	if (setresuid(0,0,0) < 0)
+		SYSERROR("Failed to setuid to 0");
+	if (setgroups(0, NULL) < 0)
+		SYSERROR("Failed to clear groups");
+
+	for (i = 0; files[i]; i++) {
+		ret = snprintf(fn, sizeof(fn), "%s/%s", arg->path, files[i]);
+		if (ret < 0 || ret >= sizeof(fn))
+			return -1;
+		if (chown(fn, 0, 0) < 0 && errno != ENOENT) {
+			SYSERROR("Failed to chown %s", fn);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* hand the cgroup to the container's root so it can make its own below */
+static bool cgfs2_chown(void *hdata, struct lxc_conf *conf)
+{
+	struct cgfs2_data *d = hdata;
+	struct cg2_chown_data data;
+	bool bret = true;
+	char *path;
+
+	if (!d || !d->cgroup_path)
+		return false;
+	if (lxc_list_empty(&conf->id_map))
+		/* If there's no mapping then we don't need to chown */
+		return true;
+
+	path = cg2_path(d->cgroup_path, NULL);
+	if (!path)
+		return false;
+	data.path = path;
+	if (userns_exec_1(conf, cg2_chown_wrapper, &data) < 0) {
+		WARN("Failed to chown %s to container root", path);
+		bret = false;
+	}
+	free(path);
+	return bret;
+}
+
+static bool cgfs2_attach(const char *name, const char *lxcpath, pid_t pid)
+{
+	char *cgroup;
+	bool bret;
+
+	cgroup = lxc_cmd_get_cgroup_path(name, lxcpath, "cgroup");
+	if (!cgroup) {
+		ERROR("Failed to get the cgroup of %s", name);
+		return false;
+	}
+	bret = cg2_enter(cgroup, pid);
+	free(cgroup);
+	return bret;
+}
+
+/*
+ * The full mounts show the whole hierarchy, the others a tmpfs with just
+ * the container's cgroup at its place in the hierarchy.
+ */
+static bool cgfs2_mount_cgroup(void *hdata, const char *root, int type)
+{
+	struct cgfs2_data *d = hdata;
+	char *target = NULL, *own = NULL, *src = NULL;
+	bool bret = false;
+
+	if (!d || !d->cgroup_path)
+		return false;
+
+	if (type == LXC_AUTO_CGROUP_FULL_NOSPEC)
+		type = LXC_AUTO_CGROUP_FULL_MIXED;
+	else if (type == LXC_AUTO_CGROUP_NOSPEC)
+		type = LXC_AUTO_CGROUP_MIXED;
+	if (type < LXC_AUTO_CGROUP_RO || type > LXC_AUTO_CGROUP_FULL_MIXED) {
+		ERROR("could not mount cgroups into container: invalid type specified internally");
+		errno = EINVAL;
+		return false;
+	}
+
+	target = lxc_append_paths(root, "/sys/fs/cgroup");
+	src = cg2_path(d->cgroup_path, NULL);
+	if (!target || !src)
+		goto out;
+	own = lxc_append_paths(target, d->cgroup_path + strlen(cg2_mount_root));
+	if (!own)
+		goto out;
+
+	if (type == LXC_AUTO_CGROUP_FULL_RO || type == LXC_AUTO_CGROUP_FULL_RW ||
+	    type == LXC_AUTO_CGROUP_FULL_MIXED) {
+		if (mount(cg2_mountpoint, target, "none", MS_BIND, NULL) < 0) {
+			SYSERROR("error bind-mounting %s to %s", cg2_mountpoint, target);
+			goto out;
+		}
+		if (type != LXC_AUTO_CGROUP_FULL_RW &&
+		    mount(NULL, target, NULL, MS_REMOUNT|MS_BIND|MS_RDONLY, NULL) < 0) {
+			SYSERROR("error re-mounting %s readonly", target);
+			goto out;
+		}
+		/* own cgroup should be read-write */
+		if (type == LXC_AUTO_CGROUP_FULL_MIXED &&
+		    (mount(own, own, NULL, MS_BIND, NULL) < 0 ||
+		     mount(NULL, own, NULL, MS_REMOUNT|MS_BIND, NULL) < 0)) {
+			SYSERROR("error re-mounting %s readwrite", own);
+			goto out;
+		}
+	} else {
+		if (mount("cgroup_root", target, "tmpfs",
+			  MS_NOSUID|MS_NODEV|MS_NOEXEC|MS_RELATIME,
+			  "size=10240k,mode=755") < 0) {
+			SYSERROR("could not mount tmpfs to /sys/fs/cgroup in the container");
+			goto out;
+		}
+		if (mkdir_p(own, 0755) < 0) {
+			SYSERROR("could not create %s", own);
+			goto out;
+		}
+		if (mount(src, own, "none", MS_BIND, NULL) < 0) {
+			SYSERROR("error bind-mounting %s to %s", src, own);
+			goto out;
+		}
+		if (type == LXC_AUTO_CGROUP_RO &&
+		    mount(NULL, own, NULL, MS_REMOUNT|MS_BIND|MS_RDONLY, NULL) < 0) {
+			SYSERROR("error re-mounting %s readonly", own);
+			goto out;
+		}
+		/* the paths leading there are read-only but for RW */
+		if (type != LXC_AUTO_CGROUP_RW &&
+		    mount(NULL, target, NULL, MS_REMOUNT|MS_NOSUID|MS_NODEV|MS_NOEXEC|MS_RELATIME|MS_RDONLY,
+			  "size=10240k,mode=755") < 0) {
+			SYSERROR("error re-mounting %s readonly", target);
+			goto out;
+		}
+	}
+	bret = true;
+out:
+	free(target);
+	free(own);
+	free(src);
+	return bret;
+}
+
+/* count the lines of @name in @dirfd */
+static int cg2_count_lines_at(int dirfd, const char *name)
+{
+	char buf[65536], *p, *end;
+	ssize_t len;
+	int fd, n = 0;
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	while ((len = read(fd, buf, sizeof(buf))) != 0) {
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			n = -1;
+			break;
+		}
+		end = buf + len;
+		for (p = buf; (p = memchr(p, '\n', end - p)); p++)
+			n++;
+	}
+	close(fd);
+	return n;
+}
+
+/* the threads of the cgroup open as @dirfd and its children, closes @dirfd */
+static int cg2_task_count_at(int dirfd)
+{
+	struct dirent *dent;
+	DIR *d;
+	int fd, n, r;
+
+	d = fdopendir(dirfd);
+	if (!d) {
+		close(dirfd);
+		return -1;
+	}
+
+	n = cg2_count_lines_at(dirfd, "cgroup.threads");
+	if (n < 0)
+		n = cg2_count_lines_at(dirfd, "cgroup.procs");
+	if (n < 0)
+		n = 0;
+
+	while ((dent = readdir(d))) {
+		if (dent->d_type != DT_DIR || !strcmp(dent->d_name, ".") ||
+		    !strcmp(dent->d_name, ".."))
+			continue;
+		fd = openat(dirfd, dent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		r = cg2_task_count_at(fd);
+		if (r >= 0)
+			n += r;
+	}
+	closedir(d);
+	return n;
+}
+
+/* the cgroup is opened once, as for cgroupfs */
+static int cgfs2_nrtasks(void *hdata)
+{
+	struct cgfs2_data *d = hdata;
+	char *path;
+	int fd;
+
+	if (!d || !d->cgroup_path) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (d->nrtasks_fd < 0) {
+		path = cg2_path(d->cgroup_path, NULL);
+		if (!path)
+			return -1;
+		d->nrtasks_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		free(path);
+		if (d->nrtasks_fd < 0)
+			return -1;
+	}
+	if (lseek(d->nrtasks_fd, 0, SEEK_SET) < 0)
+		return -1;
+	fd = fcntl(d->nrtasks_fd, F_DUPFD_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	return cg2_task_count_at(fd);
+}
+
+static struct cgroup_ops cgfs2_ops = {
+	.init = cgfs2_init,
+	.destroy = cgfs2_destroy,
+	.create = cgfs2_create,
+	.enter = cgfs2_enter,
+	.create_legacy = NULL,
+	.get_cgroup = cgfs2_get_cgroup,
+	.get_abs_path = cgfs2_get_abs_path,
+	.get = cgfs2_get,
+	.set = cgfs2_set,
+	.get_path = cgfs2_get_path,
+	.unfreeze = cgfs2_unfreeze,
+	.kill = cgfs2_kill,
+	.setup_limits = cgfs2_setup_limits,
+	.name = "cgroup2",
+	.attach = cgfs2_attach,
+	.chown = cgfs2_chown,
+	.mount_cgroup = cgfs2_mount_cgroup,
+	.nrtasks = cgfs2_nrtasks,
+	.disconnect = NULL,
+};
@@ -118,15 +118,58 @@ static char **subsystems;
 static bool dbus_threads_initialized = false;
 static void cull_user_controllers(void);
 
+/*
+ * The connection to cgmanager is kept for the life of the process (or
+ * until cgroup_disconnect()), so a container start or a series of
+ * lxc-cgroup calls share one.  cgm_dbus_connect() takes cgm_lock and
+ * reconnects if the connection is missing or dead, cgm_dbus_disconnect()
+ * only drops the lock.  A child of fork() must not use the connection of
+ * its parent and opens its own.
+ */
+static pid_t cgm_conn_pid;
+
+/* called with cgm_lock held */
+static void cgm_dbus_close(void)
+{
+	if (cgroup_manager) {
+		dbus_connection_flush(cgroup_manager->connection);
+		dbus_connection_close(cgroup_manager->connection);
+		nih_free(cgroup_manager);
+	}
+	cgroup_manager = NULL;
+}
+
 static void cgm_dbus_disconnect(void)
 {
-       if (cgroup_manager) {
-	       dbus_connection_flush(cgroup_manager->connection);
-	       dbus_connection_close(cgroup_manager->connection);
-               nih_free(cgroup_manager);
-       }
-       cgroup_manager = NULL;
-       cgm_unlock();
+	cgm_unlock();
+}
+
+/* close the connection until it is needed again */
+static void cgm_disconnect(void)
+{
+	cgm_lock();
+	if (cgroup_manager && cgm_conn_pid == getpid())
+		cgm_dbus_close();
+	cgroup_manager = NULL;
+	cgm_unlock();
+}
+
+/* called with cgm_lock held */
+static bool cgm_dbus_connected(void)
+{
+	if (!cgroup_manager)
+		return false;
+	if (cgm_conn_pid != getpid()) {
+		/* the parent still talks over it, leave it alone */
+		cgroup_manager = NULL;
+		return false;
+	}
+	if (!dbus_connection_get_is_connected(cgroup_manager->connection)) {
+		INFO("Connection to cgroup manager was lost, reconnecting");
+		cgm_dbus_close();
+		return false;
+	}
+	return true;
 }
 
 #define CGMANAGER_DBUS_SOCK "unix:path=/sys/fs/cgroup/cgmanager/sock"
@@ -136,6 +179,9 @@ static bool cgm_dbus_connect(void)
 	static DBusConnection *connection;
 
 	cgm_lock();
+	if (cgm_dbus_connected())
+		return true;
+
 	if (!dbus_threads_initialized) {
 		// tell dbus to do struct locking for thread safety
 		dbus_threads_init_default();
@@ -163,9 +209,11 @@ static bool cgm_dbus_connect(void)
 		nerr = nih_error_get();
 		ERROR("Error opening cgmanager proxy: %s", nerr->message);
 		nih_free(nerr);
-		cgm_dbus_disconnect();
+		cgm_dbus_close();
+		cgm_unlock();
 		return false;
 	}
+	cgm_conn_pid = getpid();
 
 	// get the api version
 	if (cgmanager_get_api_version_sync(NULL, cgroup_manager, &api_version) != 0) {
@@ -173,7 +221,8 @@ static bool cgm_dbus_connect(void)
 		nerr = nih_error_get();
 		ERROR("Error cgroup manager api version: %s", nerr->message);
 		nih_free(nerr);
-		cgm_dbus_disconnect();
+		cgm_dbus_close();
+		cgm_unlock();
 		return false;
 	}
 	if (api_version < CGM_SUPPORTS_NAMED)
@@ -658,8 +707,8 @@ static char *try_get_abs_cgroup(const char *name, const char *lxcpath,
 
 /*
  * nrtasks is called by the utmp helper by the container monitor.
- * cgmanager socket was closed after cgroup setup was complete, so we need
- * to reopen here.
+ * cgmanager socket was closed after cgroup setup was complete, so
+ * cgm_dbus_connect() reopens it here.
  *
  * Return -1 on error.
  */
@@ -1020,7 +1069,7 @@ out_free:
 /*
  * called during cgroup.c:cgroup_ops_init(), at startup.  No threads.
  * We check whether we can talk to cgmanager, escape to root cgroup if
- * we are root, then close the connection.
+ * we are root, then close the connection until it is first needed.
  */
 struct cgroup_ops *cgm_ops_init(void)
 {
@@ -1032,11 +1081,13 @@ struct cgroup_ops *cgm_ops_init(void)
 	// root;  try to escape to root cgroup
 	if (geteuid() == 0 && !lxc_cgmanager_escape())
 		goto err2;
+	cgm_dbus_close();
 	cgm_dbus_disconnect();
 
 	return &cgmanager_ops;
 
 err2:
+	cgm_dbus_close();
 	cgm_dbus_disconnect();
 err1:
 	free_subsystems();
@@ -1243,6 +1294,6 @@ static struct cgroup_ops cgmanager_ops = {
 	.attach = cgm_attach,
 	.mount_cgroup = cgm_mount_cgroup,
 	.nrtasks = cgm_get_nrtasks,
-	.disconnect = NULL,
+	.disconnect = cgm_disconnect,
 };
 #endif
@@ -21,8 +21,15 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
 #include "cgroup.h"
 #include "conf.h"
+#include "cpuset.h"
 #include "log.h"
 #include "start.h"
 
@@ -31,6 +38,7 @@ lxc_log_define(lxc_cgroup, lxc);
 static struct cgroup_ops *ops = NULL;
 
 extern struct cgroup_ops *cgfs_ops_init(void);
+extern struct cgroup_ops *cgfs2_ops_init(void);
 extern struct cgroup_ops *cgm_ops_init(void);
 
 __attribute__((constructor))
@@ -45,6 +53,8 @@ void cgroup_ops_init(void)
 	#if HAVE_CGMANAGER
 	ops = cgm_ops_init();
 	#endif
+	if (!ops)
+		ops = cgfs2_ops_init();
 	if (!ops)
 		ops = cgfs_ops_init();
 	if (ops)
@@ -76,8 +86,8 @@ void cgroup_destroy(struct lxc_handler *handler)
 /* Create the container cgroups for all requested controllers */
 bool cgroup_create(struct lxc_handler *handler)
 {
-	if (ops)
-		return ops->create(handler->cgroup_data);
+	if (ops && ops->create(handler->cgroup_data))
+		return lxc_cpuset_place(handler);
 	return false;
 }
 
@@ -106,6 +116,14 @@ const char *cgroup_get_cgroup(struct lxc_handler *handler, const char *subsystem
 	return NULL;
 }
 
+/* where the container's cgroup is mounted on the host, NULL if unknown */
+char *cgroup_get_abs_path(struct lxc_handler *handler, const char *subsystem)
+{
+	if (ops && ops->get_abs_path)
+		return ops->get_abs_path(handler->cgroup_data, subsystem);
+	return NULL;
+}
+
 bool cgroup_unfreeze(struct lxc_handler *handler)
 {
 	if (ops)
@@ -113,6 +131,64 @@ bool cgroup_unfreeze(struct lxc_handler *handler)
 	return false;
 }
 
+/*
+ * SIGKILL every task of the container at once, false if the backend can't:
+ * the caller then kills its init only.  It leaves the cgroup frozen if it
+ * had to freeze it, cgroup_unfreeze() lets the signals be delivered.
+ */
+bool cgroup_kill(struct lxc_handler *handler)
+{
+	if (ops && ops->kill)
+		return ops->kill(handler->cgroup_data);
+	return false;
+}
+
+/*
+ * SIGKILL the processes of the cgroup directory @dir and of all the cgroups
+ * below it, for when the kernel can't do it itself.  They are expected to be
+ * frozen, so that none forks meanwhile.
+ */
+int lxc_cgroup_kill_tree(const char *dir)
+{
+	char path[MAXPATHLEN];
+	struct dirent *dent;
+	DIR *d;
+	FILE *f;
+	int ret, pid, failed = 0;
+
+	ret = snprintf(path, sizeof(path), "%s/cgroup.procs", dir);
+	if (ret < 0 || ret >= sizeof(path))
+		return -1;
+	f = fopen(path, "re");
+	if (!f) {
+		SYSERROR("failed to open %s", path);
+		return -1;
+	}
+	while (fscanf(f, "%d", &pid) == 1) {
+		if (pid <= 0)
+			continue;
+		if (kill(pid, SIGKILL) < 0 && errno != ESRCH) {
+			SYSERROR("failed to kill %d", pid);
+			failed = 1;
+		}
+	}
+	fclose(f);
+
+	d = opendir(dir);
+	if (!d)
+		return -1;
+	while ((dent = readdir(d))) {
+		if (dent->d_type != DT_DIR || !strcmp(dent->d_name, ".") ||
+		    !strcmp(dent->d_name, ".."))
+			continue;
+		ret = snprintf(path, sizeof(path), "%s/%s", dir, dent->d_name);
+		if (ret < 0 || ret >= sizeof(path) || lxc_cgroup_kill_tree(path) < 0)
+			failed = 1;
+	}
+	closedir(d);
+	return failed ? -1 : 0;
+}
+
 bool cgroup_setup_limits(struct lxc_handler *handler, bool with_devices)
 {
 	if (ops)
@@ -168,6 +244,19 @@ int lxc_cgroup_get(const char *filename, char *value, size_t len, const char *na
 	return -1;
 }
 
+/*
+ * Absolute path of the container's cgroup for @subsystem, for reading its
+ * files directly.  Returns NULL with errno set to ENOSYS if the driver has
+ * no such paths, lxc_cgroup_get() is all there is then.
+ */
+char *lxc_cgroup_get_path(const char *subsystem, const char *name, const char *lxcpath)
+{
+	if (ops && ops->get_path)
+		return ops->get_path(subsystem, name, lxcpath);
+	errno = ENOSYS;
+	return NULL;
+}
+
 void cgroup_disconnect(void)
 {
 	if (ops && ops->disconnect)
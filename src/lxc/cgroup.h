@@ -41,9 +41,12 @@ struct cgroup_ops {
 	bool (*enter)(void *hdata, pid_t pid);
 	bool (*create_legacy)(void *hdata, pid_t pid);
 	const char *(*get_cgroup)(void *hdata, const char *subsystem);
+	char *(*get_abs_path)(void *hdata, const char *subsystem);
 	int (*set)(const char *filename, const char *value, const char *name, const char *lxcpath);
 	int (*get)(const char *filename, char *value, size_t len, const char *name, const char *lxcpath);
+	char *(*get_path)(const char *subsystem, const char *name, const char *lxcpath);
 	bool (*unfreeze)(void *hdata);
+	bool (*kill)(void *hdata);
 	bool (*setup_limits)(void *hdata, struct lxc_list *cgroup_conf, bool with_devices);
 	bool (*chown)(void *hdata, struct lxc_conf *conf);
 	bool (*attach)(const char *name, const char *lxcpath, pid_t pid);
@@ -64,7 +67,11 @@ extern void cgroup_cleanup(struct lxc_handler *handler);
 extern bool cgroup_create_legacy(struct lxc_handler *handler);
 extern int cgroup_nrtasks(struct lxc_handler *handler);
 extern const char *cgroup_get_cgroup(struct lxc_handler *handler, const char *subsystem);
+extern char *cgroup_get_abs_path(struct lxc_handler *handler, const char *subsystem);
 extern bool cgroup_unfreeze(struct lxc_handler *handler);
+extern bool cgroup_kill(struct lxc_handler *handler);
+extern int lxc_cgroup_kill_tree(const char *dir);
+extern char *lxc_cgroup_get_path(const char *subsystem, const char *name, const char *lxcpath);
 extern void cgroup_disconnect(void);
 
 #endif
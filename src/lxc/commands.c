@@ -27,6 +27,7 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/param.h>
@@ -44,6 +45,8 @@
 #include "confile.h"
 #include "mainloop.h"
 #include "af_unix.h"
+#include "status.h"
+#include "apistats.h"
 #include "config.h"
 
 /*
@@ -56,9 +59,14 @@
  * giving the request's status (zero or a negative errno value).
  * Both the request and response may contain addtional data.
  *
- * Each command is wrapped in a ancillary message in order to pass
- * a credential making possible to the server to check if the client
- * is allowed to ask for this command or not.
+ * The command socket is a SOCK_SEQPACKET one, a request is a single
+ * message made of struct lxc_cmd_req followed by its data, and so is a
+ * response with any fd it passes along: the length of the data is what
+ * is left of the message after the header.  A response whose data does
+ * not fit in LXC_CMD_DATA_MAX bytes goes on in LXC_CMD_RSP_CHUNK sized
+ * messages.  The server checks who is at the other end of the socket
+ * with SO_PEERCRED once, when it accepts the connection, to decide
+ * whether the client is allowed to ask for commands or not.
  *
  * IMPORTANTLY: Note that semantics for current commands are fixed.  If you
  * wish to make any changes to how, say, LXC_CMD_GET_CONFIG_ITEM works by
@@ -73,6 +81,9 @@
 
 lxc_log_define(lxc_commands, lxc);
 
+/* the rest of a response which did not fit in its first message */
+#define LXC_CMD_RSP_CHUNK (64 * 1024)
+
 static int fill_sock_name(char *path, int len, const char *name,
 			  const char *inpath)
 {
@@ -105,6 +116,10 @@ static const char *lxc_cmd_str(lxc_cmd_t cmd)
 		[LXC_CMD_GET_CLONE_FLAGS] = "get_clone_flags",
 		[LXC_CMD_GET_CGROUP]      = "get_cgroup",
 		[LXC_CMD_GET_CONFIG_ITEM] = "get_config_item",
+		[LXC_CMD_GET_CONFIG_ITEMS] = "get_config_items",
+		[LXC_CMD_CLAIM]           = "claim",
+		[LXC_CMD_CONSOLE_LOG]     = "console_log",
+		[LXC_CMD_GET_INIT_PIDFD]  = "get_init_pidfd",
 	};
 
 	if (cmd >= LXC_CMD_MAX)
@@ -127,19 +142,30 @@ static const char *lxc_cmd_str(lxc_cmd_t cmd)
  *
  * As a special case, the response for LXC_CMD_CONSOLE is created
  * here as it contains an fd for the master pty passed through the
- * unix socket.
+ * unix socket.  The pidfd LXC_CMD_GET_INIT_PIDFD passes along is
+ * returned in rsp.ret.
  */
-static int lxc_cmd_rsp_recv(int sock, struct lxc_cmd_rr *cmd)
+static int lxc_cmd_rsp_recv(int sock, struct lxc_cmd_rr *cmd, int legacy)
 {
-	int ret,rspfd;
+	int ret, rspfd = -1, len;
 	struct lxc_cmd_rsp *rsp = &cmd->rsp;
+	char buf[LXC_CMD_DATA_MAX];
+	struct iovec iov[2] = {
+		{ .iov_base = rsp, .iov_len = sizeof(*rsp) },
+		{ .iov_base = buf, .iov_len = sizeof(buf) },
+	};
 
-	ret = lxc_abstract_unix_recv_fd(sock, &rspfd, rsp, sizeof(*rsp));
+	/* a stream carries the header alone first, the data follows */
+	ret = lxc_abstract_unix_recv_fds_iov(sock, &rspfd, 1, iov, legacy ? 1 : 2);
 	if (ret < 0) {
 		WARN("command %s failed to receive response",
 		     lxc_cmd_str(cmd->req.cmd));
 		return -1;
 	}
+	if (ret > 0 && ret < sizeof(*rsp)) {
+		ERROR("command %s short response", lxc_cmd_str(cmd->req.cmd));
+		return -1;
+	}
 
 	if (cmd->req.cmd == LXC_CMD_CONSOLE) {
 		struct lxc_cmd_console_rsp_data *rspdata;
@@ -159,60 +185,339 @@ static int lxc_cmd_rsp_recv(int sock, struct lxc_cmd_rr *cmd)
 		rspdata->masterfd = rspfd;
 		rspdata->ttynum = PTR_TO_INT(rsp->data);
 		rsp->data = rspdata;
+		return ret;
 	}
 
-	if (rsp->datalen == 0)
+	if (cmd->req.cmd == LXC_CMD_GET_INIT_PIDFD && ret > 0 &&
+	    rsp->ret == 0) {
+		rsp->ret = rspfd >= 0 ? rspfd : -EBADF;
 		return ret;
-	if (rsp->datalen > LXC_CMD_DATA_MAX) {
+	}
+
+	if (rspfd >= 0)
+		close(rspfd);
+	if (ret == 0 || rsp->datalen == 0)
+		return ret;
+
+	if (rsp->datalen < 0 ||
+	    (rsp->datalen > LXC_CMD_DATA_MAX &&
+	     (cmd->req.cmd != LXC_CMD_GET_CONFIG_ITEMS ||
+	      rsp->datalen > LXC_CMD_CONFIG_ITEMS_MAX) &&
+	     (cmd->req.cmd != LXC_CMD_CONSOLE_LOG ||
+	      rsp->datalen > LXC_CONSOLE_BUFFER_MAX))) {
 		ERROR("command %s response data %d too long",
 		      lxc_cmd_str(cmd->req.cmd), rsp->datalen);
 		errno = EFBIG;
 		return -1;
 	}
 
+	len = ret - sizeof(*rsp);
+	if (!legacy &&
+	    len != (rsp->datalen < sizeof(buf) ? rsp->datalen : sizeof(buf))) {
+		ERROR("command %s response data cut short",
+		      lxc_cmd_str(cmd->req.cmd));
+		return -1;
+	}
+
 	rsp->data = malloc(rsp->datalen);
 	if (!rsp->data) {
 		ERROR("command %s unable to allocate response buffer",
 		      lxc_cmd_str(cmd->req.cmd));
 		return -1;
 	}
-	ret = recv(sock, rsp->data, rsp->datalen, 0);
-	if (ret != rsp->datalen) {
-		ERROR("command %s failed to receive response data",
-		      lxc_cmd_str(cmd->req.cmd));
-		if (ret >= 0)
-			ret = -1;
+	memcpy(rsp->data, buf, len);
+
+	/* each message of the rest is never bigger than what is left */
+	while (len < rsp->datalen) {
+		ret = recv(sock, (char *)rsp->data + len, rsp->datalen - len, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			ERROR("command %s failed to receive response data",
+			      lxc_cmd_str(cmd->req.cmd));
+			free(rsp->data);
+			rsp->data = NULL;
+			return -1;
+		}
+		len += ret;
 	}
 
-	return ret;
+	return sizeof(*rsp) + len;
+}
+
+/*
+ * The server's connections are non-blocking so that a client can't stall
+ * it, a message waits LXC_CMD_SEND_TIMEOUT milliseconds at most for the
+ * client to make room for it.
+ */
+static int lxc_cmd_send_msg(int fd, struct iovec *iov, size_t iovlen,
+			    int *sendfds, int num_sendfds)
+{
+	struct pollfd pfd;
+	int ret;
+
+	for (;;) {
+		ret = lxc_abstract_unix_send_fds_iov(fd, sendfds, num_sendfds,
+						     iov, iovlen);
+		if (ret >= 0)
+			return ret;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		ret = poll(&pfd, 1, LXC_CMD_SEND_TIMEOUT);
+		if (ret > 0 || (ret < 0 && errno == EINTR))
+			continue;
+		if (ret == 0)
+			errno = ETIMEDOUT;
+		return -1;
+	}
 }
 
 /*
- * lxc_cmd_rsp_send: Send a command response
+ * lxc_cmd_rsp_send_fd: Send a command response
  *
- * @fd   : file descriptor of socket to send response on
- * @rsp  : response to send
+ * @fd     : file descriptor of socket to send response on
+ * @rsp    : response to send
+ * @sendfd : fd to pass along with it, or -1
  *
  * Returns 0 on success, < 0 on failure
  */
-static int lxc_cmd_rsp_send(int fd, struct lxc_cmd_rsp *rsp)
+static int lxc_cmd_rsp_send_fd(int fd, struct lxc_cmd_rsp *rsp, int sendfd)
 {
-	int ret;
-
-	ret = send(fd, rsp, sizeof(*rsp), 0);
-	if (ret != sizeof(*rsp)) {
+	struct iovec iov[2];
+	int ret, len;
+
+	len = rsp->datalen < LXC_CMD_DATA_MAX ? rsp->datalen : LXC_CMD_DATA_MAX;
+	if (len < 0)
+		len = 0;
+	iov[0].iov_base = rsp;
+	iov[0].iov_len = sizeof(*rsp);
+	iov[1].iov_base = rsp->data;
+	iov[1].iov_len = len;
+
+	ret = lxc_cmd_send_msg(fd, iov, len ? 2 : 1, &sendfd, sendfd >= 0);
+	if (ret != sizeof(*rsp) + len) {
 		ERROR("failed to send command response %d %s", ret,
 		      strerror(errno));
 		return -1;
 	}
 
-	if (rsp->datalen > 0) {
-		ret = send(fd, rsp->data, rsp->datalen, 0);
-		if (ret != rsp->datalen) {
+	while (len < rsp->datalen) {
+		iov[0].iov_base = (char *)rsp->data + len;
+		iov[0].iov_len = rsp->datalen - len;
+		if (iov[0].iov_len > LXC_CMD_RSP_CHUNK)
+			iov[0].iov_len = LXC_CMD_RSP_CHUNK;
+
+		ret = lxc_cmd_send_msg(fd, iov, 1, NULL, 0);
+		if (ret != iov[0].iov_len) {
 			WARN("failed to send command response data %d %s", ret,
 			      strerror(errno));
 			return -1;
 		}
+		len += ret;
+	}
+	return 0;
+}
+
+static int lxc_cmd_rsp_send(int fd, struct lxc_cmd_rsp *rsp)
+{
+	return lxc_cmd_rsp_send_fd(fd, rsp, -1);
+}
+
+/*
+ * Persistent connections.  Callers which talk to the same container over
+ * and over can ask, with lxc_cmd_connection_get(), for its command socket
+ * to be kept open between commands.  The monitor serves any number of
+ * requests on one connection and answers them in order, so lxc_cmd() just
+ * reuses the socket instead of paying for connect, accept and the
+ * credential check each time.  Commands on one connection are serialized by its
+ * lock.
+ */
+struct lxc_cmd_conn {
+	char *path;
+	int refcount;
+	int sock;
+	int legacy;
+	pid_t owner;
+	pthread_mutex_t lock;
+	struct lxc_cmd_conn *next;
+};
+
+static struct lxc_cmd_conn *cmd_conns;
+static pthread_mutex_t cmd_conns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct lxc_cmd_conn *lxc_cmd_conn_find(const char *path)
+{
+	struct lxc_cmd_conn *conn;
+
+	for (conn = cmd_conns; conn; conn = conn->next)
+		if (strcmp(conn->path, path) == 0)
+			return conn;
+	return NULL;
+}
+
+/*
+ * lxc_cmd_conn_lock: Find and lock the kept connection for a socket path
+ *
+ * Returns NULL if nobody asked for the connection to be kept.  A socket
+ * inherited across fork() is dropped, it is the parent's conversation.
+ */
+static struct lxc_cmd_conn *lxc_cmd_conn_lock(const char *path)
+{
+	struct lxc_cmd_conn *conn;
+
+	pthread_mutex_lock(&cmd_conns_lock);
+	conn = lxc_cmd_conn_find(path);
+	if (conn)
+		pthread_mutex_lock(&conn->lock);
+	pthread_mutex_unlock(&cmd_conns_lock);
+
+	if (conn && conn->owner != getpid()) {
+		if (conn->sock >= 0)
+			close(conn->sock);
+		conn->sock = -1;
+		conn->owner = getpid();
+	}
+	return conn;
+}
+
+/*
+ * lxc_cmd_connection_get: Keep the command connection to a container open
+ *
+ * @name      : name of container
+ * @lxcpath   : the lxcpath in which the container is running
+ *
+ * Calls nest, the connection is closed by the last lxc_cmd_connection_put().
+ *
+ * Returns 0 on success, < 0 on failure
+ */
+int lxc_cmd_connection_get(const char *name, const char *lxcpath)
+{
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	struct lxc_cmd_conn *conn;
+	int ret = 0;
+
+	if (fill_sock_name(path, sizeof(path)-1, name, lxcpath))
+		return -1;
+
+	pthread_mutex_lock(&cmd_conns_lock);
+	conn = lxc_cmd_conn_find(path);
+	if (conn) {
+		conn->refcount++;
+		goto out;
+	}
+
+	conn = malloc(sizeof(*conn));
+	if (!conn || !(conn->path = strdup(path))) {
+		ERROR("failed to allocate command connection");
+		free(conn);
+		ret = -1;
+		goto out;
+	}
+	conn->refcount = 1;
+	conn->sock = -1;
+	conn->owner = getpid();
+	pthread_mutex_init(&conn->lock, NULL);
+	conn->next = cmd_conns;
+	cmd_conns = conn;
+out:
+	pthread_mutex_unlock(&cmd_conns_lock);
+	return ret;
+}
+
+/*
+ * lxc_cmd_connection_put: Drop a reference taken by lxc_cmd_connection_get()
+ *
+ * @name      : name of container
+ * @lxcpath   : the lxcpath in which the container is running
+ */
+void lxc_cmd_connection_put(const char *name, const char *lxcpath)
+{
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	struct lxc_cmd_conn *conn, **prev;
+
+	if (fill_sock_name(path, sizeof(path)-1, name, lxcpath))
+		return;
+
+	pthread_mutex_lock(&cmd_conns_lock);
+	for (prev = &cmd_conns; (conn = *prev); prev = &conn->next) {
+		if (strcmp(conn->path, path) != 0)
+			continue;
+		if (--conn->refcount > 0)
+			break;
+
+		*prev = conn->next;
+		/* wait for a command which may still be using it */
+		pthread_mutex_lock(&conn->lock);
+		if (conn->sock >= 0 && conn->owner == getpid())
+			close(conn->sock);
+		pthread_mutex_unlock(&conn->lock);
+		pthread_mutex_destroy(&conn->lock);
+		free(conn->path);
+		free(conn);
+		break;
+	}
+	pthread_mutex_unlock(&cmd_conns_lock);
+}
+
+/*
+ * lxc_cmd_connect: Connect to the command socket at @path
+ *
+ * A container started by an older liblxc listens on a SOCK_STREAM socket.
+ * Connecting to it as SOCK_SEQPACKET fails with EPROTOTYPE, or with
+ * ECONNREFUSED on kernels which keep abstract names apart per socket type,
+ * so a stream is tried before the container is taken for stopped.  *@legacy
+ * is then set: the request bytes are the same, the server's SO_PASSCRED has
+ * the kernel attach our credentials to them, but a response has to be read
+ * header first and then its data.
+ *
+ * Returns the socket, < 0 on failure with errno set
+ */
+static int lxc_cmd_connect(const char *path, int *legacy)
+{
+	int sock;
+
+	*legacy = 0;
+	sock = lxc_abstract_unix_connect(path, SOCK_SEQPACKET);
+	if (sock < 0 && (errno == EPROTOTYPE || errno == ECONNREFUSED)) {
+		sock = lxc_abstract_unix_connect(path, SOCK_STREAM);
+		if (sock >= 0) {
+			DEBUG("'@%s' is a stream socket, using the former protocol",
+			      &path[1]);
+			*legacy = 1;
+		}
+	}
+	return sock;
+}
+
+/*
+ * lxc_cmd_req_send: Send a command request, and its data if any
+ *
+ * Returns 0 on success, < 0 on failure with errno set
+ */
+static int lxc_cmd_req_send(int sock, struct lxc_cmd_rr *cmd, const char *path)
+{
+	struct iovec iov[2] = {
+		{ .iov_base = &cmd->req, .iov_len = sizeof(cmd->req) },
+		{ .iov_base = (void *)cmd->req.data, .iov_len = 0 },
+	};
+	int ret, iovlen = 1;
+
+	if (cmd->req.datalen > 0) {
+		iov[1].iov_len = cmd->req.datalen;
+		iovlen = 2;
+	}
+
+	ret = lxc_abstract_unix_send_fds_iov(sock, NULL, 0, iov, iovlen);
+	if (ret != iov[0].iov_len + iov[1].iov_len) {
+		if (errno != EPIPE)
+			SYSERROR("command %s failed to send req to '@%s' %d",
+				 lxc_cmd_str(cmd->req.cmd), path, ret);
+		return -1;
 	}
 	return 0;
 }
@@ -235,15 +540,26 @@ static int lxc_cmd_rsp_send(int fd, struct lxc_cmd_rsp *rsp)
  * will notice the fd on its side of the socket in its mainloop select and
  * then free the slot with lxc_cmd_fd_cleanup(). The socket fd will be
  * returned in the cmd response structure.
+ *
+ * LXC_CMD_CLAIM keeps the socket too, the caller talks to the container's
+ * lxc-init through it from then on.
+ *
+ * If the connection to the container is kept (see lxc_cmd_connection_get())
+ * every command but LXC_CMD_CONSOLE and LXC_CMD_CLAIM goes through the kept
+ * socket.
  */
 static int lxc_cmd(const char *name, struct lxc_cmd_rr *cmd, int *stopped,
 		   const char *lxcpath)
 {
+	LXC_STATS_TIMER(LXC_STAT_CMD);
 	int sock, ret = -1;
 	char path[sizeof(((struct sockaddr_un *)0)->sun_path)] = { 0 };
 	char *offset = &path[1];
 	int len;
-	int stay_connected = cmd->req.cmd == LXC_CMD_CONSOLE;
+	int stay_connected = cmd->req.cmd == LXC_CMD_CONSOLE ||
+			     cmd->req.cmd == LXC_CMD_CLAIM;
+	struct lxc_cmd_conn *conn = NULL;
+	int reused, legacy;
 
 	*stopped = 0;
 
@@ -251,53 +567,57 @@ static int lxc_cmd(const char *name, struct lxc_cmd_rr *cmd, int *stopped,
 	if (fill_sock_name(offset, len, name, lxcpath))
 		return -1;
 
-	sock = lxc_abstract_unix_connect(path);
-	if (sock < 0) {
-		if (errno == ECONNREFUSED)
-			*stopped = 1;
-		else
-			SYSERROR("command %s failed to connect to '@%s'",
-				 lxc_cmd_str(cmd->req.cmd), offset);
-		return -1;
-	}
-
-	ret = lxc_abstract_unix_send_credential(sock, &cmd->req, sizeof(cmd->req));
-	if (ret != sizeof(cmd->req)) {
-		if (errno == EPIPE)
-			goto epipe;
-		SYSERROR("command %s failed to send req to '@%s' %d",
-			 lxc_cmd_str(cmd->req.cmd), offset, ret);
-		if (ret >=0)
+	if (!stay_connected)
+		conn = lxc_cmd_conn_lock(offset);
+
+again:
+	reused = conn && conn->sock >= 0;
+	if (reused) {
+		sock = conn->sock;
+		legacy = conn->legacy;
+		conn->sock = -1;
+	} else {
+		sock = lxc_cmd_connect(path, &legacy);
+		if (sock < 0) {
+			if (errno == ECONNREFUSED)
+				*stopped = 1;
+			else
+				SYSERROR("command %s failed to connect to '@%s'",
+					 lxc_cmd_str(cmd->req.cmd), offset);
 			ret = -1;
-		goto out;
+			goto out_unlock;
+		}
 	}
 
-	if (cmd->req.datalen > 0) {
-		ret = send(sock, cmd->req.data, cmd->req.datalen, MSG_NOSIGNAL);
-		if (ret != cmd->req.datalen) {
-			if (errno == EPIPE)
-				goto epipe;
-			SYSERROR("command %s failed to send request data to '@%s' %d",
-				 lxc_cmd_str(cmd->req.cmd), offset, ret);
-			if (ret >=0)
-				ret = -1;
-			goto out;
+	if (lxc_cmd_req_send(sock, cmd, offset)) {
+		if (errno == EPIPE) {
+			close(sock);
+			/* the monitor closed our kept connection, reconnect */
+			if (reused)
+				goto again;
+			*stopped = 1;
+			ret = 0;
+			goto out_unlock;
 		}
+		ret = -1;
+		goto out;
 	}
 
-	ret = lxc_cmd_rsp_recv(sock, cmd);
+	ret = lxc_cmd_rsp_recv(sock, cmd, legacy);
 out:
-	if (!stay_connected || ret <= 0)
+	if (conn && ret > 0) {
+		conn->sock = sock;
+		conn->legacy = legacy;
+	}
+	else if (!stay_connected || ret <= 0 || cmd->rsp.ret < 0)
 		close(sock);
-	if (stay_connected && ret > 0)
+	if (stay_connected && ret > 0 && cmd->rsp.ret >= 0)
 		cmd->rsp.ret = sock;
+out_unlock:
+	if (conn)
+		pthread_mutex_unlock(&conn->lock);
 
 	return ret;
-
-epipe:
-	close(sock);
-	*stopped = 1;
-	return 0;
 }
 
 int lxc_try_cmd(const char *name, const char *lxcpath)
@@ -362,6 +682,48 @@ static int lxc_cmd_get_init_pid_callback(int fd, struct lxc_cmd_req *req,
 	return lxc_cmd_rsp_send(fd, &rsp);
 }
 
+/*
+ * lxc_cmd_get_init_pidfd: Get a pidfd for the container's init process
+ *
+ * @name      : name of container to connect to
+ * @lxcpath   : the lxcpath in which the container is running
+ * @pid       : out: pid of the init, may be NULL
+ *
+ * Unlike the pid, the pidfd can't come to name another process once the
+ * init is gone: it polls readable when the init exits and signals sent
+ * with pidfd_send_signal() to a reaped init fail with ESRCH.
+ *
+ * Returns the pidfd on success, < 0 on failure, -ENOSYS if the kernel
+ * has no pidfds.  The caller must close() it.
+ */
+int lxc_cmd_get_init_pidfd(const char *name, const char *lxcpath, pid_t *pid)
+{
+	int ret, stopped;
+	struct lxc_cmd_rr cmd = {
+		.req = { .cmd = LXC_CMD_GET_INIT_PIDFD },
+	};
+
+	ret = lxc_cmd(name, &cmd, &stopped, lxcpath);
+	if (ret < 0)
+		return ret;
+	if (ret == 0)
+		return -EPROTO;
+
+	if (cmd.rsp.ret >= 0 && pid)
+		*pid = PTR_TO_INT(cmd.rsp.data);
+	return cmd.rsp.ret;
+}
+
+static int lxc_cmd_get_init_pidfd_callback(int fd, struct lxc_cmd_req *req,
+					   struct lxc_handler *handler)
+{
+	struct lxc_cmd_rsp rsp = { .data = INT_TO_PTR(handler->pid) };
+
+	if (handler->pidfd < 0)
+		rsp.ret = -ENOSYS;
+	return lxc_cmd_rsp_send_fd(fd, &rsp, handler->pidfd);
+}
+
 /*
  * lxc_cmd_get_clone_flags: Get clone flags container was spawned with
  *
@@ -408,6 +770,7 @@ char *lxc_cmd_get_cgroup_path(const char *name, const char *lxcpath,
 	const char *subsystem)
 {
 	int ret, stopped;
+	char *path;
 	struct lxc_cmd_rr cmd = {
 		.req = {
 			.cmd = LXC_CMD_GET_CGROUP,
@@ -416,6 +779,11 @@ char *lxc_cmd_get_cgroup_path(const char *name, const char *lxcpath,
 		},
 	};
 
+	/* the container's status page usually knows it already */
+	path = lxc_status_get_cgroup(name, lxcpath, subsystem);
+	if (path)
+		return path;
+
 	ret = lxc_cmd(name, &cmd, &stopped, lxcpath);
 	if (ret < 0)
 		return NULL;
@@ -444,9 +812,13 @@ static int lxc_cmd_get_cgroup_callback(int fd, struct lxc_cmd_req *req,
 	if (req->datalen < 1)
 		return -1;
 
+	memset(&rsp, 0, sizeof(rsp));
 	path = cgroup_get_cgroup(handler, req->data);
-	if (!path)
-		return -1;
+	if (!path) {
+		/* answer rather than hang up, the client may keep the connection */
+		rsp.ret = -ENOENT;
+		return lxc_cmd_rsp_send(fd, &rsp);
+	}
 	rsp.datalen = strlen(path) + 1,
 	rsp.data = (char *)path;
 	rsp.ret = 0;
@@ -484,6 +856,18 @@ char *lxc_cmd_get_config_item(const char *name, const char *item,
 	return NULL;
 }
 
+/*
+ * lxc.start.timing only exists in a running container, it is not part of
+ * the configuration
+ */
+static int lxc_cmd_config_item(struct lxc_handler *handler, const char *key,
+			       char *retv, int inlen)
+{
+	if (strcmp(key, "lxc.start.timing") == 0)
+		return lxc_start_timing_get(handler, retv, inlen);
+	return lxc_get_config_item(handler->conf, key, retv, inlen);
+}
+
 static int lxc_cmd_get_config_item_callback(int fd, struct lxc_cmd_req *req,
 					    struct lxc_handler *handler)
 {
@@ -492,12 +876,12 @@ static int lxc_cmd_get_config_item_callback(int fd, struct lxc_cmd_req *req,
 	char *cidata;
 
 	memset(&rsp, 0, sizeof(rsp));
-	cilen = lxc_get_config_item(handler->conf, req->data, NULL, 0);
+	cilen = lxc_cmd_config_item(handler, req->data, NULL, 0);
 	if (cilen <= 0)
 		goto err1;
 
 	cidata = alloca(cilen + 1);
-	if (lxc_get_config_item(handler->conf, req->data, cidata, cilen + 1) != cilen)
+	if (lxc_cmd_config_item(handler, req->data, cidata, cilen + 1) != cilen)
 		goto err1;
 	cidata[cilen] = '\0';
 	rsp.data = cidata;
@@ -511,6 +895,135 @@ out:
 	return lxc_cmd_rsp_send(fd, &rsp);
 }
 
+/*
+ * lxc_cmd_get_config_items: Get several config items of the running
+ * container in one request
+ *
+ * @name     : name of container to connect to
+ * @items    : the configuration items to retrieve
+ * @n        : number of entries in @items
+ * @values   : out: the value of each item, NULL if it is empty or unknown
+ * @lxcpath  : the lxcpath in which the container is running
+ *
+ * The items are sent as consecutive nul-terminated strings, and the values
+ * come back the same way and in the same order.
+ *
+ * Returns 0 on success, < 0 on failure. The caller must free() each of the
+ * returned values.
+ */
+int lxc_cmd_get_config_items(const char *name, const char **items,
+			     int n, char **values, const char *lxcpath)
+{
+	int i, ret, stopped, len = 0;
+	char *buf, *p, *end;
+	struct lxc_cmd_rr cmd = {
+		.req = { .cmd = LXC_CMD_GET_CONFIG_ITEMS },
+	};
+
+	for (i = 0; i < n; i++) {
+		values[i] = NULL;
+		len += strlen(items[i]) + 1;
+	}
+	if (n <= 0)
+		return 0;
+	if (len > LXC_CMD_DATA_MAX) {
+		ERROR("too many config items requested");
+		return -1;
+	}
+
+	buf = alloca(len);
+	for (i = 0, p = buf; i < n; i++)
+		p = stpcpy(p, items[i]) + 1;
+	cmd.req.data = buf;
+	cmd.req.datalen = len;
+
+	ret = lxc_cmd(name, &cmd, &stopped, lxcpath);
+	if (ret <= 0)
+		return -1;
+
+	if (cmd.rsp.ret < 0 || cmd.rsp.datalen <= 0) {
+		ERROR("command %s failed for '%s': %s",
+		      lxc_cmd_str(cmd.req.cmd), name,
+		      strerror(-cmd.rsp.ret));
+		ret = -1;
+		goto out;
+	}
+
+	p = cmd.rsp.data;
+	end = p + cmd.rsp.datalen;
+	for (i = 0; i < n; i++) {
+		len = strnlen(p, end - p);
+		if (p + len == end) {
+			ERROR("command %s response truncated",
+			      lxc_cmd_str(cmd.req.cmd));
+			goto err;
+		}
+		if (len > 0 && !(values[i] = strdup(p)))
+			goto err;
+		p += len + 1;
+	}
+	ret = 0;
+	goto out;
+
+err:
+	for (i = 0; i < n; i++) {
+		free(values[i]);
+		values[i] = NULL;
+	}
+	ret = -1;
+out:
+	if (cmd.rsp.datalen > 0)
+		free(cmd.rsp.data);
+	return ret;
+}
+
+static int lxc_cmd_get_config_items_callback(int fd, struct lxc_cmd_req *req,
+					     struct lxc_handler *handler)
+{
+	struct lxc_cmd_rsp rsp;
+	const char *item, *end;
+	char *buf = NULL, *tmp;
+	int cilen, len = 0, ret;
+
+	memset(&rsp, 0, sizeof(rsp));
+	if (req->datalen < 1 || ((const char *)req->data)[req->datalen - 1]) {
+		rsp.ret = -EINVAL;
+		goto out;
+	}
+
+	end = (const char *)req->data + req->datalen;
+	for (item = req->data; item < end; item += strlen(item) + 1) {
+		/* empty or unknown items are sent back as empty strings */
+		cilen = lxc_cmd_config_item(handler, item, NULL, 0);
+		if (cilen < 0)
+			cilen = 0;
+
+		if (len + cilen + 1 > LXC_CMD_CONFIG_ITEMS_MAX) {
+			rsp.ret = -EFBIG;
+			goto out;
+		}
+		tmp = realloc(buf, len + cilen + 1);
+		if (!tmp) {
+			rsp.ret = -ENOMEM;
+			goto out;
+		}
+		buf = tmp;
+
+		if (cilen > 0 &&
+		    lxc_cmd_config_item(handler, item, buf + len, cilen + 1) != cilen)
+			cilen = 0;
+		buf[len + cilen] = '\0';
+		len += cilen + 1;
+	}
+	rsp.data = buf;
+	rsp.datalen = len;
+
+out:
+	ret = lxc_cmd_rsp_send(fd, &rsp);
+	free(buf);
+	return ret;
+}
+
 /*
  * lxc_cmd_get_state: Get current state of the container
  *
@@ -551,6 +1064,196 @@ static int lxc_cmd_get_state_callback(int fd, struct lxc_cmd_req *req,
 	return lxc_cmd_rsp_send(fd, &rsp);
 }
 
+/*
+ * Batched state queries.  Rather than connecting to one container at a
+ * time, keep up to LXC_CMD_BATCH_MAX connections in flight and send each
+ * of them a GET_STATE followed by a GET_INIT_PID request straight away.
+ * The answers are collected from a mainloop as they come in.
+ */
+#define LXC_CMD_BATCH_MAX	256
+#define LXC_CMD_BATCH_TIMEOUT	5000	/* ms without any answer */
+
+struct lxc_cmd_batch;
+
+struct lxc_cmd_batch_ent {
+	struct lxc_cmd_batch *batch;
+	int idx;
+	int fd;
+	int nrsp;
+};
+
+struct lxc_cmd_batch {
+	const char *lxcpath;
+	const char **names;
+	int n, next, inflight;
+	lxc_state_t *states;
+	pid_t *pids;
+	struct lxc_cmd_batch_ent *ents;
+};
+
+static int lxc_cmd_batch_handler(int fd, uint32_t events, void *data,
+				 struct lxc_epoll_descr *descr);
+
+static int lxc_cmd_batch_send(int sock, lxc_cmd_t cmd)
+{
+	struct lxc_cmd_req req = { .cmd = cmd };
+
+	if (send(sock, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req))
+		return -1;
+	return 0;
+}
+
+static void lxc_cmd_batch_fill(struct lxc_cmd_batch *b,
+			       struct lxc_epoll_descr *descr)
+{
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	char *offset = &path[1];
+	int i, sock, legacy;
+
+	while (b->inflight < LXC_CMD_BATCH_MAX && b->next < b->n) {
+		i = b->next++;
+
+		memset(path, 0, sizeof(path));
+		if (fill_sock_name(offset, sizeof(path)-1, b->names[i], b->lxcpath))
+			continue;
+
+		/* responses without data read the same from a stream */
+		sock = lxc_cmd_connect(path, &legacy);
+		if (sock < 0) {
+			if (errno == ECONNREFUSED)
+				b->states[i] = STOPPED;
+			continue;
+		}
+
+		if (fcntl(sock, F_SETFD, FD_CLOEXEC) ||
+		    fcntl(sock, F_SETFL, O_NONBLOCK) ||
+		    lxc_cmd_batch_send(sock, LXC_CMD_GET_STATE) ||
+		    lxc_cmd_batch_send(sock, LXC_CMD_GET_INIT_PID)) {
+			if (errno == EPIPE)
+				b->states[i] = STOPPED;
+			close(sock);
+			continue;
+		}
+
+		b->ents[i].batch = b;
+		b->ents[i].idx = i;
+		b->ents[i].fd = sock;
+		b->ents[i].nrsp = 0;
+		if (lxc_mainloop_add_handler(descr, sock, lxc_cmd_batch_handler,
+					     &b->ents[i])) {
+			close(sock);
+			b->ents[i].fd = -1;
+			continue;
+		}
+		b->inflight++;
+	}
+}
+
+static int lxc_cmd_batch_handler(int fd, uint32_t events, void *data,
+				 struct lxc_epoll_descr *descr)
+{
+	struct lxc_cmd_batch_ent *e = data;
+	struct lxc_cmd_batch *b = e->batch;
+	struct lxc_cmd_rsp rsp;
+	int ret;
+
+	for (;;) {
+		ret = recv(fd, &rsp, sizeof(rsp), MSG_DONTWAIT);
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			return 0;
+		if (ret != sizeof(rsp))
+			break;
+		if (rsp.ret < 0 || rsp.datalen != 0) {
+			DEBUG("command batch for '%s' failed: %s",
+			      b->names[e->idx], strerror(-rsp.ret));
+			break;
+		}
+
+		if (e->nrsp++ == 0) {
+			b->states[e->idx] = PTR_TO_INT(rsp.data);
+			continue;
+		}
+		if (b->pids)
+			b->pids[e->idx] = PTR_TO_INT(rsp.data);
+		break;
+	}
+
+	/* the monitor went away before telling us anything */
+	if (ret == 0 && e->nrsp == 0)
+		b->states[e->idx] = STOPPED;
+
+	lxc_mainloop_del_handler(descr, fd);
+	close(fd);
+	e->fd = -1;
+	b->inflight--;
+	lxc_cmd_batch_fill(b, descr);
+	return 0;
+}
+
+/*
+ * lxc_cmd_get_states: Get the state and init pid of many containers at once
+ *
+ * @lxcpath   : the lxcpath in which the containers are
+ * @names     : names of the containers to ask
+ * @n         : number of entries in @names
+ * @states    : out: state of each container, or -1 if it is unknown
+ * @pids      : out: init pid of each container, or -1 (may be NULL)
+ *
+ * Returns the number of containers whose state is known, < 0 on failure
+ */
+int lxc_cmd_get_states(const char *lxcpath, const char **names, int n,
+		       lxc_state_t *states, pid_t *pids)
+{
+	struct lxc_epoll_descr descr;
+	struct lxc_cmd_batch b = {
+		.lxcpath = lxcpath,
+		.names = names,
+		.n = n,
+		.states = states,
+		.pids = pids,
+	};
+	int i, known = 0;
+
+	if (n <= 0)
+		return 0;
+
+	b.ents = malloc(n * sizeof(*b.ents));
+	if (!b.ents)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		states[i] = -1;
+		if (pids)
+			pids[i] = -1;
+		b.ents[i].fd = -1;
+	}
+
+	if (lxc_mainloop_open(&descr)) {
+		ERROR("failed to create mainloop");
+		free(b.ents);
+		return -1;
+	}
+
+	lxc_cmd_batch_fill(&b, &descr);
+	/* lxc_mainloop() returns once all handlers are gone or on timeout */
+	if (b.inflight > 0 && lxc_mainloop(&descr, LXC_CMD_BATCH_TIMEOUT) < 0)
+		SYSERROR("failed waiting for command answers");
+
+	if (b.inflight > 0) {
+		WARN("%d containers did not answer in time", b.inflight);
+		for (i = 0; i < n; i++)
+			if (b.ents[i].fd >= 0)
+				close(b.ents[i].fd);
+	}
+	lxc_mainloop_close(&descr);
+	free(b.ents);
+
+	for (i = 0; i < n; i++)
+		if (states[i] >= 0)
+			known++;
+	return known;
+}
+
 /*
  * lxc_cmd_stop: Stop the container previously started with lxc_start. All
  * the processes running inside this container will be killed.
@@ -560,11 +1263,11 @@ static int lxc_cmd_get_state_callback(int fd, struct lxc_cmd_req *req,
  *
  * Returns 0 on success, < 0 on failure
  */
-int lxc_cmd_stop(const char *name, const char *lxcpath)
+static int do_lxc_cmd_stop(const char *name, int flags, const char *lxcpath)
 {
 	int ret, stopped;
 	struct lxc_cmd_rr cmd = {
-		.req = { .cmd = LXC_CMD_STOP },
+		.req = { .cmd = LXC_CMD_STOP, .data = INT_TO_PTR(flags) },
 	};
 
 	ret = lxc_cmd(name, &cmd, &stopped, lxcpath);
@@ -577,17 +1280,30 @@ int lxc_cmd_stop(const char *name, const char *lxcpath)
 	}
 
 	/* we do not expect any answer, because we wait for the connection to be
-	 * closed
+	 * closed, unless we asked not to wait
 	 */
-	if (ret > 0) {
+	if (ret > 0 && (!(flags & LXC_CMD_STOP_NOWAIT) || cmd.rsp.ret < 0)) {
 		ERROR("failed to stop '%s': %s", name, strerror(-cmd.rsp.ret));
 		return -1;
 	}
 
-	INFO("'%s' has stopped", name);
+	if (ret > 0)
+		INFO("'%s' is stopping", name);
+	else
+		INFO("'%s' has stopped", name);
 	return 0;
 }
 
+int lxc_cmd_stop(const char *name, const char *lxcpath)
+{
+	return do_lxc_cmd_stop(name, 0, lxcpath);
+}
+
+int lxc_cmd_stop_nowait(const char *name, const char *lxcpath)
+{
+	return do_lxc_cmd_stop(name, LXC_CMD_STOP_NOWAIT, lxcpath);
+}
+
 static int lxc_cmd_stop_callback(int fd, struct lxc_cmd_req *req,
 				 struct lxc_handler *handler)
 {
@@ -597,15 +1313,27 @@ static int lxc_cmd_stop_callback(int fd, struct lxc_cmd_req *req,
 	if (handler->conf->stopsignal)
 		stopsignal = handler->conf->stopsignal;
 	memset(&rsp, 0, sizeof(rsp));
-	rsp.ret = kill(handler->pid, stopsignal);
+	/*
+	 * Rather than leave it to the kernel to kill the rest of the pid
+	 * namespace once init is gone, one task after the other.
+	 */
+	if (stopsignal == SIGKILL && handler->conf->stop_cgroup_kill &&
+	    cgroup_kill(handler))
+		rsp.ret = 0;
+	else
+		rsp.ret = kill(handler->pid, stopsignal);
 	if (!rsp.ret) {
 		/* we can't just use lxc_unfreeze() since we are already in the
 		 * context of handling the STOP cmd in lxc-start, and calling
 		 * lxc_unfreeze() would do another cmd (GET_CGROUP) which would
 		 * deadlock us
 		 */
-		if (cgroup_unfreeze(handler))
+		if (cgroup_unfreeze(handler)) {
+			/* else the client learns it stopped from the close */
+			if (PTR_TO_INT(req->data) & LXC_CMD_STOP_NOWAIT)
+				return lxc_cmd_rsp_send(fd, &rsp);
 			return 0;
+		}
 		ERROR("Failed to unfreeze %s:%s", handler->lxcpath, handler->name);
 		rsp.ret = -1;
 	}
@@ -644,6 +1372,65 @@ static int lxc_cmd_console_winch_callback(int fd, struct lxc_cmd_req *req,
 	return lxc_cmd_rsp_send(fd, &rsp);
 }
 
+/*
+ * lxc_cmd_console_log: Read and/or clear the history of the console
+ *
+ * @name      : name of container to connect to
+ * @lxcpath   : the lxcpath in which the container is running
+ * @flags     : LXC_CMD_CONSOLE_LOG_READ and/or LXC_CMD_CONSOLE_LOG_CLEAR
+ * @data      : out: with LXC_CMD_CONSOLE_LOG_READ, the history, to free()
+ * @len       : out: with LXC_CMD_CONSOLE_LOG_READ, its length
+ *
+ * Returns 0 on success, -ENODATA when lxc.console.buffer.size is not set,
+ * < 0 on other failures
+ */
+int lxc_cmd_console_log(const char *name, const char *lxcpath, int flags,
+			char **data, size_t *len)
+{
+	int ret, stopped;
+	struct lxc_cmd_rr cmd = {
+		.req = { .cmd = LXC_CMD_CONSOLE_LOG, .data = INT_TO_PTR(flags) },
+	};
+
+	ret = lxc_cmd(name, &cmd, &stopped, lxcpath);
+	if (ret < 0)
+		return ret;
+	if (cmd.rsp.ret < 0) {
+		free(cmd.rsp.datalen ? cmd.rsp.data : NULL);
+		return cmd.rsp.ret;
+	}
+
+	if (flags & LXC_CMD_CONSOLE_LOG_READ) {
+		*data = cmd.rsp.datalen ? cmd.rsp.data : strdup("");
+		*len = cmd.rsp.datalen;
+		if (!*data)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+static int lxc_cmd_console_log_callback(int fd, struct lxc_cmd_req *req,
+					struct lxc_handler *handler)
+{
+	struct lxc_cmd_rsp rsp = { .data = NULL };
+	int flags = PTR_TO_INT(req->data);
+	char *buf = NULL;
+	size_t len = 0;
+	int ret;
+
+	rsp.ret = lxc_console_log(&handler->conf->console,
+				  flags & LXC_CMD_CONSOLE_LOG_READ ? &buf : NULL,
+				  &len, flags & LXC_CMD_CONSOLE_LOG_CLEAR);
+	if (rsp.ret == 0 && len) {
+		rsp.data = buf;
+		rsp.datalen = len;
+	}
+
+	ret = lxc_cmd_rsp_send(fd, &rsp);
+	free(buf);
+	return ret;
+}
+
 /*
  * lxc_cmd_console: Open an fd to a tty in the container
  *
@@ -707,7 +1494,7 @@ static int lxc_cmd_console_callback(int fd, struct lxc_cmd_req *req,
 
 	memset(&rsp, 0, sizeof(rsp));
 	rsp.data = INT_TO_PTR(ttynum);
-	if (lxc_abstract_unix_send_fd(fd, masterfd, &rsp, sizeof(rsp)) < 0) {
+	if (lxc_cmd_rsp_send_fd(fd, &rsp, masterfd) < 0) {
 		ERROR("failed to send tty to client");
 		lxc_console_free(handler->conf, fd);
 		goto out_close;
@@ -723,6 +1510,106 @@ out_close:
 }
 
 
+/*
+ * lxc_cmd_claim: Run a command in a parked container
+ *
+ * @name      : name of container to connect to
+ * @argv      : the command and its arguments
+ * @lxcpath   : the lxcpath in which the container is running
+ *
+ * The command runs with our stdin, stdout and stderr, and once it exited
+ * the container goes away.  Returns its wait status, < 0 on failure
+ */
+int lxc_cmd_claim(const char *name, char *const argv[], const char *lxcpath)
+{
+	int ret, stopped, sock, i, status;
+	int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	struct lxc_cmd_claim_job job = { 0 };
+	struct iovec iov[2];
+	char *buf, *p;
+	struct lxc_cmd_rr cmd = {
+		.req = { .cmd = LXC_CMD_CLAIM },
+	};
+
+	for (i = 0; argv[i]; i++) {
+		job.len += strlen(argv[i]) + 1;
+		if (job.len > LXC_CMD_DATA_MAX) {
+			ERROR("command line too long");
+			return -1;
+		}
+	}
+	job.argc = i;
+	if (!job.argc) {
+		ERROR("missing command to run in '%s'", name);
+		return -1;
+	}
+
+	buf = malloc(job.len);
+	if (!buf) {
+		ERROR("failed to allocate memory");
+		return -1;
+	}
+	for (p = buf, i = 0; argv[i]; i++)
+		p = stpcpy(p, argv[i]) + 1;
+
+	ret = lxc_cmd(name, &cmd, &stopped, lxcpath);
+	if (ret <= 0) {
+		if (stopped)
+			ERROR("'%s' is not running", name);
+		ret = -1;
+		goto out;
+	}
+
+	if (cmd.rsp.ret < 0) {
+		ERROR("failed to claim '%s': %s", name, strerror(-cmd.rsp.ret));
+		ret = -1;
+		goto out;
+	}
+
+	sock = cmd.rsp.ret;
+	ret = -1;
+	iov[0].iov_base = &job;
+	iov[0].iov_len = sizeof(job);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = job.len;
+	if (lxc_abstract_unix_send_fds_iov(sock, fds, 3, iov, 2) !=
+	    sizeof(job) + job.len) {
+		SYSERROR("failed to hand '%s' over to '%s'", argv[0], name);
+		goto out_close;
+	}
+
+	if (lxc_read_nointr(sock, &status, sizeof(status)) != sizeof(status)) {
+		ERROR("'%s' went away without the status of '%s'", name, argv[0]);
+		goto out_close;
+	}
+	ret = status;
+
+out_close:
+	close(sock);
+out:
+	free(buf);
+	return ret;
+}
+
+static int lxc_cmd_claim_callback(int fd, struct lxc_cmd_req *req,
+				  struct lxc_handler *handler)
+{
+	struct lxc_cmd_rsp rsp;
+
+	memset(&rsp, 0, sizeof(rsp));
+	if (handler->claimfd < 0)
+		rsp.ret = -EBUSY;
+	else if (lxc_abstract_unix_send_fd(handler->claimfd, fd, NULL, 0) < 0)
+		rsp.ret = -errno;
+	else
+		handler->claimfd = -1;
+
+	lxc_cmd_rsp_send(fd, &rsp);
+
+	/* lxc-init holds the connection from now on, drop ours */
+	return 1;
+}
+
 
 static int lxc_cmd_process(int fd, struct lxc_cmd_req *req,
 			   struct lxc_handler *handler)
@@ -738,6 +1625,10 @@ static int lxc_cmd_process(int fd, struct lxc_cmd_req *req,
 		[LXC_CMD_GET_CLONE_FLAGS] = lxc_cmd_get_clone_flags_callback,
 		[LXC_CMD_GET_CGROUP]      = lxc_cmd_get_cgroup_callback,
 		[LXC_CMD_GET_CONFIG_ITEM] = lxc_cmd_get_config_item_callback,
+		[LXC_CMD_GET_CONFIG_ITEMS] = lxc_cmd_get_config_items_callback,
+		[LXC_CMD_CLAIM]           = lxc_cmd_claim_callback,
+		[LXC_CMD_CONSOLE_LOG]     = lxc_cmd_console_log_callback,
+		[LXC_CMD_GET_INIT_PIDFD]  = lxc_cmd_get_init_pidfd_callback,
 	};
 
 	if (req->cmd >= LXC_CMD_MAX) {
@@ -747,32 +1638,62 @@ static int lxc_cmd_process(int fd, struct lxc_cmd_req *req,
 	return cb[req->cmd](fd, req, handler);
 }
 
-static void lxc_cmd_fd_cleanup(int fd, struct lxc_handler *handler,
+/*
+ * Server side connection state. A request comes whole in one message,
+ * its data is kept for as long as it is being served.
+ *
+ * @fd      : the accepted connection
+ * @handler : the container's handler
+ * @req     : the request being served
+ * @data    : req.datalen bytes buffer for the request's data
+ * @denied  : the client may not ask for commands, see lxc_cmd_accept()
+ */
+struct lxc_cmd_peer {
+	int fd;
+	struct lxc_handler *handler;
+	struct lxc_cmd_req req;
+	char *data;
+	bool denied;
+};
+
+static void lxc_cmd_peer_reset(struct lxc_cmd_peer *peer,
 			       struct lxc_epoll_descr *descr)
 {
-	lxc_console_free(handler->conf, fd);
-	lxc_mainloop_del_handler(descr, fd);
-	close(fd);
+	free(peer->data);
+	peer->data = NULL;
+}
+
+static void lxc_cmd_fd_cleanup(struct lxc_cmd_peer *peer,
+			       struct lxc_epoll_descr *descr)
+{
+	lxc_cmd_peer_reset(peer, descr);
+	lxc_console_free(peer->handler->conf, peer->fd);
+	lxc_mainloop_del_handler(descr, peer->fd);
+	close(peer->fd);
+	free(peer);
 }
 
 static int lxc_cmd_handler(int fd, uint32_t events, void *data,
 			   struct lxc_epoll_descr *descr)
 {
 	int ret;
-	struct lxc_cmd_req req;
-	struct lxc_handler *handler = data;
-
-	ret = lxc_abstract_unix_rcv_credential(fd, &req, sizeof(req));
-	if (ret == -EACCES) {
-		/* we don't care for the peer, just send and close */
-		struct lxc_cmd_rsp rsp = { .ret = ret };
+	struct lxc_cmd_peer *peer = data;
+	char buf[LXC_CMD_DATA_MAX];
+	struct iovec iov[2] = {
+		{ .iov_base = &peer->req, .iov_len = sizeof(peer->req) },
+		{ .iov_base = buf, .iov_len = sizeof(buf) },
+	};
 
-		lxc_cmd_rsp_send(fd, &rsp);
-		goto out_close;
-	}
+	ret = lxc_abstract_unix_recv_fds_iov(fd, NULL, 0, iov, 2);
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+			errno == EINTR))
+		return 0;
 
 	if (ret < 0) {
-		SYSERROR("failed to receive data on command socket");
+		if (errno == EMSGSIZE)
+			ERROR("cmd data too large");
+		else
+			SYSERROR("failed to receive data on command socket");
 		goto out_close;
 	}
 
@@ -781,49 +1702,51 @@ static int lxc_cmd_handler(int fd, uint32_t events, void *data,
 		goto out_close;
 	}
 
-	if (ret != sizeof(req)) {
+	if (ret < sizeof(peer->req)) {
 		WARN("partial request, ignored");
-		ret = -1;
 		goto out_close;
 	}
 
-	if (req.datalen > LXC_CMD_DATA_MAX) {
-		ERROR("cmd data length %d too large", req.datalen);
-		ret = -1;
+	if (peer->denied) {
+		/* we don't care for the peer, just send and close */
+		struct lxc_cmd_rsp rsp = { .ret = -EACCES };
+
+		lxc_cmd_rsp_send(fd, &rsp);
 		goto out_close;
 	}
 
-	if (req.datalen > 0) {
-		void *reqdata;
-
-		reqdata = alloca(req.datalen);
-		ret = recv(fd, reqdata, req.datalen, 0);
-		if (ret != req.datalen) {
-			WARN("partial request, ignored");
-			ret = -1;
+	/* whatever follows the header is the data, req.data is left alone
+	 * otherwise, some commands pass an int in it */
+	peer->req.datalen = ret - sizeof(peer->req);
+	if (peer->req.datalen > 0) {
+		peer->data = malloc(peer->req.datalen);
+		if (!peer->data) {
+			ERROR("failed to allocate the cmd data");
 			goto out_close;
 		}
-		req.data = reqdata;
+		memcpy(peer->data, buf, peer->req.datalen);
+		peer->req.data = peer->data;
 	}
 
-	ret = lxc_cmd_process(fd, &req, handler);
+	ret = lxc_cmd_process(fd, &peer->req, peer->handler);
 	if (ret) {
 		/* this is not an error, but only a request to close fd */
-		ret = 0;
 		goto out_close;
 	}
 
-out:
-	return ret;
+	lxc_cmd_peer_reset(peer, descr);
+	return 0;
+
 out_close:
-	lxc_cmd_fd_cleanup(fd, handler, descr);
-	goto out;
+	lxc_cmd_fd_cleanup(peer, descr);
+	return 0;
 }
 
 static int lxc_cmd_accept(int fd, uint32_t events, void *data,
 			  struct lxc_epoll_descr *descr)
 {
-	int opt = 1, ret = -1, connection;
+	int ret = -1, connection, flags, allowed;
+	struct lxc_cmd_peer *peer;
 
 	connection = accept(fd, NULL, 0);
 	if (connection < 0) {
@@ -836,15 +1759,33 @@ static int lxc_cmd_accept(int fd, uint32_t events, void *data,
 		goto out_close;
 	}
 
-	if (setsockopt(connection, SOL_SOCKET,
-		       SO_PASSCRED, &opt, sizeof(opt))) {
-		SYSERROR("failed to enable credential on socket");
+	flags = fcntl(connection, F_GETFL);
+	if (flags < 0 || fcntl(connection, F_SETFL, flags | O_NONBLOCK)) {
+		SYSERROR("failed to set non-blocking on incoming connection");
 		goto out_close;
 	}
 
-	ret = lxc_mainloop_add_handler(descr, connection, lxc_cmd_handler, data);
+	/* the client learns it was denied with the answer to its request */
+	allowed = lxc_abstract_unix_check_peer(connection);
+	if (allowed < 0 && allowed != -EACCES) {
+		SYSERROR("failed to get the credentials of the client");
+		goto out_close;
+	}
+
+	peer = malloc(sizeof(*peer));
+	if (!peer) {
+		ERROR("failed to allocate the connection");
+		goto out_close;
+	}
+	memset(peer, 0, sizeof(*peer));
+	peer->fd = connection;
+	peer->handler = data;
+	peer->denied = allowed == -EACCES;
+
+	ret = lxc_mainloop_add_handler(descr, connection, lxc_cmd_handler, peer);
 	if (ret) {
 		ERROR("failed to add handler");
+		free(peer);
 		goto out_close;
 	}
 
@@ -868,7 +1809,7 @@ int lxc_cmd_init(const char *name, struct lxc_handler *handler,
 	if (fill_sock_name(offset, len, name, lxcpath))
 		return -1;
 
-	fd = lxc_abstract_unix_open(path, SOCK_STREAM, 0);
+	fd = lxc_abstract_unix_open(path, SOCK_SEQPACKET, 0);
 	if (fd < 0) {
 		ERROR("failed (%d) to create the command service point %s", errno, offset);
 		if (errno == EADDRINUSE) {
@@ -889,6 +1830,17 @@ int lxc_cmd_init(const char *name, struct lxc_handler *handler,
 	return 0;
 }
 
+static void lxc_cmd_peer_release(int fd, void *data,
+				 struct lxc_epoll_descr *descr)
+{
+	lxc_cmd_fd_cleanup(data, descr);
+}
+
+void lxc_cmd_mainloop_release(struct lxc_epoll_descr *descr)
+{
+	lxc_mainloop_for_each(descr, lxc_cmd_handler, lxc_cmd_peer_release);
+}
+
 int lxc_cmd_mainloop_add(const char *name,
 			 struct lxc_epoll_descr *descr,
 			 struct lxc_handler *handler)
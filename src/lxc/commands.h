@@ -27,6 +27,10 @@
 #include "state.h"
 
 #define LXC_CMD_DATA_MAX (MAXPATHLEN*2)
+/* a whole set of config items can be much larger than a single one */
+#define LXC_CMD_CONFIG_ITEMS_MAX (MAXPATHLEN*64)
+/* ms a client has to take each message of a response */
+#define LXC_CMD_SEND_TIMEOUT 5000
 
 /* https://developer.gnome.org/glib/2.28/glib-Type-Conversion-Macros.html */
 #define INT_TO_PTR(n) ((void *) (long) (n))
@@ -41,6 +45,10 @@ typedef enum {
 	LXC_CMD_GET_CLONE_FLAGS,
 	LXC_CMD_GET_CGROUP,
 	LXC_CMD_GET_CONFIG_ITEM,
+	LXC_CMD_GET_CONFIG_ITEMS,
+	LXC_CMD_CLAIM,
+	LXC_CMD_CONSOLE_LOG,
+	LXC_CMD_GET_INIT_PIDFD,
 	LXC_CMD_MAX,
 } lxc_cmd_t;
 
@@ -66,7 +74,24 @@ struct lxc_cmd_console_rsp_data {
 	int ttynum;
 };
 
+/*
+ * What the claimer of a parked container sends its lxc-init, with its
+ * stdin, stdout and stderr: @argc strings, NUL terminated, which take
+ * @len bytes altogether follow.  lxc-init answers the wait status of
+ * the command as an int when it exits.
+ */
+struct lxc_cmd_claim_job {
+	int argc;
+	int len;
+};
+
+/* what LXC_CMD_CONSOLE_LOG does with the console history, in req.data */
+#define LXC_CMD_CONSOLE_LOG_READ  1
+#define LXC_CMD_CONSOLE_LOG_CLEAR 2
+
 extern int lxc_cmd_console_winch(const char *name, const char *lxcpath);
+extern int lxc_cmd_console_log(const char *name, const char *lxcpath,
+			       int flags, char **data, size_t *len);
 extern int lxc_cmd_console(const char *name, int *ttynum, int *fd,
 			   const char *lxcpath);
 /*
@@ -77,9 +102,26 @@ extern char *lxc_cmd_get_cgroup_path(const char *name, const char *lxcpath,
 			const char *subsystem);
 extern int lxc_cmd_get_clone_flags(const char *name, const char *lxcpath);
 extern char *lxc_cmd_get_config_item(const char *name, const char *item, const char *lxcpath);
+extern int lxc_cmd_get_config_items(const char *name, const char **items,
+				    int n, char **values, const char *lxcpath);
 extern pid_t lxc_cmd_get_init_pid(const char *name, const char *lxcpath);
+extern int lxc_cmd_get_init_pidfd(const char *name, const char *lxcpath,
+				  pid_t *pid);
 extern lxc_state_t lxc_cmd_get_state(const char *name, const char *lxcpath);
+extern int lxc_cmd_get_states(const char *lxcpath, const char **names, int n,
+			      lxc_state_t *states, pid_t *pids);
 extern int lxc_cmd_stop(const char *name, const char *lxcpath);
+/* answer LXC_CMD_STOP once the container is signalled, in req.data */
+#define LXC_CMD_STOP_NOWAIT 1
+extern int lxc_cmd_stop_nowait(const char *name, const char *lxcpath);
+/*
+ * Run @argv in container @name, which lxc_execute_park() started, with
+ * our stdin, stdout and stderr.  Returns its wait status, or < 0.
+ */
+extern int lxc_cmd_claim(const char *name, char *const argv[],
+			 const char *lxcpath);
+extern int lxc_cmd_connection_get(const char *name, const char *lxcpath);
+extern void lxc_cmd_connection_put(const char *name, const char *lxcpath);
 
 struct lxc_epoll_descr;
 struct lxc_handler;
@@ -88,6 +130,8 @@ extern int lxc_cmd_init(const char *name, struct lxc_handler *handler,
 			    const char *lxcpath);
 extern int lxc_cmd_mainloop_add(const char *name, struct lxc_epoll_descr *descr,
 				    struct lxc_handler *handler);
+/* closes the client connections left in descr, when it goes away */
+extern void lxc_cmd_mainloop_release(struct lxc_epoll_descr *descr);
 extern int lxc_try_cmd(const char *name, const char *lxcpath);
 
 #endif /* __commands_h */
@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <errno.h>
 #include <string.h>
 #include <dirent.h>
@@ -34,25 +35,22 @@
 #include <sys/syscall.h>
 #include <time.h>
 
-#if HAVE_PTY_H
-#include <pty.h>
-#else
-#include <../include/openpty.h>
-#endif
-
 #include <linux/loop.h>
+#include <linux/if_addr.h>
 
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/mount.h>
 #include <sys/mman.h>
 #include <sys/prctl.h>
 
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include <net/if.h>
 #include <libgen.h>
@@ -68,6 +66,7 @@
 #include "cgroup.h"
 #include "lxclock.h"
 #include "namespace.h"
+#include "sync.h"
 #include "lsm/lsm.h"
 
 #if HAVE_SYS_CAPABILITY_H
@@ -121,6 +120,14 @@ lxc_log_define(lxc_conf, lxc);
 #define CAP_SYS_ADMIN 21
 #endif
 
+#ifndef IFA_F_NODAD
+#define IFA_F_NODAD 0x02
+#endif
+
+#ifndef IFA_F_OPTIMISTIC
+#define IFA_F_OPTIMISTIC 0x04
+#endif
+
 /* Define pivot_root() if missing from the C library */
 #ifndef HAVE_PIVOT_ROOT
 static int pivot_root(const char * new_root, const char * put_old)
@@ -149,6 +156,129 @@ return -1;
 }
 #endif
 
+/*
+ * The new mount API (Linux 5.2, mount_setattr() 5.12), called directly as
+ * the C library may not wrap it yet.  Its syscall numbers are the same on
+ * every architecture but alpha.
+ */
+#if !defined(__NR_open_tree) && !defined(__alpha__)
+#define __NR_open_tree 428
+#endif
+#if !defined(__NR_move_mount) && !defined(__alpha__)
+#define __NR_move_mount 429
+#endif
+#if !defined(__NR_mount_setattr) && !defined(__alpha__)
+#define __NR_mount_setattr 442
+#endif
+
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY	0x00000001
+#define MOUNT_ATTR_NOSUID	0x00000002
+#define MOUNT_ATTR_NODEV	0x00000004
+#define MOUNT_ATTR_NOEXEC	0x00000008
+#define MOUNT_ATTR__ATIME	0x00000070
+#define MOUNT_ATTR_NOATIME	0x00000010
+#define MOUNT_ATTR_STRICTATIME	0x00000020
+#define MOUNT_ATTR_NODIRATIME	0x00000080
+#endif
+#ifndef MOUNT_ATTR_IDMAP
+#define MOUNT_ATTR_IDMAP	0x00100000
+#endif
+
+/* struct mount_attr, which newer C libraries define too */
+struct lxc_mount_attr {
+	uint64_t attr_set;
+	uint64_t attr_clr;
+	uint64_t propagation;
+	uint64_t userns_fd;
+};
+
+/*
+ * Bind @src on @target, relative to @dfd, through the new mount API: the
+ * tree is cloned, given all of @flags in one mount_setattr(), recursively
+ * for MS_REC, and attached to @target, instead of a mount() and a remount
+ * which both walk @target.  Returns 0, or -1 if the caller should
+ * mount(2).
+ */
+static int mount_bind_tree(const char *src, int dfd, const char *target,
+			   unsigned long flags)
+{
+#if defined(__NR_open_tree) && defined(__NR_move_mount) && \
+    defined(__NR_mount_setattr)
+	static bool unsupported;
+	struct lxc_mount_attr attr = { 0 };
+	unsigned int rec = flags & MS_REC ? AT_RECURSIVE : 0;
+	int fd, ret;
+
+	if (unsupported)
+		return -1;
+
+	if (flags & MS_RDONLY)
+		attr.attr_set |= MOUNT_ATTR_RDONLY;
+	if (flags & MS_NOSUID)
+		attr.attr_set |= MOUNT_ATTR_NOSUID;
+	if (flags & MS_NODEV)
+		attr.attr_set |= MOUNT_ATTR_NODEV;
+	if (flags & MS_NOEXEC)
+		attr.attr_set |= MOUNT_ATTR_NOEXEC;
+	if (flags & MS_NODIRATIME)
+		attr.attr_set |= MOUNT_ATTR_NODIRATIME;
+	if (flags & (MS_NOATIME | MS_STRICTATIME | MS_RELATIME))
+		attr.attr_clr |= MOUNT_ATTR__ATIME;
+	if (flags & MS_NOATIME)
+		attr.attr_set |= MOUNT_ATTR_NOATIME;
+	else if (flags & MS_STRICTATIME)
+		attr.attr_set |= MOUNT_ATTR_STRICTATIME;
+	if (flags & MS_SHARED)
+		attr.propagation = MS_SHARED;
+	else if (flags & MS_SLAVE)
+		attr.propagation = MS_SLAVE;
+	else if (flags & MS_PRIVATE)
+		attr.propagation = MS_PRIVATE;
+	else if (flags & MS_UNBINDABLE)
+		attr.propagation = MS_UNBINDABLE;
+
+	fd = syscall(__NR_open_tree, AT_FDCWD, src,
+		     OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | rec);
+	if (fd < 0) {
+		if (errno == ENOSYS)
+			unsupported = true;
+		return -1;
+	}
+
+	if (attr.attr_set || attr.attr_clr || attr.propagation) {
+		ret = syscall(__NR_mount_setattr, fd, "", AT_EMPTY_PATH | rec,
+			      &attr, sizeof(attr));
+		if (ret < 0) {
+			/* open_tree() but no mount_setattr(): 5.2 to 5.11 */
+			if (errno == ENOSYS)
+				unsupported = true;
+			close(fd);
+			return -1;
+		}
+	}
+
+	ret = syscall(__NR_move_mount, fd, "", dfd, target,
+		      MOVE_MOUNT_F_EMPTY_PATH);
+	close(fd);
+	return ret < 0 ? -1 : 0;
+#else
+	return -1;
+#endif
+}
+
 /* Define __S_ISTYPE if missing from the C library */
 #ifndef __S_ISTYPE
 #define        __S_ISTYPE(mode, mask)  (((mode) & S_IFMT) == (mask))
@@ -175,6 +305,7 @@ static int in_caplist(int cap, struct lxc_list *caps);
 
 static int instanciate_veth(struct lxc_handler *, struct lxc_netdev *);
 static int instanciate_macvlan(struct lxc_handler *, struct lxc_netdev *);
+static int instanciate_ipvlan(struct lxc_handler *, struct lxc_netdev *);
 static int instanciate_vlan(struct lxc_handler *, struct lxc_netdev *);
 static int instanciate_phys(struct lxc_handler *, struct lxc_netdev *);
 static int instanciate_empty(struct lxc_handler *, struct lxc_netdev *);
@@ -183,6 +314,7 @@ static int instanciate_none(struct lxc_handler *, struct lxc_netdev *);
 static  instanciate_cb netdev_conf[LXC_NET_MAXCONFTYPE + 1] = {
 	[LXC_NET_VETH]    = instanciate_veth,
 	[LXC_NET_MACVLAN] = instanciate_macvlan,
+	[LXC_NET_IPVLAN]  = instanciate_ipvlan,
 	[LXC_NET_VLAN]    = instanciate_vlan,
 	[LXC_NET_PHYS]    = instanciate_phys,
 	[LXC_NET_EMPTY]   = instanciate_empty,
@@ -191,6 +323,7 @@ static  instanciate_cb netdev_conf[LXC_NET_MAXCONFTYPE + 1] = {
 
 static int shutdown_veth(struct lxc_handler *, struct lxc_netdev *);
 static int shutdown_macvlan(struct lxc_handler *, struct lxc_netdev *);
+static int shutdown_ipvlan(struct lxc_handler *, struct lxc_netdev *);
 static int shutdown_vlan(struct lxc_handler *, struct lxc_netdev *);
 static int shutdown_phys(struct lxc_handler *, struct lxc_netdev *);
 static int shutdown_empty(struct lxc_handler *, struct lxc_netdev *);
@@ -199,6 +332,7 @@ static int shutdown_none(struct lxc_handler *, struct lxc_netdev *);
 static  instanciate_cb netdev_deconf[LXC_NET_MAXCONFTYPE + 1] = {
 	[LXC_NET_VETH]    = shutdown_veth,
 	[LXC_NET_MACVLAN] = shutdown_macvlan,
+	[LXC_NET_IPVLAN]  = shutdown_ipvlan,
 	[LXC_NET_VLAN]    = shutdown_vlan,
 	[LXC_NET_PHYS]    = shutdown_phys,
 	[LXC_NET_EMPTY]   = shutdown_empty,
@@ -285,13 +419,51 @@ static struct caps_opt caps_opt[] = {
 static struct caps_opt caps_opt[] = {};
 #endif
 
+/* Characters which need the shell to run a hook or script command */
+#define SHELL_CHARS "|&;<>()$`\\\"'*?[]#~=%{}!\n"
+
+/*
+ * Split a command which is only words separated by blanks into its
+ * arguments, in place.  Returns NULL if the command needs the shell.
+ */
+static char **buffer_to_argv(char *buffer)
+{
+	char **argv, *tok, *saveptr = NULL;
+	size_t n = 0;
+
+	if (strpbrk(buffer, SHELL_CHARS))
+		return NULL;
+
+	argv = malloc((strlen(buffer) / 2 + 2) * sizeof(*argv));
+	if (!argv)
+		return NULL;
+
+	for (tok = strtok_r(buffer, " \t", &saveptr); tok;
+	     tok = strtok_r(NULL, " \t", &saveptr))
+		argv[n++] = tok;
+	argv[n] = NULL;
+
+	if (!n) {
+		free(argv);
+		return NULL;
+	}
+	return argv;
+}
+
 static int run_buffer(char *buffer)
 {
 	struct lxc_popen_FILE *f;
-	char *output;
+	char *output, **argv;
 	int ret;
 
-	f = lxc_popen(buffer);
+	/* Plain commands are executed directly, saving a shell per hook */
+	argv = buffer_to_argv(buffer);
+	if (argv) {
+		f = lxc_popenv(argv);
+		free(argv);
+	} else {
+		f = lxc_popen(buffer);
+	}
 	if (!f) {
 		SYSERROR("popen failed");
 		return -1;
@@ -325,6 +497,118 @@ static int run_buffer(char *buffer)
 	return 0;
 }
 
+static int write_string(int fd, const char *s)
+{
+	size_t len = strlen(s) + 1;
+
+	return lxc_write_nointr(fd, s, len) == len ? 0 : -1;
+}
+
+/*
+ * Hand a hook over to a daemon listening on the unix socket path, or on
+ * the abstract socket name if path is "@name".  The arguments a script
+ * would be given, then the LXC_* environment variables, are sent as two
+ * lists of NUL-terminated strings, each ending with an empty string.  The
+ * daemon answers with the output of the hook, its last line being the
+ * exit status.
+ */
+static int run_socket_hook(const char *path, const char *name,
+			   const char *section, const char *hook,
+			   char **argsin)
+{
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	char *output, *line, *last = NULL, *end, **env;
+	size_t len = strlen(path);
+	int fd, i;
+	long st;
+	FILE *f;
+
+	if (len == 0 || len >= sizeof(addr.sun_path)) {
+		ERROR("Invalid hook socket '%s'", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path, len);
+	addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+	if (path[0] == '@')
+		addr.sun_path[0] = '\0';
+	else
+		addrlen++;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		SYSERROR("failed to create hook socket");
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, addrlen) < 0) {
+		SYSERROR("failed to connect to hook socket '%s'", path);
+		close(fd);
+		return -1;
+	}
+
+	if (write_string(fd, name) || write_string(fd, section) ||
+	    write_string(fd, hook))
+		goto out_write;
+	for (i = 0; argsin && argsin[i]; i++)
+		if (write_string(fd, argsin[i]))
+			goto out_write;
+	if (write_string(fd, ""))
+		goto out_write;
+	for (env = environ; *env; env++)
+		if (strncmp(*env, "LXC_", 4) == 0 && write_string(fd, *env))
+			goto out_write;
+	if (write_string(fd, ""))
+		goto out_write;
+	shutdown(fd, SHUT_WR);
+
+	f = fdopen(fd, "r");
+	if (!f) {
+		SYSERROR("fdopen failure");
+		close(fd);
+		return -1;
+	}
+
+	/* two lines, so that the previous one is logged once we know it is
+	 * not the last one, which is the status */
+	output = malloc(2 * LXC_LOG_BUFFER_SIZE);
+	if (!output) {
+		ERROR("failed to allocate memory for hook output");
+		fclose(f);
+		return -1;
+	}
+
+	line = output;
+	while (fgets(line, LXC_LOG_BUFFER_SIZE, f)) {
+		if (last)
+			DEBUG("script output: %s", last);
+		last = line;
+		line = line == output ? output + LXC_LOG_BUFFER_SIZE : output;
+	}
+	fclose(f);
+
+	errno = 0;
+	st = last ? strtol(last, &end, 10) : 0;
+	if (!last || errno || end == last || (*end && *end != '\n')) {
+		ERROR("Hook socket '%s' did not return a status", path);
+		free(output);
+		return -1;
+	}
+	free(output);
+	if (st != 0) {
+		ERROR("Script exited with status %ld", st);
+		return -1;
+	}
+	return 0;
+
+out_write:
+	SYSERROR("failed to send hook to socket '%s'", path);
+	close(fd);
+	return -1;
+}
+
 static int run_script_argv(const char *name, const char *section,
 		      const char *script, const char *hook, const char *lxcpath,
 		      char **argsin)
@@ -336,6 +620,9 @@ static int run_script_argv(const char *name, const char *section,
 	INFO("Executing script '%s' for container '%s', config section '%s'",
 	     script, name, section);
 
+	if (strncmp(script, "unix:", 5) == 0)
+		return run_socket_hook(script + 5, name, section, hook, argsin);
+
 	for (i=0; argsin && argsin[i]; i++)
 		size += strlen(argsin[i]) + 1;
 
@@ -487,6 +774,17 @@ static int mount_unknown_fs(const char *rootfs, const char *target,
 		.options = options,
 	};
 
+	const char *probed;
+	char fstype[16];
+
+	/* most of the time the superblock tells, and one mount does */
+	probed = lxc_probe_fstype(rootfs);
+	if (probed) {
+		strcpy(fstype, probed);
+		if (find_fstype_cb(fstype, &cbarg) == 1)
+			return 0;
+	}
+
 	/*
 	 * find the filesystem type with brute force:
 	 * first we check with /etc/filesystems, in case the modules
@@ -530,7 +828,12 @@ static int mount_rootfs_dir(const char *rootfs, const char *target,
 		return -1;
 	}
 
-	ret = mount(rootfs, target, "none", MS_BIND | MS_REC | mntflags, mntdata);
+	/* like the flags of a bind mount(), @mntflags are not applied */
+	if (mount_bind_tree(rootfs, AT_FDCWD, target, MS_BIND | MS_REC) == 0)
+		ret = 0;
+	else
+		ret = mount(rootfs, target, "none", MS_BIND | MS_REC | mntflags,
+			    mntdata);
 	free(mntdata);
 
 	return ret;
@@ -896,84 +1199,133 @@ static int setup_dev_symlinks(const struct lxc_rootfs *rootfs)
 	return 0;
 }
 
+/* bind the pty @src on @name in the directory @dir, open as @dfd */
+static int mount_pty(const char *src, int dfd, const char *dir,
+		     const char *name)
+{
+	char path[MAXPATHLEN];
+	int ret;
+
+	if (mount_bind_tree(src, dfd, name, MS_BIND) == 0)
+		return 0;
+
+	ret = snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (ret < 0 || ret >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return mount(src, path, "none", MS_BIND, 0);
+}
+
+/*
+ * The ttys are created and mounted relative to the container's /dev (and
+ * ttydir) opened once, rather than through a full path each.
+ */
 static int setup_tty(const struct lxc_rootfs *rootfs,
 		     const struct lxc_tty_info *tty_info, char *ttydir)
 {
-	char path[MAXPATHLEN], lxcpath[MAXPATHLEN];
-	int i, ret;
+	char devpath[MAXPATHLEN], dirpath[MAXPATHLEN], name[32];
+	char lxcpath[MAXPATHLEN];
+	int i, ret, fd, devfd, dirfd = -1;
 
 	if (!rootfs->path)
 		return 0;
 
+	ret = snprintf(devpath, sizeof(devpath), "%s/dev", rootfs->mount);
+	if (ret >= sizeof(devpath)) {
+		ERROR("pathname too long for ttys");
+		return -1;
+	}
+	devfd = open(devpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (devfd < 0) {
+		SYSERROR("failed to open %s", devpath);
+		return -1;
+	}
+
+	if (ttydir) {
+		ret = snprintf(dirpath, sizeof(dirpath), "%s/%s", devpath,
+			       ttydir);
+		if (ret >= sizeof(dirpath)) {
+			ERROR("pathname too long for ttys");
+			goto err;
+		}
+		dirfd = openat(devfd, ttydir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dirfd < 0) {
+			SYSERROR("failed to open %s", dirpath);
+			goto err;
+		}
+	}
+
 	for (i = 0; i < tty_info->nbtty; i++) {
 
 		struct lxc_pty_info *pty_info = &tty_info->pty_info[i];
 
-		ret = snprintf(path, sizeof(path), "%s/dev/tty%d",
-			 rootfs->mount, i + 1);
-		if (ret >= sizeof(path)) {
-			ERROR("pathname too long for ttys");
-			return -1;
-		}
+		sprintf(name, "tty%d", i + 1);
 		if (ttydir) {
 			/* create dev/lxc/tty%d" */
-			ret = snprintf(lxcpath, sizeof(lxcpath), "%s/dev/%s/tty%d",
-				 rootfs->mount, ttydir, i + 1);
-			if (ret >= sizeof(lxcpath)) {
-				ERROR("pathname too long for ttys");
-				return -1;
-			}
-			ret = creat(lxcpath, 0660);
-			if (ret==-1 && errno != EEXIST) {
-				SYSERROR("error creating %s", lxcpath);
-				return -1;
+			fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_CLOEXEC,
+				    0660);
+			if (fd < 0) {
+				SYSERROR("error creating %s/%s", dirpath, name);
+				goto err;
 			}
-			if (ret >= 0)
-				close(ret);
-			ret = unlink(path);
+			close(fd);
+			ret = unlinkat(devfd, name, 0);
 			if (ret && errno != ENOENT) {
-				SYSERROR("error unlinking %s", path);
-				return -1;
+				SYSERROR("error unlinking %s/%s", devpath, name);
+				goto err;
 			}
 
-			if (mount(pty_info->name, lxcpath, "none", MS_BIND, 0)) {
-				WARN("failed to mount '%s'->'%s'",
-				     pty_info->name, path);
+			if (mount_pty(pty_info->name, dirfd, dirpath, name)) {
+				WARN("failed to mount '%s'->'%s/%s'",
+				     pty_info->name, devpath, name);
 				continue;
 			}
 
-			ret = snprintf(lxcpath, sizeof(lxcpath), "%s/tty%d", ttydir, i+1);
+			ret = snprintf(lxcpath, sizeof(lxcpath), "%s/%s", ttydir, name);
 			if (ret >= sizeof(lxcpath)) {
 				ERROR("tty pathname too long");
-				return -1;
+				goto err;
 			}
-			ret = symlink(lxcpath, path);
+			ret = symlinkat(lxcpath, devfd, name);
 			if (ret) {
 				SYSERROR("failed to create symlink for tty %d", i+1);
-				return -1;
+				goto err;
 			}
 		} else {
 			/* If we populated /dev, then we need to create /dev/ttyN */
-			if (access(path, F_OK)) {
-				ret = creat(path, 0660);
-				if (ret==-1) {
-					SYSERROR("error creating %s", path);
+			if (faccessat(devfd, name, F_OK, 0)) {
+				fd = openat(devfd, name,
+					    O_WRONLY | O_CREAT | O_CLOEXEC, 0660);
+				if (fd < 0) {
+					SYSERROR("error creating %s/%s",
+						 devpath, name);
 					/* this isn't fatal, continue */
 				} else {
-					close(ret);
+					close(fd);
 				}
 			}
-			if (mount(pty_info->name, path, "none", MS_BIND, 0)) {
-				WARN("failed to mount '%s'->'%s'",
-						pty_info->name, path);
+			if (mount_pty(pty_info->name, devfd, devpath, name)) {
+				WARN("failed to mount '%s'->'%s/%s'",
+				     pty_info->name, devpath, name);
 				continue;
 			}
 		}
 	}
 
+	if (dirfd >= 0)
+		close(dirfd);
+	close(devfd);
+
 	INFO("%d tty(s) has been setup", tty_info->nbtty);
 
 	return 0;
+
+err:
+	if (dirfd >= 0)
+		close(dirfd);
+	close(devfd);
+	return -1;
 }
 
 static int setup_rootfs_pivot_root_cb(char *buffer, void *data)
@@ -1448,7 +1800,7 @@ static int setup_autodev(const char *root)
 {
 	int ret;
 	char path[MAXPATHLEN];
-	int i;
+	int i, devfd;
 	mode_t cmask;
 
 	INFO("Creating initial consoles under %s/dev", root);
@@ -1458,21 +1810,26 @@ static int setup_autodev(const char *root)
 		ERROR("Error calculating container /dev location");
 		return -1;
 	}
+	devfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (devfd < 0) {
+		SYSERROR("Error opening %s", path);
+		return -1;
+	}
 
 	INFO("Populating /dev under %s", root);
 	cmask = umask(S_IXUSR | S_IXGRP | S_IXOTH);
 	for (i = 0; i < sizeof(lxc_devs) / sizeof(lxc_devs[0]); i++) {
 		const struct lxc_devs *d = &lxc_devs[i];
-		ret = snprintf(path, MAXPATHLEN, "%s/dev/%s", root, d->name);
-		if (ret < 0 || ret >= MAXPATHLEN)
-			return -1;
-		ret = mknod(path, d->mode, makedev(d->maj, d->min));
+		ret = mknodat(devfd, d->name, d->mode, makedev(d->maj, d->min));
 		if (ret && errno != EEXIST) {
 			SYSERROR("Error creating %s", d->name);
+			umask(cmask);
+			close(devfd);
 			return -1;
 		}
 	}
 	umask(cmask);
+	close(devfd);
 
 	INFO("Populated /dev under %s", root);
 	return 0;
@@ -1798,6 +2155,132 @@ static int setup_kmsg(const struct lxc_rootfs *rootfs,
 	return 0;
 }
 
+/* the default huge page size, in kB */
+static unsigned long default_hugepage_size(void)
+{
+	char line[256];
+	unsigned long size = 0;
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "Hugepagesize: %lu kB", &size) == 1)
+			break;
+	fclose(f);
+	return size;
+}
+
+static long read_hugepages(unsigned long size, const char *what)
+{
+	char path[MAXPATHLEN], buf[32];
+	int ret;
+
+	ret = snprintf(path, sizeof(path),
+		       "/sys/kernel/mm/hugepages/hugepages-%lukB/%s", size, what);
+	if (ret < 0 || ret >= sizeof(path))
+		return -1;
+	ret = lxc_read_from_file(path, buf, sizeof(buf) - 1);
+	if (ret <= 0)
+		return -1;
+	buf[ret] = '\0';
+	return atol(buf);
+}
+
+/*
+ * Make sure the host's pool of @size pages has @reserve of them which
+ * are not used nor reserved yet, growing it if need be.  The kernel
+ * allocates the pages of the pool up front, whatever it takes to find
+ * them, which is what a container which wants them at once would rather
+ * not wait for.
+ */
+static void grow_hugepages_pool(unsigned long size, unsigned long reserve)
+{
+	char path[MAXPATHLEN], buf[32];
+	long nr, free, resv, avail;
+	int ret;
+
+	nr = read_hugepages(size, "nr_hugepages");
+	free = read_hugepages(size, "free_hugepages");
+	resv = read_hugepages(size, "resv_hugepages");
+	if (nr < 0 || free < 0 || resv < 0) {
+		WARN("no pool of %lukB huge pages", size);
+		return;
+	}
+	avail = free - resv;
+	if (avail >= (long)reserve)
+		return;
+
+	ret = snprintf(path, sizeof(path),
+		       "/sys/kernel/mm/hugepages/hugepages-%lukB/nr_hugepages", size);
+	if (ret < 0 || ret >= sizeof(path))
+		return;
+	ret = snprintf(buf, sizeof(buf), "%ld", nr + (long)reserve - avail);
+	if (ret < 0 || ret >= sizeof(buf))
+		return;
+	if (lxc_write_to_file(path, buf, ret, false) < 0)
+		WARN("failed to grow the pool of %lukB huge pages to %s: %s",
+		     size, buf, strerror(errno));
+	else
+		INFO("grew the pool of %lukB huge pages to %ld", size,
+		     read_hugepages(size, "nr_hugepages"));
+}
+
+/*
+ * Mount a hugetlbfs at lxc.hugepages.mount, whose min_size sets aside
+ * lxc.hugepages.reserve pages for it: the mount fails if they can't be
+ * had, and the container then never waits for the kernel to find them.
+ */
+static int setup_hugepages(const struct lxc_conf *conf)
+{
+	char path[MAXPATHLEN], opts[MAXPATHLEN], *dup, *target, *extra;
+	unsigned long size = conf->hugepages_size;
+	int ret;
+
+	if (!conf->hugepages_mount)
+		return 0;
+
+	if (!size)
+		size = default_hugepage_size();
+	if (!size) {
+		ERROR("no huge pages on this system");
+		return -1;
+	}
+	if (conf->hugepages_reserve)
+		grow_hugepages_pool(size, conf->hugepages_reserve);
+
+	dup = alloca(strlen(conf->hugepages_mount) + 1);
+	strcpy(dup, conf->hugepages_mount);
+	target = dup;
+	extra = strpbrk(dup, " \t");
+	if (extra) {
+		*extra++ = '\0';
+		extra += lxc_char_left_gc(extra, strlen(extra));
+	}
+
+	ret = snprintf(path, sizeof(path), "%s%s",
+		       conf->rootfs.path ? conf->rootfs.mount : "", target);
+	if (ret < 0 || ret >= sizeof(path))
+		return -1;
+	if (mkdir_p(path, 0755) < 0) {
+		SYSERROR("failed to create %s", path);
+		return -1;
+	}
+
+	ret = snprintf(opts, sizeof(opts), "pagesize=%luK,min_size=%lu%s%s",
+		       size, conf->hugepages_reserve * size * 1024,
+		       extra && *extra ? "," : "", extra ? extra : "");
+	if (ret < 0 || ret >= sizeof(opts))
+		return -1;
+	if (mount("hugetlbfs", path, "hugetlbfs", MS_NOSUID | MS_NODEV, opts)) {
+		SYSERROR("failed to mount hugetlbfs on %s with %s", path, opts);
+		return -1;
+	}
+	INFO("mounted hugetlbfs on %s with %s", target, opts);
+	return 0;
+}
+
 static void parse_mntopt(char *opt, unsigned long *flags, char **data)
 {
 	struct mount_opt *mo;
@@ -1863,6 +2346,13 @@ static int mount_entry(const char *fsname, const char *target,
 		       const char *fstype, unsigned long mountflags,
 		       const char *data, int optional)
 {
+	/* a bind with its flags in one go, when the kernel can */
+	if ((mountflags & MS_BIND) && !(mountflags & MS_REMOUNT) &&
+	    mount_bind_tree(fsname, AT_FDCWD, target, mountflags) == 0) {
+		DEBUG("mounted '%s' on '%s', type '%s'", fsname, target, fstype);
+		return 0;
+	}
+
 	if (mount(fsname, target, fstype, mountflags & ~MS_REMOUNT, data)) {
 		if (optional) {
 			INFO("failed to mount '%s' on '%s' (optional): %s", fsname,
@@ -2115,6 +2605,20 @@ static int mount_entry_on_relative_rootfs(struct mntent *mntent,
 	return ret;
 }
 
+static int mount_entry_on_rootfs(struct mntent *mntent,
+				 const struct lxc_rootfs *rootfs,
+				 const char *lxc_name)
+{
+	if (!rootfs->path)
+		return mount_entry_on_systemfs(mntent);
+
+	/* We have a separate root, mounts are relative to it */
+	if (mntent->mnt_dir[0] != '/')
+		return mount_entry_on_relative_rootfs(mntent, rootfs->mount);
+
+	return mount_entry_on_absolute_rootfs(mntent, rootfs, lxc_name);
+}
+
 static int mount_file_entries(const struct lxc_rootfs *rootfs, FILE *file,
 	const char *lxc_name)
 {
@@ -2123,22 +2627,7 @@ static int mount_file_entries(const struct lxc_rootfs *rootfs, FILE *file,
 	int ret = -1;
 
 	while (getmntent_r(file, &mntent, buf, sizeof(buf))) {
-
-		if (!rootfs->path) {
-			if (mount_entry_on_systemfs(&mntent))
-				goto out;
-			continue;
-		}
-
-		/* We have a separate root, mounts are relative to it */
-		if (mntent.mnt_dir[0] != '/') {
-			if (mount_entry_on_relative_rootfs(&mntent,
-							   rootfs->mount))
-				goto out;
-			continue;
-		}
-
-		if (mount_entry_on_absolute_rootfs(&mntent, rootfs, lxc_name))
+		if (mount_entry_on_rootfs(&mntent, rootfs, lxc_name))
 			goto out;
 	}
 
@@ -2170,37 +2659,99 @@ static int setup_mount(const struct lxc_rootfs *rootfs, const char *fstab,
 	return ret;
 }
 
-static int setup_mount_entries(const struct lxc_rootfs *rootfs, struct lxc_list *mount,
-	const char *lxc_name)
+/* undo the octal escapes of fstab fields, as getmntent() does */
+static char *decode_mntent_field(char *s)
 {
-	FILE *file;
-	struct lxc_list *iterator;
-	char *mount_entry;
-	int ret;
+	static const struct {
+		const char *esc;
+		char c;
+	} escapes[] = {
+		{ "\\040", ' ' }, { "\\011", '\t' }, { "\\012", '\n' },
+		{ "\\134", '\\' }, { "\\\\", '\\' },
+	};
+	char *r, *w;
+	int i;
 
-	file = tmpfile();
-	if (!file) {
-		ERROR("tmpfile error: %m");
-		return -1;
+	for (r = w = s; *r; w++) {
+		for (i = 0; i < sizeof(escapes) / sizeof(escapes[0]); i++)
+			if (strncmp(r, escapes[i].esc, strlen(escapes[i].esc)) == 0)
+				break;
+		if (i < sizeof(escapes) / sizeof(escapes[0])) {
+			*w = escapes[i].c;
+			r += strlen(escapes[i].esc);
+		} else
+			*w = *r++;
 	}
+	*w = '\0';
+	return s;
+}
 
-	lxc_list_for_each(iterator, mount) {
-		mount_entry = iterator->elem;
-		fprintf(file, "%s\n", mount_entry);
-	}
+static char *next_mntent_field(char **line)
+{
+	char *field;
 
-	rewind(file);
+	if (!*line)
+		return "";
+	*line += strspn(*line, " \t");
+	field = strsep(line, " \t");
+	return decode_mntent_field(field);
+}
 
-	ret = mount_file_entries(rootfs, file, lxc_name);
+/*
+ * Split an lxc.mount.entry @line, in place, the way getmntent() reads a
+ * line of fstab.  Returns 0, or 1 if it is blank or a comment.
+ */
+int lxc_parse_mntent(char *line, struct mntent *mntent)
+{
+	line += strspn(line, " \t");
+	if (*line == '\0' || *line == '#')
+		return 1;
 
-	fclose(file);
-	return ret;
+	mntent->mnt_fsname = next_mntent_field(&line);
+	mntent->mnt_dir = next_mntent_field(&line);
+	mntent->mnt_type = next_mntent_field(&line);
+	mntent->mnt_opts = next_mntent_field(&line);
+	mntent->mnt_freq = 0;
+	mntent->mnt_passno = 0;
+	if (line)
+		sscanf(line, " %d %d", &mntent->mnt_freq, &mntent->mnt_passno);
+	return 0;
 }
 
-static int parse_cap(const char *cap)
+/*
+ * The lxc.mount.entry lines are split in memory, in the order of the
+ * configuration, which later entries may depend on.
+ */
+static int setup_mount_entries(const struct lxc_rootfs *rootfs, struct lxc_list *mount,
+	const char *lxc_name)
 {
-	char *ptr = NULL;
-	int i, capid = -1;
+	struct lxc_list *iterator;
+	struct mntent mntent;
+	char *line;
+	int ret = 0;
+
+	lxc_list_for_each(iterator, mount) {
+		line = strdup(iterator->elem);
+		if (!line) {
+			SYSERROR("failed to allocate memory");
+			return -1;
+		}
+
+		if (lxc_parse_mntent(line, &mntent) == 0)
+			ret = mount_entry_on_rootfs(&mntent, rootfs, lxc_name);
+		free(line);
+		if (ret)
+			return -1;
+	}
+
+	INFO("mount points have been setup");
+	return 0;
+}
+
+static int parse_cap(const char *cap)
+{
+	char *ptr = NULL;
+	int i, capid = -1;
 
 	if (!strcmp(cap, "none"))
 		return -2;
@@ -2379,11 +2930,16 @@ static int setup_ipv4_addr(struct lxc_list *ip, int ifindex)
 	return 0;
 }
 
-static int setup_ipv6_addr(struct lxc_list *ip, int ifindex)
+static int setup_ipv6_addr(struct lxc_list *ip, int ifindex, int dad)
 {
 	struct lxc_list *iterator;
 	struct lxc_inet6dev *inet6dev;
-	int err;
+	int err, flags = 0;
+
+	if (dad == LXC_NET_DAD_OFF)
+		flags = IFA_F_NODAD;
+	else if (dad == LXC_NET_DAD_OPTIMISTIC)
+		flags = IFA_F_OPTIMISTIC;
 
 	lxc_list_for_each(iterator, ip) {
 
@@ -2391,7 +2947,7 @@ static int setup_ipv6_addr(struct lxc_list *ip, int ifindex)
 
 		err = lxc_ipv6_addr_add(ifindex, &inet6dev->addr,
 					&inet6dev->mcast, &inet6dev->acast,
-					inet6dev->prefix);
+					inet6dev->prefix, flags);
 		if (err) {
 			ERROR("failed to setup_ipv6_addr ifindex %d : %s",
 			      ifindex, strerror(-err));
@@ -2402,6 +2958,47 @@ static int setup_ipv6_addr(struct lxc_list *ip, int ifindex)
 	return 0;
 }
 
+/*
+ * Send the addresses and link changes setup_netdev() queued, and report
+ * the ones which failed
+ */
+static int setup_netdev_batch_end(struct lxc_netdev *netdev,
+				  const char *ifname)
+{
+	size_t n4 = lxc_list_len(&netdev->ipv4);
+	size_t n6 = lxc_list_len(&netdev->ipv6);
+	size_t i, n = n4 + n6 + (netdev->flags & IFF_UP ? 2 : 0);
+	int *errs, err, reported = 0;
+
+	errs = alloca(n * sizeof(int) + 1);
+	err = lxc_rtnl_batch_end(errs, n);
+	if (!err)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		if (!errs[i])
+			continue;
+		reported++;
+		if (i < n4)
+			ERROR("failed to setup_ipv4_addr ifindex %d : %s",
+			      netdev->ifindex, strerror(-errs[i]));
+		else if (i < n4 + n6)
+			ERROR("failed to setup_ipv6_addr ifindex %d : %s",
+			      netdev->ifindex, strerror(-errs[i]));
+		else if (i == n4 + n6)
+			ERROR("failed to set '%s' up : %s", ifname,
+			      strerror(-errs[i]));
+		else
+			ERROR("failed to set the loopback up : %s",
+			      strerror(-errs[i]));
+	}
+
+	/* the batch itself went wrong */
+	if (!reported)
+		ERROR("failed to setup '%s' : %s", ifname, strerror(-err));
+	return -1;
+}
+
 static int setup_netdev(struct lxc_netdev *netdev)
 {
 	char ifname[IFNAMSIZ];
@@ -2472,17 +3069,28 @@ static int setup_netdev(struct lxc_netdev *netdev)
 		}
 	}
 
+	/* the addresses and the links going up are sent to the kernel
+	 * together, setup_netdev_batch_end() tells which failed */
+	err = lxc_rtnl_batch_begin();
+	if (err) {
+		ERROR("failed to start the setup of '%s' : %s", ifname,
+		      strerror(-err));
+		return -1;
+	}
+
 	/* setup ipv4 addresses on the interface */
 	if (setup_ipv4_addr(&netdev->ipv4, netdev->ifindex)) {
 		ERROR("failed to setup ip addresses for '%s'",
 			      ifname);
+		lxc_rtnl_batch_end(NULL, 0);
 		return -1;
 	}
 
 	/* setup ipv6 addresses on the interface */
-	if (setup_ipv6_addr(&netdev->ipv6, netdev->ifindex)) {
+	if (setup_ipv6_addr(&netdev->ipv6, netdev->ifindex, netdev->ipv6_dad)) {
 		ERROR("failed to setup ipv6 addresses for '%s'",
 			      ifname);
+		lxc_rtnl_batch_end(NULL, 0);
 		return -1;
 	}
 
@@ -2494,6 +3102,7 @@ static int setup_netdev(struct lxc_netdev *netdev)
 		if (err) {
 			ERROR("failed to set '%s' up : %s", current_ifname,
 			      strerror(-err));
+			lxc_rtnl_batch_end(NULL, 0);
 			return -1;
 		}
 
@@ -2502,10 +3111,14 @@ static int setup_netdev(struct lxc_netdev *netdev)
 		if (err) {
 			ERROR("failed to set the loopback up : %s",
 			      strerror(-err));
+			lxc_rtnl_batch_end(NULL, 0);
 			return -1;
 		}
 	}
 
+	if (setup_netdev_batch_end(netdev, current_ifname))
+		return -1;
+
 	/* We can only set up the default routes after bringing
 	 * up the interface, sine bringing up the interface adds
 	 * the link-local routes and we can't add a default
@@ -2588,6 +3201,14 @@ static int setup_network(struct lxc_list *network)
 {
 	struct lxc_list *iterator;
 	struct lxc_netdev *netdev;
+	int err;
+
+	/* in the container's network namespace by now */
+	err = lxc_rtnl_hold();
+	if (err) {
+		ERROR("failed to open the netlink socket : %s", strerror(-err));
+		return -1;
+	}
 
 	lxc_list_for_each(iterator, network) {
 
@@ -2595,10 +3216,13 @@ static int setup_network(struct lxc_list *network)
 
 		if (setup_netdev(netdev)) {
 			ERROR("failed to setup netdev");
+			lxc_rtnl_release();
 			return -1;
 		}
 	}
 
+	lxc_rtnl_release();
+
 	if (!lxc_list_empty(network))
 		INFO("network has been setup");
 
@@ -2608,7 +3232,7 @@ static int setup_network(struct lxc_list *network)
 /* try to move physical nics to the init netns */
 void restore_phys_nics_to_netns(int netnsfd, struct lxc_conf *conf)
 {
-	int i, ret, oldfd;
+	int i, ret, oldfd, batched, *errs, *queued, n = 0;
 	char path[MAXPATHLEN];
 
 	if (netnsfd < 0)
@@ -2628,11 +3252,24 @@ void restore_phys_nics_to_netns(int netnsfd, struct lxc_conf *conf)
 		close(oldfd);
 		return;
 	}
+	/* nothing holds the netlink socket here, so it's opened in this netns */
+	batched = !lxc_rtnl_batch_begin();
+	queued = alloca(conf->num_savednics * sizeof(int));
 	for (i=0; i<conf->num_savednics; i++) {
 		struct saved_nic *s = &conf->saved_nics[i];
 		if (lxc_netdev_move_by_index(s->ifindex, 1))
 			WARN("Error moving nic index:%d back to host netns",
 					s->ifindex);
+		else if (batched)
+			queued[n++] = i;
+	}
+	if (batched) {
+		errs = alloca(n * sizeof(int) + 1);
+		lxc_rtnl_batch_end(errs, n);
+		for (i=0; i<n; i++)
+			if (errs[i])
+				WARN("Error moving nic index:%d back to host netns",
+						conf->saved_nics[queued[i]].ifindex);
 	}
 	if (setns(oldfd, 0) != 0)
 		SYSERROR("Failed to re-enter monitor's netns");
@@ -2641,19 +3278,22 @@ void restore_phys_nics_to_netns(int netnsfd, struct lxc_conf *conf)
 
 void lxc_rename_phys_nics_on_shutdown(int netnsfd, struct lxc_conf *conf)
 {
-	int i;
+	int i, batched;
 
 	if (conf->num_savednics == 0)
 		return;
 
 	INFO("running to reset %d nic names", conf->num_savednics);
 	restore_phys_nics_to_netns(netnsfd, conf);
+	batched = !lxc_rtnl_batch_begin();
 	for (i=0; i<conf->num_savednics; i++) {
 		struct saved_nic *s = &conf->saved_nics[i];
 		INFO("resetting nic %d to %s", s->ifindex, s->orig_name);
 		lxc_netdev_rename_by_index(s->ifindex, s->orig_name);
 		free(s->orig_name);
 	}
+	if (batched)
+		lxc_rtnl_batch_end(NULL, 0);
 	conf->num_savednics = 0;
 }
 
@@ -2676,6 +3316,8 @@ struct lxc_conf *lxc_conf_init(void)
 	new->autodev = -1;
 	new->console.log_path = NULL;
 	new->console.log_fd = -1;
+	new->console.buffer_path = NULL;
+	new->console.ringbuf = NULL;
 	new->console.path = NULL;
 	new->console.peer = -1;
 	new->console.peerpty.busy = -1;
@@ -2686,6 +3328,7 @@ struct lxc_conf *lxc_conf_init(void)
 	new->console.name[0] = '\0';
 	new->maincmd_fd = -1;
 	new->nbd_idx = -1;
+	new->userns_fd = -1;
 	new->rootfs.mount = strdup(default_rootfs_mount);
 	if (!new->rootfs.mount) {
 		ERROR("lxc_conf_init : %m");
@@ -2701,6 +3344,7 @@ struct lxc_conf *lxc_conf_init(void)
 	lxc_list_init(&new->id_map);
 	lxc_list_init(&new->includes);
 	lxc_list_init(&new->aliens);
+	lxc_list_init(&new->loglevels);
 	for (i=0; i<NUM_LXC_HOOKS; i++)
 		lxc_list_init(&new->hooks[i]);
 	lxc_list_init(&new->groups);
@@ -2714,11 +3358,71 @@ struct lxc_conf *lxc_conf_init(void)
 	return new;
 }
 
+/* lxc.veth.pool, the number of spare veth pairs kept per bridge */
+static int veth_pool_size(void)
+{
+	const char *v = lxc_global_config_value("lxc.veth.pool");
+
+	return v ? atoi(v) : 0;
+}
+
+/*
+ * Take a pair from the pool of the bridge of @netdev and finish its setup,
+ * returning 1 and the name of its peer in @veth2 if there was one to take
+ */
+static int claim_pooled_veth(struct lxc_netdev *netdev, const char *veth1,
+			     char **veth2)
+{
+	char peer[IFNAMSIZ];
+	int err, ret;
+
+	if (!netdev->link || veth_pool_size() <= 0)
+		return 0;
+
+	err = lxc_veth_pool_claim(netdev->link, veth1, peer);
+	if (err) {
+		if (err != -ENOENT)
+			WARN("failed to take a veth from the pool of '%s' : %s",
+			     netdev->link, strerror(-err));
+		return 0;
+	}
+
+	*veth2 = strdup(peer);
+	if (!*veth2) {
+		ERROR("failed to allocate the peer name");
+		return -1;
+	}
+
+	err = lxc_rtnl_batch_begin();
+	if (err) {
+		ERROR("failed to open the netlink socket : %s", strerror(-err));
+		return -1;
+	}
+
+	ret = 0;
+	if (netdev->mtu) {
+		ret = lxc_netdev_set_mtu(veth1, atoi(netdev->mtu));
+		if (!ret)
+			ret = lxc_netdev_set_mtu(peer, atoi(netdev->mtu));
+	}
+	if (!ret)
+		ret = lxc_netdev_up(veth1);
+
+	err = lxc_rtnl_batch_end(NULL, 0);
+	if (ret || err) {
+		ERROR("failed to setup the pooled veth %s-%s : %s", veth1, peer,
+		      strerror(ret ? -ret : -err));
+		return -1;
+	}
+
+	return 1;
+}
+
 static int instanciate_veth(struct lxc_handler *handler, struct lxc_netdev *netdev)
 {
 	char veth1buf[IFNAMSIZ], *veth1;
 	char veth2buf[IFNAMSIZ], *veth2;
-	int err;
+	int err, master = 0;
 
 	if (netdev->priv.veth_attr.pair)
 		veth1 = netdev->priv.veth_attr.pair;
@@ -2737,6 +3441,13 @@ static int instanciate_veth(struct lxc_handler *handler, struct lxc_netdev *netd
 		memcpy(netdev->priv.veth_attr.veth1, veth1, IFNAMSIZ);
 	}
 
+	veth2 = NULL;
+	err = claim_pooled_veth(netdev, veth1, &veth2);
+	if (err < 0)
+		goto out_delete;
+	if (err > 0)
+		goto out_pooled;
+
 	snprintf(veth2buf, sizeof(veth2buf), "vethXXXXXX");
 	veth2 = lxc_mkifname(veth2buf);
 	if (!veth2) {
@@ -2744,55 +3455,31 @@ static int instanciate_veth(struct lxc_handler *handler, struct lxc_netdev *netd
 		goto out_delete;
 	}
 
-	err = lxc_veth_create(veth1, veth2);
-	if (err) {
-		ERROR("failed to create %s-%s : %s", veth1, veth2,
-		      strerror(-err));
-		goto out_delete;
-	}
-
-	/* changing the high byte of the mac address to 0xfe, the bridge interface
-	 * will always keep the host's mac address and not take the mac address
-	 * of a container */
-	err = setup_private_host_hw_addr(veth1);
-	if (err) {
-		ERROR("failed to change mac address of host interface '%s' : %s",
-			veth1, strerror(-err));
-		goto out_delete;
-	}
-
-	if (netdev->mtu) {
-		err = lxc_netdev_set_mtu(veth1, atoi(netdev->mtu));
-		if (!err)
-			err = lxc_netdev_set_mtu(veth2, atoi(netdev->mtu));
-		if (err) {
-			ERROR("failed to set mtu '%s' for %s-%s : %s",
-			      netdev->mtu, veth1, veth2, strerror(-err));
+	if (netdev->link) {
+		master = if_nametoindex(netdev->link);
+		if (!master) {
+			ERROR("failed to retrieve the index for the bridge '%s'",
+			      netdev->link);
 			goto out_delete;
 		}
 	}
 
-	if (netdev->link) {
-		err = lxc_bridge_attach(netdev->link, veth1);
-		if (err) {
-			ERROR("failed to attach '%s' to the bridge '%s' : %s",
-				      veth1, netdev->link, strerror(-err));
-			goto out_delete;
-		}
+	/* creating, configuring, attaching and setting up veth1 at once */
+	err = lxc_veth_create_bridged(veth1, veth2, master,
+				      netdev->mtu ? atoi(netdev->mtu) : 0, 1);
+	if (err) {
+		ERROR("failed to create %s-%s : %s", veth1, veth2,
+		      strerror(-err));
+		goto out_delete;
 	}
 
+out_pooled:
 	netdev->ifindex = if_nametoindex(veth2);
 	if (!netdev->ifindex) {
 		ERROR("failed to retrieve the index for %s", veth2);
 		goto out_delete;
 	}
 
-	err = lxc_netdev_up(veth1);
-	if (err) {
-		ERROR("failed to set %s up : %s", veth1, strerror(-err));
-		goto out_delete;
-	}
-
 	if (netdev->upscript) {
 		err = run_script(handler->name, "net", netdev->upscript, "up",
 				 "veth", veth1, (char*) NULL);
@@ -2830,6 +3517,14 @@ static int shutdown_veth(struct lxc_handler *handler, struct lxc_netdev *netdev)
 		if (err)
 			return -1;
 	}
+
+	/* off the start path, make up for the pair a start may have taken */
+	if (netdev->link && veth_pool_size() > 0) {
+		err = lxc_veth_pool_fill(netdev->link, veth_pool_size());
+		if (err)
+			WARN("failed to fill the veth pool of '%s' : %s",
+			     netdev->link, strerror(-err));
+	}
 	return 0;
 }
 
@@ -2898,6 +3593,71 @@ static int shutdown_macvlan(struct lxc_handler *handler, struct lxc_netdev *netd
 	return 0;
 }
 
+static int instanciate_ipvlan(struct lxc_handler *handler, struct lxc_netdev *netdev)
+{
+	char peerbuf[IFNAMSIZ], *peer;
+	int err;
+
+	if (!netdev->link) {
+		ERROR("no link specified for ipvlan netdev");
+		return -1;
+	}
+
+	err = snprintf(peerbuf, sizeof(peerbuf), "ipXXXXXX");
+	if (err >= sizeof(peerbuf))
+		return -1;
+
+	peer = lxc_mkifname(peerbuf);
+	if (!peer) {
+		ERROR("failed to make a temporary name");
+		return -1;
+	}
+
+	err = lxc_ipvlan_create(netdev->link, peer,
+				netdev->priv.ipvlan_attr.mode);
+	if (err) {
+		ERROR("failed to create ipvlan interface '%s' on '%s' : %s",
+		      peer, netdev->link, strerror(-err));
+		goto out;
+	}
+
+	netdev->ifindex = if_nametoindex(peer);
+	if (!netdev->ifindex) {
+		ERROR("failed to retrieve the index for %s", peer);
+		goto out;
+	}
+
+	if (netdev->upscript) {
+		err = run_script(handler->name, "net", netdev->upscript, "up",
+				 "ipvlan", netdev->link, (char*) NULL);
+		if (err)
+			goto out;
+	}
+
+	DEBUG("instanciated ipvlan '%s', index is '%d' and mode '%d'",
+	      peer, netdev->ifindex, netdev->priv.ipvlan_attr.mode);
+
+	return 0;
+out:
+	lxc_netdev_delete_by_name(peer);
+	free(peer);
+	return -1;
+}
+
+static int shutdown_ipvlan(struct lxc_handler *handler, struct lxc_netdev *netdev)
+{
+	int err;
+
+	if (netdev->downscript) {
+		err = run_script(handler->name, "net", netdev->downscript,
+				 "down", "ipvlan", netdev->link,
+				 (char*) NULL);
+		if (err)
+			return -1;
+	}
+	return 0;
+}
+
 /* XXX: merge with instanciate_macvlan */
 static int instanciate_vlan(struct lxc_handler *handler, struct lxc_netdev *netdev)
 {
@@ -3044,10 +3804,17 @@ int lxc_create_network(struct lxc_handler *handler)
 	struct lxc_list *iterator;
 	struct lxc_netdev *netdev;
 	int am_root = (getuid() == 0);
+	int err;
 
 	if (!am_root)
 		return 0;
 
+	err = lxc_rtnl_hold();
+	if (err) {
+		ERROR("failed to open the netlink socket : %s", strerror(-err));
+		return -1;
+	}
+
 	lxc_list_for_each(iterator, network) {
 
 		netdev = iterator->elem;
@@ -3055,47 +3822,90 @@ int lxc_create_network(struct lxc_handler *handler)
 		if (netdev->type < 0 || netdev->type > LXC_NET_MAXCONFTYPE) {
 			ERROR("invalid network configuration type '%d'",
 			      netdev->type);
+			lxc_rtnl_release();
 			return -1;
 		}
 
 		if (netdev_conf[netdev->type](handler, netdev)) {
 			ERROR("failed to create netdev");
+			lxc_rtnl_release();
 			return -1;
 		}
 
 	}
 
+	lxc_rtnl_release();
 	return 0;
 }
 
+static void warn_delete_netdev(struct lxc_netdev *netdev)
+{
+	if (netdev->type == LXC_NET_PHYS)
+		WARN("failed to rename to the initial name the " \
+		     "netdev '%s'", netdev->link);
+	else
+		WARN("failed to remove interface '%s'", netdev->name);
+}
+
 void lxc_delete_network(struct lxc_handler *handler)
 {
 	struct lxc_list *network = &handler->conf->network;
 	struct lxc_list *iterator;
-	struct lxc_netdev *netdev;
+	struct lxc_netdev *netdev, **queued;
+	int *errs, batched, err, i, n = 0;
 
 	lxc_list_for_each(iterator, network) {
 		netdev = iterator->elem;
 
-		if (netdev->ifindex != 0 && netdev->type == LXC_NET_PHYS) {
-			if (lxc_netdev_rename_by_index(netdev->ifindex, netdev->link))
-				WARN("failed to rename to the initial name the " \
-				     "netdev '%s'", netdev->link);
+		if (netdev->ifindex != 0)
+			n++;
+		if (netdev->ifindex != 0 && netdev->type == LXC_NET_PHYS)
 			continue;
-		}
 
 		if (netdev_deconf[netdev->type](handler, netdev)) {
 			WARN("failed to destroy netdev");
 		}
+	}
+
+	if (!n)
+		return;
+
+	/* the renames and deletes don't depend on each other, send them
+	 * together, @queued says which device each request is for */
+	queued = alloca(n * sizeof(*queued));
+	batched = !lxc_rtnl_batch_begin();
+	if (!batched)
+		WARN("failed to batch the network teardown");
+
+	n = 0;
+	lxc_list_for_each(iterator, network) {
+		netdev = iterator->elem;
+		if (netdev->ifindex == 0)
+			continue;
 
 		/* Recent kernel remove the virtual interfaces when the network
 		 * namespace is destroyed but in case we did not moved the
 		 * interface to the network namespace, we have to destroy it
 		 */
-		if (netdev->ifindex != 0 &&
-		    lxc_netdev_delete_by_index(netdev->ifindex))
-			WARN("failed to remove interface '%s'", netdev->name);
+		if (netdev->type == LXC_NET_PHYS)
+			err = lxc_netdev_rename_by_index(netdev->ifindex,
+							 netdev->link);
+		else
+			err = lxc_netdev_delete_by_index(netdev->ifindex);
+		if (err)
+			warn_delete_netdev(netdev);
+		else if (batched)
+			queued[n++] = netdev;
 	}
+
+	if (!batched)
+		return;
+
+	errs = alloca(n * sizeof(int) + 1);
+	lxc_rtnl_batch_end(errs, n);
+	for (i = 0; i < n; i++)
+		if (errs[i])
+			warn_delete_netdev(queued[i]);
 }
 
 #define LXC_USERNIC_PATH LIBEXECDIR "/lxc/lxc-user-nic"
@@ -3192,7 +4002,7 @@ int lxc_assign_network(struct lxc_list *network, pid_t pid)
 	struct lxc_list *iterator;
 	struct lxc_netdev *netdev;
 	int am_root = (getuid() == 0);
-	int err;
+	int err, *errs, i, n = 0;
 
 	lxc_list_for_each(iterator, network) {
 
@@ -3211,14 +4021,53 @@ int lxc_assign_network(struct lxc_list *network, pid_t pid)
 		if (!netdev->ifindex)
 			continue;
 
+		n++;
+	}
+
+	if (!n)
+		return 0;
+
+	/* the moves don't depend on each other, send them together */
+	err = lxc_rtnl_batch_begin();
+	if (err) {
+		ERROR("failed to open the netlink socket : %s", strerror(-err));
+		return -1;
+	}
+
+	lxc_list_for_each(iterator, network) {
+		netdev = iterator->elem;
+		if ((netdev->type == LXC_NET_VETH && !am_root) || !netdev->ifindex)
+			continue;
+
 		err = lxc_netdev_move_by_index(netdev->ifindex, pid);
 		if (err) {
 			ERROR("failed to move '%s' to the container : %s",
 			      netdev->link, strerror(-err));
+			lxc_rtnl_batch_end(NULL, 0);
 			return -1;
 		}
+	}
+
+	errs = alloca(n * sizeof(int));
+	err = lxc_rtnl_batch_end(errs, n);
 
-		DEBUG("move '%s' to '%d'", netdev->name, pid);
+	i = 0;
+	lxc_list_for_each(iterator, network) {
+		netdev = iterator->elem;
+		if ((netdev->type == LXC_NET_VETH && !am_root) || !netdev->ifindex)
+			continue;
+
+		if (errs[i])
+			ERROR("failed to move '%s' to the container : %s",
+			      netdev->link, strerror(-errs[i]));
+		else
+			DEBUG("move '%s' to '%d'", netdev->name, pid);
+		i++;
+	}
+
+	if (err) {
+		ERROR("failed to move the network devices : %s", strerror(-err));
+		return -1;
 	}
 
 	return 0;
@@ -3250,47 +4099,129 @@ static int write_id_mapping(enum idtype idtype, pid_t pid, const char *buf,
 	return ret < 0 ? ret : closeret;
 }
 
-int lxc_map_ids(struct lxc_list *idmap, pid_t pid)
+/*
+ * newuidmap and newgidmap are looked up on $PATH once per process rather
+ * than on every start.
+ */
+static char *newuidmap_path, *newgidmap_path;
+static pthread_once_t idmap_helpers_once = PTHREAD_ONCE_INIT;
+
+static void find_idmap_helpers(void)
+{
+	newuidmap_path = on_path("newuidmap", NULL);
+	newgidmap_path = on_path("newgidmap", NULL);
+}
+
+/*
+ * Start new[ug]idmap on @pid with all @idmap entries of @type as its
+ * arguments, without a shell in between.  *@child is set to the helper's
+ * pid, or to 0 if there is nothing to map.
+ */
+static int start_idmap_helper(enum idtype type, pid_t pid,
+			      struct lxc_list *idmap, pid_t *child)
 {
 	struct lxc_list *iterator;
 	struct id_map *map;
-	int ret = 0, use_shadow = 0;
-	enum idtype type;
-	char *buf = NULL, *pos, *cmdpath = NULL;
+	char *helper, **argv, *buf, *pos;
+	int n = 0, argc = 0;
+	pid_t p;
 
-	cmdpath = on_path("newuidmap", NULL);
-	if (cmdpath) {
-		use_shadow = 1;
-		free(cmdpath);
+	*child = 0;
+	lxc_list_for_each(iterator, idmap) {
+		map = iterator->elem;
+		if (map->idtype == type)
+			n++;
 	}
+	if (!n)
+		return 0;
 
-	if (!use_shadow) {
-		cmdpath = on_path("newgidmap", NULL);
-		if (cmdpath) {
-			use_shadow = 1;
-			free(cmdpath);
-		}
+	helper = type == ID_TYPE_UID ? newuidmap_path : newgidmap_path;
+	if (!helper) {
+		ERROR("Missing new%cidmap", type == ID_TYPE_UID ? 'u' : 'g');
+		return -1;
 	}
 
-	if (!use_shadow && geteuid()) {
-		ERROR("Missing newuidmap/newgidmap");
+	/* every argument is a number of at most 20 digits */
+	argv = malloc((3 * n + 3) * sizeof(*argv));
+	buf = pos = malloc((3 * n + 1) * 21);
+	if (!argv || !buf) {
+		ERROR("Out of memory");
+		free(argv);
+		free(buf);
+		return -1;
+	}
+	argv[argc++] = helper;
+	argv[argc++] = pos;
+	pos += sprintf(pos, "%d", pid) + 1;
+	lxc_list_for_each(iterator, idmap) {
+		map = iterator->elem;
+		if (map->idtype != type)
+			continue;
+		argv[argc++] = pos;
+		pos += sprintf(pos, "%lu", map->nsid) + 1;
+		argv[argc++] = pos;
+		pos += sprintf(pos, "%lu", map->hostid) + 1;
+		argv[argc++] = pos;
+		pos += sprintf(pos, "%lu", map->range) + 1;
+	}
+	argv[argc] = NULL;
+
+	p = fork();
+	if (p < 0) {
+		SYSERROR("Failed forking");
+	} else if (p == 0) {
+		execv(helper, argv);
+		SYSERROR("Failed executing %s", helper);
+		_exit(1);
+	}
+	free(argv);
+	free(buf);
+	if (p < 0)
 		return -1;
+	*child = p;
+	return 0;
+}
+
+int lxc_map_ids(struct lxc_list *idmap, pid_t pid)
+{
+	struct lxc_list *iterator;
+	struct id_map *map;
+	int ret = 0;
+	enum idtype type;
+	char *buf, *pos;
+	pid_t uidpid, gidpid;
+
+	if (geteuid()) {
+		/*
+		 * Unprivileged: newuidmap and newgidmap run side by side, each
+		 * given all of its mappings in one invocation.
+		 */
+		pthread_once(&idmap_helpers_once, find_idmap_helpers);
+		if (!newuidmap_path && !newgidmap_path) {
+			ERROR("Missing newuidmap/newgidmap");
+			return -1;
+		}
+		if (start_idmap_helper(ID_TYPE_UID, pid, idmap, &uidpid) < 0)
+			return -1;
+		if (start_idmap_helper(ID_TYPE_GID, pid, idmap, &gidpid) < 0)
+			ret = -1;
+		if (uidpid && wait_for_pid(uidpid))
+			ret = -1;
+		if (gidpid && wait_for_pid(gidpid))
+			ret = -1;
+		return ret;
 	}
 
+	/* Privileged: write the maps ourselves, no helpers needed */
+	buf = malloc(4096);
+	if (!buf)
+		return -ENOMEM;
+
 	for(type = ID_TYPE_UID; type <= ID_TYPE_GID; type++) {
 		int left, fill;
 		int had_entry = 0;
-		if (!buf) {
-			buf = pos = malloc(4096);
-			if (!buf)
-				return -ENOMEM;
-		}
-		pos = buf;
-		if (use_shadow)
-			pos += sprintf(buf, "new%cidmap %d",
-				type == ID_TYPE_UID ? 'u' : 'g',
-				pid);
 
+		pos = buf;
 		lxc_list_for_each(iterator, idmap) {
 			/* The kernel only takes <= 4k for writes to /proc/<nr>/[ug]id_map */
 			map = iterator->elem;
@@ -3299,10 +4230,8 @@ int lxc_map_ids(struct lxc_list *idmap, pid_t pid)
 
 			had_entry = 1;
 			left = 4096 - (pos - buf);
-			fill = snprintf(pos, left, "%s%lu %lu %lu%s",
-					use_shadow ? " " : "",
-					map->nsid, map->hostid, map->range,
-					use_shadow ? "" : "\n");
+			fill = snprintf(pos, left, "%lu %lu %lu\n",
+					map->nsid, map->hostid, map->range);
 			if (fill <= 0 || fill >= left)
 				SYSERROR("snprintf failed, too many mappings");
 			pos += fill;
@@ -3310,23 +4239,12 @@ int lxc_map_ids(struct lxc_list *idmap, pid_t pid)
 		if (!had_entry)
 			continue;
 
-		if (!use_shadow) {
-			ret = write_id_mapping(type, pid, buf, pos-buf);
-		} else {
-			left = 4096 - (pos - buf);
-			fill = snprintf(pos, left, "\n");
-			if (fill <= 0 || fill >= left)
-				SYSERROR("snprintf failed, too many mappings");
-			pos += fill;
-			ret = system(buf);
-		}
-
+		ret = write_id_mapping(type, pid, buf, pos-buf);
 		if (ret)
 			break;
 	}
 
-	if (buf)
-		free(buf);
+	free(buf);
 	return ret;
 }
 
@@ -3398,9 +4316,10 @@ int lxc_find_gateway_addresses(struct lxc_handler *handler)
 		if (!netdev->ipv4_gateway_auto && !netdev->ipv6_gateway_auto)
 			continue;
 
-		if (netdev->type != LXC_NET_VETH && netdev->type != LXC_NET_MACVLAN) {
+		if (netdev->type != LXC_NET_VETH && netdev->type != LXC_NET_MACVLAN &&
+		    netdev->type != LXC_NET_IPVLAN) {
 			ERROR("gateway = auto only supported for "
-			      "veth and macvlan");
+			      "veth, macvlan and ipvlan");
 			return -1;
 		}
 
@@ -3453,10 +4372,8 @@ int lxc_create_tty(const char *name, struct lxc_conf *conf)
 
 		struct lxc_pty_info *pty_info = &tty_info->pty_info[i];
 
-		process_lock();
-		ret = openpty(&pty_info->master, &pty_info->slave,
-			    pty_info->name, NULL, NULL);
-		process_unlock();
+		ret = lxc_openpty(&pty_info->master, &pty_info->slave,
+				  pty_info->name);
 		if (ret) {
 			SYSERROR("failed to create pty #%d", i);
 			tty_info->nbtty = i;
@@ -3467,33 +4384,246 @@ int lxc_create_tty(const char *name, struct lxc_conf *conf)
 		DEBUG("allocated pty '%s' (%d/%d)",
 		      pty_info->name, pty_info->master, pty_info->slave);
 
-		/* Prevent leaking the file descriptors to the container */
-		fcntl(pty_info->master, F_SETFD, FD_CLOEXEC);
-		fcntl(pty_info->slave, F_SETFD, FD_CLOEXEC);
-
 		pty_info->busy = 0;
 	}
 
-	tty_info->nbtty = conf->tty;
+	tty_info->nbtty = conf->tty;
+
+	INFO("tty's configured");
+
+	return 0;
+}
+
+void lxc_delete_tty(struct lxc_tty_info *tty_info)
+{
+	int i;
+
+	for (i = 0; i < tty_info->nbtty; i++) {
+		struct lxc_pty_info *pty_info = &tty_info->pty_info[i];
+
+		close(pty_info->master);
+		close(pty_info->slave);
+	}
+
+	free(tty_info->pty_info);
+	tty_info->nbtty = 0;
+}
+
+/*
+ * Run one lxc-usernsexec chowning all of @paths, which are group-owned by
+ * @pathgid, to container root.  See chown_mapped_paths().
+ */
+static int usernsexec_chown(char **paths, int n, uid_t rootuid,
+			    gid_t rootgid, gid_t pathgid)
+{
+	int hostuid = geteuid(), hostgid = getegid(), ret, i, argc = 0;
+	char map1[100], map2[100], map3[100], map4[100], map5[100];
+	char ugid[100];
+	char **args;
+	pid_t pid;
+
+	// "u:0:rootuid:1"
+	ret = snprintf(map1, 100, "u:0:%d:1", rootuid);
+	if (ret < 0 || ret >= 100) {
+		ERROR("Error uid printing map string");
+		return -1;
+	}
+
+	// "u:hostuid:hostuid:1"
+	ret = snprintf(map2, 100, "u:%d:%d:1", hostuid, hostuid);
+	if (ret < 0 || ret >= 100) {
+		ERROR("Error uid printing map string");
+		return -1;
+	}
+
+	// "g:0:rootgid:1"
+	ret = snprintf(map3, 100, "g:0:%d:1", rootgid);
+	if (ret < 0 || ret >= 100) {
+		ERROR("Error gid printing map string");
+		return -1;
+	}
+
+	// "g:pathgid:rootgid+pathgid:1"
+	ret = snprintf(map4, 100, "g:%d:%d:1", pathgid, rootgid + pathgid);
+	if (ret < 0 || ret >= 100) {
+		ERROR("Error gid printing map string");
+		return -1;
+	}
+
+	// "g:hostgid:hostgid:1"
+	ret = snprintf(map5, 100, "g:%d:%d:1", hostgid, hostgid);
+	if (ret < 0 || ret >= 100) {
+		ERROR("Error gid printing map string");
+		return -1;
+	}
+
+	// "0:pathgid" (chown)
+	ret = snprintf(ugid, 100, "0:%d", pathgid);
+	if (ret < 0 || ret >= 100) {
+		ERROR("Error owner printing format string for chown");
+		return -1;
+	}
+
+	args = malloc((n + 16) * sizeof(*args));
+	if (!args) {
+		ERROR("Out of memory");
+		return -1;
+	}
+	args[argc++] = "lxc-usernsexec";
+	args[argc++] = "-m";
+	args[argc++] = map1;
+	args[argc++] = "-m";
+	args[argc++] = map2;
+	args[argc++] = "-m";
+	args[argc++] = map3;
+	if (hostgid != pathgid) {
+		args[argc++] = "-m";
+		args[argc++] = map4;
+	}
+	args[argc++] = "-m";
+	args[argc++] = map5;
+	args[argc++] = "--";
+	args[argc++] = "chown";
+	args[argc++] = ugid;
+	for (i = 0; i < n; i++)
+		args[argc++] = paths[i];
+	args[argc] = NULL;
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("Failed forking");
+		free(args);
+		return -1;
+	}
+	if (!pid) {
+		execvp("lxc-usernsexec", args);
+		SYSERROR("Failed executing usernsexec");
+		exit(1);
+	}
+	free(args);
+	return wait_for_pid(pid);
+}
+
+struct chown_paths_data {
+	char **paths;
+	int n;
+};
+
+/* in the user namespace of userns_hold(), where container root is 0 */
+static int chown_paths_wrapper(void *data)
+{
+	struct chown_paths_data *arg = data;
+	int i;
+
+	for (i = 0; i < arg->n; i++) {
+		if (chown(arg->paths[i], 0, -1) < 0) {
+			SYSERROR("Error chowning %s", arg->paths[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * chown_mapped_paths: chown each of @paths to the container root.  When
+ * that needs a helper in a user namespace (see chown_mapped_root()), all
+ * paths with the same group share one lxc-usernsexec, so the ttys and
+ * console of a container are chowned by a single helper rather than one
+ * per device.  Those of our group are chowned in the user namespace of
+ * userns_hold() instead, if there is one.
+ */
+static int chown_mapped_paths(char **paths, int n, struct lxc_conf *conf)
+{
+	uid_t rootuid;
+	gid_t rootgid, *gids;
+	unsigned long val;
+	char **batch;
+	int i, j, nbatch, ret = -1;
+
+	if (!get_mapped_rootid(conf, ID_TYPE_UID, &val)) {
+		ERROR("No mapping for container root");
+		return -1;
+	}
+	rootuid = (uid_t) val;
+	if (!get_mapped_rootid(conf, ID_TYPE_GID, &val)) {
+		ERROR("No mapping for container root");
+		return -1;
+	}
+	rootgid = (gid_t) val;
+
+	if (geteuid() == 0) {
+		for (i = 0; i < n; i++) {
+			if (chown(paths[i], rootuid, rootgid) < 0) {
+				ERROR("Error chowning %s", paths[i]);
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	if (rootuid == geteuid()) {
+		// nothing to do
+		INFO("%s: container root is our uid;  no need to chown" ,__func__);
+		return 0;
+	}
+
+	gids = malloc(n * sizeof(*gids));
+	batch = malloc(n * sizeof(*batch));
+	if (!gids || !batch) {
+		ERROR("Out of memory");
+		goto out;
+	}
 
-	INFO("tty's configured");
+	for (i = 0; i < n; i++) {
+		struct stat sb;
 
-	return 0;
-}
+		// save the current gid of the path
+		if (stat(paths[i], &sb) < 0) {
+			ERROR("Error stat %s", paths[i]);
+			goto out;
+		}
 
-void lxc_delete_tty(struct lxc_tty_info *tty_info)
-{
-	int i;
+		/*
+		 * A file has to be group-owned by a gid mapped into the
+		 * container, or the container won't be privileged over it.
+		 */
+		if (sb.st_uid == geteuid() &&
+				mapped_hostid(sb.st_gid, conf, ID_TYPE_GID) < 0) {
+			if (chown(paths[i], -1, getegid()) < 0) {
+				ERROR("Failed chgrping %s", paths[i]);
+				goto out;
+			}
+			sb.st_gid = getegid();
+		}
+		gids[i] = sb.st_gid;
+	}
 
-	for (i = 0; i < tty_info->nbtty; i++) {
-		struct lxc_pty_info *pty_info = &tty_info->pty_info[i];
+	for (i = 0; i < n; i++) {
+		if (!paths[i])
+			continue;
+		nbatch = 0;
+		for (j = i; j < n; j++) {
+			if (paths[j] && gids[j] == gids[i]) {
+				batch[nbatch++] = paths[j];
+				if (j > i)
+					paths[j] = NULL;
+			}
+		}
+		if (gids[i] == getegid() && conf->userns_fd >= 0) {
+			struct chown_paths_data data = { batch, nbatch };
 
-		close(pty_info->master);
-		close(pty_info->slave);
+			if (userns_exec_1(conf, chown_paths_wrapper, &data))
+				goto out;
+		} else if (usernsexec_chown(batch, nbatch, rootuid, rootgid,
+					    gids[i]))
+			goto out;
 	}
+	ret = 0;
 
-	free(tty_info->pty_info);
-	tty_info->nbtty = 0;
+out:
+	free(gids);
+	free(batch);
+	return ret;
 }
 
 /*
@@ -3506,23 +4636,8 @@ void lxc_delete_tty(struct lxc_tty_info *tty_info)
  */
 int chown_mapped_root(char *path, struct lxc_conf *conf)
 {
-	uid_t rootuid;
-	gid_t rootgid;
-	pid_t pid;
-	unsigned long val;
 	char *chownpath = path;
 
-	if (!get_mapped_rootid(conf, ID_TYPE_UID, &val)) {
-		ERROR("No mapping for container root");
-		return -1;
-	}
-	rootuid = (uid_t) val;
-	if (!get_mapped_rootid(conf, ID_TYPE_GID, &val)) {
-		ERROR("No mapping for container root");
-		return -1;
-	}
-	rootgid = (gid_t) val;
-
 	/*
 	 * In case of overlay, we want only the writeable layer
 	 * to be chowned
@@ -3533,137 +4648,155 @@ int chown_mapped_root(char *path, struct lxc_conf *conf)
 			ERROR("Bad overlay path: %s", path);
 			return -1;
 		}
-		chownpath = strchr(chownpath+1, ':');
+		/* the upper layer comes after all the lower ones */
+		chownpath = strrchr(chownpath+1, ':');
 		if (!chownpath) {
 			ERROR("Bad overlay path: %s", path);
 			return -1;
 		}
 		chownpath++;
 	}
-	path = chownpath;
-	if (geteuid() == 0) {
-		if (chown(path, rootuid, rootgid) < 0) {
-			ERROR("Error chowning %s", path);
-			return -1;
-		}
-		return 0;
-	}
 
-	if (rootuid == geteuid()) {
-		// nothing to do
-		INFO("%s: container root is our uid;  no need to chown" ,__func__);
-		return 0;
+	return chown_mapped_paths(&chownpath, 1, conf);
+}
+
+static int idmap_userns_wait(void *data)
+{
+	int *sync = data;
+	char c;
+
+	close(sync[1]);
+	/* returns once the parent has taken a reference to our userns */
+	if (read(sync[0], &c, 1) < 0)
+		return 1;
+	return 0;
+}
+
+/*
+ * Return an fd for a fresh user namespace carrying @idmap, which is kept
+ * alive by the fd alone.
+ */
+static int idmap_userns_fd(struct lxc_list *idmap)
+{
+	char path[MAXPATHLEN];
+	int sync[2], fd = -1;
+	pid_t pid;
+
+	if (pipe2(sync, O_CLOEXEC) < 0) {
+		SYSERROR("failed to create pipe");
+		return -1;
 	}
 
-	pid = fork();
+	pid = lxc_clone(idmap_userns_wait, sync, CLONE_NEWUSER);
 	if (pid < 0) {
-		SYSERROR("Failed forking");
+		SYSERROR("failed to create a user namespace");
+		close(sync[0]);
+		close(sync[1]);
 		return -1;
 	}
-	if (!pid) {
-		int hostuid = geteuid(), hostgid = getegid(), ret;
-		struct stat sb;
-		char map1[100], map2[100], map3[100], map4[100], map5[100];
-		char ugid[100];
-		char *args1[] = { "lxc-usernsexec", "-m", map1, "-m", map2,
-				"-m", map3, "-m", map5,
-				"--", "chown", ugid, path, NULL };
-		char *args2[] = { "lxc-usernsexec", "-m", map1, "-m", map2,
-				"-m", map3, "-m", map4, "-m", map5,
-				"--", "chown", ugid, path, NULL };
-
-		// save the current gid of "path"
-		if (stat(path, &sb) < 0) {
-			ERROR("Error stat %s", path);
-			return -1;
-		}
+	close(sync[0]);
 
-		/*
-		 * A file has to be group-owned by a gid mapped into the
-		 * container, or the container won't be privileged over it.
-		 */
-		if (sb.st_uid == geteuid() &&
-				mapped_hostid(sb.st_gid, conf, ID_TYPE_GID) < 0 &&
-				chown(path, -1, hostgid) < 0) {
-			ERROR("Failed chgrping %s", path);
-			return -1;
-		}
+	if (lxc_map_ids(idmap, pid) == 0) {
+		snprintf(path, sizeof(path), "/proc/%d/ns/user", pid);
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			SYSERROR("failed to open %s", path);
+	} else {
+		ERROR("failed to set up the id map");
+	}
 
-		// "u:0:rootuid:1"
-		ret = snprintf(map1, 100, "u:0:%d:1", rootuid);
-		if (ret < 0 || ret >= 100) {
-			ERROR("Error uid printing map string");
-			return -1;
-		}
+	close(sync[1]);
+	wait_for_pid(pid);
+	return fd;
+}
 
-		// "u:hostuid:hostuid:1"
-		ret = snprintf(map2, 100, "u:%d:%d:1", hostuid, hostuid);
-		if (ret < 0 || ret >= 100) {
-			ERROR("Error uid printing map string");
-			return -1;
-		}
+/*
+ * lxc_idmap_rootfs: for lxc.rootfs.idmapped, replace the rootfs mounted on
+ * conf->rootfs.mount with an id-mapped clone of it (Linux 5.12), so that
+ * files owned by N on disk show up as owned by container id N.  This runs
+ * as host root before the container is spawned, since only it may id-map
+ * a mount.  The rootfs is then never chowned for the container's id map.
+ */
+int lxc_idmap_rootfs(struct lxc_conf *conf)
+{
+#if defined(__NR_open_tree) && defined(__NR_move_mount) && \
+    defined(__NR_mount_setattr)
+	struct lxc_mount_attr attr = { 0 };
+	const char *path = conf->rootfs.mount;
+	int fd, userns_fd, ret = -1;
 
-		// "g:0:rootgid:1"
-		ret = snprintf(map3, 100, "g:0:%d:1", rootgid);
-		if (ret < 0 || ret >= 100) {
-			ERROR("Error gid printing map string");
-			return -1;
-		}
+	userns_fd = idmap_userns_fd(&conf->id_map);
+	if (userns_fd < 0)
+		return -1;
 
-		// "g:pathgid:rootgid+pathgid:1"
-		ret = snprintf(map4, 100, "g:%d:%d:1", (gid_t)sb.st_gid,
-				rootgid + (gid_t)sb.st_gid);
-		if (ret < 0 || ret >= 100) {
-			ERROR("Error gid printing map string");
-			return -1;
-		}
+	fd = syscall(__NR_open_tree, AT_FDCWD, path,
+		     OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+	if (fd < 0) {
+		SYSERROR("failed to clone the rootfs mount at %s", path);
+		goto out;
+	}
 
-		// "g:hostgid:hostgid:1"
-		ret = snprintf(map5, 100, "g:%d:%d:1", hostgid, hostgid);
-		if (ret < 0 || ret >= 100) {
-			ERROR("Error gid printing map string");
-			return -1;
-		}
+	attr.attr_set = MOUNT_ATTR_IDMAP;
+	attr.userns_fd = userns_fd;
+	if (syscall(__NR_mount_setattr, fd, "", AT_EMPTY_PATH, &attr,
+		    sizeof(attr)) < 0) {
+		SYSERROR("failed to id-map the rootfs at %s", path);
+		goto out;
+	}
 
-		// "0:pathgid" (chown)
-		ret = snprintf(ugid, 100, "0:%d", (gid_t)sb.st_gid);
-		if (ret < 0 || ret >= 100) {
-			ERROR("Error owner printing format string for chown");
-			return -1;
-		}
+	if (umount2(path, MNT_DETACH) < 0) {
+		SYSERROR("failed to unmount %s", path);
+		goto out;
+	}
 
-		if (hostgid == sb.st_gid)
-			ret = execvp("lxc-usernsexec", args1);
-		else
-			ret = execvp("lxc-usernsexec", args2);
-		SYSERROR("Failed executing usernsexec");
-		exit(1);
+	if (syscall(__NR_move_mount, fd, "", AT_FDCWD, path,
+		    MOVE_MOUNT_F_EMPTY_PATH) < 0) {
+		SYSERROR("failed to attach the id-mapped rootfs on %s", path);
+		goto out;
 	}
-	return wait_for_pid(pid);
+
+	INFO("id-mapped the rootfs at %s", path);
+	ret = 0;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	close(userns_fd);
+	return ret;
+#else
+	ERROR("id-mapped mounts are not supported on this architecture");
+	return -1;
+#endif
 }
 
 int ttys_shift_ids(struct lxc_conf *c)
 {
-	int i;
+	char **paths;
+	int i, n = 0, ret;
 
 	if (lxc_list_empty(&c->id_map))
 		return 0;
 
-	for (i = 0; i < c->tty_info.nbtty; i++) {
-		struct lxc_pty_info *pty_info = &c->tty_info.pty_info[i];
-
-		if (chown_mapped_root(pty_info->name, c) < 0) {
-			ERROR("Failed to chown %s", pty_info->name);
-			return -1;
-		}
+	paths = malloc((c->tty_info.nbtty + 1) * sizeof(*paths));
+	if (!paths) {
+		ERROR("Out of memory");
+		return -1;
 	}
 
-	if (strcmp(c->console.name, "") !=0 && chown_mapped_root(c->console.name, c) < 0) {
-		ERROR("Failed to chown %s", c->console.name);
-		return -1;
+	for (i = 0; i < c->tty_info.nbtty; i++)
+		paths[n++] = c->tty_info.pty_info[i].name;
+
+	if (strcmp(c->console.name, "") != 0)
+		paths[n++] = c->console.name;
+
+	ret = 0;
+	if (n && chown_mapped_paths(paths, n, c) < 0) {
+		ERROR("Failed to chown the ttys and console");
+		ret = -1;
 	}
 
-	return 0;
+	free(paths);
+	return ret;
 }
 
 /*
@@ -3939,6 +5072,7 @@ int do_rootfs_setup(struct lxc_conf *conf, const char *name, const char *lxcpath
 			ERROR("Failed to bind-mount container / onto itself");
 			return false;
 		}
+		return 0;
 	}
 
 	if (detect_ramfs_rootfs()) {
@@ -3973,6 +5107,10 @@ static bool verify_start_hooks(struct lxc_conf *conf)
 		struct stat st;
 		int ret;
 
+		/* the socket of a hook daemon is only looked up when it runs */
+		if (strncmp(hookname, "unix:", 5) == 0)
+			continue;
+
 		ret = snprintf(path, MAXPATHLEN, "%s%s",
 			conf->rootfs.mount, hookname);
 		if (ret < 0 || ret >= MAXPATHLEN)
@@ -3999,6 +5137,7 @@ int lxc_setup(struct lxc_handler *handler)
 		ERROR("Error setting up rootfs mount after spawn");
 		return -1;
 	}
+	lxc_start_mark(handler, LXC_PHASE_ROOTFS);
 
 	if (lxc_conf->inherit_ns_fd[LXC_NS_UTS] == -1) {
 		if (setup_utsname(lxc_conf->utsname)) {
@@ -4007,10 +5146,15 @@ int lxc_setup(struct lxc_handler *handler)
 		}
 	}
 
+	/* the parent moves the interfaces in while the rootfs is set up */
+	if (lxc_sync_wait_parent(handler, LXC_SYNC_NETWORK))
+		return -1;
+
 	if (setup_network(&lxc_conf->network)) {
 		ERROR("failed to setup the network for '%s'", name);
 		return -1;
 	}
+	lxc_start_mark(handler, LXC_PHASE_NET_SETUP);
 
 	if (lxc_conf->autodev < 0) {
 		lxc_conf->autodev = check_autodev(lxc_conf->rootfs.mount, data);
@@ -4056,6 +5200,11 @@ int lxc_setup(struct lxc_handler *handler)
 		ERROR("failed to setup the automatic mounts for '%s'", name);
 		return -1;
 	}
+	if (setup_hugepages(lxc_conf)) {
+		ERROR("failed to setup the huge pages for '%s'", name);
+		return -1;
+	}
+	lxc_start_mark(handler, LXC_PHASE_MOUNTS);
 
 	if (run_lxc_hooks(name, "mount", lxc_conf, lxcpath, NULL)) {
 		ERROR("failed to run mount hooks for container '%s'.", name);
@@ -4072,6 +5221,7 @@ int lxc_setup(struct lxc_handler *handler)
 			return -1;
 		}
 	}
+	lxc_start_mark(handler, LXC_PHASE_MOUNT_HOOKS);
 
 	if (!lxc_conf->is_execute && setup_console(&lxc_conf->rootfs, &lxc_conf->console, lxc_conf->ttydir)) {
 		ERROR("failed to setup the console for '%s'", name);
@@ -4103,6 +5253,7 @@ int lxc_setup(struct lxc_handler *handler)
 		ERROR("failed to set rootfs for '%s'", name);
 		return -1;
 	}
+	lxc_start_mark(handler, LXC_PHASE_PIVOT);
 
 	if (setup_pts(lxc_conf->pts)) {
 		ERROR("failed to setup the new pts instance");
@@ -4281,6 +5432,8 @@ int lxc_clear_nic(struct lxc_conf *c, const char *key)
 			free(netdev->ipv4_gateway);
 			netdev->ipv4_gateway = NULL;
 		}
+	} else if (strcmp(p1, ".ipv6_dad") == 0) {
+		netdev->ipv6_dad = LXC_NET_DAD_ON;
 	} else if (strcmp(p1, ".ipv6_gateway") == 0) {
 		if (netdev->ipv6_gateway) {
 			free(netdev->ipv6_gateway);
@@ -4443,6 +5596,17 @@ static inline void lxc_clear_aliens(struct lxc_conf *conf)
 	}
 }
 
+static inline void lxc_clear_loglevels(struct lxc_conf *conf)
+{
+	struct lxc_list *it,*next;
+
+	lxc_list_for_each_safe(it, &conf->loglevels, next) {
+		lxc_list_del(it);
+		free(it->elem);
+		free(it);
+	}
+}
+
 static inline void lxc_clear_includes(struct lxc_conf *conf)
 {
 	struct lxc_list *it,*next;
@@ -4458,8 +5622,12 @@ void lxc_conf_free(struct lxc_conf *conf)
 {
 	if (!conf)
 		return;
+	if (conf->userns_fd >= 0)
+		close(conf->userns_fd);
 	if (conf->console.path)
 		free(conf->console.path);
+	free(conf->console.log_path);
+	free(conf->console.buffer_path);
 	if (conf->rootfs.mount)
 		free(conf->rootfs.mount);
 	if (conf->rootfs.options)
@@ -4478,6 +5646,10 @@ void lxc_conf_free(struct lxc_conf *conf)
 		free(conf->fstab);
 	if (conf->rcfile)
 		free(conf->rcfile);
+	free(conf->start_notify);
+	free(conf->cpuset_mempolicy);
+	free(conf->hugepages_mount);
+	free(conf->checkpoint_page_server);
 	lxc_clear_config_network(conf);
 	if (conf->lsm_aa_profile)
 		free(conf->lsm_aa_profile);
@@ -4494,9 +5666,232 @@ void lxc_conf_free(struct lxc_conf *conf)
 	lxc_clear_groups(conf);
 	lxc_clear_includes(conf);
 	lxc_clear_aliens(conf);
+	lxc_clear_loglevels(conf);
 	free(conf);
 }
 
+/*
+ * Append copies of the elements of src to dst, elements of size bytes,
+ * or strings if size is 0.
+ */
+static int dup_list(struct lxc_list *dst, struct lxc_list *src, size_t size)
+{
+	struct lxc_list *it, *item;
+	void *elem;
+
+	lxc_list_for_each(it, src) {
+		if (size) {
+			elem = malloc(size);
+			if (elem)
+				memcpy(elem, it->elem, size);
+		} else {
+			elem = strdup(it->elem);
+		}
+		if (!elem)
+			return -1;
+		item = malloc(sizeof(*item));
+		if (!item) {
+			free(elem);
+			return -1;
+		}
+		item->elem = elem;
+		lxc_list_add_tail(dst, item);
+	}
+	return 0;
+}
+
+static int dup_str(char **dst, const char *src)
+{
+	if (!src)
+		return 0;
+	*dst = strdup(src);
+	return *dst ? 0 : -1;
+}
+
+static int dup_mem(void **dst, const void *src, size_t size)
+{
+	if (!src)
+		return 0;
+	*dst = malloc(size);
+	if (!*dst)
+		return -1;
+	memcpy(*dst, src, size);
+	return 0;
+}
+
+static int dup_cgroups(struct lxc_list *dst, struct lxc_list *src)
+{
+	struct lxc_list *it, *item;
+	struct lxc_cgroup *cg, *orig;
+
+	lxc_list_for_each(it, src) {
+		orig = it->elem;
+		cg = malloc(sizeof(*cg));
+		if (!cg)
+			return -1;
+		memset(cg, 0, sizeof(*cg));
+		item = malloc(sizeof(*item));
+		if (!item) {
+			free(cg);
+			return -1;
+		}
+		item->elem = cg;
+		lxc_list_add_tail(dst, item);
+		if (dup_str(&cg->subsystem, orig->subsystem) ||
+		    dup_str(&cg->value, orig->value))
+			return -1;
+	}
+	return 0;
+}
+
+static int dup_network(struct lxc_list *dst, struct lxc_list *src)
+{
+	struct lxc_list *it, *item;
+	struct lxc_netdev *netdev, *orig;
+
+	lxc_list_for_each(it, src) {
+		orig = it->elem;
+		netdev = malloc(sizeof(*netdev));
+		if (!netdev)
+			return -1;
+		item = malloc(sizeof(*item));
+		if (!item) {
+			free(netdev);
+			return -1;
+		}
+
+		/* the settings, but nothing owned by orig */
+		*netdev = *orig;
+		netdev->link = netdev->name = netdev->hwaddr = netdev->mtu = NULL;
+		netdev->upscript = netdev->downscript = NULL;
+		netdev->ipv4_gateway = NULL;
+		netdev->ipv6_gateway = NULL;
+		if (netdev->type == LXC_NET_VETH)
+			netdev->priv.veth_attr.pair = NULL;
+		lxc_list_init(&netdev->ipv4);
+		lxc_list_init(&netdev->ipv6);
+
+		/* from here on lxc_conf_free() knows how to free it */
+		item->elem = netdev;
+		lxc_list_add_tail(dst, item);
+
+		if (dup_str(&netdev->link, orig->link) ||
+		    dup_str(&netdev->name, orig->name) ||
+		    dup_str(&netdev->hwaddr, orig->hwaddr) ||
+		    dup_str(&netdev->mtu, orig->mtu) ||
+		    dup_str(&netdev->upscript, orig->upscript) ||
+		    dup_str(&netdev->downscript, orig->downscript))
+			return -1;
+		if (orig->type == LXC_NET_VETH &&
+		    dup_str(&netdev->priv.veth_attr.pair,
+			    orig->priv.veth_attr.pair))
+			return -1;
+		if (dup_mem((void **)&netdev->ipv4_gateway, orig->ipv4_gateway,
+			    sizeof(*orig->ipv4_gateway)) ||
+		    dup_mem((void **)&netdev->ipv6_gateway, orig->ipv6_gateway,
+			    sizeof(*orig->ipv6_gateway)))
+			return -1;
+		if (dup_list(&netdev->ipv4, &orig->ipv4,
+			     sizeof(struct lxc_inetdev)) ||
+		    dup_list(&netdev->ipv6, &orig->ipv6,
+			     sizeof(struct lxc_inet6dev)))
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Copy the configuration of c, what lxc_config_read() would have set in
+ * a new lxc_conf reading the same file.  The state of a running container
+ * (ttys, console fds, saved nics, inherited namespaces, ...) is not copied.
+ */
+struct lxc_conf *lxc_conf_dup(struct lxc_conf *c)
+{
+	struct lxc_conf *new;
+	int i;
+
+	new = lxc_conf_init();
+	if (!new)
+		return NULL;
+
+	new->is_execute = c->is_execute;
+	new->unexpanded = c->unexpanded;
+	new->tty = c->tty;
+	new->pts = c->pts;
+	new->personality = c->personality;
+	new->auto_mounts = c->auto_mounts;
+	new->close_all_fds = c->close_all_fds;
+	new->autodev = c->autodev;
+	new->rootfs.idmapped = c->rootfs.idmapped;
+	new->haltsignal = c->haltsignal;
+	new->stopsignal = c->stopsignal;
+	new->kmsg = c->kmsg;
+	new->loglevel = c->loglevel;
+	new->logbuffer = c->logbuffer;
+	new->logbinary = c->logbinary;
+	new->start_auto = c->start_auto;
+	new->start_delay = c->start_delay;
+	new->start_order = c->start_order;
+	new->start_supervised = c->start_supervised;
+	new->ephemeral = c->ephemeral;
+	new->stop_cgroup_kill = c->stop_cgroup_kill;
+	new->checkpoint_predump = c->checkpoint_predump;
+	new->cpuset_policy = c->cpuset_policy;
+	new->cpuset_count = c->cpuset_count;
+	new->hugepages_size = c->hugepages_size;
+	new->hugepages_reserve = c->hugepages_reserve;
+	new->console.log_size = c->console.log_size;
+	new->console.log_rate = c->console.log_rate;
+	new->console.buffer_size = c->console.buffer_size;
+
+	free(new->rootfs.mount);
+	new->rootfs.mount = NULL;
+	if (dup_str(&new->rootfs.mount, c->rootfs.mount) ||
+	    dup_str(&new->rootfs.path, c->rootfs.path) ||
+	    dup_str(&new->rootfs.pivot, c->rootfs.pivot) ||
+	    dup_str(&new->rootfs.options, c->rootfs.options) ||
+	    dup_str(&new->console.path, c->console.path) ||
+	    dup_str(&new->console.log_path, c->console.log_path) ||
+	    dup_str(&new->console.buffer_path, c->console.buffer_path) ||
+	    dup_str(&new->fstab, c->fstab) ||
+	    dup_str(&new->ttydir, c->ttydir) ||
+	    dup_str(&new->lsm_aa_profile, c->lsm_aa_profile) ||
+	    dup_str(&new->lsm_se_context, c->lsm_se_context) ||
+	    dup_str(&new->seccomp, c->seccomp) ||
+	    dup_str(&new->start_notify, c->start_notify) ||
+	    dup_str(&new->cpuset_mempolicy, c->cpuset_mempolicy) ||
+	    dup_str(&new->hugepages_mount, c->hugepages_mount) ||
+	    dup_str(&new->checkpoint_page_server, c->checkpoint_page_server) ||
+	    dup_str(&new->logfile, c->logfile) ||
+	    dup_str(&new->rcfile, c->rcfile))
+		goto err;
+	if (dup_mem((void **)&new->utsname, c->utsname, sizeof(*c->utsname)))
+		goto err;
+
+	if (dup_list(&new->caps, &c->caps, 0) ||
+	    dup_list(&new->keepcaps, &c->keepcaps, 0) ||
+	    dup_list(&new->mount_list, &c->mount_list, 0) ||
+	    dup_list(&new->groups, &c->groups, 0) ||
+	    dup_list(&new->includes, &c->includes, 0) ||
+	    dup_list(&new->aliens, &c->aliens, 0) ||
+	    dup_list(&new->loglevels, &c->loglevels, 0) ||
+	    dup_list(&new->id_map, &c->id_map, sizeof(struct id_map)))
+		goto err;
+	for (i = 0; i < NUM_LXC_HOOKS; i++)
+		if (dup_list(&new->hooks[i], &c->hooks[i], 0))
+			goto err;
+	if (dup_cgroups(&new->cgroup, &c->cgroup) ||
+	    dup_network(&new->network, &c->network))
+		goto err;
+
+	return new;
+
+err:
+	ERROR("failed to copy the configuration");
+	lxc_conf_free(new);
+	return NULL;
+}
+
 struct userns_fn_data {
 	int (*fn)(void *);
 	void *arg;
@@ -4598,6 +5993,26 @@ err:
 	return NULL;
 }
 
+/* run fn in a child joining the user namespace of userns_hold() */
+static int userns_exec_held(int userns_fd, int (*fn)(void *), void *data)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("failed to fork");
+		return -1;
+	}
+	if (pid)
+		return wait_for_pid(pid);
+
+	if (setns(userns_fd, CLONE_NEWUSER) < 0) {
+		SYSERROR("failed to join the user namespace");
+		_exit(1);
+	}
+	_exit(fn(data) ? 1 : 0);
+}
+
 /*
  * Run a function in a new user namespace.
  * The caller's euid/egid will be mapped in if it is not already.
@@ -4610,6 +6025,10 @@ int userns_exec_1(struct lxc_conf *conf, int (*fn)(void *), void *data)
 	int p[2];
 	struct lxc_list *idmap;
 
+	/* the id mapping, two setuid helpers, was done once for all */
+	if (conf->userns_fd >= 0)
+		return userns_exec_held(conf->userns_fd, fn, data);
+
 	ret = pipe(p);
 	if (ret < 0) {
 		SYSERROR("opening pipe");
@@ -4655,3 +6074,35 @@ err:
 	close(p[1]);
 	return -1;
 }
+
+/*
+ * The user namespace is held by its fd alone, the steps joining it only
+ * need a fork.  Should it not come up, they go on creating their own.
+ */
+void userns_hold(struct lxc_conf *conf)
+{
+	struct lxc_list *idmap;
+
+	if (conf->userns_refs++ || geteuid() == 0 ||
+	    lxc_list_empty(&conf->id_map))
+		return;
+
+	idmap = idmap_add_id(conf, geteuid(), getegid());
+	if (!idmap) {
+		WARN("Error adding self to container uid/gid map");
+		return;
+	}
+	conf->userns_fd = idmap_userns_fd(idmap);
+	lxc_free_idmap(idmap);
+	free(idmap);
+	if (conf->userns_fd < 0)
+		WARN("failed to set up a user namespace to reuse");
+}
+
+void userns_release(struct lxc_conf *conf)
+{
+	if (--conf->userns_refs || conf->userns_fd < 0)
+		return;
+	close(conf->userns_fd);
+	conf->userns_fd = -1;
+}
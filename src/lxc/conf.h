@@ -30,6 +30,8 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "list.h"
 #include "start.h" /* for lxc_handler */
@@ -45,6 +47,7 @@ enum {
 	LXC_NET_PHYS,
 	LXC_NET_VLAN,
 	LXC_NET_NONE,
+	LXC_NET_IPVLAN,
 	LXC_NET_MAXCONFTYPE,
 };
 
@@ -95,13 +98,28 @@ struct ifla_vlan {
 };
 
 struct ifla_macvlan {
-	int mode; /* private, vepa, bridge */
+	int mode; /* private, vepa, bridge, passthru */
+};
+
+struct ifla_ipvlan {
+	int mode; /* l2, l3, l3s */
 };
 
 union netdev_p {
 	struct ifla_veth veth_attr;
 	struct ifla_vlan vlan_attr;
 	struct ifla_macvlan macvlan_attr;
+	struct ifla_ipvlan ipvlan_attr;
+};
+
+/*
+ * Duplicate address detection of the ipv6 addresses: the kernel default,
+ * none at all, or optimistic where the addresses can be used during it
+ */
+enum {
+	LXC_NET_DAD_ON,
+	LXC_NET_DAD_OFF,
+	LXC_NET_DAD_OPTIMISTIC,
 };
 
 /*
@@ -111,6 +129,7 @@ union netdev_p {
  * @flags      : flag of the network device (IFF_UP, ... )
  * @ipv4       : a list of ipv4 addresses to be set on the network device
  * @ipv6       : a list of ipv6 addresses to be set on the network device
+ * @ipv6_dad   : lxc.network.ipv6.dad, duplicate address detection for @ipv6
  * @upscript   : a script filename to be executed during interface configuration
  * @downscript : a script filename to be executed during interface destruction
  */
@@ -129,6 +148,7 @@ struct lxc_netdev {
 	bool ipv4_gateway_auto;
 	struct in6_addr *ipv6_gateway;
 	bool ipv6_gateway_auto;
+	int ipv6_dad;
 	char *upscript;
 	char *downscript;
 };
@@ -195,6 +215,16 @@ struct lxc_tty_state;
  * @peer   : the file descriptor put/get console traffic
  * @name   : the file name of the slave pty
  */
+struct lxc_ringbuf;
+
+/*
+ * Defines the console of a container
+ * @log_path    : lxc.console.logfile, file the output is logged to
+ * @log_size    : lxc.console.size, rotate the log file past this size
+ * @log_rate    : lxc.console.rate, bytes logged per second at most
+ * @buffer_size : lxc.console.buffer.size, size of the in-memory history
+ * @buffer_path : lxc.console.buffer.file, file the history is mapped on
+ */
 struct lxc_console {
 	int slave;
 	int master;
@@ -204,9 +234,20 @@ struct lxc_console {
 	char *path;
 	char *log_path;
 	int log_fd;
+	uint64_t log_size;
+	uint64_t log_rate;
+	uint64_t buffer_size;
+	char *buffer_path;
 	char name[MAXPATHLEN];
 	struct termios *tios;
 	struct lxc_tty_state *tty_state;
+	char *buf; /* proxy buffer, grown while reads fill it */
+	size_t buf_size;
+	struct lxc_ringbuf *ringbuf;
+	uint64_t log_written; /* bytes in the current log file */
+	uint64_t log_budget; /* bytes which may still be logged this second */
+	uint64_t log_dropped; /* bytes not logged this second */
+	time_t log_second;
 };
 
 /*
@@ -220,6 +261,8 @@ struct lxc_rootfs {
 	char *mount;
 	char *pivot;
 	char *options;
+	/* on-disk ownership is unshifted, id-map the mount at start */
+	int idmapped;
 };
 
 /*
@@ -292,6 +335,12 @@ struct lxc_conf {
 	signed long personality;
 	struct utsname *utsname;
 	struct lxc_list cgroup;
+	int cpuset_policy; // lxc.cpuset.policy, see cpuset.h
+	int cpuset_count;  // lxc.cpuset.count, cpus to place on
+	char *cpuset_mempolicy; // lxc.cpuset.mempolicy, of the init
+	char *hugepages_mount;  // lxc.hugepages.mount, "path [options]"
+	unsigned long hugepages_size;    // lxc.hugepages.size, in kB, 0 for the default
+	unsigned long hugepages_reserve; // lxc.hugepages.reserve, in pages
 	struct lxc_list id_map;
 	struct lxc_list network;
 	struct saved_nic *saved_nics;
@@ -314,10 +363,14 @@ struct lxc_conf {
 #if HAVE_SCMP_FILTER_CTX
 	scmp_filter_ctx seccomp_ctx;
 #endif
+	/* the compiled policy, when found in the seccomp cache */
+	struct sock_filter *seccomp_bpf;
+	unsigned short seccomp_bpf_len;
 	int maincmd_fd;
 	int autodev;  // if 1, mount and fill a /dev at start
 	int haltsignal; // signal used to halt container
 	int stopsignal; // signal used to hard stop container
+	int stop_cgroup_kill; // lxc.stop.cgroup_kill, SIGKILL all tasks at once
 	int kmsg;  // if 1, create /dev/kmsg symlink
 	char *rcfile;	// Copy of the top level rcfile we read
 
@@ -328,12 +381,20 @@ struct lxc_conf {
 	// store the config file specified values here.
 	char *logfile;  // the logfile as specifed in config
 	int loglevel;   // loglevel as specifed in config (if any)
+	struct lxc_list loglevels; // "category = LEVEL" of lxc.loglevel.*
+	int logbuffer;  // buffer the logfile writes, see log.c
+	int logbinary;  // lxc.logformat is binary
 
 	int inherit_ns_fd[LXC_NS_MAX];
 
 	int start_auto;
 	int start_delay;
 	int start_order;
+	char *start_notify; // lxc.start.notify, NOTIFY_SOCKET in the container
+	int start_supervised; // lxc.start.supervised, see supervisor.h
+	int ephemeral; // lxc.ephemeral, destroyed once stopped
+	int checkpoint_predump; // lxc.checkpoint.predump, pre-dumps before a checkpoint
+	char *checkpoint_page_server; // lxc.checkpoint.page_server, "address:port"
 	struct lxc_list groups;
 	int nbd_idx;
 
@@ -344,6 +405,11 @@ struct lxc_conf {
 	struct lxc_list includes;
 	/* config entries which are not "lxc.*" are aliens */
 	struct lxc_list aliens;
+	/* while a config is read, where what it sets is recorded */
+	struct lxc_config_record *record;
+	/* the user namespace of userns_hold(), and its holds */
+	int userns_fd;
+	int userns_refs;
 };
 
 int run_lxc_hooks(const char *name, char *hook, struct lxc_conf *conf,
@@ -356,6 +422,7 @@ extern int detect_shared_rootfs(void);
  */
 extern struct lxc_conf *lxc_conf_init(void);
 extern void lxc_conf_free(struct lxc_conf *conf);
+extern struct lxc_conf *lxc_conf_dup(struct lxc_conf *c);
 
 extern int pin_rootfs(const char *rootfs);
 
@@ -383,6 +450,13 @@ extern int lxc_clear_groups(struct lxc_conf *c);
 extern int do_rootfs_setup(struct lxc_conf *conf, const char *name,
 			   const char *lxcpath);
 
+struct mntent;
+/*
+ * Split an lxc.mount.entry @line, in place, the way getmntent() reads a
+ * line of fstab.  Returns 0, or 1 if it is blank or a comment.
+ */
+extern int lxc_parse_mntent(char *line, struct mntent *mntent);
+
 /*
  * Configure the container from inside
  */
@@ -396,7 +470,16 @@ extern int find_unmapped_nsuid(struct lxc_conf *conf, enum idtype idtype);
 extern int mapped_hostid(unsigned id, struct lxc_conf *conf, enum idtype idtype);
 extern int chown_mapped_root(char *path, struct lxc_conf *conf);
 extern int ttys_shift_ids(struct lxc_conf *c);
+extern int lxc_idmap_rootfs(struct lxc_conf *conf);
 extern int userns_exec_1(struct lxc_conf *conf, int (*fn)(void *), void *data);
+
+/*
+ * Set up the user namespace userns_exec_1() runs in once, for the steps of
+ * an operation on an unprivileged container to join until the matching
+ * userns_release().  Holds nest.
+ */
+extern void userns_hold(struct lxc_conf *conf);
+extern void userns_release(struct lxc_conf *conf);
 extern int parse_mntopts(const char *mntopts, unsigned long *mntflags,
 			 char **mntdata);
 extern void tmp_proc_unmount(struct lxc_conf *lxc_conf);
@@ -0,0 +1,569 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "log.h"
+#include "conf.h"
+#include "confile.h"
+#include "confcache.h"
+#include "utils.h"
+#include "version.h"
+
+lxc_log_define(lxc_confcache, lxc);
+
+#define LXC_CONFCACHE_MAGIC	0x6c786363	/* "lxcc" */
+#define LXC_CONFCACHE_VERSION	1
+#define LXC_CONFCACHE_MAX	(16 * 1024 * 1024)
+
+/*
+ * Layout of a cache file: the header, LXC_VERSION, then for each file
+ * a struct confcache_file and its path, then for each pair its key and
+ * its value.  All strings are NUL terminated.
+ */
+struct confcache_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nfiles;
+	uint32_t npairs;
+};
+
+struct confcache_file {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+};
+
+struct lxc_config_record *lxc_config_record_new(void)
+{
+	struct lxc_config_record *rec;
+
+	rec = malloc(sizeof(*rec));
+	if (rec)
+		memset(rec, 0, sizeof(*rec));
+	return rec;
+}
+
+void lxc_config_record_free(struct lxc_config_record *rec)
+{
+	size_t i;
+
+	if (!rec)
+		return;
+	if (!rec->buf) {
+		for (i = 0; i < rec->nfiles; i++)
+			free(rec->files[i].path);
+		for (i = 0; i < rec->npairs; i++) {
+			free(rec->pairs[i].key);
+			free(rec->pairs[i].value);
+		}
+	}
+	free(rec->files);
+	free(rec->pairs);
+	free(rec->buf);
+	free(rec);
+}
+
+static int config_file_stat(const char *path, struct lxc_config_file *file)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return -1;
+	file->dev = st.st_dev;
+	file->ino = st.st_ino;
+	file->size = st.st_size;
+	file->mtime_sec = st.st_mtim.tv_sec;
+	file->mtime_nsec = st.st_mtim.tv_nsec;
+	return 0;
+}
+
+/*
+ * Call this before reading @path, so that a change made while it is read
+ * shows in its mtime.
+ */
+int lxc_config_record_file(struct lxc_config_record *rec, const char *path)
+{
+	struct lxc_config_file *files, *file;
+
+	/* a relative include depends on the cwd of whoever reads it */
+	if (path[0] != '/')
+		goto nocache;
+
+	files = realloc(rec->files, (rec->nfiles + 1) * sizeof(*files));
+	if (!files)
+		goto nocache;
+	rec->files = files;
+	file = &files[rec->nfiles];
+	if (config_file_stat(path, file) < 0)
+		goto nocache;
+
+	/*
+	 * A file changed within the last second may change again without
+	 * its mtime showing it on filesystems with coarse timestamps.
+	 */
+	if (file->mtime_sec >= time(NULL) - 1)
+		goto nocache;
+
+	file->path = strdup(path);
+	if (!file->path)
+		goto nocache;
+	rec->nfiles++;
+	return 0;
+
+nocache:
+	rec->nocache = true;
+	return -1;
+}
+
+int lxc_config_record_pair(struct lxc_config_record *rec, const char *key,
+			   const char *value)
+{
+	struct lxc_config_pair *pairs;
+
+	pairs = realloc(rec->pairs, (rec->npairs + 1) * sizeof(*pairs));
+	if (!pairs)
+		goto nocache;
+	rec->pairs = pairs;
+	pairs[rec->npairs].key = strdup(key);
+	pairs[rec->npairs].value = strdup(value);
+	if (!pairs[rec->npairs].key || !pairs[rec->npairs].value) {
+		free(pairs[rec->npairs].key);
+		free(pairs[rec->npairs].value);
+		goto nocache;
+	}
+	rec->npairs++;
+	return 0;
+
+nocache:
+	rec->nocache = true;
+	return -1;
+}
+
+int lxc_config_record_replay(const struct lxc_config_record *rec,
+			     struct lxc_conf *conf)
+{
+	struct lxc_config_t *config;
+	size_t i;
+
+	for (i = 0; i < rec->npairs; i++) {
+		config = lxc_getconfig(rec->pairs[i].key);
+		if (!config) {
+			ERROR("unknown key %s", rec->pairs[i].key);
+			return -1;
+		}
+		if (config->cb(rec->pairs[i].key, rec->pairs[i].value, conf))
+			return -1;
+	}
+	return 0;
+}
+
+static bool config_record_valid(const struct lxc_config_record *rec)
+{
+	struct lxc_config_file now;
+	size_t i;
+
+	for (i = 0; i < rec->nfiles; i++) {
+		if (config_file_stat(rec->files[i].path, &now) < 0)
+			return false;
+		if (now.dev != rec->files[i].dev ||
+		    now.ino != rec->files[i].ino ||
+		    now.size != rec->files[i].size ||
+		    now.mtime_sec != rec->files[i].mtime_sec ||
+		    now.mtime_nsec != rec->files[i].mtime_nsec)
+			return false;
+	}
+	return true;
+}
+
+/* append what @src recorded, as if it had been recorded into @dst */
+int lxc_config_record_merge(struct lxc_config_record *dst,
+			    const struct lxc_config_record *src)
+{
+	struct lxc_config_file *files;
+	size_t i;
+
+	if (src->nocache)
+		goto nocache;
+
+	files = realloc(dst->files,
+			(dst->nfiles + src->nfiles) * sizeof(*files));
+	if (!files && src->nfiles)
+		goto nocache;
+	dst->files = files;
+	for (i = 0; i < src->nfiles; i++) {
+		files[dst->nfiles] = src->files[i];
+		files[dst->nfiles].path = strdup(src->files[i].path);
+		if (!files[dst->nfiles].path)
+			goto nocache;
+		dst->nfiles++;
+	}
+
+	for (i = 0; i < src->npairs; i++)
+		if (lxc_config_record_pair(dst, src->pairs[i].key,
+					   src->pairs[i].value) < 0)
+			return -1;
+	return 0;
+
+nocache:
+	dst->nocache = true;
+	return -1;
+}
+
+struct config_memo {
+	char *path;
+	struct lxc_config_record *rec;
+	struct config_memo *next;
+};
+
+static pthread_mutex_t config_memo_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct config_memo *config_memos;
+
+/* called with config_memo_lock held */
+static void config_memo_unref(struct lxc_config_record *rec)
+{
+	if (--rec->refcount == 0)
+		lxc_config_record_free(rec);
+}
+
+/* called with config_memo_lock held */
+static struct config_memo **config_memo_find(const char *path)
+{
+	struct config_memo **p;
+
+	for (p = &config_memos; *p; p = &(*p)->next)
+		if (!strcmp((*p)->path, path))
+			return p;
+	return NULL;
+}
+
+/* called with config_memo_lock held */
+static void config_memo_drop(struct config_memo **p)
+{
+	struct config_memo *m = *p;
+
+	*p = m->next;
+	config_memo_unref(m->rec);
+	free(m->path);
+	free(m);
+}
+
+struct lxc_config_record *lxc_config_memo_get(const char *path)
+{
+	struct lxc_config_record *rec = NULL;
+	struct config_memo **p;
+
+	pthread_mutex_lock(&config_memo_lock);
+	p = config_memo_find(path);
+	if (p) {
+		if (config_record_valid((*p)->rec)) {
+			rec = (*p)->rec;
+			rec->refcount++;
+		} else {
+			config_memo_drop(p);
+		}
+	}
+	pthread_mutex_unlock(&config_memo_lock);
+	return rec;
+}
+
+void lxc_config_memo_put(struct lxc_config_record *rec)
+{
+	pthread_mutex_lock(&config_memo_lock);
+	config_memo_unref(rec);
+	pthread_mutex_unlock(&config_memo_lock);
+}
+
+void lxc_config_memo_add(const char *path, struct lxc_config_record *rec)
+{
+	struct config_memo **p, *m;
+
+	if (rec->nocache) {
+		lxc_config_record_free(rec);
+		return;
+	}
+
+	m = malloc(sizeof(*m));
+	if (m)
+		m->path = strdup(path);
+	if (!m || !m->path) {
+		free(m);
+		lxc_config_record_free(rec);
+		return;
+	}
+	rec->refcount = 1;
+	m->rec = rec;
+
+	pthread_mutex_lock(&config_memo_lock);
+	p = config_memo_find(path);
+	if (p)
+		config_memo_drop(p);
+	m->next = config_memos;
+	config_memos = m;
+	pthread_mutex_unlock(&config_memo_lock);
+}
+
+/* $rundir/lxc/confcache/$path, creating the directories if @create */
+static char *confcache_path(const char *path, bool create)
+{
+	char *rundir, *cpath, *slash;
+	int ret, len;
+
+	rundir = get_rundir();
+	if (!rundir)
+		return NULL;
+
+	/* $rundir + "/lxc/confcache" + $path + '\0' */
+	len = strlen(rundir) + strlen(path) + 15;
+	cpath = malloc(len);
+	if (!cpath) {
+		free(rundir);
+		return NULL;
+	}
+	ret = snprintf(cpath, len, "%s/lxc/confcache%s", rundir, path);
+	free(rundir);
+	if (ret < 0 || ret >= len)
+		goto err;
+
+	if (create) {
+		slash = strrchr(cpath, '/');
+		*slash = '\0';
+		ret = mkdir_p(cpath, 0755);
+		*slash = '/';
+		if (ret < 0)
+			goto err;
+	}
+	return cpath;
+
+err:
+	free(cpath);
+	return NULL;
+}
+
+static const char *confcache_str(char **p, const char *end)
+{
+	char *s = *p, *nul;
+
+	nul = memchr(s, '\0', end - s);
+	if (!nul)
+		return NULL;
+	*p = nul + 1;
+	return s;
+}
+
+static int confcache_parse(struct lxc_config_record *rec, size_t len)
+{
+	struct confcache_hdr hdr;
+	struct confcache_file cf;
+	const char *version;
+	char *p = rec->buf, *end = rec->buf + len;
+	size_t i;
+
+	if (len < sizeof(hdr))
+		return -1;
+	memcpy(&hdr, p, sizeof(hdr));
+	p += sizeof(hdr);
+	if (hdr.magic != LXC_CONFCACHE_MAGIC ||
+	    hdr.version != LXC_CONFCACHE_VERSION ||
+	    hdr.nfiles > len || hdr.npairs > len)
+		return -1;
+
+	/* the callbacks may have changed with the version of lxc */
+	version = confcache_str(&p, end);
+	if (!version || strcmp(version, LXC_VERSION))
+		return -1;
+
+	rec->files = malloc(hdr.nfiles * sizeof(*rec->files));
+	rec->pairs = malloc(hdr.npairs * sizeof(*rec->pairs));
+	if ((hdr.nfiles && !rec->files) || (hdr.npairs && !rec->pairs))
+		return -1;
+
+	for (i = 0; i < hdr.nfiles; i++) {
+		if (end - p < sizeof(cf))
+			return -1;
+		memcpy(&cf, p, sizeof(cf));
+		p += sizeof(cf);
+		rec->files[i].path = (char *)confcache_str(&p, end);
+		if (!rec->files[i].path)
+			return -1;
+		rec->files[i].dev = cf.dev;
+		rec->files[i].ino = cf.ino;
+		rec->files[i].size = cf.size;
+		rec->files[i].mtime_sec = cf.mtime_sec;
+		rec->files[i].mtime_nsec = cf.mtime_nsec;
+		rec->nfiles++;
+	}
+
+	for (i = 0; i < hdr.npairs; i++) {
+		rec->pairs[i].key = (char *)confcache_str(&p, end);
+		if (!rec->pairs[i].key)
+			return -1;
+		rec->pairs[i].value = (char *)confcache_str(&p, end);
+		if (!rec->pairs[i].value)
+			return -1;
+		rec->npairs++;
+	}
+
+	return p == end ? 0 : -1;
+}
+
+struct lxc_config_record *lxc_confcache_load(const char *path)
+{
+	struct lxc_config_record *rec = NULL;
+	struct stat st;
+	char *cpath;
+	ssize_t ret;
+	int fd;
+
+	cpath = confcache_path(path, false);
+	if (!cpath)
+		return NULL;
+	fd = open(cpath, O_RDONLY | O_CLOEXEC);
+	free(cpath);
+	if (fd < 0)
+		return NULL;
+
+	/* only trust what we wrote ourselves */
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+	    st.st_size > LXC_CONFCACHE_MAX)
+		goto err;
+
+	rec = lxc_config_record_new();
+	if (!rec)
+		goto err;
+	rec->buf = malloc(st.st_size + 1);
+	if (!rec->buf)
+		goto err;
+	ret = lxc_read_nointr(fd, rec->buf, st.st_size);
+	if (ret != st.st_size)
+		goto err;
+	close(fd);
+	fd = -1;
+
+	if (confcache_parse(rec, st.st_size) < 0) {
+		DEBUG("ignoring malformed config cache of %s", path);
+		goto err;
+	}
+	if (!config_record_valid(rec)) {
+		DEBUG("config cache of %s is out of date", path);
+		goto err;
+	}
+	return rec;
+
+err:
+	if (fd >= 0)
+		close(fd);
+	lxc_config_record_free(rec);
+	return NULL;
+}
+
+static int confcache_write(FILE *f, const struct lxc_config_record *rec)
+{
+	struct confcache_hdr hdr = {
+		.magic = LXC_CONFCACHE_MAGIC,
+		.version = LXC_CONFCACHE_VERSION,
+		.nfiles = rec->nfiles,
+		.npairs = rec->npairs,
+	};
+	struct confcache_file cf;
+	size_t i;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		return -1;
+	if (fwrite(LXC_VERSION, strlen(LXC_VERSION) + 1, 1, f) != 1)
+		return -1;
+
+	for (i = 0; i < rec->nfiles; i++) {
+		memset(&cf, 0, sizeof(cf));
+		cf.dev = rec->files[i].dev;
+		cf.ino = rec->files[i].ino;
+		cf.size = rec->files[i].size;
+		cf.mtime_sec = rec->files[i].mtime_sec;
+		cf.mtime_nsec = rec->files[i].mtime_nsec;
+		if (fwrite(&cf, sizeof(cf), 1, f) != 1 ||
+		    fwrite(rec->files[i].path, strlen(rec->files[i].path) + 1,
+			   1, f) != 1)
+			return -1;
+	}
+
+	for (i = 0; i < rec->npairs; i++) {
+		if (fwrite(rec->pairs[i].key, strlen(rec->pairs[i].key) + 1,
+			   1, f) != 1 ||
+		    fwrite(rec->pairs[i].value, strlen(rec->pairs[i].value) + 1,
+			   1, f) != 1)
+			return -1;
+	}
+	return 0;
+}
+
+int lxc_confcache_store(const char *path, const struct lxc_config_record *rec)
+{
+	char *cpath, tmp[MAXPATHLEN];
+	FILE *f;
+	int fd, ret;
+
+	if (rec->nocache)
+		return -1;
+
+	cpath = confcache_path(path, true);
+	if (!cpath)
+		return -1;
+
+	/*
+	 * whoever reads the cache sees the old file or the new one, and
+	 * threads storing the same config each write their own
+	 */
+	ret = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", cpath);
+	if (ret < 0 || ret >= sizeof(tmp))
+		goto err;
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0)
+		goto err;
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		goto err_unlink;
+	}
+	ret = confcache_write(f, rec);
+	if (fclose(f) || ret < 0)
+		goto err_unlink;
+	if (rename(tmp, cpath) < 0)
+		goto err_unlink;
+	free(cpath);
+	return 0;
+
+err_unlink:
+	unlink(tmp);
+err:
+	DEBUG("failed to cache the config of %s", path);
+	free(cpath);
+	return -1;
+}
@@ -0,0 +1,96 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef __LXC_CONFCACHE_H
+#define __LXC_CONFCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+struct lxc_conf;
+
+/*
+ * A file a config was read from, as it was when it was read
+ */
+struct lxc_config_file {
+	char *path;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+};
+
+struct lxc_config_pair {
+	char *key;
+	char *value;
+};
+
+/*
+ * The outcome of reading a config: the key/value pairs handed to the
+ * config callbacks, in order and with every lxc.include expanded, and
+ * the files they came from.
+ *
+ * @files   : the config and everything it included
+ * @pairs   : the pairs to replay into a lxc_conf
+ * @nocache : something makes the result unfit for reuse
+ * @buf     : if set, where all the strings point into
+ * @refcount: references held on a record shared through the memo
+ */
+struct lxc_config_record {
+	struct lxc_config_file *files;
+	size_t nfiles;
+	struct lxc_config_pair *pairs;
+	size_t npairs;
+	bool nocache;
+	char *buf;
+	int refcount;
+};
+
+extern struct lxc_config_record *lxc_config_record_new(void);
+extern void lxc_config_record_free(struct lxc_config_record *rec);
+extern int lxc_config_record_file(struct lxc_config_record *rec,
+				  const char *path);
+extern int lxc_config_record_pair(struct lxc_config_record *rec,
+				  const char *key, const char *value);
+extern int lxc_config_record_replay(const struct lxc_config_record *rec,
+				    struct lxc_conf *conf);
+extern int lxc_config_record_merge(struct lxc_config_record *dst,
+				   const struct lxc_config_record *src);
+
+/*
+ * Records of the files included by configs, shared by everyone in the
+ * process.  lxc_config_memo_get() returns a reference on the record of
+ * @path if none of its files changed since, which lxc_config_memo_put()
+ * drops.  lxc_config_memo_add() hands @rec over to the memo.
+ */
+extern struct lxc_config_record *lxc_config_memo_get(const char *path);
+extern void lxc_config_memo_put(struct lxc_config_record *rec);
+extern void lxc_config_memo_add(const char *path,
+				struct lxc_config_record *rec);
+
+/*
+ * Records of the configs read before, kept under $rundir/lxc/confcache.
+ * lxc_confcache_load() returns NULL unless the record of @path is there
+ * and none of the files it came from changed since.
+ */
+extern struct lxc_config_record *lxc_confcache_load(const char *path);
+extern int lxc_confcache_store(const char *path,
+			       const struct lxc_config_record *rec);
+
+#endif
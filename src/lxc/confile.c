@@ -29,6 +29,7 @@
 #include <fcntl.h>
 #include <ctype.h>
 #include <signal.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/param.h>
@@ -40,10 +41,12 @@
 #include "parse.h"
 #include "config.h"
 #include "confile.h"
+#include "confcache.h"
 #include "utils.h"
 #include "log.h"
 #include "conf.h"
 #include "network.h"
+#include "cpuset.h"
 #include "lxcseccomp.h"
 
 #if HAVE_SYS_PERSONALITY_H
@@ -63,10 +66,13 @@ static int config_cgroup(const char *, const char *, struct lxc_conf *);
 static int config_idmap(const char *, const char *, struct lxc_conf *);
 static int config_loglevel(const char *, const char *, struct lxc_conf *);
 static int config_logfile(const char *, const char *, struct lxc_conf *);
+static int config_logbuffer(const char *, const char *, struct lxc_conf *);
+static int config_logformat(const char *, const char *, struct lxc_conf *);
 static int config_mount(const char *, const char *, struct lxc_conf *);
 static int config_rootfs(const char *, const char *, struct lxc_conf *);
 static int config_rootfs_mount(const char *, const char *, struct lxc_conf *);
 static int config_rootfs_options(const char *, const char *, struct lxc_conf *);
+static int config_rootfs_idmapped(const char *, const char *, struct lxc_conf *);
 static int config_pivotdir(const char *, const char *, struct lxc_conf *);
 static int config_utsname(const char *, const char *, struct lxc_conf *);
 static int config_hook(const char *, const char *, struct lxc_conf *lxc_conf);
@@ -76,6 +82,7 @@ static int config_network_link(const char *, const char *, struct lxc_conf *);
 static int config_network_name(const char *, const char *, struct lxc_conf *);
 static int config_network_veth_pair(const char *, const char *, struct lxc_conf *);
 static int config_network_macvlan_mode(const char *, const char *, struct lxc_conf *);
+static int config_network_ipvlan_mode(const char *, const char *, struct lxc_conf *);
 static int config_network_hwaddr(const char *, const char *, struct lxc_conf *);
 static int config_network_vlan_id(const char *, const char *, struct lxc_conf *);
 static int config_network_mtu(const char *, const char *, struct lxc_conf *);
@@ -85,16 +92,23 @@ static int config_network_script_up(const char *, const char *, struct lxc_conf
 static int config_network_script_down(const char *, const char *, struct lxc_conf *);
 static int config_network_ipv6(const char *, const char *, struct lxc_conf *);
 static int config_network_ipv6_gateway(const char *, const char *, struct lxc_conf *);
+static int config_network_ipv6_dad(const char *, const char *, struct lxc_conf *);
 static int config_cap_drop(const char *, const char *, struct lxc_conf *);
 static int config_cap_keep(const char *, const char *, struct lxc_conf *);
 static int config_console(const char *, const char *, struct lxc_conf *);
+static int config_console_log(const char *, const char *, struct lxc_conf *);
 static int config_seccomp(const char *, const char *, struct lxc_conf *);
 static int config_includefile(const char *, const char *, struct lxc_conf *);
 static int config_network_nic(const char *, const char *, struct lxc_conf *);
 static int config_autodev(const char *, const char *, struct lxc_conf *);
+static int config_ephemeral(const char *, const char *, struct lxc_conf *);
+static int config_checkpoint(const char *, const char *, struct lxc_conf *);
 static int config_haltsignal(const char *, const char *, struct lxc_conf *);
 static int config_stopsignal(const char *, const char *, struct lxc_conf *);
+static int config_stop_cgroup_kill(const char *, const char *, struct lxc_conf *);
 static int config_start(const char *, const char *, struct lxc_conf *);
+static int config_cpuset(const char *, const char *, struct lxc_conf *);
+static int config_hugepages(const char *, const char *, struct lxc_conf *);
 static int config_group(const char *, const char *, struct lxc_conf *);
 
 static struct lxc_config_t config[] = {
@@ -107,12 +121,21 @@ static struct lxc_config_t config[] = {
 	{ "lxc.aa_profile",           config_lsm_aa_profile       },
 	{ "lxc.se_context",           config_lsm_se_context       },
 	{ "lxc.cgroup",               config_cgroup               },
+	{ "lxc.cpuset.policy",        config_cpuset               },
+	{ "lxc.cpuset.count",         config_cpuset               },
+	{ "lxc.cpuset.mempolicy",     config_cpuset               },
+	{ "lxc.hugepages.mount",      config_hugepages            },
+	{ "lxc.hugepages.size",       config_hugepages            },
+	{ "lxc.hugepages.reserve",    config_hugepages            },
 	{ "lxc.id_map",               config_idmap                },
 	{ "lxc.loglevel",             config_loglevel             },
 	{ "lxc.logfile",              config_logfile              },
+	{ "lxc.logbuffer",            config_logbuffer            },
+	{ "lxc.logformat",            config_logformat            },
 	{ "lxc.mount",                config_mount                },
 	{ "lxc.rootfs.mount",         config_rootfs_mount         },
 	{ "lxc.rootfs.options",       config_rootfs_options       },
+	{ "lxc.rootfs.idmapped",      config_rootfs_idmapped      },
 	{ "lxc.rootfs",               config_rootfs               },
 	{ "lxc.pivotdir",             config_pivotdir             },
 	{ "lxc.utsname",              config_utsname              },
@@ -128,6 +151,7 @@ static struct lxc_config_t config[] = {
 	{ "lxc.network.link",         config_network_link         },
 	{ "lxc.network.name",         config_network_name         },
 	{ "lxc.network.macvlan.mode", config_network_macvlan_mode },
+	{ "lxc.network.ipvlan.mode",  config_network_ipvlan_mode  },
 	{ "lxc.network.veth.pair",    config_network_veth_pair    },
 	{ "lxc.network.script.up",    config_network_script_up    },
 	{ "lxc.network.script.down",  config_network_script_down  },
@@ -137,20 +161,32 @@ static struct lxc_config_t config[] = {
 	{ "lxc.network.ipv4.gateway", config_network_ipv4_gateway },
 	{ "lxc.network.ipv4",         config_network_ipv4         },
 	{ "lxc.network.ipv6.gateway", config_network_ipv6_gateway },
+	{ "lxc.network.ipv6.dad",     config_network_ipv6_dad     },
 	{ "lxc.network.ipv6",         config_network_ipv6         },
 	/* config_network_nic must come after all other 'lxc.network.*' entries */
 	{ "lxc.network.",             config_network_nic          },
 	{ "lxc.cap.drop",             config_cap_drop             },
 	{ "lxc.cap.keep",             config_cap_keep             },
+	{ "lxc.console.buffer.size",  config_console_log          },
+	{ "lxc.console.buffer.file",  config_console_log          },
+	{ "lxc.console.logfile",      config_console_log          },
+	{ "lxc.console.size",         config_console_log          },
+	{ "lxc.console.rate",         config_console_log          },
 	{ "lxc.console",              config_console              },
 	{ "lxc.seccomp",              config_seccomp              },
 	{ "lxc.include",              config_includefile          },
 	{ "lxc.autodev",              config_autodev              },
+	{ "lxc.ephemeral",            config_ephemeral            },
+	{ "lxc.checkpoint.predump",   config_checkpoint           },
+	{ "lxc.checkpoint.page_server", config_checkpoint         },
 	{ "lxc.haltsignal",           config_haltsignal           },
 	{ "lxc.stopsignal",           config_stopsignal           },
+	{ "lxc.stop.cgroup_kill",     config_stop_cgroup_kill     },
 	{ "lxc.start.auto",           config_start                },
 	{ "lxc.start.delay",          config_start                },
 	{ "lxc.start.order",          config_start                },
+	{ "lxc.start.notify",         config_start                },
+	{ "lxc.start.supervised",     config_start                },
 	{ "lxc.group",                config_group                },
 };
 
@@ -183,15 +219,97 @@ static const struct signame signames[] = {
 
 static const size_t config_size = sizeof(config)/sizeof(struct lxc_config_t);
 
-extern struct lxc_config_t *lxc_getconfig(const char *key)
+/*
+ * A key belongs to the first entry of config[] its name starts with, the
+ * order of the table puts longer names before the names they extend, so
+ * that is the longest matching name.  Rather than comparing the key with
+ * every entry it is walked once through a trie of the names.
+ *
+ * @c       : the character of this node
+ * @child   : first node of the next character, -1 if none
+ * @sibling : next node for the same position, -1 if none
+ * @entry   : index of the config[] entry ending here, -1 if none
+ */
+struct config_trie_node {
+	char c;
+	short child;
+	short sibling;
+	short entry;
+};
+
+#define CONFIG_TRIE_NODES 1024
+
+static struct config_trie_node config_trie[CONFIG_TRIE_NODES];
+static int config_trie_size;
+static pthread_once_t config_trie_once = PTHREAD_ONCE_INIT;
+
+static int config_trie_add(int i)
+{
+	const char *p;
+	int n = 0, next;
+
+	for (p = config[i].name; *p; p++) {
+		for (next = config_trie[n].child; next >= 0;
+		     next = config_trie[next].sibling)
+			if (config_trie[next].c == *p)
+				break;
+		if (next < 0) {
+			if (config_trie_size == CONFIG_TRIE_NODES)
+				return -1;
+			next = config_trie_size++;
+			config_trie[next].c = *p;
+			config_trie[next].child = -1;
+			config_trie[next].entry = -1;
+			config_trie[next].sibling = config_trie[n].child;
+			config_trie[n].child = next;
+		}
+		n = next;
+	}
+	if (config_trie[n].entry < 0)
+		config_trie[n].entry = i;
+	return 0;
+}
+
+static void config_trie_build(void)
 {
 	int i;
 
-	for (i = 0; i < config_size; i++)
-		if (!strncmp(config[i].name, key,
-			     strlen(config[i].name)))
-			return &config[i];
-	return NULL;
+	config_trie[0].child = config_trie[0].sibling = -1;
+	config_trie[0].entry = -1;
+	config_trie_size = 1;
+	for (i = 0; i < config_size; i++) {
+		if (config_trie_add(i) < 0) {
+			/* lxc_getconfig() falls back to scanning the table */
+			config_trie_size = 0;
+			return;
+		}
+	}
+}
+
+extern struct lxc_config_t *lxc_getconfig(const char *key)
+{
+	int i, n = 0, match = -1;
+	const char *p;
+
+	pthread_once(&config_trie_once, config_trie_build);
+	if (!config_trie_size) {
+		for (i = 0; i < config_size; i++)
+			if (!strncmp(config[i].name, key,
+				     strlen(config[i].name)))
+				return &config[i];
+		return NULL;
+	}
+
+	for (p = key; *p; p++) {
+		for (n = config_trie[n].child; n >= 0; n = config_trie[n].sibling)
+			if (config_trie[n].c == *p)
+				break;
+		if (n < 0)
+			break;
+		if (config_trie[n].entry >= 0)
+			match = config_trie[n].entry;
+	}
+	return match < 0 ? NULL : &config[match];
 }
 
 #define strprint(str, inlen, ...) \
@@ -304,6 +422,7 @@ out:
 }
 
 static int macvlan_mode(int *valuep, const char *value);
+static int ipvlan_mode(int *valuep, const char *value);
 
 static int config_network_type(const char *key, const char *value,
 			       struct lxc_conf *lxc_conf)
@@ -343,6 +462,10 @@ static int config_network_type(const char *key, const char *value,
 		netdev->type = LXC_NET_MACVLAN;
 		macvlan_mode(&netdev->priv.macvlan_attr.mode, "private");
 	}
+	else if (!strcmp(value, "ipvlan")) {
+		netdev->type = LXC_NET_IPVLAN;
+		ipvlan_mode(&netdev->priv.ipvlan_attr.mode, "l3");
+	}
 	else if (!strcmp(value, "vlan"))
 		netdev->type = LXC_NET_VLAN;
 	else if (!strcmp(value, "phys"))
@@ -432,6 +555,7 @@ extern int lxc_list_nicconfigs(struct lxc_conf *c, const char *key,
 		strprint(retv, inlen, "mtu\n");
 		strprint(retv, inlen, "ipv6\n");
 		strprint(retv, inlen, "ipv6_gateway\n");
+		strprint(retv, inlen, "ipv6_dad\n");
 		strprint(retv, inlen, "ipv4\n");
 		strprint(retv, inlen, "ipv4_gateway\n");
 	}
@@ -442,6 +566,9 @@ extern int lxc_list_nicconfigs(struct lxc_conf *c, const char *key,
 	case LXC_NET_MACVLAN:
 		strprint(retv, inlen, "macvlan.mode\n");
 		break;
+	case LXC_NET_IPVLAN:
+		strprint(retv, inlen, "ipvlan.mode\n");
+		break;
 	case LXC_NET_VLAN:
 		strprint(retv, inlen, "vlan.id\n");
 		break;
@@ -493,6 +620,16 @@ static int network_ifname(char **valuep, const char *value)
 #  define MACVLAN_MODE_BRIDGE 4
 #endif
 
+#ifndef MACVLAN_MODE_PASSTHRU
+#  define MACVLAN_MODE_PASSTHRU 8
+#endif
+
+#ifndef IPVLAN_MODE_L2
+#  define IPVLAN_MODE_L2 0
+#  define IPVLAN_MODE_L3 1
+#  define IPVLAN_MODE_L3S 2
+#endif
+
 static int macvlan_mode(int *valuep, const char *value)
 {
 	struct mc_mode {
@@ -502,6 +639,7 @@ static int macvlan_mode(int *valuep, const char *value)
 		{ "private", MACVLAN_MODE_PRIVATE },
 		{ "vepa", MACVLAN_MODE_VEPA },
 		{ "bridge", MACVLAN_MODE_BRIDGE },
+		{ "passthru", MACVLAN_MODE_PASSTHRU },
 	};
 
 	int i;
@@ -517,6 +655,64 @@ static int macvlan_mode(int *valuep, const char *value)
 	return -1;
 }
 
+static int ipvlan_mode(int *valuep, const char *value)
+{
+	struct ipvl_mode {
+		char *name;
+		int mode;
+	} m[] = {
+		{ "l2", IPVLAN_MODE_L2 },
+		{ "l3", IPVLAN_MODE_L3 },
+		{ "l3s", IPVLAN_MODE_L3S },
+	};
+
+	int i;
+
+	for (i = 0; i < sizeof(m)/sizeof(m[0]); i++) {
+		if (strcmp(m[i].name, value))
+			continue;
+
+		*valuep = m[i].mode;
+		return 0;
+	}
+
+	return -1;
+}
+
+static const struct ipv6_dad_mode {
+	char *name;
+	int mode;
+} ipv6_dad_modes[] = {
+	{ "on", LXC_NET_DAD_ON },
+	{ "off", LXC_NET_DAD_OFF },
+	{ "optimistic", LXC_NET_DAD_OPTIMISTIC },
+};
+
+static int ipv6_dad_mode(int *valuep, const char *value)
+{
+	int i;
+
+	for (i = 0; i < sizeof(ipv6_dad_modes)/sizeof(ipv6_dad_modes[0]); i++) {
+		if (strcmp(ipv6_dad_modes[i].name, value))
+			continue;
+
+		*valuep = ipv6_dad_modes[i].mode;
+		return 0;
+	}
+
+	return -1;
+}
+
+static const char *ipv6_dad_name(int mode)
+{
+	int i;
+
+	for (i = 0; i < sizeof(ipv6_dad_modes)/sizeof(ipv6_dad_modes[0]); i++)
+		if (ipv6_dad_modes[i].mode == mode)
+			return ipv6_dad_modes[i].name;
+	return NULL;
+}
+
 static int rand_complete_hwaddr(char *hwaddr)
 {
 	const char hex[] = "0123456789abcdef";
@@ -610,6 +806,18 @@ static int config_network_macvlan_mode(const char *key, const char *value,
 	return macvlan_mode(&netdev->priv.macvlan_attr.mode, value);
 }
 
+static int config_network_ipvlan_mode(const char *key, const char *value,
+				      struct lxc_conf *lxc_conf)
+{
+	struct lxc_netdev *netdev;
+
+	netdev = network_netdev(key, value, &lxc_conf->network);
+	if (!netdev)
+		return -1;
+
+	return ipvlan_mode(&netdev->priv.ipvlan_attr.mode, value);
+}
+
 static int config_network_hwaddr(const char *key, const char *value,
 				 struct lxc_conf *lxc_conf)
 {
@@ -888,6 +1096,28 @@ static int config_network_ipv6_gateway(const char *key, const char *value,
 	return 0;
 }
 
+static int config_network_ipv6_dad(const char *key, const char *value,
+				   struct lxc_conf *lxc_conf)
+{
+	struct lxc_netdev *netdev;
+
+	netdev = network_netdev(key, value, &lxc_conf->network);
+	if (!netdev)
+		return -1;
+
+	if (!value || !*value) {
+		netdev->ipv6_dad = LXC_NET_DAD_ON;
+		return 0;
+	}
+
+	if (ipv6_dad_mode(&netdev->ipv6_dad, value)) {
+		ERROR("invalid ipv6 dad mode '%s'", value);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int config_network_script_up(const char *key, const char *value,
 				    struct lxc_conf *lxc_conf)
 {
@@ -1002,6 +1232,116 @@ static int config_start(const char *key, const char *value,
 		lxc_conf->start_order = atoi(value);
 		return 0;
 	}
+	else if (strcmp(key, "lxc.start.notify") == 0) {
+		if (value && *value && *value != '/') {
+			ERROR("lxc.start.notify must be an absolute path");
+			return -1;
+		}
+		return config_path_item(&lxc_conf->start_notify, value);
+	}
+	else if (strcmp(key, "lxc.start.supervised") == 0) {
+		lxc_conf->start_supervised = value ? atoi(value) : 0;
+		return 0;
+	}
+	SYSERROR("Unknown key: %s", key);
+	return -1;
+}
+
+static int config_cpuset(const char *key, const char *value,
+			 struct lxc_conf *lxc_conf)
+{
+	int v;
+
+	if (strcmp(key, "lxc.cpuset.policy") == 0) {
+		if (!value || !*value) {
+			lxc_conf->cpuset_policy = LXC_CPUSET_NONE;
+			return 0;
+		}
+		v = lxc_cpuset_policy_parse(value);
+		if (v < 0) {
+			ERROR("lxc.cpuset.policy must be none, spread, pack or numa-local");
+			return -1;
+		}
+		lxc_conf->cpuset_policy = v;
+		return 0;
+	}
+	else if (strcmp(key, "lxc.cpuset.count") == 0) {
+		v = value ? atoi(value) : 0;
+		if (v < 0) {
+			ERROR("lxc.cpuset.count must not be negative");
+			return -1;
+		}
+		lxc_conf->cpuset_count = v;
+		return 0;
+	}
+	else if (strcmp(key, "lxc.cpuset.mempolicy") == 0) {
+		unsigned long nodemask[LXC_MEMPOLICY_MASK_LONGS];
+
+		if (value && *value && lxc_mempolicy_parse(value, nodemask) < 0) {
+			ERROR("invalid lxc.cpuset.mempolicy '%s'", value);
+			return -1;
+		}
+		return config_string_item(&lxc_conf->cpuset_mempolicy, value);
+	}
+	SYSERROR("Unknown key: %s", key);
+	return -1;
+}
+
+/* "2M", "1G" or "2048K", in kB */
+static int parse_hugepage_size(const char *value, unsigned long *size)
+{
+	unsigned long v;
+	char *end;
+
+	errno = 0;
+	v = strtoul(value, &end, 10);
+	if (errno || end == value)
+		return -1;
+	switch (*end) {
+	case 'G': case 'g': v *= 1024; /* fall through */
+	case 'M': case 'm': v *= 1024; /* fall through */
+	case 'K': case 'k': end++; break;
+	default: return -1;
+	}
+	if (*end == 'B' || *end == 'b')
+		end++;
+	if (*end)
+		return -1;
+	*size = v;
+	return 0;
+}
+
+static int config_hugepages(const char *key, const char *value,
+			    struct lxc_conf *lxc_conf)
+{
+	char *end;
+
+	if (strcmp(key, "lxc.hugepages.mount") == 0)
+		return config_string_item(&lxc_conf->hugepages_mount, value);
+	else if (strcmp(key, "lxc.hugepages.size") == 0) {
+		if (!value || !*value) {
+			lxc_conf->hugepages_size = 0;
+			return 0;
+		}
+		if (parse_hugepage_size(value, &lxc_conf->hugepages_size) < 0) {
+			ERROR("invalid lxc.hugepages.size '%s'", value);
+			return -1;
+		}
+		return 0;
+	}
+	else if (strcmp(key, "lxc.hugepages.reserve") == 0) {
+		if (!value || !*value) {
+			lxc_conf->hugepages_reserve = 0;
+			return 0;
+		}
+		errno = 0;
+		lxc_conf->hugepages_reserve = strtoul(value, &end, 10);
+		if (errno || *end || *value == '-') {
+			ERROR("invalid lxc.hugepages.reserve '%s'", value);
+			return -1;
+		}
+		return 0;
+	}
 	SYSERROR("Unknown key: %s", key);
 	return -1;
 }
@@ -1103,6 +1443,33 @@ static int config_logfile(const char *key, const char *value,
 	return ret;
 }
 
+static int config_loglevel_category(const char *category, int level,
+				    struct lxc_conf *lxc_conf)
+{
+	struct lxc_list *list;
+	char *entry;
+	int ret;
+
+	ret = lxc_log_set_category_level(category, level);
+	if (ret < 0)
+		return -1;
+	if (!ret)
+		WARN("no log category '%s'", category);
+
+	list = malloc(sizeof(*list));
+	if (!list)
+		return -1;
+	entry = malloc(strlen(category) + 16);
+	if (!entry) {
+		free(list);
+		return -1;
+	}
+	sprintf(entry, "%s = %s", category, lxc_log_priority_to_string(level));
+	list->elem = entry;
+	lxc_list_add_tail(&lxc_conf->loglevels, list);
+	return 0;
+}
+
 static int config_loglevel(const char *key, const char *value,
 			     struct lxc_conf *lxc_conf)
 {
@@ -1115,12 +1482,38 @@ static int config_loglevel(const char *key, const char *value,
 		newlevel = atoi(value);
 	else
 		newlevel = lxc_log_priority_to_int(value);
+
+	/* lxc.loglevel.<category> only sets the level of that category */
+	if (key[strlen("lxc.loglevel")] == '.')
+		return config_loglevel_category(key + strlen("lxc.loglevel."),
+						newlevel, lxc_conf);
+
 	// store these values in the lxc_conf, and then try to set for
 	// actual current logging.
 	lxc_conf->loglevel = newlevel;
 	return lxc_log_set_level(newlevel);
 }
 
+static int config_logbuffer(const char *key, const char *value,
+			    struct lxc_conf *lxc_conf)
+{
+	int v = atoi(value);
+
+	lxc_conf->logbuffer = v ? 1 : 0;
+	return lxc_log_set_buffered(lxc_conf->logbuffer);
+}
+
+static int config_logformat(const char *key, const char *value,
+			    struct lxc_conf *lxc_conf)
+{
+	if (!value || strlen(value) == 0)
+		value = "text";
+	if (lxc_log_set_format(value))
+		return -1;
+	lxc_conf->logbinary = strcmp(value, "binary") == 0;
+	return 0;
+}
+
 static int config_autodev(const char *key, const char *value,
 			  struct lxc_conf *lxc_conf)
 {
@@ -1131,6 +1524,42 @@ static int config_autodev(const char *key, const char *value,
 	return 0;
 }
 
+static int config_ephemeral(const char *key, const char *value,
+			    struct lxc_conf *lxc_conf)
+{
+	lxc_conf->ephemeral = value ? atoi(value) : 0;
+	return 0;
+}
+
+static int config_checkpoint(const char *key, const char *value,
+			     struct lxc_conf *lxc_conf)
+{
+	char *end;
+
+	if (strcmp(key, "lxc.checkpoint.predump") == 0) {
+		if (!value || !*value) {
+			lxc_conf->checkpoint_predump = 0;
+			return 0;
+		}
+		errno = 0;
+		lxc_conf->checkpoint_predump = strtol(value, &end, 10);
+		if (errno || *end || lxc_conf->checkpoint_predump < 0) {
+			ERROR("invalid lxc.checkpoint.predump '%s'", value);
+			return -1;
+		}
+		return 0;
+	}
+	else if (strcmp(key, "lxc.checkpoint.page_server") == 0) {
+		if (value && *value && !strrchr(value, ':')) {
+			ERROR("lxc.checkpoint.page_server must be address:port");
+			return -1;
+		}
+		return config_string_item(&lxc_conf->checkpoint_page_server, value);
+	}
+	SYSERROR("Unknown key: %s", key);
+	return -1;
+}
+
 static int sig_num(const char *sig)
 {
 	int n;
@@ -1212,6 +1641,13 @@ static int config_stopsignal(const char *key, const char *value,
 	return 0;
 }
 
+static int config_stop_cgroup_kill(const char *key, const char *value,
+				   struct lxc_conf *lxc_conf)
+{
+	lxc_conf->stop_cgroup_kill = value ? atoi(value) : 0;
+	return 0;
+}
+
 static int config_cgroup(const char *key, const char *value,
 			 struct lxc_conf *lxc_conf)
 {
@@ -1555,6 +1991,65 @@ static int config_console(const char *key, const char *value,
 	return config_path_item(&lxc_conf->console.path, value);
 }
 
+/* a byte count, optionally suffixed with K, M or G */
+static int parse_byte_size(const char *value, uint64_t *size)
+{
+	unsigned long long v;
+	char *end;
+
+	errno = 0;
+	v = strtoull(value, &end, 10);
+	if (errno || end == value)
+		return -1;
+
+	switch (*end) {
+	case 'G': case 'g':
+		v <<= 10;
+	case 'M': case 'm':
+		v <<= 10;
+	case 'K': case 'k':
+		v <<= 10;
+		end++;
+	}
+	if (*end && !isspace(*end))
+		return -1;
+
+	*size = v;
+	return 0;
+}
+
+static int config_console_log(const char *key, const char *value,
+			      struct lxc_conf *lxc_conf)
+{
+	struct lxc_console *console = &lxc_conf->console;
+	uint64_t *size;
+
+	if (strcmp(key, "lxc.console.buffer.file") == 0)
+		return config_path_item(&console->buffer_path, value);
+	else if (strcmp(key, "lxc.console.logfile") == 0)
+		return config_path_item(&console->log_path, value);
+	else if (strcmp(key, "lxc.console.buffer.size") == 0)
+		size = &console->buffer_size;
+	else if (strcmp(key, "lxc.console.size") == 0)
+		size = &console->log_size;
+	else if (strcmp(key, "lxc.console.rate") == 0)
+		size = &console->log_rate;
+	else {
+		SYSERROR("Unknown key: %s", key);
+		return -1;
+	}
+
+	if (!value || !*value) {
+		*size = 0;
+		return 0;
+	}
+	if (parse_byte_size(value, size) < 0) {
+		ERROR("invalid size '%s' for %s", value, key);
+		return -1;
+	}
+	return 0;
+}
+
 static int add_include_file(const char *fname, struct lxc_conf *lxc_conf)
 {
 	struct lxc_list *list;
@@ -1577,12 +2072,15 @@ static int add_include_file(const char *fname, struct lxc_conf *lxc_conf)
 	return 0;
 }
 
+static int config_read(const char *file, struct lxc_conf *conf,
+		       struct lxc_conf *unexp_conf, bool include);
+
 static int config_includefile(const char *key, const char *value,
 			  struct lxc_conf *lxc_conf)
 {
 	if (lxc_conf->unexpanded)
 		return add_include_file(value, lxc_conf);
-	return lxc_config_read(value, lxc_conf, NULL);
+	return config_read(value, lxc_conf, NULL, true);
 }
 
 static int config_rootfs(const char *key, const char *value,
@@ -1603,6 +2101,16 @@ static int config_rootfs_options(const char *key, const char *value,
 	return config_string_item(&lxc_conf->rootfs.options, value);
 }
 
+static int config_rootfs_idmapped(const char *key, const char *value,
+				  struct lxc_conf *lxc_conf)
+{
+	int v = atoi(value);
+
+	lxc_conf->rootfs.idmapped = v;
+
+	return 0;
+}
+
 static int config_pivotdir(const char *key, const char *value,
 			   struct lxc_conf *lxc_conf)
 {
@@ -1660,46 +2168,34 @@ static int store_martian_option(char *line, void *data)
 	return 0;
 }
 
+/* parses buffer in place, the caller must not need it afterwards */
 static int parse_line(char *buffer, void *data)
 {
+	struct lxc_conf *conf = data;
 	struct lxc_config_t *config;
-	char *line, *linep;
+	char *line = buffer;
+	int ret;
 	char *dot;
 	char *key;
 	char *value;
-	int ret = 0;
 
 	if (lxc_is_line_empty(buffer))
 		return 0;
 
-	/* we have to dup the buffer otherwise, at the re-exec for
-	 * reboot we modified the original string on the stack by
-	 * replacing '=' by '\0' below
-	 */
-	linep = line = strdup(buffer);
-	if (!line) {
-		SYSERROR("failed to allocate memory for '%s'", buffer);
-		return -1;
-	}
-
 	line += lxc_char_left_gc(line, strlen(line));
 
 	/* ignore comments */
 	if (line[0] == '#')
-		goto out;
+		return 0;
 
 	/* martian option - save it in the unexpanded config only */
-	if (strncmp(line, "lxc.", 4)) {
-		ret = store_martian_option(line, data);
-		goto out;
-	}
-
-	ret = -1;
+	if (strncmp(line, "lxc.", 4))
+		return store_martian_option(line, data);
 
-	dot = strstr(line, "=");
+	dot = strchr(line, '=');
 	if (!dot) {
 		ERROR("invalid configuration line: %s", line);
-		goto out;
+		return -1;
 	}
 
 	*dot = '\0';
@@ -1714,22 +2210,115 @@ static int parse_line(char *buffer, void *data)
 	config = lxc_getconfig(key);
 	if (!config) {
 		ERROR("unknown key %s", key);
-		goto out;
+		return -1;
 	}
 
 	ret = config->cb(key, value, data);
-
-out:
-	free(linep);
+	if (!ret && conf->record && config->cb != config_includefile)
+		lxc_config_record_pair(conf->record, key, value);
 	return ret;
 }
 
 static int lxc_config_readline(char *buffer, struct lxc_conf *conf)
 {
-	return parse_line(buffer, conf);
+	char *line;
+	int ret;
+
+	/* we have to dup the buffer otherwise, at the re-exec for
+	 * reboot we modified the original string on the stack by
+	 * replacing '=' by '\0' in parse_line()
+	 */
+	line = strdup(buffer);
+	if (!line) {
+		SYSERROR("failed to allocate memory for '%s'", buffer);
+		return -1;
+	}
+	ret = parse_line(line, conf);
+	free(line);
+	return ret;
 }
 
-int lxc_config_read(const char *file, struct lxc_conf *conf, struct lxc_conf *unexp_conf)
+/*
+ * Included files are mostly the same few common configs, each is parsed
+ * once per process and replayed from the memo into every other config
+ * including it.  What an include replays also goes into the record of
+ * the config including it.
+ */
+static int config_read_include(const char *file, struct lxc_conf *conf)
+{
+	struct lxc_config_record *rec, *parent = conf->record;
+	int ret;
+
+	rec = lxc_config_memo_get(file);
+	if (rec) {
+		ret = lxc_config_record_replay(rec, conf);
+		if (!ret && parent)
+			lxc_config_record_merge(parent, rec);
+		lxc_config_memo_put(rec);
+		return ret;
+	}
+
+	rec = lxc_config_record_new();
+	if (!rec) {
+		if (parent)
+			parent->nocache = true;
+		conf->record = NULL;
+		ret = lxc_file_for_each_line_mmap(file, parse_line, conf);
+		conf->record = parent;
+		return ret;
+	}
+	lxc_config_record_file(rec, file);
+	conf->record = rec;
+	ret = lxc_file_for_each_line_mmap(file, parse_line, conf);
+	conf->record = parent;
+	if (ret) {
+		lxc_config_record_free(rec);
+		return ret;
+	}
+	if (parent)
+		lxc_config_record_merge(parent, rec);
+	lxc_config_memo_add(file, rec);
+	return 0;
+}
+
+/*
+ * Read the expanded config from file, or replay what an earlier read of
+ * it recorded if none of the files involved changed since.
+ */
+static int config_read_expanded(const char *file, struct lxc_conf *conf,
+				bool include)
+{
+	struct lxc_config_record *rec;
+	int ret;
+
+	if (include)
+		return config_read_include(file, conf);
+
+	if (conf->unexpanded || conf->record || file[0] != '/')
+		return lxc_file_for_each_line_mmap(file, parse_line, conf);
+
+	rec = lxc_confcache_load(file);
+	if (rec) {
+		ret = lxc_config_record_replay(rec, conf);
+		lxc_config_record_free(rec);
+		return ret;
+	}
+
+	rec = lxc_config_record_new();
+	if (!rec)
+		return lxc_file_for_each_line_mmap(file, parse_line, conf);
+	lxc_config_record_file(rec, file);
+	conf->record = rec;
+	ret = lxc_file_for_each_line_mmap(file, parse_line, conf);
+	conf->record = NULL;
+	if (!ret)
+		lxc_confcache_store(file, rec);
+	lxc_config_record_free(rec);
+	return ret;
+}
+
+static int config_read(const char *file, struct lxc_conf *conf,
+		       struct lxc_conf *unexp_conf, bool include)
 {
 	int ret;
 
@@ -1740,16 +2329,26 @@ int lxc_config_read(const char *file, struct lxc_conf *conf, struct lxc_conf *un
 	if( ! conf->rcfile ) {
 		conf->rcfile = strdup( file );
 	}
-	ret = lxc_file_for_each_line(file, parse_line, conf);
+	ret = config_read_expanded(file, conf, include);
 	if (ret)
 		return ret;
 	if (!unexp_conf)
 		return 0;
-	if (!unexp_conf->rcfile) {
-		unexp_conf->rcfile = strdup( file );
-	}
+	return lxc_config_read_unexpanded(file, unexp_conf);
+}
 
-	return lxc_file_for_each_line(file, parse_line, unexp_conf);
+int lxc_config_read_unexpanded(const char *file, struct lxc_conf *unexp_conf)
+{
+	if (access(file, R_OK) == -1)
+		return -1;
+	if (!unexp_conf->rcfile)
+		unexp_conf->rcfile = strdup(file);
+	return lxc_file_for_each_line_mmap(file, parse_line, unexp_conf);
+}
+
+int lxc_config_read(const char *file, struct lxc_conf *conf, struct lxc_conf *unexp_conf)
+{
+	return config_read(file, conf, unexp_conf, false);
 }
 
 int lxc_config_define_add(struct lxc_list *defines, char* arg)
@@ -1861,6 +2460,16 @@ static int lxc_get_conf_int(struct lxc_conf *c, char *retv, int inlen, int v)
 	return snprintf(retv, inlen, "%d", v);
 }
 
+static int lxc_get_conf_uint64(struct lxc_conf *c, char *retv, int inlen,
+			       uint64_t v)
+{
+	if (!retv)
+		inlen = 0;
+	else
+		memset(retv, 0, inlen);
+	return snprintf(retv, inlen, "%llu", (unsigned long long)v);
+}
+
 static int lxc_get_arch_entry(struct lxc_conf *c, char *retv, int inlen)
 {
 	int fulllen = 0;
@@ -2058,7 +2667,7 @@ static int lxc_get_auto_mounts(struct lxc_conf *c, char *retv, int inlen)
 
 /*
  * lxc.network.0.XXX, where XXX can be: name, type, link, flags, type,
- * macvlan.mode, veth.pair, vlan, ipv4, ipv6, script.up, hwaddr, mtu,
+ * macvlan.mode, ipvlan.mode, veth.pair, vlan, ipv4, ipv6, script.up, hwaddr, mtu,
  * ipv4_gateway, ipv6_gateway.  ipvX_gateway can return 'auto' instead
  * of an address.  ipv4 and ipv6 return lists (newline-separated).
  * things like veth.pair return '' if invalid (i.e. if called for vlan
@@ -2113,6 +2722,18 @@ static int lxc_get_item_nic(struct lxc_conf *c, char *retv, int inlen,
 			case MACVLAN_MODE_PRIVATE: mode = "private"; break;
 			case MACVLAN_MODE_VEPA: mode = "vepa"; break;
 			case MACVLAN_MODE_BRIDGE: mode = "bridge"; break;
+			case MACVLAN_MODE_PASSTHRU: mode = "passthru"; break;
+			default: mode = "(invalid)"; break;
+			}
+			strprint(retv, inlen, "%s", mode);
+		}
+	} else if (strcmp(p1, "ipvlan.mode") == 0) {
+		if (netdev->type == LXC_NET_IPVLAN) {
+			const char *mode;
+			switch (netdev->priv.ipvlan_attr.mode) {
+			case IPVLAN_MODE_L2: mode = "l2"; break;
+			case IPVLAN_MODE_L3: mode = "l3"; break;
+			case IPVLAN_MODE_L3S: mode = "l3s"; break;
 			default: mode = "(invalid)"; break;
 			}
 			strprint(retv, inlen, "%s", mode);
@@ -2152,6 +2773,8 @@ static int lxc_get_item_nic(struct lxc_conf *c, char *retv, int inlen,
 			inet_ntop(AF_INET, netdev->ipv6_gateway, buf, sizeof(buf));
 			strprint(retv, inlen, "%s", buf);
 		}
+	} else if (strcmp(p1, "ipv6_dad") == 0) {
+		strprint(retv, inlen, "%s", ipv6_dad_name(netdev->ipv6_dad));
 	} else if (strcmp(p1, "ipv6") == 0) {
 		struct lxc_list *it2;
 		lxc_list_for_each(it2, &netdev->ipv6) {
@@ -2209,18 +2832,51 @@ int lxc_get_config_item(struct lxc_conf *c, const char *key, char *retv,
 		v = lxc_log_get_file();
 	else if (strcmp(key, "lxc.loglevel") == 0)
 		v = lxc_log_priority_to_string(lxc_log_get_level());
+	else if (strcmp(key, "lxc.logbuffer") == 0)
+		return lxc_get_conf_int(c, retv, inlen, c->logbuffer);
+	else if (strcmp(key, "lxc.logformat") == 0)
+		v = lxc_log_get_format();
 	else if (strcmp(key, "lxc.cgroup") == 0) // all cgroup info
 		return lxc_get_cgroup_entry(c, retv, inlen, "all");
 	else if (strncmp(key, "lxc.cgroup.", 11) == 0) // specific cgroup info
 		return lxc_get_cgroup_entry(c, retv, inlen, key + 11);
+	else if (strcmp(key, "lxc.cpuset.policy") == 0)
+		v = c->cpuset_policy ? lxc_cpuset_policy_name(c->cpuset_policy) : NULL;
+	else if (strcmp(key, "lxc.cpuset.count") == 0)
+		return lxc_get_conf_int(c, retv, inlen, c->cpuset_count);
+	else if (strcmp(key, "lxc.cpuset.mempolicy") == 0)
+		v = c->cpuset_mempolicy;
+	else if (strcmp(key, "lxc.hugepages.mount") == 0)
+		v = c->hugepages_mount;
+	else if (strcmp(key, "lxc.hugepages.size") == 0) {
+		if (!retv)
+			inlen = 0;
+		else
+			memset(retv, 0, inlen);
+		return snprintf(retv, inlen, "%luK", c->hugepages_size);
+	}
+	else if (strcmp(key, "lxc.hugepages.reserve") == 0)
+		return lxc_get_conf_uint64(c, retv, inlen, c->hugepages_reserve);
 	else if (strcmp(key, "lxc.utsname") == 0)
 		v = c->utsname ? c->utsname->nodename : NULL;
 	else if (strcmp(key, "lxc.console") == 0)
 		v = c->console.path;
+	else if (strcmp(key, "lxc.console.logfile") == 0)
+		v = c->console.log_path;
+	else if (strcmp(key, "lxc.console.buffer.file") == 0)
+		v = c->console.buffer_path;
+	else if (strcmp(key, "lxc.console.buffer.size") == 0)
+		return lxc_get_conf_uint64(c, retv, inlen, c->console.buffer_size);
+	else if (strcmp(key, "lxc.console.size") == 0)
+		return lxc_get_conf_uint64(c, retv, inlen, c->console.log_size);
+	else if (strcmp(key, "lxc.console.rate") == 0)
+		return lxc_get_conf_uint64(c, retv, inlen, c->console.log_rate);
 	else if (strcmp(key, "lxc.rootfs.mount") == 0)
 		v = c->rootfs.mount;
 	else if (strcmp(key, "lxc.rootfs.options") == 0)
 		v = c->rootfs.options;
+	else if (strcmp(key, "lxc.rootfs.idmapped") == 0)
+		return lxc_get_conf_int(c, retv, inlen, c->rootfs.idmapped);
 	else if (strcmp(key, "lxc.rootfs") == 0)
 		v = c->rootfs.path;
 	else if (strcmp(key, "lxc.pivotdir") == 0)
@@ -2241,6 +2897,18 @@ int lxc_get_config_item(struct lxc_conf *c, const char *key, char *retv,
 		return lxc_get_conf_int(c, retv, inlen, c->start_delay);
 	else if (strcmp(key, "lxc.start.order") == 0)
 		return lxc_get_conf_int(c, retv, inlen, c->start_order);
+	else if (strcmp(key, "lxc.start.notify") == 0)
+		v = c->start_notify;
+	else if (strcmp(key, "lxc.start.supervised") == 0)
+		return lxc_get_conf_int(c, retv, inlen, c->start_supervised);
+	else if (strcmp(key, "lxc.ephemeral") == 0)
+		return lxc_get_conf_int(c, retv, inlen, c->ephemeral);
+	else if (strcmp(key, "lxc.stop.cgroup_kill") == 0)
+		return lxc_get_conf_int(c, retv, inlen, c->stop_cgroup_kill);
+	else if (strcmp(key, "lxc.checkpoint.predump") == 0)
+		return lxc_get_conf_int(c, retv, inlen, c->checkpoint_predump);
+	else if (strcmp(key, "lxc.checkpoint.page_server") == 0)
+		v = c->checkpoint_page_server;
 	else if (strcmp(key, "lxc.group") == 0)
 		return lxc_get_item_groups(c, retv, inlen);
 	else if (strcmp(key, "lxc.seccomp") == 0)
@@ -2266,6 +2934,43 @@ int lxc_clear_config_item(struct lxc_conf *c, const char *key)
 		return lxc_clear_config_keepcaps(c);
 	else if (strncmp(key, "lxc.cgroup", 10) == 0)
 		return lxc_clear_cgroups(c, key);
+	else if (strncmp(key, "lxc.cpuset", 10) == 0) {
+		bool all = strcmp(key, "lxc.cpuset") == 0;
+
+		if (all || strcmp(key, "lxc.cpuset.policy") == 0)
+			c->cpuset_policy = LXC_CPUSET_NONE;
+		if (all || strcmp(key, "lxc.cpuset.count") == 0)
+			c->cpuset_count = 0;
+		if (all || strcmp(key, "lxc.cpuset.mempolicy") == 0) {
+			free(c->cpuset_mempolicy);
+			c->cpuset_mempolicy = NULL;
+		}
+		return 0;
+	}
+	else if (strncmp(key, "lxc.hugepages", 13) == 0) {
+		bool all = strcmp(key, "lxc.hugepages") == 0;
+
+		if (all || strcmp(key, "lxc.hugepages.mount") == 0) {
+			free(c->hugepages_mount);
+			c->hugepages_mount = NULL;
+		}
+		if (all || strcmp(key, "lxc.hugepages.size") == 0)
+			c->hugepages_size = 0;
+		if (all || strcmp(key, "lxc.hugepages.reserve") == 0)
+			c->hugepages_reserve = 0;
+		return 0;
+	}
+	else if (strncmp(key, "lxc.checkpoint", 14) == 0) {
+		bool all = strcmp(key, "lxc.checkpoint") == 0;
+
+		if (all || strcmp(key, "lxc.checkpoint.predump") == 0)
+			c->checkpoint_predump = 0;
+		if (all || strcmp(key, "lxc.checkpoint.page_server") == 0) {
+			free(c->checkpoint_page_server);
+			c->checkpoint_page_server = NULL;
+		}
+		return 0;
+	}
 	else if (strcmp(key, "lxc.mount.entries") == 0)
 		return lxc_clear_mount_entries(c);
 	else if (strcmp(key, "lxc.mount.auto") == 0)
@@ -2372,12 +3077,31 @@ void write_config(FILE *fout, struct lxc_conf *c)
 		fprintf(fout, "lxc.autodev = 1\n");
 	if (c->loglevel != LXC_LOG_PRIORITY_NOTSET)
 		fprintf(fout, "lxc.loglevel = %s\n", lxc_log_priority_to_string(c->loglevel));
+	lxc_list_for_each(it, &c->loglevels)
+		fprintf(fout, "lxc.loglevel.%s\n", (char *)it->elem);
 	if (c->logfile)
 		fprintf(fout, "lxc.logfile = %s\n", c->logfile);
+	if (c->logbuffer)
+		fprintf(fout, "lxc.logbuffer = 1\n");
+	if (c->logbinary)
+		fprintf(fout, "lxc.logformat = binary\n");
 	lxc_list_for_each(it, &c->cgroup) {
 		struct lxc_cgroup *cg = it->elem;
 		fprintf(fout, "lxc.cgroup.%s = %s\n", cg->subsystem, cg->value);
 	}
+	if (c->cpuset_policy)
+		fprintf(fout, "lxc.cpuset.policy = %s\n",
+			lxc_cpuset_policy_name(c->cpuset_policy));
+	if (c->cpuset_count)
+		fprintf(fout, "lxc.cpuset.count = %d\n", c->cpuset_count);
+	if (c->cpuset_mempolicy)
+		fprintf(fout, "lxc.cpuset.mempolicy = %s\n", c->cpuset_mempolicy);
+	if (c->hugepages_mount)
+		fprintf(fout, "lxc.hugepages.mount = %s\n", c->hugepages_mount);
+	if (c->hugepages_size)
+		fprintf(fout, "lxc.hugepages.size = %luK\n", c->hugepages_size);
+	if (c->hugepages_reserve)
+		fprintf(fout, "lxc.hugepages.reserve = %lu\n", c->hugepages_reserve);
 	if (c->utsname)
 		fprintf(fout, "lxc.utsname = %s\n", c->utsname->nodename);
 	lxc_list_for_each(it, &c->network) {
@@ -2397,9 +3121,19 @@ void write_config(FILE *fout, struct lxc_conf *c)
 			case MACVLAN_MODE_PRIVATE: mode = "private"; break;
 			case MACVLAN_MODE_VEPA: mode = "vepa"; break;
 			case MACVLAN_MODE_BRIDGE: mode = "bridge"; break;
+			case MACVLAN_MODE_PASSTHRU: mode = "passthru"; break;
 			default: mode = "(invalid)"; break;
 			}
 			fprintf(fout, "lxc.network.macvlan.mode = %s\n", mode);
+		} else if (n->type == LXC_NET_IPVLAN) {
+			const char *mode;
+			switch (n->priv.ipvlan_attr.mode) {
+			case IPVLAN_MODE_L2: mode = "l2"; break;
+			case IPVLAN_MODE_L3: mode = "l3"; break;
+			case IPVLAN_MODE_L3S: mode = "l3s"; break;
+			default: mode = "(invalid)"; break;
+			}
+			fprintf(fout, "lxc.network.ipvlan.mode = %s\n", mode);
 		} else if (n->type == LXC_NET_VETH) {
 			if (n->priv.veth_attr.pair)
 				fprintf(fout, "lxc.network.veth.pair = %s\n",
@@ -2447,6 +3181,9 @@ void write_config(FILE *fout, struct lxc_conf *c)
 			inet_ntop(AF_INET6, n->ipv6_gateway, buf, sizeof(buf));
 			fprintf(fout, "lxc.network.ipv6.gateway = %s\n", buf);
 		}
+		if (n->ipv6_dad != LXC_NET_DAD_ON)
+			fprintf(fout, "lxc.network.ipv6.dad = %s\n",
+				ipv6_dad_name(n->ipv6_dad));
 		lxc_list_for_each(it2, &n->ipv6) {
 			struct lxc_inet6dev *i = it2->elem;
 			char buf[INET6_ADDRSTRLEN];
@@ -2475,12 +3212,27 @@ void write_config(FILE *fout, struct lxc_conf *c)
 	}
 	if (c->console.path)
 		fprintf(fout, "lxc.console = %s\n", c->console.path);
+	if (c->console.log_path)
+		fprintf(fout, "lxc.console.logfile = %s\n", c->console.log_path);
+	if (c->console.log_size)
+		fprintf(fout, "lxc.console.size = %llu\n",
+			(unsigned long long)c->console.log_size);
+	if (c->console.log_rate)
+		fprintf(fout, "lxc.console.rate = %llu\n",
+			(unsigned long long)c->console.log_rate);
+	if (c->console.buffer_size)
+		fprintf(fout, "lxc.console.buffer.size = %llu\n",
+			(unsigned long long)c->console.buffer_size);
+	if (c->console.buffer_path)
+		fprintf(fout, "lxc.console.buffer.file = %s\n", c->console.buffer_path);
 	if (c->rootfs.path)
 		fprintf(fout, "lxc.rootfs = %s\n", c->rootfs.path);
 	if (c->rootfs.mount && strcmp(c->rootfs.mount, LXCROOTFSMOUNT) != 0)
 		fprintf(fout, "lxc.rootfs.mount = %s\n", c->rootfs.mount);
 	if (c->rootfs.options)
 		fprintf(fout, "lxc.rootfs.options = %s\n", c->rootfs.options);
+	if (c->rootfs.idmapped)
+		fprintf(fout, "lxc.rootfs.idmapped = %d\n", c->rootfs.idmapped);
 	if (c->rootfs.pivot)
 		fprintf(fout, "lxc.pivotdir = %s\n", c->rootfs.pivot);
 	if (c->start_auto)
@@ -2489,6 +3241,18 @@ void write_config(FILE *fout, struct lxc_conf *c)
 		fprintf(fout, "lxc.start.delay = %d\n", c->start_delay);
 	if (c->start_order)
 		fprintf(fout, "lxc.start.order = %d\n", c->start_order);
+	if (c->start_notify)
+		fprintf(fout, "lxc.start.notify = %s\n", c->start_notify);
+	if (c->start_supervised)
+		fprintf(fout, "lxc.start.supervised = %d\n", c->start_supervised);
+	if (c->ephemeral)
+		fprintf(fout, "lxc.ephemeral = %d\n", c->ephemeral);
+	if (c->stop_cgroup_kill)
+		fprintf(fout, "lxc.stop.cgroup_kill = %d\n", c->stop_cgroup_kill);
+	if (c->checkpoint_predump)
+		fprintf(fout, "lxc.checkpoint.predump = %d\n", c->checkpoint_predump);
+	if (c->checkpoint_page_server)
+		fprintf(fout, "lxc.checkpoint.page_server = %s\n", c->checkpoint_page_server);
 	lxc_list_for_each(it, &c->groups)
 		fprintf(fout, "lxc.group = %s\n", (char *)it->elem);
 }
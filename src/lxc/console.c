@@ -28,8 +28,13 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <termios.h>
+#include <time.h>
 
 #include <lxc/lxccontainer.h>
 
@@ -39,20 +44,16 @@
 #include "start.h" 	/* for struct lxc_handler */
 #include "caps.h"
 #include "commands.h"
+#include "console.h"
 #include "mainloop.h"
 #include "af_unix.h"
 #include "lxclock.h"
 #include "utils.h"
 
-#if HAVE_PTY_H
-#include <pty.h>
-#else
-#include <../include/openpty.h>
-#endif
-
 lxc_log_define(lxc_console, lxc);
 
 static struct lxc_list lxc_ttys;
+static pthread_mutex_t lxc_ttys_lock = PTHREAD_MUTEX_INITIALIZER;
 
 typedef void (*sighandler_t)(int);
 struct lxc_tty_state
@@ -104,10 +105,12 @@ void lxc_console_sigwinch(int sig)
 	struct lxc_list *it;
 	struct lxc_tty_state *ts;
 
+	pthread_mutex_lock(&lxc_ttys_lock);
 	lxc_list_for_each(it, &lxc_ttys) {
 		ts = it->elem;
 		lxc_console_winch(ts);
 	}
+	pthread_mutex_unlock(&lxc_ttys_lock);
 }
 
 static int lxc_console_cb_sigwinch_fd(int fd, uint32_t events, void *cbdata,
@@ -135,9 +138,6 @@ static int lxc_console_cb_sigwinch_fd(int fd, uint32_t events, void *cbdata,
  * member of the returned lxc_tty_state can be select()/poll()ed/epoll()ed
  * on (ie added to a mainloop) for SIGWINCH.
  *
- * Must be called with process_lock held to protect the lxc_ttys list, or
- * from a non-threaded context.
- *
  * Note that SIGWINCH isn't installed as a classic asychronous handler,
  * rather signalfd(2) is used so that we can handle the signal when we're
  * ready for it. This avoids deadlocks since a signal handler
@@ -161,7 +161,9 @@ static struct lxc_tty_state *lxc_console_sigwinch_init(int srcfd, int dstfd)
 
 	/* add tty to list to be scanned at SIGWINCH time */
 	lxc_list_add_elem(&ts->node, ts);
+	pthread_mutex_lock(&lxc_ttys_lock);
 	lxc_list_add_tail(&lxc_ttys, &ts->node);
+	pthread_mutex_unlock(&lxc_ttys_lock);
 
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGWINCH);
@@ -170,7 +172,7 @@ static struct lxc_tty_state *lxc_console_sigwinch_init(int srcfd, int dstfd)
 		goto err1;
 	}
 
-	ts->sigfd = signalfd(-1, &mask, 0);
+	ts->sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
 	if (ts->sigfd < 0) {
 		SYSERROR("failed to get signalfd");
 		goto err2;
@@ -182,7 +184,9 @@ static struct lxc_tty_state *lxc_console_sigwinch_init(int srcfd, int dstfd)
 err2:
 	sigprocmask(SIG_SETMASK, &ts->oldmask, NULL);
 err1:
+	pthread_mutex_lock(&lxc_ttys_lock);
 	lxc_list_del(&ts->node);
+	pthread_mutex_unlock(&lxc_ttys_lock);
 	free(ts);
 	ts = NULL;
 out:
@@ -196,29 +200,279 @@ out:
  *
  * Restore the saved signal handler that was in effect at the time
  * lxc_console_sigwinch_init() was called.
- *
- * Must be called with process_lock held to protect the lxc_ttys list, or
- * from a non-threaded context.
  */
 static void lxc_console_sigwinch_fini(struct lxc_tty_state *ts)
 {
 	if (ts->sigfd >= 0) {
 		close(ts->sigfd);
 	}
+	pthread_mutex_lock(&lxc_ttys_lock);
 	lxc_list_del(&ts->node);
+	pthread_mutex_unlock(&lxc_ttys_lock);
 	sigprocmask(SIG_SETMASK, &ts->oldmask, NULL);
 	free(ts);
 }
 
+/*
+ * The history of the console is a ring of @size bytes following this
+ * header.  @written counts all the bytes ever written to it, the last
+ * @size of which are kept.  When lxc.console.buffer.file is set the whole
+ * ring is a shared mapping of that file, which outlives the container:
+ * a container started again with the same size appends to it.
+ */
+#define LXC_RINGBUF_MAGIC 0x3166756272636c78ULL /* "lxcrbuf1" */
+
+struct lxc_ringbuf_hdr {
+	uint64_t magic;
+	uint64_t size;
+	uint64_t written;
+};
+
+struct lxc_ringbuf {
+	struct lxc_ringbuf_hdr *hdr;
+	char *data;
+	size_t maplen;
+};
+
+static struct lxc_ringbuf *lxc_ringbuf_new(uint64_t size, const char *path)
+{
+	struct lxc_ringbuf *rb;
+	struct stat st;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	int fd = -1;
+	bool reuse = false;
+
+	/* the data is a whole number of pages */
+	size = (size + pagesize - 1) / pagesize * pagesize;
+	if (size > LXC_CONSOLE_BUFFER_MAX)
+		size = LXC_CONSOLE_BUFFER_MAX;
+
+	rb = malloc(sizeof(*rb));
+	if (!rb)
+		return NULL;
+	rb->maplen = pagesize + size;
+
+	if (path) {
+		fd = lxc_unpriv(open(path, O_CLOEXEC | O_RDWR | O_CREAT, 0600));
+		if (fd < 0) {
+			SYSERROR("failed to open '%s'", path);
+			goto err;
+		}
+		reuse = fstat(fd, &st) == 0 && st.st_size == rb->maplen;
+		if (!reuse && ftruncate(fd, rb->maplen) < 0) {
+			SYSERROR("failed to size '%s'", path);
+			goto err;
+		}
+		rb->hdr = mmap(NULL, rb->maplen, PROT_READ | PROT_WRITE,
+			       MAP_SHARED, fd, 0);
+		close(fd);
+		fd = -1;
+	} else {
+		rb->hdr = mmap(NULL, rb->maplen, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (rb->hdr == MAP_FAILED) {
+		SYSERROR("failed to map the console buffer");
+		goto err;
+	}
+
+	rb->data = (char *)rb->hdr + pagesize;
+	if (!reuse || rb->hdr->magic != LXC_RINGBUF_MAGIC ||
+	    rb->hdr->size != size) {
+		rb->hdr->magic = LXC_RINGBUF_MAGIC;
+		rb->hdr->size = size;
+		rb->hdr->written = 0;
+	}
+	return rb;
+
+err:
+	if (fd >= 0)
+		close(fd);
+	free(rb);
+	return NULL;
+}
+
+static void lxc_ringbuf_free(struct lxc_ringbuf *rb)
+{
+	munmap(rb->hdr, rb->maplen);
+	free(rb);
+}
+
+static void lxc_ringbuf_write(struct lxc_ringbuf *rb, const char *buf,
+			      size_t len)
+{
+	uint64_t size = rb->hdr->size;
+	size_t pos, n;
+
+	if (len > size) {
+		rb->hdr->written += len - size;
+		buf += len - size;
+		len = size;
+	}
+
+	pos = rb->hdr->written % size;
+	n = len < size - pos ? len : size - pos;
+	memcpy(rb->data + pos, buf, n);
+	memcpy(rb->data, buf + n, len - n);
+	rb->hdr->written += len;
+}
+
+/* copy the history, oldest first, to @buf which holds the whole ring */
+static size_t lxc_ringbuf_read(struct lxc_ringbuf *rb, char *buf)
+{
+	uint64_t size = rb->hdr->size;
+	size_t len, pos, n;
+
+	len = rb->hdr->written < size ? rb->hdr->written : size;
+	pos = (rb->hdr->written - len) % size;
+	n = len < size - pos ? len : size - pos;
+	memcpy(buf, rb->data + pos, n);
+	memcpy(buf + n, rb->data, len - n);
+	return len;
+}
+
+int lxc_console_log(struct lxc_console *console, char **data, size_t *len,
+		    bool clear)
+{
+	struct lxc_ringbuf *rb = console->ringbuf;
+
+	if (!rb)
+		return -ENODATA;
+
+	if (data) {
+		*data = malloc(rb->hdr->size ? rb->hdr->size : 1);
+		if (!*data)
+			return -ENOMEM;
+		*len = lxc_ringbuf_read(rb, *data);
+	}
+	if (clear)
+		rb->hdr->written = 0;
+	return 0;
+}
+
+static int lxc_console_log_open(struct lxc_console *console, int flags)
+{
+	struct stat st;
+
+	console->log_fd = lxc_unpriv(open(console->log_path,
+					  O_CLOEXEC | O_RDWR | O_CREAT |
+					  O_APPEND | flags, 0600));
+	if (console->log_fd < 0) {
+		SYSERROR("failed to open '%s'", console->log_path);
+		return -1;
+	}
+	console->log_written = fstat(console->log_fd, &st) == 0 ? st.st_size : 0;
+	return 0;
+}
+
+/* move the log file to <log>.1, replacing the previous one, and reopen it */
+static void lxc_console_log_rotate(struct lxc_console *console)
+{
+	char path[MAXPATHLEN];
+	int ret;
+
+	ret = snprintf(path, sizeof(path), "%s.1", console->log_path);
+	if (ret < 0 || ret >= sizeof(path))
+		return;
+	if (rename(console->log_path, path) < 0) {
+		SYSERROR("failed to rotate '%s'", console->log_path);
+		return;
+	}
+	close(console->log_fd);
+	if (lxc_console_log_open(console, O_TRUNC) < 0)
+		WARN("console output is not logged anymore");
+}
+
+/*
+ * Log the console output, lxc.console.rate bytes per second at most: what
+ * comes beyond is only counted, and noted in the log once the next second
+ * starts.
+ */
+static int lxc_console_log_write(struct lxc_console *console, char *buf, int r)
+{
+	char note[64];
+	struct timespec now;
+	int w, n;
+
+	if (console->log_rate) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec != console->log_second) {
+			console->log_second = now.tv_sec;
+			console->log_budget = console->log_rate;
+			if (console->log_dropped) {
+				n = snprintf(note, sizeof(note),
+					     "\n[%llu bytes of console output not logged]\n",
+					     (unsigned long long)console->log_dropped);
+				console->log_dropped = 0;
+				if (write(console->log_fd, note, n) == n)
+					console->log_written += n;
+			}
+		}
+		if (r > console->log_budget) {
+			console->log_dropped += r - console->log_budget;
+			r = console->log_budget;
+		}
+		console->log_budget -= r;
+		if (!r)
+			return 0;
+	}
+
+	if (console->log_size && console->log_written + r > console->log_size &&
+	    console->log_written)
+		lxc_console_log_rotate(console);
+	if (console->log_fd < 0)
+		return r;
+
+	w = write(console->log_fd, buf, r);
+	if (w > 0)
+		console->log_written += w;
+	if (w != r)
+		WARN("console short write r:%d w:%d", r, w);
+	return w;
+}
+
+/* bounds of the console proxy buffer */
+#define LXC_CONSOLE_BUF_MIN 4096
+#define LXC_CONSOLE_BUF_MAX 65536
+
+/*
+ * The peer is written to without blocking, what it can't take right away
+ * is dropped: a peer which doesn't read must not keep us from draining the
+ * console, nor from logging it.
+ */
+static void lxc_console_write_peer(struct lxc_console *console, char *buf,
+				   int r)
+{
+	int w;
+
+	w = write(console->peer, buf, r);
+	if (w < 0 && errno == EAGAIN)
+		return;
+	if (w != r)
+		WARN("console short write r:%d w:%d", r, w);
+}
+
 static int lxc_console_cb_con(int fd, uint32_t events, void *data,
 			      struct lxc_epoll_descr *descr)
 {
 	struct lxc_console *console = (struct lxc_console *)data;
-	char buf[1024];
-	int r,w;
+	char *buf;
+	int r, w;
+
+	if (!console->buf) {
+		console->buf = malloc(LXC_CONSOLE_BUF_MIN);
+		if (!console->buf) {
+			SYSERROR("failed to allocate the console buffer");
+			return 1;
+		}
+		console->buf_size = LXC_CONSOLE_BUF_MIN;
+	}
+	buf = console->buf;
 
-	w = r = read(fd, buf, sizeof(buf));
+	w = r = read(fd, buf, console->buf_size);
 	if (r < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
 		SYSERROR("failed to read");
 		return 1;
 	}
@@ -234,21 +488,43 @@ static int lxc_console_cb_con(int fd, uint32_t events, void *data,
 		w = write(console->master, buf, r);
 
 	if (fd == console->master) {
+		if (console->ringbuf)
+			lxc_ringbuf_write(console->ringbuf, buf, r);
+
 		if (console->log_fd >= 0)
-			w = write(console->log_fd, buf, r);
+			lxc_console_log_write(console, buf, r);
 
 		if (console->peer >= 0)
-			w = write(console->peer, buf, r);
+			lxc_console_write_peer(console, buf, r);
 	}
 
 	if (w != r)
 		WARN("console short write r:%d w:%d", r, w);
+
+	/* a chatty console gets fewer, larger reads */
+	if (r == console->buf_size && console->buf_size < LXC_CONSOLE_BUF_MAX) {
+		buf = realloc(console->buf, 2 * console->buf_size);
+		if (buf) {
+			console->buf = buf;
+			console->buf_size *= 2;
+		}
+	}
 	return 0;
 }
 
 static void lxc_console_mainloop_add_peer(struct lxc_console *console)
 {
+	int flags;
+
 	if (console->peer >= 0) {
+		/*
+		 * we opened the peer ourselves, so no one else shares its
+		 * file description and its flags
+		 */
+		flags = fcntl(console->peer, F_GETFL);
+		if (flags < 0 ||
+		    fcntl(console->peer, F_SETFL, flags | O_NONBLOCK) < 0)
+			WARN("failed to make the console peer non blocking");
 		if (lxc_mainloop_add_handler(console->descr, console->peer,
 					     lxc_console_cb_con, console))
 			WARN("console peer not added to mainloop");
@@ -373,10 +649,8 @@ static int lxc_console_peer_proxy_alloc(struct lxc_console *console, int sockfd)
 	/* this is the proxy pty that will be given to the client, and that
 	 * the real pty master will send to / recv from
 	 */
-	process_lock();
-	ret = openpty(&console->peerpty.master, &console->peerpty.slave,
-		    console->peerpty.name, NULL, NULL);
-	process_unlock();
+	ret = lxc_openpty(&console->peerpty.master, &console->peerpty.slave,
+			  console->peerpty.name);
 	if (ret) {
 		SYSERROR("failed to create proxy pty");
 		return -1;
@@ -554,6 +828,15 @@ void lxc_console_delete(struct lxc_console *console)
 	console->master = -1;
 	console->slave = -1;
 	console->log_fd = -1;
+
+	free(console->buf);
+	console->buf = NULL;
+	console->buf_size = 0;
+
+	if (console->ringbuf) {
+		lxc_ringbuf_free(console->ringbuf);
+		console->ringbuf = NULL;
+	}
 }
 
 int lxc_console_create(struct lxc_conf *conf)
@@ -572,38 +855,30 @@ int lxc_console_create(struct lxc_conf *conf)
 	if (console->path && !strcmp(console->path, "none"))
 		return 0;
 
-	process_lock();
-	ret = openpty(&console->master, &console->slave,
-		    console->name, NULL, NULL);
-	process_unlock();
+	ret = lxc_openpty(&console->master, &console->slave, console->name);
 	if (ret) {
 		SYSERROR("failed to allocate a pty");
 		return -1;
 	}
 
-	if (fcntl(console->master, F_SETFD, FD_CLOEXEC)) {
-		SYSERROR("failed to set console master to close-on-exec");
-		goto err;
-	}
-
-	if (fcntl(console->slave, F_SETFD, FD_CLOEXEC)) {
-		SYSERROR("failed to set console slave to close-on-exec");
-		goto err;
-	}
-
 	lxc_console_peer_default(console);
 
 	if (console->log_path) {
-		console->log_fd = lxc_unpriv(open(console->log_path,
-						  O_CLOEXEC | O_RDWR |
-						  O_CREAT | O_APPEND, 0600));
-		if (console->log_fd < 0) {
-			SYSERROR("failed to open '%s'", console->log_path);
+		if (lxc_console_log_open(console, 0) < 0)
 			goto err;
-		}
+		console->log_budget = console->log_rate;
+		console->log_dropped = 0;
+		console->log_second = 0;
 		DEBUG("using '%s' as console log", console->log_path);
 	}
 
+	if (console->buffer_size) {
+		console->ringbuf = lxc_ringbuf_new(console->buffer_size,
+						   console->buffer_path);
+		if (!console->ringbuf)
+			goto err;
+	}
+
 	return 0;
 
 err:
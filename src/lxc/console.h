@@ -24,6 +24,9 @@
 #ifndef __LXC_CONSOLE_H
 #define __LXC_CONSOLE_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 struct lxc_epoll_descr;
 struct lxc_container;
 
@@ -41,4 +44,14 @@ extern int  lxc_console_getfd(struct lxc_container *c, int *ttynum,
 			      int *masterfd);
 extern int  lxc_console_set_stdfds(struct lxc_handler *);
 
+/*
+ * The in-memory history of a console, lxc.console.buffer.size bytes at
+ * most.  lxc_console_log() copies it to a malloc()ed @data of @len bytes
+ * unless @data is NULL, then clears it if @clear is set.  Returns 0, or
+ * -ENODATA if the console keeps no history.
+ */
+#define LXC_CONSOLE_BUFFER_MAX (16 * 1024 * 1024)
+extern int  lxc_console_log(struct lxc_console *console, char **data,
+			    size_t *len, bool clear);
+
 #endif
@@ -0,0 +1,845 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "log.h"
+#include "copytree.h"
+#include "rmtree.h"
+#include "utils.h"
+
+lxc_log_define(lxc_copytree, lxc);
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#define COPY_MAX_THREADS	16
+#define COPY_CHUNK		(1 << 20)
+
+/*
+ * The directories waiting to be copied by one worker.  It takes the most
+ * recently queued one itself and idle workers steal the oldest, which
+ * tends to be the top of a large subtree.
+ */
+struct copy_queue {
+	pthread_mutex_t lock;
+	char **items;
+	size_t head;
+	size_t tail;
+	size_t size;
+};
+
+/* a file with further links, and where it was copied to */
+struct copy_link {
+	dev_t dev;
+	ino_t ino;
+	char *path;
+};
+
+/*
+ * @srcfd, @dstfd: the directories being copied from and to
+ * @pending      : directories queued or being copied
+ * @gen          : bumped whenever a directory is queued
+ * @failed       : something could not be copied
+ * @no_clone     : the destination can't reflink from the source
+ * @no_range     : copy_file_range() does not work between them
+ * @layer        : @src is an overlayfs layer to be put on top of @dest
+ * @bwlimit      : bytes per second from lxc.bdev.io.bwlimit, 0 for no cap
+ * @copied       : bytes copied since @start, against @bwlimit
+ */
+struct copy_tree {
+	const char *dest;
+	int srcfd;
+	int dstfd;
+	int nworkers;
+	struct copy_queue *queues;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	long pending;
+	unsigned long gen;
+
+	pthread_mutex_t links_lock;
+	struct copy_link *links;
+	size_t nlinks;
+	size_t links_size;
+
+	int failed;
+	int no_clone;
+	int no_range;
+	bool layer;
+
+	unsigned long long bwlimit;
+	unsigned long long copied;
+	struct timespec start;
+};
+
+struct copy_worker {
+	struct copy_tree *ct;
+	int id;
+};
+
+static void copy_failed(struct copy_tree *ct)
+{
+	__sync_lock_test_and_set(&ct->failed, 1);
+}
+
+static bool queue_push(struct copy_queue *q, char *item)
+{
+	char **items;
+	size_t size;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->tail == q->size) {
+		if (q->head) {
+			memmove(q->items, q->items + q->head,
+				(q->tail - q->head) * sizeof(*q->items));
+			q->tail -= q->head;
+			q->head = 0;
+		} else {
+			size = q->size ? q->size * 2 : 64;
+			items = realloc(q->items, size * sizeof(*items));
+			if (!items) {
+				pthread_mutex_unlock(&q->lock);
+				return false;
+			}
+			q->items = items;
+			q->size = size;
+		}
+	}
+	q->items[q->tail++] = item;
+	pthread_mutex_unlock(&q->lock);
+	return true;
+}
+
+static char *queue_pop(struct copy_queue *q, bool steal)
+{
+	char *item = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail)
+		item = steal ? q->items[q->head++] : q->items[--q->tail];
+	if (q->head == q->tail)
+		q->head = q->tail = 0;
+	pthread_mutex_unlock(&q->lock);
+	return item;
+}
+
+static void copy_queue_dir(struct copy_tree *ct, int id, char *path)
+{
+	if (!queue_push(&ct->queues[id], path)) {
+		ERROR("out of memory queueing %s", path);
+		free(path);
+		copy_failed(ct);
+		return;
+	}
+	pthread_mutex_lock(&ct->lock);
+	ct->pending++;
+	ct->gen++;
+	pthread_cond_signal(&ct->cond);
+	pthread_mutex_unlock(&ct->lock);
+}
+
+/* where the file @st was copied to already, called with links_lock held */
+static const char *copy_link_find(struct copy_tree *ct, const struct stat *st)
+{
+	size_t i;
+
+	for (i = 0; i < ct->nlinks; i++)
+		if (ct->links[i].ino == st->st_ino &&
+		    ct->links[i].dev == st->st_dev)
+			return ct->links[i].path;
+	return NULL;
+}
+
+/* remember that @st was copied to @path, called with links_lock held */
+static bool copy_link_add(struct copy_tree *ct, const struct stat *st,
+			  const char *path)
+{
+	struct copy_link *links;
+	size_t size;
+
+	if (ct->nlinks == ct->links_size) {
+		size = ct->links_size ? ct->links_size * 2 : 64;
+		links = realloc(ct->links, size * sizeof(*links));
+		if (!links)
+			return false;
+		ct->links = links;
+		ct->links_size = size;
+	}
+	ct->links[ct->nlinks].path = strdup(path);
+	if (!ct->links[ct->nlinks].path)
+		return false;
+	ct->links[ct->nlinks].dev = st->st_dev;
+	ct->links[ct->nlinks].ino = st->st_ino;
+	ct->nlinks++;
+	return true;
+}
+
+static char *copy_path(const char *dir, const char *name)
+{
+	char *path;
+
+	if (!strcmp(dir, "."))
+		return strdup(name);
+	if (asprintf(&path, "%s/%s", dir, name) < 0)
+		return NULL;
+	return path;
+}
+
+static ssize_t copy_range(int from, loff_t *off_from, int to, loff_t *off_to,
+			  size_t len)
+{
+#ifdef __NR_copy_file_range
+	return syscall(__NR_copy_file_range, from, off_from, to, off_to, len, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* account @n bytes copied, sleeping for as long as they are ahead of the cap */
+static void copy_throttle(struct copy_tree *ct, size_t n)
+{
+	struct timespec now;
+	double due, elapsed;
+
+	if (!ct->bwlimit)
+		return;
+	due = (double)__sync_add_and_fetch(&ct->copied, n) / ct->bwlimit;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - ct->start.tv_sec) +
+		  (now.tv_nsec - ct->start.tv_nsec) / 1e9;
+	if (due > elapsed)
+		usleep((due - elapsed) * 1e6);
+}
+
+/* copy bytes [@off, @end) of @from at the same offset of @to */
+static int copy_data(struct copy_tree *ct, int from, int to, off_t off,
+		     off_t end)
+{
+	char *buf = NULL;
+	loff_t in, out;
+	ssize_t n, w;
+	size_t len;
+
+	while (off < end) {
+		len = MIN(end - off, COPY_CHUNK);
+		if (!ct->no_range) {
+			in = out = off;
+			n = copy_range(from, &in, to, &out, len);
+			if (n > 0) {
+				off += n;
+				copy_throttle(ct, n);
+				continue;
+			}
+			if (n == 0)
+				break;
+			if (errno != EXDEV && errno != ENOSYS &&
+			    errno != EOPNOTSUPP && errno != EINVAL)
+				goto err;
+			ct->no_range = 1;
+		}
+
+		if (!buf && !(buf = malloc(COPY_CHUNK)))
+			goto err;
+		n = pread(from, buf, len, off);
+		if (n < 0)
+			goto err;
+		if (n == 0)
+			break;
+		for (w = 0; w < n; ) {
+			ssize_t ret = pwrite(to, buf + w, n - w, off + w);
+			if (ret < 0)
+				goto err;
+			w += ret;
+		}
+		off += n;
+		copy_throttle(ct, n);
+	}
+	free(buf);
+	return 0;
+
+err:
+	free(buf);
+	return -1;
+}
+
+/* copy the contents of @from to @to, reflinking or leaving holes */
+static int copy_contents(struct copy_tree *ct, int from, int to,
+			 const struct stat *st)
+{
+	off_t data, hole;
+
+	if (!ct->no_clone) {
+		if (ioctl(to, FICLONE, from) == 0)
+			return 0;
+		if (errno == EXDEV || errno == EOPNOTSUPP || errno == ENOTTY ||
+		    errno == EINVAL || errno == ENOSYS)
+			ct->no_clone = 1;
+	}
+
+	for (data = 0; data < st->st_size; data = hole) {
+		data = lseek(from, data, SEEK_DATA);
+		if (data < 0) {
+			/* nothing but a hole left */
+			if (errno == ENXIO)
+				break;
+			/* no idea where the holes are, copy it all */
+			return copy_data(ct, from, to, 0, st->st_size) < 0 ?
+				-1 : ftruncate(to, st->st_size);
+		}
+		hole = lseek(from, data, SEEK_HOLE);
+		if (hole < 0)
+			hole = st->st_size;
+		if (copy_data(ct, from, to, data, hole) < 0)
+			return -1;
+	}
+	return ftruncate(to, st->st_size);
+}
+
+/* the xattr calls on @path, or on @fd if there is no path */
+static ssize_t xattr_list(int fd, const char *path, char *list, size_t size)
+{
+	return path ? llistxattr(path, list, size) : flistxattr(fd, list, size);
+}
+
+static ssize_t xattr_get(int fd, const char *path, const char *name,
+			 void *value, size_t size)
+{
+	return path ? lgetxattr(path, name, value, size) :
+		      fgetxattr(fd, name, value, size);
+}
+
+static int xattr_set(int fd, const char *path, const char *name,
+		     const void *value, size_t size)
+{
+	return path ? lsetxattr(path, name, value, size, 0) :
+		      fsetxattr(fd, name, value, size, 0);
+}
+
+/*
+ * Copy the xattrs of @name in @sfd to @name in @dfd, or those of the
+ * directories themselves if @name is NULL.  Failing to set one is only
+ * worth a warning, the destination may not support it.
+ */
+static void copy_xattrs(int sfd, int dfd, const char *name)
+{
+	char spath[PATH_MAX], dpath[PATH_MAX], *sp = NULL, *dp = NULL;
+	char *list = NULL, *value = NULL, *p;
+	ssize_t len, vlen;
+	size_t vsize = 0;
+
+	/* no *xattrat(), go through the directory fds */
+	if (name) {
+		snprintf(spath, sizeof(spath), "/proc/self/fd/%d/%s", sfd, name);
+		snprintf(dpath, sizeof(dpath), "/proc/self/fd/%d/%s", dfd, name);
+		sp = spath;
+		dp = dpath;
+	}
+
+	len = xattr_list(sfd, sp, NULL, 0);
+	if (len <= 0)
+		return;
+	list = malloc(len);
+	if (!list)
+		return;
+	len = xattr_list(sfd, sp, list, len);
+	if (len <= 0)
+		goto out;
+
+	for (p = list; p < list + len; p += strlen(p) + 1) {
+		vlen = xattr_get(sfd, sp, p, NULL, 0);
+		if (vlen < 0)
+			continue;
+		if ((size_t)vlen >= vsize) {
+			free(value);
+			vsize = vlen + 1;
+			value = malloc(vsize);
+			if (!value)
+				goto out;
+		}
+		vlen = xattr_get(sfd, sp, p, value, vsize);
+		if (vlen < 0)
+			continue;
+		if (xattr_set(dfd, dp, p, value, vlen) < 0)
+			WARN("failed to set xattr %s on %s: %s", p,
+			     name ? name : "a directory", strerror(errno));
+	}
+out:
+	free(list);
+	free(value);
+}
+
+/* give @name in @dfd (or @dfd itself) the owner, mode and times of @st */
+static int copy_attrs(int sfd, int dfd, const char *name, const struct stat *st)
+{
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+	if (name) {
+		if (fchownat(dfd, name, st->st_uid, st->st_gid,
+			     AT_SYMLINK_NOFOLLOW) < 0)
+			return -1;
+		if (!S_ISLNK(st->st_mode) &&
+		    fchmodat(dfd, name, st->st_mode & 07777, 0) < 0)
+			return -1;
+	} else {
+		if (fchown(dfd, st->st_uid, st->st_gid) < 0)
+			return -1;
+		if (fchmod(dfd, st->st_mode & 07777) < 0)
+			return -1;
+	}
+
+	/* after the owner, which would drop file capabilities */
+	copy_xattrs(sfd, dfd, name);
+
+	if (name)
+		return utimensat(dfd, name, times, AT_SYMLINK_NOFOLLOW);
+	return futimens(dfd, times);
+}
+
+static int copy_file(struct copy_tree *ct, int sdir, int ddir, const char *dir,
+		     const char *name, const struct stat *st)
+{
+	const char *link;
+	char *path;
+	int from = -1, to = -1, ret = -1;
+
+	if (st->st_nlink > 1) {
+		path = copy_path(dir, name);
+		if (!path)
+			return -1;
+
+		/*
+		 * Create the first copy under the lock, so that any other
+		 * link to it finds it there.
+		 */
+		pthread_mutex_lock(&ct->links_lock);
+		link = copy_link_find(ct, st);
+		if (link) {
+			ret = linkat(ct->dstfd, link, ddir, name, 0);
+		} else {
+			to = openat(ddir, name, O_WRONLY | O_CREAT | O_TRUNC |
+				    O_NOFOLLOW | O_CLOEXEC, 0600);
+			if (to >= 0 && !copy_link_add(ct, st, path)) {
+				close(to);
+				to = -1;
+				errno = ENOMEM;
+			}
+		}
+		pthread_mutex_unlock(&ct->links_lock);
+		free(path);
+		if (link || to < 0)
+			return ret;
+	} else {
+		to = openat(ddir, name, O_WRONLY | O_CREAT | O_TRUNC |
+			    O_NOFOLLOW | O_CLOEXEC, 0600);
+		if (to < 0)
+			return -1;
+	}
+
+	from = openat(sdir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (from < 0)
+		goto out;
+	if (copy_contents(ct, from, to, st) < 0)
+		goto out;
+	ret = 0;
+out:
+	if (from >= 0)
+		close(from);
+	close(to);
+	if (ret == 0)
+		ret = copy_attrs(sdir, ddir, name, st);
+	return ret;
+}
+
+#define OVL_OPAQUE_XATTR "trusted.overlay.opaque"
+
+static bool ovl_is_opaque(int sdir, const char *name)
+{
+	char value;
+	int fd;
+	bool ret;
+
+	fd = openat(sdir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	ret = fgetxattr(fd, OVL_OPAQUE_XATTR, &value, 1) == 1 && value == 'y';
+	close(fd);
+	return ret;
+}
+
+/*
+ * Make way in @ddir for the @name of an overlayfs layer, which hides
+ * whatever was there unless both are directories and the new one is not
+ * opaque.  Whiteouts are device nodes, so are copied as they are.
+ */
+static int copy_layer_clear(struct copy_tree *ct, int sdir, int ddir,
+			    const char *dir, const char *name,
+			    const struct stat *st)
+{
+	char path[PATH_MAX];
+	struct stat dst;
+	int ret;
+
+	if (fstatat(ddir, name, &dst, AT_SYMLINK_NOFOLLOW) < 0)
+		return errno == ENOENT ? 0 : -1;
+	if (!S_ISDIR(dst.st_mode))
+		return S_ISDIR(st->st_mode) ? unlinkat(ddir, name, 0) : 0;
+	if (S_ISDIR(st->st_mode) && !ovl_is_opaque(sdir, name))
+		return 0;
+
+	ret = snprintf(path, sizeof(path), "%s/%s/%s", ct->dest, dir, name);
+	if (ret < 0 || ret >= sizeof(path))
+		return -1;
+	return lxc_remove_tree(path, NULL);
+}
+
+static int copy_entry(struct copy_tree *ct, int id, int sdir, int ddir,
+		      const char *dir, const char *name)
+{
+	char target[PATH_MAX], *path;
+	struct stat st;
+	ssize_t len;
+	int ret;
+
+	if (fstatat(sdir, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+		return -1;
+
+	if (ct->layer && copy_layer_clear(ct, sdir, ddir, dir, name, &st) < 0)
+		return -1;
+
+	if (S_ISDIR(st.st_mode)) {
+		if (mkdirat(ddir, name, 0700) < 0 && errno != EEXIST)
+			return -1;
+		path = copy_path(dir, name);
+		if (!path)
+			return -1;
+		copy_queue_dir(ct, id, path);
+		return 0;
+	}
+
+	/* whatever is in the way is replaced, as rsync would */
+	if (unlinkat(ddir, name, 0) < 0 && errno != ENOENT)
+		return -1;
+
+	if (S_ISREG(st.st_mode))
+		return copy_file(ct, sdir, ddir, dir, name, &st);
+
+	if (S_ISLNK(st.st_mode)) {
+		len = readlinkat(sdir, name, target, sizeof(target) - 1);
+		if (len < 0)
+			return -1;
+		target[len] = '\0';
+		ret = symlinkat(target, ddir, name);
+	} else {
+		ret = mknodat(ddir, name, st.st_mode, st.st_rdev);
+	}
+	if (ret < 0)
+		return -1;
+	return copy_attrs(sdir, ddir, name, &st);
+}
+
+/* copy the entries of @dir, queueing its subdirectories */
+static void copy_dir(struct copy_tree *ct, int id, const char *dir)
+{
+	struct dirent *direntp;
+	struct stat st;
+	int sdir, ddir;
+	DIR *d;
+
+	sdir = openat(ct->srcfd, dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+		      O_CLOEXEC);
+	if (sdir < 0) {
+		SYSERROR("failed to open %s", dir);
+		copy_failed(ct);
+		return;
+	}
+	ddir = openat(ct->dstfd, dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+		      O_CLOEXEC);
+	if (ddir < 0) {
+		SYSERROR("failed to open the copy of %s", dir);
+		close(sdir);
+		copy_failed(ct);
+		return;
+	}
+
+	d = fdopendir(dup(sdir));
+	if (!d) {
+		SYSERROR("failed to read %s", dir);
+		copy_failed(ct);
+		goto out;
+	}
+	while ((direntp = readdir(d))) {
+		if (!strcmp(direntp->d_name, ".") ||
+		    !strcmp(direntp->d_name, ".."))
+			continue;
+		if (copy_entry(ct, id, sdir, ddir, dir, direntp->d_name) < 0) {
+			SYSERROR("failed to copy %s/%s", dir, direntp->d_name);
+			copy_failed(ct);
+		}
+	}
+	closedir(d);
+
+	/* the subdirectories being copied don't change its times anymore */
+	if (fstat(sdir, &st) < 0 || copy_attrs(sdir, ddir, NULL, &st) < 0) {
+		SYSERROR("failed to copy the attributes of %s", dir);
+		copy_failed(ct);
+	}
+out:
+	close(sdir);
+	close(ddir);
+}
+
+static void *copy_worker(void *arg)
+{
+	struct copy_worker *w = arg;
+	struct copy_tree *ct = w->ct;
+	unsigned long gen;
+	char *dir;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&ct->lock);
+		gen = ct->gen;
+		pthread_mutex_unlock(&ct->lock);
+
+		dir = queue_pop(&ct->queues[w->id], false);
+		for (i = 1; !dir && i < ct->nworkers; i++)
+			dir = queue_pop(&ct->queues[(w->id + i) % ct->nworkers],
+					true);
+
+		if (!dir) {
+			pthread_mutex_lock(&ct->lock);
+			while (ct->pending && ct->gen == gen)
+				pthread_cond_wait(&ct->cond, &ct->lock);
+			if (!ct->pending) {
+				pthread_mutex_unlock(&ct->lock);
+				break;
+			}
+			pthread_mutex_unlock(&ct->lock);
+			continue;
+		}
+
+		copy_dir(ct, w->id, dir);
+		free(dir);
+
+		pthread_mutex_lock(&ct->lock);
+		if (!--ct->pending)
+			pthread_cond_broadcast(&ct->cond);
+		pthread_mutex_unlock(&ct->lock);
+	}
+	return NULL;
+}
+
+int lxc_copy_fd(int from, int to, const struct stat *st)
+{
+	struct copy_tree ct;
+
+	memset(&ct, 0, sizeof(ct));
+	return copy_contents(&ct, from, to, st);
+}
+
+/* a non-empty regular file somewhere near the top of @dirfd */
+static int find_some_file(int dirfd, int depth)
+{
+	struct dirent *direntp;
+	struct stat st;
+	int fd = -1, sub;
+	DIR *d;
+
+	d = fdopendir(dup(dirfd));
+	if (!d)
+		return -1;
+	while (fd < 0 && (direntp = readdir(d))) {
+		if (!strcmp(direntp->d_name, ".") ||
+		    !strcmp(direntp->d_name, ".."))
+			continue;
+		if (fstatat(dirfd, direntp->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+			continue;
+		if (S_ISREG(st.st_mode) && st.st_size > 0) {
+			fd = openat(dirfd, direntp->d_name,
+				    O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		} else if (S_ISDIR(st.st_mode) && depth > 0) {
+			sub = openat(dirfd, direntp->d_name, O_RDONLY |
+				     O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (sub < 0)
+				continue;
+			fd = find_some_file(sub, depth - 1);
+			close(sub);
+		}
+	}
+	closedir(d);
+	return fd;
+}
+
+bool lxc_copy_can_reflink(const char *src, const char *dest)
+{
+	char *dir, *p, tmpl[PATH_MAX];
+	int srcfd, from, to = -1, ret;
+	bool ok = false;
+
+	srcfd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (srcfd < 0)
+		return false;
+	from = find_some_file(srcfd, 3);
+	close(srcfd);
+	if (from < 0)
+		return false;
+
+	/* try next to where the copy goes, or whatever of it exists yet */
+	dir = strdup(dest);
+	if (!dir)
+		goto out;
+	while (access(dir, F_OK) < 0 && (p = strrchr(dir, '/')) && p != dir)
+		*p = '\0';
+
+	ret = snprintf(tmpl, sizeof(tmpl), "%s/.reflinkXXXXXX", dir);
+	free(dir);
+	if (ret < 0 || ret >= sizeof(tmpl))
+		goto out;
+	to = mkstemp(tmpl);
+	if (to < 0)
+		goto out;
+	unlink(tmpl);
+	ok = ioctl(to, FICLONE, from) == 0;
+out:
+	if (to >= 0)
+		close(to);
+	close(from);
+	return ok;
+}
+
+static int copy_tree(const char *src, const char *dest, bool layer)
+{
+	struct copy_tree ct;
+	struct copy_worker *workers;
+	pthread_t *threads;
+	const char *bwlimit;
+	char *root;
+	long ncpus;
+	int i, started = 0;
+
+	memset(&ct, 0, sizeof(ct));
+	ct.dest = dest;
+	ct.layer = layer;
+	ct.srcfd = ct.dstfd = -1;
+	pthread_mutex_init(&ct.lock, NULL);
+	pthread_cond_init(&ct.cond, NULL);
+	pthread_mutex_init(&ct.links_lock, NULL);
+
+	/* in MB/s */
+	bwlimit = lxc_global_config_value("lxc.bdev.io.bwlimit");
+	if (bwlimit && *bwlimit)
+		ct.bwlimit = strtoull(bwlimit, NULL, 10) << 20;
+	clock_gettime(CLOCK_MONOTONIC, &ct.start);
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	ct.nworkers = ncpus > 0 ? MIN(ncpus, COPY_MAX_THREADS) : 1;
+	ct.queues = calloc(ct.nworkers, sizeof(*ct.queues));
+	workers = calloc(ct.nworkers, sizeof(*workers));
+	threads = calloc(ct.nworkers, sizeof(*threads));
+	root = strdup(".");
+	if (!ct.queues || !workers || !threads || !root) {
+		ERROR("out of memory");
+		free(root);
+		goto out;
+	}
+	for (i = 0; i < ct.nworkers; i++)
+		pthread_mutex_init(&ct.queues[i].lock, NULL);
+
+	ct.srcfd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ct.srcfd < 0) {
+		SYSERROR("failed to open %s", src);
+		free(root);
+		goto out;
+	}
+	if (mkdir(dest, 0700) < 0 && errno != EEXIST) {
+		SYSERROR("failed to create %s", dest);
+		free(root);
+		goto out;
+	}
+	ct.dstfd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ct.dstfd < 0) {
+		SYSERROR("failed to open %s", dest);
+		free(root);
+		goto out;
+	}
+
+	copy_queue_dir(&ct, 0, root);
+	for (i = 0; i < ct.nworkers; i++) {
+		workers[i].ct = &ct;
+		workers[i].id = i;
+		if (i && pthread_create(&threads[i], NULL, copy_worker,
+					&workers[i]))
+			break;
+		started++;
+	}
+	/* the caller is worker 0 */
+	copy_worker(&workers[0]);
+	for (i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	DEBUG("copied %s to %s with %d threads", src, dest, started);
+out:
+	if (ct.srcfd >= 0)
+		close(ct.srcfd);
+	if (ct.dstfd >= 0)
+		close(ct.dstfd);
+	for (i = 0; ct.queues && i < ct.nworkers; i++) {
+		free(ct.queues[i].items);
+		pthread_mutex_destroy(&ct.queues[i].lock);
+	}
+	for (i = 0; i < ct.nlinks; i++)
+		free(ct.links[i].path);
+	free(ct.links);
+	free(ct.queues);
+	free(workers);
+	free(threads);
+	pthread_mutex_destroy(&ct.links_lock);
+	pthread_cond_destroy(&ct.cond);
+	pthread_mutex_destroy(&ct.lock);
+	return (started && !ct.failed) ? 0 : -1;
+}
+
+int lxc_copy_tree(const char *src, const char *dest)
+{
+	return copy_tree(src, dest, false);
+}
+
+int lxc_copy_layer(const char *src, const char *dest)
+{
+	return copy_tree(src, dest, true);
+}
@@ -0,0 +1,54 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef __LXC_COPYTREE_H
+#define __LXC_COPYTREE_H
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+/*
+ * Copy the contents of directory @src into @dest, creating it if needed,
+ * like "rsync -aHAX --sparse src/ dest" would: ownership, modes, times,
+ * xattrs (and so ACLs and file capabilities), hardlinks, device nodes and
+ * holes are preserved.  Files are reflinked when the filesystem allows.
+ * Returns 0 on success, -1 if anything could not be copied.
+ */
+extern int lxc_copy_tree(const char *src, const char *dest);
+
+/*
+ * Like lxc_copy_tree(), but @src is an overlayfs upper layer and @dest
+ * the layers below it, merged: what @src hides, through a whiteout or an
+ * opaque directory, is removed from @dest.  Merging the layers of a stack
+ * from the bottom up gives a single layer which does what they did.
+ */
+extern int lxc_copy_layer(const char *src, const char *dest);
+
+/*
+ * Copy the contents of file @from, of which @st is the stat, into empty
+ * file @to, by reflinking it if possible, or else with copy_file_range()
+ * and keeping its holes.  Returns 0 on success, -1 on error.
+ */
+extern int lxc_copy_fd(int from, int to, const struct stat *st);
+
+/*
+ * Whether a copy of @src to @dest can reflink its files, so that it takes
+ * next to no time or space.
+ */
+extern bool lxc_copy_can_reflink(const char *src, const char *dest);
+
+#endif
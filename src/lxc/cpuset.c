@@ -0,0 +1,493 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+
+#include "conf.h"
+#include "log.h"
+#include "cgroup.h"
+#include "cpuset.h"
+#include "start.h"
+#include "utils.h"
+
+lxc_log_define(lxc_cpuset, lxc);
+
+/* cpus and nodes past these are left alone */
+#define CPUSET_MAX_CPUS		4096
+#define CPUSET_MAX_NODES	1024
+
+static const char *policy_names[] = {
+	[LXC_CPUSET_NONE]	= "none",
+	[LXC_CPUSET_SPREAD]	= "spread",
+	[LXC_CPUSET_PACK]	= "pack",
+	[LXC_CPUSET_NUMA_LOCAL]	= "numa-local",
+};
+
+int lxc_cpuset_policy_parse(const char *value)
+{
+	int i;
+
+	for (i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++)
+		if (!strcmp(value, policy_names[i]))
+			return i;
+	return -1;
+}
+
+const char *lxc_cpuset_policy_name(int policy)
+{
+	if (policy < 0 || policy >= sizeof(policy_names) / sizeof(policy_names[0]))
+		return NULL;
+	return policy_names[policy];
+}
+
+struct cpu {
+	int node;	/* -1 if the parent does not allow the cpu */
+	int llc;	/* lowest cpu sharing its last level cache */
+	int load;	/* sibling cpusets which have it */
+	bool chosen;
+};
+
+struct placement {
+	struct cpu cpus[CPUSET_MAX_CPUS];
+	int llc_load[CPUSET_MAX_CPUS];
+	int node_load[CPUSET_MAX_NODES];
+	int node_size[CPUSET_MAX_NODES];
+	unsigned char allowed[CPUSET_MAX_CPUS];
+	unsigned char mems[CPUSET_MAX_NODES];
+	unsigned char set[CPUSET_MAX_CPUS];
+	char buf[CPUSET_MAX_CPUS * 6];
+};
+
+/* parses a "0-3,8,10-11" list into set, ignoring what is past max */
+static int parse_list(const char *s, unsigned char *set, int max)
+{
+	unsigned long a, b;
+	char *end;
+
+	memset(set, 0, max);
+	while (*s && *s != '\n') {
+		a = strtoul(s, &end, 10);
+		if (end == s)
+			return -1;
+		b = a;
+		if (*end == '-') {
+			s = end + 1;
+			b = strtoul(s, &end, 10);
+			if (end == s || b < a)
+				return -1;
+		}
+		for (; a <= b && a < max; a++)
+			set[a] = 1;
+		s = end;
+		if (*s == ',')
+			s++;
+	}
+	return 0;
+}
+
+static int format_list(const unsigned char *set, int max, char *buf, size_t size)
+{
+	size_t len = 0;
+	int i, j, n;
+
+	buf[0] = '\0';
+	for (i = 0; i < max; i++) {
+		if (!set[i])
+			continue;
+		for (j = i; j + 1 < max && set[j + 1]; j++)
+			;
+		if (i == j)
+			n = snprintf(buf + len, size - len, "%s%d", len ? "," : "", i);
+		else
+			n = snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", i, j);
+		if (n < 0 || n >= size - len)
+			return -1;
+		len += n;
+		i = j;
+	}
+	return len;
+}
+
+/* the first of files which can be read, for v2 and old and new v1 */
+static int read_parent_list(struct placement *p, int parentfd,
+			    const char *const *files, unsigned char *set, int max)
+{
+	for (; *files; files++) {
+		if (lxc_readat(parentfd, *files, p->buf, sizeof(p->buf)) <= 0)
+			continue;
+		if (p->buf[0] == '\n')
+			continue;
+		return parse_list(p->buf, set, max);
+	}
+	return -1;
+}
+
+static void read_topology(struct placement *p)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *dir;
+	int i, node, level;
+
+	for (i = 0; i < CPUSET_MAX_CPUS; i++)
+		p->cpus[i].node = -1;
+
+	dir = opendir("/sys/devices/system/node");
+	while (dir && (de = readdir(dir))) {
+		if (sscanf(de->d_name, "node%d", &node) != 1 ||
+		    node < 0 || node >= CPUSET_MAX_NODES)
+			continue;
+		snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist",
+			 de->d_name);
+		if (lxc_readat(AT_FDCWD, path, p->buf, sizeof(p->buf)) <= 0 ||
+		    parse_list(p->buf, p->set, CPUSET_MAX_CPUS) < 0)
+			continue;
+		for (i = 0; i < CPUSET_MAX_CPUS; i++)
+			if (p->set[i] && p->allowed[i])
+				p->cpus[i].node = node;
+	}
+	if (dir)
+		closedir(dir);
+
+	for (i = 0; i < CPUSET_MAX_CPUS; i++) {
+		if (!p->allowed[i])
+			continue;
+		/* without NUMA everything is on node 0 */
+		if (p->cpus[i].node < 0)
+			p->cpus[i].node = 0;
+
+		/* L3 where there is one, else L2, else the cpu alone */
+		p->cpus[i].llc = i;
+		for (level = 3; level >= 2; level--) {
+			snprintf(path, sizeof(path),
+				 "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+				 i, level);
+			if (lxc_readat(AT_FDCWD, path, p->buf, sizeof(p->buf)) > 0) {
+				p->cpus[i].llc = atoi(p->buf);
+				break;
+			}
+		}
+		if (p->cpus[i].llc < 0 || p->cpus[i].llc >= CPUSET_MAX_CPUS)
+			p->cpus[i].llc = i;
+	}
+}
+
+/* counts the cpusets of the other cgroups beside the container's */
+static void read_loads(struct placement *p, int parentfd, const char *self)
+{
+	char path[NAME_MAX + 16];
+	struct dirent *de;
+	DIR *dir;
+	int fd, i;
+
+	fd = openat(parentfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return;
+	}
+	while ((de = readdir(dir))) {
+		if (de->d_type != DT_DIR || de->d_name[0] == '.' ||
+		    !strcmp(de->d_name, self))
+			continue;
+		snprintf(path, sizeof(path), "%s/cpuset.cpus", de->d_name);
+		if (lxc_readat(parentfd, path, p->buf, sizeof(p->buf)) <= 0 ||
+		    parse_list(p->buf, p->set, CPUSET_MAX_CPUS) < 0)
+			continue;
+		for (i = 0; i < CPUSET_MAX_CPUS; i++)
+			if (p->set[i] && p->allowed[i])
+				p->cpus[i].load++;
+	}
+	closedir(dir);
+}
+
+/* whether cpu a is a better pick than cpu b */
+static bool better(struct placement *p, int policy, int a, int b)
+{
+	struct cpu *ca = &p->cpus[a], *cb = &p->cpus[b];
+
+	if (ca->load != cb->load)
+		return ca->load < cb->load;
+	if (policy == LXC_CPUSET_SPREAD &&
+	    p->node_load[ca->node] != p->node_load[cb->node])
+		return p->node_load[ca->node] < p->node_load[cb->node];
+	if (ca->node != cb->node)
+		return ca->node < cb->node;
+	/* keep to one cache while there is room */
+	if (p->llc_load[ca->llc] != p->llc_load[cb->llc])
+		return p->llc_load[ca->llc] < p->llc_load[cb->llc];
+	if (ca->llc != cb->llc)
+		return ca->llc < cb->llc;
+	return a < b;
+}
+
+/*
+ * Marks the chosen cpus, and puts their nodes in p->set.  Returns how
+ * many cpus were chosen.
+ */
+static int choose(struct placement *p, int policy, int count)
+{
+	int i, n, best, node = -1, ncpus = 0, nnodes = 0;
+	struct cpu *c;
+
+	for (i = 0; i < CPUSET_MAX_CPUS; i++) {
+		c = &p->cpus[i];
+		if (c->node < 0)
+			continue;
+		if (!p->node_size[c->node]++)
+			nnodes++;
+		p->node_load[c->node] += c->load;
+		p->llc_load[c->llc] += c->load;
+		ncpus++;
+	}
+	if (!ncpus)
+		return 0;
+
+	if (policy == LXC_CPUSET_NUMA_LOCAL) {
+		/* the node with the least load per cpu, and memory we may use */
+		for (n = 0; n < CPUSET_MAX_NODES; n++) {
+			if (!p->node_size[n] || !p->mems[n])
+				continue;
+			if (node < 0 || p->node_load[n] * p->node_size[node] <
+					p->node_load[node] * p->node_size[n])
+				node = n;
+		}
+		if (node < 0)
+			return 0;
+		ncpus = p->node_size[node];
+		if (count <= 0)
+			count = ncpus;
+	} else if (count <= 0) {
+		/* as many as a node has */
+		count = (ncpus + nnodes - 1) / nnodes;
+	}
+	if (count > ncpus)
+		count = ncpus;
+
+	for (n = 0; n < count; n++) {
+		best = -1;
+		for (i = 0; i < CPUSET_MAX_CPUS; i++) {
+			c = &p->cpus[i];
+			if (c->node < 0 || c->chosen || (node >= 0 && c->node != node))
+				continue;
+			if (best < 0 || better(p, policy, i, best))
+				best = i;
+		}
+		p->cpus[best].chosen = true;
+	}
+
+	memset(p->set, 0, CPUSET_MAX_NODES);
+	for (i = 0; i < CPUSET_MAX_CPUS; i++) {
+		c = &p->cpus[i];
+		if (c->chosen && p->mems[c->node])
+			p->set[c->node] = 1;
+	}
+	/* memory-less nodes, the memory is far whichever is used */
+	if (!memchr(p->set, 1, CPUSET_MAX_NODES))
+		memcpy(p->set, p->mems, CPUSET_MAX_NODES);
+	return count;
+}
+
+static bool write_placement(struct placement *p, int parentfd,
+			    const char *self, const char *name, int policy)
+{
+	char path[NAME_MAX + 16], mems[CPUSET_MAX_NODES * 6];
+	int i, len;
+
+	if (format_list(p->set, CPUSET_MAX_NODES, mems, sizeof(mems)) < 0)
+		return false;
+	for (i = 0; i < CPUSET_MAX_CPUS; i++)
+		p->set[i] = p->cpus[i].chosen;
+	len = format_list(p->set, CPUSET_MAX_CPUS, p->buf, sizeof(p->buf));
+	if (len < 0)
+		return false;
+
+	/* mems first, a cpuset may not be left without any */
+	snprintf(path, sizeof(path), "%s/cpuset.mems", self);
+	if (lxc_writeat(parentfd, path, mems, strlen(mems)) < 0) {
+		SYSERROR("failed to set the cpuset.mems of '%s' to %s", name, mems);
+		return false;
+	}
+	snprintf(path, sizeof(path), "%s/cpuset.cpus", self);
+	if (lxc_writeat(parentfd, path, p->buf, len) < 0) {
+		SYSERROR("failed to set the cpuset.cpus of '%s' to %s", name, p->buf);
+		return false;
+	}
+	INFO("placed '%s' on cpus %s and mems %s by the %s policy", name,
+	     p->buf, mems, policy_names[policy]);
+	return true;
+}
+
+bool lxc_cpuset_place(struct lxc_handler *handler)
+{
+	static const char *const cpus_files[] = {
+		"cpuset.cpus.effective", "cpuset.effective_cpus", "cpuset.cpus", NULL
+	};
+	static const char *const mems_files[] = {
+		"cpuset.mems.effective", "cpuset.effective_mems", "cpuset.mems", NULL
+	};
+	struct lxc_conf *conf = handler->conf;
+	struct placement *p = NULL;
+	struct lxc_list *it;
+	char *path, *self, file[NAME_MAX + 16];
+	int parentfd = -1;
+	bool ok = false;
+
+	if (conf->cpuset_policy == LXC_CPUSET_NONE)
+		return true;
+	lxc_list_for_each(it, &conf->cgroup) {
+		struct lxc_cgroup *cg = it->elem;
+
+		if (!strncmp(cg->subsystem, "cpuset.", 7)) {
+			INFO("lxc.cgroup.%s is set, not placing '%s'",
+			     cg->subsystem, handler->name);
+			return true;
+		}
+	}
+
+	path = cgroup_get_abs_path(handler, "cpuset");
+	if (!path) {
+		INFO("no cpuset cgroup to place '%s' in", handler->name);
+		return true;
+	}
+	self = strrchr(path, '/');
+	if (!self || self == path) {
+		free(path);
+		return true;
+	}
+	*self++ = '\0';
+
+	parentfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (parentfd < 0) {
+		SYSERROR("failed to open %s", path);
+		goto out;
+	}
+	snprintf(file, sizeof(file), "%s/cpuset.cpus", self);
+	if (faccessat(parentfd, file, F_OK, 0)) {
+		INFO("no cpuset controller for '%s'", handler->name);
+		ok = true;
+		goto out;
+	}
+
+	/* containers starting together must not all pick the same idle cpus */
+	if (flock(parentfd, LOCK_EX) < 0)
+		WARN("failed to lock %s: %s", path, strerror(errno));
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		goto out;
+	if (read_parent_list(p, parentfd, cpus_files, p->allowed, CPUSET_MAX_CPUS) < 0 ||
+	    read_parent_list(p, parentfd, mems_files, p->mems, CPUSET_MAX_NODES) < 0) {
+		ERROR("failed to read the cpuset of %s", path);
+		goto out;
+	}
+	read_topology(p);
+	read_loads(p, parentfd, self);
+
+	if (!choose(p, conf->cpuset_policy, conf->cpuset_count)) {
+		WARN("no cpus to place '%s' on, keeping the parent's", handler->name);
+		ok = true;
+		goto out;
+	}
+	ok = write_placement(p, parentfd, self, handler->name, conf->cpuset_policy);
+
+out:
+	/* closing drops the lock */
+	if (parentfd >= 0)
+		close(parentfd);
+	free(p);
+	free(path);
+	return ok;
+}
+
+/*
+ * lxc.cpuset.mempolicy, the NUMA memory policy of the init, which it
+ * keeps across exec and passes on to its children.
+ */
+#ifndef __NR_set_mempolicy
+#  define __NR_set_mempolicy 238
+#endif
+
+static const char *mempolicy_names[] = {
+	[0] = "default",	/* MPOL_DEFAULT */
+	[1] = "preferred",	/* MPOL_PREFERRED */
+	[2] = "bind",		/* MPOL_BIND */
+	[3] = "interleave",	/* MPOL_INTERLEAVE */
+	[4] = "local",		/* MPOL_LOCAL */
+};
+
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+int lxc_mempolicy_parse(const char *value, unsigned long *nodemask)
+{
+	unsigned char nodes[CPUSET_MAX_NODES];
+	const char *list;
+	size_t len;
+	int i, mode;
+
+	list = strchr(value, ':');
+	len = list ? list - value : strlen(value);
+	for (mode = 0; mode < sizeof(mempolicy_names) / sizeof(mempolicy_names[0]); mode++)
+		if (strlen(mempolicy_names[mode]) == len &&
+		    !strncmp(value, mempolicy_names[mode], len))
+			break;
+	if (mode == sizeof(mempolicy_names) / sizeof(mempolicy_names[0]))
+		return -1;
+
+	/* default and local take no nodes, the others need some */
+	if ((mode == 0 || mode == 4) != !list)
+		return -1;
+	if (!list)
+		return mode;
+	if (parse_list(list + 1, nodes, CPUSET_MAX_NODES) < 0)
+		return -1;
+
+	memset(nodemask, 0, LXC_MEMPOLICY_MASK_LONGS * sizeof(unsigned long));
+	for (i = 0; i < CPUSET_MAX_NODES; i++)
+		if (nodes[i])
+			nodemask[i / BITS_PER_LONG] |= 1UL << (i % BITS_PER_LONG);
+	return mode;
+}
+
+int lxc_mempolicy_apply(const char *value)
+{
+	unsigned long nodemask[LXC_MEMPOLICY_MASK_LONGS];
+	int mode;
+
+	mode = lxc_mempolicy_parse(value, nodemask);
+	if (mode < 0) {
+		ERROR("invalid memory policy '%s'", value);
+		return -1;
+	}
+	if (syscall(__NR_set_mempolicy, mode, mode == 0 || mode == 4 ? NULL : nodemask,
+		    mode == 0 || mode == 4 ? 0 : CPUSET_MAX_NODES + 1) < 0) {
+		SYSERROR("failed to set memory policy '%s'", value);
+		return -1;
+	}
+	INFO("memory policy set to '%s'", value);
+	return 0;
+}
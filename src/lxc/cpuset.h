@@ -0,0 +1,56 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef __LXC_CPUSET_H
+#define __LXC_CPUSET_H
+
+#include <stdbool.h>
+
+struct lxc_handler;
+
+/* lxc.cpuset.policy */
+enum lxc_cpuset_policy {
+	LXC_CPUSET_NONE,	/* inherit the parent's cpuset, the default */
+	LXC_CPUSET_SPREAD,	/* least used cpus, on the least used node */
+	LXC_CPUSET_PACK,	/* least used cpus, on the lowest nodes */
+	LXC_CPUSET_NUMA_LOCAL,	/* cpus and memory of the least used node */
+};
+
+extern int lxc_cpuset_policy_parse(const char *value);
+extern const char *lxc_cpuset_policy_name(int policy);
+
+/*
+ * Narrows the cpuset of the container's new cgroup according to
+ * lxc.cpuset.policy, counting how much each cpu is used by the cpusets
+ * of the sibling cgroups.  Does nothing without a policy, or when the
+ * configuration sets lxc.cgroup.cpuset.* itself.
+ */
+extern bool lxc_cpuset_place(struct lxc_handler *handler);
+
+/*
+ * lxc.cpuset.mempolicy is "default", "local", or one of "preferred",
+ * "bind" and "interleave" followed by ':' and a list of nodes, such as
+ * "interleave:0-3".  lxc_mempolicy_parse() returns the MPOL_* mode and
+ * fills @nodemask, or -1 if @value is no policy.  lxc_mempolicy_apply()
+ * sets it for the calling process.
+ */
+#define LXC_MEMPOLICY_MASK_LONGS (1024 / (8 * sizeof(unsigned long)))
+
+extern int lxc_mempolicy_parse(const char *value, unsigned long *nodemask);
+extern int lxc_mempolicy_apply(const char *value);
+
+#endif
@@ -0,0 +1,520 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <mntent.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cgroup.h"
+#include "conf.h"
+#include "criu.h"
+#include "log.h"
+#include "lxccontainer.h"
+#include "network.h"
+#include "start.h"
+#include "utils.h"
+
+lxc_log_define(lxc_criu, lxc);
+
+#define CRIU_BIN "criu"
+
+/*
+ * A run of criu.
+ * @action    : "pre-dump", "dump" or "restore"
+ * @directory : its images, where it logs to @action.log
+ * @prev      : images of the last pre-dump, relative to @directory
+ * @stop      : the dumped container is killed rather than left running
+ * @pid       : the init to dump
+ * @freezer   : freezer cgroup of the container dumped
+ * @cgroup    : cgroup the container is restored in
+ * @pidfile   : where criu writes the pid of the restored init
+ */
+struct criu_opts {
+	struct lxc_conf *conf;
+	const char *action;
+	const char *directory;
+	const char *prev;
+	bool stop;
+	bool verbose;
+	pid_t pid;
+	const char *freezer;
+	const char *cgroup;
+	const char *pidfile;
+};
+
+static void criu_arg(struct lxc_strv *sv, int *err, const char *fmt, ...)
+{
+	char buf[MAXPATHLEN * 2];
+	va_list ap;
+	int ret;
+
+	if (*err)
+		return;
+	va_start(ap, fmt);
+	ret = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (ret < 0 || ret >= sizeof(buf) || lxc_strv_add(sv, buf, ret) < 0)
+		*err = -1;
+}
+
+/*
+ * The bind mounts of the configuration are external to the container:
+ * criu records them under their path in the container, which a restore
+ * maps back to their source.
+ */
+static void criu_ext_mount(struct lxc_strv *sv, int *err,
+			   struct criu_opts *opts, struct mntent *mntent)
+{
+	const char *dir = mntent->mnt_dir, *root = opts->conf->rootfs.mount;
+	size_t len = root ? strlen(root) : 0;
+
+	if (!hasmntopt(mntent, "bind"))
+		return;
+	if (len && strncmp(dir, root, len) == 0 &&
+	    (dir[len] == '/' || dir[len] == '\0'))
+		dir += len;
+	dir += strspn(dir, "/");
+
+	criu_arg(sv, err, "--ext-mount-map");
+	if (strcmp(opts->action, "restore") == 0)
+		criu_arg(sv, err, "/%s:%s", dir, mntent->mnt_fsname);
+	else
+		criu_arg(sv, err, "/%s:/%s", dir, dir);
+}
+
+static void criu_ext_mounts(struct lxc_strv *sv, int *err,
+			    struct criu_opts *opts)
+{
+	struct lxc_conf *conf = opts->conf;
+	struct lxc_list *it;
+	struct mntent mntent;
+	char buf[4096], *line;
+	FILE *f;
+
+	if (conf->fstab) {
+		f = setmntent(conf->fstab, "r");
+		if (!f) {
+			SYSERROR("failed to use '%s'", conf->fstab);
+			*err = -1;
+			return;
+		}
+		while (getmntent_r(f, &mntent, buf, sizeof(buf)))
+			criu_ext_mount(sv, err, opts, &mntent);
+		endmntent(f);
+	}
+
+	lxc_list_for_each(it, &conf->mount_list) {
+		line = strdup(it->elem);
+		if (!line) {
+			*err = -1;
+			return;
+		}
+		if (lxc_parse_mntent(line, &mntent) == 0)
+			criu_ext_mount(sv, err, opts, &mntent);
+		free(line);
+	}
+}
+
+static char **criu_argv(struct criu_opts *opts)
+{
+	struct lxc_strv sv = LXC_STRV_INIT;
+	struct lxc_list *it;
+	struct lxc_netdev *netdev;
+	const char *ps = opts->conf->checkpoint_page_server, *port;
+	bool predump = strcmp(opts->action, "pre-dump") == 0;
+	bool restore = strcmp(opts->action, "restore") == 0;
+	int err = 0;
+
+	criu_arg(&sv, &err, CRIU_BIN);
+	criu_arg(&sv, &err, "%s", opts->action);
+	criu_arg(&sv, &err, "-D");
+	criu_arg(&sv, &err, "%s", opts->directory);
+	criu_arg(&sv, &err, "-o");
+	criu_arg(&sv, &err, "%s.log", opts->action);
+	if (opts->verbose)
+		criu_arg(&sv, &err, "-v4");
+
+	if (!restore) {
+		criu_arg(&sv, &err, "-t");
+		criu_arg(&sv, &err, "%d", opts->pid);
+		criu_arg(&sv, &err, "--freeze-cgroup");
+		criu_arg(&sv, &err, "%s", opts->freezer);
+		if (opts->prev) {
+			criu_arg(&sv, &err, "--prev-images-dir");
+			criu_arg(&sv, &err, "%s", opts->prev);
+		}
+		/* a pre-dump, or the dump after it, only copies what changed */
+		if (predump || opts->prev)
+			criu_arg(&sv, &err, "--track-mem");
+		if (ps) {
+			port = strrchr(ps, ':');
+			criu_arg(&sv, &err, "--page-server");
+			criu_arg(&sv, &err, "--address");
+			criu_arg(&sv, &err, "%.*s", (int)(port - ps), ps);
+			criu_arg(&sv, &err, "--port");
+			criu_arg(&sv, &err, "%s", port + 1);
+		}
+		if (!predump && !opts->stop)
+			criu_arg(&sv, &err, "--leave-running");
+	}
+
+	if (!predump) {
+		criu_arg(&sv, &err, "--tcp-established");
+		criu_arg(&sv, &err, "--file-locks");
+		criu_arg(&sv, &err, "--link-remap");
+		criu_arg(&sv, &err, "--manage-cgroups");
+		criu_ext_mounts(&sv, &err, opts);
+	}
+
+	if (restore) {
+		criu_arg(&sv, &err, "--root");
+		criu_arg(&sv, &err, "%s", opts->conf->rootfs.mount);
+		/* the init comes back as our child, we are its monitor */
+		criu_arg(&sv, &err, "--restore-detached");
+		criu_arg(&sv, &err, "--restore-sibling");
+		criu_arg(&sv, &err, "--pidfile");
+		criu_arg(&sv, &err, "%s", opts->pidfile);
+		criu_arg(&sv, &err, "--cgroup-root");
+		criu_arg(&sv, &err, "%s", opts->cgroup);
+		lxc_list_for_each(it, &opts->conf->network) {
+			netdev = it->elem;
+			if (netdev->type != LXC_NET_VETH)
+				continue;
+			criu_arg(&sv, &err, "--veth-pair");
+			criu_arg(&sv, &err, "%s=%s", netdev->name,
+				 netdev->priv.veth_attr.veth1);
+		}
+	}
+
+	if (err) {
+		lxc_strv_free(&sv);
+		return NULL;
+	}
+	return lxc_strv_finish(&sv);
+}
+
+static int criu_run(struct criu_opts *opts)
+{
+	char **argv;
+	pid_t pid;
+	int ret;
+
+	argv = criu_argv(opts);
+	if (!argv) {
+		ERROR("failed to build the criu %s command", opts->action);
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("failed to fork");
+		free(argv);
+		return -1;
+	}
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		SYSERROR("failed to exec %s", argv[0]);
+		_exit(EXIT_FAILURE);
+	}
+	free(argv);
+
+	ret = wait_for_pid(pid);
+	if (ret)
+		ERROR("criu %s failed, see %s/%s.log", opts->action,
+		      opts->directory, opts->action);
+	return ret;
+}
+
+bool criu_ok(struct lxc_container *c)
+{
+	struct lxc_conf *conf = c->lxc_conf;
+	struct lxc_list *it;
+	struct lxc_netdev *netdev;
+
+	if (am_unpriv()) {
+		ERROR("checkpoint and restore need root");
+		return false;
+	}
+	if (!lxc_list_empty(&conf->id_map)) {
+		ERROR("%s has an id map, criu can't handle it", c->name);
+		return false;
+	}
+
+	/* their ptys are the monitor's, outside of the container */
+	if (conf->tty) {
+		ERROR("lxc.tty must be 0 for criu");
+		return false;
+	}
+	if (!conf->console.path || strcmp(conf->console.path, "none")) {
+		ERROR("lxc.console must be none for criu");
+		return false;
+	}
+
+	lxc_list_for_each(it, &conf->network) {
+		netdev = it->elem;
+		switch (netdev->type) {
+		case LXC_NET_VETH:
+			if (!netdev->name) {
+				ERROR("the veths need an lxc.network.name for criu");
+				return false;
+			}
+			break;
+		case LXC_NET_EMPTY:
+			break;
+		default:
+			ERROR("criu only handles veth and empty networks");
+			return false;
+		}
+	}
+	return true;
+}
+
+bool criu_checkpoint(struct lxc_container *c, const char *directory,
+		     bool stop, bool verbose)
+{
+	struct criu_opts opts = {
+		.conf = c->lxc_conf,
+		.stop = stop,
+		.verbose = verbose,
+	};
+	char *dir = NULL, *freezer = NULL;
+	char cur[MAXPATHLEN], prev[32];
+	int i, n, ret;
+	bool bret = false;
+
+	if (!criu_ok(c))
+		return false;
+	opts.pid = c->init_pid(c);
+	if (opts.pid < 0) {
+		ERROR("%s is not running", c->name);
+		return false;
+	}
+
+	if (mkdir(directory, 0700) < 0 && errno != EEXIST) {
+		SYSERROR("failed to create %s", directory);
+		return false;
+	}
+	dir = realpath(directory, NULL);
+	if (!dir) {
+		SYSERROR("failed to resolve %s", directory);
+		return false;
+	}
+	freezer = lxc_cgroup_get_path("freezer", c->name, c->config_path);
+	if (!freezer) {
+		ERROR("no freezer cgroup for %s", c->name);
+		goto out;
+	}
+	opts.freezer = freezer;
+
+	/*
+	 * Each pre-dump copies the memory with the container only frozen
+	 * while it does, the ones after the first only what changed, so that
+	 * the dump itself freezes it for as short as can be.
+	 */
+	n = c->lxc_conf->checkpoint_predump;
+	for (i = 0; i < n; i++) {
+		ret = snprintf(cur, MAXPATHLEN, "%s/predump.%d", dir, i);
+		if (ret < 0 || ret >= MAXPATHLEN)
+			goto out;
+		if (mkdir(cur, 0700) < 0 && errno != EEXIST) {
+			SYSERROR("failed to create %s", cur);
+			goto out;
+		}
+		snprintf(prev, sizeof(prev), "../predump.%d", i - 1);
+		opts.action = "pre-dump";
+		opts.directory = cur;
+		opts.prev = i ? prev : NULL;
+		if (criu_run(&opts))
+			goto out;
+		INFO("pre-dump %d of %s done", i, c->name);
+	}
+
+	snprintf(prev, sizeof(prev), "predump.%d", n - 1);
+	opts.action = "dump";
+	opts.directory = dir;
+	opts.prev = n ? prev : NULL;
+	if (criu_run(&opts))
+		goto out;
+	NOTICE("checkpointed %s in %s", c->name, dir);
+	bret = true;
+
+out:
+	free(freezer);
+	free(dir);
+	return bret;
+}
+
+struct criu_restore_args {
+	struct lxc_container *c;
+	const char *directory;
+	bool verbose;
+	int statusfd;
+};
+
+static void criu_restore_status(struct criu_restore_args *args, int status)
+{
+	if (args->statusfd < 0)
+		return;
+	if (write(args->statusfd, &status, sizeof(status)) != sizeof(status))
+		SYSERROR("failed to report the restore of %s", args->c->name);
+	close(args->statusfd);
+	args->statusfd = -1;
+}
+
+/*
+ * criu makes the veths along with the network namespace, their host ends
+ * are lxc.network.veth.pair or names of ours
+ */
+static int criu_name_veths(struct lxc_conf *conf)
+{
+	struct lxc_list *it;
+	struct lxc_netdev *netdev;
+	char *veth1;
+
+	lxc_list_for_each(it, &conf->network) {
+		netdev = it->elem;
+		if (netdev->type != LXC_NET_VETH)
+			continue;
+		if (netdev->priv.veth_attr.pair)
+			veth1 = strdup(netdev->priv.veth_attr.pair);
+		else
+			veth1 = lxc_mkifname("vethXXXXXX");
+		if (!veth1) {
+			ERROR("failed to name the host end of %s", netdev->name);
+			return -1;
+		}
+		strncpy(netdev->priv.veth_attr.veth1, veth1, IFNAMSIZ - 1);
+		netdev->priv.veth_attr.veth1[IFNAMSIZ - 1] = '\0';
+		free(veth1);
+	}
+	return 0;
+}
+
+static int criu_attach_veths(struct lxc_conf *conf)
+{
+	struct lxc_list *it;
+	struct lxc_netdev *netdev;
+	char *veth1;
+	int err;
+
+	lxc_list_for_each(it, &conf->network) {
+		netdev = it->elem;
+		if (netdev->type != LXC_NET_VETH)
+			continue;
+		veth1 = netdev->priv.veth_attr.veth1;
+		if (netdev->link) {
+			err = lxc_bridge_attach(netdev->link, veth1);
+			if (err) {
+				ERROR("failed to attach '%s' to the bridge '%s' : %s",
+				      veth1, netdev->link, strerror(-err));
+				return -1;
+			}
+		}
+		err = lxc_netdev_up(veth1);
+		if (err) {
+			ERROR("failed to set %s up : %s", veth1, strerror(-err));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int criu_restore_start(struct lxc_handler *handler, void *data)
+{
+	struct criu_restore_args *args = data;
+	struct criu_opts opts = {
+		.conf = handler->conf,
+		.action = "restore",
+		.directory = args->directory,
+		.verbose = args->verbose,
+	};
+	char pidfile[MAXPATHLEN];
+	pid_t pid = -1;
+	FILE *f;
+	int ret;
+
+	opts.cgroup = cgroup_get_cgroup(handler, "freezer");
+	if (!opts.cgroup) {
+		ERROR("no cgroup for %s", handler->name);
+		return -1;
+	}
+	ret = snprintf(pidfile, MAXPATHLEN, "%s/restore.pid", args->directory);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	opts.pidfile = pidfile;
+
+	if (criu_name_veths(handler->conf) || criu_run(&opts))
+		return -1;
+
+	f = fopen(pidfile, "re");
+	if (!f || fscanf(f, "%d", &pid) != 1 || pid <= 0) {
+		SYSERROR("failed to read the pid of the init from %s", pidfile);
+		pid = -1;
+	}
+	if (f)
+		fclose(f);
+	unlink(pidfile);
+	if (pid < 0)
+		return -1;
+
+	if (criu_attach_veths(handler->conf)) {
+		kill(pid, SIGKILL);
+		return -1;
+	}
+	return pid;
+}
+
+static int criu_restore_post_start(struct lxc_handler *handler, void *data)
+{
+	struct criu_restore_args *args = data;
+
+	criu_restore_status(args, 0);
+	NOTICE("'%s' restored with pid '%d'", handler->name, handler->pid);
+	return 0;
+}
+
+int criu_restore(struct lxc_container *c, const char *directory,
+		 bool verbose, int statusfd)
+{
+	struct lxc_operations ops = {
+		.start = criu_restore_start,
+		.post_start = criu_restore_post_start,
+	};
+	struct criu_restore_args args = {
+		.c = c,
+		.directory = directory,
+		.verbose = verbose,
+		.statusfd = statusfd,
+	};
+	int ret;
+
+	c->lxc_conf->reboot = 0;
+	ret = lxc_restore_start(c->name, c->lxc_conf, c->config_path, &ops,
+				&args);
+	criu_restore_status(&args, -1);
+	return ret;
+}
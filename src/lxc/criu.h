@@ -0,0 +1,44 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef __LXC_CRIU_H
+#define __LXC_CRIU_H
+
+#include <stdbool.h>
+
+struct lxc_container;
+
+/*
+ * Checkpoint and restore of containers by CRIU, the "criu" of the PATH.
+ * See lxc_container::checkpoint and lxc_container::restore.
+ */
+
+/* whether criu can handle the container, logging why not */
+extern bool criu_ok(struct lxc_container *c);
+
+extern bool criu_checkpoint(struct lxc_container *c, const char *directory,
+			    bool stop, bool verbose);
+
+/*
+ * Restores the container from @directory, an absolute path, and runs it
+ * until it stops as its monitor.  0 is written to @statusfd once it runs,
+ * -1 if it could not be restored.  Returns as lxc_start().
+ */
+extern int criu_restore(struct lxc_container *c, const char *directory,
+			bool verbose, int statusfd);
+
+#endif
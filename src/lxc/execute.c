@@ -26,6 +26,8 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 
 #include "conf.h"
 #include "log.h"
@@ -37,6 +39,7 @@ lxc_log_define(lxc_execute, lxc_start);
 struct execute_args {
 	char *const *argv;
 	int quiet;
+	int park[2];	/* lxc-init waits for a claimer on park[1] */
 };
 
 static int execute_start(struct lxc_handler *handler, void* data)
@@ -46,10 +49,20 @@ static int execute_start(struct lxc_handler *handler, void* data)
 	char **argv;
 	int argc = 0, argc_add;
 	char *initpath;
+	char parkfd[20];
 
 	while (my_args->argv[argc++]);
 
 	argc_add = 4;
+	if (my_args->park[1] >= 0) {
+		argc_add++;
+		/* lxc-init has to keep it */
+		if (fcntl(my_args->park[1], F_SETFD, 0)) {
+			SYSERROR("failed to pass the park socket on");
+			goto out1;
+		}
+		snprintf(parkfd, sizeof(parkfd), "--park=%d", my_args->park[1]);
+	}
 	if (my_args->quiet)
 		argc_add++;
 	if (!handler->conf->rootfs.path) {
@@ -70,6 +83,8 @@ static int execute_start(struct lxc_handler *handler, void* data)
 	argv[i++] = initpath;
 	if (my_args->quiet)
 		argv[i++] = "--quiet";
+	if (my_args->park[1] >= 0)
+		argv[i++] = parkfd;
 	if (!handler->conf->rootfs.path) {
 		argv[i++] = "--name";
 		argv[i++] = (char *)handler->name;
@@ -87,7 +102,10 @@ static int execute_start(struct lxc_handler *handler, void* data)
 		argv[i++] = my_args->argv[j];
 	argv[i++] = NULL;
 
-	NOTICE("exec'ing '%s'", my_args->argv[0]);
+	if (my_args->park[1] >= 0)
+		NOTICE("exec'ing %s, parked", initpath);
+	else
+		NOTICE("exec'ing '%s'", my_args->argv[0]);
 
 	execvp(argv[0], argv);
 	SYSERROR("failed to exec %s", argv[0]);
@@ -101,6 +119,12 @@ out1:
 static int execute_post_start(struct lxc_handler *handler, void* data)
 {
 	struct execute_args *my_args = data;
+
+	if (my_args->park[1] >= 0) {
+		NOTICE("parked with pid '%d'", handler->pid);
+		handler->claimfd = my_args->park[0];
+		return 0;
+	}
 	NOTICE("'%s' started with pid '%d'", my_args->argv[0], handler->pid);
 	return 0;
 }
@@ -110,17 +134,45 @@ static struct lxc_operations execute_start_ops = {
 	.post_start = execute_post_start
 };
 
-int lxc_execute(const char *name, char *const argv[], int quiet,
-		struct lxc_conf *conf, const char *lxcpath)
+static int __lxc_execute(const char *name, char *const argv[], int quiet,
+			 bool park, struct lxc_conf *conf, const char *lxcpath)
 {
 	struct execute_args args = {
 		.argv = argv,
-		.quiet = quiet
+		.quiet = quiet,
+		.park = { -1, -1 },
 	};
+	int ret;
 
 	if (lxc_check_inherited(conf, -1))
 		return -1;
 
+	if (park && socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+			       args.park)) {
+		SYSERROR("failed to create the park socket");
+		return -1;
+	}
+
 	conf->is_execute = 1;
-	return __lxc_start(name, conf, &execute_start_ops, &args, lxcpath);
+	ret = __lxc_start(name, conf, &execute_start_ops, &args, lxcpath);
+
+	if (park) {
+		close(args.park[0]);
+		close(args.park[1]);
+	}
+	return ret;
+}
+
+int lxc_execute(const char *name, char *const argv[], int quiet,
+		struct lxc_conf *conf, const char *lxcpath)
+{
+	return __lxc_execute(name, argv, quiet, false, conf, lxcpath);
+}
+
+int lxc_execute_park(const char *name, int quiet, struct lxc_conf *conf,
+		     const char *lxcpath)
+{
+	static char *const noargv[] = { NULL };
+
+	return __lxc_execute(name, noargv, quiet, true, conf, lxcpath);
 }
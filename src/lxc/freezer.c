@@ -27,7 +27,10 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdbool.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
 #include <sys/types.h>
 #include <sys/param.h>
 
@@ -36,6 +39,8 @@
 #include "monitor.h"
 #include "log.h"
 #include "lxc.h"
+#include "cgroup.h"
+#include "utils.h"
 
 lxc_log_define(lxc_freezer, lxc);
 
@@ -50,38 +55,225 @@ lxc_state_t freezer_state(const char *name, const char *lxcpath)
 	return lxc_str2state(v);
 }
 
-static int do_freeze_thaw(int freeze, const char *name, const char *lxcpath)
+/*
+ * A container being frozen or thawed.
+ * @events : its cgroup.events on the unified hierarchy, watched for the
+ *           kernel to report the freezer settled
+ * @state  : its freezer.state on a freezer hierarchy
+ * @wd     : the inotify watch on @events, -1 if there is none
+ * @done   : the freezer settled, or could not be read
+ * @ret    : 0 if it settled, < 0 otherwise
+ *
+ * When neither file can be found, freezer.state is read through the
+ * cgroup driver.
+ */
+struct freezer_wait {
+	const char *name;
+	const char *lxcpath;
+	char *events;
+	char *state;
+	int wd;
+	bool done;
+	int ret;
+};
+
+#define FREEZER_MIN_DELAY	1
+#define FREEZER_MAX_DELAY	1000
+
+static int freezer_read(const char *path, char *buf, size_t size)
 {
-	char v[100];
-	const char *state = freeze ? "FROZEN" : "THAWED";
+	ssize_t ret;
+	int fd;
 
-	if (lxc_cgroup_set("freezer.state", state, name, lxcpath) < 0) {
-		ERROR("Failed to freeze %s:%s", lxcpath, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
 		return -1;
+	ret = read(fd, buf, size - 1);
+	close(fd);
+	if (ret < 0)
+		return -1;
+	buf[ret] = '\0';
+	return 0;
+}
+
+static void freezer_wait_init(struct freezer_wait *w, const char *name,
+			      const char *lxcpath)
+{
+	char *dir;
+
+	memset(w, 0, sizeof(*w));
+	w->name = name;
+	w->lxcpath = lxcpath;
+	w->wd = -1;
+
+	dir = lxc_cgroup_get_path("freezer", name, lxcpath);
+	if (!dir)
+		return;
+	w->events = lxc_append_paths(dir, "cgroup.events");
+	if (w->events && access(w->events, F_OK) < 0) {
+		free(w->events);
+		w->events = NULL;
+		w->state = lxc_append_paths(dir, "freezer.state");
+		if (w->state && access(w->state, F_OK) < 0) {
+			free(w->state);
+			w->state = NULL;
+		}
 	}
-	while (1) {
-		if (lxc_cgroup_get("freezer.state", v, 100, name, lxcpath) < 0) {
-			ERROR("Failed to get new freezer state for %s:%s", lxcpath, name);
-			return -1;
+	free(dir);
+}
+
+static void freezer_wait_free(struct freezer_wait *w)
+{
+	free(w->events);
+	free(w->state);
+}
+
+/*
+ * Check whether the freezer of @w reached @freeze, marking it done once
+ * it did or once it cannot be read anymore.
+ */
+static void freezer_wait_check(struct freezer_wait *w, int freeze)
+{
+	const char *state = freeze ? "FROZEN" : "THAWED";
+	char v[4096], *p;
+	bool settled;
+
+	if (w->events) {
+		if (freezer_read(w->events, v, sizeof(v)) < 0)
+			goto err;
+		p = strstr(v, "frozen ");
+		if (!p)
+			goto err;
+		settled = (p[7] == '1') == !!freeze;
+	} else {
+		if (w->state) {
+			if (freezer_read(w->state, v, sizeof(v)) < 0)
+				goto err;
+		} else if (lxc_cgroup_get("freezer.state", v, 100, w->name,
+					  w->lxcpath) < 0) {
+			goto err;
 		}
-		if (v[strlen(v)-1] == '\n')
-			v[strlen(v)-1] = '\0';
-		if (strncmp(v, state, strlen(state)) == 0) {
-			if (name)
-				lxc_monitor_send_state(name, freeze ? FROZEN : THAWED, lxcpath);
-			return 0;
+		settled = strncmp(v, state, strlen(state)) == 0;
+	}
+
+	if (!settled)
+		return;
+	w->done = true;
+	w->ret = 0;
+	if (w->name)
+		lxc_monitor_send_state(w->name, freeze ? FROZEN : THAWED,
+				       w->lxcpath);
+	return;
+
+err:
+	ERROR("Failed to get new freezer state for %s:%s", w->lxcpath, w->name);
+	w->done = true;
+	w->ret = -1;
+}
+
+/*
+ * Wait for the freezers of all of @ws to settle.  Where the kernel
+ * reports it through cgroup.events, sleep on inotify until it changes;
+ * everything else is polled with a delay doubling from 1ms up to 1s.
+ */
+static void freezer_wait_all(struct freezer_wait *ws, int n, int freeze)
+{
+	struct pollfd pfd = { .fd = -1, .events = POLLIN };
+	char buf[4096];
+	int i, pending, polled, delay = FREEZER_MIN_DELAY;
+
+	for (i = 0; i < n; i++) {
+		if (ws[i].done || !ws[i].events)
+			continue;
+		if (pfd.fd < 0)
+			pfd.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+		if (pfd.fd < 0)
+			break;
+		ws[i].wd = inotify_add_watch(pfd.fd, ws[i].events, IN_MODIFY);
+	}
+
+	for (;;) {
+		pending = polled = 0;
+		for (i = 0; i < n; i++) {
+			if (ws[i].done)
+				continue;
+			freezer_wait_check(&ws[i], freeze);
+			if (ws[i].done)
+				continue;
+			pending++;
+			if (ws[i].wd < 0)
+				polled++;
 		}
-		sleep(1);
+		if (!pending)
+			break;
+
+		/*
+		 * The watches cover every pending container, the timeout
+		 * only guards against a missed event.
+		 */
+		if (poll(&pfd, 1, polled ? delay : FREEZER_MAX_DELAY) > 0)
+			while (read(pfd.fd, buf, sizeof(buf)) > 0)
+				;
+		if (polled && delay < FREEZER_MAX_DELAY)
+			delay = MIN(delay * 2, FREEZER_MAX_DELAY);
 	}
+
+	if (pfd.fd >= 0)
+		close(pfd.fd);
+}
+
+static int do_freeze_thaw_many(int freeze, const char **names,
+			       const char **lxcpaths, int n)
+{
+	struct freezer_wait *ws;
+	const char *state = freeze ? "FROZEN" : "THAWED";
+	int i, done = 0;
+
+	ws = malloc(n * sizeof(*ws));
+	if (!ws)
+		return -1;
+
+	/* start all of them before waiting for any */
+	for (i = 0; i < n; i++) {
+		freezer_wait_init(&ws[i], names[i], lxcpaths[i]);
+		if (freeze && names[i])
+			lxc_monitor_send_state(names[i], FREEZING, lxcpaths[i]);
+		if (lxc_cgroup_set("freezer.state", state, names[i],
+				   lxcpaths[i]) < 0) {
+			ERROR("Failed to %s %s:%s", freeze ? "freeze" : "thaw",
+			      lxcpaths[i], names[i]);
+			ws[i].done = true;
+			ws[i].ret = -1;
+		}
+	}
+
+	freezer_wait_all(ws, n, freeze);
+
+	for (i = 0; i < n; i++) {
+		if (!ws[i].ret)
+			done++;
+		freezer_wait_free(&ws[i]);
+	}
+	free(ws);
+	return done;
 }
 
 int lxc_freeze(const char *name, const char *lxcpath)
 {
-	lxc_monitor_send_state(name, FREEZING, lxcpath);
-	return do_freeze_thaw(1, name, lxcpath);
+	return do_freeze_thaw_many(1, &name, &lxcpath, 1) == 1 ? 0 : -1;
 }
 
 int lxc_unfreeze(const char *name, const char *lxcpath)
 {
-	return do_freeze_thaw(0, name, lxcpath);
+	return do_freeze_thaw_many(0, &name, &lxcpath, 1) == 1 ? 0 : -1;
+}
+
+int lxc_freeze_many(const char **names, const char **lxcpaths, int n)
+{
+	return do_freeze_thaw_many(1, names, lxcpaths, n);
+}
+
+int lxc_unfreeze_many(const char **names, const char **lxcpaths, int n)
+{
+	return do_freeze_thaw_many(0, names, lxcpaths, n);
 }
@@ -32,6 +32,13 @@
 
 #include <fcntl.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
 
 #include "log.h"
 #include "caps.h"
@@ -40,6 +47,24 @@
 #define LXC_LOG_PREFIX_SIZE	32
 #define LXC_LOG_BUFFER_SIZE	512
 
+/*
+ * In buffered mode (lxc.logbuffer) the logfile lines of a thread are
+ * kept in a buffer of LXC_LOG_BUFFERED_SIZE bytes. It is written out
+ * when full, when its oldest line is LXC_LOG_FLUSH_MS old, with any
+ * ERROR or worse, and from lxc_log_close(), exit() and fork().
+ */
+#define LXC_LOG_BUFFERED_SIZE	(16 * LXC_LOG_BUFFER_SIZE)
+#define LXC_LOG_FLUSH_MS	1000
+
+struct log_buffer {
+	int enabled;
+	size_t len;
+	struct timeval since;
+	char data[LXC_LOG_BUFFERED_SIZE];
+};
+
+static void log_formats_reset(void);
+
 #ifdef HAVE_TLS
 __thread int lxc_log_fd = -1;
 static __thread char log_prefix[LXC_LOG_PREFIX_SIZE] = "lxc";
@@ -49,6 +74,7 @@ static __thread char *log_fname = NULL;
  */
 static __thread int lxc_logfile_specified = 0;
 static __thread int lxc_loglevel_specified = 0;
+static __thread struct log_buffer *log_buffer = NULL;
 #else
 int lxc_log_fd = -1;
 static char log_prefix[LXC_LOG_PREFIX_SIZE] = "lxc";
@@ -58,6 +84,7 @@ static char *log_fname = NULL;
  */
 static int lxc_logfile_specified = 0;
 static int lxc_loglevel_specified = 0;
+static struct log_buffer *log_buffer = NULL;
 #endif
 
 lxc_log_define(lxc_log, lxc);
@@ -76,6 +103,692 @@ static int log_append_stderr(const struct lxc_log_appender *appender,
 }
 
 /*---------------------------------------------------------------------------*/
+extern void lxc_log_flush(void)
+{
+	struct log_buffer *b = log_buffer;
+	size_t off = 0;
+	ssize_t ret;
+
+	if (!b || !b->len)
+		return;
+
+	while (lxc_log_fd != -1 && off < b->len) {
+		ret = write(lxc_log_fd, b->data + off, b->len - off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		off += ret;
+	}
+	b->len = 0;
+}
+
+static int log_write(const char *line, size_t len,
+		     struct lxc_log_event *event)
+{
+	struct log_buffer *b = log_buffer;
+	long age;
+
+	if (!b || !b->enabled)
+		return write(lxc_log_fd, line, len);
+
+	if (b->len + len > sizeof(b->data))
+		lxc_log_flush();
+	if (!b->len)
+		b->since = event->timestamp;
+	memcpy(b->data + b->len, line, len);
+	b->len += len;
+
+	age = (event->timestamp.tv_sec - b->since.tv_sec) * 1000 +
+	      (event->timestamp.tv_usec - b->since.tv_usec) / 1000;
+	if (event->priority >= LXC_LOG_PRIORITY_ERROR ||
+	    age >= LXC_LOG_FLUSH_MS)
+		lxc_log_flush();
+	return len;
+}
+
+/*
+ * A child must neither lose what its parent buffered nor write it a
+ * second time, and it may exec at any time: it writes unbuffered.
+ */
+extern void lxc_log_unbuffer_child(void)
+{
+	if (log_buffer)
+		log_buffer->enabled = 0;
+	log_formats_reset();
+}
+
+static void log_buffer_hooks(void)
+{
+	atexit(lxc_log_flush);
+#ifdef HAVE_PTHREAD_ATFORK
+	pthread_atfork(lxc_log_flush, NULL, lxc_log_unbuffer_child);
+#endif
+}
+
+extern int lxc_log_set_buffered(int buffered)
+{
+	static pthread_once_t hooks_once = PTHREAD_ONCE_INIT;
+
+	if (!buffered) {
+		lxc_log_flush();
+		if (log_buffer)
+			log_buffer->enabled = 0;
+		return 0;
+	}
+
+	if (!log_buffer) {
+		log_buffer = malloc(sizeof(*log_buffer));
+		if (!log_buffer) {
+			ERROR("failed to allocate the log buffer");
+			return -1;
+		}
+		log_buffer->len = 0;
+	}
+	pthread_once(&hooks_once, log_buffer_hooks);
+	log_buffer->enabled = 1;
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Binary log format (lxc.logformat = binary).  Rather than formatting
+ * each event, the logfile appender writes its format string once, in a
+ * LXC_LOG_REC_FORMAT record, and then only the raw arguments of the
+ * events using it.  lxc-logdecode renders such a file back to text.
+ *
+ * Every record starts with a struct lxc_log_rec whose first byte is 0,
+ * which a text line never contains, so that a file may mix both.
+ * Format ids are only unique within a thread, the records carry its tid.
+ *
+ * FORMAT payload : prefix '\0' category '\0' format '\0'
+ * EVENT payload  : struct lxc_log_rec_event, then for each argument an
+ *                  int32, an int64, a double, or a uint32 length and the
+ *                  bytes of a string, as told by the conversions of the
+ *                  format.
+ */
+#define LXC_LOG_REC_VERSION	1
+#define LXC_LOG_REC_FORMAT	1
+#define LXC_LOG_REC_EVENT	2
+#define LXC_LOG_FORMATS		1024	/* cached formats, a power of 2 */
+
+struct lxc_log_rec {
+	uint8_t zero;
+	uint8_t version;
+	uint8_t type;
+	uint8_t pad;
+	uint32_t len;		/* of the record, this header included */
+	uint32_t tid;
+	uint32_t id;		/* of the format */
+};
+
+struct lxc_log_rec_event {
+	int64_t sec;
+	int32_t usec;
+	int32_t priority;
+};
+
+enum {
+	LOG_ARG_NONE,
+	LOG_ARG_INT,
+	LOG_ARG_LONG,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_STR,
+	LOG_ARG_PTR,
+	LOG_ARG_ERRNO,
+};
+
+/* one conversion of a format string */
+struct log_spec {
+	const char *start;	/* the '%' */
+	const char *end;	/* past the conversion character */
+	int star_width;
+	int star_prec;
+	char length[3];
+	char conv;
+	int type;
+};
+
+/* parse the conversion at p, which points to a '%' */
+static const char *log_spec_parse(const char *p, struct log_spec *spec)
+{
+	int n = 0;
+
+	memset(spec, 0, sizeof(*spec));
+	spec->start = p++;
+	while (*p && strchr("-+ #0'", *p))
+		p++;
+	if (*p == '*') {
+		spec->star_width = 1;
+		p++;
+	}
+	while (*p >= '0' && *p <= '9')
+		p++;
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			spec->star_prec = 1;
+			p++;
+		}
+		while (*p >= '0' && *p <= '9')
+			p++;
+	}
+	while (*p && strchr("hlLqjzt", *p) && n < 2)
+		spec->length[n++] = *p++;
+	spec->conv = *p;
+	if (*p)
+		p++;
+	spec->end = p;
+
+	switch (spec->conv) {
+	case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+		if (spec->length[0] && strchr("lLqjzt", spec->length[0]))
+			spec->type = LOG_ARG_LONG;
+		else
+			spec->type = LOG_ARG_INT;
+		break;
+	case 'c':
+		spec->type = LOG_ARG_INT;
+		break;
+	case 'e': case 'E': case 'f': case 'F':
+	case 'g': case 'G': case 'a': case 'A':
+		spec->type = LOG_ARG_DOUBLE;
+		break;
+	case 's':
+		spec->type = LOG_ARG_STR;
+		break;
+	case 'p': case 'n':
+		spec->type = LOG_ARG_PTR;
+		break;
+	case 'm':
+		spec->type = LOG_ARG_ERRNO;
+		break;
+	default:
+		spec->type = LOG_ARG_NONE;
+		break;
+	}
+	return p;
+}
+
+struct log_format {
+	const char *fmt;
+	const char *category;
+	uint32_t id;
+};
+
+#ifdef HAVE_TLS
+static __thread int log_binary = 0;
+static __thread uint32_t log_tid = 0;
+static __thread uint32_t log_format_id = 0;
+static __thread struct log_format *log_formats = NULL;
+#else
+static int log_binary = 0;
+static uint32_t log_tid = 0;
+static uint32_t log_format_id = 0;
+static struct log_format *log_formats = NULL;
+#endif
+
+/* growable record under construction */
+struct log_rec_buf {
+	char *data;
+	size_t len;
+	size_t size;
+	char stack[LXC_LOG_BUFFER_SIZE];
+};
+
+static int log_rec_put(struct log_rec_buf *b, const void *p, size_t len)
+{
+	char *data;
+	size_t size;
+
+	if (b->len + len > b->size) {
+		size = b->size * 2;
+		while (size < b->len + len)
+			size *= 2;
+		data = b->data == b->stack ? malloc(size) : realloc(b->data, size);
+		if (!data)
+			return -1;
+		if (b->data == b->stack)
+			memcpy(data, b->stack, b->len);
+		b->data = data;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, p, len);
+	b->len += len;
+	return 0;
+}
+
+static int log_rec_put_str(struct log_rec_buf *b, const char *s)
+{
+	uint32_t len;
+
+	if (!s)
+		s = "(null)";
+	len = strlen(s);
+	if (log_rec_put(b, &len, sizeof(len)))
+		return -1;
+	return log_rec_put(b, s, len);
+}
+
+static void log_rec_init(struct log_rec_buf *b, int type, uint32_t id)
+{
+	struct lxc_log_rec rec = {
+		.version = LXC_LOG_REC_VERSION,
+		.type = type,
+		.tid = log_tid,
+		.id = id,
+	};
+
+	b->data = b->stack;
+	b->size = sizeof(b->stack);
+	b->len = 0;
+	log_rec_put(b, &rec, sizeof(rec));
+}
+
+static int log_rec_write(struct log_rec_buf *b, struct lxc_log_event *event)
+{
+	int ret;
+
+	((struct lxc_log_rec *)b->data)->len = b->len;
+	ret = log_write(b->data, b->len, event);
+	if (b->data != b->stack)
+		free(b->data);
+	return ret;
+}
+
+/* the id of the format of event, written out if it is new */
+static uint32_t log_format_get(struct lxc_log_event *event)
+{
+	struct log_rec_buf b;
+	struct log_format *f;
+	uintptr_t h;
+	int err = 0;
+
+	if (!log_formats) {
+		log_formats = calloc(LXC_LOG_FORMATS, sizeof(*log_formats));
+		if (!log_formats)
+			return 0;
+	}
+	if (!log_tid)
+		log_tid = syscall(SYS_gettid);
+
+	h = ((uintptr_t)event->fmt >> 3) ^ ((uintptr_t)event->category >> 5);
+	f = &log_formats[h & (LXC_LOG_FORMATS - 1)];
+	if (f->id && f->fmt == event->fmt && f->category == event->category)
+		return f->id;
+
+	/* a collision just costs the format being written again */
+	log_rec_init(&b, LXC_LOG_REC_FORMAT, ++log_format_id);
+	err |= log_rec_put(&b, log_prefix, strlen(log_prefix) + 1);
+	err |= log_rec_put(&b, event->category, strlen(event->category) + 1);
+	err |= log_rec_put(&b, event->fmt, strlen(event->fmt) + 1);
+	if (err || log_rec_write(&b, event) < 0)
+		return 0;
+
+	f->fmt = event->fmt;
+	f->category = event->category;
+	f->id = log_format_id;
+	return f->id;
+}
+
+/* forget the formats written, after a fork or a change of prefix */
+static void log_formats_reset(void)
+{
+	if (log_formats)
+		memset(log_formats, 0, LXC_LOG_FORMATS * sizeof(*log_formats));
+	log_tid = 0;
+}
+
+static int log_append_binary(struct lxc_log_event *event)
+{
+	struct lxc_log_rec_event ev = {
+		.sec = event->timestamp.tv_sec,
+		.usec = event->timestamp.tv_usec,
+		.priority = event->priority,
+	};
+	struct log_rec_buf b;
+	struct log_spec spec;
+	const char *p;
+	int saved_errno = errno, err = 0, i;
+	int64_t l;
+	double d;
+	uint32_t id;
+
+	id = log_format_get(event);
+	if (!id)
+		return -1;
+
+	log_rec_init(&b, LXC_LOG_REC_EVENT, id);
+	err |= log_rec_put(&b, &ev, sizeof(ev));
+	for (p = event->fmt; (p = strchr(p, '%')); ) {
+		p = log_spec_parse(p, &spec);
+		for (i = spec.star_width + spec.star_prec; i > 0; i--) {
+			int32_t star = va_arg(*event->vap, int);
+			err |= log_rec_put(&b, &star, sizeof(star));
+		}
+
+		switch (spec.type) {
+		case LOG_ARG_INT: {
+			int32_t v = va_arg(*event->vap, int);
+			err |= log_rec_put(&b, &v, sizeof(v));
+			break;
+		}
+		case LOG_ARG_LONG:
+			if (spec.length[0] == 'l' && spec.length[1] != 'l')
+				l = va_arg(*event->vap, long);
+			else if (spec.length[0] == 'z')
+				l = va_arg(*event->vap, size_t);
+			else if (spec.length[0] == 'j')
+				l = va_arg(*event->vap, intmax_t);
+			else if (spec.length[0] == 't')
+				l = va_arg(*event->vap, ptrdiff_t);
+			else
+				l = va_arg(*event->vap, long long);
+			err |= log_rec_put(&b, &l, sizeof(l));
+			break;
+		case LOG_ARG_DOUBLE:
+			if (spec.length[0] == 'L')
+				d = va_arg(*event->vap, long double);
+			else
+				d = va_arg(*event->vap, double);
+			err |= log_rec_put(&b, &d, sizeof(d));
+			break;
+		case LOG_ARG_STR:
+			err |= log_rec_put_str(&b, va_arg(*event->vap, char *));
+			break;
+		case LOG_ARG_PTR:
+			l = (uintptr_t)va_arg(*event->vap, void *);
+			err |= log_rec_put(&b, &l, sizeof(l));
+			break;
+		case LOG_ARG_ERRNO:
+			err |= log_rec_put_str(&b, strerror(saved_errno));
+			break;
+		}
+	}
+
+	if (err) {
+		if (b.data != b.stack)
+			free(b.data);
+		return -1;
+	}
+	return log_rec_write(&b, event);
+}
+
+extern int lxc_log_set_format(const char *format)
+{
+	if (!format || !strcmp(format, "text")) {
+		log_binary = 0;
+		return 0;
+	}
+	if (!strcmp(format, "binary")) {
+		log_binary = 1;
+		return 0;
+	}
+	ERROR("invalid log format '%s'", format);
+	return -1;
+}
+
+extern const char *lxc_log_get_format(void)
+{
+	return log_binary ? "binary" : "text";
+}
+
+/*
+ * Decoder of the binary log format, see above.  Text lines, either
+ * interleaved or from a file that was never binary, pass through.
+ */
+#define LOG_DECODE_BUCKETS 4096
+
+struct log_decode_format {
+	uint32_t tid;
+	uint32_t id;
+	char *prefix;
+	char *category;
+	char *fmt;
+	struct log_decode_format *next;
+};
+
+struct log_decode_args {
+	const char *p;
+	size_t left;
+};
+
+static int log_decode_get(struct log_decode_args *a, void *dst, size_t len)
+{
+	if (a->left < len)
+		return -1;
+	memcpy(dst, a->p, len);
+	a->p += len;
+	a->left -= len;
+	return 0;
+}
+
+/* a string argument, as a pointer into the record and its length */
+static int log_decode_get_str(struct log_decode_args *a, const char **s,
+			      uint32_t *len)
+{
+	if (log_decode_get(a, len, sizeof(*len)) || a->left < *len)
+		return -1;
+	*s = a->p;
+	a->p += *len;
+	a->left -= *len;
+	return 0;
+}
+
+static void log_decode_message(const char *fmt, struct log_decode_args *a,
+			       FILE *out)
+{
+	struct log_spec spec;
+	const char *p, *q, *s;
+	char cspec[64], *c, *sv;
+	int32_t i32, star;
+	int64_t i64;
+	uint32_t slen;
+	double d;
+
+	for (p = fmt; *p; ) {
+		if (*p != '%') {
+			q = p + strcspn(p, "%");
+			fwrite(p, 1, q - p, out);
+			p = q;
+			continue;
+		}
+		if (p[1] == '%') {
+			fputc('%', out);
+			p += 2;
+			continue;
+		}
+		q = log_spec_parse(p, &spec);
+
+		/* the conversion, with the stars and the length resolved */
+		c = cspec;
+		for (s = spec.start; s < spec.end - 1 && c < cspec + 40; s++) {
+			if (*s == '*') {
+				if (log_decode_get(a, &star, sizeof(star)))
+					return;
+				c += sprintf(c, "%d", star);
+			} else if (!strchr("hlLqjzt", *s)) {
+				*c++ = *s;
+			}
+		}
+		if (spec.type == LOG_ARG_INT)
+			c += sprintf(c, "%s", spec.length);
+		else if (spec.type == LOG_ARG_LONG)
+			c += sprintf(c, "ll");
+		*c++ = spec.conv;
+		*c = '\0';
+
+		switch (spec.type) {
+		case LOG_ARG_INT:
+			if (log_decode_get(a, &i32, sizeof(i32)))
+				return;
+			fprintf(out, cspec, i32);
+			break;
+		case LOG_ARG_LONG:
+			if (log_decode_get(a, &i64, sizeof(i64)))
+				return;
+			fprintf(out, cspec, (long long)i64);
+			break;
+		case LOG_ARG_DOUBLE:
+			if (log_decode_get(a, &d, sizeof(d)))
+				return;
+			fprintf(out, cspec, d);
+			break;
+		case LOG_ARG_STR:
+			if (log_decode_get_str(a, &s, &slen))
+				return;
+			sv = strndup(s, slen);
+			fprintf(out, cspec, sv ? sv : "");
+			free(sv);
+			break;
+		case LOG_ARG_PTR:
+			if (log_decode_get(a, &i64, sizeof(i64)))
+				return;
+			if (spec.conv == 'p')
+				fprintf(out, cspec, (void *)(uintptr_t)i64);
+			break;
+		case LOG_ARG_ERRNO:
+			if (log_decode_get_str(a, &s, &slen))
+				return;
+			fwrite(s, 1, slen, out);
+			break;
+		default:
+			fwrite(spec.start, 1, spec.end - spec.start, out);
+			break;
+		}
+		p = q;
+	}
+}
+
+static struct log_decode_format **log_decode_find(
+		struct log_decode_format **formats, uint32_t tid, uint32_t id)
+{
+	struct log_decode_format **f;
+
+	f = &formats[(tid * 31 + id) & (LOG_DECODE_BUCKETS - 1)];
+	for (; *f; f = &(*f)->next)
+		if ((*f)->tid == tid && (*f)->id == id)
+			break;
+	return f;
+}
+
+static void log_decode_record(struct log_decode_format **formats,
+			      struct lxc_log_rec *rec, char *payload,
+			      size_t len, FILE *out)
+{
+	struct log_decode_format **pf, *f;
+	struct log_decode_args args;
+	struct lxc_log_rec_event ev;
+	char *strs[3];
+	int i;
+
+	pf = log_decode_find(formats, rec->tid, rec->id);
+	if (rec->type == LXC_LOG_REC_FORMAT) {
+		/* prefix, category and format, each '\0' terminated */
+		for (i = 0; i < 3; i++) {
+			strs[i] = payload;
+			payload = memchr(payload, '\0', len);
+			if (!payload)
+				return;
+			payload++;
+			len -= payload - strs[i];
+		}
+		f = *pf;
+		if (!f) {
+			f = calloc(1, sizeof(*f));
+			if (!f)
+				return;
+			f->tid = rec->tid;
+			f->id = rec->id;
+			*pf = f;
+		}
+		free(f->prefix);
+		free(f->category);
+		free(f->fmt);
+		f->prefix = strdup(strs[0]);
+		f->category = strdup(strs[1]);
+		f->fmt = strdup(strs[2]);
+		return;
+	}
+
+	if (rec->type != LXC_LOG_REC_EVENT)
+		return;
+	args.p = payload;
+	args.left = len;
+	if (log_decode_get(&args, &ev, sizeof(ev)))
+		return;
+	f = *pf;
+	fprintf(out, "%15s %10lld.%03d %-8s %s - ",
+		f && f->prefix ? f->prefix : "?", (long long)ev.sec,
+		ev.usec / 1000, lxc_log_priority_to_string(ev.priority),
+		f && f->category ? f->category : "?");
+	if (f && f->fmt)
+		log_decode_message(f->fmt, &args, out);
+	else
+		fprintf(out, "<unknown format %u of thread %u>", rec->id,
+			rec->tid);
+	fputc('\n', out);
+}
+
+extern int lxc_log_decode(FILE *in, FILE *out)
+{
+	struct log_decode_format **formats, *f, *next;
+	struct lxc_log_rec rec;
+	char *line = NULL, *payload;
+	size_t n = 0, len;
+	int c, i, ret = -1;
+
+	formats = calloc(LOG_DECODE_BUCKETS, sizeof(*formats));
+	if (!formats)
+		return -1;
+
+	while ((c = getc(in)) != EOF) {
+		if (c) {
+			ungetc(c, in);
+			if (getline(&line, &n, in) < 0)
+				break;
+			fputs(line, out);
+			continue;
+		}
+
+		rec.zero = 0;
+		if (fread((char *)&rec + 1, sizeof(rec) - 1, 1, in) != 1)
+			goto out;
+		if (rec.version != LXC_LOG_REC_VERSION ||
+		    rec.len < sizeof(rec) || rec.len > (1 << 24)) {
+			fprintf(stderr, "bad log record at offset %ld\n",
+				ftell(in) - (long)sizeof(rec));
+			goto out;
+		}
+		len = rec.len - sizeof(rec);
+		payload = malloc(len + 1);
+		if (!payload)
+			goto out;
+		if (len && fread(payload, len, 1, in) != 1) {
+			free(payload);
+			goto out;
+		}
+		payload[len] = '\0';
+		log_decode_record(formats, &rec, payload, len, out);
+		free(payload);
+	}
+	ret = 0;
+
+out:
+	for (i = 0; i < LOG_DECODE_BUCKETS; i++) {
+		for (f = formats[i]; f; f = next) {
+			next = f->next;
+			free(f->prefix);
+			free(f->category);
+			free(f->fmt);
+			free(f);
+		}
+	}
+	free(formats);
+	free(line);
+	return ret;
+}
+
 static int log_append_logfile(const struct lxc_log_appender *appender,
 			      struct lxc_log_event *event)
 {
@@ -86,6 +799,9 @@ static int log_append_logfile(const struct lxc_log_appender *appender,
 	if (lxc_log_fd == -1)
 		return 0;
 
+	if (log_binary)
+		return log_append_binary(event);
+
 	ms = event->timestamp.tv_usec / 1000;
 	n = snprintf(buffer, sizeof(buffer),
 		     "%15s %10ld.%03d %-8s %s - ",
@@ -106,7 +822,7 @@ static int log_append_logfile(const struct lxc_log_appender *appender,
 
 	buffer[n] = '\n';
 
-	return write(lxc_log_fd, buffer, n + 1);
+	return log_write(buffer, n + 1, event);
 }
 
 static struct lxc_log_appender log_appender_stderr = {
@@ -126,15 +842,84 @@ static struct lxc_log_category log_root = {
 	.priority	= LXC_LOG_PRIORITY_ERROR,
 	.appender	= NULL,
 	.parent		= NULL,
+	.effective	= LXC_LOG_PRIORITY_ERROR,
 };
 
 struct lxc_log_category lxc_log_category_lxc = {
 	.name		= "lxc",
 	.priority	= LXC_LOG_PRIORITY_ERROR,
 	.appender	= &log_appender_stderr,
-	.parent		= &log_root
+	.parent		= &log_root,
+	.effective	= LXC_LOG_PRIORITY_ERROR,
 };
 
+/*
+ * All the categories, so that a change of level is applied to them at
+ * once rather than looked up along the parents on every event.
+ */
+static struct lxc_log_category *log_categories = NULL;
+static pthread_mutex_t log_categories_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int log_category_effective(const struct lxc_log_category *category)
+{
+	while (category->priority == LXC_LOG_PRIORITY_NOTSET &&
+	       category->parent)
+		category = category->parent;
+	return category->priority;
+}
+
+static void log_categories_refresh(void)
+{
+	struct lxc_log_category *c;
+
+	pthread_mutex_lock(&log_categories_lock);
+	log_root.effective = log_category_effective(&log_root);
+	lxc_log_category_lxc.effective =
+		log_category_effective(&lxc_log_category_lxc);
+	for (c = log_categories; c; c = c->next)
+		c->effective = log_category_effective(c);
+	pthread_mutex_unlock(&log_categories_lock);
+}
+
+extern void lxc_log_category_register(struct lxc_log_category *category)
+{
+	pthread_mutex_lock(&log_categories_lock);
+	category->next = log_categories;
+	log_categories = category;
+	category->effective = log_category_effective(category);
+	pthread_mutex_unlock(&log_categories_lock);
+}
+
+/*
+ * Set the level of the categories called name, or lxc_name, apart from
+ * the one they inherit.  LXC_LOG_PRIORITY_NOTSET makes them inherit it
+ * again.  Returns the number of categories changed.
+ */
+extern int lxc_log_set_category_level(const char *name, int level)
+{
+	struct lxc_log_category *c;
+	int n = 0;
+
+	if (level < 0 || level > LXC_LOG_PRIORITY_NOTSET) {
+		ERROR("invalid log priority %d", level);
+		return -1;
+	}
+
+	pthread_mutex_lock(&log_categories_lock);
+	for (c = log_categories; c; c = c->next) {
+		if (strcmp(c->name, name) &&
+		    (strncmp(c->name, "lxc_", 4) || strcmp(c->name + 4, name)))
+			continue;
+		c->priority = level;
+		n++;
+	}
+	pthread_mutex_unlock(&log_categories_lock);
+
+	if (n)
+		log_categories_refresh();
+	return n;
+}
+
 /*---------------------------------------------------------------------------*/
 static int build_dir(const char *name)
 {
@@ -191,6 +976,60 @@ static int log_open(const char *name)
 	return newfd;
 }
 
+/*
+ * Connect to the log collector listening on the abstract socket @sockname.
+ * The collector learns who is talking from our own address,
+ * "lxc/log/$pid/$name", so that nothing has to be added to the records.
+ * Returns the connected datagram socket, or -1 on failure.
+ */
+static int log_collector_open(const char *sockname, const char *name)
+{
+	struct sockaddr_un addr;
+	struct timeval tv = { .tv_sec = 1 };
+	socklen_t addrlen;
+	int fd, newfd, len;
+
+	if (strlen(sockname) >= sizeof(addr.sun_path) - 1)
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+		       "lxc/log/%d/%s", getpid(), name);
+	if (len < 0 || len >= sizeof(addr.sun_path) - 1)
+		goto err;
+	addrlen = offsetof(struct sockaddr_un, sun_path) + len + 1;
+	if (bind(fd, (struct sockaddr *)&addr, addrlen) < 0)
+		goto err;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	len = strlen(sockname);
+	memcpy(addr.sun_path + 1, sockname, len);
+	addrlen = offsetof(struct sockaddr_un, sun_path) + len + 1;
+	if (connect(fd, (struct sockaddr *)&addr, addrlen) < 0)
+		goto err;
+
+	/* rather lose records than stall the container behind the collector */
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+		goto err;
+
+	if (fd > 2)
+		return fd;
+
+	newfd = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+	close(fd);
+	return newfd;
+
+err:
+	close(fd);
+	return -1;
+}
+
 /*
  * Build the path to the log file
  * @name     : the name of the container
@@ -257,6 +1096,7 @@ static int __lxc_log_set_file(const char *fname, int create_dirs)
 {
 	if (lxc_log_fd != -1) {
 		// we are overriding the default.
+		lxc_log_flush();
 		close(lxc_log_fd);
 		free(log_fname);
 	}
@@ -305,6 +1145,7 @@ extern int lxc_log_init(const char *name, const char *file,
 			const char *lxcpath)
 {
 	int lxc_priority = LXC_LOG_PRIORITY_ERROR;
+	const char *collector;
 	int ret;
 
 	if (lxc_log_fd != -1) {
@@ -316,6 +1157,7 @@ extern int lxc_log_init(const char *name, const char *file,
 		lxc_priority = lxc_log_priority_to_int(priority);
 
 	lxc_log_category_lxc.priority = lxc_priority;
+	log_categories_refresh();
 	lxc_log_category_lxc.appender = &log_appender_logfile;
 
 	if (!quiet)
@@ -338,6 +1180,16 @@ extern int lxc_log_init(const char *name, const char *file,
 		if (!name)
 			return 0;
 
+		/* hand the records to the log collector if there is one */
+		collector = lxc_global_config_value("lxc.logcollector");
+		if (collector) {
+			lxc_log_fd = log_collector_open(collector, name);
+			if (lxc_log_fd >= 0)
+				return 0;
+			INFO("failed to connect to log collector %s, using a log file",
+			     collector);
+		}
+
 		ret = -1;
 
 		if (!lxcpath)
@@ -372,6 +1224,7 @@ extern void lxc_log_close(void)
 {
 	if (lxc_log_fd == -1)
 		return;
+	lxc_log_flush();
 	close(lxc_log_fd);
 	lxc_log_fd = -1;
 	free(log_fname);
@@ -392,6 +1245,7 @@ extern int lxc_log_set_level(int level)
 		return -1;
 	}
 	lxc_log_category_lxc.priority = level;
+	log_categories_refresh();
 	return 0;
 }
 
@@ -427,6 +1281,7 @@ extern const char *lxc_log_get_file(void)
 
 extern void lxc_log_set_prefix(const char *prefix)
 {
+	log_formats_reset();
 	strncpy(log_prefix, prefix, sizeof(log_prefix));
 	log_prefix[sizeof(log_prefix) - 1] = 0;
 }
@@ -96,14 +96,24 @@ struct lxc_log_appender {
 	struct lxc_log_appender	*next;
 };
 
-/* log category object */
+/*
+ * log category object
+ *
+ * @effective is the priority the category logs at, that is its own or
+ * the one it inherits from its parents.  It is kept up to date for every
+ * registered category by lxc_log_set_level() and friends.
+ */
 struct lxc_log_category {
 	const char			*name;
 	int				priority;
 	struct lxc_log_appender		*appender;
 	const struct lxc_log_category	*parent;
+	int				effective;
+	struct lxc_log_category		*next;
 };
 
+extern void lxc_log_category_register(struct lxc_log_category *category);
+
 /*
  * Returns true if the chained priority is equal to or higher than
  * given priority.
@@ -112,11 +122,7 @@ static inline int
 lxc_log_priority_is_enabled(const struct lxc_log_category* category,
 			   int priority)
 {
-	while (category->priority == LXC_LOG_PRIORITY_NOTSET &&
-	       category->parent)
-		category = category->parent;
-
-	return priority >= category->priority;
+	return priority >= category->effective;
 }
 
 /*
@@ -221,8 +227,16 @@ ATTR_UNUSED static inline void LXC_##PRIORITY(struct lxc_log_locinfo* locinfo,	\
 		#name,							\
 		LXC_LOG_PRIORITY_NOTSET,				\
 		NULL,							\
-		&lxc_log_category_##parent				\
-	};
+		&lxc_log_category_##parent,				\
+		LXC_LOG_PRIORITY_ERROR,					\
+		NULL							\
+	};								\
+									\
+	static void __attribute__((constructor))			\
+	lxc_log_category_register_##name(void)				\
+	{								\
+		lxc_log_category_register(&lxc_log_category_##name);	\
+	}
 
 #define lxc_log_define(name, parent)					\
 	lxc_log_category_define(name, parent)				\
@@ -312,4 +326,11 @@ extern int lxc_log_get_level(void);
 extern bool lxc_log_has_valid_level(void);
 extern const char *lxc_log_get_prefix(void);
 extern void lxc_log_options_no_override();
+extern int lxc_log_set_buffered(int buffered);
+extern void lxc_log_flush(void);
+extern void lxc_log_unbuffer_child(void);
+extern int lxc_log_set_format(const char *format);
+extern const char *lxc_log_get_format(void);
+extern int lxc_log_decode(FILE *in, FILE *out);
+extern int lxc_log_set_category_level(const char *name, int level);
 #endif
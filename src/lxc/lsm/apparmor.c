@@ -158,9 +158,15 @@ static int apparmor_process_label_set(const char *label, int use_default,
 	return 0;
 }
 
+/* as found by lsm_apparmor_drv_init, rather than probed again */
+static int apparmor_drv_enabled(void)
+{
+	return aa_enabled;
+}
+
 static struct lsm_drv apparmor_drv = {
 	.name = "AppArmor",
-	.enabled           = apparmor_enabled,
+	.enabled           = apparmor_drv_enabled,
 	.process_label_get = apparmor_process_label_get,
 	.process_label_set = apparmor_process_label_set,
 };
@@ -41,13 +41,14 @@ extern struct lsm_drv *lsm_apparmor_drv_init(void);
 extern struct lsm_drv *lsm_selinux_drv_init(void);
 extern struct lsm_drv *lsm_nop_drv_init(void);
 
-__attribute__((constructor))
+/*
+ * The driver is probed once, on first use rather than whenever liblxc is
+ * loaded: most of what links it never starts or attaches to a container.
+ */
 void lsm_init(void)
 {
-	if (drv) {
-		INFO("LSM security driver %s", drv->name);
+	if (drv)
 		return;
-	}
 
 	#if HAVE_APPARMOR
 	drv = lsm_apparmor_drv_init();
@@ -64,33 +65,29 @@ void lsm_init(void)
 
 int lsm_enabled(void)
 {
-	if (drv)
-		return drv->enabled();
-	return 0;
+	static int enabled = -1;
+
+	lsm_init();
+	if (enabled < 0)
+		enabled = drv->enabled();
+	return enabled;
 }
 
 const char *lsm_name(void)
 {
-	if (drv)
-		return drv->name;
-	return "none";
+	lsm_init();
+	return drv->name;
 }
 
 char *lsm_process_label_get(pid_t pid)
 {
-	if (!drv) {
-		ERROR("LSM driver not inited");
-		return NULL;
-	}
+	lsm_init();
 	return drv->process_label_get(pid);
 }
 
 int lsm_process_label_set(const char *label, int use_default, int on_exec)
 {
-	if (!drv) {
-		ERROR("LSM driver not inited");
-		return -1;
-	}
+	lsm_init();
 	return drv->process_label_set(label, use_default, on_exec);
 }
 
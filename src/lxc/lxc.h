@@ -63,6 +63,16 @@ extern int lxc_start(const char *name, char *const argv[], struct lxc_conf *conf
 extern int lxc_execute(const char *name, char *const argv[], int quiet,
 		       struct lxc_conf *conf, const char *lxcpath);
 
+/*
+ * Set up an application container like lxc_execute() does, but leave its
+ * lxc-init waiting for the command, which lxc_cmd_claim() hands it.  What
+ * a job pays for is then only that handover, not the container's creation.
+ * An application container can be claimed once.
+ * Returns the exit code of the command, < 0 otherwise
+ */
+extern int lxc_execute_park(const char *name, int quiet,
+			    struct lxc_conf *conf, const char *lxcpath);
+
 /*
  * Open the monitoring mechanism for a specific container
  * The function will return an fd corresponding to the events
@@ -122,6 +132,22 @@ extern int lxc_freeze(const char *name, const char *lxcpath);
  */
 extern int lxc_unfreeze(const char *name, const char *lxcpath);
 
+/*
+ * Freeze several containers at once, waiting for all of them only after
+ * asking each to freeze
+ * @names    : the containers names
+ * @lxcpaths : the lxcpath of each container
+ * @n        : the number of containers
+ * Returns the number of containers frozen
+ */
+extern int lxc_freeze_many(const char **names, const char **lxcpaths, int n);
+
+/*
+ * Unfreeze several containers at once, see lxc_freeze_many
+ * Returns the number of containers thawed
+ */
+extern int lxc_unfreeze_many(const char **names, const char **lxcpaths, int n);
+
 /*
  * Retrieve the container state
  * @name : the name of the container
@@ -27,6 +27,8 @@
 #include <sys/types.h>
 #include <stdlib.h>
 
+#include <lxc/lxccontainer.h>
+
 #include "attach.h"
 #include "arguments.h"
 #include "config.h"
@@ -48,6 +50,8 @@ static const struct option my_longopts[] = {
 	{"keep-env", no_argument, 0, 501},
 	{"keep-var", required_argument, 0, 502},
 	{"set-var", required_argument, 0, 'v'},
+	{"multi", no_argument, 0, 'm'},
+	{"jobs", required_argument, 0, 'j'},
 	LXC_COMMON_OPTIONS
 };
 
@@ -55,6 +59,7 @@ static int elevated_privileges = 0;
 static signed long new_personality = -1;
 static int namespace_flags = -1;
 static int remount_sys_proc = 0;
+static int multi = 0;
 static lxc_attach_env_policy_t env_policy = LXC_ATTACH_KEEP_ENV;
 static char **extra_env = NULL;
 static ssize_t extra_env_size = 0;
@@ -98,6 +103,8 @@ static int my_parser(struct lxc_arguments* args, int c, char* arg)
 			return -1;
 		break;
 	case 'R': remount_sys_proc = 1; break;
+	case 'm': multi = 1; break;
+	case 'j': args->jobs = atoi(arg); break;
 	case 'a':
 		new_personality = lxc_config_parse_arch(arg);
 		if (new_personality < 0) {
@@ -180,12 +187,94 @@ Options :\n\
                     multiple times.\n\
       --keep-var    Keep an additional environment variable. Only\n\
                     applicable if --clear-env is specified. May be used\n\
-                    multiple times.\n",
+                    multiple times.\n\
+  -m, --multi       NAME is a comma separated list of containers to run\n\
+                    COMMAND in. The output of each container is printed\n\
+                    once COMMAND is done, each line prefixed with NAME.\n\
+  -j, --jobs=N      With --multi, run COMMAND in up to N containers at\n\
+                    once (0 for no limit, default 0).\n",
 	.options  = my_longopts,
 	.parser   = my_parser,
 	.checker  = NULL,
 };
 
+static void print_prefixed(const char *name, const char *out)
+{
+	const char *eol;
+
+	while (*out) {
+		eol = strchr(out, '\n');
+		if (!eol)
+			eol = out + strlen(out);
+		printf("%s: %.*s\n", name, (int)(eol - out), out);
+		out = *eol ? eol + 1 : eol;
+	}
+}
+
+/* run the command in all the containers of the --multi NAME */
+static int attach_multi(lxc_attach_options_t *attach_options)
+{
+	struct lxc_container **list = NULL;
+	char *names, *name, *saveptr = NULL;
+	char **outputs = NULL;
+	int *statuses = NULL;
+	int i, n = 0, ret = 1;
+
+	names = strdup(my_args.name);
+	if (!names)
+		return 1;
+	for (name = strtok_r(names, ",", &saveptr); name;
+	     name = strtok_r(NULL, ",", &saveptr)) {
+		struct lxc_container **tmp;
+
+		tmp = realloc(list, (n + 1) * sizeof(*list));
+		if (!tmp)
+			goto out;
+		list = tmp;
+		list[n] = lxc_container_new(name, my_args.lxcpath[0]);
+		if (!list[n]) {
+			fprintf(stderr, "%s: failed to load the container\n", name);
+			goto out;
+		}
+		n++;
+	}
+
+	statuses = malloc(n * sizeof(*statuses));
+	outputs = malloc(n * sizeof(*outputs));
+	if (!statuses || !outputs)
+		goto out;
+
+	if (lxc_containers_attach_run_wait(list, n, attach_options,
+			my_args.argv[0], (const char * const *)my_args.argv,
+			my_args.jobs, statuses, outputs) < 0)
+		goto out;
+
+	ret = 0;
+	for (i = 0; i < n; i++) {
+		if (outputs[i]) {
+			print_prefixed(list[i]->name, outputs[i]);
+			free(outputs[i]);
+		}
+		if (statuses[i] < 0) {
+			fprintf(stderr, "%s: failed to run the command\n", list[i]->name);
+			ret = 1;
+		} else if (!WIFEXITED(statuses[i]) || WEXITSTATUS(statuses[i])) {
+			fprintf(stderr, "%s: command failed (status %d)\n",
+				list[i]->name, statuses[i]);
+			ret = 1;
+		}
+	}
+
+out:
+	for (i = 0; i < n; i++)
+		lxc_container_put(list[i]);
+	free(list);
+	free(statuses);
+	free(outputs);
+	free(names);
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	int ret;
@@ -220,6 +309,14 @@ int main(int argc, char *argv[])
 	attach_options.extra_env_vars = extra_env;
 	attach_options.extra_keep_env = extra_keep;
 
+	if (multi) {
+		if (!my_args.argc) {
+			lxc_error(&my_args, "--multi needs a COMMAND");
+			return 1;
+		}
+		return attach_multi(&attach_options);
+	}
+
 	if (my_args.argc) {
 		command.program = my_args.argv[0];
 		command.argv = (char**)my_args.argv;
@@ -43,6 +43,7 @@ static int my_parser(struct lxc_arguments* args, int c, char* arg)
 	case 'A': args->ignore_auto = 1; break;
 	case 'g': cmd_groups_list = accumulate_list( arg, ",", cmd_groups_list); break;
 	case 't': args->timeout = atoi(arg); break;
+	case 'j': args->jobs = atoi(arg); break;
 	}
 	return 0;
 }
@@ -56,6 +57,7 @@ static const struct option my_longopts[] = {
 	{"ignore-auto", no_argument, 0, 'A'},
 	{"groups", required_argument, 0, 'g'},
 	{"timeout", required_argument, 0, 't'},
+	{"jobs", required_argument, 0, 'j'},
 	{"help", no_argument, 0, 'h'},
 	LXC_COMMON_OPTIONS
 };
@@ -75,11 +77,14 @@ Options:\n\
   -a, --all         list all auto-started containers (ignore groups)\n\
   -A, --ignore-auto ignore lxc.start.auto and select all matching containers\n\
   -g, --groups      list of groups (comma separated) to select\n\
-  -t, --timeout=T   wait T seconds before hard-stopping\n",
+  -t, --timeout=T   wait T seconds before hard-stopping\n\
+  -j, --jobs=N      start, shutdown or kill up to N containers at once\n\
+                    (0 for no limit, default 1)\n",
 	.options  = my_longopts,
 	.parser   = my_parser,
 	.checker  = NULL,
 	.timeout = 60,
+	.jobs = 1,
 };
 
 int list_contains_entry( char *str_ptr, struct lxc_list *p1 ) {
@@ -330,6 +335,8 @@ int main(int argc, char *argv[])
 	struct lxc_container **containers = NULL;
 	struct lxc_list **c_groups_lists = NULL;
 	struct lxc_list *cmd_group;
+	struct lxc_container **batch = NULL;
+	int *batch_idx = NULL, nbatch;
 	char *const default_start_args[] = {
 		"/sbin/init",
 		NULL,
@@ -355,6 +362,16 @@ int main(int argc, char *argv[])
 
 	qsort(&containers[0], count, sizeof(struct lxc_container *), cmporder);
 
+	if (my_args.jobs != 1 && !my_args.list && !my_args.reboot) {
+		/* Containers of a group are then handled all together */
+		batch = calloc(count, sizeof(*batch));
+		batch_idx = calloc(count, sizeof(*batch_idx));
+		if (count && (!batch || !batch_idx)) {
+			fprintf(stderr, "Failed to allocate memory\n");
+			return 1;
+		}
+	}
+
 	if (cmd_groups_list && my_args.all) {
 		fprintf(stderr, "Specifying -a (all) with -g (groups) doesn't make sense. All option overrides.");
 	}
@@ -370,6 +387,7 @@ int main(int argc, char *argv[])
 	}
 
 	lxc_list_for_each(cmd_group, cmd_groups_list) {
+		nbatch = 0;
 
 		/*
 		 * Prograpmmers Note:
@@ -424,6 +442,13 @@ int main(int argc, char *argv[])
 			/* We have a candidate continer to process */
 			c->want_daemonize(c, 1);
 
+			if (batch) {
+				/* Processed once the whole group is known */
+				batch[nbatch] = c;
+				batch_idx[nbatch++] = i;
+				continue;
+			}
+
 			if (my_args.shutdown) {
 				/* Shutdown the container */
 				if (c->is_running(c)) {
@@ -492,6 +517,38 @@ int main(int argc, char *argv[])
 			}
 		}
 
+		if (!nbatch)
+			continue;
+
+		if (my_args.hardstop && !my_args.shutdown) {
+			if (lxc_containers_stop(batch, nbatch, my_args.jobs) < nbatch)
+				fprintf(stderr, "Error killing some containers\n");
+		} else if (my_args.shutdown) {
+			lxc_containers_shutdown(batch, nbatch, my_args.timeout,
+						my_args.jobs);
+			for (i = 0; i < nbatch; i++) {
+				struct lxc_container *c = batch[i];
+
+				if (c->is_running(c) && !c->stop(c))
+					fprintf(stderr, "Error shutting down container: %s\n", c->name);
+			}
+		} else {
+			lxc_containers_start(batch, nbatch, my_args.jobs);
+			for (i = 0; i < nbatch; i++)
+				if (!batch[i]->is_running(batch[i]))
+					fprintf(stderr, "Error starting container: %s\n", batch[i]->name);
+		}
+
+		for (i = 0; i < nbatch; i++) {
+			int idx = batch_idx[i];
+
+			if (lxc_container_put(batch[i]) > 0)
+				containers[idx] = NULL;
+			if (c_groups_lists && c_groups_lists[idx]) {
+				toss_list(c_groups_lists[idx]);
+				c_groups_lists[idx] = NULL;
+			}
+		}
 	}
 
 	/* clean up any lingering detritus */
@@ -512,6 +569,8 @@ int main(int argc, char *argv[])
 	}
 
 	free(containers);
+	free(batch);
+	free(batch_idx);
 
 	return 0;
 }
@@ -81,6 +81,7 @@ static int my_parser(struct lxc_arguments* args, int c, char* arg)
 	case '4': args->fssize = get_fssize(arg); break;
 	case '5': args->zfsroot = arg; break;
 	case '6': args->dir = arg; break;
+	case '7': args->image = arg; break;
 	}
 	return 0;
 }
@@ -96,6 +97,7 @@ static const struct option my_longopts[] = {
 	{"fssize", required_argument, 0, '4'},
 	{"zfsroot", required_argument, 0, '5'},
 	{"dir", required_argument, 0, '6'},
+	{"image", required_argument, 0, '7'},
 	LXC_COMMON_OPTIONS
 };
 
@@ -154,7 +156,10 @@ Options :\n\
                      (Default: 1G, default unit: M)\n\
   --dir=DIR          Place rootfs directory under DIR\n\
   --zfsroot=PATH     Create zfs under given zfsroot\n\
-                     (Default: tank/lxc)\n",
+                     (Default: tank/lxc)\n\
+  --image=FILE       Use squashfs or erofs image FILE, or import\n\
+                     rootfs tarball FILE, with -B squashfs;\n\
+                     read image FILE lazily, with -B nbd\n",
 	.options  = my_longopts,
 	.parser   = my_parser,
 	.checker  = NULL,
@@ -182,6 +187,13 @@ static bool validate_bdev_args(struct lxc_arguments *a)
 				return false;
 			}
 		}
+		if (strcmp(a->bdevtype, "squashfs") != 0 &&
+		    strcmp(a->bdevtype, "nbd") != 0) {
+			if (a->image) {
+				fprintf(stderr, "--image is only valid with -B squashfs or nbd\n");
+				return false;
+			}
+		}
 	}
 	return true;
 }
@@ -271,6 +283,10 @@ int main(int argc, char *argv[])
 	if (my_args.dir) {
 		spec.dir = my_args.dir;
 	}
+	if (my_args.image) {
+		spec.squashfs.image = my_args.image;
+		spec.nbd.image = my_args.image;
+	}
 
 	if (strcmp(my_args.bdevtype, "_unset") == 0)
 		my_args.bdevtype = NULL;
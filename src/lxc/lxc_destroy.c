@@ -35,25 +35,28 @@ static int my_parser(struct lxc_arguments* args, int c, char* arg)
 {
 	switch (c) {
 	case 'f': args->force = 1; break;
+	case 'a': args->async = 1; break;
 	}
 	return 0;
 }
 
 static const struct option my_longopts[] = {
 	{"force", no_argument, 0, 'f'},
+	{"async", no_argument, 0, 'a'},
 	LXC_COMMON_OPTIONS
 };
 
 static struct lxc_arguments my_args = {
 	.progname = "lxc-destroy",
 	.help     = "\
---name=NAME [-f] [-P lxcpath]\n\
+--name=NAME [-f] [-a] [-P lxcpath]\n\
 \n\
 lxc-destroy destroys a container with the identifier NAME\n\
 \n\
 Options :\n\
   -n, --name=NAME   NAME for name of the container\n\
-  -f, --force       wait for the container to shut down\n",
+  -f, --force       wait for the container to shut down\n\
+  -a, --async       remove the container's files in the background\n",
 	.options  = my_longopts,
 	.parser   = my_parser,
 	.checker  = NULL,
@@ -101,7 +104,7 @@ int main(int argc, char *argv[])
 		c->stop(c);
 	}
 
-	if (!c->destroy(c)) {
+	if (!(my_args.async ? c->destroy_async(c) : c->destroy(c))) {
 		fprintf(stderr, "Destroying %s failed\n", my_args.name);
 		lxc_container_put(c);
 		exit(1);
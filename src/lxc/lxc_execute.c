@@ -30,6 +30,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/wait.h>
 
 #include "caps.h"
 #include "lxc.h"
@@ -40,14 +41,26 @@
 #include "config.h"
 #include "start.h"
 #include "utils.h"
+#include "commands.h"
 
 lxc_log_define(lxc_execute_ui, lxc);
 
 static struct lxc_list defines;
+static int park, claim;
 
 static int my_checker(const struct lxc_arguments* args)
 {
-	if (!args->argc) {
+	if (park && claim) {
+		lxc_error(args, "--park and --claim can't be used together");
+		return -1;
+	}
+
+	if (park && args->argc) {
+		lxc_error(args, "a parked container gets its command when claimed");
+		return -1;
+	}
+
+	if (!park && !args->argc) {
 		lxc_error(args, "missing command to execute !");
 		return -1;
 	}
@@ -60,6 +73,8 @@ static int my_parser(struct lxc_arguments* args, int c, char* arg)
 	switch (c) {
 	case 'f': args->rcfile = arg; break;
 	case 's': return lxc_config_define_add(&defines, arg);
+	case 'p': park = 1; break;
+	case 'c': claim = 1; break;
 	}
 	return 0;
 }
@@ -67,13 +82,15 @@ static int my_parser(struct lxc_arguments* args, int c, char* arg)
 static const struct option my_longopts[] = {
 	{"rcfile", required_argument, 0, 'f'},
 	{"define", required_argument, 0, 's'},
+	{"park", no_argument, 0, 'p'},
+	{"claim", no_argument, 0, 'c'},
 	LXC_COMMON_OPTIONS
 };
 
 static struct lxc_arguments my_args = {
 	.progname = "lxc-execute",
 	.help     = "\
---name=NAME -- COMMAND\n\
+--name=NAME [--park | [--claim] -- COMMAND]\n\
 \n\
 lxc-execute creates a container with the identifier NAME\n\
 and execs COMMAND into this container.\n\
@@ -81,7 +98,10 @@ and execs COMMAND into this container.\n\
 Options :\n\
   -n, --name=NAME      NAME for name of the container\n\
   -f, --rcfile=FILE    Load configuration file FILE\n\
-  -s, --define KEY=VAL Assign VAL to configuration variable KEY\n",
+  -s, --define KEY=VAL Assign VAL to configuration variable KEY\n\
+  -p, --park           Create the container, and wait for --claim\n\
+                       to give the command\n\
+  -c, --claim          Exec COMMAND into the parked container NAME\n",
 	.options  = my_longopts,
 	.parser   = my_parser,
 	.checker  = my_checker,
@@ -106,6 +126,15 @@ int main(int argc, char *argv[])
 		return 1;
 	lxc_log_options_no_override();
 
+	if (claim) {
+		ret = lxc_cmd_claim(my_args.name, my_args.argv, my_args.lxcpath[0]);
+		if (ret < 0)
+			return 1;
+		if (WIFSIGNALED(ret))
+			return 128 + WTERMSIG(ret);
+		return WEXITSTATUS(ret);
+	}
+
 	/* rcfile is specified in the cli option */
 	if (my_args.rcfile)
 		rcfile = (char *)my_args.rcfile;
@@ -139,7 +168,12 @@ int main(int argc, char *argv[])
 	if (lxc_config_define_load(&defines, conf))
 		return 1;
 
-	ret = lxc_execute(my_args.name, my_args.argv, my_args.quiet, conf, my_args.lxcpath[0]);
+	if (park)
+		ret = lxc_execute_park(my_args.name, my_args.quiet, conf,
+				       my_args.lxcpath[0]);
+	else
+		ret = lxc_execute(my_args.name, my_args.argv, my_args.quiet,
+				  conf, my_args.lxcpath[0]);
 
 	lxc_conf_free(conf);
 
@@ -21,14 +21,20 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <libgen.h>
+#include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
 #define _GNU_SOURCE
 #include <getopt.h>
@@ -37,6 +43,8 @@
 #include "caps.h"
 #include "error.h"
 #include "utils.h"
+#include "af_unix.h"
+#include "commands.h"
 
 lxc_log_define(lxc_init, lxc);
 
@@ -47,6 +55,7 @@ static const struct option options[] = {
 	{ "logpriority", required_argument, NULL, 'l' },
 	{ "quiet",       no_argument,       NULL, 'q' },
 	{ "lxcpath",     required_argument, NULL, 'P' },
+	{ "park",        required_argument, NULL, 'p' },
 	{ 0, 0, 0, 0 },
 };
 
@@ -65,6 +74,7 @@ static void usage(void) {
 		"  -l, --logpriority=LEVEL  Set log priority to LEVEL\n"
 		"  -q, --quiet              Don't produce any output\n"
 		"  -P, --lxcpath=PATH       Use specified container path\n"
+		"  -p, --park=FD            Wait for the command on socket FD\n"
 		"  -?, --help               Give this help list\n"
 		"\n"
 		"Mandatory or optional arguments to long options are also mandatory or optional\n"
@@ -74,6 +84,104 @@ static void usage(void) {
 		"      and does not need to be run by hand\n\n");
 }
 
+/*
+ * Wait on @parkfd for someone to claim the container, and take the
+ * command to run and its stdin, stdout and stderr from them.  Returns
+ * the connection to the claimer, which gets the command's status, or -1
+ * if we should just go away.
+ */
+static int wait_for_claim(int parkfd, const sigset_t *mask, char ***argvp,
+			  int *fds)
+{
+	struct pollfd pfd = { .fd = parkfd, .events = POLLIN };
+	struct lxc_cmd_claim_job job;
+	struct iovec iov[2];
+	char *buf = NULL, *p, **argv = NULL;
+	int i, conn = -1, flags, ret;
+
+	for (;;) {
+		ret = ppoll(&pfd, 1, NULL, mask);
+		if (ret > 0)
+			break;
+		if (ret < 0 && errno != EINTR) {
+			SYSERROR("failed to wait for a claim");
+			return -1;
+		}
+		if (was_interrupted && was_interrupted != SIGCHLD) {
+			INFO("got signal %d while parked", was_interrupted);
+			return -1;
+		}
+		was_interrupted = 0;
+	}
+
+	ret = lxc_abstract_unix_recv_fd(parkfd, &conn, NULL, 0);
+	if (ret <= 0 || conn < 0) {
+		if (ret < 0)
+			SYSERROR("failed to receive the claim");
+		return -1;
+	}
+	close(parkfd);
+
+	/* the monitor accepted it non-blocking */
+	flags = fcntl(conn, F_GETFL);
+	if (flags < 0 || fcntl(conn, F_SETFL, flags & ~O_NONBLOCK) ||
+	    fcntl(conn, F_SETFD, FD_CLOEXEC)) {
+		SYSERROR("failed to set up the claim connection");
+		goto out_err;
+	}
+
+	/* the job comes along with the command line in one message */
+	buf = malloc(LXC_CMD_DATA_MAX);
+	if (!buf) {
+		ERROR("failed to allocate memory");
+		goto out_err;
+	}
+	iov[0].iov_base = &job;
+	iov[0].iov_len = sizeof(job);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = LXC_CMD_DATA_MAX;
+	ret = lxc_abstract_unix_recv_fds_iov(conn, fds, 3, iov, 2);
+	if (ret < (int)sizeof(job) || fds[0] < 0) {
+		ERROR("bad claim");
+		goto out_err;
+	}
+	if (job.argc < 1 || job.len < job.argc || job.len > LXC_CMD_DATA_MAX) {
+		ERROR("bad claim of %d arguments in %d bytes", job.argc, job.len);
+		goto out_err;
+	}
+	if (ret != sizeof(job) + job.len || buf[job.len - 1]) {
+		ERROR("bad claim, command line cut short");
+		goto out_err;
+	}
+
+	argv = malloc((job.argc + 1) * sizeof(*argv));
+	if (!argv) {
+		ERROR("failed to allocate memory");
+		goto out_err;
+	}
+	for (p = buf, i = 0; i < job.argc; i++) {
+		if (p >= buf + job.len) {
+			ERROR("bad claim, not %d arguments", job.argc);
+			goto out_err;
+		}
+		argv[i] = p;
+		p += strlen(p) + 1;
+	}
+	argv[i] = NULL;
+
+	*argvp = argv;
+	return conn;
+
+out_err:
+	free(argv);
+	free(buf);
+	for (i = 0; i < 3; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	close(conn);
+	return -1;
+}
+
 int main(int argc, char *argv[])
 {
 	pid_t pid;
@@ -83,8 +191,11 @@ int main(int argc, char *argv[])
 	int i, have_status = 0, shutdown = 0;
 	int opt;
 	char *lxcpath = NULL, *name = NULL, *logpriority = NULL;
+	int parkfd = -1, claimfd = -1;
+	char *end;
+	int jobfds[3] = { -1, -1, -1 };
 
-	while ((opt = getopt_long(argc, argv, "n:l:qP:", options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "n:l:qP:p:", options, NULL)) != -1) {
 		switch(opt) {
 		case 'n':
 			name = optarg;
@@ -98,6 +209,13 @@ int main(int argc, char *argv[])
 		case 'P':
 			lxcpath = optarg;
 			break;
+		case 'p':
+			parkfd = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || parkfd < 0) {
+				usage();
+				exit(EXIT_FAILURE);
+			}
+			break;
 		default: /* '?' */
 			usage();
 			exit(EXIT_FAILURE);
@@ -110,7 +228,7 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	lxc_log_options_no_override();
 
-	if (!argv[optind]) {
+	if (parkfd < 0 && !argv[optind]) {
 		ERROR("missing command to launch");
 		exit(EXIT_FAILURE);
 	}
@@ -165,6 +283,12 @@ int main(int argc, char *argv[])
 
 	lxc_setup_fs();
 
+	if (parkfd >= 0) {
+		claimfd = wait_for_claim(parkfd, &omask, &aargv, jobfds);
+		if (claimfd < 0)
+			exit(EXIT_FAILURE);
+	}
+
 	pid = fork();
 
 	if (pid < 0)
@@ -181,6 +305,14 @@ int main(int argc, char *argv[])
 			exit(EXIT_FAILURE);
 		}
 
+		/* the claimer's stdin, stdout and stderr */
+		for (i = 0; claimfd >= 0 && i < 3; i++) {
+			if (dup2(jobfds[i], i) < 0) {
+				SYSERROR("failed to set up fd %d", i);
+				exit(EXIT_FAILURE);
+			}
+		}
+
 		NOTICE("about to exec '%s'", aargv[0]);
 
 		execvp(aargv[0], aargv);
@@ -198,6 +330,9 @@ int main(int argc, char *argv[])
 	/* no need of other inherited fds but stderr */
 	close(fileno(stdin));
 	close(fileno(stdout));
+	for (i = 0; i < 3; i++)
+		if (jobfds[i] >= 0)
+			close(jobfds[i]);
 
 	err = EXIT_SUCCESS;
 	for (;;) {
@@ -239,19 +374,33 @@ int main(int argc, char *argv[])
 			goto out;
 		}
 
-		/* reset timer each time a process exited */
-		if (shutdown)
-			alarm(1);
-
 		/*
 		 * keep the exit code of started application
 		 * (not wrapped pid) and continue to wait for
-		 * the end of the orphan group.
+		 * the end of the orphan group.  Reap whatever else
+		 * exited meanwhile before going back to the signals,
+		 * a dying orphan group exits in bursts.
 		 */
-		if (waited_pid == pid && !have_status) {
-			err = lxc_error_set_and_log(waited_pid, status);
-			have_status = 1;
-		}
+		do {
+			if (waited_pid == pid && !have_status) {
+				err = lxc_error_set_and_log(waited_pid, status);
+				have_status = 1;
+
+				/* the claimer waits for just this */
+				if (claimfd >= 0) {
+					if (send(claimfd, &status, sizeof(status),
+						 MSG_NOSIGNAL) != sizeof(status))
+						SYSERROR("failed to report the status");
+					close(claimfd);
+					claimfd = -1;
+				}
+			}
+			waited_pid = waitpid(-1, &status, WNOHANG);
+		} while (waited_pid > 0);
+
+		/* reset timer each time processes exited */
+		if (shutdown)
+			alarm(1);
 	}
 out:
 	if (err < 0)
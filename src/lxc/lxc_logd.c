@@ -0,0 +1,390 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "log.h"
+#include "utils.h"
+
+lxc_log_define(lxc_logd, lxc);
+
+#define LOGD_DEFAULT_SOCK	"lxc/logd"
+#define LOGD_BATCH		64
+#define LOGD_MSGSIZE		65536
+#define LOGD_FILES		256
+#define LOGD_SENDER		"lxc/log/"
+
+/*
+ * An open log file
+ * @name : the container writing to it, "" if the slot is free
+ * @fd   : the file opened for appending
+ * @used : the last batch which wrote to it
+ */
+struct logd_file {
+	char name[NAME_MAX + 1];
+	int fd;
+	unsigned long used;
+};
+
+static struct logd_file files[LOGD_FILES];
+static unsigned long batch;
+static const char *logdir = LOGPATH;
+static volatile sig_atomic_t quit, reopen;
+
+static void logd_sig_handler(int sig)
+{
+	if (sig == SIGHUP)
+		reopen = 1;
+	else
+		quit = 1;
+}
+
+static void logd_files_close(void)
+{
+	int i;
+
+	for (i = 0; i < LOGD_FILES; i++) {
+		if (!files[i].name[0])
+			continue;
+		close(files[i].fd);
+		files[i].name[0] = '\0';
+	}
+}
+
+/*
+ * Find the file of container @name, opening it if needed.  The least
+ * recently used file gets closed to make room, never one the current
+ * batch still has to write to.
+ */
+static struct logd_file *logd_file_get(const char *name)
+{
+	struct logd_file *f, *victim = NULL;
+	char path[PATH_MAX];
+	int i, ret;
+
+	for (i = 0; i < LOGD_FILES; i++) {
+		f = &files[i];
+		if (!f->name[0]) {
+			if (!victim || victim->name[0])
+				victim = f;
+			continue;
+		}
+		if (!strcmp(f->name, name)) {
+			f->used = batch;
+			return f;
+		}
+		if (f->used != batch && (!victim ||
+		    (victim->name[0] && f->used < victim->used)))
+			victim = f;
+	}
+	if (!victim)
+		return NULL;
+
+	ret = snprintf(path, sizeof(path), "%s/%s.log", logdir, name);
+	if (ret < 0 || ret >= sizeof(path))
+		return NULL;
+
+	if (victim->name[0]) {
+		close(victim->fd);
+		victim->name[0] = '\0';
+	}
+	victim->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (victim->fd < 0) {
+		SYSERROR("failed to open %s", path);
+		return NULL;
+	}
+	strcpy(victim->name, name);
+	victim->used = batch;
+	return victim;
+}
+
+/*
+ * Extract the container name from the sender's "lxc/log/$pid/$name"
+ * address, rejecting anything which could escape the log directory.
+ */
+static int logd_sender_name(const struct sockaddr_un *addr, socklen_t len,
+			    char *name)
+{
+	const char *p, *end;
+	size_t n;
+
+	if (len <= offsetof(struct sockaddr_un, sun_path) + 1 ||
+	    addr->sun_path[0] != '\0')
+		return -1;
+	p = addr->sun_path + 1;
+	end = (const char *)addr + len;
+
+	n = strlen(LOGD_SENDER);
+	if (end - p <= n || strncmp(p, LOGD_SENDER, n))
+		return -1;
+	p += n;
+	while (p < end && *p >= '0' && *p <= '9')
+		p++;
+	if (p >= end || *p != '/')
+		return -1;
+	p++;
+
+	n = end - p;
+	if (!n || n > NAME_MAX - 4 || memchr(p, '/', n) || memchr(p, '\0', n))
+		return -1;
+	if ((n == 1 && p[0] == '.') || (n == 2 && p[0] == '.' && p[1] == '.'))
+		return -1;
+	memcpy(name, p, n);
+	name[n] = '\0';
+	return 0;
+}
+
+static int logd_sender_allowed(struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+	struct ucred *cred;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_CREDENTIALS)
+			continue;
+		cred = (struct ucred *)CMSG_DATA(cmsg);
+		return cred->uid == 0 || cred->uid == getuid();
+	}
+	return 0;
+}
+
+static int logd_open(const char *sockname)
+{
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	int fd, opt = 1, size = 4 << 20;
+	size_t len;
+
+	len = strlen(sockname);
+	if (len >= sizeof(addr.sun_path) - 1) {
+		ERROR("socket name %s is too long", sockname);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		SYSERROR("failed to create socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path + 1, sockname, len);
+	addrlen = offsetof(struct sockaddr_un, sun_path) + len + 1;
+	if (bind(fd, (struct sockaddr *)&addr, addrlen) < 0) {
+		SYSERROR("failed to bind to @%s", sockname);
+		close(fd);
+		return -1;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &opt, sizeof(opt)) < 0) {
+		SYSERROR("failed to enable credentials on @%s", sockname);
+		close(fd);
+		return -1;
+	}
+
+	/* give bursts of containers starting at once some room */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+		WARN("failed to grow the receive buffer: %s", strerror(errno));
+
+	return fd;
+}
+
+struct logd_msg {
+	struct sockaddr_un addr;
+	char control[CMSG_SPACE(sizeof(struct ucred))];
+	struct iovec iov;
+	struct logd_file *file;
+};
+
+/*
+ * Write out one batch, gathering each container's records into a single
+ * writev() in the order they arrived.
+ */
+static void logd_write_batch(struct mmsghdr *hdrs, struct logd_msg *msgs,
+			     int count)
+{
+	struct iovec iov[LOGD_BATCH];
+	struct logd_file *file;
+	int i, j, n;
+
+	for (i = 0; i < count; i++) {
+		file = msgs[i].file;
+		if (!file)
+			continue;
+
+		for (n = 0, j = i; j < count; j++) {
+			if (msgs[j].file != file)
+				continue;
+			iov[n].iov_base = msgs[j].iov.iov_base;
+			iov[n].iov_len = hdrs[j].msg_len;
+			n++;
+			msgs[j].file = NULL;
+		}
+		if (writev(file->fd, iov, n) < 0)
+			SYSERROR("failed to write to %s/%s.log", logdir,
+				 file->name);
+	}
+}
+
+static int logd_run(int fd)
+{
+	struct mmsghdr hdrs[LOGD_BATCH];
+	struct logd_msg *msgs;
+	char *data, name[NAME_MAX + 1];
+	int i, count;
+
+	msgs = calloc(LOGD_BATCH, sizeof(*msgs));
+	data = malloc(LOGD_BATCH * LOGD_MSGSIZE);
+	if (!msgs || !data) {
+		ERROR("failed to allocate receive buffers");
+		free(msgs);
+		free(data);
+		return -1;
+	}
+
+	while (!quit) {
+		memset(hdrs, 0, sizeof(hdrs));
+		for (i = 0; i < LOGD_BATCH; i++) {
+			msgs[i].iov.iov_base = data + i * LOGD_MSGSIZE;
+			msgs[i].iov.iov_len = LOGD_MSGSIZE;
+			msgs[i].file = NULL;
+			hdrs[i].msg_hdr.msg_name = &msgs[i].addr;
+			hdrs[i].msg_hdr.msg_namelen = sizeof(msgs[i].addr);
+			hdrs[i].msg_hdr.msg_iov = &msgs[i].iov;
+			hdrs[i].msg_hdr.msg_iovlen = 1;
+			hdrs[i].msg_hdr.msg_control = msgs[i].control;
+			hdrs[i].msg_hdr.msg_controllen = sizeof(msgs[i].control);
+		}
+
+		count = recvmmsg(fd, hdrs, LOGD_BATCH, MSG_WAITFORONE, NULL);
+		if (reopen) {
+			NOTICE("reopening log files");
+			logd_files_close();
+			reopen = 0;
+		}
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			SYSERROR("failed to receive log records");
+			break;
+		}
+
+		batch++;
+		for (i = 0; i < count; i++) {
+			if (!hdrs[i].msg_len ||
+			    (hdrs[i].msg_hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+				continue;
+			if (!logd_sender_allowed(&hdrs[i].msg_hdr))
+				continue;
+			if (logd_sender_name(&msgs[i].addr,
+					     hdrs[i].msg_hdr.msg_namelen, name))
+				continue;
+			msgs[i].file = logd_file_get(name);
+		}
+		logd_write_batch(hdrs, msgs, count);
+	}
+
+	logd_files_close();
+	free(msgs);
+	free(data);
+	return quit ? 0 : -1;
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [-h] [-s socket] [-d logdir]\n", name);
+	printf("\n");
+	printf("  Collects the logs of the containers started on this host and\n");
+	printf("  writes them to logdir/$name.log (default %s).\n", LOGPATH);
+	printf("  socket is the abstract socket name to listen on, lxc.logcollector\n");
+	printf("  from lxc.conf or %s by default.\n", LOGD_DEFAULT_SOCK);
+	printf("  Send SIGHUP to reopen the log files after rotating them.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct sigaction sa;
+	const char *sockname;
+	int fd, opt, ret;
+
+	sockname = lxc_global_config_value("lxc.logcollector");
+	if (!sockname)
+		sockname = LOGD_DEFAULT_SOCK;
+
+	while ((opt = getopt(argc, argv, "hs:d:")) != -1) {
+		switch (opt) {
+		case 's':
+			sockname = optarg;
+			break;
+		case 'd':
+			logdir = optarg;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (lxc_log_init(NULL, "none", "NOTICE", "lxc-logd", 0, NULL))
+		exit(EXIT_FAILURE);
+
+	if (mkdir_p(logdir, 0755)) {
+		ERROR("failed to create %s", logdir);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = logd_sig_handler;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGHUP, &sa, NULL) || sigaction(SIGTERM, &sa, NULL) ||
+	    sigaction(SIGINT, &sa, NULL)) {
+		SYSERROR("failed to set signal handlers");
+		exit(EXIT_FAILURE);
+	}
+
+	fd = logd_open(sockname);
+	if (fd < 0)
+		exit(EXIT_FAILURE);
+
+	NOTICE("pid:%d collecting logs on @%s into %s", getpid(), sockname,
+	       logdir);
+	ret = logd_run(fd);
+	close(fd);
+	NOTICE("exiting");
+	exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,57 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+static void usage(const char *name)
+{
+	printf("usage: %s [-h] [logfile ...]\n", name);
+	printf("\n");
+	printf("  Renders a log written with lxc.logformat = binary as text,\n");
+	printf("  reading the standard input if no logfile is given.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *f;
+	int i, ret = 0;
+
+	if (argc > 1 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help"))) {
+		usage(argv[0]);
+		exit(0);
+	}
+
+	if (argc == 1)
+		exit(lxc_log_decode(stdin, stdout) ? 1 : 0);
+
+	for (i = 1; i < argc; i++) {
+		f = fopen(argv[i], "r");
+		if (!f) {
+			perror(argv[i]);
+			ret = 1;
+			continue;
+		}
+		if (lxc_log_decode(f, stdout))
+			ret = 1;
+		fclose(f);
+	}
+	exit(ret);
+}
@@ -32,6 +32,7 @@
 #include "lxc.h"
 #include "log.h"
 #include "monitor.h"
+#include "memevents.h"
 #include "arguments.h"
 
 lxc_log_define(lxc_monitor_ui, lxc);
@@ -172,6 +173,16 @@ int main(int argc, char *argv[])
 			printf("'%s' changed state to [%s]\n",
 			       msg.name, lxc_state2str(msg.value));
 			break;
+		case lxc_msg_phase:
+			printf("'%s' start phase [%s] took %dus\n", msg.name,
+			       lxc_start_phase_name(LXC_MSG_PHASE(msg.value)),
+			       LXC_MSG_PHASE_USEC(msg.value));
+			break;
+		case lxc_msg_memory:
+			printf("'%s' memory event [%s] x%d\n", msg.name,
+			       lxc_memory_event_name(LXC_MSG_MEMORY(msg.value)),
+			       LXC_MSG_MEMORY_COUNT(msg.value));
+			break;
 		default:
 			/* ignore garbage */
 			break;
@@ -29,6 +29,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <time.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -40,33 +42,102 @@
 
 #include "af_unix.h"
 #include "log.h"
+#include "lxccontainer.h"
 #include "mainloop.h"
 #include "monitor.h"
+#include "state.h"
 #include "utils.h"
 
 #define CLIENTFDS_CHUNK 64
+#define CLIENT_OUT_MAX (128 * sizeof(struct lxc_msg))
+#define FIFO_BATCH 16
+/* what a message takes encoded for either kind of client */
+#define CLIENT_MSG_MAX MAX(sizeof(struct lxc_msg), LXC_MONITOR_FRAME_MAX)
+#define RECENT_LEN 64
+#define STATES_CHUNK 64
+#define IDLE_TIMEOUT (30 * 1000)
 
 lxc_log_define(lxc_monitord, lxc);
 
 static void lxc_monitord_cleanup(void);
 
+/*
+ * Defines the structure to store a subscriber connection. Clients are
+ * non-blocking, what the socket can't take right away is kept in a
+ * bounded buffer and written out when the socket becomes writable again
+ * @fd     : the accepted client file descriptor
+ * @dead   : the client overflowed or failed, it is waiting for its EPOLLHUP
+ * @frames : the client reads struct lxc_monitor_frame rather than lxc_msg
+ * @seq    : sequence number of the last frame sent to the client
+ * @out    : output buffer, CLIENT_OUT_MAX bytes unless a snapshot grew it
+ * @outsize: number of bytes out can hold
+ * @outlen : the count of bytes in out
+ * @outoff : bytes of out already written
+ * @subs   : the messages the client subscribed to, all if subs_cnt is 0
+ * @next   : subscription requests received but not yet committed
+ * @inbuf  : partially received request from the client
+ */
+struct lxc_monitord_client {
+	int fd;
+	int dead;
+	int frames;
+	uint64_t seq;
+	char *out;
+	size_t outsize;
+	size_t outlen;
+	size_t outoff;
+	struct lxc_monitor_sub *subs;
+	int subs_cnt;
+	struct lxc_monitor_sub *next;
+	int next_cnt;
+	char inbuf[sizeof(struct lxc_monitor_sub)];
+	size_t inlen;
+};
+
+/* last state monitord knows of a container, and a message it passed on */
+struct lxc_monitord_state {
+	char name[NAME_MAX+1];
+	int state;
+	uint64_t timestamp;
+};
+
+struct lxc_monitord_event {
+	struct lxc_msg msg;
+	uint64_t timestamp;
+};
+
 /*
  * Defines the structure to store the monitor information
  * @lxcpath        : the path being monitored
  * @fifofd         : the file descriptor for publishers (containers) to write state
  * @listenfd       : the file descriptor for subscribers (lxc-monitors) to connect
- * @clientfds      : accepted client file descriptors
- * @clientfds_size : number of file descriptors clientfds can hold
- * @clientfds_cnt  : the count of valid fds in clientfds
+ * @clients        : accepted clients
+ * @clientfds_size : number of clients the clients array can hold
+ * @clientfds_cnt  : the count of valid entries in clients
+ * @states         : last known state of the containers, see
+ *                   lxc_monitord_states_seed()
+ * @states_size    : number of entries states can hold
+ * @states_cnt     : the count of valid entries in states
+ * @recent         : ring of the last RECENT_LEN messages
+ * @recent_head    : index in recent of the oldest message
+ * @recent_cnt     : the count of valid entries in recent
+ * @idle_timer     : id of the timer ending an idle monitord, 0 if none
  * @descr          : the lxc_mainloop state
  */
 struct lxc_monitor {
 	const char *lxcpath;
 	int fifofd;
 	int listenfd;
-	int *clientfds;
+	struct lxc_monitord_client *clients;
 	int clientfds_size;
 	int clientfds_cnt;
+	struct lxc_monitord_state *states;
+	int states_size;
+	int states_cnt;
+	struct lxc_monitord_event recent[RECENT_LEN];
+	int recent_head;
+	int recent_cnt;
+	int idle_timer;
 	struct lxc_epoll_descr descr;
 };
 
@@ -122,44 +193,492 @@ static int lxc_monitord_fifo_delete(struct lxc_monitor *mon)
 	return 0;
 }
 
+static struct lxc_monitord_client *lxc_monitord_client_find(
+	struct lxc_monitor *mon, int fd)
+{
+	int i;
+
+	for (i = 0; i < mon->clientfds_cnt; i++) {
+		if (mon->clients[i].fd == fd)
+			return &mon->clients[i];
+	}
+	return NULL;
+}
+
+static int lxc_monitord_idle_handler(void *data, struct lxc_epoll_descr *descr)
+{
+	struct lxc_monitor *mon = data;
+
+	mon->idle_timer = 0;
+	return mon->clientfds_cnt <= 0;
+}
+
+/* exit once without clients for IDLE_TIMEOUT */
+static void lxc_monitord_idle_arm(struct lxc_monitor *mon)
+{
+	int id;
+
+	if (mon->idle_timer)
+		return;
+
+	id = lxc_mainloop_add_timer(&mon->descr, IDLE_TIMEOUT, 0,
+				    lxc_monitord_idle_handler, mon);
+	if (id < 0)
+		ERROR("failed to add the idle timer");
+	else
+		mon->idle_timer = id;
+}
+
 static void lxc_monitord_sockfd_remove(struct lxc_monitor *mon, int fd) {
+	struct lxc_monitord_client *client;
 	int i;
 
 	if (lxc_mainloop_del_handler(&mon->descr, fd))
 		CRIT("fd:%d not found in mainloop", fd);
 	close(fd);
 
-	for (i = 0; i < mon->clientfds_cnt; i++) {
-		if (mon->clientfds[i] == fd)
-			break;
-	}
-	if (i >= mon->clientfds_cnt) {
+	client = lxc_monitord_client_find(mon, fd);
+	if (!client) {
 		CRIT("fd:%d not found in clients array", fd);
 		lxc_monitord_cleanup();
 		exit(EXIT_FAILURE);
 	}
+	free(client->out);
+	free(client->subs);
+	free(client->next);
 
-	memmove(&mon->clientfds[i], &mon->clientfds[i+1],
-		(mon->clientfds_cnt - i - 1) * sizeof(mon->clientfds[0]));
+	i = client - mon->clients;
+	memmove(&mon->clients[i], &mon->clients[i+1],
+		(mon->clientfds_cnt - i - 1) * sizeof(mon->clients[0]));
 	mon->clientfds_cnt--;
+
+	if (mon->clientfds_cnt <= 0)
+		lxc_monitord_idle_arm(mon);
+}
+
+/*
+ * The client can't be removed right away since epoll may already have
+ * returned events for it in the current mainloop iteration. Shutting the
+ * socket down makes it report EPOLLHUP, its own handler then removes it.
+ */
+static void lxc_monitord_client_drop(struct lxc_monitord_client *client)
+{
+	client->dead = 1;
+	client->outlen = client->outoff = 0;
+	shutdown(client->fd, SHUT_RDWR);
+}
+
+/*
+ * Append to the client's output. Unless @unbounded, which replays and
+ * snapshots are as they are sent once per subscription, the pending
+ * output may not exceed CLIENT_OUT_MAX.
+ */
+static int lxc_monitord_client_queue(struct lxc_monitord_client *client,
+				     const char *buf, size_t len, int unbounded)
+{
+	char *out;
+	size_t size;
+
+	if (!unbounded && client->outlen - client->outoff + len > CLIENT_OUT_MAX)
+		return -1;
+
+	if (client->outlen + len > client->outsize && client->outoff) {
+		memmove(client->out, client->out + client->outoff,
+			client->outlen - client->outoff);
+		client->outlen -= client->outoff;
+		client->outoff = 0;
+	}
+
+	if (client->outlen + len > client->outsize) {
+		size = client->outsize ? client->outsize : CLIENT_OUT_MAX;
+		while (size < client->outlen + len)
+			size *= 2;
+		out = realloc(client->out, size);
+		if (!out)
+			return -1;
+		client->out = out;
+		client->outsize = size;
+	}
+
+	memcpy(client->out + client->outlen, buf, len);
+	client->outlen += len;
+	return 0;
+}
+
+/*
+ * Write out as much of the client's pending output as the socket takes.
+ * Returns 0 once the buffer is empty, 1 if output is still pending and
+ * -1 on a write error.
+ */
+static int lxc_monitord_client_flush(struct lxc_monitord_client *client)
+{
+	ssize_t ret;
+
+	while (client->outoff < client->outlen) {
+		ret = send(client->fd, client->out + client->outoff,
+			   client->outlen - client->outoff, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			return -1;
+		}
+		client->outoff += ret;
+	}
+
+	client->outlen = client->outoff = 0;
+	return 0;
+}
+
+/*
+ * Append msg to buf in the format the client reads, buf must have room
+ * for CLIENT_MSG_MAX bytes. Returns the number of bytes added.
+ */
+static size_t lxc_monitord_client_encode(struct lxc_monitord_client *client,
+					 struct lxc_msg *msg, uint64_t timestamp,
+					 char *buf)
+{
+	struct lxc_monitor_frame frame;
+	size_t namelen;
+
+	if (!client->frames) {
+		memcpy(buf, msg, sizeof(*msg));
+		return sizeof(*msg);
+	}
+
+	namelen = strlen(msg->name) + 1;
+	frame.len = sizeof(frame) + namelen;
+	frame.version = LXC_MONITOR_FRAME_VERSION;
+	frame.type = msg->type;
+	frame.value = msg->value;
+	frame.seq = ++client->seq;
+	frame.timestamp = timestamp;
+	memcpy(buf, &frame, sizeof(frame));
+	memcpy(buf + sizeof(frame), msg->name, namelen);
+	return frame.len;
+}
+
+/* try writing out what was just queued, @pending if output was before */
+static void lxc_monitord_client_kick(struct lxc_epoll_descr *descr,
+				     struct lxc_monitord_client *client,
+				     int pending)
+{
+	int ret;
+
+	/* EPOLLOUT is already armed, the message goes out in order */
+	if (pending)
+		return;
+
+	ret = lxc_monitord_client_flush(client);
+	if (ret < 0) {
+		ERROR("write failed to client sock:%d %d %s",
+		      client->fd, errno, strerror(errno));
+		lxc_monitord_client_drop(client);
+	} else if (ret > 0 &&
+		   lxc_mainloop_mod_events(descr, client->fd,
+					   EPOLLIN | EPOLLOUT)) {
+		ERROR("failed to watch client sock:%d for writing", client->fd);
+		lxc_monitord_client_drop(client);
+	}
+}
+
+static void lxc_monitord_client_send(struct lxc_epoll_descr *descr,
+				     struct lxc_monitord_client *client,
+				     const char *buf, size_t len)
+{
+	int pending;
+
+	if (client->dead)
+		return;
+
+	DEBUG("writing client fd:%d", client->fd);
+	pending = client->outlen > client->outoff;
+	if (lxc_monitord_client_queue(client, buf, len, 0) < 0) {
+		WARN("client fd:%d is not reading its messages, dropping it",
+		     client->fd);
+		lxc_monitord_client_drop(client);
+		return;
+	}
+
+	lxc_monitord_client_kick(descr, client, pending);
+}
+
+static int lxc_monitord_client_wants(struct lxc_monitord_client *client,
+				     struct lxc_msg *msg)
+{
+	struct lxc_monitor_sub *sub;
+	int i;
+
+	if (!client->subs_cnt)
+		return 1;
+
+	for (i = 0; i < client->subs_cnt; i++) {
+		sub = &client->subs[i];
+		if (sub->types && !(sub->types & (1 << msg->type)))
+			continue;
+		if (sub->flags & LXC_MONITOR_SUB_EXACT) {
+			if (!strcmp(sub->name, msg->name))
+				return 1;
+		} else if (!fnmatch(sub->name, msg->name, 0))
+			return 1;
+	}
+	return 0;
+}
+
+static struct lxc_monitord_state *lxc_monitord_state_find(
+	struct lxc_monitor *mon, const char *name)
+{
+	int i;
+
+	for (i = 0; i < mon->states_cnt; i++) {
+		if (!strcmp(mon->states[i].name, name))
+			return &mon->states[i];
+	}
+	return NULL;
+}
+
+static void lxc_monitord_state_set(struct lxc_monitor *mon, const char *name,
+				   int state, uint64_t timestamp)
+{
+	struct lxc_monitord_state *st;
+
+	/* a thawed container is running again */
+	if (state == THAWED)
+		state = RUNNING;
+
+	st = lxc_monitord_state_find(mon, name);
+	if (!st) {
+		if (mon->states_cnt + 1 > mon->states_size) {
+			st = realloc(mon->states,
+				     (mon->states_size + STATES_CHUNK) *
+				      sizeof(mon->states[0]));
+			if (!st) {
+				ERROR("failed to realloc memory for states");
+				return;
+			}
+			mon->states = st;
+			mon->states_size += STATES_CHUNK;
+		}
+		st = &mon->states[mon->states_cnt++];
+		strncpy(st->name, name, NAME_MAX);
+		st->name[NAME_MAX] = '\0';
+	}
+	st->state = state;
+	st->timestamp = timestamp;
+}
+
+static void lxc_monitord_record(struct lxc_monitor *mon, struct lxc_msg *msg,
+				uint64_t timestamp)
+{
+	struct lxc_monitord_event *ev;
+
+	if (msg->type == lxc_msg_state)
+		lxc_monitord_state_set(mon, msg->name, msg->value, timestamp);
+
+	if (mon->recent_cnt < RECENT_LEN) {
+		ev = &mon->recent[(mon->recent_head + mon->recent_cnt++) % RECENT_LEN];
+	} else {
+		ev = &mon->recent[mon->recent_head];
+		mon->recent_head = (mon->recent_head + 1) % RECENT_LEN;
+	}
+	ev->msg = *msg;
+	ev->timestamp = timestamp;
+}
+
+/*
+ * monitord only learns of state changes once running, so it asks the
+ * containers which already run for their state when it starts. Containers
+ * it has no entry for are not running.
+ */
+static void lxc_monitord_states_seed(struct lxc_monitor *mon)
+{
+	char **names = NULL;
+	const char **states = NULL;
+	int i, n;
+
+	n = list_active_containers(mon->lxcpath, &names, NULL);
+	if (n <= 0)
+		return;
+
+	states = malloc(n * sizeof(*states));
+	if (!states)
+		goto out;
+
+	if (lxc_get_states(mon->lxcpath, (const char **)names, n, states,
+			   NULL) < 0)
+		goto out;
+
+	/* changes queued in the fifo meanwhile are applied on top later */
+	for (i = 0; i < n; i++) {
+		if (states[i])
+			lxc_monitord_state_set(mon, names[i],
+					       lxc_str2state(states[i]), 0);
+	}
+	INFO("seeded the states of %d running containers", n);
+
+out:
+	free(states);
+	lxc_free_array((void **)names, free);
+}
+
+/*
+ * Queue what a LXC_MONITOR_SUB_REPLAY and/or LXC_MONITOR_SUB_SNAPSHOT
+ * request asked for, followed by the empty lxc_msg_snapshot ending it.
+ */
+static void lxc_monitord_client_replay(struct lxc_monitor *mon,
+				       struct lxc_monitord_client *client,
+				       int flags)
+{
+	struct lxc_monitord_event *ev;
+	struct lxc_msg msg;
+	char buf[CLIENT_MSG_MAX];
+	size_t len;
+	int i, pending;
+
+	pending = client->outlen > client->outoff;
+
+	for (i = 0; (flags & LXC_MONITOR_SUB_REPLAY) && i < mon->recent_cnt; i++) {
+		ev = &mon->recent[(mon->recent_head + i) % RECENT_LEN];
+		if (!lxc_monitord_client_wants(client, &ev->msg))
+			continue;
+		len = lxc_monitord_client_encode(client, &ev->msg,
+						 ev->timestamp, buf);
+		if (lxc_monitord_client_queue(client, buf, len, 1) < 0)
+			goto err;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	for (i = 0; (flags & LXC_MONITOR_SUB_SNAPSHOT) && i < mon->states_cnt; i++) {
+		msg.type = lxc_msg_state;
+		strcpy(msg.name, mon->states[i].name);
+		if (!lxc_monitord_client_wants(client, &msg))
+			continue;
+		msg.type = lxc_msg_snapshot;
+		msg.value = mon->states[i].state;
+		len = lxc_monitord_client_encode(client, &msg,
+						 mon->states[i].timestamp, buf);
+		if (lxc_monitord_client_queue(client, buf, len, 1) < 0)
+			goto err;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = lxc_msg_snapshot;
+	msg.value = -1;
+	len = lxc_monitord_client_encode(client, &msg, 0, buf);
+	if (lxc_monitord_client_queue(client, buf, len, 1) < 0)
+		goto err;
+
+	lxc_monitord_client_kick(&mon->descr, client, pending);
+	return;
+
+err:
+	ERROR("failed to queue the snapshot for client fd:%d", client->fd);
+	lxc_monitord_client_drop(client);
+}
+
+static void lxc_monitord_client_subscribe(struct lxc_monitor *mon,
+					  struct lxc_monitord_client *client,
+					  struct lxc_monitor_sub *req)
+{
+	struct lxc_monitor_sub *next;
+	struct lxc_msg ack;
+	char buf[CLIENT_MSG_MAX];
+	size_t len;
+
+	next = realloc(client->next, (client->next_cnt + 1) * sizeof(*next));
+	if (!next) {
+		ERROR("failed to allocate subscription for client fd:%d",
+		      client->fd);
+		lxc_monitord_client_drop(client);
+		return;
+	}
+	client->next = next;
+	client->next[client->next_cnt] = *req;
+	client->next[client->next_cnt].name[NAME_MAX] = '\0';
+	client->next_cnt++;
+
+	if (req->flags & LXC_MONITOR_SUB_MORE)
+		return;
+
+	free(client->subs);
+	client->subs = client->next;
+	client->subs_cnt = client->next_cnt;
+	client->next = NULL;
+	client->next_cnt = 0;
+	DEBUG("client fd:%d subscribed to %d names", client->fd,
+	      client->subs_cnt);
+
+	/* the acknowledgement is the last message in the former format */
+	memset(&ack, 0, sizeof(ack));
+	ack.type = lxc_msg_subscribed;
+	ack.value = client->subs_cnt;
+	len = lxc_monitord_client_encode(client, &ack, 0, buf);
+	lxc_monitord_client_send(&mon->descr, client, buf, len);
+	client->frames = !!(req->flags & LXC_MONITOR_SUB_FRAMES);
+
+	if (!client->dead &&
+	    (req->flags & (LXC_MONITOR_SUB_REPLAY | LXC_MONITOR_SUB_SNAPSHOT)))
+		lxc_monitord_client_replay(mon, client, req->flags);
+}
+
+/*
+ * Clients write either "quit" or struct lxc_monitor_sub requests, the
+ * latter possibly in several pieces.
+ */
+static void lxc_monitord_client_read(struct lxc_monitor *mon,
+				     struct lxc_monitord_client *client)
+{
+	int rc;
+
+	rc = read(client->fd, client->inbuf + client->inlen,
+		  sizeof(client->inbuf) - client->inlen);
+	if (rc <= 0)
+		return;
+	client->inlen += rc;
+
+	if (client->inlen < 4)
+		return;
+
+	if (!strncmp(client->inbuf, "quit", 4)) {
+		quit = 1;
+	} else if (!strncmp(client->inbuf, LXC_MONITOR_SUB_MAGIC, 4)) {
+		if (client->inlen < sizeof(client->inbuf))
+			return;
+		if (!client->dead)
+			lxc_monitord_client_subscribe(mon, client,
+				(struct lxc_monitor_sub *)client->inbuf);
+	}
+	client->inlen = 0;
 }
 
 static int lxc_monitord_sock_handler(int fd, uint32_t events, void *data,
 				     struct lxc_epoll_descr *descr)
 {
 	struct lxc_monitor *mon = data;
+	struct lxc_monitord_client *client;
 
-	if (events & EPOLLIN) {
-		int rc;
-		char buf[4];
+	client = lxc_monitord_client_find(mon, fd);
+	if ((events & EPOLLIN) && client)
+		lxc_monitord_client_read(mon, client);
 
-		rc = read(fd, buf, sizeof(buf));
-		if (rc > 0 && !strncmp(buf, "quit", 4))
-			quit = 1;
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		lxc_monitord_sockfd_remove(mon, fd);
+		return quit;
 	}
 
-	if (events & EPOLLHUP)
-		lxc_monitord_sockfd_remove(mon, fd);
+	if ((events & EPOLLOUT) && client && !client->dead) {
+		switch (lxc_monitord_client_flush(client)) {
+		case 0:
+			lxc_mainloop_mod_events(descr, fd, EPOLLIN);
+			break;
+		case -1:
+			ERROR("write failed to client sock:%d %d %s",
+			      fd, errno, strerror(errno));
+			lxc_monitord_client_drop(client);
+			break;
+		}
+	}
 	return quit;
 }
 
@@ -183,6 +702,12 @@ static int lxc_monitord_sock_accept(int fd, uint32_t events, void *data,
 		goto err1;
 	}
 
+	/* a slow subscriber must never block delivery to the others */
+	if (fcntl(clientfd, F_SETFL, O_NONBLOCK)) {
+		SYSERROR("failed to set non-blocking on incoming connection");
+		goto err1;
+	}
+
 	if (getsockopt(clientfd, SOL_SOCKET, SO_PEERCRED, &cred, &credsz))
 	{
 		ERROR("failed to get credentials on socket");
@@ -195,17 +720,17 @@ static int lxc_monitord_sock_accept(int fd, uint32_t events, void *data,
 	}
 
 	if (mon->clientfds_cnt + 1 > mon->clientfds_size) {
-		int *clientfds;
+		struct lxc_monitord_client *clients;
 		DEBUG("realloc space for %d clientfds",
 		      mon->clientfds_size + CLIENTFDS_CHUNK);
-		clientfds = realloc(mon->clientfds,
-				    (mon->clientfds_size + CLIENTFDS_CHUNK) *
-				     sizeof(mon->clientfds[0]));
-		if (clientfds == NULL) {
+		clients = realloc(mon->clients,
+				  (mon->clientfds_size + CLIENTFDS_CHUNK) *
+				   sizeof(mon->clients[0]));
+		if (clients == NULL) {
 			ERROR("failed to realloc memory for clientfds");
 			goto err1;
 		}
-		mon->clientfds = clientfds;
+		mon->clients = clients;
 		mon->clientfds_size += CLIENTFDS_CHUNK;
 	}
 
@@ -216,8 +741,14 @@ static int lxc_monitord_sock_accept(int fd, uint32_t events, void *data,
 		goto err1;
 	}
 
-	mon->clientfds[mon->clientfds_cnt++] = clientfd;
+	memset(&mon->clients[mon->clientfds_cnt], 0, sizeof(mon->clients[0]));
+	mon->clients[mon->clientfds_cnt++].fd = clientfd;
 	INFO("accepted client fd:%d clients:%d", clientfd, mon->clientfds_cnt);
+
+	if (mon->idle_timer) {
+		lxc_mainloop_del_timer(&mon->descr, mon->idle_timer);
+		mon->idle_timer = 0;
+	}
 	goto out;
 
 err1:
@@ -280,32 +811,57 @@ static void lxc_monitord_delete(struct lxc_monitor *mon)
 	close(mon->fifofd);
 
 	for (i = 0; i < mon->clientfds_cnt; i++) {
-		lxc_mainloop_del_handler(&mon->descr, mon->clientfds[i]);
-		close(mon->clientfds[i]);
+		lxc_mainloop_del_handler(&mon->descr, mon->clients[i].fd);
+		close(mon->clients[i].fd);
+		free(mon->clients[i].out);
+		free(mon->clients[i].subs);
+		free(mon->clients[i].next);
 	}
 	mon->clientfds_cnt = 0;
+
+	free(mon->states);
+	mon->states = NULL;
+	mon->states_cnt = mon->states_size = 0;
 }
 
 static int lxc_monitord_fifo_handler(int fd, uint32_t events, void *data,
 				     struct lxc_epoll_descr *descr)
 {
-	int ret,i;
-	struct lxc_msg msglxc;
+	int ret,i,j,cnt;
+	struct lxc_msg msglxc[FIFO_BATCH];
 	struct lxc_monitor *mon = data;
-
-	ret = read(fd, &msglxc, sizeof(msglxc));
-	if (ret != sizeof(msglxc)) {
+	struct lxc_monitord_client *client;
+	char buf[FIFO_BATCH * CLIENT_MSG_MAX];
+	struct timespec now;
+	uint64_t timestamp;
+	size_t len;
+
+	/* publishers write whole messages, a burst is fanned out at once */
+	ret = read(fd, msglxc, sizeof(msglxc));
+	if (ret < (int)sizeof(msglxc[0])) {
 		SYSERROR("read fifo failed : %s", strerror(errno));
 		return 1;
 	}
+	cnt = ret / sizeof(msglxc[0]);
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	timestamp = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+	for (j = 0; j < cnt; j++) {
+		msglxc[j].name[NAME_MAX] = '\0';
+		lxc_monitord_record(mon, &msglxc[j], timestamp);
+	}
 
 	for (i = 0; i < mon->clientfds_cnt; i++) {
-		DEBUG("writing client fd:%d", mon->clientfds[i]);
-		ret = write(mon->clientfds[i], &msglxc, sizeof(msglxc));
-		if (ret < 0) {
-			ERROR("write failed to client sock:%d %d %s",
-			      mon->clientfds[i], errno, strerror(errno));
+		client = &mon->clients[i];
+		len = 0;
+		for (j = 0; j < cnt; j++) {
+			if (lxc_monitord_client_wants(client, &msglxc[j]))
+				len += lxc_monitord_client_encode(client,
+						&msglxc[j], timestamp, buf + len);
 		}
+		if (len)
+			lxc_monitord_client_send(descr, client, buf, len);
 	}
 
 	return 0;
@@ -329,6 +885,8 @@ static int lxc_monitord_mainloop_add(struct lxc_monitor *mon)
 		return -1;
 	}
 
+	lxc_monitord_idle_arm(mon);
+
 	return 0;
 }
 
@@ -393,6 +951,8 @@ int main(int argc, char *argv[])
 		ERROR("failed to create mainloop");
 		goto out;
 	}
+	/* see all of hundreds of subscribers in one go */
+	lxc_mainloop_set_max_events(&mon.descr, 1024);
 
 	if (lxc_monitord_create(&mon)) {
 		goto out;
@@ -408,6 +968,8 @@ int main(int argc, char *argv[])
 		;
 	close(pipefd);
 
+	lxc_monitord_states_seed(&mon);
+
 	if (lxc_monitord_mainloop_add(&mon)) {
 		ERROR("failed to add mainloop handlers");
 		goto out;
@@ -415,7 +977,7 @@ int main(int argc, char *argv[])
 
 	NOTICE("pid:%d monitoring lxcpath %s", getpid(), mon.lxcpath);
 	for(;;) {
-		ret = lxc_mainloop(&mon.descr, 1000 * 30);
+		ret = lxc_mainloop(&mon.descr, -1);
 		if (mon.clientfds_cnt <= 0)
 		{
 			NOTICE("no remaining clients, exiting");
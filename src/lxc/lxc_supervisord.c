@@ -0,0 +1,303 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "af_unix.h"
+#include "conf.h"
+#include "log.h"
+#include "lxccontainer.h"
+#include "mainloop.h"
+#include "start.h"
+#include "supervisor.h"
+#include "utils.h"
+
+#define IDLE_TIMEOUT (30 * 1000)
+
+lxc_log_define(lxc_supervisord, lxc);
+
+/*
+ * A supervised container: its own mainloop, as lxc_poll() would have it,
+ * nested in the one of the daemon through its epoll fd.
+ */
+struct supervised {
+	struct lxc_container *c;
+	struct lxc_handler *handler;
+	struct lxc_epoll_descr descr;
+};
+
+static struct lxc_epoll_descr descr;
+static const char *lxcpath;
+static int nsupervised;
+
+static char *default_args[] = {
+	"/sbin/init",
+	NULL,
+};
+
+static int supervised_start(struct supervised *s);
+
+static int idle_timeout(void *data, struct lxc_epoll_descr *descr)
+{
+	if (nsupervised)
+		return 0;
+	NOTICE("no container left to supervise, exiting");
+	return 1;
+}
+
+static int supervised_handler(int fd, uint32_t events, void *data,
+			      struct lxc_epoll_descr *descr)
+{
+	struct supervised *s = data;
+	struct lxc_container *c = s->c;
+	int ret;
+
+	ret = lxc_mainloop_once(&s->descr);
+	if (!ret)
+		return 0;
+	if (ret < 0)
+		ERROR("mainloop of '%s' exited with an error", c->name);
+
+	lxc_mainloop_del_handler(descr, s->descr.epfd);
+	c->error_num = lxc_start_supervised_end(s->handler, &s->descr, ret < 0);
+	s->handler = NULL;
+
+	if (c->lxc_conf->reboot) {
+		INFO("'%s' requested reboot", c->name);
+		c->lxc_conf->reboot = 0;
+		if (!supervised_start(s))
+			return 0;
+	}
+
+	NOTICE("'%s' is no longer supervised", c->name);
+	lxc_container_put(c);
+	free(s);
+	if (!--nsupervised)
+		lxc_mainloop_add_timer(descr, IDLE_TIMEOUT, 0, idle_timeout, NULL);
+	return 0;
+}
+
+static int supervised_start(struct supervised *s)
+{
+	struct lxc_container *c = s->c;
+
+	s->handler = lxc_start_supervised(c->name, default_args, c->lxc_conf,
+					  c->config_path, &s->descr);
+	if (!s->handler)
+		return errno == EOPNOTSUPP ? -EOPNOTSUPP : -ECANCELED;
+
+	if (lxc_mainloop_add_handler(&descr, s->descr.epfd,
+				     supervised_handler, s)) {
+		ERROR("failed to add '%s' to the mainloop", c->name);
+		lxc_start_supervised_end(s->handler, &s->descr, true);
+		s->handler = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static int supervise(const char *name, pid_t *pid)
+{
+	struct lxc_container *c;
+	struct supervised *s;
+	int ret;
+
+	c = lxc_container_new(name, lxcpath);
+	if (!c)
+		return -ENOMEM;
+	if (!c->is_defined(c) || !c->lxc_conf) {
+		ret = -ENOENT;
+		goto err;
+	}
+	if (c->is_running(c)) {
+		ret = -EEXIST;
+		goto err;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	s->c = c;
+	c->lxc_conf->reboot = 0;
+	ret = supervised_start(s);
+	if (ret) {
+		free(s);
+		goto err;
+	}
+
+	nsupervised++;
+	*pid = s->handler->pid;
+	NOTICE("supervising '%s', init %d", name, *pid);
+	return 0;
+
+err:
+	lxc_container_put(c);
+	return ret;
+}
+
+static int request_handler(int fd, uint32_t events, void *data,
+			   struct lxc_epoll_descr *descr)
+{
+	struct lxc_supervisor_req req;
+	struct lxc_supervisor_rsp rsp;
+	ssize_t ret;
+
+	memset(&rsp, 0, sizeof(rsp));
+	ret = recv(fd, &req, sizeof(req), 0);
+	if (ret <= 0)
+		goto out;
+
+	if (data) {
+		rsp.ret = -EACCES;
+	} else if (ret != sizeof(req)) {
+		rsp.ret = -EINVAL;
+	} else {
+		req.name[sizeof(req.name) - 1] = '\0';
+		rsp.ret = supervise(req.name, &rsp.pid);
+	}
+	if (send(fd, &rsp, sizeof(rsp), MSG_NOSIGNAL) < 0)
+		WARN("failed to answer for '%s': %s", req.name, strerror(errno));
+
+out:
+	lxc_mainloop_del_handler(descr, fd);
+	close(fd);
+	return 0;
+}
+
+static int accept_handler(int fd, uint32_t events, void *data,
+			  struct lxc_epoll_descr *descr)
+{
+	int conn, allowed;
+
+	conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+	if (conn < 0) {
+		SYSERROR("failed to accept a connection");
+		return 0;
+	}
+
+	/* only those who could run the container's monitor themselves */
+	allowed = lxc_abstract_unix_check_peer(conn);
+	if (allowed < 0 && allowed != -EACCES) {
+		close(conn);
+		return 0;
+	}
+	if (lxc_mainloop_add_handler(descr, conn, request_handler,
+				     allowed ? (void *)1 : NULL)) {
+		ERROR("failed to add a connection to the mainloop");
+		close(conn);
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	char logpath[PATH_MAX];
+	int ret, pipefd, fd;
+	sigset_t mask;
+
+	if (argc != 3) {
+		fprintf(stderr,
+			"Usage: lxc-supervisord lxcpath sync-pipe-fd\n\n"
+			"NOTE: lxc-supervisord is intended for use by lxc internally\n"
+			"      and does not need to be run by hand\n\n");
+		exit(EXIT_FAILURE);
+	}
+	lxcpath = argv[1];
+	pipefd = atoi(argv[2]);
+
+	ret = snprintf(logpath, sizeof(logpath), "%s/lxc-supervisord.log",
+		       (strcmp(LXCPATH, lxcpath) ? lxcpath : LOGPATH ) );
+	if (ret < 0 || ret >= sizeof(logpath))
+		return EXIT_FAILURE;
+
+	ret = lxc_log_init(NULL, logpath, "NOTICE", "lxc-supervisord", 0, lxcpath);
+	if (ret)
+		INFO("Failed to open log file %s, log will be lost", lxcpath);
+	/* one log for all, lxc.logfile of the containers does not apply */
+	lxc_log_options_no_override();
+
+	/*
+	 * As a monitor of each container would, once for all of them.  The
+	 * inits are watched through pidfds, no signal is expected here, and
+	 * being told to go away would leave the containers without monitor.
+	 */
+	if (sigfillset(&mask) ||
+	    sigdelset(&mask, SIGILL)  ||
+	    sigdelset(&mask, SIGSEGV) ||
+	    sigdelset(&mask, SIGBUS)  ||
+	    sigdelset(&mask, SIGWINCH) ||
+	    sigprocmask(SIG_BLOCK, &mask, NULL)) {
+		SYSERROR("failed to set signal mask");
+		return EXIT_FAILURE;
+	}
+	if (chdir("/"))
+		return EXIT_FAILURE;
+
+	ret = EXIT_FAILURE;
+	if (lxc_mainloop_open(&descr)) {
+		ERROR("failed to create mainloop");
+		goto out;
+	}
+
+	if (lxc_supervisor_sock_name(lxcpath, path))
+		goto out;
+	fd = lxc_abstract_unix_open(path, SOCK_SEQPACKET, 0);
+	if (fd < 0) {
+		/* lost the race against another one, which will do */
+		if (errno == EADDRINUSE)
+			ret = EXIT_SUCCESS;
+		else
+			SYSERROR("failed to create the socket %s", &path[1]);
+		goto out;
+	}
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) ||
+	    lxc_mainloop_add_handler(&descr, fd, accept_handler, NULL)) {
+		ERROR("failed to add the socket to the mainloop");
+		goto out;
+	}
+	lxc_mainloop_add_timer(&descr, IDLE_TIMEOUT, 0, idle_timeout, NULL);
+
+	/* sync with parent, which then connects */
+	if (write(pipefd, "S", 1))
+		;
+	close(pipefd);
+	pipefd = -1;
+
+	NOTICE("pid:%d supervising lxcpath %s", getpid(), lxcpath);
+	if (lxc_mainloop(&descr, -1) == 0)
+		ret = EXIT_SUCCESS;
+	lxc_mainloop_close(&descr);
+	NOTICE("supervisor exiting");
+
+out:
+	if (pipefd >= 0)
+		close(pipefd);
+	return ret;
+}
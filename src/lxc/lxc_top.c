@@ -0,0 +1,713 @@
+/*
+ * lxc: linux Container library
+ *
+ * top(1) like monitor for lxc containers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include <lxc/lxccontainer.h>
+
+#include "log.h"
+#include "arguments.h"
+
+lxc_log_define(lxc_top_ui, lxc);
+
+#define ESC		"\033"
+#define TERMCLEAR	ESC "[H" ESC "[J"
+#define TERMNORM	ESC "[0m"
+#define TERMBOLD	ESC "[1m"
+#define TERMRVRS	ESC "[7m"
+#define TERMEOL		ESC "[K"
+#define TERMEOS		ESC "[J"
+#define TERMHIDE	ESC "[?25l"
+#define TERMSHOW	ESC "[?25h"
+
+#define LINE_SIZE	256
+/* header lines and the total line */
+#define EXTRA_LINES	3
+
+/* the cgroup items sampled for each container, see stat_keys */
+enum {
+	STAT_MEM,
+	STAT_KMEM,
+	STAT_CPU,
+	STAT_CPU_USER,
+	STAT_CPU_SYS,
+	STAT_BLKIO,
+	STAT_MAX,
+};
+
+static const char *stat_keys[STAT_MAX] = {
+	[STAT_MEM]	= "memory.usage_in_bytes",
+	[STAT_KMEM]	= "memory.kmem.usage_in_bytes",
+	[STAT_CPU]	= "cpuacct.usage",
+	[STAT_CPU_USER]	= "cpuacct.stat:user",
+	[STAT_CPU_SYS]	= "cpuacct.stat:system",
+	[STAT_BLKIO]	= "blkio.throttle.io_service_bytes:Total",
+};
+
+struct ct_row {
+	char *name;
+	struct lxc_container *c;
+	bool active;
+	uint64_t stat[STAT_MAX];
+	/* previous counters, to compute the rates between two refreshes */
+	bool have_prev;
+	uint64_t prev_cpu;
+	uint64_t prev_blkio;
+	struct timespec prev_ts;
+	double cpu_pct;
+	double blkio_rate;
+};
+
+static double delay = 3.0;
+static int max_containers;
+static char sort_by = 'n';
+static bool reverse;
+
+/* containers sorted by name, running or which were running when the
+ * sampler was last built */
+static struct ct_row **rows;
+static int nrows;
+static struct lxc_cgroup_stats *sampler;
+static struct lxc_cgroup_sample *samples;
+static struct ct_row total;
+static long user_hz;
+
+/* what is currently on the screen */
+static char *screen;
+static int screen_lines;
+static int term_rows = 25;
+static int term_cols = 80;
+
+static struct termios oldtios;
+static bool tios_saved;
+static volatile sig_atomic_t resized;
+static volatile sig_atomic_t quit;
+
+static int my_parser(struct lxc_arguments *args, int c, char *arg)
+{
+	char *end;
+
+	switch (c) {
+	case 'd':
+		errno = 0;
+		delay = strtod(arg, &end);
+		if (errno || *end || delay <= 0) {
+			lxc_error(args, "invalid delay '%s'", arg);
+			return -1;
+		}
+		break;
+	case 'm':
+		max_containers = atoi(arg);
+		break;
+	case 's':
+		if (!arg[0] || arg[1] || !strchr("ncdmk", arg[0])) {
+			lxc_error(args, "invalid sort key '%s'", arg);
+			return -1;
+		}
+		sort_by = arg[0];
+		break;
+	case 'r':
+		reverse = true;
+		break;
+	}
+	return 0;
+}
+
+static const struct option my_longopts[] = {
+	{"delay", required_argument, 0, 'd'},
+	{"max", required_argument, 0, 'm'},
+	{"sort", required_argument, 0, 's'},
+	{"reverse", no_argument, 0, 'r'},
+	LXC_COMMON_OPTIONS
+};
+
+static struct lxc_arguments my_args = {
+	.progname = "lxc-top",
+	.help     = "\
+[--max=COUNT] [--delay=DELAY] [--sort=SORTBY] [--reverse]\n\
+\n\
+lxc-top monitors the state of the active containers\n\
+\n\
+Options :\n\
+  -m, --max=COUNT   display at most COUNT containers\n\
+  -d, --delay=DELAY delay in seconds between refreshes (default: 3.0)\n\
+  -s, --sort=SORTBY sort by [n,c,d,m,k] (default: n) where\n\
+                    n = Name\n\
+                    c = CPU use\n\
+                    d = Disk I/O use\n\
+                    m = Memory use\n\
+                    k = Kernel memory use\n\
+  -r, --reverse     sort in reverse (descending) order\n\
+\n\
+While running, the same letters change the sort order, 'r' reverses\n\
+it and 'q' quits.\n",
+	.options  = my_longopts,
+	.parser   = my_parser,
+	.checker  = NULL,
+};
+
+static void sig_handler(int sig)
+{
+	if (sig == SIGWINCH)
+		resized = 1;
+	else
+		quit = 1;
+}
+
+static void term_restore(void)
+{
+	if (tios_saved)
+		tcsetattr(0, TCSAFLUSH, &oldtios);
+	if (screen)
+		printf("%s\n", TERMSHOW);
+	fflush(stdout);
+}
+
+static void term_setup(void)
+{
+	struct termios tios;
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGWINCH, &sa, NULL);
+
+	if (isatty(0) && tcgetattr(0, &oldtios) == 0) {
+		tios = oldtios;
+		tios.c_lflag &= ~(ICANON | ECHO);
+		tios.c_cc[VMIN] = 1;
+		tios.c_cc[VTIME] = 0;
+		if (tcsetattr(0, TCSAFLUSH, &tios) == 0)
+			tios_saved = true;
+	}
+	atexit(term_restore);
+}
+
+static void term_size(void)
+{
+	struct winsize ws;
+
+	if (ioctl(1, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0) {
+		term_rows = ws.ws_row;
+		term_cols = ws.ws_col;
+	}
+	if (term_cols >= LINE_SIZE)
+		term_cols = LINE_SIZE - 1;
+
+	/* forget what is on the screen, the next frame is drawn in full */
+	free(screen);
+	screen = calloc(term_rows, LINE_SIZE);
+	screen_lines = -1;
+}
+
+static int row_cmp_name(const void *a, const void *b)
+{
+	const struct ct_row *ra = *(struct ct_row * const *)a;
+	const struct ct_row *rb = *(struct ct_row * const *)b;
+
+	return strcmp(ra->name, rb->name);
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static struct ct_row *row_find(const char *name)
+{
+	struct ct_row key = { .name = (char *)name }, *kp = &key, **r;
+
+	r = bsearch(&kp, rows, nrows, sizeof(*rows), row_cmp_name);
+	return r ? *r : NULL;
+}
+
+static void row_free(struct ct_row *r)
+{
+	lxc_container_put(r->c);
+	free(r->name);
+	free(r);
+}
+
+/*
+ * Rebuild the sampler over the active containers.  This reopens all the
+ * cgroup files, so containers which stopped are kept in it until a new
+ * one shows up: their items are then simply not valid.
+ */
+static void sampler_rebuild(void)
+{
+	struct lxc_container **cs;
+	int i, n = 0;
+
+	lxc_cgroup_stats_free(sampler);
+	sampler = NULL;
+	free(samples);
+	samples = NULL;
+
+	for (i = 0; i < nrows; i++) {
+		if (rows[i]->active)
+			rows[n++] = rows[i];
+		else
+			row_free(rows[i]);
+	}
+	nrows = n;
+	if (!nrows)
+		return;
+
+	cs = malloc(nrows * sizeof(*cs));
+	samples = malloc(nrows * STAT_MAX * sizeof(*samples));
+	if (!cs || !samples) {
+		free(cs);
+		return;
+	}
+	for (i = 0; i < nrows; i++)
+		cs[i] = rows[i]->c;
+	sampler = lxc_cgroup_stats_new(cs, nrows, stat_keys, STAT_MAX);
+	free(cs);
+	if (!sampler)
+		ERROR("Failed to prepare reading the cgroup items");
+}
+
+static void rows_update(const char *lxcpath)
+{
+	struct ct_row *r, **newrows;
+	char **names = NULL;
+	bool added = false;
+	int i, n, nnew = 0;
+
+	n = list_active_containers(lxcpath, &names, NULL);
+	if (n < 0)
+		n = 0;
+	qsort(names, n, sizeof(*names), name_cmp);
+
+	for (i = 0; i < nrows; i++)
+		rows[i]->active = false;
+
+	newrows = malloc((nrows + n) * sizeof(*newrows));
+	for (i = 0; newrows && i < n; i++) {
+		r = row_find(names[i]);
+		if (r) {
+			r->active = true;
+			continue;
+		}
+		r = calloc(1, sizeof(*r));
+		if (!r)
+			continue;
+		r->c = lxc_container_new(names[i], lxcpath);
+		if (!r->c) {
+			free(r);
+			continue;
+		}
+		r->name = names[i];
+		names[i] = NULL;
+		r->active = true;
+		newrows[nnew++] = r;
+		added = true;
+	}
+
+	if (added) {
+		memcpy(newrows + nnew, rows, nrows * sizeof(*rows));
+		free(rows);
+		rows = newrows;
+		nrows += nnew;
+		qsort(rows, nrows, sizeof(*rows), row_cmp_name);
+		sampler_rebuild();
+	} else {
+		free(newrows);
+	}
+
+	for (i = 0; i < n; i++)
+		free(names[i]);
+	free(names);
+}
+
+static void rows_sample(void)
+{
+	struct lxc_cgroup_sample *s;
+	struct timespec now;
+	double elapsed;
+	int i, j;
+
+	if (sampler && lxc_cgroup_stats_sample(sampler, samples) < 0)
+		ERROR("Failed to read the cgroup items");
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < nrows; i++) {
+		struct ct_row *r = rows[i];
+
+		if (!r->active || !sampler) {
+			r->have_prev = false;
+			continue;
+		}
+
+		s = &samples[i * STAT_MAX];
+		for (j = 0; j < STAT_MAX; j++)
+			r->stat[j] = s[j].valid ? s[j].value : 0;
+
+		/* the rates survive rebuilding the sampler, and a counter
+		 * going backwards means the container was restarted */
+		r->cpu_pct = 0;
+		r->blkio_rate = 0;
+		elapsed = now.tv_sec - r->prev_ts.tv_sec +
+			  (now.tv_nsec - r->prev_ts.tv_nsec) / 1e9;
+		if (r->have_prev && elapsed > 0) {
+			if (r->stat[STAT_CPU] >= r->prev_cpu)
+				r->cpu_pct = (r->stat[STAT_CPU] - r->prev_cpu) /
+					     (elapsed * 1e7);
+			if (r->stat[STAT_BLKIO] >= r->prev_blkio)
+				r->blkio_rate = (r->stat[STAT_BLKIO] -
+						 r->prev_blkio) / elapsed;
+		}
+		r->prev_cpu = r->stat[STAT_CPU];
+		r->prev_blkio = r->stat[STAT_BLKIO];
+		r->prev_ts = now;
+		r->have_prev = true;
+
+		for (j = 0; j < STAT_MAX; j++)
+			total.stat[j] += r->stat[j];
+		total.cpu_pct += r->cpu_pct;
+		total.blkio_rate += r->blkio_rate;
+	}
+}
+
+static int row_cmp(const struct ct_row *a, const struct ct_row *b)
+{
+	double va, vb;
+	int ret;
+
+	switch (sort_by) {
+	case 'c':
+		va = a->cpu_pct;
+		vb = b->cpu_pct;
+		break;
+	case 'd':
+		va = a->blkio_rate;
+		vb = b->blkio_rate;
+		break;
+	case 'm':
+		va = a->stat[STAT_MEM];
+		vb = b->stat[STAT_MEM];
+		break;
+	case 'k':
+		va = a->stat[STAT_KMEM];
+		vb = b->stat[STAT_KMEM];
+		break;
+	default:
+		ret = strcmp(a->name, b->name);
+		return reverse ? -ret : ret;
+	}
+
+	/* values sort largest first, equal ones by name so that rows do not
+	 * swap places between refreshes */
+	if (va != vb)
+		ret = va > vb ? -1 : 1;
+	else
+		return strcmp(a->name, b->name);
+	return reverse ? -ret : ret;
+}
+
+static int row_qsort_cmp(const void *a, const void *b)
+{
+	return row_cmp(*(struct ct_row * const *)a, *(struct ct_row * const *)b);
+}
+
+/*
+ * Move the k first rows of v under row_cmp() to the front, in no
+ * particular order, without sorting the whole of it.
+ */
+static void rows_select(struct ct_row **v, int n, int k)
+{
+	struct ct_row *pivot, *tmp;
+	int lo = 0, hi = n - 1, i, j;
+
+	if (k <= 0 || k >= n)
+		return;
+
+	while (lo < hi) {
+		pivot = v[lo + (hi - lo) / 2];
+		i = lo;
+		j = hi;
+		while (i <= j) {
+			while (row_cmp(v[i], pivot) < 0)
+				i++;
+			while (row_cmp(v[j], pivot) > 0)
+				j--;
+			if (i <= j) {
+				tmp = v[i];
+				v[i++] = v[j];
+				v[j--] = tmp;
+			}
+		}
+		if (k - 1 <= j)
+			hi = j;
+		else if (k - 1 >= i)
+			lo = i;
+		else
+			break;
+	}
+}
+
+static void size_str(double size, char *buf, size_t len)
+{
+	static const char *units[] = { "KB", "MB", "GB", "TB", "PB", "EB" };
+	int i = -1;
+
+	while (size >= 1024 && i < 5) {
+		size /= 1024;
+		i++;
+	}
+	if (i < 0)
+		snprintf(buf, len, "%6.2f   ", size);
+	else
+		snprintf(buf, len, "%6.2f %s", size, units[i]);
+}
+
+static void line_format(char *line, const char *name, struct ct_row *r,
+		bool kmem)
+{
+	char blkio[16], blkio_rate[16], mem[16], kmem_buf[16];
+	int len;
+
+	size_str(r->stat[STAT_BLKIO], blkio, sizeof(blkio));
+	size_str(r->blkio_rate, blkio_rate, sizeof(blkio_rate));
+	size_str(r->stat[STAT_MEM], mem, sizeof(mem));
+	len = snprintf(line, term_cols + 1,
+		       "%-13.13s %8.2f %8.2f %8.2f %6.1f %10s %10s %10s",
+		       name, r->stat[STAT_CPU] / 1e9,
+		       (double)r->stat[STAT_CPU_SYS] / user_hz,
+		       (double)r->stat[STAT_CPU_USER] / user_hz,
+		       r->cpu_pct, blkio, blkio_rate, mem);
+	if (kmem && len >= 0 && len < term_cols) {
+		size_str(r->stat[STAT_KMEM], kmem_buf, sizeof(kmem_buf));
+		snprintf(line + len, term_cols + 1 - len, " %10s", kmem_buf);
+	}
+}
+
+static void obuf_printf(char **buf, size_t *len, size_t *size,
+		const char *fmt, ...)
+{
+	va_list ap;
+	char *nbuf;
+	int ret;
+
+	for (;;) {
+		va_start(ap, fmt);
+		ret = vsnprintf(*buf + *len, *size - *len, fmt, ap);
+		va_end(ap);
+		if (ret < 0)
+			return;
+		if (*len + ret < *size) {
+			*len += ret;
+			return;
+		}
+		nbuf = realloc(*buf, *size * 2 + ret);
+		if (!nbuf)
+			return;
+		*buf = nbuf;
+		*size = *size * 2 + ret;
+	}
+}
+
+/*
+ * Draw a frame, only writing out the lines which differ from what is on
+ * the screen already.
+ */
+static void render(void)
+{
+	static struct ct_row **order;
+	static int order_size;
+	static char *out;
+	static size_t out_size;
+	struct ct_row **tmp;
+	char line[LINE_SIZE], buf[LINE_SIZE], name[32];
+	size_t out_len = 0;
+	int i, n = 0, k, nlines = 0;
+	bool kmem = total.stat[STAT_KMEM] > 0;
+
+	if (order_size < nrows) {
+		tmp = realloc(order, nrows * sizeof(*order));
+		if (!tmp)
+			return;
+		order = tmp;
+		order_size = nrows;
+	}
+	for (i = 0; i < nrows; i++)
+		if (rows[i]->active)
+			order[n++] = rows[i];
+
+	k = term_rows - EXTRA_LINES;
+	if (max_containers > 0 && max_containers < k)
+		k = max_containers;
+	if (k > n)
+		k = n;
+	if (k < 0)
+		k = 0;
+	rows_select(order, n, k);
+	qsort(order, k, sizeof(*order), row_qsort_cmp);
+
+	if (!out) {
+		out_size = 4096;
+		out = malloc(out_size);
+		if (!out)
+			return;
+	}
+	if (screen_lines < 0) {
+		obuf_printf(&out, &out_len, &out_size, "%s", TERMCLEAR);
+		screen_lines = 0;
+	}
+
+#define EMIT_LINE(attr, ...)							\
+	do {									\
+		snprintf(line, term_cols + 1, __VA_ARGS__);			\
+		if (nlines >= screen_lines ||					\
+		    strcmp(screen + nlines * LINE_SIZE, line)) {		\
+			obuf_printf(&out, &out_len, &out_size,			\
+				    ESC "[%d;1H%s%s%s" TERMEOL, nlines + 1,	\
+				    attr, line, attr[0] ? TERMNORM : "");	\
+			strcpy(screen + nlines * LINE_SIZE, line);		\
+		}								\
+		nlines++;							\
+	} while (0)
+
+	EMIT_LINE(TERMRVRS TERMBOLD, "%-13s %8s %8s %8s %6s %10s %10s %10s%s",
+		  "Container", "CPU", "CPU", "CPU", "CPU", "BlkIO", "BlkIO",
+		  "Mem", kmem ? "       KMem" : "");
+	EMIT_LINE(TERMRVRS TERMBOLD, "%-13s %8s %8s %8s %6s %10s %10s %10s%s",
+		  "Name", "Used", "Sys", "User", "%", "Total", "Rate/s",
+		  "Used", kmem ? "       Used" : "");
+
+	for (i = 0; i < k && nlines < term_rows - 1; i++) {
+		line_format(buf, order[i]->name, order[i], kmem);
+		EMIT_LINE("", "%s", buf);
+	}
+
+	snprintf(name, sizeof(name), "TOTAL (%d)", n);
+	line_format(buf, name, &total, kmem);
+	EMIT_LINE(TERMBOLD, "%s", buf);
+#undef EMIT_LINE
+
+	if (nlines < screen_lines)
+		obuf_printf(&out, &out_len, &out_size, ESC "[%d;1H" TERMEOS,
+			    nlines + 1);
+	screen_lines = nlines;
+
+	if (out_len && write(1, out, out_len) < 0)
+		SYSERROR("Failed to write to the terminal");
+}
+
+static double now_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Wait until the next refresh, handling the keys pressed in between.
+ * Returns false to quit.
+ */
+static bool wait_refresh(void)
+{
+	struct pollfd pfd = { .fd = 0, .events = POLLIN };
+	double deadline = now_secs() + delay, left;
+	char ch;
+	int ret;
+
+	while (!quit) {
+		left = deadline - now_secs();
+		if (left <= 0)
+			return true;
+
+		ret = poll(&pfd, tios_saved ? 1 : 0, (int)(left * 1000) + 1);
+		if (ret < 0 && errno != EINTR)
+			return false;
+		if (resized) {
+			resized = 0;
+			term_size();
+			render();
+		}
+		if (ret <= 0)
+			continue;
+		if (read(0, &ch, 1) != 1)
+			return false;
+
+		switch (ch) {
+		case 'q':
+			return false;
+		case 'r':
+			reverse = !reverse;
+			break;
+		case 'n': case 'c': case 'd': case 'm': case 'k':
+			sort_by = ch;
+			break;
+		default:
+			continue;
+		}
+		render();
+	}
+	return false;
+}
+
+int main(int argc, char *argv[])
+{
+	if (lxc_arguments_parse(&my_args, argc, argv))
+		return 1;
+
+	if (lxc_log_init(my_args.name, my_args.log_file, my_args.log_priority,
+			 my_args.progname, my_args.quiet, my_args.lxcpath[0]))
+		return 1;
+	lxc_log_options_no_override();
+
+	user_hz = sysconf(_SC_CLK_TCK);
+	if (user_hz <= 0)
+		user_hz = 100;
+
+	term_setup();
+	term_size();
+	if (!screen)
+		return 1;
+	printf("%s", TERMHIDE);
+	fflush(stdout);
+
+	do {
+		rows_update(my_args.lxcpath[0]);
+		rows_sample();
+		render();
+	} while (wait_refresh());
+
+	return 0;
+}
@@ -197,35 +197,6 @@ static bool nic_exists(char *nic)
 	return true;
 }
 
-static int instanciate_veth(char *n1, char **n2)
-{
-	int err;
-
-	err = snprintf(*n2, IFNAMSIZ, "%sp", n1);
-	if (err < 0 || err >= IFNAMSIZ) {
-		fprintf(stderr, "nic name too long\n");
-		return -1;
-	}
-
-	err = lxc_veth_create(n1, *n2);
-	if (err) {
-		fprintf(stderr, "failed to create %s-%s : %s\n", n1, *n2,
-		      strerror(-err));
-		return -1;
-	}
-
-	/* changing the high byte of the mac address to 0xfe, the bridge interface
-	 * will always keep the host's mac address and not take the mac address
-	 * of a container */
-	err = setup_private_host_hw_addr(n1);
-	if (err) {
-		fprintf(stderr, "failed to change mac address of host interface '%s' : %s\n",
-			n1, strerror(-err));
-	}
-
-	return netdev_set_flag(n1, IFF_UP);
-}
-
 static int get_mtu(char *name)
 {
 	int idx = if_nametoindex(name);
@@ -237,7 +208,7 @@ static bool create_nic(char *nic, char *br, int pid, char **cnic)
 	char *veth1buf, *veth2buf;
 	veth1buf = alloca(IFNAMSIZ);
 	veth2buf = alloca(IFNAMSIZ);
-	int ret, mtu;
+	int ret, mtu, master;
 
 	ret = snprintf(veth1buf, IFNAMSIZ, "%s", nic);
 	if (ret < 0 || ret >= IFNAMSIZ) {
@@ -245,26 +216,28 @@ static bool create_nic(char *nic, char *br, int pid, char **cnic)
 		return false;
 	}
 
-	/* create the nics */
-	if (instanciate_veth(veth1buf, &veth2buf) < 0) {
-		fprintf(stderr, "Error creating veth tunnel\n");
+	ret = snprintf(veth2buf, IFNAMSIZ, "%sp", veth1buf);
+	if (ret < 0 || ret >= IFNAMSIZ) {
+		fprintf(stderr, "nic name too long\n");
 		return false;
 	}
 
-	/* copy the bridge's mtu to both ends */
-	mtu = get_mtu(br);
-	if (mtu != -1) {
-		if (lxc_netdev_set_mtu(veth1buf, mtu) < 0 ||
-				lxc_netdev_set_mtu(veth2buf, mtu) < 0) {
-			fprintf(stderr, "Failed setting mtu\n");
-			goto out_del;
-		}
+	master = if_nametoindex(br);
+	if (!master) {
+		fprintf(stderr, "Error finding the bridge %s\n", br);
+		return false;
 	}
 
-	/* attach veth1 to bridge */
-	if (lxc_bridge_attach(br, veth1buf) < 0) {
-		fprintf(stderr, "Error attaching %s to %s\n", veth1buf, br);
-		goto out_del;
+	/* create the nics with the bridge's mtu on both ends, attached to
+	 * the bridge and up, all in one go */
+	mtu = get_mtu(br);
+	ret = lxc_veth_create_bridged(veth1buf, veth2buf, master,
+				      mtu > 0 ? mtu : 0, 1);
+	if (ret) {
+		fprintf(stderr, "failed to create %s-%s : %s\n", veth1buf,
+			veth2buf, strerror(-ret));
+		lxc_netdev_delete_by_name(veth1buf);
+		return false;
 	}
 
 	/* pass veth2 to target netns */
@@ -291,6 +264,8 @@ static bool get_new_nicname(char **dest, char *br, int pid, char **cnic)
 	char template[IFNAMSIZ];
 	snprintf(template, sizeof(template), "vethXXXXXX");
 	*dest = lxc_mkifname(template);
+	if (!*dest)
+		return false;
 
 	if (!create_nic(*dest, br, pid, cnic)) {
 		return false;
@@ -389,6 +364,30 @@ static int count_entries(char *buf, off_t len, char *me, char *t, char *br)
 	return count;
 }
 
+/* the number of entries of @me for @t and @br, -1 on error */
+static int count_db_entries(int fd, char *me, char *t, char *br)
+{
+	struct stat sb;
+	char *buf;
+	int count;
+
+	if (fstat(fd, &sb) < 0) {
+		fprintf(stderr, "Failed to fstat: %s\n", strerror(errno));
+		return -1;
+	}
+	if (sb.st_size == 0)
+		return 0;
+
+	buf = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (buf == MAP_FAILED) {
+		fprintf(stderr, "Failed to create mapping\n");
+		return -1;
+	}
+	count = count_entries(buf, sb.st_size, me, t, br);
+	munmap(buf, sb.st_size);
+	return count;
+}
+
 /*
  * The dbfile has lines of the format:
  * user type bridge nicname
@@ -398,29 +397,31 @@ static bool get_nic_if_avail(int fd, char *me, int pid, char *intype, char *br,
 	off_t len, slen;
 	struct stat sb;
 	char *buf = NULL, *newline;
-	int ret, count = 0;
-
-	cull_entries(fd, me, intype, br);
+	int ret, count;
 
 	if (allowed == 0)
 		return false;
 
+	/*
+	 * Stale entries, of nics which went away with their container, only
+	 * matter once they would count against the quota, so they are culled
+	 * then rather than checked on every call.
+	 */
+	count = count_db_entries(fd, me, intype, br);
+	if (count < 0)
+		return false;
+	if (count >= allowed) {
+		cull_entries(fd, me, intype, br);
+		count = count_db_entries(fd, me, intype, br);
+		if (count < 0 || count >= allowed)
+			return false;
+	}
+
 	if (fstat(fd, &sb) < 0) {
 		fprintf(stderr, "Failed to fstat: %s\n", strerror(errno));
 		return false;
 	}
 	len = sb.st_size;
-	if (len != 0) {
-		buf = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-		if (buf == MAP_FAILED) {
-			fprintf(stderr, "Failed to create mapping\n");
-			return false;
-		}
-
-		count = count_entries(buf, len, me, intype, br);
-		if (count >= allowed)
-			return false;
-	}
 
 	if (!get_new_nicname(nicname, br, pid, cnic))
 		return false;
@@ -433,8 +434,6 @@ static bool get_nic_if_avail(int fd, char *me, int pid, char *intype, char *br,
 			fprintf(stderr, "Error unlinking %s!\n", *nicname);
 		return false;
 	}
-	if (len)
-		munmap(buf, len);
 	if (ftruncate(fd, len + slen))
 		fprintf(stderr, "Failed to set new file size\n");
 	buf = mmap(NULL, len + slen, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
@@ -34,8 +34,13 @@
 #include <arpa/inet.h>
 #include <libgen.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <grp.h>
+#include <time.h>
 #include <sys/syscall.h>
+#include <sys/file.h>
+#include <sys/utsname.h>
+#include <poll.h>
 
 #include <lxc/lxccontainer.h>
 #include <lxc/version.h>
@@ -54,7 +59,15 @@
 #include "attach.h"
 #include "monitor.h"
 #include "namespace.h"
+#include "network.h"
+#include "start.h"
+#include "supervisor.h"
 #include "lxclock.h"
+#include "status.h"
+#include "rmtree.h"
+#include "copytree.h"
+#include "criu.h"
+#include "apistats.h"
 
 #if HAVE_IFADDRS_H
 #include <ifaddrs.h>
@@ -119,7 +132,7 @@ static int ongoing_create(struct lxc_container *c)
 
 	if (!file_exists(path))
 		return 0;
-	fd = open(path, O_RDWR);
+	fd = open(path, O_RDWR | O_CLOEXEC);
 	if (fd < 0) {
 		// give benefit of the doubt
 		SYSERROR("Error opening partial file");
@@ -153,7 +166,7 @@ static int create_partial(struct lxc_container *c)
 		ERROR("Error writing partial pathname");
 		return -1;
 	}
-	if ((fd=open(path, O_RDWR | O_CREAT | O_EXCL, 0755)) < 0) {
+	if ((fd=open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0755)) < 0) {
 		SYSERROR("Erorr creating partial file");
 		return -1;
 	}
@@ -192,7 +205,8 @@ static void remove_partial(struct lxc_container *c, int fd)
  * 2. container_disk_lock(c) protects the on-disk container data - in particular the
  *    container configuration file.
  *    The container_disk_lock also takes the container_mem_lock.
- * 3. thread_mutex protects process data (ex: fd table) from multiple threads.
+ *    Paths which only read the disk take container_disk_rdlock(c), which
+ *    programs reading the same container at the same time can share.
  * NOTHING mutexes two independent programs with their own struct
  * lxc_container for the same c->name, between API calls.  For instance,
  * c->config_read(); c->start();  Between those calls, data on disk
@@ -230,6 +244,32 @@ static void lxc_container_free(struct lxc_container *c)
 		lxc_putlock(c->privlock);
 		c->privlock = NULL;
 	}
+	if (c->cmd_conn_kept) {
+		lxc_cmd_connection_put(c->name, c->config_path);
+		lxc_wait_monitor_release(c->config_path);
+		c->cmd_conn_kept = false;
+	}
+	if (c->ns_cache) {
+		lxc_ns_cache_free(c->ns_cache);
+		c->ns_cache = NULL;
+	}
+	if (c->attach_cache) {
+		lxc_attach_cache_free(c->attach_cache);
+		c->attach_cache = NULL;
+	}
+	if (c->attach_helper) {
+		lxc_attach_helper_stop(c->attach_helper);
+		free(c->attach_helper);
+		c->attach_helper = NULL;
+	}
+	if (c->cgroup_stats) {
+		lxc_cgroup_stats_free(c->cgroup_stats);
+		c->cgroup_stats = NULL;
+	}
+	if (c->state_watch) {
+		lxc_state_watch_free(c->state_watch);
+		c->state_watch = NULL;
+	}
 	if (c->name) {
 		free(c->name);
 		c->name = NULL;
@@ -242,6 +282,8 @@ static void lxc_container_free(struct lxc_container *c)
 		lxc_conf_free(c->lxc_unexp_conf);
 		c->lxc_unexp_conf = NULL;
 	}
+	free(c->unexp_file);
+	c->unexp_file = NULL;
 	if (c->config_path) {
 		free(c->config_path);
 		c->config_path = NULL;
@@ -267,7 +309,7 @@ lxc_container_put()           |   lxc_container_get()
  * is true:
  * 1. freer has set numthreads = 0.  get() returns 0
  * 2. freer is between lxclock and setting numthreads to 0.  get()er will
- *    sem_wait on privlock, get lxclock after freer() drops it, then see
+ *    wait on privlock, get lxclock after freer() drops it, then see
  *    numthreads is 0 and exit without touching lxclock again..
  * 3. freer has not yet locked privlock.  If get()er runs first, then put()er
  *    will see --numthreads = 1 and not call lxc_container_free().
@@ -312,6 +354,7 @@ int lxc_container_put(struct lxc_container *c)
 
 static bool lxcapi_is_defined(struct lxc_container *c)
 {
+	LXC_API_STATS(is_defined);
 	struct stat statbuf;
 	bool ret = false;
 	int statret;
@@ -333,25 +376,101 @@ out:
 	return ret;
 }
 
+/*
+ * State cache (see lxcapi_cache_state()).  The state events the monitor
+ * connection got are applied before the cached state is used, which only
+ * costs a poll.  After an operation of ours which changes the state, the
+ * events about it may still be on their way: the state is then asked
+ * from the container until the events caught up with the answer.
+ */
+static pthread_mutex_t state_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* called with state_cache_lock held, false if the cache can't be used */
+static bool state_cache_update(struct lxc_container *c)
+{
+	const char *name, *state;
+	int ret;
+
+	if (!c->state_watch || c->state_watch_owner != getpid())
+		return false;
+
+	while ((ret = lxc_state_watch_next(c->state_watch, &name, &state)) > 0) {
+		c->cached_state = lxc_str2state(state);
+		c->cached_pid = 0;
+		if (c->state_stale && c->cached_state == c->state_expected)
+			c->state_stale = false;
+	}
+	if (ret < 0) {
+		WARN("lost the state events of '%s', not caching its state",
+		     c->name);
+		lxc_state_watch_free(c->state_watch);
+		c->state_watch = NULL;
+		return false;
+	}
+	return true;
+}
+
+static void state_cache_invalidate(struct lxc_container *c)
+{
+	if (!c->state_watch)
+		return;
+	pthread_mutex_lock(&state_cache_lock);
+	c->state_stale = true;
+	c->cached_pid = 0;
+	pthread_mutex_unlock(&state_cache_lock);
+}
+
+static lxc_state_t container_state(struct lxc_container *c)
+{
+	lxc_state_t s;
+	bool cached;
+
+	if (!c->state_watch)
+		return lxc_getstate(c->name, c->config_path);
+
+	pthread_mutex_lock(&state_cache_lock);
+	cached = state_cache_update(c);
+	if (cached && !c->state_stale) {
+		s = c->cached_state;
+		pthread_mutex_unlock(&state_cache_lock);
+		return s;
+	}
+	pthread_mutex_unlock(&state_cache_lock);
+
+	s = lxc_getstate(c->name, c->config_path);
+
+	pthread_mutex_lock(&state_cache_lock);
+	if (cached && c->state_watch && c->state_stale) {
+		c->state_expected = s;
+		/* nothing is on its way if the events agree already */
+		if (state_cache_update(c) && c->cached_state == s)
+			c->state_stale = false;
+	}
+	pthread_mutex_unlock(&state_cache_lock);
+	return s;
+}
+
 static const char *lxcapi_state(struct lxc_container *c)
 {
+	LXC_API_STATS(state);
 	lxc_state_t s;
 
 	if (!c)
 		return NULL;
-	s = lxc_getstate(c->name, c->config_path);
+	s = container_state(c);
 	return lxc_state2str(s);
 }
 
 static bool is_stopped(struct lxc_container *c)
 {
 	lxc_state_t s;
-	s = lxc_getstate(c->name, c->config_path);
+	s = container_state(c);
 	return (s == STOPPED);
 }
 
 static bool lxcapi_is_running(struct lxc_container *c)
 {
+	LXC_API_STATS(is_running);
 	const char *s;
 
 	if (!c)
@@ -364,11 +483,13 @@ static bool lxcapi_is_running(struct lxc_container *c)
 
 static bool lxcapi_freeze(struct lxc_container *c)
 {
+	LXC_API_STATS(freeze);
 	int ret;
 	if (!c)
 		return false;
 
 	ret = lxc_freeze(c->name, c->config_path);
+	state_cache_invalidate(c);
 	if (ret)
 		return false;
 	return true;
@@ -376,11 +497,13 @@ static bool lxcapi_freeze(struct lxc_container *c)
 
 static bool lxcapi_unfreeze(struct lxc_container *c)
 {
+	LXC_API_STATS(unfreeze);
 	int ret;
 	if (!c)
 		return false;
 
 	ret = lxc_unfreeze(c->name, c->config_path);
+	state_cache_invalidate(c);
 	if (ret)
 		return false;
 	return true;
@@ -388,6 +511,7 @@ static bool lxcapi_unfreeze(struct lxc_container *c)
 
 static int lxcapi_console_getfd(struct lxc_container *c, int *ttynum, int *masterfd)
 {
+	LXC_API_STATS(console_getfd);
 	int ttyfd;
 	if (!c)
 		return -1;
@@ -399,19 +523,110 @@ static int lxcapi_console_getfd(struct lxc_container *c, int *ttynum, int *maste
 static int lxcapi_console(struct lxc_container *c, int ttynum, int stdinfd,
 			  int stdoutfd, int stderrfd, int escape)
 {
+	LXC_API_STATS(console);
 	return lxc_console(c, ttynum, stdinfd, stdoutfd, stderrfd, escape);
 }
 
+static int lxcapi_console_log(struct lxc_container *c, char **data,
+			      size_t *len, bool clear)
+{
+	LXC_API_STATS(console_log);
+	int flags = 0;
+
+	if (!c || (data && !len))
+		return -EINVAL;
+
+	if (data)
+		flags |= LXC_CMD_CONSOLE_LOG_READ;
+	if (clear)
+		flags |= LXC_CMD_CONSOLE_LOG_CLEAR;
+	return lxc_cmd_console_log(c->name, c->config_path, flags, data, len);
+}
+
 static pid_t lxcapi_init_pid(struct lxc_container *c)
 {
+	LXC_API_STATS(init_pid);
+	struct lxc_status status;
+	pid_t pid;
+
 	if (!c)
 		return -1;
 
-	return lxc_cmd_get_init_pid(c->name, c->config_path);
+	/* the pid of init is good until the next state event */
+	if (c->state_watch) {
+		pthread_mutex_lock(&state_cache_lock);
+		pid = 0;
+		if (state_cache_update(c) && !c->state_stale)
+			pid = c->cached_state == STOPPED ? -1 : c->cached_pid;
+		pthread_mutex_unlock(&state_cache_lock);
+		if (pid)
+			return pid;
+	}
+
+	if (!lxc_status_get(c->name, c->config_path, &status) &&
+	    status.init_pid > 0)
+		pid = status.init_pid;
+	else
+		pid = lxc_cmd_get_init_pid(c->name, c->config_path);
+
+	if (c->state_watch && pid > 0) {
+		pthread_mutex_lock(&state_cache_lock);
+		if (state_cache_update(c) && !c->state_stale &&
+		    c->cached_state != STOPPED)
+			c->cached_pid = pid;
+		pthread_mutex_unlock(&state_cache_lock);
+	}
+	return pid;
+}
+
+/*
+ * Read c->lxc_unexp_conf from the file the config was first loaded from,
+ * if that was put off.  Called with the container locked.
+ */
+static bool load_unexp_config(struct lxc_container *c)
+{
+	struct lxc_conf *unexp;
+
+	if (!c->unexp_file)
+		return true;
+	unexp = lxc_conf_init();
+	if (!unexp)
+		return false;
+	unexp->unexpanded = true;
+	if (lxc_config_read_unexpanded(c->unexp_file, unexp)) {
+		ERROR("Failed to read the configuration %s", c->unexp_file);
+		lxc_conf_free(unexp);
+		return false;
+	}
+	c->lxc_unexp_conf = unexp;
+	free(c->unexp_file);
+	c->unexp_file = NULL;
+	return true;
 }
 
 static bool load_config_locked(struct lxc_container *c, const char *fname)
 {
+	/*
+	 * Most containers are only looked at, their unexpanded config is
+	 * left to be read should it be changed or saved.
+	 */
+	if (!c->lxc_conf && !c->lxc_unexp_conf && !c->unexp_file) {
+		c->lxc_conf = lxc_conf_init();
+		if (c->lxc_conf && !lxc_config_read(fname, c->lxc_conf, NULL))
+			c->unexp_file = strdup(fname);
+		if (!c->unexp_file) {
+			/* don't leave a half read config behind */
+			if (c->lxc_conf) {
+				lxc_conf_free(c->lxc_conf);
+				c->lxc_conf = NULL;
+			}
+			return false;
+		}
+		return true;
+	}
+
+	if (!load_unexp_config(c))
+		return false;
 	if (!c->lxc_conf)
 		c->lxc_conf = lxc_conf_init();
 	if (!c->lxc_unexp_conf) {
@@ -428,6 +643,7 @@ static bool load_config_locked(struct lxc_container *c, const char *fname)
 
 static bool lxcapi_load_config(struct lxc_container *c, const char *alt_file)
 {
+	LXC_API_STATS(load_config);
 	bool ret = false, need_disklock = false;
 	int lret;
 	const char *fname;
@@ -448,13 +664,19 @@ static bool lxcapi_load_config(struct lxc_container *c, const char *alt_file)
 		need_disklock = true;
 
 	if (need_disklock)
-		lret = container_disk_lock(c);
+		lret = container_disk_rdlock(c);
 	else
 		lret = container_mem_lock(c);
 	if (lret)
 		return false;
 
 	ret = load_config_locked(c, fname);
+	if (need_disklock) {
+		/* an explicit load replaces a pending or failed lazy one */
+		c->lazy_config_failed = false;
+		__sync_synchronize();
+		c->lazy_config = false;
+	}
 
 	if (need_disklock)
 		container_disk_unlock(c);
@@ -463,9 +685,40 @@ static bool lxcapi_load_config(struct lxc_container *c, const char *alt_file)
 	return ret;
 }
 
+/*
+ * Containers handed out by a LXC_LIST_LAZY listing have not read their
+ * configuration yet.  Every entry point which needs c->lxc_conf calls this
+ * first.  Unlike lxc_container_new(), we do not clean up after an
+ * interrupted create here.  A config which failed to parse is not retried,
+ * every later call fails as the first one did.
+ */
+static bool lazy_load_config(struct lxc_container *c)
+{
+	bool ret;
+
+	if (!c->lazy_config) {
+		__sync_synchronize();
+		return !c->lazy_config_failed;
+	}
+	if (container_disk_rdlock(c))
+		return false;
+	if (c->lazy_config) {
+		/* only mark the config read once it is all there */
+		if (file_exists(c->configfile) &&
+		    !load_config_locked(c, c->configfile))
+			c->lazy_config_failed = true;
+		__sync_synchronize();
+		c->lazy_config = false;
+	}
+	ret = !c->lazy_config_failed;
+	container_disk_unlock(c);
+	return ret;
+}
+
 static bool lxcapi_want_daemonize(struct lxc_container *c, bool state)
 {
-	if (!c || !c->lxc_conf)
+	LXC_API_STATS(want_daemonize);
+	if (!c || !lazy_load_config(c) || !c->lxc_conf)
 		return false;
 	if (container_mem_lock(c)) {
 		ERROR("Error getting mem lock");
@@ -481,7 +734,8 @@ static bool lxcapi_want_daemonize(struct lxc_container *c, bool state)
 
 static bool lxcapi_want_close_all_fds(struct lxc_container *c, bool state)
 {
-	if (!c || !c->lxc_conf)
+	LXC_API_STATS(want_close_all_fds);
+	if (!c || !lazy_load_config(c) || !c->lxc_conf)
 		return false;
 	if (container_mem_lock(c)) {
 		ERROR("Error getting mem lock");
@@ -494,6 +748,7 @@ static bool lxcapi_want_close_all_fds(struct lxc_container *c, bool state)
 
 static bool lxcapi_wait(struct lxc_container *c, const char *state, int timeout)
 {
+	LXC_API_STATS(wait);
 	int ret;
 
 	if (!c)
@@ -504,7 +759,8 @@ static bool lxcapi_wait(struct lxc_container *c, const char *state, int timeout)
 }
 
 
-static bool wait_on_daemonized_start(struct lxc_container *c, int pid)
+static bool wait_on_daemonized_start(struct lxc_container *c, int pid,
+				     bool wait)
 {
 	/* we'll probably want to make this timeout configurable? */
 	int timeout = 5, ret, status;
@@ -514,8 +770,13 @@ static bool wait_on_daemonized_start(struct lxc_container *c, int pid)
 	 * child
 	 */
 	ret = waitpid(pid, &status, 0);
-	if (ret == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	if (ret == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
 		DEBUG("failed waiting for first dual-fork child");
+		if (!wait)
+			return false;
+	}
+	if (!wait)
+		return true;
 	return lxcapi_wait(c, "RUNNING", timeout);
 }
 
@@ -550,8 +811,12 @@ static bool am_single_threaded(void)
 /*
  * I can't decide if it'd be more convenient for callers if we accept '...',
  * or a null-terminated array (i.e. execl vs execv)
+ *
+ * Without @wait the container is daemonized and we return as soon as
+ * its monitor is forked.
  */
-static bool lxcapi_start(struct lxc_container *c, int useinit, char * const argv[])
+static bool do_lxcapi_start(struct lxc_container *c, int useinit,
+			    char * const argv[], bool wait)
 {
 	int ret;
 	struct lxc_conf *conf;
@@ -566,7 +831,7 @@ static bool lxcapi_start(struct lxc_container *c, int useinit, char * const argv
 	if (!c)
 		return false;
 	/* container has been setup */
-	if (!c->lxc_conf)
+	if (!lazy_load_config(c) || !c->lxc_conf)
 		return false;
 
 	if ((ret = ongoing_create(c)) < 0) {
@@ -589,7 +854,7 @@ static bool lxcapi_start(struct lxc_container *c, int useinit, char * const argv
 	if (container_mem_lock(c))
 		return false;
 	conf = c->lxc_conf;
-	daemonize = c->daemonize;
+	daemonize = c->daemonize || !wait;
 	container_mem_unlock(c);
 
 	if (useinit) {
@@ -609,6 +874,16 @@ static bool lxcapi_start(struct lxc_container *c, int useinit, char * const argv
 	if (daemonize) {
 		lxc_monitord_spawn(c->config_path);
 
+		/* the supervisor's pid would not do as the pid file's */
+		if (conf->start_supervised && !c->pidfile && argv == default_args) {
+			ret = lxc_supervisor_start(c->name, c->config_path);
+			if (ret != -EOPNOTSUPP) {
+				c->error_num = ret;
+				return ret == 0;
+			}
+			INFO("starting '%s' with a monitor of its own", c->name);
+		}
+
 		pid_t pid = fork();
 		if (pid < 0)
 			return false;
@@ -618,7 +893,7 @@ static bool lxcapi_start(struct lxc_container *c, int useinit, char * const argv
 			 * the PID file, child will do the free and unlink.
 			 */
 			c->pidfile = NULL;
-			return wait_on_daemonized_start(c, pid);
+			return wait_on_daemonized_start(c, pid, wait);
 		}
 
 		/* second fork to be reparented by init */
@@ -652,7 +927,7 @@ static bool lxcapi_start(struct lxc_container *c, int useinit, char * const argv
 	 * write the right PID.
 	 */
 	if (c->pidfile) {
-		pid_fp = fopen(c->pidfile, "w");
+		pid_fp = fopen(c->pidfile, "we");
 		if (pid_fp == NULL) {
 			SYSERROR("Failed to create pidfile '%s' for '%s'",
 				 c->pidfile, c->name);
@@ -693,11 +968,34 @@ reboot:
 		return (ret == 0 ? true : false);
 }
 
+static bool lxcapi_start(struct lxc_container *c, int useinit, char * const argv[])
+{
+	LXC_API_STATS(start);
+	bool ret;
+
+	ret = do_lxcapi_start(c, useinit, argv, true);
+	if (c)
+		state_cache_invalidate(c);
+	return ret;
+}
+
+static bool lxcapi_start_nowait(struct lxc_container *c, char * const argv[])
+{
+	LXC_API_STATS(start_nowait);
+	bool ret;
+
+	ret = do_lxcapi_start(c, 0, argv, false);
+	if (c)
+		state_cache_invalidate(c);
+	return ret;
+}
+
 /*
  * note there MUST be an ending NULL
  */
 static bool lxcapi_startl(struct lxc_container *c, int useinit, ...)
 {
+	LXC_API_STATS(startl);
 	va_list ap;
 	char **inargs = NULL;
 	bool bret = false;
@@ -731,13 +1029,28 @@ out:
 
 static bool lxcapi_stop(struct lxc_container *c)
 {
+	LXC_API_STATS(stop);
 	int ret;
 
 	if (!c)
 		return false;
 
 	ret = lxc_cmd_stop(c->name, c->config_path);
+	state_cache_invalidate(c);
+
+	return ret == 0;
+}
+
+static bool lxcapi_stop_nowait(struct lxc_container *c)
+{
+	LXC_API_STATS(stop_nowait);
+	int ret;
+
+	if (!c)
+		return false;
 
+	ret = lxc_cmd_stop_nowait(c->name, c->config_path);
+	state_cache_invalidate(c);
 	return ret == 0;
 }
 
@@ -808,9 +1121,10 @@ static struct bdev *do_bdev_create(struct lxc_container *c, const char *type,
 	lxcapi_set_config_item(c, "lxc.rootfs", bdev->src);
 
 	/* if we are not root, chown the rootfs dir to root in the
-	 * target uidmap */
+	 * target uidmap, unless the rootfs is id-mapped at start */
 
-	if (geteuid() != 0 || (c->lxc_conf && !lxc_list_empty(&c->lxc_conf->id_map))) {
+	if (geteuid() != 0 || (c->lxc_conf && !lxc_list_empty(&c->lxc_conf->id_map) &&
+			       !c->lxc_conf->rootfs.idmapped)) {
 		if (chown_mapped_root(bdev->dest, c->lxc_conf) < 0) {
 			ERROR("Error chowning %s to container root", bdev->dest);
 			bdev_put(bdev);
@@ -995,8 +1309,11 @@ static bool create_run_template(struct lxc_container *c, char *tpath, bool quiet
 		 * lxc-usernsexec <-m map1> ... <-m mapn> --
 		 * and we append "--mapped-uid x", where x is the mapped uid
 		 * for our geteuid()
+		 * An id-mapped rootfs is written with the ids the container
+		 * sees, so its template runs unmapped.
 		 */
-		if (!lxc_list_empty(&conf->id_map)) {
+		if (!lxc_list_empty(&conf->id_map) &&
+		    (geteuid() != 0 || !conf->rootfs.idmapped)) {
 			int n2args = 1;
 			char txtuid[20];
 			char txtgid[20];
@@ -1124,7 +1441,7 @@ static bool prepend_lxc_header(char *path, const char *t, char *const argv[])
 	char *tpath;
 #endif
 
-	f = fopen(path, "r");
+	f = fopen(path, "re");
 	if (f == NULL)
 		return false;
 
@@ -1161,7 +1478,7 @@ static bool prepend_lxc_header(char *path, const char *t, char *const argv[])
 	free(tpath);
 #endif
 
-	f = fopen(path, "w");
+	f = fopen(path, "we");
 	if (f == NULL) {
 		SYSERROR("reopening config for writing");
 		free(contents);
@@ -1208,7 +1525,10 @@ out_error:
 
 static void lxcapi_clear_config(struct lxc_container *c)
 {
+	LXC_API_STATS(clear_config);
 	if (c) {
+		c->lazy_config = false;
+		c->lazy_config_failed = false;
 		if (c->lxc_conf) {
 			lxc_conf_free(c->lxc_conf);
 			c->lxc_conf = NULL;
@@ -1217,12 +1537,278 @@ static void lxcapi_clear_config(struct lxc_container *c)
 			lxc_conf_free(c->lxc_unexp_conf);
 			c->lxc_unexp_conf = NULL;
 		}
+		free(c->unexp_file);
+		c->unexp_file = NULL;
 	}
 }
 
 static bool lxcapi_destroy(struct lxc_container *c);
-static bool container_destroy(struct lxc_container *c);
+static bool container_destroy(struct lxc_container *c, bool async);
 static bool get_snappath_dir(struct lxc_container *c, char *snappath);
+static bool file_has_contents(const char *path, const char *buf, size_t len);
+static int create_file_dirname(char *path);
+static int clone_config_text(struct lxc_container *c, char **buf, size_t *len);
+static struct lxc_container *lxcapi_clone(struct lxc_container *c, const char *newname,
+		const char *lxcpath, int flags,
+		const char *bdevtype, const char *bdevdata, uint64_t newsize,
+		char **hookargs);
+static bool do_lxcapi_create(struct lxc_container *c, const char *t,
+		const char *bdevtype, struct bdev_specs *specs, int flags,
+		char *const argv[], bool cache);
+
+/*
+ * With lxc.create.cache set, what a template made is kept as a container
+ * in $lxcpath/.cache, named after a hash of everything which went into
+ * it: the template itself, its arguments, the backing store type and the
+ * starting configuration.  Further containers made from the same are
+ * clones of that one, which the template never sees.  Only the simple
+ * case is cached: root creating a container whose rootfs and backing
+ * store details are left to lxc.
+ */
+#define CACHE_DIR ".cache"
+
+static bool create_cacheable(struct lxc_container *c, struct bdev_specs *specs)
+{
+	const char *v = lxc_global_config_value("lxc.create.cache");
+
+	if (!v || strcmp(v, "1") != 0)
+		return false;
+	if (am_unpriv() || (!lxc_list_empty(&c->lxc_conf->id_map) &&
+			    !c->lxc_conf->rootfs.idmapped))
+		return false;
+	if (c->lxc_conf->rootfs.path)
+		return false;
+	if (specs && (specs->fstype || specs->fssize || specs->zfs.zfsroot ||
+			specs->lvm.vg || specs->lvm.lv || specs->lvm.thinpool ||
+			specs->dir))
+		return false;
+	return true;
+}
+
+/* everything a template run depends on, as one string */
+static char *create_cache_key(struct lxc_container *c, const char *tpath,
+		const char *bdevtype, char *const argv[], size_t *len)
+{
+	char *key = NULL, *config, *p, *eol, buf[4096];
+	size_t clen, n;
+	FILE *f, *t;
+	bool ok;
+
+	if (clone_config_text(c, &config, &clen) < 0)
+		return NULL;
+	t = fopen(tpath, "re");
+	if (!t) {
+		SYSERROR("Error opening template %s", tpath);
+		free(config);
+		return NULL;
+	}
+	f = open_memstream(&key, len);
+	if (!f) {
+		fclose(t);
+		free(config);
+		return NULL;
+	}
+	while ((n = fread(buf, 1, sizeof(buf), t)) > 0)
+		fwrite(buf, 1, n, f);
+	ok = !ferror(t);
+	fclose(t);
+	fprintf(f, "%c%s%c", '\0', bdevtype ? bdevtype : "", '\0');
+	while (argv && *argv)
+		fprintf(f, "%s%c", *argv++, '\0');
+	fputc('\0', f);
+	/* leaving out the addresses made up when the config was read */
+	for (p = config; p < config + clen; p = eol + 1) {
+		eol = memchr(p, '\n', config + clen - p);
+		if (!eol)
+			eol = config + clen;
+		if (strncmp(p, "lxc.network.hwaddr", 18) == 0)
+			continue;
+		fwrite(p, 1, eol - p, f);
+		fputc('\n', f);
+	}
+	free(config);
+	if (fclose(f) != 0 || !ok) {
+		free(key);
+		return NULL;
+	}
+	return key;
+}
+
+/* 64 bit FNV-1a, the key is kept with the cached container to compare */
+static uint64_t create_cache_hash(const char *key, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/*
+ * Make sure the cached container @name in @cachepath holds what running
+ * the template with @key would give, by running it if not.  Called with
+ * the entry locked, so that concurrent creates of the same run it once.
+ */
+static struct lxc_container *create_cache_fill(struct lxc_container *c,
+		const char *cachepath, const char *name, const char *key,
+		size_t len, const char *t, const char *bdevtype, int flags,
+		char *const argv[])
+{
+	struct lxc_container *cc;
+	char path[MAXPATHLEN], *config;
+	size_t clen;
+	int ret, fd;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/%s/cache.key", cachepath, name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return NULL;
+	if (file_has_contents(path, key, len)) {
+		INFO("Using cached %s/%s", cachepath, name);
+		return lxc_container_new(name, cachepath);
+	}
+
+	/* whatever is there was left by a failed attempt */
+	cc = lxc_container_new(name, cachepath);
+	if (!cc)
+		return NULL;
+	if (lxcapi_is_defined(cc) && !container_destroy(cc, false)) {
+		ERROR("Failed to remove stale cache entry %s/%s", cachepath, name);
+		lxc_container_put(cc);
+		return NULL;
+	}
+	lxc_container_put(cc);
+
+	ret = snprintf(path, MAXPATHLEN, "%s/%s/config", cachepath, name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return NULL;
+	if (create_file_dirname(path) < 0 && errno != EEXIST) {
+		ERROR("Error creating cache entry %s/%s", cachepath, name);
+		return NULL;
+	}
+	if (clone_config_text(c, &config, &clen) < 0)
+		return NULL;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		SYSERROR("open %s", path);
+		free(config);
+		return NULL;
+	}
+	ret = lxc_write_nointr(fd, config, clen);
+	close(fd);
+	free(config);
+	if (ret != clen)
+		return NULL;
+
+	INFO("Filling cache entry %s/%s", cachepath, name);
+	cc = lxc_container_new(name, cachepath);
+	if (!cc)
+		return NULL;
+	if (!do_lxcapi_create(cc, t, bdevtype, NULL, flags, argv, false)) {
+		lxc_container_put(cc);
+		return NULL;
+	}
+
+	/* the key goes last, so only a complete entry has it */
+	ret = snprintf(path, MAXPATHLEN, "%s/%s/cache.key", cachepath, name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		goto err;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		goto err;
+	ret = lxc_write_nointr(fd, key, len);
+	if (close(fd) < 0 || ret != len)
+		goto err;
+	return cc;
+
+err:
+	SYSERROR("Failed to write %s", path);
+	lxc_container_put(cc);
+	return NULL;
+}
+
+/*
+ * Create c by cloning the cache entry for running template @t with
+ * @argv, making that first if needed.  Backing stores which snapshot
+ * cheaply and independently are snapshotted, others are copied, which
+ * for a directory means reflinked where the filesystem can.
+ */
+static bool create_from_cache(struct lxc_container *c, const char *t,
+		const char *tpath, const char *bdevtype, int flags,
+		char *const argv[])
+{
+	struct lxc_container *cc, *c2;
+	struct bdev *bdev;
+	char cachepath[MAXPATHLEN], path[MAXPATHLEN], name[MAXPATHLEN];
+	const char *base;
+	char *key;
+	size_t len;
+	int ret, fd, cflags = 0;
+
+	key = create_cache_key(c, tpath, bdevtype, argv, &len);
+	if (!key)
+		return false;
+	base = strrchr(tpath, '/');
+	base = base ? base + 1 : tpath;
+	ret = snprintf(name, MAXPATHLEN, "%s-%016" PRIx64, base,
+		create_cache_hash(key, len));
+	if (ret < 0 || ret >= MAXPATHLEN)
+		goto out_free;
+	ret = snprintf(cachepath, MAXPATHLEN, "%s/" CACHE_DIR, c->config_path);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		goto out_free;
+	if (mkdir_p(cachepath, 0755) < 0) {
+		ERROR("Error creating %s", cachepath);
+		goto out_free;
+	}
+
+	ret = snprintf(path, MAXPATHLEN, "%s/%s.lock", cachepath, name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		goto out_free;
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		SYSERROR("Error opening %s", path);
+		goto out_free;
+	}
+	if (flock(fd, LOCK_EX) < 0) {
+		SYSERROR("Error locking %s", path);
+		close(fd);
+		goto out_free;
+	}
+	cc = create_cache_fill(c, cachepath, name, key, len, t, bdevtype,
+		flags, argv);
+	close(fd);
+	free(key);
+	if (!cc)
+		return false;
+
+	bdev = bdev_init(cc->lxc_conf, cc->lxc_conf->rootfs.path, NULL, NULL);
+	if (bdev && (strcmp(bdev->type, "btrfs") == 0 ||
+			strcmp(bdev->type, "zfs") == 0))
+		cflags = LXC_CLONE_SNAPSHOT | LXC_CLONE_MAYBE_SNAPSHOT |
+			LXC_CLONE_KEEPBDEVTYPE;
+	if (bdev)
+		bdev_put(bdev);
+
+	c2 = lxcapi_clone(cc, c->name, c->config_path, cflags, NULL, NULL, 0,
+		NULL);
+	lxc_container_put(cc);
+	if (!c2)
+		return false;
+	lxc_container_put(c2);
+
+	lxcapi_clear_config(c);
+	if (!prepend_lxc_header(c->configfile, tpath, argv))
+		WARN("Error prepending header to configuration file");
+	return load_config_locked(c, c->configfile);
+
+out_free:
+	free(key);
+	return false;
+}
+
 /*
  * lxcapi_create:
  * create a container with the given parameters.
@@ -1240,13 +1826,21 @@ static bool get_snappath_dir(struct lxc_container *c, char *snappath);
 static bool lxcapi_create(struct lxc_container *c, const char *t,
 		const char *bdevtype, struct bdev_specs *specs, int flags,
 		char *const argv[])
+{
+	LXC_API_STATS(create);
+	return do_lxcapi_create(c, t, bdevtype, specs, flags, argv, true);
+}
+
+static bool do_lxcapi_create(struct lxc_container *c, const char *t,
+		const char *bdevtype, struct bdev_specs *specs, int flags,
+		char *const argv[], bool cache)
 {
 	bool ret = false;
 	pid_t pid;
 	char *tpath = NULL;
 	int partial_fd;
 
-	if (!c)
+	if (!c || !lazy_load_config(c))
 		return false;
 
 	if (t) {
@@ -1297,6 +1891,17 @@ static bool lxcapi_create(struct lxc_container *c, const char *t,
 		goto out;
 	}
 
+	if (cache && tpath && create_cacheable(c, specs)) {
+		if (create_from_cache(c, t, tpath, bdevtype, flags, argv)) {
+			ret = true;
+			goto out;
+		}
+		WARN("Failed to create %s from the cache, running the template",
+			c->name);
+		if (!create_container_dir(c))
+			goto free_tpath;
+	}
+
 	/* Mark that this container is being created */
 	if ((partial_fd = create_partial(c)) < 0)
 		goto out;
@@ -1342,6 +1947,8 @@ static bool lxcapi_create(struct lxc_container *c, const char *t,
 	lxc_conf_free(c->lxc_conf);
 	c->lxc_conf = NULL;
 	c->lxc_unexp_conf = NULL;
+	free(c->unexp_file);
+	c->unexp_file = NULL;
 	if (!load_config_locked(c, c->configfile))
 		goto out_unlock;
 
@@ -1365,54 +1972,114 @@ out_unlock:
 		remove_partial(c, partial_fd);
 out:
 	if (!ret && c)
-		container_destroy(c);
+		container_destroy(c, false);
 free_tpath:
 	if (tpath)
 		free(tpath);
 	return ret;
 }
 
-static bool lxcapi_reboot(struct lxc_container *c)
+/*
+ * Send @sig to the init of @c.  Through a pidfd when the kernel has them,
+ * so that a pid reused since it was looked up can't be signalled, else
+ * by pid.  If @pidfd isn't NULL it gets the pidfd, or -1, which the
+ * caller can poll for the init to exit and then close.
+ */
+static bool container_signal_init(struct lxc_container *c, int sig,
+				  int *pidfd)
 {
 	pid_t pid;
+	int fd, ret;
+
+	if (pidfd)
+		*pidfd = -1;
+
+	fd = lxc_cmd_get_init_pidfd(c->name, c->config_path, &pid);
+	if (fd >= 0) {
+		ret = lxc_pidfd_send_signal(fd, sig);
+		if (ret < 0 && errno == ENOSYS) {
+			close(fd);
+			goto by_pid;
+		}
+		if (ret < 0)
+			SYSERROR("failed to send signal %d to the init of '%s'",
+				 sig, c->name);
+		if (pidfd)
+			*pidfd = fd;
+		else
+			close(fd);
+		return ret == 0;
+	}
+
+by_pid:
+	pid = c->init_pid(c);
+	if (pid <= 0)
+		return false;
+	return kill(pid, sig) == 0;
+}
+
+static bool lxcapi_reboot(struct lxc_container *c)
+{
+	LXC_API_STATS(reboot);
 
 	if (!c)
 		return false;
 	if (!c->is_running(c))
 		return false;
-	pid = c->init_pid(c);
-	if (pid <= 0)
-		return false;
-	if (kill(pid, SIGINT) < 0)
+	if (!container_signal_init(c, SIGINT, NULL))
 		return false;
+	state_cache_invalidate(c);
 	return true;
 
 }
 
 static bool lxcapi_shutdown(struct lxc_container *c, int timeout)
 {
+	LXC_API_STATS(shutdown);
 	bool retv;
-	pid_t pid;
 	int haltsignal = SIGPWR;
+	struct timespec start, now;
+	struct pollfd pfd;
+	int ret;
 
-	if (!c)
+	if (!c || !lazy_load_config(c))
 		return false;
 
 	if (!c->is_running(c))
 		return true;
-	pid = c->init_pid(c);
-	if (pid <= 0)
-		return true;
 	if (c->lxc_conf && c->lxc_conf->haltsignal)
 		haltsignal = c->lxc_conf->haltsignal;
-	kill(pid, haltsignal);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	container_signal_init(c, haltsignal, &pfd.fd);
+
+	/*
+	 * The pidfd polls readable as soon as the init exits, the wait
+	 * for STOPPED is then only for the monitor to clean up.
+	 */
+	if (pfd.fd >= 0) {
+		pfd.events = POLLIN;
+		do {
+			ret = poll(&pfd, 1, timeout < 0 ? -1 : timeout * 1000);
+		} while (ret < 0 && errno == EINTR);
+		close(pfd.fd);
+		if (ret == 0)
+			return false;
+		if (timeout > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timeout -= now.tv_sec - start.tv_sec;
+			if (timeout < 1)
+				timeout = 1;
+		}
+	}
 	retv = c->wait(c, "STOPPED", timeout);
+	state_cache_invalidate(c);
 	return retv;
 }
 
 static bool lxcapi_createl(struct lxc_container *c, const char *t,
 		const char *bdevtype, struct bdev_specs *specs, int flags, ...)
 {
+	LXC_API_STATS(createl);
 	bool bret = false;
 	char **args = NULL;
 	va_list ap;
@@ -1441,9 +2108,10 @@ out:
 
 static bool lxcapi_clear_config_item(struct lxc_container *c, const char *key)
 {
+	LXC_API_STATS(clear_config_item);
 	int ret;
 
-	if (!c || !c->lxc_conf)
+	if (!c || !lazy_load_config(c) || !c->lxc_conf)
 		return false;
 	if (container_mem_lock(c))
 		return false;
@@ -1452,27 +2120,40 @@ static bool lxcapi_clear_config_item(struct lxc_container *c, const char *key)
 	return ret == 0;
 }
 
+/*
+ * Get a new fd for namespace @ns of the container's init @pid, through the
+ * container's namespace cache so /proc/<pid> is only looked up once per
+ * init.
+ */
+static int container_ns_fd(struct lxc_container *c, pid_t pid, int ns)
+{
+	int fd = -1;
+
+	if (container_mem_lock(c))
+		return -1;
+
+	if (!c->ns_cache)
+		c->ns_cache = lxc_ns_cache_new();
+	if (c->ns_cache)
+		fd = lxc_ns_cache_get(c->ns_cache, pid, ns);
+
+	container_mem_unlock(c);
+	return fd;
+}
+
 static inline bool enter_to_ns(struct lxc_container *c) {
-	int netns, userns, ret = 0, init_pid = 0;;
-	char new_netns_path[MAXPATHLEN];
-	char new_userns_path[MAXPATHLEN];
+	int netns, userns, init_pid = 0;
 
-	if (!c->is_running(c))
+	if (!c->is_running(c) || !lazy_load_config(c))
 		goto out;
 
 	init_pid = c->init_pid(c);
 
 	/* Switch to new userns */
 	if ((geteuid() != 0 || (c->lxc_conf && !lxc_list_empty(&c->lxc_conf->id_map))) && access("/proc/self/ns/user", F_OK) == 0) {
-		ret = snprintf(new_userns_path, MAXPATHLEN, "/proc/%d/ns/user", init_pid);
-		if (ret < 0 || ret >= MAXPATHLEN)
-			goto out;
-
-		userns = open(new_userns_path, O_RDONLY);
-		if (userns < 0) {
-			SYSERROR("failed to open %s", new_userns_path);
+		userns = container_ns_fd(c, init_pid, LXC_NS_USER);
+		if (userns < 0)
 			goto out;
-		}
 
 		if (setns(userns, CLONE_NEWUSER)) {
 			SYSERROR("failed to setns for CLONE_NEWUSER");
@@ -1483,15 +2164,9 @@ static inline bool enter_to_ns(struct lxc_container *c) {
 	}
 
 	/* Switch to new netns */
-	ret = snprintf(new_netns_path, MAXPATHLEN, "/proc/%d/ns/net", init_pid);
-	if (ret < 0 || ret >= MAXPATHLEN)
-		goto out;
-
-	netns = open(new_netns_path, O_RDONLY);
-	if (netns < 0) {
-		SYSERROR("failed to open %s", new_netns_path);
+	netns = container_ns_fd(c, init_pid, LXC_NS_NET);
+	if (netns < 0)
 		goto out;
-	}
 
 	if (setns(netns, CLONE_NEWNET)) {
 		SYSERROR("failed to setns for CLONE_NEWNET");
@@ -1504,16 +2179,38 @@ out:
 	return false;
 }
 
-// used by qsort and bsearch functions for comparing names
-static inline int string_cmp(char **first, char **second)
+/*
+ * Open the network namespace of a running container, so that it can be
+ * queried without entering it.  Returns -1 when the container's user
+ * namespace would have to be entered first, which can only be done from
+ * a single-threaded child.
+ */
+static int container_netns_fd_pid(struct lxc_container *c, pid_t init_pid)
 {
-	return strcmp(*first, *second);
+	if ((geteuid() != 0 || (c->lxc_conf && !lxc_list_empty(&c->lxc_conf->id_map))) && access("/proc/self/ns/user", F_OK) == 0)
+		return -1;
+
+	return container_ns_fd(c, init_pid, LXC_NS_NET);
+}
+
+static int container_netns_fd(struct lxc_container *c)
+{
+	pid_t init_pid;
+
+	if (!c->is_running(c) || !lazy_load_config(c))
+		return -1;
+
+	init_pid = c->init_pid(c);
+	if (init_pid <= 0)
+		return -1;
+
+	return container_netns_fd_pid(c, init_pid);
 }
 
-// used by qsort and bsearch functions for comparing container names
-static inline int container_cmp(struct lxc_container **first, struct lxc_container **second)
+// used by qsort and bsearch functions for comparing names
+static inline int string_cmp(char **first, char **second)
 {
-	return strcmp((*first)->name, (*second)->name);
+	return strcmp(*first, *second);
 }
 
 static bool add_to_array(char ***names, char *cname, int pos)
@@ -1535,24 +2232,6 @@ static bool add_to_array(char ***names, char *cname, int pos)
 	return true;
 }
 
-static bool add_to_clist(struct lxc_container ***list, struct lxc_container *c, int pos, bool sort)
-{
-	struct lxc_container **newlist = realloc(*list, (pos+1) * sizeof(struct lxc_container *));
-	if (!newlist) {
-		ERROR("Out of memory");
-		return false;
-	}
-
-	*list = newlist;
-	newlist[pos] = c;
-
-	// sort the arrray as we will use binary search on it
-	if (sort)
-		qsort(newlist, pos + 1, sizeof(struct lxc_container *), (int (*)(const void *,const void *))container_cmp);
-
-	return true;
-}
-
 static char** get_from_array(char ***names, char *cname, int size)
 {
 	return (char **)bsearch(&cname, *names, size, sizeof(char *), (int (*)(const void *, const void *))string_cmp);
@@ -1565,24 +2244,26 @@ static bool array_contains(char ***names, char *cname, int size) {
 	return false;
 }
 
-static bool remove_from_array(char ***names, char *cname, int size)
-{
-	char **result = get_from_array(names, cname, size);
-	if (result != NULL) {
-		free(result);
-		return true;
-	}
-	return false;
-}
-
 static char** lxcapi_get_interfaces(struct lxc_container *c)
 {
+	LXC_API_STATS(get_interfaces);
 	pid_t pid;
 	int i, count = 0, pipefd[2];
 	char **interfaces = NULL;
 	char interface[IFNAMSIZ];
+	int netns;
 
-	if(pipe(pipefd) < 0) {
+	netns = container_netns_fd(c);
+	if (netns >= 0) {
+		count = lxc_netns_get_interfaces(netns, &interfaces);
+		close(netns);
+		if (count >= 0)
+			return interfaces;
+		count = 0;
+		interfaces = NULL;
+	}
+
+	if (pipe2(pipefd, O_CLOEXEC) < 0) {
 		SYSERROR("pipe failed");
 		return NULL;
 	}
@@ -1664,12 +2345,24 @@ static char** lxcapi_get_interfaces(struct lxc_container *c)
 
 static char** lxcapi_get_ips(struct lxc_container *c, const char* interface, const char* family, int scope)
 {
+	LXC_API_STATS(get_ips);
 	pid_t pid;
 	int i, count = 0, pipefd[2];
 	char **addresses = NULL;
 	char address[INET6_ADDRSTRLEN];
+	int netns;
+
+	netns = container_netns_fd(c);
+	if (netns >= 0) {
+		count = lxc_netns_get_ips(netns, interface, family, scope, &addresses);
+		close(netns);
+		if (count >= 0)
+			return addresses;
+		count = 0;
+		addresses = NULL;
+	}
 
-	if(pipe(pipefd) < 0) {
+	if (pipe2(pipefd, O_CLOEXEC) < 0) {
 		SYSERROR("pipe failed");
 		return NULL;
 	}
@@ -1781,9 +2474,10 @@ static char** lxcapi_get_ips(struct lxc_container *c, const char* interface, con
 
 static int lxcapi_get_config_item(struct lxc_container *c, const char *key, char *retv, int inlen)
 {
+	LXC_API_STATS(get_config_item);
 	int ret;
 
-	if (!c || !c->lxc_conf)
+	if (!c || !lazy_load_config(c) || !c->lxc_conf)
 		return -1;
 	if (container_mem_lock(c))
 		return -1;
@@ -1794,9 +2488,10 @@ static int lxcapi_get_config_item(struct lxc_container *c, const char *key, char
 
 static char* lxcapi_get_running_config_item(struct lxc_container *c, const char *key)
 {
+	LXC_API_STATS(get_running_config_item);
 	char *ret;
 
-	if (!c || !c->lxc_conf)
+	if (!c || !lazy_load_config(c) || !c->lxc_conf)
 		return NULL;
 	if (container_mem_lock(c))
 		return NULL;
@@ -1805,8 +2500,26 @@ static char* lxcapi_get_running_config_item(struct lxc_container *c, const char
 	return ret;
 }
 
+static bool lxcapi_get_running_config_items(struct lxc_container *c,
+		const char **keys, int n, char **values)
+{
+	LXC_API_STATS(get_running_config_items);
+	int ret;
+
+	if (!c || !keys || !values || n < 0)
+		return false;
+	if (!lazy_load_config(c) || !c->lxc_conf)
+		return false;
+	if (container_mem_lock(c))
+		return false;
+	ret = lxc_cmd_get_config_items(c->name, keys, n, values, c->get_config_path(c));
+	container_mem_unlock(c);
+	return ret == 0;
+}
+
 static int lxcapi_get_keys(struct lxc_container *c, const char *key, char *retv, int inlen)
 {
+	LXC_API_STATS(get_keys);
 	if (!key)
 		return lxc_listconfigs(retv, inlen);
 	/*
@@ -1814,7 +2527,7 @@ static int lxcapi_get_keys(struct lxc_container *c, const char *key, char *retv,
 	 * This is an intelligent result to show which keys are valid given
 	 * the type of nic it is
 	 */
-	if (!c || !c->lxc_conf)
+	if (!c || !lazy_load_config(c) || !c->lxc_conf)
 		return -1;
 	if (container_mem_lock(c))
 		return -1;
@@ -1825,12 +2538,114 @@ static int lxcapi_get_keys(struct lxc_container *c, const char *key, char *retv,
 	return ret;
 }
 
+/* does the file at path hold exactly len bytes of buf */
+static bool file_has_contents(const char *path, const char *buf, size_t len)
+{
+	char *old;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	old = malloc(len + 1);
+	if (!old) {
+		close(fd);
+		return false;
+	}
+	ret = lxc_read_nointr(fd, old, len + 1);
+	close(fd);
+	ret = (ret == len && !memcmp(old, buf, len));
+	free(old);
+	return ret;
+}
+
+/*
+ * Write conf to path unless it already holds exactly that.  An existing
+ * file is replaced through a temporary file renamed over it, so that it
+ * is never seen half written, keeping its owner and mode.  A symlink is
+ * written through, as is a file of someone else we can't chown to.
+ * Called with the container locked.
+ */
+static bool save_config_file(const char *path, struct lxc_conf *conf)
+{
+	char *buf = NULL, *tmp = NULL;
+	size_t len = 0;
+	struct stat st;
+	bool ret = false;
+	FILE *f;
+	int fd;
+
+	f = open_memstream(&buf, &len);
+	if (!f)
+		return false;
+	write_config(f, conf);
+	if (fclose(f))
+		goto out;
+
+	if (lstat(path, &st) < 0 || !S_ISREG(st.st_mode))
+		goto in_place;
+
+	/* nothing to do, and mtime stays what config caches recorded */
+	if (st.st_size == len && file_has_contents(path, buf, len)) {
+		ret = true;
+		goto out;
+	}
+
+	tmp = malloc(strlen(path) + 8);
+	if (!tmp)
+		goto out;
+	sprintf(tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto in_place;
+	if ((st.st_uid != geteuid() || st.st_gid != getegid()) &&
+	    fchown(fd, st.st_uid, st.st_gid) < 0) {
+		close(fd);
+		unlink(tmp);
+		goto in_place;
+	}
+	if (fchmod(fd, st.st_mode & 07777) < 0 ||
+	    lxc_write_nointr(fd, buf, len) != len || fsync(fd) < 0) {
+		SYSERROR("failed to write %s", tmp);
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	close(fd);
+	if (rename(tmp, path) < 0) {
+		SYSERROR("failed to rename %s to %s", tmp, path);
+		unlink(tmp);
+		goto out;
+	}
+	ret = true;
+	goto out;
+
+in_place:
+	f = fopen(path, "we");
+	if (!f)
+		goto out;
+	if (fwrite(buf, 1, len, f) != len) {
+		fclose(f);
+		goto out;
+	}
+	ret = (fclose(f) == 0);
+
+out:
+	free(tmp);
+	free(buf);
+	return ret;
+}
+
 static bool lxcapi_save_config(struct lxc_container *c, const char *alt_file)
 {
-	FILE *fout;
+	LXC_API_STATS(save_config);
 	bool ret = false, need_disklock = false;
 	int lret;
 
+	if (!lazy_load_config(c))
+		return false;
+
 	if (!alt_file)
 		alt_file = c->configfile;
 	if (!alt_file)
@@ -1863,14 +2678,9 @@ static bool lxcapi_save_config(struct lxc_container *c, const char *alt_file)
 	if (lret)
 		return false;
 
-	fout = fopen(alt_file, "w");
-	if (!fout)
-		goto out;
-	write_config(fout, c->lxc_unexp_conf);
-	fclose(fout);
-	ret = true;
+	ret = load_unexp_config(c) &&
+	      save_config_file(alt_file, c->lxc_unexp_conf);
 
-out:
 	if (need_disklock)
 		container_disk_unlock(c);
 	else
@@ -1891,7 +2701,7 @@ static bool mod_rdep(struct lxc_container *c, bool inc)
 			c->name);
 	if (ret < 0 || ret > MAXPATHLEN)
 		goto out;
-	f = fopen(path, "r");
+	f = fopen(path, "re");
 	if (f) {
 		ret = fscanf(f, "%d", &v);
 		fclose(f);
@@ -1901,7 +2711,7 @@ static bool mod_rdep(struct lxc_container *c, bool inc)
 		}
 	}
 	v += inc ? 1 : -1;
-	f = fopen(path, "w");
+	f = fopen(path, "we");
 	if (!f)
 		goto out;
 	if (fprintf(f, "%d\n", v) < 0) {
@@ -1945,7 +2755,7 @@ static void mod_all_rdeps(struct lxc_container *c, bool inc)
 		ERROR("Path name too long");
 		return;
 	}
-	f = fopen(path, "r");
+	f = fopen(path, "re");
 	if (f == NULL)
 		return;
 	while (getline(&lxcpath, &pathlen, f) != -1) {
@@ -1982,7 +2792,7 @@ static bool has_fs_snapshots(struct lxc_container *c)
 			c->name);
 	if (ret < 0 || ret > MAXPATHLEN)
 		goto out;
-	f = fopen(path, "r");
+	f = fopen(path, "re");
 	if (!f)
 		goto out;
 	ret = fscanf(f, "%d", &v);
@@ -2061,16 +2871,169 @@ static int bdev_destroy_wrapper(void *data)
 	return do_bdev_destroy(conf);
 }
 
-static bool container_destroy(struct lxc_container *c)
+static int container_destroy_rootfs(void *data)
 {
-	bool bret = false;
+	struct lxc_conf *conf = data;
+
+	if (am_unpriv())
+		return userns_exec_1(conf, bdev_destroy_wrapper, conf);
+	return do_bdev_destroy(conf);
+}
+
+struct rmdir_data {
+	struct lxc_conf *conf;
+	char *path;
+};
+
+static int container_rmdir(void *data)
+{
+	struct rmdir_data *arg = data;
+
+	if (am_unpriv())
+		return userns_exec_1(arg->conf, lxc_rmdir_onedev_wrapper, arg->path);
+	return lxc_rmdir_onedev(arg->path, "snaps");
+}
+
+#define TRASH_DIR ".trash"
+
+/* whether the rootfs is a directory inside @path, and so goes with it */
+static bool rootfs_is_inside(struct lxc_conf *conf, const char *path)
+{
+	struct bdev *r;
+	size_t len = strlen(path);
+	bool ret;
+
+	r = bdev_init(conf, conf->rootfs.path, conf->rootfs.mount, NULL);
+	if (!r)
+		return false;
+	ret = strcmp(r->type, "dir") == 0 && r->src &&
+		strncmp(r->src, path, len) == 0 && r->src[len] == '/';
+	bdev_put(r);
+	return ret;
+}
+
+/*
+ * Move the container directory @path out of the way, into the trash of
+ * @lxcpath.  A rename is all it takes, however large the rootfs in it.
+ */
+static bool container_to_trash(const char *lxcpath, const char *name,
+		const char *path)
+{
+	char trash[MAXPATHLEN];
 	int ret;
 
-	if (!c || !lxcapi_is_defined(c))
+	ret = snprintf(trash, MAXPATHLEN, "%s/" TRASH_DIR, lxcpath);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return false;
+	if (mkdir(trash, 0700) < 0 && errno != EEXIST) {
+		SYSERROR("Error creating %s", trash);
+		return false;
+	}
+	ret = snprintf(trash, MAXPATHLEN, "%s/" TRASH_DIR "/%s.XXXXXX",
+			lxcpath, name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return false;
+	if (!mkdtemp(trash)) {
+		SYSERROR("Error creating trash entry for %s", name);
+		return false;
+	}
+	if (rename(path, trash) < 0) {
+		SYSERROR("Error moving %s to %s", path, trash);
+		rmdir(trash);
+		return false;
+	}
+	return true;
+}
+
+static int trash_remove_wrapper(void *data)
+{
+	return lxc_remove_tree(data, NULL);
+}
+
+/*
+ * Empty the trash of @lxcpath in the background, from a daemonized child
+ * at idle I/O priority.  The trash is locked meanwhile, so that reapers
+ * started in the meantime wait and then remove what was added since.
+ */
+static void trash_reap(const char *lxcpath, struct lxc_conf *conf)
+{
+	struct dirent *direntp;
+	char trash[MAXPATHLEN], *entry;
+	DIR *dir;
+	pid_t pid;
+	int ret;
+
+	ret = snprintf(trash, MAXPATHLEN, "%s/" TRASH_DIR, lxcpath);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return;
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("Error forking to empty %s", trash);
+		return;
+	}
+	if (pid > 0) {
+		wait_for_pid(pid);
+		return;
+	}
+
+	/* second fork to be reparented by init */
+	pid = fork();
+	if (pid != 0)
+		_exit(pid < 0);
+	if (chdir("/") < 0)
+		_exit(1);
+	close(0);
+	close(1);
+	close(2);
+	open("/dev/zero", O_RDONLY);
+	open("/dev/null", O_RDWR);
+	open("/dev/null", O_RDWR);
+	setsid();
+	/* for the cgroup, idle whatever the priority configured */
+	lxc_io_throttle();
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+	if (nice(19) < 0)
+		DEBUG("failed to lower the priority of the reaper");
+
+	dir = opendir(trash);
+	if (!dir)
+		exit(1);
+	if (flock(dirfd(dir), LOCK_EX) < 0)
+		exit(1);
+	while ((direntp = readdir(dir))) {
+		if (!strcmp(direntp->d_name, ".") ||
+		    !strcmp(direntp->d_name, ".."))
+			continue;
+		if (asprintf(&entry, "%s/%s", trash, direntp->d_name) < 0)
+			continue;
+		if (am_unpriv())
+			ret = userns_exec_1(conf, trash_remove_wrapper, entry);
+		else
+			ret = lxc_remove_tree(entry, NULL);
+		if (ret < 0)
+			ERROR("Error removing %s", entry);
+		free(entry);
+	}
+	closedir(dir);
+	exit(0);
+}
+
+static bool container_destroy(struct lxc_container *c, bool async)
+{
+	bool bret = false, trashed = false;
+	const char *p1;
+	char *path;
+	int ret;
+
+	if (!c || !lxcapi_is_defined(c) || !lazy_load_config(c))
 		return false;
 
 	if (container_disk_lock(c))
 		return false;
+	if (c->lxc_conf)
+		userns_hold(c->lxc_conf);
 
 	if (!is_stopped(c)) {
 		// we should queue some sort of error - in c->error_string?
@@ -2078,11 +3041,17 @@ static bool container_destroy(struct lxc_container *c)
 		goto out;
 	}
 
-	if (c->lxc_conf && c->lxc_conf->rootfs.path && c->lxc_conf->rootfs.mount) {
-		if (am_unpriv())
-			ret = userns_exec_1(c->lxc_conf, bdev_destroy_wrapper, c->lxc_conf);
-		else
-			ret = do_bdev_destroy(c->lxc_conf);
+	p1 = lxcapi_get_config_path(c);
+	path = alloca(strlen(p1) + strlen(c->name) + 2);
+	sprintf(path, "%s/%s", p1, c->name);
+
+	/*
+	 * Other backing stores are destroyed now, as they are found through
+	 * paths in the container directory.
+	 */
+	if (c->lxc_conf && c->lxc_conf->rootfs.path && c->lxc_conf->rootfs.mount &&
+	    !(async && rootfs_is_inside(c->lxc_conf, path))) {
+		ret = lxc_io_throttled(container_destroy_rootfs, c->lxc_conf);
 		if (ret < 0) {
 			ERROR("Error destroying rootfs for %s", c->name);
 			goto out;
@@ -2091,26 +3060,50 @@ static bool container_destroy(struct lxc_container *c)
 
 	mod_all_rdeps(c, false);
 
-	const char *p1 = lxcapi_get_config_path(c);
-	char *path = alloca(strlen(p1) + strlen(c->name) + 2);
-	sprintf(path, "%s/%s", p1, c->name);
-	if (am_unpriv())
-		ret = userns_exec_1(c->lxc_conf, lxc_rmdir_onedev_wrapper, path);
-	else
-		ret = lxc_rmdir_onedev(path, "snaps");
-	if (ret < 0) {
-		ERROR("Error destroying container directory for %s", c->name);
-		goto out;
+	if (async && container_to_trash(p1, c->name, path)) {
+		trashed = true;
+	} else {
+		struct rmdir_data rdata = { c->lxc_conf, path };
+
+		ret = lxc_io_throttled(container_rmdir, &rdata);
+		if (ret < 0) {
+			ERROR("Error destroying container directory for %s", c->name);
+			goto out;
+		}
 	}
 	bret = true;
 
 out:
 	container_disk_unlock(c);
+	/* not before, the reaper mustn't inherit the lock */
+	if (trashed)
+		trash_reap(p1, c->lxc_conf);
+	if (c->lxc_conf)
+		userns_release(c->lxc_conf);
 	return bret;
 }
 
 static bool lxcapi_destroy(struct lxc_container *c)
 {
+	LXC_API_STATS(destroy);
+	if (!c || !lxcapi_is_defined(c))
+		return false;
+	if (has_snapshots(c)) {
+		ERROR("Container %s has snapshots;  not removing", c->name);
+		return false;
+	}
+
+	if (has_fs_snapshots(c)) {
+		ERROR("container %s has snapshots on its rootfs", c->name);
+		return false;
+	}
+
+	return container_destroy(c, false);
+}
+
+static bool lxcapi_destroy_async(struct lxc_container *c)
+{
+	LXC_API_STATS(destroy_async);
 	if (!c || !lxcapi_is_defined(c))
 		return false;
 	if (has_snapshots(c)) {
@@ -2123,13 +3116,14 @@ static bool lxcapi_destroy(struct lxc_container *c)
 		return false;
 	}
 
-	return container_destroy(c);
+	return container_destroy(c, true);
 }
 
 static bool lxcapi_snapshot_destroy_all(struct lxc_container *c);
 
 static bool lxcapi_destroy_with_snapshots(struct lxc_container *c)
 {
+	LXC_API_STATS(destroy_with_snapshots);
 	if (!c || !lxcapi_is_defined(c))
 		return false;
 	if (!lxcapi_snapshot_destroy_all(c)) {
@@ -2144,6 +3138,8 @@ static bool set_config_item_locked(struct lxc_container *c, const char *key, con
 {
 	struct lxc_config_t *config;
 
+	if (!load_unexp_config(c))
+		return false;
 	if (!c->lxc_conf)
 		c->lxc_conf = lxc_conf_init();
 	if (!c->lxc_unexp_conf) {
@@ -2163,9 +3159,10 @@ static bool set_config_item_locked(struct lxc_container *c, const char *key, con
 
 static bool lxcapi_set_config_item(struct lxc_container *c, const char *key, const char *v)
 {
+	LXC_API_STATS(set_config_item);
 	bool b = false;
 
-	if (!c)
+	if (!c || !lazy_load_config(c))
 		return false;
 
 	if (container_mem_lock(c))
@@ -2177,15 +3174,58 @@ static bool lxcapi_set_config_item(struct lxc_container *c, const char *key, con
 	return b;
 }
 
-static char *lxcapi_config_file_name(struct lxc_container *c)
+static bool lxcapi_set_config_items(struct lxc_container *c,
+		const char **keys, const char **values, int n, bool save)
 {
-	if (!c || !c->configfile)
-		return NULL;
-	return strdup(c->configfile);
+	LXC_API_STATS(set_config_items);
+	bool ret = false;
+	int i, lret;
+
+	if (!c || !lazy_load_config(c))
+		return false;
+
+	if (save && (!c->configfile || !create_container_dir(c)))
+		return false;
+
+	if (save)
+		lret = container_disk_lock(c);
+	else
+		lret = container_mem_lock(c);
+	if (lret)
+		return false;
+
+	for (i = 0; i < n; i++) {
+		if (!set_config_item_locked(c, keys[i], values[i])) {
+			ERROR("failed to set %s = %s", keys[i], values[i]);
+			goto out;
+		}
+	}
+
+	if (save)
+		ret = load_unexp_config(c) &&
+		      save_config_file(c->configfile, c->lxc_unexp_conf);
+	else
+		ret = true;
+
+out:
+	if (save)
+		container_disk_unlock(c);
+	else
+		container_mem_unlock(c);
+	return ret;
+}
+
+static char *lxcapi_config_file_name(struct lxc_container *c)
+{
+	LXC_API_STATS(config_file_name);
+	if (!c || !c->configfile)
+		return NULL;
+	return strdup(c->configfile);
 }
 
 static const char *lxcapi_get_config_path(struct lxc_container *c)
 {
+	LXC_API_STATS(get_config_path);
 	if (!c || !c->config_path)
 		return NULL;
 	return (const char *)(c->config_path);
@@ -2225,8 +3265,72 @@ static bool set_config_filename(struct lxc_container *c)
 	return true;
 }
 
+static bool lxcapi_keep_cmd_connection(struct lxc_container *c, bool keep)
+{
+	LXC_API_STATS(keep_cmd_connection);
+	bool b = true;
+
+	if (!c)
+		return false;
+
+	if (container_mem_lock(c))
+		return false;
+
+	if (keep && !c->cmd_conn_kept) {
+		/* waits on the container keep their connection too */
+		if (lxc_cmd_connection_get(c->name, c->config_path) < 0) {
+			b = false;
+		} else if (lxc_wait_monitor_hold(c->config_path) < 0) {
+			lxc_cmd_connection_put(c->name, c->config_path);
+			b = false;
+		} else
+			c->cmd_conn_kept = true;
+	} else if (!keep && c->cmd_conn_kept) {
+		lxc_cmd_connection_put(c->name, c->config_path);
+		lxc_wait_monitor_release(c->config_path);
+		c->cmd_conn_kept = false;
+	}
+
+	container_mem_unlock(c);
+	return b;
+}
+
+static bool lxcapi_cache_state(struct lxc_container *c, bool cache)
+{
+	LXC_API_STATS(cache_state);
+	struct lxc_state_watch *w = NULL;
+	bool ret = true;
+
+	if (!c)
+		return false;
+
+	/* the watch starts with the state the container is in */
+	if (cache) {
+		w = lxc_state_watch_new(c->config_path,
+					(const char **)&c->name, 1);
+		if (!w) {
+			ERROR("failed to watch the state of '%s'", c->name);
+			return false;
+		}
+	}
+
+	pthread_mutex_lock(&state_cache_lock);
+	if (c->state_watch)
+		lxc_state_watch_free(c->state_watch);
+	c->state_watch = w;
+	c->state_watch_owner = getpid();
+	c->cached_state = STOPPED;
+	c->cached_pid = 0;
+	c->state_stale = false;
+	if (w)
+		ret = state_cache_update(c);
+	pthread_mutex_unlock(&state_cache_lock);
+	return ret;
+}
+
 static bool lxcapi_set_config_path(struct lxc_container *c, const char *path)
 {
+	LXC_API_STATS(set_config_path);
 	char *p;
 	bool b = false;
 	char *oldpath = NULL;
@@ -2243,6 +3347,19 @@ static bool lxcapi_set_config_path(struct lxc_container *c, const char *path)
 		goto err;
 	}
 
+	/* the kept connection is to the container in the old path */
+	if (c->cmd_conn_kept) {
+		lxc_cmd_connection_put(c->name, c->config_path);
+		lxc_wait_monitor_release(c->config_path);
+		c->cmd_conn_kept = false;
+	}
+	if (c->state_watch) {
+		pthread_mutex_lock(&state_cache_lock);
+		lxc_state_watch_free(c->state_watch);
+		c->state_watch = NULL;
+		pthread_mutex_unlock(&state_cache_lock);
+	}
+
 	b = true;
 	if (c->config_path)
 		oldpath = c->config_path;
@@ -2267,6 +3384,7 @@ err:
 
 static bool lxcapi_set_cgroup_item(struct lxc_container *c, const char *subsys, const char *value)
 {
+	LXC_API_STATS(set_cgroup_item);
 	int ret;
 
 	if (!c)
@@ -2286,6 +3404,7 @@ static bool lxcapi_set_cgroup_item(struct lxc_container *c, const char *subsys,
 
 static int lxcapi_get_cgroup_item(struct lxc_container *c, const char *subsys, char *retv, int inlen)
 {
+	LXC_API_STATS(get_cgroup_item);
 	int ret;
 
 	if (!c)
@@ -2294,7 +3413,7 @@ static int lxcapi_get_cgroup_item(struct lxc_container *c, const char *subsys, c
 	if (is_stopped(c))
 		return -1;
 
-	if (container_disk_lock(c))
+	if (container_disk_rdlock(c))
 		return -1;
 
 	ret = lxc_cgroup_get(subsys, retv, inlen, c->name, c->config_path);
@@ -2303,1423 +3422,4274 @@ static int lxcapi_get_cgroup_item(struct lxc_container *c, const char *subsys, c
 	return ret;
 }
 
-const char *lxc_get_global_config_item(const char *key)
-{
-	return lxc_global_config_value(key);
-}
+/*
+ * A cgroup file of a sampler
+ * @fd      : the file, -1 if it could not be opened
+ * @fallback: the driver has no paths, so read it through lxc_cgroup_get()
+ * @buf     : where it is read to
+ * @size    : the size of @buf, grown to fit the file
+ */
+struct cgroup_stats_file {
+	int fd;
+	bool fallback;
+	char *buf;
+	size_t size;
+};
 
-const char *lxc_get_version(void)
-{
-	return LXC_VERSION;
-}
+/*
+ * @names   : the files of the keys, e.g. "cpuacct.stat"
+ * @fields  : the field of the keys, e.g. "user", or NULL
+ * @pids    : the init pid the files of each container were opened for
+ * @files   : nc * nk files, those of container i starting at i * nk
+ * @last    : the previous samples, laid out like the files
+ * @last_pid: the init pid of each container at its previous sample
+ * @last_ts : when the previous sample of each container was taken
+ */
+struct lxc_cgroup_stats {
+	struct lxc_container **cs;
+	int nc;
+	char **keys;
+	char **names;
+	const char **fields;
+	int nk;
+	pid_t *pids;
+	struct cgroup_stats_file *files;
+	struct lxc_cgroup_sample *last;
+	pid_t *last_pid;
+	struct timespec *last_ts;
+};
 
-static int copy_file(const char *old, const char *new)
+static void cgroup_stats_close(struct lxc_cgroup_stats *s, int i)
 {
-	int in, out;
-	ssize_t len, ret;
-	char buf[8096];
-	struct stat sbuf;
-
-	if (file_exists(new)) {
-		ERROR("copy destination %s exists", new);
-		return -1;
-	}
-	ret = stat(old, &sbuf);
-	if (ret < 0) {
-		INFO("Error stat'ing %s", old);
-		return -1;
-	}
+	struct cgroup_stats_file *f = &s->files[i * s->nk];
+	int j;
 
-	in = open(old, O_RDONLY);
-	if (in < 0) {
-		SYSERROR("Error opening original file %s", old);
-		return -1;
-	}
-	out = open(new, O_CREAT | O_EXCL | O_WRONLY, 0644);
-	if (out < 0) {
-		SYSERROR("Error opening new file %s", new);
-		close(in);
-		return -1;
+	for (j = 0; j < s->nk; j++) {
+		if (f[j].fd >= 0)
+			close(f[j].fd);
+		f[j].fd = -1;
+		f[j].fallback = false;
 	}
+}
 
-	while (1) {
-		len = read(in, buf, 8096);
-		if (len < 0) {
-			SYSERROR("Error reading old file %s", old);
-			goto err;
-		}
-		if (len == 0)
-			break;
-		ret = write(out, buf, len);
-		if (ret < len) { // should we retry?
-			SYSERROR("Error: write to new file %s was interrupted", new);
-			goto err;
+/* open the files of container i, resolving each subsystem's path once */
+static void cgroup_stats_open(struct lxc_cgroup_stats *s, int i)
+{
+	struct lxc_container *c = s->cs[i];
+	struct cgroup_stats_file *f = &s->files[i * s->nk];
+	char filename[MAXPATHLEN], **paths, *path, *subsystem;
+	size_t len;
+	int j, k, ret;
+
+	paths = alloca(s->nk * sizeof(*paths));
+	for (j = 0; j < s->nk; j++) {
+		paths[j] = NULL;
+		len = strcspn(s->names[j], ".");
+		for (k = 0; k < j; k++)
+			if (!strncmp(s->names[k], s->names[j], len + 1))
+				break;
+		if (k < j) {
+			path = paths[k];
+			f[j].fallback = f[k].fallback;
+		} else {
+			subsystem = alloca(len + 1);
+			memcpy(subsystem, s->names[j], len);
+			subsystem[len] = '\0';
+			path = paths[j] = lxc_cgroup_get_path(subsystem, c->name,
+							      c->config_path);
+			if (!path)
+				f[j].fallback = errno == ENOSYS;
 		}
-	}
-	close(in);
-	close(out);
+		if (!path)
+			continue;
 
-	// we set mode, but not owner/group
-	ret = chmod(new, sbuf.st_mode);
-	if (ret) {
-		SYSERROR("Error setting mode on %s", new);
-		return -1;
+		ret = snprintf(filename, MAXPATHLEN, "%s/%s", path, s->names[j]);
+		if (ret < 0 || ret >= MAXPATHLEN)
+			continue;
+		f[j].fd = open(filename, O_RDONLY | O_CLOEXEC);
+		if (f[j].fd < 0)
+			DEBUG("failed to open %s: %s", filename, strerror(errno));
 	}
+	for (j = 0; j < s->nk; j++)
+		free(paths[j]);
+}
 
-	return 0;
+static bool cgroup_stats_grow(struct cgroup_stats_file *f)
+{
+	size_t size = f->size ? f->size * 2 : 128;
+	char *buf;
 
-err:
-	close(in);
-	close(out);
-	return -1;
+	buf = realloc(f->buf, size);
+	if (!buf)
+		return false;
+	f->buf = buf;
+	f->size = size;
+	return true;
 }
 
-static int copyhooks(struct lxc_container *oldc, struct lxc_container *c)
+/* read key j of container i, NULL if it could not be */
+static const char *cgroup_stats_read_one(struct lxc_cgroup_stats *s, int i,
+					 int j)
 {
-	int i, len, ret;
-	struct lxc_list *it;
-	char *cpath;
+	struct lxc_container *c = s->cs[i];
+	struct cgroup_stats_file *f = &s->files[i * s->nk + j];
+	ssize_t ret;
 
-	len = strlen(oldc->config_path) + strlen(oldc->name) + 3;
-	cpath = alloca(len);
-	ret = snprintf(cpath, len, "%s/%s/", oldc->config_path, oldc->name);
-	if (ret < 0 || ret >= len)
-		return -1;
+	if (f->fd < 0 && !f->fallback)
+		return NULL;
+	if (!f->size && !cgroup_stats_grow(f))
+		return NULL;
 
-	for (i=0; i<NUM_LXC_HOOKS; i++) {
-		lxc_list_for_each(it, &c->lxc_conf->hooks[i]) {
-			char *hookname = it->elem;
-			char *fname = strrchr(hookname, '/');
-			char tmppath[MAXPATHLEN];
-			if (!fname) // relative path - we don't support, but maybe we should
-				return 0;
-			if (strncmp(hookname, cpath, len - 1) != 0) {
-				// this hook is public - ignore
-				continue;
-			}
-			// copy the script, and change the entry in confile
-			ret = snprintf(tmppath, MAXPATHLEN, "%s/%s/%s",
-					c->config_path, c->name, fname+1);
-			if (ret < 0 || ret >= MAXPATHLEN)
-				return -1;
-			ret = copy_file(it->elem, tmppath);
-			if (ret < 0)
-				return -1;
-			free(it->elem);
-			it->elem = strdup(tmppath);
-			if (!it->elem) {
-				ERROR("out of memory copying hook path");
-				return -1;
-			}
+	for (;;) {
+		if (f->fallback)
+			ret = lxc_cgroup_get(s->names[j], f->buf, f->size - 1,
+					     c->name, c->config_path);
+		else
+			ret = pread(f->fd, f->buf, f->size - 1, 0);
+		if (ret < 0)
+			break;
+		if ((size_t)ret < f->size - 1) {
+			f->buf[ret] = '\0';
+			return f->buf;
 		}
+		if (!cgroup_stats_grow(f))
+			return NULL;
 	}
 
-	c->save_config(c, NULL);
-	return 0;
+	/* the cgroup may be gone, resolve it again next time */
+	if (!f->fallback)
+		s->pids[i] = 0;
+	return NULL;
 }
 
-static void new_hwaddr(char *hwaddr)
+struct lxc_cgroup_stats *lxc_cgroup_stats_new(struct lxc_container **cs,
+		int nc, const char **keys, int nk)
 {
-	FILE *f;
-	f = fopen("/dev/urandom", "r");
-	if (f) {
-		unsigned int seed;
-		int ret = fread(&seed, sizeof(seed), 1, f);
-		if (ret != 1)
-			seed = time(NULL);
-		fclose(f);
-		srand(seed);
-	} else
-		srand(time(NULL));
-	snprintf(hwaddr, 18, "00:16:3e:%02x:%02x:%02x",
-			rand() % 255, rand() % 255, rand() % 255);
-}
+	struct lxc_cgroup_stats *s;
+	const char *field;
+	int i;
 
-static void network_new_hwaddrs(struct lxc_container *c)
-{
-	struct lxc_list *it;
+	if (!cs || nc <= 0 || !keys || nk <= 0)
+		return NULL;
 
-	lxc_list_for_each(it, &c->lxc_conf->network) {
-		struct lxc_netdev *n = it->elem;
-		if (n->hwaddr)
-			new_hwaddr(n->hwaddr);
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->nc = nc;
+	s->nk = nk;
+	s->cs = malloc(nc * sizeof(*s->cs));
+	s->keys = calloc(nk, sizeof(*s->keys));
+	s->names = calloc(nk, sizeof(*s->names));
+	s->fields = calloc(nk, sizeof(*s->fields));
+	s->pids = calloc(nc, sizeof(*s->pids));
+	s->files = calloc(nc * nk, sizeof(*s->files));
+	s->last = calloc(nc * nk, sizeof(*s->last));
+	s->last_pid = calloc(nc, sizeof(*s->last_pid));
+	s->last_ts = calloc(nc, sizeof(*s->last_ts));
+	if (!s->cs || !s->keys || !s->names || !s->fields || !s->pids ||
+	    !s->files || !s->last || !s->last_pid || !s->last_ts)
+		goto err;
+
+	memcpy(s->cs, cs, nc * sizeof(*s->cs));
+	for (i = 0; i < nk; i++) {
+		field = strchr(keys[i], ':');
+		s->keys[i] = strdup(keys[i]);
+		s->names[i] = field ? strndup(keys[i], field - keys[i]) :
+				      strdup(keys[i]);
+		if (!s->keys[i] || !s->names[i])
+			goto err;
+		if (field)
+			s->fields[i] = s->keys[i] + (field - keys[i]) + 1;
 	}
+	for (i = 0; i < nc * nk; i++)
+		s->files[i].fd = -1;
+	return s;
+
+err:
+	ERROR("failed to allocate cgroup sampler");
+	lxc_cgroup_stats_free(s);
+	return NULL;
 }
 
-static int copy_fstab(struct lxc_container *oldc, struct lxc_container *c)
+/* get the files of container i ready, returns its init pid or 0 */
+static pid_t cgroup_stats_refresh(struct lxc_cgroup_stats *s, int i)
 {
-	char newpath[MAXPATHLEN];
-	char *oldpath = oldc->lxc_conf->fstab;
-	int ret;
+	struct lxc_container *c = s->cs[i];
+	pid_t pid;
 
-	if (!oldpath)
+	pid = c->init_pid(c);
+	if (pid <= 0) {
+		if (s->pids[i])
+			cgroup_stats_close(s, i);
+		s->pids[i] = 0;
 		return 0;
-
-	char *p = strrchr(oldpath, '/');
-	if (!p)
-		return -1;
-	ret = snprintf(newpath, MAXPATHLEN, "%s/%s%s",
-			c->config_path, c->name, p);
-	if (ret < 0 || ret >= MAXPATHLEN) {
-		ERROR("error printing new path for %s", oldpath);
-		return -1;
 	}
-	if (file_exists(newpath)) {
-		ERROR("error: fstab file %s exists", newpath);
-		return -1;
+
+	/* a new run of the container means new cgroups */
+	if (pid != s->pids[i]) {
+		cgroup_stats_close(s, i);
+		cgroup_stats_open(s, i);
+		s->pids[i] = pid;
 	}
+	return pid;
+}
 
-	if (copy_file(oldpath, newpath) < 0) {
-		ERROR("error: copying %s to %s", oldpath, newpath);
+int lxc_cgroup_stats_read(struct lxc_cgroup_stats *s, const char **values)
+{
+	int i, j, running = 0;
+
+	if (!s || !values)
 		return -1;
+
+	for (i = 0; i < s->nc; i++) {
+		if (!cgroup_stats_refresh(s, i)) {
+			for (j = 0; j < s->nk; j++)
+				values[i * s->nk + j] = NULL;
+			continue;
+		}
+		for (j = 0; j < s->nk; j++)
+			values[i * s->nk + j] = cgroup_stats_read_one(s, i, j);
+		running++;
 	}
-	free(c->lxc_conf->fstab);
-	c->lxc_conf->fstab = strdup(newpath);
-	if (!c->lxc_conf->fstab) {
-		ERROR("error: allocating pathname");
-		return -1;
+	return running;
+}
+
+/* the number at the start of @v, or of its line starting with @field */
+static bool cgroup_stats_parse(const char *v, const char *field,
+			       uint64_t *value)
+{
+	size_t len;
+	char *end;
+
+	if (field) {
+		len = strlen(field);
+		while (strncmp(v, field, len) || (v[len] != ' ' && v[len] != '\t')) {
+			v = strchr(v, '\n');
+			if (!v)
+				return false;
+			v++;
+		}
+		v += len;
 	}
 
-	return 0;
+	errno = 0;
+	*value = strtoull(v, &end, 10);
+	return !errno && end != v;
 }
 
-static void copy_rdepends(struct lxc_container *c, struct lxc_container *c0)
+int lxc_cgroup_stats_sample(struct lxc_cgroup_stats *s,
+		struct lxc_cgroup_sample *samples)
 {
-	char path0[MAXPATHLEN], path1[MAXPATHLEN];
-	int ret;
+	struct lxc_cgroup_sample *sample, *last;
+	struct timespec now;
+	const char *v;
+	double elapsed;
+	int i, j, running = 0;
+	pid_t pid;
 
-	ret = snprintf(path0, MAXPATHLEN, "%s/%s/lxc_rdepends", c0->config_path,
-		c0->name);
-	if (ret < 0 || ret >= MAXPATHLEN) {
-		WARN("Error copying reverse dependencies");
-		return;
-	}
-	ret = snprintf(path1, MAXPATHLEN, "%s/%s/lxc_rdepends", c->config_path,
-		c->name);
-	if (ret < 0 || ret >= MAXPATHLEN) {
-		WARN("Error copying reverse dependencies");
-		return;
-	}
-	if (copy_file(path0, path1) < 0) {
-		INFO("Error copying reverse dependencies");
-		return;
+	if (!s || !samples)
+		return -1;
+
+	for (i = 0; i < s->nc; i++) {
+		pid = cgroup_stats_refresh(s, i);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = now.tv_sec - s->last_ts[i].tv_sec +
+			  (now.tv_nsec - s->last_ts[i].tv_nsec) / 1e9;
+
+		for (j = 0; j < s->nk; j++) {
+			sample = &samples[i * s->nk + j];
+			last = &s->last[i * s->nk + j];
+			memset(sample, 0, sizeof(*sample));
+			v = pid ? cgroup_stats_read_one(s, i, j) : NULL;
+			if (v)
+				sample->valid = cgroup_stats_parse(v,
+						s->fields[j], &sample->value);
+			if (sample->valid && last->valid &&
+			    pid == s->last_pid[i] && elapsed > 0)
+				sample->rate = ((double)sample->value -
+						(double)last->value) / elapsed;
+			*last = *sample;
+		}
+
+		s->last_pid[i] = pid;
+		s->last_ts[i] = now;
+		if (pid)
+			running++;
 	}
+	return running;
 }
 
-static bool add_rdepends(struct lxc_container *c, struct lxc_container *c0)
+void lxc_cgroup_stats_free(struct lxc_cgroup_stats *s)
 {
-	int ret;
-	char path[MAXPATHLEN];
-	FILE *f;
-	bool bret;
+	int i;
+
+	if (!s)
+		return;
+	if (s->files) {
+		for (i = 0; i < s->nc; i++)
+			cgroup_stats_close(s, i);
+		for (i = 0; i < s->nc * s->nk; i++)
+			free(s->files[i].buf);
+		free(s->files);
+	}
+	if (s->keys) {
+		for (i = 0; i < s->nk; i++)
+			free(s->keys[i]);
+		free(s->keys);
+	}
+	if (s->names) {
+		for (i = 0; i < s->nk; i++)
+			free(s->names[i]);
+		free(s->names);
+	}
+	free(s->fields);
+	free(s->last);
+	free(s->last_pid);
+	free(s->last_ts);
+	free(s->pids);
+	free(s->cs);
+	free(s);
+}
+
+static bool cgroup_stats_same_keys(struct lxc_cgroup_stats *s,
+				   const char **keys, int n)
+{
+	int i;
+
+	if (s->nk != n)
+		return false;
+	for (i = 0; i < n; i++)
+		if (strcmp(s->keys[i], keys[i]))
+			return false;
+	return true;
+}
+
+static bool lxcapi_get_cgroup_items(struct lxc_container *c,
+		const char **keys, int n, char **values)
+{
+	LXC_API_STATS(get_cgroup_items);
+	const char **v;
+	bool bret = false;
+	int i;
+
+	if (!c || !keys || n <= 0 || !values)
+		return false;
+
+	v = alloca(n * sizeof(*v));
+	if (container_mem_lock(c))
+		return false;
+
+	if (c->cgroup_stats && !cgroup_stats_same_keys(c->cgroup_stats, keys, n)) {
+		lxc_cgroup_stats_free(c->cgroup_stats);
+		c->cgroup_stats = NULL;
+	}
+	if (!c->cgroup_stats)
+		c->cgroup_stats = lxc_cgroup_stats_new(&c, 1, keys, n);
+	if (!c->cgroup_stats || lxc_cgroup_stats_read(c->cgroup_stats, v) != 1)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		values[i] = v[i] ? strdup(v[i]) : NULL;
+		if (v[i] && !values[i]) {
+			while (i--)
+				free(values[i]);
+			goto out;
+		}
+	}
+	bret = true;
+out:
+	container_mem_unlock(c);
+	return bret;
+}
+
+/*
+ * Host side names of the veth interfaces of running container @c, and their
+ * index in lxc.network, read with a single command.  Returns the number of
+ * veth interfaces, -1 on error.
+ */
+static int net_stats_pairs(struct lxc_container *c, int **netnrs,
+		char ***names)
+{
+	const char **keys;
+	char **values;
+	char (*buf)[64];
+	int i, n, nr = 0, ret = -1;
+
+	*netnrs = NULL;
+	*names = NULL;
+	if (!c || !lazy_load_config(c) || !c->lxc_conf)
+		return -1;
+	n = lxc_list_len(&c->lxc_conf->network);
+	if (!n)
+		return 0;
+
+	keys = malloc(2 * n * sizeof(*keys));
+	values = calloc(2 * n, sizeof(*values));
+	buf = malloc(2 * n * sizeof(*buf));
+	*netnrs = malloc(n * sizeof(**netnrs));
+	*names = malloc(n * sizeof(**names));
+	if (!keys || !values || !buf || !*netnrs || !*names)
+		goto out;
+	for (i = 0; i < n; i++) {
+		sprintf(buf[2 * i], "lxc.network.%d.type", i);
+		sprintf(buf[2 * i + 1], "lxc.network.%d.veth.pair", i);
+		keys[2 * i] = buf[2 * i];
+		keys[2 * i + 1] = buf[2 * i + 1];
+	}
+	if (!c->get_running_config_items(c, keys, 2 * n, values))
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		if (!values[2 * i] || strcmp(values[2 * i], "veth") ||
+		    !values[2 * i + 1] || !*values[2 * i + 1])
+			continue;
+		(*netnrs)[nr] = i;
+		(*names)[nr++] = values[2 * i + 1];
+		values[2 * i + 1] = NULL;
+	}
+	ret = nr;
+out:
+	if (values)
+		for (i = 0; i < 2 * n; i++)
+			free(values[i]);
+	free(values);
+	free(keys);
+	free(buf);
+	if (ret < 0) {
+		free(*netnrs);
+		free(*names);
+		*netnrs = NULL;
+		*names = NULL;
+	}
+	return ret;
+}
+
+void lxc_net_stats_free(struct lxc_net_stats *stats, int n)
+{
+	int i;
+
+	if (!stats)
+		return;
+	for (i = 0; i < n; i++)
+		free(stats[i].ifname);
+	free(stats);
+}
+
+int lxc_get_net_stats(struct lxc_container **list, int n,
+		struct lxc_net_stats **stats, int *counts)
+{
+	struct lxc_netdev_stats *ns = NULL;
+	const char **all = NULL;
+	int **netnrs = NULL;
+	char ***names = NULL;
+	int *pairs = NULL, *found = NULL;
+	int i, j, k, total = 0, done = 0, ret = -1;
+
+	if (!list || n <= 0 || !stats || !counts)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		stats[i] = NULL;
+		counts[i] = -1;
+	}
+	netnrs = calloc(n, sizeof(*netnrs));
+	names = calloc(n, sizeof(*names));
+	pairs = calloc(n, sizeof(*pairs));
+	if (!netnrs || !names || !pairs)
+		goto out;
+	for (i = 0; i < n; i++) {
+		pairs[i] = -1;
+		if (!list[i] || !list[i]->is_running(list[i]))
+			continue;
+		pairs[i] = net_stats_pairs(list[i], &netnrs[i], &names[i]);
+		if (pairs[i] > 0)
+			total += pairs[i];
+	}
+
+	if (total) {
+		all = malloc(total * sizeof(*all));
+		ns = malloc(total * sizeof(*ns));
+		found = malloc(total * sizeof(*found));
+		if (!all || !ns || !found)
+			goto out;
+		for (i = 0, k = 0; i < n; i++)
+			for (j = 0; j < pairs[i]; j++)
+				all[k++] = names[i][j];
+		if (lxc_netdev_get_stats(all, total, ns, found) < 0)
+			goto out;
+	}
+
+	/* the counters are the host side's, swap them for the container */
+	for (i = 0, k = 0; i < n; i++) {
+		struct lxc_net_stats *s;
+		int nr = 0;
+
+		if (pairs[i] < 0)
+			continue;
+		counts[i] = 0;
+		done++;
+		if (!pairs[i])
+			continue;
+		s = calloc(pairs[i], sizeof(*s));
+		if (!s) {
+			k += pairs[i];
+			counts[i] = -1;
+			done--;
+			continue;
+		}
+		for (j = 0; j < pairs[i]; j++, k++) {
+			if (!found[k])
+				continue;
+			s[nr].netnr = netnrs[i][j];
+			s[nr].ifname = names[i][j];
+			names[i][j] = NULL;
+			s[nr].rx_packets = ns[k].tx_packets;
+			s[nr].tx_packets = ns[k].rx_packets;
+			s[nr].rx_bytes = ns[k].tx_bytes;
+			s[nr].tx_bytes = ns[k].rx_bytes;
+			s[nr].rx_errors = ns[k].tx_errors;
+			s[nr].tx_errors = ns[k].rx_errors;
+			s[nr].rx_dropped = ns[k].tx_dropped;
+			s[nr].tx_dropped = ns[k].rx_dropped;
+			nr++;
+		}
+		if (!nr) {
+			free(s);
+			s = NULL;
+		}
+		stats[i] = s;
+		counts[i] = nr;
+	}
+	ret = done;
+out:
+	for (i = 0; i < n; i++) {
+		if (names && names[i]) {
+			for (j = 0; j < pairs[i]; j++)
+				free(names[i][j]);
+			free(names[i]);
+		}
+		if (netnrs)
+			free(netnrs[i]);
+	}
+	free(names);
+	free(netnrs);
+	free(pairs);
+	free(all);
+	free(ns);
+	free(found);
+	return ret;
+}
+
+static int lxcapi_get_net_stats(struct lxc_container *c,
+		struct lxc_net_stats **stats)
+{
+	LXC_API_STATS(get_net_stats);
+	int count;
+
+	if (!c || !stats)
+		return -1;
+	if (lxc_get_net_stats(&c, 1, stats, &count) < 0)
+		return -1;
+	return count;
+}
+
+const char *lxc_get_global_config_item(const char *key)
+{
+	return lxc_global_config_value(key);
+}
+
+const char *lxc_get_version(void)
+{
+	return LXC_VERSION;
+}
+
+static int copy_file(const char *old, const char *new)
+{
+	int in, out;
+	struct stat sbuf;
+
+	in = open(old, O_RDONLY | O_CLOEXEC);
+	if (in < 0) {
+		SYSERROR("Error opening original file %s", old);
+		return -1;
+	}
+	if (fstat(in, &sbuf) < 0) {
+		INFO("Error stat'ing %s", old);
+		close(in);
+		return -1;
+	}
+	out = open(new, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+	if (out < 0) {
+		if (errno == EEXIST)
+			ERROR("copy destination %s exists", new);
+		else
+			SYSERROR("Error opening new file %s", new);
+		close(in);
+		return -1;
+	}
+
+	if (lxc_copy_fd(in, out, &sbuf) < 0) {
+		SYSERROR("Error copying %s to %s", old, new);
+		goto err;
+	}
+
+	// we set mode, but not owner/group
+	if (fchmod(out, sbuf.st_mode) < 0) {
+		SYSERROR("Error setting mode on %s", new);
+		goto err;
+	}
+
+	close(in);
+	return close(out) < 0 ? -1 : 0;
+
+err:
+	close(in);
+	close(out);
+	return -1;
+}
+
+/* point the hooks of @conf which run @old at @new, it is saved as is */
+static bool clone_update_hook(struct lxc_conf *conf, int i, const char *old,
+		const char *new)
+{
+	struct lxc_list *it;
+
+	if (!conf)
+		return true;
+	lxc_list_for_each(it, &conf->hooks[i]) {
+		if (strcmp(it->elem, old) != 0)
+			continue;
+		free(it->elem);
+		it->elem = strdup(new);
+		if (!it->elem) {
+			ERROR("out of memory copying hook path");
+			return false;
+		}
+	}
+	return true;
+}
+
+static int copyhooks(struct lxc_container *oldc, struct lxc_container *c)
+{
+	int i, len, ret;
+	struct lxc_list *it;
+	char *cpath;
+
+	len = strlen(oldc->config_path) + strlen(oldc->name) + 3;
+	cpath = alloca(len);
+	ret = snprintf(cpath, len, "%s/%s/", oldc->config_path, oldc->name);
+	if (ret < 0 || ret >= len)
+		return -1;
+
+	for (i=0; i<NUM_LXC_HOOKS; i++) {
+		lxc_list_for_each(it, &c->lxc_conf->hooks[i]) {
+			char *hookname = it->elem;
+			char *fname = strrchr(hookname, '/');
+			char tmppath[MAXPATHLEN];
+			if (!fname) // relative path - we don't support, but maybe we should
+				return 0;
+			if (strncmp(hookname, cpath, len - 1) != 0) {
+				// this hook is public - ignore
+				continue;
+			}
+			// copy the script, and change the entry in confile
+			ret = snprintf(tmppath, MAXPATHLEN, "%s/%s/%s",
+					c->config_path, c->name, fname+1);
+			if (ret < 0 || ret >= MAXPATHLEN)
+				return -1;
+			ret = copy_file(it->elem, tmppath);
+			if (ret < 0)
+				return -1;
+			if (!clone_update_hook(c->lxc_unexp_conf, i, hookname,
+					tmppath))
+				return -1;
+			free(it->elem);
+			it->elem = strdup(tmppath);
+			if (!it->elem) {
+				ERROR("out of memory copying hook path");
+				return -1;
+			}
+		}
+	}
+
+	c->save_config(c, NULL);
+	return 0;
+}
+
+static void new_hwaddr(char *hwaddr)
+{
+	FILE *f;
+	f = fopen("/dev/urandom", "re");
+	if (f) {
+		unsigned int seed;
+		int ret = fread(&seed, sizeof(seed), 1, f);
+		if (ret != 1)
+			seed = time(NULL);
+		fclose(f);
+		srand(seed);
+	} else
+		srand(time(NULL));
+	snprintf(hwaddr, 18, "00:16:3e:%02x:%02x:%02x",
+			rand() % 255, rand() % 255, rand() % 255);
+}
+
+static void network_new_hwaddrs(struct lxc_container *c)
+{
+	struct lxc_list *it, *unexp = NULL, *uit = NULL;
+
+	/*
+	 * The unexpanded config is what gets saved, it gets the same
+	 * addresses: its nics come in the same order.
+	 */
+	if (c->lxc_unexp_conf) {
+		unexp = &c->lxc_unexp_conf->network;
+		uit = unexp->next;
+	}
+	lxc_list_for_each(it, &c->lxc_conf->network) {
+		struct lxc_netdev *n = it->elem, *u = NULL;
+
+		if (unexp && uit != unexp) {
+			u = uit->elem;
+			uit = uit->next;
+		}
+		if (!n->hwaddr)
+			continue;
+		new_hwaddr(n->hwaddr);
+		if (u && u->hwaddr)
+			snprintf(u->hwaddr, 18, "%s", n->hwaddr);
+	}
+}
+
+static int copy_fstab(struct lxc_container *oldc, struct lxc_container *c)
+{
+	char newpath[MAXPATHLEN];
+	char *oldpath = oldc->lxc_conf->fstab;
+	int ret;
+
+	if (!oldpath)
+		return 0;
+
+	char *p = strrchr(oldpath, '/');
+	if (!p)
+		return -1;
+	ret = snprintf(newpath, MAXPATHLEN, "%s/%s%s",
+			c->config_path, c->name, p);
+	if (ret < 0 || ret >= MAXPATHLEN) {
+		ERROR("error printing new path for %s", oldpath);
+		return -1;
+	}
+	if (file_exists(newpath)) {
+		ERROR("error: fstab file %s exists", newpath);
+		return -1;
+	}
+
+	if (copy_file(oldpath, newpath) < 0) {
+		ERROR("error: copying %s to %s", oldpath, newpath);
+		return -1;
+	}
+	free(c->lxc_conf->fstab);
+	c->lxc_conf->fstab = strdup(newpath);
+	if (!c->lxc_conf->fstab) {
+		ERROR("error: allocating pathname");
+		return -1;
+	}
+	/* what gets saved is the unexpanded config */
+	if (c->lxc_unexp_conf && c->lxc_unexp_conf->fstab &&
+			strcmp(c->lxc_unexp_conf->fstab, oldpath) == 0) {
+		free(c->lxc_unexp_conf->fstab);
+		c->lxc_unexp_conf->fstab = strdup(newpath);
+		if (!c->lxc_unexp_conf->fstab) {
+			ERROR("error: allocating pathname");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void copy_rdepends(struct lxc_container *c, struct lxc_container *c0)
+{
+	char path0[MAXPATHLEN], path1[MAXPATHLEN];
+	int ret;
+
+	ret = snprintf(path0, MAXPATHLEN, "%s/%s/lxc_rdepends", c0->config_path,
+		c0->name);
+	if (ret < 0 || ret >= MAXPATHLEN) {
+		WARN("Error copying reverse dependencies");
+		return;
+	}
+	ret = snprintf(path1, MAXPATHLEN, "%s/%s/lxc_rdepends", c->config_path,
+		c->name);
+	if (ret < 0 || ret >= MAXPATHLEN) {
+		WARN("Error copying reverse dependencies");
+		return;
+	}
+	if (copy_file(path0, path1) < 0) {
+		INFO("Error copying reverse dependencies");
+		return;
+	}
+}
+
+static bool add_rdepends(struct lxc_container *c, struct lxc_container *c0)
+{
+	int ret;
+	char path[MAXPATHLEN];
+	FILE *f;
+	bool bret;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/%s/lxc_rdepends", c->config_path,
+		c->name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return false;
+	f = fopen(path, "ae");
+	if (!f)
+		return false;
+	bret = true;
+	// if anything goes wrong, just return an error
+	if (fprintf(f, "%s\n%s\n", c0->config_path, c0->name) < 0)
+		bret = false;
+	if (fclose(f) != 0)
+		bret = false;
+	return bret;
+}
+
+static int copy_storage(struct lxc_container *c0, struct lxc_container *c,
+		const char *newtype, int flags, const char *bdevdata, uint64_t newsize)
+{
+	struct bdev *bdev;
+	int need_rdep;
+
+	bdev = bdev_copy(c0, c->name, c->config_path, newtype, flags,
+			bdevdata, newsize, &need_rdep);
+	if (!bdev) {
+		ERROR("Error copying storage");
+		return -1;
+	}
+	free(c->lxc_conf->rootfs.path);
+	c->lxc_conf->rootfs.path = strdup(bdev->src);
+	bdev_put(bdev);
+	if (!c->lxc_conf->rootfs.path) {
+		ERROR("Out of memory while setting storage path");
+		return -1;
+	}
+	free(c->lxc_unexp_conf->rootfs.path);
+	c->lxc_unexp_conf->rootfs.path = strdup(c->lxc_conf->rootfs.path);
+	if (!c->lxc_unexp_conf->rootfs.path) {
+		ERROR("Out of memory while setting storage path");
+		return -1;
+	}
+	if (flags & LXC_CLONE_SNAPSHOT)
+		copy_rdepends(c, c0);
+	if (need_rdep) {
+		if (!add_rdepends(c, c0))
+			WARN("Error adding reverse dependency from %s to %s",
+				c->name, c0->name);
+	}
+
+	mod_all_rdeps(c, true);
+
+	return 0;
+}
+
+struct clone_update_data {
+	struct lxc_container *c0;
+	struct lxc_container *c1;
+	int flags;
+	char **hookargs;
+};
+
+/*
+ * Replace the host name @oldname by @newname in the hosts file @path,
+ * leaving the rest of it alone.
+ */
+static int update_hosts_file(const char *path, const char *oldname,
+		const char *newname)
+{
+	FILE *f, *out;
+	char *line = NULL, *buf = NULL, *p, *q;
+	size_t linelen = 0, len = 0, oldlen = strlen(oldname);
+	bool changed = false;
+	int ret = -1;
+
+	f = fopen(path, "re");
+	if (!f)
+		return errno == ENOENT ? 0 : -1;
+	out = open_memstream(&buf, &len);
+	if (!out) {
+		fclose(f);
+		return -1;
+	}
+
+	while (getline(&line, &linelen, f) != -1) {
+		/* whole words before any comment */
+		for (p = line; *p && *p != '#'; p = q) {
+			q = p + strcspn(p, " \t\n#");
+			if ((size_t)(q - p) == oldlen && !strncmp(p, oldname, oldlen)) {
+				fputs(newname, out);
+				changed = true;
+			} else
+				fwrite(p, 1, q - p, out);
+			p = q;
+			q = p + strspn(p, " \t\n");
+			fwrite(p, 1, q - p, out);
+		}
+		fputs(p, out);
+	}
+	free(line);
+	fclose(f);
+	if (fclose(out) != 0)
+		goto out;
+
+	if (!changed || lxc_write_to_file(path, buf, len, false) == 0)
+		ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+static int clone_update_rootfs(struct clone_update_data *data)
+{
+	struct lxc_container *c0 = data->c0;
+	struct lxc_container *c = data->c1;
+	int flags = data->flags;
+	char **hookargs = data->hookargs;
+	int ret = -1;
+	char path[MAXPATHLEN], hosts[MAXPATHLEN];
+	struct bdev *bdev;
+	FILE *fout;
+	struct lxc_conf *conf = c->lxc_conf;
+
+	/* update hostname in rootfs */
+	/* we're going to mount, so run in a clean namespace to simplify cleanup */
+
+	if (setgid(0) < 0) {
+		ERROR("Failed to setgid to 0");
+		return -1;
+	}
+	if (setuid(0) < 0) {
+		ERROR("Failed to setuid to 0");
+		return -1;
+	}
+	if (setgroups(0, NULL) < 0)
+		WARN("Failed to clear groups");
+
+	if (unshare(CLONE_NEWNS) < 0)
+		return -1;
+	bdev = bdev_init(c->lxc_conf, c->lxc_conf->rootfs.path, c->lxc_conf->rootfs.mount, NULL);
+	if (!bdev)
+		return -1;
+	if (strcmp(bdev->type, "dir") != 0) {
+		if (unshare(CLONE_NEWNS) < 0) {
+			ERROR("error unsharing mounts");
+			bdev_put(bdev);
+			return -1;
+		}
+		if (detect_shared_rootfs()) {
+			if (mount(NULL, "/", NULL, MS_SLAVE|MS_REC, NULL)) {
+				SYSERROR("Failed to make / rslave");
+				ERROR("Continuing...");
+			}
+		}
+		if (bdev->ops->mount(bdev) < 0) {
+			bdev_put(bdev);
+			return -1;
+		}
+	} else { // TODO come up with a better way
+		if (bdev->dest)
+			free(bdev->dest);
+		bdev->dest = strdup(bdev->src);
+	}
+
+	if (!lxc_list_empty(&conf->hooks[LXCHOOK_CLONE])) {
+		/* Start of environment variable setup for hooks */
+		if (setenv("LXC_SRC_NAME", c0->name, 1)) {
+			SYSERROR("failed to set environment variable for source container name");
+		}
+		if (setenv("LXC_NAME", c->name, 1)) {
+			SYSERROR("failed to set environment variable for container name");
+		}
+		if (setenv("LXC_CONFIG_FILE", conf->rcfile, 1)) {
+			SYSERROR("failed to set environment variable for config path");
+		}
+		if (setenv("LXC_ROOTFS_MOUNT", bdev->dest, 1)) {
+			SYSERROR("failed to set environment variable for rootfs mount");
+		}
+		if (setenv("LXC_ROOTFS_PATH", conf->rootfs.path, 1)) {
+			SYSERROR("failed to set environment variable for rootfs mount");
+		}
+
+		if (run_lxc_hooks(c->name, "clone", conf, c->get_config_path(c), hookargs)) {
+			ERROR("Error executing clone hook for %s", c->name);
+			bdev_put(bdev);
+			return -1;
+		}
+	}
+
+	if (!(flags & LXC_CLONE_KEEPNAME)) {
+		/* the hostname may show in /etc/hosts too */
+		ret = snprintf(hosts, MAXPATHLEN, "%s/etc/hosts", bdev->dest);
+		if (ret >= 0 && ret < MAXPATHLEN)
+			ret = snprintf(path, MAXPATHLEN, "%s/etc/hostname", bdev->dest);
+		bdev_put(bdev);
+
+		if (ret < 0 || ret >= MAXPATHLEN)
+			return -1;
+		if (update_hosts_file(hosts, c0->name, c->name) < 0)
+			WARN("unable to update %s: ignoring", hosts);
+		if (!file_exists(path))
+			return 0;
+		if (!(fout = fopen(path, "we"))) {
+			SYSERROR("unable to open %s: ignoring", path);
+			return 0;
+		}
+		if (fprintf(fout, "%s", c->name) < 0) {
+			fclose(fout);
+			return -1;
+		}
+		if (fclose(fout) < 0)
+			return -1;
+	}
+	else
+		bdev_put(bdev);
+
+	return 0;
+}
+
+static int clone_update_rootfs_wrapper(void *data)
+{
+	struct clone_update_data *arg = (struct clone_update_data *) data;
+	return clone_update_rootfs(arg);
+}
+
+/* run clone_update_rootfs() in a child, which we wait for */
+static int clone_update_rootfs_child(struct lxc_container *c,
+		struct lxc_container *c2, int flags, char **hookargs)
+{
+	struct clone_update_data data;
+	pid_t pid;
+	int ret;
+
+	if ((pid = fork()) < 0) {
+		SYSERROR("fork");
+		return -1;
+	}
+	if (pid > 0)
+		return wait_for_pid(pid) ? -1 : 0;
+
+	data.c0 = c;
+	data.c1 = c2;
+	data.flags = flags;
+	data.hookargs = hookargs;
+	if (am_unpriv())
+		ret = userns_exec_1(c->lxc_conf, clone_update_rootfs_wrapper,
+				&data);
+	else
+		ret = clone_update_rootfs(&data);
+	exit(ret < 0 ? 1 : 0);
+}
+
+/*
+ * We want to support:
+sudo lxc-clone -o o1 -n n1 -s -L|-fssize fssize -v|--vgname vgname \
+        -p|--lvprefix lvprefix -t|--fstype fstype  -B backingstore
+
+-s [ implies overlayfs]
+-s -B overlayfs
+-s -B aufs
+
+only rootfs gets converted (copied/snapshotted) on clone.
+*/
+
+static int create_file_dirname(char *path)
+{
+	char *p = strrchr(path, '/');
+	int ret;
+
+	if (!p)
+		return -1;
+	*p = '\0';
+	ret = mkdir(path, 0755);
+	if (ret && errno != EEXIST)
+		SYSERROR("creating container path %s", path);
+	*p = '/';
+	return ret;
+}
+
+static struct lxc_container *container_new(const char *name,
+		const char *configpath, bool lazy);
+
+/* give the lazily created c2 copies of c's configuration */
+static bool clone_config(struct lxc_container *c, struct lxc_container *c2)
+{
+	if (!load_unexp_config(c))
+		return false;
+	c2->lxc_conf = lxc_conf_dup(c->lxc_conf);
+	c2->lxc_unexp_conf = lxc_conf_dup(c->lxc_unexp_conf);
+	if (!c2->lxc_conf || !c2->lxc_unexp_conf)
+		goto err;
+
+	free(c2->lxc_conf->rcfile);
+	free(c2->lxc_unexp_conf->rcfile);
+	c2->lxc_conf->rcfile = strdup(c2->configfile);
+	c2->lxc_unexp_conf->rcfile = strdup(c2->configfile);
+	if (!c2->lxc_conf->rcfile || !c2->lxc_unexp_conf->rcfile)
+		goto err;
+
+	c2->lazy_config = false;
+	return true;
+
+err:
+	lxc_conf_free(c2->lxc_conf);
+	lxc_conf_free(c2->lxc_unexp_conf);
+	c2->lxc_conf = NULL;
+	c2->lxc_unexp_conf = NULL;
+	return false;
+}
+
+/* the config every clone of c starts from */
+static int clone_config_text(struct lxc_container *c, char **buf, size_t *len)
+{
+	char *origroot = NULL;
+	FILE *f;
+	int ret = 0;
+
+	if (!load_unexp_config(c))
+		return -1;
+	f = open_memstream(buf, len);
+	if (!f) {
+		SYSERROR("clone: failed to allocate config buffer");
+		return -1;
+	}
+	if (c->lxc_conf->rootfs.path) {
+		origroot = c->lxc_conf->rootfs.path;
+		c->lxc_conf->rootfs.path = NULL;
+	}
+	write_config(f, c->lxc_unexp_conf);
+	c->lxc_conf->rootfs.path = origroot;
+	if (fclose(f)) {
+		SYSERROR("clone: failed writing config");
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Create the directory, config and empty rootfs of newname in lxcpath, and
+ * return a container for it holding copies of c's configuration.
+ */
+static struct lxc_container *clone_prepare(struct lxc_container *c,
+		const char *newname, const char *lxcpath, const char *config,
+		size_t len)
+{
+	struct lxc_container *c2;
+	char newpath[MAXPATHLEN];
+	int ret, fd;
+
+	// Make sure the container doesn't yet exist.
+	ret = snprintf(newpath, MAXPATHLEN, "%s/%s/config", lxcpath, newname);
+	if (ret < 0 || ret >= MAXPATHLEN) {
+		SYSERROR("clone: failed making config pathname");
+		return NULL;
+	}
+	if (file_exists(newpath)) {
+		ERROR("error: clone: %s exists", newpath);
+		return NULL;
+	}
+
+	ret = create_file_dirname(newpath);
+	if (ret < 0 && errno != EEXIST) {
+		ERROR("Error creating container dir for %s", newpath);
+		return NULL;
+	}
+
+	fd = open(newpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		SYSERROR("open %s", newpath);
+		return NULL;
+	}
+	ret = lxc_write_nointr(fd, config, len);
+	close(fd);
+	if (ret != len) {
+		SYSERROR("writing %s", newpath);
+		return NULL;
+	}
+
+	sprintf(newpath, "%s/%s/rootfs", lxcpath, newname);
+	if (mkdir(newpath, 0755) < 0) {
+		SYSERROR("error creating %s", newpath);
+		return NULL;
+	}
+
+	if (am_unpriv()) {
+		if (chown_mapped_root(newpath, c->lxc_conf) < 0) {
+			ERROR("Error chowning %s to container root", newpath);
+			return NULL;
+		}
+	}
+
+	/*
+	 * c2's config is what we just wrote, rather than reading it back
+	 * hand c2 copies of ours.
+	 */
+	c2 = container_new(newname, lxcpath, true);
+	if (!c2) {
+		ERROR("clone: failed to create new container (%s %s)", newname,
+			lxcpath);
+		return NULL;
+	}
+	if (!clone_config(c, c2) && !lazy_load_config(c2)) {
+		ERROR("clone: failed to load config of %s", newname);
+		lxc_container_put(c2);
+		return NULL;
+	}
+	return c2;
+}
+
+/*
+ * Copy c's storage, hooks and fstab to c2, save its config and update its
+ * rootfs.  *storage_copied tells whether c2 has a rootfs of its own to
+ * remove if this fails.
+ */
+static int clone_finish(struct lxc_container *c, struct lxc_container *c2,
+		int flags, const char *bdevtype, const char *bdevdata,
+		uint64_t newsize, char **hookargs, bool *storage_copied)
+{
+	int ret;
+
+	*storage_copied = false;
+
+	// copy/snapshot rootfs's
+	ret = copy_storage(c, c2, bdevtype, flags, bdevdata, newsize);
+	if (ret < 0)
+		return -1;
+
+	// update utsname
+	if (!set_config_item_locked(c2, "lxc.utsname", c2->name)) {
+		ERROR("Error setting new hostname");
+		return -1;
+	}
+
+	// copy hooks
+	ret = copyhooks(c, c2);
+	if (ret < 0) {
+		ERROR("error copying hooks");
+		return -1;
+	}
+
+	if (copy_fstab(c, c2) < 0) {
+		ERROR("error copying fstab");
+		return -1;
+	}
+
+	// update macaddrs
+	if (!(flags & LXC_CLONE_KEEPMACADDR))
+		network_new_hwaddrs(c2);
+
+	// We've now successfully created c2's storage, so clear it out if we
+	// fail after this
+	*storage_copied = true;
+
+	if (!c2->save_config(c2, NULL))
+		return -1;
+
+	return clone_update_rootfs_child(c, c2, flags, hookargs);
+}
+
+struct ephemeral_data {
+	char *etc;
+	const char *name;
+};
+
+/* the hostname a boot would otherwise set back to the original's */
+static int ephemeral_hostname(void *data)
+{
+	struct ephemeral_data *arg = data;
+	char *path;
+	FILE *f;
+
+	if (am_unpriv() && (setgid(0) < 0 || setuid(0) < 0)) {
+		ERROR("Failed to become root in the container");
+		return -1;
+	}
+	if (mkdir(arg->etc, 0755) < 0 && errno != EEXIST) {
+		SYSERROR("Failed to create %s", arg->etc);
+		return -1;
+	}
+	path = alloca(strlen(arg->etc) + sizeof("/hostname"));
+	sprintf(path, "%s/hostname", arg->etc);
+	f = fopen(path, "we");
+	if (!f) {
+		SYSERROR("Failed to open %s", path);
+		return -1;
+	}
+	fprintf(f, "%s\n", arg->name);
+	return fclose(f) ? -1 : 0;
+}
+
+/*
+ * Make c2 an overlay of c whose changes go to the rundir, which is left
+ * to the kernel to mount at start and to lxc_fini() to remove with the
+ * rest of c2 once it stops.  Only c2's config is written to lxcpath.
+ */
+static int clone_ephemeral(struct lxc_container *c, struct lxc_container *c2,
+		int flags)
+{
+	struct ephemeral_data data;
+	struct bdev *orig;
+	char *dir = NULL, *upper = NULL, *lower = NULL, *rootfs = NULL, *p;
+	int ret = -1;
+
+	orig = bdev_init(c->lxc_conf, c->lxc_conf->rootfs.path, NULL, NULL);
+	if (!orig) {
+		ERROR("clone: no storage found for %s", c->name);
+		return -1;
+	}
+	if (strcmp(orig->type, "dir") == 0) {
+		lower = strdup(orig->src);
+	} else if (strcmp(orig->type, "overlayfs") == 0) {
+		/* its upper goes on top of its lower layers */
+		p = strrchr(orig->src, ':');
+		if (asprintf(&lower, "%s:%.*s", p + 1,
+			     (int)(p - orig->src - 10), orig->src + 10) < 0)
+			lower = NULL;
+	} else {
+		ERROR("clone: an ephemeral copy of a %s rootfs is not supported",
+			orig->type);
+		goto out;
+	}
+	if (!lower)
+		goto out;
+
+	dir = lxc_ephemeral_dir(c2->config_path, c2->name);
+	if (!dir || asprintf(&upper, "%s/delta0", dir) < 0) {
+		upper = NULL;
+		goto out;
+	}
+	if (mkdir_p(upper, 0755) < 0) {
+		SYSERROR("clone: failed to create %s", upper);
+		goto out;
+	}
+	if (am_unpriv() && (chown_mapped_root(dir, c->lxc_conf) < 0 ||
+			    chown_mapped_root(upper, c->lxc_conf) < 0)) {
+		ERROR("clone: failed to chown %s to container root", dir);
+		goto out;
+	}
+
+	if (asprintf(&rootfs, "overlayfs:%s:%s", lower, upper) < 0) {
+		rootfs = NULL;
+		goto out;
+	}
+	free(c2->lxc_conf->rootfs.path);
+	free(c2->lxc_unexp_conf->rootfs.path);
+	c2->lxc_conf->rootfs.path = rootfs;
+	c2->lxc_unexp_conf->rootfs.path = strdup(rootfs);
+	if (!c2->lxc_unexp_conf->rootfs.path)
+		goto out;
+
+	if (!set_config_item_locked(c2, "lxc.utsname", c2->name) ||
+	    !set_config_item_locked(c2, "lxc.ephemeral", "1"))
+		goto out;
+	if (!(flags & LXC_CLONE_KEEPMACADDR))
+		network_new_hwaddrs(c2);
+	if (!c2->save_config(c2, NULL))
+		goto out;
+
+	if (!(flags & LXC_CLONE_KEEPNAME)) {
+		data.etc = alloca(strlen(upper) + sizeof("/etc"));
+		sprintf(data.etc, "%s/etc", upper);
+		data.name = c2->name;
+		if (am_unpriv())
+			ret = userns_exec_1(c->lxc_conf, ephemeral_hostname, &data);
+		else
+			ret = ephemeral_hostname(&data);
+		if (ret < 0)
+			WARN("clone: failed to set the hostname of %s", c2->name);
+	}
+	ret = 0;
+
+out:
+	if (ret < 0 && upper && lxc_rmdir_onedev(dir, NULL) < 0)
+		WARN("clone: failed to remove %s", dir);
+	bdev_put(orig);
+	free(lower);
+	free(upper);
+	free(dir);
+	return ret;
+}
+
+/* remove what is left of a clone which failed */
+static void clone_abort(struct lxc_container *c2, bool storage_copied)
+{
+	if (!storage_copied && c2->lxc_conf)
+		c2->lxc_conf->rootfs.path = NULL;
+	c2->destroy(c2);
+	lxc_container_put(c2);
+}
+
+static struct lxc_container *lxcapi_clone(struct lxc_container *c, const char *newname,
+		const char *lxcpath, int flags,
+		const char *bdevtype, const char *bdevdata, uint64_t newsize,
+		char **hookargs)
+{
+	LXC_API_STATS(clone);
+	struct lxc_container *c2 = NULL;
+	char *config = NULL;
+	size_t len = 0;
+	bool storage_copied = false;
+	const char *n, *l;
+
+	if (!c || !c->is_defined(c) || !lazy_load_config(c))
+		return NULL;
+
+	if (container_mem_lock(c))
+		return NULL;
+	userns_hold(c->lxc_conf);
+
+	if (!is_stopped(c)) {
+		ERROR("error: Original container (%s) is running", c->name);
+		goto out;
+	}
+
+	n = newname ? newname : c->name;
+	l = lxcpath ? lxcpath : c->get_config_path(c);
+
+	// copy the configuration, tweak it as needed,
+	if (clone_config_text(c, &config, &len) < 0)
+		goto out;
+	c2 = clone_prepare(c, n, l, config, len);
+	if (!c2)
+		goto out;
+
+	if (flags & LXC_CLONE_EPHEMERAL) {
+		if (clone_ephemeral(c, c2, flags) < 0)
+			goto out;
+	} else if (clone_finish(c, c2, flags, bdevtype, bdevdata, newsize,
+			hookargs, &storage_copied) < 0)
+		goto out;
+
+	free(config);
+	userns_release(c->lxc_conf);
+	container_mem_unlock(c);
+	return c2;
+
+out:
+	free(config);
+	if (c2)
+		clone_abort(c2, storage_copied);
+	userns_release(c->lxc_conf);
+	container_mem_unlock(c);
+
+	return NULL;
+}
+
+static int lxcapi_clone_many(struct lxc_container *c, const char **newnames,
+		int n, const char *lxcpath, int flags, const char *bdevtype,
+		const char *bdevdata, uint64_t newsize, char **hookargs,
+		int max_parallel, struct lxc_container **newcs)
+{
+	LXC_API_STATS(clone_many);
+	struct lxc_container **c2s = NULL;
+	pid_t *pids = NULL;
+	char *config = NULL;
+	size_t len = 0;
+	int i, first, next = 0, cloned = -1;
+	const char *l;
+
+	if (!c || !newnames || n < 0)
+		return -1;
+	if (newcs)
+		memset(newcs, 0, n * sizeof(*newcs));
+	if (n == 0)
+		return 0;
+
+	if (!c->is_defined(c) || !lazy_load_config(c))
+		return -1;
+
+	if (container_mem_lock(c))
+		return -1;
+	/* for all the clones, which the children share */
+	userns_hold(c->lxc_conf);
+
+	if (!is_stopped(c)) {
+		ERROR("error: Original container (%s) is running", c->name);
+		goto out;
+	}
+
+	l = lxcpath ? lxcpath : c->get_config_path(c);
+
+	/* the config is only written out once for all of them */
+	if (clone_config_text(c, &config, &len) < 0)
+		goto out;
+
+	c2s = calloc(n, sizeof(*c2s));
+	pids = calloc(n, sizeof(*pids));
+	if (!c2s || !pids)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		if (!newnames[i]) {
+			ERROR("clone: no name given for clone %d", i);
+			continue;
+		}
+		c2s[i] = clone_prepare(c, newnames[i], l, config, len);
+	}
+
+	/*
+	 * The storage copies and rootfs updates are the slow part, each
+	 * clone gets a child doing those.
+	 */
+	cloned = 0;
+	for (first = 0; first < n; first++) {
+		while (next < n && (max_parallel <= 0 || next - first < max_parallel)) {
+			pids[next] = 0;
+			if (c2s[next]) {
+				pids[next] = fork();
+				if (pids[next] < 0)
+					SYSERROR("failed to fork to clone %s",
+						c2s[next]->name);
+			}
+			if (pids[next] == 0 && c2s[next]) {
+				bool storage_copied = false;
+
+				if (flags & LXC_CLONE_EPHEMERAL) {
+					if (clone_ephemeral(c, c2s[next], flags) == 0)
+						exit(0);
+				} else if (clone_finish(c, c2s[next], flags,
+						bdevtype, bdevdata, newsize,
+						hookargs, &storage_copied) == 0)
+					exit(0);
+				clone_abort(c2s[next], storage_copied);
+				exit(1);
+			}
+			next++;
+		}
+
+		if (!c2s[first])
+			continue;
+		if (pids[first] > 0 && wait_for_pid(pids[first]) == 0) {
+			/* c2s[first] did not see what the child did to it */
+			if (newcs)
+				newcs[first] = lxc_container_new(newnames[first], l);
+			cloned++;
+		} else {
+			ERROR("Error cloning %s into %s", c->name, newnames[first]);
+			/* the child cleans up after itself */
+			if (pids[first] < 0) {
+				clone_abort(c2s[first], false);
+				c2s[first] = NULL;
+			}
+		}
+		if (c2s[first])
+			lxc_container_put(c2s[first]);
+		c2s[first] = NULL;
+	}
+
+out:
+	userns_release(c->lxc_conf);
+	container_mem_unlock(c);
+	free(config);
+	free(c2s);
+	free(pids);
+	return cloned;
+}
+
+/*
+ * Point *@s at @newdir wherever it names @olddir or a path under it, be it
+ * the whole value or one of the paths in it, as in an overlayfs rootfs or
+ * a mount entry.
+ */
+static int rename_path(char **s, const char *olddir, const char *newdir)
+{
+	size_t oldlen = strlen(olddir), newlen = strlen(newdir);
+	char *p, *q, *r, *res;
+	int n = 0;
+
+	if (!*s)
+		return 0;
+	for (p = *s; (p = strstr(p, olddir)); p += oldlen)
+		n++;
+	if (!n)
+		return 0;
+
+	res = malloc(strlen(*s) + n * newlen + 1);
+	if (!res)
+		return -1;
+	for (p = *s, r = res; (q = strstr(p, olddir)); p = q + oldlen) {
+		memcpy(r, p, q - p);
+		r += q - p;
+		if ((q == *s || strchr(" :=", q[-1])) &&
+		    strchr(" :/", q[oldlen])) {
+			memcpy(r, newdir, newlen);
+			r += newlen;
+		} else {
+			memcpy(r, q, oldlen);
+			r += oldlen;
+		}
+	}
+	strcpy(r, p);
+	free(*s);
+	*s = res;
+	return 0;
+}
+
+static int rename_list_paths(struct lxc_list *list, const char *olddir,
+		const char *newdir)
+{
+	struct lxc_list *it;
+	char *elem;
+
+	lxc_list_for_each(it, list) {
+		elem = it->elem;
+		if (rename_path(&elem, olddir, newdir) < 0)
+			return -1;
+		it->elem = elem;
+	}
+	return 0;
+}
+
+/* the paths in conf under the container's directory, as it moves */
+static int rename_conf_paths(struct lxc_conf *conf, const char *olddir,
+		const char *newdir)
+{
+	int i;
+
+	if (rename_path(&conf->rootfs.path, olddir, newdir) < 0 ||
+	    rename_path(&conf->fstab, olddir, newdir) < 0 ||
+	    rename_path(&conf->logfile, olddir, newdir) < 0 ||
+	    rename_path(&conf->seccomp, olddir, newdir) < 0 ||
+	    rename_path(&conf->console.path, olddir, newdir) < 0 ||
+	    rename_path(&conf->console.log_path, olddir, newdir) < 0 ||
+	    rename_path(&conf->console.buffer_path, olddir, newdir) < 0 ||
+	    rename_list_paths(&conf->mount_list, olddir, newdir) < 0 ||
+	    rename_list_paths(&conf->includes, olddir, newdir) < 0)
+		return -1;
+	for (i = 0; i < NUM_LXC_HOOKS; i++)
+		if (rename_list_paths(&conf->hooks[i], olddir, newdir) < 0)
+			return -1;
+	return 0;
+}
+
+/*
+ * Rename the container's directory, and with it whatever its storage is
+ * named after, then write the config with the paths and hostname which
+ * followed, and update the hostname in the rootfs as clone does.  Neither
+ * the rootfs nor the config are copied.  c keeps the old name, it no
+ * longer is a defined container.
+ */
+static bool lxcapi_rename(struct lxc_container *c, const char *newname)
+{
+	LXC_API_STATS(rename);
+	char olddir[MAXPATHLEN], newdir[MAXPATHLEN], newconfig[MAXPATHLEN];
+	struct lxc_conf *conf = NULL;
+	struct lxc_container *newc;
+	struct bdev *bdev = NULL;
+	const char *rootfs;
+	bool moved = false, bdev_moved = false, hostname_follows, ret = false;
+	int len;
+
+	if (!c || !c->name || !c->config_path || !lazy_load_config(c) || !c->lxc_conf)
+		return false;
+
+	if (!newname || !*newname || strchr(newname, '/') ||
+	    strcmp(newname, ".") == 0 || strcmp(newname, "..") == 0) {
+		ERROR("Invalid container name %s", newname ? newname : "(null)");
+		return false;
+	}
+	if (has_fs_snapshots(c) || has_snapshots(c)) {
+		ERROR("Renaming a container with snapshots is not supported");
+		return false;
+	}
+
+	len = snprintf(olddir, MAXPATHLEN, "%s/%s", c->config_path, c->name);
+	if (len < 0 || len >= MAXPATHLEN)
+		return false;
+	len = snprintf(newdir, MAXPATHLEN, "%s/%s", c->config_path, newname);
+	if (len < 0 || len >= MAXPATHLEN)
+		return false;
+	len = snprintf(newconfig, MAXPATHLEN, "%s/config", newdir);
+	if (len < 0 || len >= MAXPATHLEN)
+		return false;
+
+	if (container_disk_lock(c))
+		return false;
+
+	if (!is_stopped(c)) {
+		ERROR("Container %s is running", c->name);
+		goto out;
+	}
+	if (file_exists(newdir)) {
+		ERROR("%s exists", newdir);
+		goto out;
+	}
+
+	if (!load_unexp_config(c) || !c->lxc_unexp_conf)
+		goto out;
+	rootfs = c->lxc_unexp_conf->rootfs.path;
+	if (rootfs) {
+		bdev = bdev_init(c->lxc_conf, rootfs, NULL, NULL);
+		if (!bdev) {
+			ERROR("Failed to find original backing store type");
+			goto out;
+		}
+	}
+
+	conf = lxc_conf_dup(c->lxc_unexp_conf);
+	if (!conf || rename_conf_paths(conf, olddir, newdir) < 0) {
+		ERROR("Failed to update the configuration of %s", c->name);
+		goto out;
+	}
+	hostname_follows = !conf->utsname ||
+			   strcmp(conf->utsname->nodename, c->name) == 0;
+	if (conf->utsname && hostname_follows) {
+		if (strlen(newname) >= sizeof(conf->utsname->nodename)) {
+			ERROR("Container name %s is too long for a hostname", newname);
+			goto out;
+		}
+		strcpy(conf->utsname->nodename, newname);
+	}
+
+	if (rename(olddir, newdir) < 0) {
+		SYSERROR("Failed to rename %s to %s", olddir, newdir);
+		goto out;
+	}
+	moved = true;
+
+	if (bdev) {
+		if (bdev_rename(bdev, c->name, newname, c->config_path) < 0) {
+			ERROR("Failed to rename the %s backing store %s",
+				bdev->type, bdev->src);
+			goto out;
+		}
+		bdev_moved = true;
+		if (strcmp(bdev->src, rootfs)) {
+			free(conf->rootfs.path);
+			conf->rootfs.path = strdup(bdev->src);
+			if (!conf->rootfs.path)
+				goto out;
+		}
+	}
+
+	if (!save_config_file(newconfig, conf)) {
+		ERROR("Failed to save the configuration of %s", newname);
+		goto out;
+	}
+
+	ret = true;
+
+	/* as clone would, runs the clone hooks and updates the hostname */
+	newc = lxc_container_new(newname, c->config_path);
+	if (!newc || clone_update_rootfs_child(c, newc,
+			hostname_follows ? 0 : LXC_CLONE_KEEPNAME, NULL) < 0)
+		WARN("Failed to update the rootfs of %s", newname);
+	if (newc)
+		lxc_container_put(newc);
+
+out:
+	if (!ret && moved) {
+		if (rename(newdir, olddir) < 0)
+			SYSERROR("Failed to rename %s back to %s", newdir, olddir);
+		else if (bdev_moved &&
+			 bdev_rename(bdev, newname, c->name, c->config_path) < 0)
+			ERROR("Failed to rename %s back", bdev->src);
+	}
+	container_disk_unlock(c);
+	if (conf)
+		lxc_conf_free(conf);
+	if (bdev)
+		bdev_put(bdev);
+	return ret;
+}
+
+/*
+ * lxc_attach(), entering the namespaces through the container's cache and
+ * reusing the context of its init from previous attaches.  Only the
+ * namespaces asked for, or those the container was started with when
+ * known, are opened; lxc_attach_ns_fds() opens any other it needs.
+ */
+static int container_attach(struct lxc_container *c, lxc_attach_exec_t exec_function, void *exec_payload, lxc_attach_options_t *options, pid_t *attached_process)
+{
+	int i, ret, nsfds[LXC_NS_MAX];
+	int which = options ? options->namespaces : -1;
+	pid_t init_pid;
+
+	if (which == -1 && !container_mem_lock(c)) {
+		if (c->attach_cache)
+			which = c->attach_cache->clone_flags;
+		container_mem_unlock(c);
+	}
+
+	init_pid = c->init_pid(c);
+	for (i = 0; i < LXC_NS_MAX; i++) {
+		nsfds[i] = -1;
+		if (init_pid <= 0)
+			continue;
+		if (which != -1 && !(which & ns_info[i].clone_flag))
+			continue;
+		nsfds[i] = container_ns_fd(c, init_pid, i);
+	}
+
+	if (container_mem_lock(c)) {
+		ret = -1;
+		goto out;
+	}
+	if (!c->attach_cache)
+		c->attach_cache = lxc_attach_cache_new();
+	ret = lxc_attach_ns_fds(c->name, c->config_path, exec_function,
+				exec_payload, options, attached_process,
+				init_pid, nsfds, c->attach_cache);
+	container_mem_unlock(c);
+out:
+	for (i = 0; i < LXC_NS_MAX; i++)
+		if (nsfds[i] >= 0)
+			close(nsfds[i]);
+	return ret;
+}
+
+static int lxcapi_attach(struct lxc_container *c, lxc_attach_exec_t exec_function, void *exec_payload, lxc_attach_options_t *options, pid_t *attached_process)
+{
+	LXC_API_STATS(attach);
+	if (!c)
+		return -1;
+
+	return container_attach(c, exec_function, exec_payload, options, attached_process);
+}
+
+static int lxcapi_attach_run_wait(struct lxc_container *c, lxc_attach_options_t *options, const char *program, const char * const argv[])
+{
+	LXC_API_STATS(attach_run_wait);
+	lxc_attach_command_t command;
+	pid_t pid;
+	int r;
+
+	if (!c)
+		return -1;
+
+	command.program = (char*)program;
+	command.argv = (char**)argv;
+	r = container_attach(c, lxc_attach_run_command, &command, options, &pid);
+	if (r < 0) {
+		ERROR("ups");
+		return r;
+	}
+	return lxc_wait_for_pid_status(pid);
+}
+
+/* attach a new helper to the container whose init is @init_pid */
+static struct lxc_attach_helper *attach_helper_new(struct lxc_container *c,
+		lxc_attach_options_t *options, pid_t init_pid)
+{
+	struct lxc_attach_helper *helper;
+	struct lxc_attach_helper_args args;
+	int sock[2];
+
+	helper = malloc(sizeof(*helper));
+	if (!helper)
+		return NULL;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sock) < 0) {
+		SYSERROR("failed to create the attach helper's socket");
+		free(helper);
+		return NULL;
+	}
+
+	args.sock = sock[1];
+	args.peer = sock[0];
+	if (container_attach(c, lxc_attach_helper_main, &args, options,
+			     &helper->pid) < 0) {
+		ERROR("failed to attach the helper to %s", c->name);
+		close(sock[0]);
+		close(sock[1]);
+		free(helper);
+		return NULL;
+	}
+	close(sock[1]);
+
+	helper->sock = sock[0];
+	helper->init_pid = init_pid;
+	return helper;
+}
+
+static int lxcapi_attach_helper_run_wait(struct lxc_container *c, lxc_attach_options_t *options, const char *program, const char * const argv[])
+{
+	LXC_API_STATS(attach_helper_run_wait);
+	struct lxc_attach_helper *helper, *old = NULL;
+	int stdfds[3] = { 0, 1, 2 };
+	pid_t init_pid;
+	int ret, tries;
+
+	if (!c || !program || !argv || !argv[0])
+		return -1;
+
+	if (options) {
+		stdfds[0] = options->stdin_fd;
+		stdfds[1] = options->stdout_fd;
+		stdfds[2] = options->stderr_fd;
+	}
+
+	init_pid = c->init_pid(c);
+	if (init_pid <= 0)
+		return -1;
+
+	/*
+	 * a helper which can't take the request anymore, for instance
+	 * because the container was restarted, is replaced once
+	 */
+	for (tries = 0; tries < 2; tries++) {
+		if (container_mem_lock(c))
+			return -1;
+		helper = c->attach_helper;
+		if (helper && (tries || helper->init_pid != init_pid)) {
+			old = helper;
+			c->attach_helper = helper = NULL;
+		}
+		container_mem_unlock(c);
+
+		if (old) {
+			lxc_attach_helper_stop(old);
+			free(old);
+			old = NULL;
+		}
+
+		if (!helper) {
+			helper = attach_helper_new(c, options, init_pid);
+			if (!helper)
+				return -1;
+			if (container_mem_lock(c)) {
+				lxc_attach_helper_stop(helper);
+				free(helper);
+				return -1;
+			}
+			if (c->attach_helper)
+				old = helper;
+			else
+				c->attach_helper = helper;
+			helper = c->attach_helper;
+			container_mem_unlock(c);
+			if (old) {
+				lxc_attach_helper_stop(old);
+				free(old);
+				old = NULL;
+			}
+		}
+
+		if (container_mem_lock(c))
+			return -1;
+		ret = -ENOTCONN;
+		if (c->attach_helper == helper)
+			ret = lxc_attach_helper_run(helper, program, argv, stdfds);
+		container_mem_unlock(c);
+		if (ret != -ENOTCONN)
+			break;
+	}
+
+	if (ret < 0) {
+		ERROR("attach helper of %s failed to run %s : %s", c->name,
+		      program, strerror(-ret));
+		return -1;
+	}
+	return ret;
+}
+
+static void lxcsnap_free(struct lxc_snapshot *s)
+{
+	if (s->name)
+		free(s->name);
+	if (s->comment_pathname)
+		free(s->comment_pathname);
+	if (s->timestamp)
+		free(s->timestamp);
+	if (s->lxcpath)
+		free(s->lxcpath);
+}
+
+static char *get_snapcomment_path(const char *snappath, const char *name)
+{
+	// $snappath/$name/comment
+	int ret, len = strlen(snappath) + strlen(name) + 10;
+	char *s = malloc(len);
+
+	if (s) {
+		ret = snprintf(s, len, "%s/%s/comment", snappath, name);
+		if (ret < 0 || ret >= len) {
+			free(s);
+			s = NULL;
+		}
+	}
+	return s;
+}
+
+static char *get_timestamp(const char *snappath, const char *name)
+{
+	char path[MAXPATHLEN], *s = NULL;
+	int ret, len;
+	FILE *fin;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/%s/ts", snappath, name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return NULL;
+	fin = fopen(path, "re");
+	if (!fin)
+		return NULL;
+	(void) fseek(fin, 0, SEEK_END);
+	len = ftell(fin);
+	(void) fseek(fin, 0, SEEK_SET);
+	if (len > 0) {
+		s = malloc(len+1);
+		if (s) {
+			s[len] = '\0';
+			if (fread(s, 1, len, fin) != len) {
+				SYSERROR("reading timestamp");
+				free(s);
+				s = NULL;
+			}
+		}
+	}
+	fclose(fin);
+	return s;
+}
+
+static void free_snaps(struct lxc_snapshot *snaps, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		lxcsnap_free(&snaps[i]);
+	free(snaps);
+}
+
+/* add snapshot @name to @snaps, which takes over @timestamp */
+static bool add_snap(struct lxc_snapshot **snaps, int *n, const char *snappath,
+		const char *name, char *timestamp)
+{
+	struct lxc_snapshot *nsnaps, *s;
+
+	nsnaps = realloc(*snaps, (*n + 1) * sizeof(**snaps));
+	if (!nsnaps) {
+		SYSERROR("Out of memory");
+		free(timestamp);
+		return false;
+	}
+	*snaps = nsnaps;
+	s = &nsnaps[*n];
+	s->free = lxcsnap_free;
+	s->name = strdup(name);
+	s->lxcpath = strdup(snappath);
+	s->comment_pathname = get_snapcomment_path(snappath, name);
+	s->timestamp = timestamp;
+	if (!s->name || !s->lxcpath) {
+		lxcsnap_free(s);
+		return false;
+	}
+	(*n)++;
+	return true;
+}
+
+/* find the snapshots in @snappath by looking at what is in there */
+static int scan_snapshots(const char *snappath, struct lxc_snapshot **ret_snaps)
+{
+	char path2[MAXPATHLEN];
+	int count = 0, ret;
+	struct dirent dirent, *direntp;
+	struct lxc_snapshot *snaps = NULL;
+	DIR *dir;
+
+	*ret_snaps = NULL;
+	dir = opendir(snappath);
+	if (!dir) {
+		INFO("failed to open %s - assuming no snapshots", snappath);
+		return 0;
+	}
+
+	while (!readdir_r(dir, &dirent, &direntp)) {
+		if (!direntp)
+			break;
+
+		if (!strcmp(direntp->d_name, "."))
+			continue;
+
+		if (!strcmp(direntp->d_name, ".."))
+			continue;
+
+		ret = snprintf(path2, MAXPATHLEN, "%s/%s/config", snappath, direntp->d_name);
+		if (ret < 0 || ret >= MAXPATHLEN) {
+			ERROR("pathname too long");
+			goto out_free;
+		}
+		if (!file_exists(path2))
+			continue;
+		if (!add_snap(&snaps, &count, snappath, direntp->d_name,
+				get_timestamp(snappath, direntp->d_name)))
+			goto out_free;
+	}
+
+	if (closedir(dir))
+		WARN("failed to close directory");
+
+	*ret_snaps = snaps;
+	return count;
+
+out_free:
+	free_snaps(snaps, count);
+	if (closedir(dir))
+		WARN("failed to close directory");
+	return -1;
+}
+
+/*
+ * The snapshots of a container are listed in $snappath.catalog, so that
+ * listing them or naming the next one doesn't mean looking into each.
+ * The first line holds the mtime of $snappath when the catalog was last
+ * brought up to date, so that one left behind, say because a snapshot
+ * was removed by hand, is noticed and rebuilt.  Then there is a
+ * "name<TAB>timestamp" line per snapshot.
+ */
+#define SNAP_CATALOG_HDR "# lxc snapshots "
+#define SNAP_CATALOG_HDRLEN (sizeof(SNAP_CATALOG_HDR) - 1 + 20 + 1 + 9 + 1)
+
+static bool snap_catalog_path(const char *snappath, char *path)
+{
+	int ret;
+
+	ret = snprintf(path, MAXPATHLEN, "%s.catalog", snappath);
+	return ret >= 0 && ret < MAXPATHLEN;
+}
+
+static bool snap_catalog_header(const char *snappath, char *hdr)
+{
+	struct stat st;
+
+	if (stat(snappath, &st) < 0)
+		return false;
+	snprintf(hdr, SNAP_CATALOG_HDRLEN + 1, SNAP_CATALOG_HDR "%020lld %09ld\n",
+		(long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+	return true;
+}
+
+static int snap_catalog_read(const char *snappath, struct lxc_snapshot **ret_snaps)
+{
+	char path[MAXPATHLEN], hdr[SNAP_CATALOG_HDRLEN + 1], *line = NULL, *ts;
+	struct lxc_snapshot *snaps = NULL;
+	size_t len = 0;
+	int n = 0;
+	FILE *f;
+
+	if (!snap_catalog_path(snappath, path) ||
+			!snap_catalog_header(snappath, hdr))
+		return -1;
+	f = fopen(path, "re");
+	if (!f)
+		return -1;
+	if (getline(&line, &len, f) < 0 || strcmp(line, hdr) != 0) {
+		INFO("%s is out of date", path);
+		goto out_free;
+	}
+	while (getline(&line, &len, f) > 0) {
+		strip_newline(line);
+		ts = strchr(line, '\t');
+		if (!ts) {
+			ERROR("badly formatted file %s", path);
+			goto out_free;
+		}
+		*ts++ = '\0';
+		if (!add_snap(&snaps, &n, snappath, line, *ts ? strdup(ts) : NULL))
+			goto out_free;
+	}
+	free(line);
+	fclose(f);
+	*ret_snaps = snaps;
+	return n;
+
+out_free:
+	free(line);
+	fclose(f);
+	free_snaps(snaps, n);
+	return -1;
+}
+
+static void snap_catalog_write(const char *snappath, struct lxc_snapshot *snaps,
+		int n)
+{
+	char path[MAXPATHLEN], tmp[MAXPATHLEN], hdr[SNAP_CATALOG_HDRLEN + 1];
+	int i, ret;
+	FILE *f;
+
+	if (!snap_catalog_path(snappath, path) ||
+			!snap_catalog_header(snappath, hdr))
+		return;
+	ret = snprintf(tmp, MAXPATHLEN, "%s.new", path);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return;
+	f = fopen(tmp, "we");
+	if (!f) {
+		INFO("Not keeping a snapshot catalog at %s: %s", path,
+			strerror(errno));
+		return;
+	}
+	fputs(hdr, f);
+	for (i = 0; i < n; i++)
+		fprintf(f, "%s\t%s\n", snaps[i].name,
+			snaps[i].timestamp ? snaps[i].timestamp : "");
+	ret = ferror(f);
+	if (fclose(f) != 0 || ret || rename(tmp, path) < 0) {
+		WARN("Failed to write %s", path);
+		unlink(tmp);
+	}
+}
+
+/*
+ * The snapshots in @snappath, as the catalog says or, when it can't be
+ * trusted, as found in there, in which case the catalog is rewritten.
+ */
+static int snap_catalog_load(const char *snappath, struct lxc_snapshot **snaps)
+{
+	int n;
+
+	n = snap_catalog_read(snappath, snaps);
+	if (n >= 0)
+		return n;
+	n = scan_snapshots(snappath, snaps);
+	if (n >= 0 && dir_exists(snappath))
+		snap_catalog_write(snappath, *snaps, n);
+	return n;
+}
+
+/*
+ * Record new snapshot @snaps[n-1] at the end of the catalog, where the
+ * earlier ones already are.
+ */
+static void snap_catalog_append(const char *snappath, struct lxc_snapshot *snaps,
+		int n)
+{
+	char path[MAXPATHLEN], hdr[SNAP_CATALOG_HDRLEN + 1];
+	struct lxc_snapshot *s = &snaps[n - 1];
+	int fd;
+
+	if (!snap_catalog_path(snappath, path) ||
+			!snap_catalog_header(snappath, hdr))
+		return;
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		snap_catalog_write(snappath, snaps, n);
+		return;
+	}
+	if (lseek(fd, 0, SEEK_END) < 0 ||
+			dprintf(fd, "%s\t%s\n", s->name,
+				s->timestamp ? s->timestamp : "") < 0 ||
+			pwrite(fd, hdr, strlen(hdr), 0) != strlen(hdr))
+		WARN("Failed to update %s", path);
+	close(fd);
+}
+
+/*
+ * The lowest snapN which is free, both in the catalog and on disk, where
+ * something may have been left of a failed snapshot.
+ */
+static int get_next_index(const char *lxcpath, struct lxc_snapshot *snaps,
+		int n)
+{
+	char *fname;
+	struct stat sb;
+	bool *taken;
+	int i, idx, end;
+
+	taken = calloc(n + 1, sizeof(bool));
+	if (!taken)
+		return -1;
+	for (i = 0; i < n; i++) {
+		if (sscanf(snaps[i].name, "snap%d%n", &idx, &end) == 1 &&
+				!snaps[i].name[end] && idx >= 0 && idx <= n)
+			taken[idx] = true;
+	}
+
+	fname = alloca(strlen(lxcpath) + 20);
+	for (i = 0; ; i++) {
+		if (i <= n && taken[i])
+			continue;
+		sprintf(fname, "%s/snap%d", lxcpath, i);
+		if (stat(fname, &sb) != 0)
+			break;
+	}
+	free(taken);
+	return i;
+}
+
+static bool get_snappath_dir(struct lxc_container *c, char *snappath)
+{
+	int ret;
+	/*
+	 * If the old style snapshot path exists, use it
+	 * /var/lib/lxc -> /var/lib/lxcsnaps
+	 */
+	ret = snprintf(snappath, MAXPATHLEN, "%ssnaps", c->config_path);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return false;
+	if (dir_exists(snappath)) {
+		ret = snprintf(snappath, MAXPATHLEN, "%ssnaps/%s", c->config_path, c->name);
+		if (ret < 0 || ret >= MAXPATHLEN)
+			return false;
+		return true;
+	}
+
+	/*
+	 * Use the new style path
+	 * /var/lib/lxc -> /var/lib/lxc + c->name + /snaps + \0
+	 */
+	ret = snprintf(snappath, MAXPATHLEN, "%s/%s/snaps", c->config_path, c->name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return false;
+	return true;
+}
+
+static int lxcapi_snapshot(struct lxc_container *c, const char *commentfile)
+{
+	LXC_API_STATS(snapshot);
+	int i, n, flags, ret;
+	struct lxc_snapshot *snaps = NULL;
+	struct lxc_container *c2;
+	char snappath[MAXPATHLEN], newname[20];
+
+	if (!c || !lxcapi_is_defined(c) || !lazy_load_config(c))
+		return -1;
+
+	if (!get_snappath_dir(c, snappath))
+		return -1;
+
+	n = snap_catalog_load(snappath, &snaps);
+	if (n < 0)
+		return -1;
+	i = get_next_index(snappath, snaps, n);
+	if (i < 0)
+		goto out_free;
+
+	if (mkdir_p(snappath, 0755) < 0) {
+		ERROR("Failed to create snapshot directory %s", snappath);
+		goto out_free;
+	}
+
+	ret = snprintf(newname, 20, "snap%d", i);
+	if (ret < 0 || ret >= 20)
+		goto out_free;
+
+	/*
+	 * We pass LXC_CLONE_SNAPSHOT to make sure that a rdepends file entry is
+	 * created in the original container
+	 */
+	flags = LXC_CLONE_SNAPSHOT | LXC_CLONE_KEEPMACADDR | LXC_CLONE_KEEPNAME |
+		LXC_CLONE_KEEPBDEVTYPE | LXC_CLONE_MAYBE_SNAPSHOT;
+	if (bdev_is_dir(c->lxc_conf, c->lxc_conf->rootfs.path)) {
+		ERROR("Snapshot of directory-backed container requested.");
+		ERROR("Making a copy-clone.  If you do want snapshots, then");
+		ERROR("please create an aufs or overlayfs clone first, snapshot that");
+		ERROR("and keep the original container pristine.");
+		flags &= ~LXC_CLONE_SNAPSHOT | LXC_CLONE_MAYBE_SNAPSHOT;
+	}
+	c2 = c->clone(c, newname, snappath, flags, NULL, NULL, 0, NULL);
+	if (!c2) {
+		ERROR("clone of %s:%s failed", c->config_path, c->name);
+		goto out_free;
+	}
+
+	lxc_container_put(c2);
+
+	// Now write down the creation time
+	time_t timer;
+	char buffer[25];
+	struct tm* tm_info;
+	FILE *f;
+
+	time(&timer);
+	tm_info = localtime(&timer);
+
+	strftime(buffer, 25, "%Y:%m:%d %H:%M:%S", tm_info);
+
+	char *dfnam = alloca(strlen(snappath) + strlen(newname) + 5);
+	sprintf(dfnam, "%s/%s/ts", snappath, newname);
+	f = fopen(dfnam, "we");
+	if (!f) {
+		ERROR("Failed to open %s", dfnam);
+		goto out_free;
+	}
+	if (fprintf(f, "%s", buffer) < 0) {
+		SYSERROR("Writing timestamp");
+		fclose(f);
+		goto out_free;
+	}
+	ret = fclose(f);
+	if (ret != 0) {
+		SYSERROR("Writing timestamp");
+		goto out_free;
+	}
+
+	if (add_snap(&snaps, &n, snappath, newname, strdup(buffer)))
+		snap_catalog_append(snappath, snaps, n);
+
+	if (commentfile) {
+		// $p / $name / comment \0
+		int len = strlen(snappath) + strlen(newname) + 10;
+		char *path = alloca(len);
+		sprintf(path, "%s/%s/comment", snappath, newname);
+		if (copy_file(commentfile, path) < 0)
+			goto out_free;
+	}
 
-	ret = snprintf(path, MAXPATHLEN, "%s/%s/lxc_rdepends", c->config_path,
-		c->name);
-	if (ret < 0 || ret >= MAXPATHLEN)
-		return false;
-	f = fopen(path, "a");
-	if (!f)
-		return false;
-	bret = true;
-	// if anything goes wrong, just return an error
-	if (fprintf(f, "%s\n%s\n", c0->config_path, c0->name) < 0)
-		bret = false;
-	if (fclose(f) != 0)
-		bret = false;
-	return bret;
+	free_snaps(snaps, n);
+	return i;
+
+out_free:
+	free_snaps(snaps, n);
+	return -1;
 }
 
-static int copy_storage(struct lxc_container *c0, struct lxc_container *c,
-		const char *newtype, int flags, const char *bdevdata, uint64_t newsize)
+static int lxcapi_snapshot_list(struct lxc_container *c, struct lxc_snapshot **ret_snaps)
 {
-	struct bdev *bdev;
-	int need_rdep;
+	LXC_API_STATS(snapshot_list);
+	char snappath[MAXPATHLEN];
+	struct lxc_snapshot *snaps = NULL;
+	int count;
 
-	bdev = bdev_copy(c0, c->name, c->config_path, newtype, flags,
-			bdevdata, newsize, &need_rdep);
-	if (!bdev) {
-		ERROR("Error copying storage");
+	if (!c || !lxcapi_is_defined(c))
+		return -1;
+
+	if (!get_snappath_dir(c, snappath)) {
+		ERROR("path name too long");
 		return -1;
 	}
-	free(c->lxc_conf->rootfs.path);
-	c->lxc_conf->rootfs.path = strdup(bdev->src);
-	bdev_put(bdev);
-	if (!c->lxc_conf->rootfs.path) {
-		ERROR("Out of memory while setting storage path");
+
+	count = snap_catalog_load(snappath, &snaps);
+	if (count < 0)
 		return -1;
+	*ret_snaps = snaps;
+	return count;
+}
+
+/* the snapshot's configuration, but with the name and storage of @c */
+static bool snapshot_restore_config(struct lxc_container *c,
+		struct lxc_container *snap)
+{
+	struct lxc_conf *conf, *unexp;
+	char path[MAXPATHLEN], *p;
+	bool bret;
+	int ret;
+
+	if (container_mem_lock(c))
+		return false;
+	if (!load_unexp_config(c)) {
+		container_mem_unlock(c);
+		return false;
+	}
+	conf = c->lxc_conf;
+	unexp = c->lxc_unexp_conf;
+	if (!clone_config(snap, c)) {
+		c->lxc_conf = conf;
+		c->lxc_unexp_conf = unexp;
+		container_mem_unlock(c);
+		return false;
 	}
+	free(c->lxc_conf->rootfs.path);
 	free(c->lxc_unexp_conf->rootfs.path);
-	c->lxc_unexp_conf->rootfs.path = strdup(c->lxc_conf->rootfs.path);
-	if (!c->lxc_unexp_conf->rootfs.path) {
-		ERROR("Out of memory while setting storage path");
+	c->lxc_conf->rootfs.path = conf->rootfs.path;
+	c->lxc_unexp_conf->rootfs.path = unexp->rootfs.path;
+	conf->rootfs.path = unexp->rootfs.path = NULL;
+	lxc_conf_free(conf);
+	lxc_conf_free(unexp);
+	bret = set_config_item_locked(c, "lxc.utsname", c->name);
+	container_mem_unlock(c);
+	if (!bret)
+		return false;
+
+	/* copy_fstab() won't overwrite the fstab we had */
+	if (snap->lxc_conf->fstab && (p = strrchr(snap->lxc_conf->fstab, '/'))) {
+		ret = snprintf(path, MAXPATHLEN, "%s/%s%s", c->config_path,
+				c->name, p);
+		if (ret > 0 && ret < MAXPATHLEN && unlink(path) < 0 &&
+				errno != ENOENT)
+			SYSERROR("Failed to remove %s", path);
+	}
+	if (copyhooks(snap, c) < 0 || copy_fstab(snap, c) < 0)
+		return false;
+	return c->save_config(c, NULL);
+}
+
+/*
+ * Restore @snap over @c itself: its storage in place where the backing
+ * store can do it cheaply, rather than removing and copying it all,
+ * then its configuration.  Returns 1 if the storage can't be, for the
+ * caller to destroy and clone instead.
+ */
+static int snapshot_restore_in_place(struct lxc_container *c,
+		struct lxc_container *snap, struct bdev *bdev)
+{
+	struct bdev *sbdev;
+	char *old = NULL;
+	int ret;
+
+	if (!lazy_load_config(snap))
+		return -1;
+	sbdev = bdev_init(snap->lxc_conf, snap->lxc_conf->rootfs.path, NULL, NULL);
+	if (!sbdev)
+		return -1;
+
+	if (container_disk_lock(c)) {
+		bdev_put(sbdev);
 		return -1;
 	}
-	if (flags & LXC_CLONE_SNAPSHOT)
-		copy_rdepends(c, c0);
-	if (need_rdep) {
-		if (!add_rdepends(c, c0))
-			WARN("Error adding reverse dependency from %s to %s",
-				c->name, c0->name);
+	if (!is_stopped(c)) {
+		ERROR("container %s is not stopped", c->name);
+		ret = -1;
+	} else {
+		ret = bdev_restore(bdev, sbdev, &old);
 	}
+	container_disk_unlock(c);
+	bdev_put(sbdev);
+	if (ret)
+		return ret;
 
-	mod_all_rdeps(c, true);
+	/* what the storage held before goes to the trash, a rename away */
+	if (old) {
+		if (container_to_trash(c->config_path, c->name, old))
+			trash_reap(c->config_path, c->lxc_conf);
+		else if (lxc_rmdir_onedev(old, NULL) < 0)
+			WARN("Failed to remove %s", old);
+		free(old);
+	}
 
+	if (!snapshot_restore_config(c, snap)) {
+		ERROR("Failed to restore the configuration of %s", c->name);
+		return -1;
+	}
+	INFO("restored %s in place", c->name);
 	return 0;
 }
 
-struct clone_update_data {
-	struct lxc_container *c0;
-	struct lxc_container *c1;
-	int flags;
-	char **hookargs;
-};
-
-static int clone_update_rootfs(struct clone_update_data *data)
+static bool lxcapi_snapshot_restore(struct lxc_container *c, const char *snapname, const char *newname)
 {
-	struct lxc_container *c0 = data->c0;
-	struct lxc_container *c = data->c1;
-	int flags = data->flags;
-	char **hookargs = data->hookargs;
-	int ret = -1;
-	char path[MAXPATHLEN];
+	LXC_API_STATS(snapshot_restore);
+	char clonelxcpath[MAXPATHLEN];
+	int flags = 0;
+	struct lxc_container *snap, *rest;
 	struct bdev *bdev;
-	FILE *fout;
-	struct lxc_conf *conf = c->lxc_conf;
+	bool b = false;
 
-	/* update hostname in rootfs */
-	/* we're going to mount, so run in a clean namespace to simplify cleanup */
+	if (!c || !c->name || !c->config_path || !lazy_load_config(c))
+		return false;
 
-	if (setgid(0) < 0) {
-		ERROR("Failed to setgid to 0");
-		return -1;
-	}
-	if (setuid(0) < 0) {
-		ERROR("Failed to setuid to 0");
-		return -1;
+	if (has_fs_snapshots(c)) {
+		ERROR("container rootfs has dependent snapshots");
+		return false;
 	}
-	if (setgroups(0, NULL) < 0)
-		WARN("Failed to clear groups");
 
-	if (unshare(CLONE_NEWNS) < 0)
-		return -1;
 	bdev = bdev_init(c->lxc_conf, c->lxc_conf->rootfs.path, c->lxc_conf->rootfs.mount, NULL);
-	if (!bdev)
-		return -1;
-	if (strcmp(bdev->type, "dir") != 0) {
-		if (unshare(CLONE_NEWNS) < 0) {
-			ERROR("error unsharing mounts");
+	if (!bdev) {
+		ERROR("Failed to find original backing store type");
+		return false;
+	}
+
+	if (!newname)
+		newname = c->name;
+
+	if (!get_snappath_dir(c, clonelxcpath)) {
+		bdev_put(bdev);
+		return false;
+	}
+	// how should we lock this?
+
+	snap = lxc_container_new(snapname, clonelxcpath);
+	if (!snap || !lxcapi_is_defined(snap)) {
+		ERROR("Could not open snapshot %s", snapname);
+		if (snap) lxc_container_put(snap);
+		bdev_put(bdev);
+		return false;
+	}
+
+	if (strcmp(c->name, newname) == 0) {
+		int ret = snapshot_restore_in_place(c, snap, bdev);
+
+		if (ret <= 0) {
+			lxc_container_put(snap);
 			bdev_put(bdev);
-			return -1;
-		}
-		if (detect_shared_rootfs()) {
-			if (mount(NULL, "/", NULL, MS_SLAVE|MS_REC, NULL)) {
-				SYSERROR("Failed to make / rslave");
-				ERROR("Continuing...");
-			}
+			return ret == 0;
 		}
-		if (bdev->ops->mount(bdev) < 0) {
+		if (!container_destroy(c, false)) {
+			ERROR("Could not destroy existing container %s", newname);
+			lxc_container_put(snap);
 			bdev_put(bdev);
-			return -1;
+			return false;
 		}
-	} else { // TODO come up with a better way
-		if (bdev->dest)
-			free(bdev->dest);
-		bdev->dest = strdup(bdev->src);
 	}
 
-	if (!lxc_list_empty(&conf->hooks[LXCHOOK_CLONE])) {
-		/* Start of environment variable setup for hooks */
-		if (setenv("LXC_SRC_NAME", c0->name, 1)) {
-			SYSERROR("failed to set environment variable for source container name");
-		}
-		if (setenv("LXC_NAME", c->name, 1)) {
-			SYSERROR("failed to set environment variable for container name");
-		}
-		if (setenv("LXC_CONFIG_FILE", conf->rcfile, 1)) {
-			SYSERROR("failed to set environment variable for config path");
-		}
-		if (setenv("LXC_ROOTFS_MOUNT", bdev->dest, 1)) {
-			SYSERROR("failed to set environment variable for rootfs mount");
-		}
-		if (setenv("LXC_ROOTFS_PATH", conf->rootfs.path, 1)) {
-			SYSERROR("failed to set environment variable for rootfs mount");
-		}
+	if (strcmp(bdev->type, "dir") != 0 && strcmp(bdev->type, "loop") != 0)
+		flags = LXC_CLONE_SNAPSHOT | LXC_CLONE_MAYBE_SNAPSHOT;
+	rest = lxcapi_clone(snap, newname, c->config_path, flags,
+			bdev->type, NULL, 0, NULL);
+	bdev_put(bdev);
+	if (rest && lxcapi_is_defined(rest))
+		b = true;
+	if (rest)
+		lxc_container_put(rest);
+	lxc_container_put(snap);
+	return b;
+}
 
-		if (run_lxc_hooks(c->name, "clone", conf, c->get_config_path(c), hookargs)) {
-			ERROR("Error executing clone hook for %s", c->name);
-			bdev_put(bdev);
-			return -1;
-		}
+static bool do_snapshot_destroy(const char *snapname, const char *clonelxcpath)
+{
+	struct lxc_container *snap = NULL;
+	bool bret = false;
+
+	snap = lxc_container_new(snapname, clonelxcpath);
+	if (!snap) {
+		ERROR("Could not find snapshot %s", snapname);
+		goto err;
 	}
 
-	if (!(flags & LXC_CLONE_KEEPNAME)) {
-		ret = snprintf(path, MAXPATHLEN, "%s/etc/hostname", bdev->dest);
-		bdev_put(bdev);
+	if (!lxcapi_destroy(snap)) {
+		ERROR("Could not destroy snapshot %s", snapname);
+		goto err;
+	}
+	bret = true;
 
-		if (ret < 0 || ret >= MAXPATHLEN)
-			return -1;
-		if (!file_exists(path))
-			return 0;
-		if (!(fout = fopen(path, "w"))) {
-			SYSERROR("unable to open %s: ignoring", path);
-			return 0;
-		}
-		if (fprintf(fout, "%s", c->name) < 0) {
-			fclose(fout);
-			return -1;
+err:
+	if (snap)
+		lxc_container_put(snap);
+	return bret;
+}
+
+static bool remove_all_snapshots(const char *path)
+{
+	DIR *dir;
+	struct dirent dirent, *direntp;
+	bool bret = true;
+
+	dir = opendir(path);
+	if (!dir) {
+		SYSERROR("opendir on snapshot path %s", path);
+		return false;
+	}
+	while (!readdir_r(dir, &dirent, &direntp)) {
+		if (!direntp)
+			break;
+		if (!strcmp(direntp->d_name, "."))
+			continue;
+		if (!strcmp(direntp->d_name, ".."))
+			continue;
+		if (!do_snapshot_destroy(direntp->d_name, path)) {
+			bret = false;
+			continue;
 		}
-		if (fclose(fout) < 0)
-			return -1;
 	}
-	else
-		bdev_put(bdev);
 
-	return 0;
+	closedir(dir);
+
+	if (rmdir(path))
+		SYSERROR("Error removing directory %s", path);
+
+	return bret;
 }
 
-static int clone_update_rootfs_wrapper(void *data)
+static bool lxcapi_snapshot_destroy(struct lxc_container *c, const char *snapname)
 {
-	struct clone_update_data *arg = (struct clone_update_data *) data;
-	return clone_update_rootfs(arg);
-}
+	LXC_API_STATS(snapshot_destroy);
+	char clonelxcpath[MAXPATHLEN];
+	struct lxc_snapshot *snaps = NULL;
+	int i, n;
 
-/*
- * We want to support:
-sudo lxc-clone -o o1 -n n1 -s -L|-fssize fssize -v|--vgname vgname \
-        -p|--lvprefix lvprefix -t|--fstype fstype  -B backingstore
+	if (!c || !c->name || !c->config_path || !snapname)
+		return false;
 
--s [ implies overlayfs]
--s -B overlayfs
--s -B aufs
+	if (!get_snappath_dir(c, clonelxcpath))
+		return false;
 
-only rootfs gets converted (copied/snapshotted) on clone.
-*/
+	n = snap_catalog_load(clonelxcpath, &snaps);
+	if (!do_snapshot_destroy(snapname, clonelxcpath)) {
+		free_snaps(snaps, n > 0 ? n : 0);
+		return false;
+	}
+	for (i = 0; i < n; i++) {
+		if (strcmp(snaps[i].name, snapname) != 0)
+			continue;
+		lxcsnap_free(&snaps[i]);
+		memmove(&snaps[i], &snaps[i + 1], (n - i - 1) * sizeof(*snaps));
+		n--;
+		snap_catalog_write(clonelxcpath, snaps, n);
+		break;
+	}
+	free_snaps(snaps, n > 0 ? n : 0);
+	return true;
+}
 
-static int create_file_dirname(char *path)
+static bool lxcapi_snapshot_destroy_all(struct lxc_container *c)
 {
-	char *p = strrchr(path, '/');
-	int ret;
+	LXC_API_STATS(snapshot_destroy_all);
+	char clonelxcpath[MAXPATHLEN], path[MAXPATHLEN];
 
-	if (!p)
-		return -1;
-	*p = '\0';
-	ret = mkdir(path, 0755);
-	if (ret && errno != EEXIST)
-		SYSERROR("creating container path %s", path);
-	*p = '/';
-	return ret;
+	if (!c || !c->name || !c->config_path)
+		return false;
+
+	if (!get_snappath_dir(c, clonelxcpath))
+		return false;
+
+	if (snap_catalog_path(clonelxcpath, path) && unlink(path) < 0 &&
+			errno != ENOENT)
+		WARN("Failed to remove %s", path);
+
+	return remove_all_snapshots(clonelxcpath);
 }
 
-static struct lxc_container *lxcapi_clone(struct lxc_container *c, const char *newname,
-		const char *lxcpath, int flags,
-		const char *bdevtype, const char *bdevdata, uint64_t newsize,
-		char **hookargs)
+static bool lxcapi_may_control(struct lxc_container *c)
 {
-	struct lxc_container *c2 = NULL;
-	char newpath[MAXPATHLEN];
-	int ret, storage_copied = 0;
-	const char *n, *l;
-	char *origroot = NULL;
-	struct clone_update_data data;
-	FILE *fout;
-	pid_t pid;
+	LXC_API_STATS(may_control);
+	return lxc_try_cmd(c->name, c->config_path) == 0;
+}
 
-	if (!c || !c->is_defined(c))
-		return NULL;
+/* a device node to create or remove in the container, and its cgroup rule */
+struct device_node_op {
+	const char *path;
+	struct stat st;
+	char rule[64];
+};
 
-	if (container_mem_lock(c))
-		return NULL;
+/*
+ * Create or remove all the @n nodes in the container of @init_pid from one
+ * helper process chrooted into it.  Each node is tried even if an earlier
+ * one failed.
+ */
+static bool do_add_remove_nodes(pid_t init_pid, struct device_node_op *ops,
+				int n, bool add)
+{
+	char chrootpath[MAXPATHLEN];
+	char *directory_path;
+	int i, ret, failed = 0;
+	pid_t pid;
 
-	if (!is_stopped(c)) {
-		ERROR("error: Original container (%s) is running", c->name);
-		goto out;
-	}
+	/* prepare the path */
+	ret = snprintf(chrootpath, MAXPATHLEN, "/proc/%d/root", init_pid);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return false;
 
-	// Make sure the container doesn't yet exist.
-	n = newname ? newname : c->name;
-	l = lxcpath ? lxcpath : c->get_config_path(c);
-	ret = snprintf(newpath, MAXPATHLEN, "%s/%s/config", l, n);
-	if (ret < 0 || ret >= MAXPATHLEN) {
-		SYSERROR("clone: failed making config pathname");
-		goto out;
+	if ((pid = fork()) < 0) {
+		SYSERROR("failed to fork a child helper");
+		return false;
 	}
-	if (file_exists(newpath)) {
-		ERROR("error: clone: %s exists", newpath);
-		goto out;
+	if (pid) {
+		if (wait_for_pid(pid) != 0) {
+			ERROR("Failed to %s device nodes in guest",
+			      add ? "create" : "remove");
+			return false;
+		}
+		return true;
 	}
 
-	ret = create_file_dirname(newpath);
-	if (ret < 0 && errno != EEXIST) {
-		ERROR("Error creating container dir for %s", newpath);
-		goto out;
-	}
+	if (chroot(chrootpath) < 0)
+		_exit(1);
+	if (chdir("/") < 0)
+		_exit(1);
 
-	// copy the configuration, tweak it as needed,
-	if (c->lxc_conf->rootfs.path) {
-		origroot = c->lxc_conf->rootfs.path;
-		c->lxc_conf->rootfs.path = NULL;
-	}
-	fout = fopen(newpath, "w");
-	if (!fout) {
-		SYSERROR("open %s", newpath);
-		goto out;
+	for (i = 0; i < n; i++) {
+		const char *path = ops[i].path;
+
+		/* remove path if it exists */
+		if (faccessat(AT_FDCWD, path, F_OK, AT_SYMLINK_NOFOLLOW) == 0 &&
+		    unlink(path) < 0) {
+			SYSERROR("unlink of %s failed", path);
+			failed = 1;
+			continue;
+		}
+		if (!add)
+			continue;
+
+		/* create any missing directories */
+		directory_path = strdup(path);
+		if (!directory_path ||
+		    (mkdir_p(dirname(directory_path), 0755) < 0 &&
+		     errno != EEXIST)) {
+			ERROR("failed to create directory for %s", path);
+			free(directory_path);
+			failed = 1;
+			continue;
+		}
+		free(directory_path);
+
+		/* create the device node */
+		if (mknod(path, ops[i].st.st_mode, ops[i].st.st_rdev) < 0) {
+			SYSERROR("mknod of %s failed", path);
+			failed = 1;
+		}
 	}
-	write_config(fout, c->lxc_unexp_conf);
-	fclose(fout);
-	c->lxc_conf->rootfs.path = origroot;
 
-	sprintf(newpath, "%s/%s/rootfs", l, n);
-	if (mkdir(newpath, 0755) < 0) {
-		SYSERROR("error creating %s", newpath);
-		goto out;
+	_exit(failed);
+}
+
+/*
+ * Write all the rules of @ops to the container's devices.allow or
+ * devices.deny, through one open cgroup directory when the driver tells
+ * where it is.
+ */
+static bool set_device_rules(struct lxc_container *c, const char *file,
+			     struct device_node_op *ops, int n)
+{
+	char *path;
+	int i, ret, dirfd = -1;
+	bool b = true;
+
+	if (container_disk_lock(c))
+		return false;
+
+	path = lxc_cgroup_get_path("devices", c->name, c->config_path);
+	if (path) {
+		dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		free(path);
 	}
 
-	if (am_unpriv()) {
-		if (chown_mapped_root(newpath, c->lxc_conf) < 0) {
-			ERROR("Error chowning %s to container root", newpath);
-			goto out;
+	for (i = 0; i < n; i++) {
+		if (dirfd >= 0)
+			ret = lxc_writeat(dirfd, file, ops[i].rule,
+					  strlen(ops[i].rule));
+		else
+			ret = lxc_cgroup_set(file, ops[i].rule, c->name,
+					     c->config_path);
+		if (ret < 0) {
+			ERROR("failed to write '%s' to %s", ops[i].rule, file);
+			b = false;
 		}
 	}
 
-	c2 = lxc_container_new(n, l);
-	if (!c2) {
-		ERROR("clone: failed to create new container (%s %s)", n, l);
-		goto out;
-	}
+	if (dirfd >= 0)
+		close(dirfd);
+	container_disk_unlock(c);
+	return b;
+}
 
-	// copy/snapshot rootfs's
-	ret = copy_storage(c, c2, bdevtype, flags, bdevdata, newsize);
-	if (ret < 0)
-		goto out;
+static bool add_remove_device_nodes(struct lxc_container *c,
+				    const char **src_paths,
+				    const char **dest_paths, int n, bool add)
+{
+	struct device_node_op *ops;
+	const char *src;
+	pid_t init_pid;
+	int i, ret;
+	bool b = false;
 
-	// update utsname
-	if (!set_config_item_locked(c2, "lxc.utsname", newname)) {
-		ERROR("Error setting new hostname");
-		goto out;
-	}
+	if (n < 1 || !src_paths)
+		return false;
 
-	// copy hooks
-	ret = copyhooks(c, c2);
-	if (ret < 0) {
-		ERROR("error copying hooks");
-		goto out;
+	/* make sure container is running */
+	if (!c->is_running(c)) {
+		ERROR("container is not running");
+		return false;
 	}
+	init_pid = c->init_pid(c);
+	if (init_pid <= 0)
+		return false;
 
-	if (copy_fstab(c, c2) < 0) {
-		ERROR("error copying fstab");
-		goto out;
+	ops = malloc(n * sizeof(*ops));
+	if (!ops) {
+		ERROR("Out of memory");
+		return false;
 	}
 
-	// update macaddrs
-	if (!(flags & LXC_CLONE_KEEPMACADDR))
-		network_new_hwaddrs(c2);
+	/* check all the devices before touching anything */
+	for (i = 0; i < n; i++) {
+		src = src_paths[i];
+		/* use src_path if dest_path is NULL otherwise use dest_path */
+		ops[i].path = dest_paths && dest_paths[i] ? dest_paths[i] : src;
 
-	// We've now successfully created c2's storage, so clear it out if we
-	// fail after this
-	storage_copied = 1;
+		if (!src || stat(src, &ops[i].st) < 0) {
+			ERROR("failed to stat device %s", src ? src : "(null)");
+			goto out;
+		}
 
-	if (!c2->save_config(c2, NULL))
-		goto out;
+		/* continue if path is character device or block device */
+		if (S_ISCHR(ops[i].st.st_mode))
+			ret = snprintf(ops[i].rule, sizeof(ops[i].rule),
+				       "c %d:%d rwm", major(ops[i].st.st_rdev),
+				       minor(ops[i].st.st_rdev));
+		else if (S_ISBLK(ops[i].st.st_mode))
+			ret = snprintf(ops[i].rule, sizeof(ops[i].rule),
+				       "b %d:%d rwm", major(ops[i].st.st_rdev),
+				       minor(ops[i].st.st_rdev));
+		else {
+			ERROR("%s is not a device", src);
+			goto out;
+		}
 
-	if ((pid = fork()) < 0) {
-		SYSERROR("fork");
+		/* check snprintf return code */
+		if (ret < 0 || ret >= sizeof(ops[i].rule))
+			goto out;
+	}
+
+	if (!do_add_remove_nodes(init_pid, ops, n, add))
 		goto out;
+
+	/* add or remove devices to/from cgroup access list */
+	b = set_device_rules(c, add ? "devices.allow" : "devices.deny", ops, n);
+
+out:
+	free(ops);
+	return b;
+}
+
+static bool add_remove_device_node(struct lxc_container *c, const char *src_path, const char *dest_path, bool add)
+{
+	return add_remove_device_nodes(c, &src_path, &dest_path, 1, add);
+}
+
+static bool lxcapi_add_device_node(struct lxc_container *c, const char *src_path, const char *dest_path)
+{
+	LXC_API_STATS(add_device_node);
+	if (am_unpriv()) {
+		ERROR(NOT_SUPPORTED_ERROR, __FUNCTION__);
+		return false;
 	}
-	if (pid > 0) {
-		ret = wait_for_pid(pid);
-		if (ret)
-			goto out;
-		container_mem_unlock(c);
-		return c2;
+	return add_remove_device_node(c, src_path, dest_path, true);
+}
+
+static bool lxcapi_remove_device_node(struct lxc_container *c, const char *src_path, const char *dest_path)
+{
+	LXC_API_STATS(remove_device_node);
+	if (am_unpriv()) {
+		ERROR(NOT_SUPPORTED_ERROR, __FUNCTION__);
+		return false;
 	}
-	data.c0 = c;
-	data.c1 = c2;
-	data.flags = flags;
-	data.hookargs = hookargs;
-	if (am_unpriv())
-		ret = userns_exec_1(c->lxc_conf, clone_update_rootfs_wrapper,
-				&data);
-	else
-		ret = clone_update_rootfs(&data);
-	if (ret < 0)
-		exit(1);
+	return add_remove_device_node(c, src_path, dest_path, false);
+}
+
+static bool lxcapi_add_device_nodes(struct lxc_container *c,
+				    const char **src_paths,
+				    const char **dest_paths, int n)
+{
+	LXC_API_STATS(add_device_nodes);
+	if (!c)
+		return false;
+	if (am_unpriv()) {
+		ERROR(NOT_SUPPORTED_ERROR, __FUNCTION__);
+		return false;
+	}
+	return add_remove_device_nodes(c, src_paths, dest_paths, n, true);
+}
+
+static bool lxcapi_remove_device_nodes(struct lxc_container *c,
+				       const char **src_paths,
+				       const char **dest_paths, int n)
+{
+	LXC_API_STATS(remove_device_nodes);
+	if (!c)
+		return false;
+	if (am_unpriv()) {
+		ERROR(NOT_SUPPORTED_ERROR, __FUNCTION__);
+		return false;
+	}
+	return add_remove_device_nodes(c, src_paths, dest_paths, n, false);
+}
 
-	container_mem_unlock(c);
-	exit(0);
+static bool lxcapi_checkpoint(struct lxc_container *c, char *directory,
+			      bool stop, bool verbose)
+{
+	LXC_API_STATS(checkpoint);
+	bool ret;
 
-out:
-	container_mem_unlock(c);
-	if (c2) {
-		if (!storage_copied)
-			c2->lxc_conf->rootfs.path = NULL;
-		c2->destroy(c2);
-		lxc_container_put(c2);
-	}
+	if (!c || !directory)
+		return false;
+	if (!lazy_load_config(c) || !c->lxc_conf)
+		return false;
 
-	return NULL;
+	ret = criu_checkpoint(c, directory, stop, verbose);
+	state_cache_invalidate(c);
+	return ret;
 }
 
-static bool lxcapi_rename(struct lxc_container *c, const char *newname)
+static bool lxcapi_restore(struct lxc_container *c, char *directory,
+			   bool verbose)
 {
-	struct bdev *bdev;
-	struct lxc_container *newc;
+	LXC_API_STATS(restore);
+	char *dir;
+	pid_t pid;
+	int pipefd[2], status = -1, ret;
 
-	if (!c || !c->name || !c->config_path || !c->lxc_conf)
+	if (!c || !directory)
 		return false;
-
-	if (has_fs_snapshots(c) || has_snapshots(c)) {
-		ERROR("Renaming a container with snapshots is not supported");
+	if (!lazy_load_config(c) || !c->lxc_conf)
 		return false;
-	}
-	bdev = bdev_init(c->lxc_conf, c->lxc_conf->rootfs.path, c->lxc_conf->rootfs.mount, NULL);
-	if (!bdev) {
-		ERROR("Failed to find original backing store type");
+	if (c->is_running(c)) {
+		ERROR("%s is running", c->name);
 		return false;
 	}
+	if (!criu_ok(c))
+		return false;
 
-	newc = lxcapi_clone(c, newname, c->config_path, LXC_CLONE_KEEPMACADDR, NULL, bdev->type, 0, NULL);
-	bdev_put(bdev);
-	if (!newc) {
-		lxc_container_put(newc);
+	/* the monitor chdirs to / */
+	dir = realpath(directory, NULL);
+	if (!dir) {
+		SYSERROR("failed to resolve %s", directory);
 		return false;
 	}
+	if (pipe2(pipefd, O_CLOEXEC) < 0) {
+		SYSERROR("failed to create a pipe");
+		free(dir);
+		return false;
+	}
+	lxc_monitord_spawn(c->config_path);
 
-	if (newc && lxcapi_is_defined(newc))
-		lxc_container_put(newc);
-
-	if (!container_destroy(c)) {
-		ERROR("Could not destroy existing container %s", c->name);
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("failed to fork");
+		close(pipefd[0]);
+		close(pipefd[1]);
+		free(dir);
 		return false;
 	}
-	return true;
-}
+	if (pid != 0) {
+		close(pipefd[1]);
+		free(dir);
+		ret = read(pipefd[0], &status, sizeof(status));
+		close(pipefd[0]);
+		wait_for_pid(pid);
+		state_cache_invalidate(c);
+		return ret == sizeof(status) && status == 0;
+	}
 
-static int lxcapi_attach(struct lxc_container *c, lxc_attach_exec_t exec_function, void *exec_payload, lxc_attach_options_t *options, pid_t *attached_process)
-{
-	if (!c)
-		return -1;
+	/* daemonized as a start is, the restored init is our child */
+	close(pipefd[0]);
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("Error doing dual-fork");
+		exit(EXIT_FAILURE);
+	}
+	if (pid != 0)
+		exit(EXIT_SUCCESS);
+	if (chdir("/")) {
+		SYSERROR("Error chdir()ing to /.");
+		exit(EXIT_FAILURE);
+	}
+	close(0);
+	close(1);
+	close(2);
+	open("/dev/zero", O_RDONLY);
+	open("/dev/null", O_RDWR);
+	open("/dev/null", O_RDWR);
+	setsid();
+
+	ret = criu_restore(c, dir, verbose, pipefd[1]);
+	c->error_num = ret;
 
-	return lxc_attach(c->name, c->config_path, exec_function, exec_payload, options, attached_process);
+	/* from then on it reboots as any container */
+	if (c->lxc_conf->reboot) {
+		INFO("container requested reboot");
+		c->daemonize = false;
+		exit(do_lxcapi_start(c, 0, NULL, true) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	exit(ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
-static int lxcapi_attach_run_wait(struct lxc_container *c, lxc_attach_options_t *options, const char *program, const char * const argv[])
+static int lxcapi_attach_run_waitl(struct lxc_container *c, lxc_attach_options_t *options, const char *program, const char *arg, ...)
 {
-	lxc_attach_command_t command;
-	pid_t pid;
-	int r;
+	LXC_API_STATS(attach_run_waitl);
+	va_list ap;
+	const char **argv;
+	int ret;
 
 	if (!c)
 		return -1;
 
-	command.program = (char*)program;
-	command.argv = (char**)argv;
-	r = lxc_attach(c->name, c->config_path, lxc_attach_run_command, &command, options, &pid);
-	if (r < 0) {
-		ERROR("ups");
-		return r;
-	}
-	return lxc_wait_for_pid_status(pid);
-}
-
-static int get_next_index(const char *lxcpath, char *cname)
-{
-	char *fname;
-	struct stat sb;
-	int i = 0, ret;
-
-	fname = alloca(strlen(lxcpath) + 20);
-	while (1) {
-		sprintf(fname, "%s/snap%d", lxcpath, i);
-		ret = stat(fname, &sb);
-		if (ret != 0)
-			return i;
-		i++;
-	}
-}
+	va_start(ap, arg);
+	argv = lxc_va_arg_list_to_argv_const(ap, 1);
+	va_end(ap);
 
-static bool get_snappath_dir(struct lxc_container *c, char *snappath)
-{
-	int ret;
-	/*
-	 * If the old style snapshot path exists, use it
-	 * /var/lib/lxc -> /var/lib/lxcsnaps
-	 */
-	ret = snprintf(snappath, MAXPATHLEN, "%ssnaps", c->config_path);
-	if (ret < 0 || ret >= MAXPATHLEN)
-		return false;
-	if (dir_exists(snappath)) {
-		ret = snprintf(snappath, MAXPATHLEN, "%ssnaps/%s", c->config_path, c->name);
-		if (ret < 0 || ret >= MAXPATHLEN)
-			return false;
-		return true;
+	if (!argv) {
+		ERROR("Memory allocation error.");
+		return -1;
 	}
+	argv[0] = arg;
 
-	/*
-	 * Use the new style path
-	 * /var/lib/lxc -> /var/lib/lxc + c->name + /snaps + \0
-	 */
-	ret = snprintf(snappath, MAXPATHLEN, "%s/%s/snaps", c->config_path, c->name);
-	if (ret < 0 || ret >= MAXPATHLEN)
-		return false;
-	return true;
+	ret = lxcapi_attach_run_wait(c, options, program, (const char * const *)argv);
+	free((void*)argv);
+	return ret;
 }
 
-static int lxcapi_snapshot(struct lxc_container *c, const char *commentfile)
+static struct lxc_container *container_new(const char *name,
+		const char *configpath, bool lazy)
 {
-	int i, flags, ret;
-	struct lxc_container *c2;
-	char snappath[MAXPATHLEN], newname[20];
+	struct lxc_container *c;
 
-	if (!c || !lxcapi_is_defined(c))
-		return -1;
+	if (!name)
+		return NULL;
 
-	if (!get_snappath_dir(c, snappath))
-		return -1;
+	c = malloc(sizeof(*c));
+	if (!c) {
+		fprintf(stderr, "failed to malloc lxc_container\n");
+		return NULL;
+	}
+	memset(c, 0, sizeof(*c));
 
-	i = get_next_index(snappath, c->name);
+	if (configpath)
+		c->config_path = strdup(configpath);
+	else
+		c->config_path = strdup(lxc_global_config_value("lxc.lxcpath"));
 
-	if (mkdir_p(snappath, 0755) < 0) {
-		ERROR("Failed to create snapshot directory %s", snappath);
-		return -1;
+	if (!c->config_path) {
+		fprintf(stderr, "Out of memory\n");
+		goto err;
 	}
 
-	ret = snprintf(newname, 20, "snap%d", i);
-	if (ret < 0 || ret >= 20)
-		return -1;
+	remove_trailing_slashes(c->config_path);
+	c->name = malloc(strlen(name)+1);
+	if (!c->name) {
+		fprintf(stderr, "Error allocating lxc_container name\n");
+		goto err;
+	}
+	strcpy(c->name, name);
 
-	/*
-	 * We pass LXC_CLONE_SNAPSHOT to make sure that a rdepends file entry is
-	 * created in the original container
-	 */
-	flags = LXC_CLONE_SNAPSHOT | LXC_CLONE_KEEPMACADDR | LXC_CLONE_KEEPNAME |
-		LXC_CLONE_KEEPBDEVTYPE | LXC_CLONE_MAYBE_SNAPSHOT;
-	if (bdev_is_dir(c->lxc_conf, c->lxc_conf->rootfs.path)) {
-		ERROR("Snapshot of directory-backed container requested.");
-		ERROR("Making a copy-clone.  If you do want snapshots, then");
-		ERROR("please create an aufs or overlayfs clone first, snapshot that");
-		ERROR("and keep the original container pristine.");
-		flags &= ~LXC_CLONE_SNAPSHOT | LXC_CLONE_MAYBE_SNAPSHOT;
+	c->numthreads = 1;
+	if (!(c->slock = lxc_newlock(c->config_path, name))) {
+		fprintf(stderr, "failed to create lock\n");
+		goto err;
 	}
-	c2 = c->clone(c, newname, snappath, flags, NULL, NULL, 0, NULL);
-	if (!c2) {
-		ERROR("clone of %s:%s failed", c->config_path, c->name);
-		return -1;
+
+	if (!(c->privlock = lxc_newlock(NULL, NULL))) {
+		fprintf(stderr, "failed to alloc privlock\n");
+		goto err;
 	}
 
-	lxc_container_put(c2);
+	if (!set_config_filename(c)) {
+		fprintf(stderr, "Error allocating config file pathname\n");
+		goto err;
+	}
 
-	// Now write down the creation time
-	time_t timer;
-	char buffer[25];
-	struct tm* tm_info;
-	FILE *f;
+	if (lazy) {
+		/* lazy_load_config() will read it when it is needed */
+		c->lazy_config = true;
+	} else {
+		if (file_exists(c->configfile) && !lxcapi_load_config(c, NULL))
+			goto err;
 
-	time(&timer);
-	tm_info = localtime(&timer);
+		if (ongoing_create(c) == 2) {
+			ERROR("Error: %s creation was not completed", c->name);
+			container_destroy(c, false);
+			lxcapi_clear_config(c);
+		}
+	}
+	c->daemonize = true;
+	c->pidfile = NULL;
 
-	strftime(buffer, 25, "%Y:%m:%d %H:%M:%S", tm_info);
+	// assign the member functions
+	c->is_defined = lxcapi_is_defined;
+	c->state = lxcapi_state;
+	c->is_running = lxcapi_is_running;
+	c->freeze = lxcapi_freeze;
+	c->unfreeze = lxcapi_unfreeze;
+	c->console = lxcapi_console;
+	c->console_getfd = lxcapi_console_getfd;
+	c->init_pid = lxcapi_init_pid;
+	c->load_config = lxcapi_load_config;
+	c->want_daemonize = lxcapi_want_daemonize;
+	c->want_close_all_fds = lxcapi_want_close_all_fds;
+	c->start = lxcapi_start;
+	c->startl = lxcapi_startl;
+	c->stop = lxcapi_stop;
+	c->config_file_name = lxcapi_config_file_name;
+	c->wait = lxcapi_wait;
+	c->set_config_item = lxcapi_set_config_item;
+	c->destroy = lxcapi_destroy;
+	c->destroy_async = lxcapi_destroy_async;
+	c->destroy_with_snapshots = lxcapi_destroy_with_snapshots;
+	c->rename = lxcapi_rename;
+	c->save_config = lxcapi_save_config;
+	c->get_keys = lxcapi_get_keys;
+	c->create = lxcapi_create;
+	c->createl = lxcapi_createl;
+	c->shutdown = lxcapi_shutdown;
+	c->reboot = lxcapi_reboot;
+	c->clear_config = lxcapi_clear_config;
+	c->clear_config_item = lxcapi_clear_config_item;
+	c->get_config_item = lxcapi_get_config_item;
+	c->get_running_config_item = lxcapi_get_running_config_item;
+	c->get_cgroup_item = lxcapi_get_cgroup_item;
+	c->set_cgroup_item = lxcapi_set_cgroup_item;
+	c->get_config_path = lxcapi_get_config_path;
+	c->set_config_path = lxcapi_set_config_path;
+	c->clone = lxcapi_clone;
+	c->clone_many = lxcapi_clone_many;
+	c->get_interfaces = lxcapi_get_interfaces;
+	c->get_ips = lxcapi_get_ips;
+	c->attach = lxcapi_attach;
+	c->attach_run_wait = lxcapi_attach_run_wait;
+	c->attach_run_waitl = lxcapi_attach_run_waitl;
+	c->attach_helper_run_wait = lxcapi_attach_helper_run_wait;
+	c->console_log = lxcapi_console_log;
+	c->start_nowait = lxcapi_start_nowait;
+	c->stop_nowait = lxcapi_stop_nowait;
+	c->snapshot = lxcapi_snapshot;
+	c->snapshot_list = lxcapi_snapshot_list;
+	c->snapshot_restore = lxcapi_snapshot_restore;
+	c->snapshot_destroy = lxcapi_snapshot_destroy;
+	c->snapshot_destroy_all = lxcapi_snapshot_destroy_all;
+	c->may_control = lxcapi_may_control;
+	c->add_device_node = lxcapi_add_device_node;
+	c->remove_device_node = lxcapi_remove_device_node;
+	c->keep_cmd_connection = lxcapi_keep_cmd_connection;
+	c->get_running_config_items = lxcapi_get_running_config_items;
+	c->set_config_items = lxcapi_set_config_items;
+	c->get_cgroup_items = lxcapi_get_cgroup_items;
+	c->get_net_stats = lxcapi_get_net_stats;
+	c->cache_state = lxcapi_cache_state;
+	c->add_device_nodes = lxcapi_add_device_nodes;
+	c->remove_device_nodes = lxcapi_remove_device_nodes;
+	c->checkpoint = lxcapi_checkpoint;
+	c->restore = lxcapi_restore;
 
-	char *dfnam = alloca(strlen(snappath) + strlen(newname) + 5);
-	sprintf(dfnam, "%s/%s/ts", snappath, newname);
-	f = fopen(dfnam, "w");
-	if (!f) {
-		ERROR("Failed to open %s", dfnam);
-		return -1;
-	}
-	if (fprintf(f, "%s", buffer) < 0) {
-		SYSERROR("Writing timestamp");
-		fclose(f);
-		return -1;
-	}
-	ret = fclose(f);
-	if (ret != 0) {
-		SYSERROR("Writing timestamp");
-		return -1;
+	/* we'll allow the caller to update these later */
+	if (lxc_log_init(NULL, "none", NULL, "lxc_container", 0, c->config_path)) {
+		fprintf(stderr, "failed to open log\n");
+		goto err;
 	}
 
-	if (commentfile) {
-		// $p / $name / comment \0
-		int len = strlen(snappath) + strlen(newname) + 10;
-		char *path = alloca(len);
-		sprintf(path, "%s/%s/comment", snappath, newname);
-		return copy_file(commentfile, path) < 0 ? -1 : i;
-	}
+	return c;
 
-	return i;
+err:
+	lxc_container_free(c);
+	return NULL;
 }
 
-static void lxcsnap_free(struct lxc_snapshot *s)
+struct lxc_container *lxc_container_new(const char *name, const char *configpath)
 {
-	if (s->name)
-		free(s->name);
-	if (s->comment_pathname)
-		free(s->comment_pathname);
-	if (s->timestamp)
-		free(s->timestamp);
-	if (s->lxcpath)
-		free(s->lxcpath);
+	return container_new(name, configpath, false);
 }
 
-static char *get_snapcomment_path(char* snappath, char *name)
-{
-	// $snappath/$name/comment
-	int ret, len = strlen(snappath) + strlen(name) + 10;
-	char *s = malloc(len);
+#define NEW_MANY_MAX_THREADS 16
 
-	if (s) {
-		ret = snprintf(s, len, "%s/%s/comment", snappath, name);
-		if (ret < 0 || ret >= len) {
-			free(s);
-			s = NULL;
-		}
-	}
-	return s;
-}
+struct new_many_data {
+	const char **names;
+	int n;
+	const char *configpath;
+	struct lxc_container **cret;
+	int next;
+	int created;
+};
 
-static char *get_timestamp(char* snappath, char *name)
+/* takes the next name until there are none left, no lock involved */
+static void *new_many_worker(void *arg)
 {
-	char path[MAXPATHLEN], *s = NULL;
-	int ret, len;
-	FILE *fin;
+	struct new_many_data *d = arg;
+	int i;
 
-	ret = snprintf(path, MAXPATHLEN, "%s/%s/ts", snappath, name);
-	if (ret < 0 || ret >= MAXPATHLEN)
-		return NULL;
-	fin = fopen(path, "r");
-	if (!fin)
-		return NULL;
-	(void) fseek(fin, 0, SEEK_END);
-	len = ftell(fin);
-	(void) fseek(fin, 0, SEEK_SET);
-	if (len > 0) {
-		s = malloc(len+1);
-		if (s) {
-			s[len] = '\0';
-			if (fread(s, 1, len, fin) != len) {
-				SYSERROR("reading timestamp");
-				free(s);
-				s = NULL;
-			}
-		}
+	while ((i = __sync_fetch_and_add(&d->next, 1)) < d->n) {
+		d->cret[i] = container_new(d->names[i], d->configpath, false);
+		if (d->cret[i])
+			__sync_fetch_and_add(&d->created, 1);
 	}
-	fclose(fin);
-	return s;
+	return NULL;
 }
 
-static int lxcapi_snapshot_list(struct lxc_container *c, struct lxc_snapshot **ret_snaps)
+int lxc_container_new_many(const char **names, int n, const char *configpath,
+		struct lxc_container **cret, int max_parallel)
 {
-	char snappath[MAXPATHLEN], path2[MAXPATHLEN];
-	int count = 0, ret;
-	struct dirent dirent, *direntp;
-	struct lxc_snapshot *snaps =NULL, *nsnaps;
-	DIR *dir;
+	struct new_many_data d;
+	pthread_t threads[NEW_MANY_MAX_THREADS];
+	int i, nthreads, started = 0;
+	long ncpus;
 
-	if (!c || !lxcapi_is_defined(c))
+	if (!names || !cret || n < 0)
 		return -1;
+	memset(cret, 0, n * sizeof(*cret));
 
-	if (!get_snappath_dir(c, snappath)) {
-		ERROR("path name too long");
+	/* resolved here, each thread would read lxc.conf again */
+	if (!configpath)
+		configpath = lxc_global_config_value("lxc.lxcpath");
+	if (!configpath)
 		return -1;
-	}
-	dir = opendir(snappath);
-	if (!dir) {
-		INFO("failed to open %s - assuming no snapshots", snappath);
-		return 0;
-	}
 
-	while (!readdir_r(dir, &dirent, &direntp)) {
-		if (!direntp)
+	d.names = names;
+	d.n = n;
+	d.configpath = configpath;
+	d.cret = cret;
+	d.next = 0;
+	d.created = 0;
+
+	nthreads = max_parallel;
+	if (nthreads <= 0) {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpus > 0 ? ncpus : 1;
+	}
+	nthreads = MIN(nthreads, MIN(n, NEW_MANY_MAX_THREADS));
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, new_many_worker, &d))
 			break;
-
-		if (!strcmp(direntp->d_name, "."))
-			continue;
-
-		if (!strcmp(direntp->d_name, ".."))
-			continue;
-
-		ret = snprintf(path2, MAXPATHLEN, "%s/%s/config", snappath, direntp->d_name);
-		if (ret < 0 || ret >= MAXPATHLEN) {
-			ERROR("pathname too long");
-			goto out_free;
-		}
-		if (!file_exists(path2))
-			continue;
-		nsnaps = realloc(snaps, (count + 1)*sizeof(*snaps));
-		if (!nsnaps) {
-			SYSERROR("Out of memory");
-			goto out_free;
-		}
-		snaps = nsnaps;
-		snaps[count].free = lxcsnap_free;
-		snaps[count].name = strdup(direntp->d_name);
-		if (!snaps[count].name)
-			goto out_free;
-		snaps[count].lxcpath = strdup(snappath);
-		if (!snaps[count].lxcpath) {
-			free(snaps[count].name);
-			goto out_free;
-		}
-		snaps[count].comment_pathname = get_snapcomment_path(snappath, direntp->d_name);
-		snaps[count].timestamp = get_timestamp(snappath, direntp->d_name);
-		count++;
+		started++;
 	}
+	/* the caller is a worker too */
+	new_many_worker(&d);
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
 
-	if (closedir(dir))
-		WARN("failed to close directory");
+	return d.created;
+}
 
-	*ret_snaps = snaps;
-	return count;
+int lxc_get_wait_states(const char **states)
+{
+	int i;
 
-out_free:
-	if (snaps) {
-		int i;
-		for (i=0; i<count; i++)
-			lxcsnap_free(&snaps[i]);
-		free(snaps);
-	}
-	if (closedir(dir))
-		WARN("failed to close directory");
-	return -1;
+	if (states)
+		for (i=0; i<MAX_STATE; i++)
+			states[i] = lxc_state2str(i);
+	return MAX_STATE;
 }
 
-static bool lxcapi_snapshot_restore(struct lxc_container *c, const char *snapname, const char *newname)
+int lxc_get_states(const char *lxcpath, const char **names, int n,
+		const char **states, pid_t *pids)
 {
-	char clonelxcpath[MAXPATHLEN];
-	int flags = 0;
-	struct lxc_container *snap, *rest;
-	struct bdev *bdev;
-	bool b = false;
-
-	if (!c || !c->name || !c->config_path)
-		return false;
+	extern lxc_state_t freezer_state(const char *name, const char *lxcpath);
+	lxc_state_t *s, fs;
+	int i, ret;
 
-	if (has_fs_snapshots(c)) {
-		ERROR("container rootfs has dependent snapshots");
-		return false;
-	}
+	if (!names || !states || n < 0)
+		return -1;
+	if (n == 0)
+		return 0;
 
-	bdev = bdev_init(c->lxc_conf, c->lxc_conf->rootfs.path, c->lxc_conf->rootfs.mount, NULL);
-	if (!bdev) {
-		ERROR("Failed to find original backing store type");
-		return false;
-	}
+	if (!lxcpath)
+		lxcpath = lxc_global_config_value("lxc.lxcpath");
 
-	if (!newname)
-		newname = c->name;
+	s = malloc(n * sizeof(*s));
+	if (!s)
+		return -1;
 
-	if (!get_snappath_dir(c, clonelxcpath)) {
-		bdev_put(bdev);
-		return false;
+	ret = lxc_cmd_get_states(lxcpath, names, n, s, pids);
+	for (i = 0; ret >= 0 && i < n; i++) {
+		/* a frozen container still answers 'RUNNING' */
+		if (s[i] == RUNNING || s[i] == READY) {
+			fs = freezer_state(names[i], lxcpath);
+			if (fs == FROZEN || fs == FREEZING)
+				s[i] = fs;
+		}
+		states[i] = s[i] < 0 ? NULL : lxc_state2str(s[i]);
 	}
-	// how should we lock this?
 
-	snap = lxc_container_new(snapname, clonelxcpath);
-	if (!snap || !lxcapi_is_defined(snap)) {
-		ERROR("Could not open snapshot %s", snapname);
-		if (snap) lxc_container_put(snap);
-		bdev_put(bdev);
-		return false;
-	}
+	free(s);
+	return ret;
+}
 
-	if (strcmp(c->name, newname) == 0) {
-		if (!container_destroy(c)) {
-			ERROR("Could not destroy existing container %s", newname);
-			lxc_container_put(snap);
-			bdev_put(bdev);
-			return false;
+static char **inventory_groups(struct lxc_conf *conf)
+{
+	struct lxc_list *it;
+	char **groups;
+	int i = 0;
+
+	groups = calloc(lxc_list_len(&conf->groups) + 1, sizeof(*groups));
+	if (!groups)
+		return NULL;
+	lxc_list_for_each(it, &conf->groups) {
+		if (!(groups[i++] = strdup(it->elem))) {
+			lxc_free_array((void **)groups, free);
+			return NULL;
 		}
 	}
+	return groups;
+}
 
-	if (strcmp(bdev->type, "dir") != 0 && strcmp(bdev->type, "loop") != 0)
-		flags = LXC_CLONE_SNAPSHOT | LXC_CLONE_MAYBE_SNAPSHOT;
-	rest = lxcapi_clone(snap, newname, c->config_path, flags,
-			bdev->type, NULL, 0, NULL);
-	bdev_put(bdev);
-	if (rest && lxcapi_is_defined(rest))
-		b = true;
-	if (rest)
-		lxc_container_put(rest);
-	lxc_container_put(snap);
-	return b;
+/* without the netns (unprivileged), go through the forking accessors */
+static void inventory_net(struct lxc_container *c, int fields,
+			  struct lxc_inventory *e)
+{
+	int netns;
+
+	netns = container_netns_fd_pid(c, e->init_pid);
+	if (fields & LXC_INVENTORY_IPV4 && (netns < 0 ||
+	    lxc_netns_get_ips(netns, NULL, "inet", 0, &e->ipv4) < 0))
+		e->ipv4 = c->get_ips(c, NULL, "inet", 0);
+	if (fields & LXC_INVENTORY_IPV6 && (netns < 0 ||
+	    lxc_netns_get_ips(netns, NULL, "inet6", 0, &e->ipv6) < 0))
+		e->ipv6 = c->get_ips(c, NULL, "inet6", 0);
+	if (fields & LXC_INVENTORY_INTERFACES && (netns < 0 ||
+	    lxc_netns_get_interfaces(netns, &e->interfaces) < 0))
+		e->interfaces = c->get_interfaces(c);
+	if (netns >= 0)
+		close(netns);
 }
 
-static bool do_snapshot_destroy(const char *snapname, const char *clonelxcpath)
+int lxc_get_inventory(const char *lxcpath, int fields,
+		struct lxc_inventory **inv)
 {
-	struct lxc_container *snap = NULL;
-	bool bret = false;
+	const int net = LXC_INVENTORY_IPV4 | LXC_INVENTORY_IPV6 |
+			LXC_INVENTORY_INTERFACES;
+	struct lxc_inventory *e = NULL;
+	struct lxc_container *c;
+	const char **states = NULL;
+	char **names = NULL;
+	pid_t *pids = NULL;
+	int i, n;
 
-	snap = lxc_container_new(snapname, clonelxcpath);
-	if (!snap) {
-		ERROR("Could not find snapshot %s", snapname);
-		goto err;
-	}
+	if (!inv)
+		return -1;
+	*inv = NULL;
 
-	if (!lxcapi_destroy(snap)) {
-		ERROR("Could not destroy snapshot %s", snapname);
+	n = list_all_containers(lxcpath, &names, NULL);
+	if (n <= 0)
+		return n;
+
+	e = calloc(n, sizeof(*e));
+	states = calloc(n, sizeof(*states));
+	pids = malloc(n * sizeof(*pids));
+	if (!e || !states || !pids)
 		goto err;
-	}
-	bret = true;
 
-err:
-	if (snap)
-		lxc_container_put(snap);
-	return bret;
-}
+	for (i = 0; i < n; i++)
+		pids[i] = -1;
+	if (fields & (LXC_INVENTORY_STATE | LXC_INVENTORY_PID | net))
+		lxc_get_states(lxcpath, (const char **)names, n, states, pids);
 
-static bool remove_all_snapshots(const char *path)
-{
-	DIR *dir;
-	struct dirent dirent, *direntp;
-	bool bret = true;
+	for (i = 0; i < n; i++) {
+		e[i].name = names[i];
+		e[i].state = states[i];
+		e[i].init_pid = pids[i];
+		names[i] = NULL;
 
-	dir = opendir(path);
-	if (!dir) {
-		SYSERROR("opendir on snapshot path %s", path);
-		return false;
-	}
-	while (!readdir_r(dir, &dirent, &direntp)) {
-		if (!direntp)
-			break;
-		if (!strcmp(direntp->d_name, "."))
-			continue;
-		if (!strcmp(direntp->d_name, ".."))
-			continue;
-		if (!do_snapshot_destroy(direntp->d_name, path)) {
-			bret = false;
+		if (!(fields & (LXC_INVENTORY_GROUPS | LXC_INVENTORY_AUTOSTART)) &&
+		    (!(fields & net) || e[i].init_pid <= 0))
 			continue;
-		}
-	}
-
-	closedir(dir);
 
-	if (rmdir(path))
-		SYSERROR("Error removing directory %s", path);
+		c = lxc_container_new(e[i].name, lxcpath);
+		if (!c)
+			continue;
+		if (c->lxc_conf && fields & LXC_INVENTORY_GROUPS)
+			e[i].groups = inventory_groups(c->lxc_conf);
+		if (c->lxc_conf && fields & LXC_INVENTORY_AUTOSTART)
+			e[i].autostart = c->lxc_conf->start_auto == 1;
+		if (fields & net && e[i].init_pid > 0)
+			inventory_net(c, fields, &e[i]);
+		lxc_container_put(c);
+	}
+
+	if (!(fields & LXC_INVENTORY_STATE))
+		for (i = 0; i < n; i++)
+			e[i].state = NULL;
+	if (!(fields & LXC_INVENTORY_PID))
+		for (i = 0; i < n; i++)
+			e[i].init_pid = -1;
+
+	free(names);
+	free(states);
+	free(pids);
+	*inv = e;
+	return n;
 
-	return bret;
+err:
+	for (i = 0; i < n; i++)
+		free(names[i]);
+	free(names);
+	free(e);
+	free(states);
+	free(pids);
+	return -1;
 }
 
-static bool lxcapi_snapshot_destroy(struct lxc_container *c, const char *snapname)
+void lxc_inventory_free(struct lxc_inventory *inv, int n)
 {
-	char clonelxcpath[MAXPATHLEN];
-
-	if (!c || !c->name || !c->config_path || !snapname)
-		return false;
-
-	if (!get_snappath_dir(c, clonelxcpath))
-		return false;
+	int i;
 
-	return do_snapshot_destroy(snapname, clonelxcpath);
+	if (!inv)
+		return;
+	for (i = 0; i < n; i++) {
+		free(inv[i].name);
+		lxc_free_array((void **)inv[i].groups, free);
+		lxc_free_array((void **)inv[i].ipv4, free);
+		lxc_free_array((void **)inv[i].ipv6, free);
+		lxc_free_array((void **)inv[i].interfaces, free);
+	}
+	free(inv);
 }
 
-static bool lxcapi_snapshot_destroy_all(struct lxc_container *c)
+/*
+ * Group operations.  Containers are handled in waves of equal
+ * lxc.start.order, highest first when starting and lowest first when
+ * shutting down, and at most max_parallel of them are in flight at once.
+ */
+#define START_ORDER(c) ((c)->lxc_conf ? (c)->lxc_conf->start_order : 0)
+
+static int cmp_start_order(const void *p1, const void *p2)
 {
-	char clonelxcpath[MAXPATHLEN];
+	struct lxc_container *c1 = *(struct lxc_container **)p1;
+	struct lxc_container *c2 = *(struct lxc_container **)p2;
 
-	if (!c || !c->name || !c->config_path)
-		return false;
+	if (START_ORDER(c1) == START_ORDER(c2))
+		return strcmp(c1->name, c2->name);
+	return START_ORDER(c2) - START_ORDER(c1);
+}
 
-	if (!get_snappath_dir(c, clonelxcpath))
-		return false;
+static struct lxc_container **sort_by_start_order(struct lxc_container **list,
+		int n, bool reverse)
+{
+	struct lxc_container **sorted, *tmp;
+	int i;
 
-	return remove_all_snapshots(clonelxcpath);
+	sorted = malloc(n * sizeof(*sorted));
+	if (!sorted)
+		return NULL;
+	for (i = 0; i < n; i++) {
+		sorted[i] = list[i];
+		lazy_load_config(list[i]);
+	}
+	qsort(sorted, n, sizeof(*sorted), cmp_start_order);
+	if (reverse) {
+		for (i = 0; i < n / 2; i++) {
+			tmp = sorted[i];
+			sorted[i] = sorted[n - 1 - i];
+			sorted[n - 1 - i] = tmp;
+		}
+	}
+	return sorted;
 }
 
-static bool lxcapi_may_control(struct lxc_container *c)
+/* number of containers from list[0] on which share its lxc.start.order */
+static int start_order_wave(struct lxc_container **list, int n)
 {
-	return lxc_try_cmd(c->name, c->config_path) == 0;
+	int i;
+
+	for (i = 1; i < n; i++)
+		if (START_ORDER(list[i]) != START_ORDER(list[0]))
+			break;
+	return i;
 }
 
-static bool do_add_remove_node(pid_t init_pid, const char *path, bool add,
-		struct stat *st)
+/* send the halt signal to all of list, then wait for all of them at once */
+static int shutdown_some(struct lxc_container **list, int n, int timeout)
 {
-	char chrootpath[MAXPATHLEN];
-	char *directory_path = NULL;
+	const char **names;
+	bool *waiting;
+	int *reached;
+	struct timespec deadline;
+	int i, j, nnames, nwaiting = 0, done = 0, ret;
 	pid_t pid;
-	int ret;
 
-	if ((pid = fork()) < 0) {
-		SYSERROR("failed to fork a child helper");
-		return false;
-	}
-	if (pid) {
-		if (wait_for_pid(pid) != 0) {
-			ERROR("Failed to create note in guest");
-			return false;
+	names = malloc(n * sizeof(*names));
+	waiting = malloc(n * sizeof(*waiting));
+	reached = malloc(n * sizeof(*reached));
+	if (!names || !waiting || !reached)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		struct lxc_container *c = list[i];
+		int haltsignal = SIGPWR;
+
+		waiting[i] = false;
+		if (!c->is_running(c) || (pid = c->init_pid(c)) <= 0) {
+			done++;
+			continue;
 		}
-		return true;
+		if (c->lxc_conf && c->lxc_conf->haltsignal)
+			haltsignal = c->lxc_conf->haltsignal;
+		if (kill(pid, haltsignal)) {
+			SYSERROR("failed to send halt signal to %s", c->name);
+			continue;
+		}
+		waiting[i] = true;
+		nwaiting++;
 	}
 
-	/* prepare the path */
-	ret = snprintf(chrootpath, MAXPATHLEN, "/proc/%d/root", init_pid);
-	if (ret < 0 || ret >= MAXPATHLEN)
-		return false;
+	if (timeout >= 0 && clock_gettime(CLOCK_MONOTONIC, &deadline) == 0)
+		deadline.tv_sec += timeout;
 
-	if (chroot(chrootpath) < 0)
-		exit(1);
-	if (chdir("/") < 0)
-		exit(1);
-	/* remove path if it exists */
-	if(faccessat(AT_FDCWD, path, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
-		if (unlink(path) < 0) {
-			ERROR("unlink failed");
-			exit(1);
+	/* one lxc_wait_many() per lxcpath */
+	while (nwaiting > 0) {
+		const char *lxcpath = NULL;
+
+		for (i = 0, nnames = 0; i < n; i++) {
+			if (!waiting[i])
+				continue;
+			if (!lxcpath)
+				lxcpath = list[i]->config_path;
+			if (strcmp(list[i]->config_path, lxcpath) == 0) {
+				names[nnames++] = list[i]->name;
+				waiting[i] = false;
+				nwaiting--;
+			}
 		}
-	}
-	if (!add)
-		exit(0);
 
-	/* create any missing directories */
-	directory_path = dirname(strdup(path));
-	if (mkdir_p(directory_path, 0755) < 0 && errno != EEXIST) {
-		ERROR("failed to create directory");
-		exit(1);
+		ret = lxc_wait_many(lxcpath, names, nnames, "STOPPED",
+				    timeout < 0 ? -1 : lxc_wait_time_left(&deadline),
+				    reached);
+		if (ret > 0)
+			done += ret;
+		for (j = 0; ret != nnames && j < nnames; j++)
+			if (ret < 0 || reached[j] != 1)
+				ERROR("%s did not shut down in time", names[j]);
 	}
 
-	/* create the device node */
-	if (mknod(path, st->st_mode, st->st_rdev) < 0) {
-		ERROR("mknod failed");
-		exit(1);
+out:
+	free(names);
+	free(waiting);
+	free(reached);
+	return done;
+}
+
+int lxc_containers_shutdown(struct lxc_container **list, int n, int timeout,
+		int max_parallel)
+{
+	struct lxc_container **sorted;
+	int i, j, wave, step, done = 0;
+
+	if (!list || n < 0)
+		return -1;
+	if (n == 0)
+		return 0;
+
+	sorted = sort_by_start_order(list, n, true);
+	if (!sorted)
+		return -1;
+
+	for (i = 0; i < n; i += wave) {
+		wave = start_order_wave(sorted + i, n - i);
+		step = max_parallel > 0 ? max_parallel : wave;
+		for (j = 0; j < wave; j += step)
+			done += shutdown_some(sorted + i + j,
+					      wave - j < step ? wave - j : step,
+					      timeout);
 	}
 
-	exit(0);
+	free(sorted);
+	return done;
 }
 
-static bool add_remove_device_node(struct lxc_container *c, const char *src_path, const char *dest_path, bool add)
+/* a container running the program of lxc_containers_attach_run_wait() */
+struct attach_run {
+	int idx;
+	pid_t pid;
+	int fd; /* read end of its output, -1 once at eof */
+	char *buf;
+	size_t len, size;
+};
+
+static int attach_run_start(struct lxc_container *c, struct attach_run *run,
+		lxc_attach_options_t *options, lxc_attach_command_t *command,
+		bool capture)
 {
+	lxc_attach_options_t opts = LXC_ATTACH_OPTIONS_DEFAULT;
+	int pipefd[2] = { -1, -1 };
 	int ret;
-	struct stat st;
-	char value[MAX_BUFFER];
-	const char *p;
-
-	/* make sure container is running */
-	if (!c->is_running(c)) {
-		ERROR("container is not running");
-		return false;
-	}
 
-	/* use src_path if dest_path is NULL otherwise use dest_path */
-	p = dest_path ? dest_path : src_path;
+	if (options)
+		opts = *options;
+	run->fd = -1;
+	run->buf = NULL;
+	run->len = run->size = 0;
 
-	/* make sure we can access p */
-	if(access(p, F_OK) < 0 || stat(p, &st) < 0)
-		return false;
+	if (capture) {
+		if (pipe2(pipefd, O_CLOEXEC) < 0) {
+			SYSERROR("failed to create a pipe for %s", c->name);
+			return -1;
+		}
+		opts.stdout_fd = opts.stderr_fd = pipefd[1];
+	}
 
-	/* continue if path is character device or block device */
-	if (S_ISCHR(st.st_mode))
-		ret = snprintf(value, MAX_BUFFER, "c %d:%d rwm", major(st.st_rdev), minor(st.st_rdev));
-	else if (S_ISBLK(st.st_mode))
-		ret = snprintf(value, MAX_BUFFER, "b %d:%d rwm", major(st.st_rdev), minor(st.st_rdev));
-	else
-		return false;
+	ret = container_attach(c, lxc_attach_run_command, command, &opts,
+			       &run->pid);
+	if (capture) {
+		close(pipefd[1]);
+		if (ret < 0)
+			close(pipefd[0]);
+		else
+			run->fd = pipefd[0];
+	}
+	if (ret < 0)
+		ERROR("failed to attach to %s", c->name);
+	return ret;
+}
 
-	/* check snprintf return code */
-	if (ret < 0 || ret >= MAX_BUFFER)
-		return false;
+/* read what is there of the output of @run, returns false at eof */
+static bool attach_run_read(struct attach_run *run)
+{
+	ssize_t ret;
 
-	if (!do_add_remove_node(c->init_pid(c), p, add, &st))
-		return false;
+	if (run->size - run->len < 4096) {
+		size_t size = run->size ? 2 * run->size : 8192;
+		char *buf = realloc(run->buf, size);
 
-	/* add or remove device to/from cgroup access list */
-	if (add) {
-		if (!c->set_cgroup_item(c, "devices.allow", value)) {
-			ERROR("set_cgroup_item failed while adding the device node");
+		if (!buf)
 			return false;
-		}
-	} else {
-		if (!c->set_cgroup_item(c, "devices.deny", value)) {
-			ERROR("set_cgroup_item failed while removing the device node");
-			return false;
-		}
+		run->buf = buf;
+		run->size = size;
 	}
 
+	ret = lxc_read_nointr(run->fd, run->buf + run->len,
+			      run->size - run->len - 1);
+	if (ret <= 0)
+		return false;
+	run->len += ret;
 	return true;
 }
 
-static bool lxcapi_add_device_node(struct lxc_container *c, const char *src_path, const char *dest_path)
+static void attach_run_finish(struct attach_run *run, int *statuses,
+		char **outputs)
 {
-	if (am_unpriv()) {
-		ERROR(NOT_SUPPORTED_ERROR, __FUNCTION__);
-		return false;
+	if (run->fd >= 0)
+		close(run->fd);
+	statuses[run->idx] = lxc_wait_for_pid_status(run->pid);
+	if (outputs) {
+		if (run->buf)
+			run->buf[run->len] = '\0';
+		outputs[run->idx] = run->buf ? run->buf : strdup("");
 	}
-	return add_remove_device_node(c, src_path, dest_path, true);
 }
 
-static bool lxcapi_remove_device_node(struct lxc_container *c, const char *src_path, const char *dest_path)
+int lxc_containers_attach_run_wait(struct lxc_container **list, int n,
+		lxc_attach_options_t *options, const char *program,
+		const char * const argv[], int max_parallel, int *statuses,
+		char **outputs)
 {
-	if (am_unpriv()) {
-		ERROR(NOT_SUPPORTED_ERROR, __FUNCTION__);
-		return false;
+	lxc_attach_command_t command;
+	struct attach_run *runs;
+	struct pollfd *pfds;
+	int i, next = 0, nrunning = 0, done = 0;
+
+	if (!list || n < 0 || !program || !argv || !statuses)
+		return -1;
+	if (max_parallel <= 0 || max_parallel > n)
+		max_parallel = n;
+	if (n == 0)
+		return 0;
+
+	runs = malloc(max_parallel * sizeof(*runs));
+	pfds = malloc(max_parallel * sizeof(*pfds));
+	if (!runs || !pfds) {
+		free(runs);
+		free(pfds);
+		return -1;
 	}
-	return add_remove_device_node(c, src_path, dest_path, false);
+
+	for (i = 0; i < n; i++) {
+		statuses[i] = -1;
+		if (outputs)
+			outputs[i] = NULL;
+	}
+
+	command.program = (char *)program;
+	command.argv = (char **)argv;
+
+	for (;;) {
+		/* keep max_parallel of them running */
+		while (nrunning < max_parallel && next < n) {
+			struct attach_run *run = &runs[nrunning];
+
+			run->idx = next++;
+			if (!list[run->idx] ||
+			    attach_run_start(list[run->idx], run, options,
+					     &command, outputs != NULL) < 0)
+				continue;
+			nrunning++;
+		}
+		if (!nrunning)
+			break;
+
+		/*
+		 * without outputs to read, wait for the oldest one; else read
+		 * them all until one reaches eof, and wait for that one
+		 */
+		i = 0;
+		if (outputs) {
+			for (i = 0; i < nrunning; i++) {
+				pfds[i].fd = runs[i].fd;
+				pfds[i].events = POLLIN;
+			}
+			if (poll(pfds, nrunning, -1) < 0) {
+				if (errno == EINTR)
+					continue;
+				SYSERROR("failed to wait for the outputs");
+				i = 0;
+			} else {
+				for (i = 0; i < nrunning; i++)
+					if (pfds[i].revents &&
+					    !attach_run_read(&runs[i]))
+						break;
+				if (i == nrunning)
+					continue;
+			}
+		}
+
+		attach_run_finish(&runs[i], statuses, outputs);
+		if (statuses[runs[i].idx] >= 0)
+			done++;
+		runs[i] = runs[--nrunning];
+	}
+
+	free(runs);
+	free(pfds);
+	return done;
 }
 
-static int lxcapi_attach_run_waitl(struct lxc_container *c, lxc_attach_options_t *options, const char *program, const char *arg, ...)
+static int freeze_thaw_list(struct lxc_container **list, int n, bool freeze)
 {
-	va_list ap;
-	const char **argv;
-	int ret;
+	const char **names, **lxcpaths;
+	int i, done;
 
-	if (!c)
+	if (!list || n < 0)
 		return -1;
+	if (n == 0)
+		return 0;
 
-	va_start(ap, arg);
-	argv = lxc_va_arg_list_to_argv_const(ap, 1);
-	va_end(ap);
-
-	if (!argv) {
-		ERROR("Memory allocation error.");
+	names = malloc(n * sizeof(*names));
+	lxcpaths = malloc(n * sizeof(*lxcpaths));
+	if (!names || !lxcpaths) {
+		free(names);
+		free(lxcpaths);
 		return -1;
 	}
-	argv[0] = arg;
+	for (i = 0; i < n; i++) {
+		names[i] = list[i]->name;
+		lxcpaths[i] = list[i]->config_path;
+	}
 
-	ret = lxcapi_attach_run_wait(c, options, program, (const char * const *)argv);
-	free((void*)argv);
-	return ret;
+	if (freeze)
+		done = lxc_freeze_many(names, lxcpaths, n);
+	else
+		done = lxc_unfreeze_many(names, lxcpaths, n);
+
+	free(names);
+	free(lxcpaths);
+	return done;
 }
 
-struct lxc_container *lxc_container_new(const char *name, const char *configpath)
+int lxc_containers_freeze(struct lxc_container **list, int n)
 {
-	struct lxc_container *c;
+	return freeze_thaw_list(list, n, true);
+}
 
-	if (!name)
-		return NULL;
+int lxc_containers_unfreeze(struct lxc_container **list, int n)
+{
+	return freeze_thaw_list(list, n, false);
+}
 
-	c = malloc(sizeof(*c));
-	if (!c) {
-		fprintf(stderr, "failed to malloc lxc_container\n");
-		return NULL;
-	}
-	memset(c, 0, sizeof(*c));
+/* pidfd_open() (Linux 5.3), which the C library may not wrap yet */
+#if !defined(__NR_pidfd_open) && !defined(__alpha__)
+#define __NR_pidfd_open 434
+#endif
 
-	if (configpath)
-		c->config_path = strdup(configpath);
-	else
-		c->config_path = strdup(lxc_global_config_value("lxc.lxcpath"));
+static int open_pidfd(pid_t pid)
+{
+#ifdef __NR_pidfd_open
+	return syscall(__NR_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
 
-	if (!c->config_path) {
-		fprintf(stderr, "Out of memory\n");
-		goto err;
-	}
+/*
+ * Run @fn on each container of @list in a child process, at most
+ * @max_parallel (0 for no limit) at once.  The children are watched
+ * through pidfds, so a new one is started as soon as any finishes rather
+ * than when the oldest does; without pidfds they are waited for in order.
+ * @ok[i] tells whether @fn succeeded for list[i], and @done_at[i], if not
+ * NULL, when it returned.  Returns the number of successes.
+ */
+static int run_in_children(struct lxc_container **list, int n, int max_parallel,
+		bool (*fn)(struct lxc_container *), bool *ok,
+		struct timespec *done_at)
+{
+	struct pollfd *pfds;
+	pid_t *pids;
+	int *pidfds, *idx;
+	int i, np, next = 0, running = 0, succeeded = 0, oldest = 0;
+	bool in_order = false;
+
+	for (i = 0; i < n; i++)
+		ok[i] = false;
+
+	pids = malloc(n * sizeof(*pids));
+	pidfds = malloc(n * sizeof(*pidfds));
+	pfds = malloc(n * sizeof(*pfds));
+	idx = malloc(n * sizeof(*idx));
+	if (!pids || !pidfds || !pfds || !idx)
+		goto out;
 
-	remove_trailing_slashes(c->config_path);
-	c->name = malloc(strlen(name)+1);
-	if (!c->name) {
-		fprintf(stderr, "Error allocating lxc_container name\n");
-		goto err;
-	}
-	strcpy(c->name, name);
+	for (i = 0; i < n; i++) {
+		pids[i] = 0;
+		pidfds[i] = -1;
+	}
+
+	while (next < n || running > 0) {
+		while (next < n && (max_parallel <= 0 || running < max_parallel)) {
+			pids[next] = fork();
+			if (pids[next] < 0) {
+				SYSERROR("failed to fork for %s", list[next]->name);
+				pids[next] = 0;
+			} else if (pids[next] == 0) {
+				_exit(fn(list[next]) ? 0 : 1);
+			} else {
+				pidfds[next] = open_pidfd(pids[next]);
+				if (pidfds[next] < 0)
+					in_order = true;
+				running++;
+			}
+			next++;
+		}
+		if (!running)
+			break;
 
-	c->numthreads = 1;
-	if (!(c->slock = lxc_newlock(c->config_path, name))) {
-		fprintf(stderr, "failed to create lock\n");
-		goto err;
-	}
+		if (in_order) {
+			while (pids[oldest] <= 0)
+				oldest++;
+			idx[0] = oldest;
+			np = 1;
+		} else {
+			for (i = 0, np = 0; i < next; i++) {
+				if (pids[i] <= 0)
+					continue;
+				pfds[np].fd = pidfds[i];
+				pfds[np].events = POLLIN;
+				idx[np++] = i;
+			}
+			if (poll(pfds, np, -1) < 0) {
+				if (errno == EINTR)
+					continue;
+				in_order = true;
+				continue;
+			}
+		}
 
-	if (!(c->privlock = lxc_newlock(NULL, NULL))) {
-		fprintf(stderr, "failed to alloc privlock\n");
-		goto err;
-	}
+		for (i = 0; i < np; i++) {
+			int j = idx[i];
 
-	if (!set_config_filename(c)) {
-		fprintf(stderr, "Error allocating config file pathname\n");
-		goto err;
+			if (!in_order && !pfds[i].revents)
+				continue;
+			ok[j] = wait_for_pid(pids[j]) == 0;
+			if (done_at)
+				clock_gettime(CLOCK_MONOTONIC, &done_at[j]);
+			if (pidfds[j] >= 0)
+				close(pidfds[j]);
+			pids[j] = 0;
+			running--;
+		}
 	}
 
-	if (file_exists(c->configfile) && !lxcapi_load_config(c, NULL))
-		goto err;
+	for (i = 0; i < n; i++)
+		if (ok[i])
+			succeeded++;
 
-	if (ongoing_create(c) == 2) {
-		ERROR("Error: %s creation was not completed", c->name);
-		container_destroy(c);
-		lxcapi_clear_config(c);
-	}
-	c->daemonize = true;
-	c->pidfile = NULL;
+out:
+	free(pids);
+	free(pidfds);
+	free(pfds);
+	free(idx);
+	return succeeded;
+}
 
-	// assign the member functions
-	c->is_defined = lxcapi_is_defined;
-	c->state = lxcapi_state;
-	c->is_running = lxcapi_is_running;
-	c->freeze = lxcapi_freeze;
-	c->unfreeze = lxcapi_unfreeze;
-	c->console = lxcapi_console;
-	c->console_getfd = lxcapi_console_getfd;
-	c->init_pid = lxcapi_init_pid;
-	c->load_config = lxcapi_load_config;
-	c->want_daemonize = lxcapi_want_daemonize;
-	c->want_close_all_fds = lxcapi_want_close_all_fds;
-	c->start = lxcapi_start;
-	c->startl = lxcapi_startl;
-	c->stop = lxcapi_stop;
-	c->config_file_name = lxcapi_config_file_name;
-	c->wait = lxcapi_wait;
-	c->set_config_item = lxcapi_set_config_item;
-	c->destroy = lxcapi_destroy;
-	c->destroy_with_snapshots = lxcapi_destroy_with_snapshots;
-	c->rename = lxcapi_rename;
-	c->save_config = lxcapi_save_config;
-	c->get_keys = lxcapi_get_keys;
-	c->create = lxcapi_create;
-	c->createl = lxcapi_createl;
-	c->shutdown = lxcapi_shutdown;
-	c->reboot = lxcapi_reboot;
-	c->clear_config = lxcapi_clear_config;
-	c->clear_config_item = lxcapi_clear_config_item;
-	c->get_config_item = lxcapi_get_config_item;
-	c->get_running_config_item = lxcapi_get_running_config_item;
-	c->get_cgroup_item = lxcapi_get_cgroup_item;
-	c->set_cgroup_item = lxcapi_set_cgroup_item;
-	c->get_config_path = lxcapi_get_config_path;
-	c->set_config_path = lxcapi_set_config_path;
-	c->clone = lxcapi_clone;
-	c->get_interfaces = lxcapi_get_interfaces;
-	c->get_ips = lxcapi_get_ips;
-	c->attach = lxcapi_attach;
-	c->attach_run_wait = lxcapi_attach_run_wait;
-	c->attach_run_waitl = lxcapi_attach_run_waitl;
-	c->snapshot = lxcapi_snapshot;
-	c->snapshot_list = lxcapi_snapshot_list;
-	c->snapshot_restore = lxcapi_snapshot_restore;
-	c->snapshot_destroy = lxcapi_snapshot_destroy;
-	c->snapshot_destroy_all = lxcapi_snapshot_destroy_all;
-	c->may_control = lxcapi_may_control;
-	c->add_device_node = lxcapi_add_device_node;
-	c->remove_device_node = lxcapi_remove_device_node;
+static bool start_one(struct lxc_container *c)
+{
+	c->want_daemonize(c, true);
+	if (!c->start(c, 0, NULL))
+		return false;
+	/* with lxc.start.notify, lxc.start.delay bounds the wait for READY */
+	if (c->lxc_conf && c->lxc_conf->start_notify &&
+	    c->lxc_conf->start_delay > 0)
+		c->wait(c, "READY", c->lxc_conf->start_delay);
+	return true;
+}
+
+static bool stop_one(struct lxc_container *c)
+{
+	return c->stop(c);
+}
+
+/*
+ * Start one wave.  Each container counts as up once its start returned,
+ * which is once it is RUNNING, plus its own lxc.start.delay, or once it
+ * is READY if it uses lxc.start.notify (see start_one()); the wave is
+ * done when all of its containers are, so delays overlap slower starts
+ * instead of adding up after them.
+ */
+static int start_some(struct lxc_container **list, int n, int max_parallel)
+{
+	struct lxc_container **todo;
+	struct timespec *done_at, ready = { 0, 0 }, t;
+	bool *ok;
+	int i, ntodo = 0, started = 0, ms;
+
+	todo = malloc(n * sizeof(*todo));
+	done_at = malloc(n * sizeof(*done_at));
+	ok = malloc(n * sizeof(*ok));
+	if (!todo || !done_at || !ok)
+		goto out;
 
-	/* we'll allow the caller to update these later */
-	if (lxc_log_init(NULL, "none", NULL, "lxc_container", 0, c->config_path)) {
-		fprintf(stderr, "failed to open log\n");
-		goto err;
+	for (i = 0; i < n; i++) {
+		if (list[i]->is_running(list[i]))
+			started++;
+		else
+			todo[ntodo++] = list[i];
 	}
+	if (!ntodo)
+		goto out;
 
-	return c;
+	started += run_in_children(todo, ntodo, max_parallel, start_one, ok,
+				   done_at);
 
-err:
-	lxc_container_free(c);
-	return NULL;
+	for (i = 0; i < ntodo; i++) {
+		if (!ok[i]) {
+			ERROR("Error starting container %s", todo[i]->name);
+			continue;
+		}
+		t = done_at[i];
+		if (todo[i]->lxc_conf && !todo[i]->lxc_conf->start_notify)
+			t.tv_sec += todo[i]->lxc_conf->start_delay;
+		if (t.tv_sec > ready.tv_sec ||
+		    (t.tv_sec == ready.tv_sec && t.tv_nsec > ready.tv_nsec))
+			ready = t;
+	}
+
+	/* lxc.start.delay is observed between waves */
+	ms = lxc_wait_time_left(&ready);
+	if (ms > 0)
+		usleep(ms * 1000);
+
+out:
+	free(todo);
+	free(done_at);
+	free(ok);
+	return started;
 }
 
-int lxc_get_wait_states(const char **states)
+int lxc_containers_start(struct lxc_container **list, int n, int max_parallel)
 {
-	int i;
+	struct lxc_container **sorted;
+	int i, wave, started = 0;
 
-	if (states)
-		for (i=0; i<MAX_STATE; i++)
-			states[i] = lxc_state2str(i);
-	return MAX_STATE;
+	if (!list || n < 0)
+		return -1;
+	if (n == 0)
+		return 0;
+
+	sorted = sort_by_start_order(list, n, false);
+	if (!sorted)
+		return -1;
+
+	for (i = 0; i < n; i += wave) {
+		wave = start_order_wave(sorted + i, n - i);
+		started += start_some(sorted + i, wave, max_parallel);
+	}
+
+	free(sorted);
+	return started;
+}
+
+int lxc_containers_stop(struct lxc_container **list, int n, int max_parallel)
+{
+	struct lxc_container **sorted, **todo = NULL;
+	bool *ok = NULL;
+	int i, j, wave, ntodo, stopped = 0;
+
+	if (!list || n < 0)
+		return -1;
+	if (n == 0)
+		return 0;
+
+	sorted = sort_by_start_order(list, n, true);
+	todo = malloc(n * sizeof(*todo));
+	ok = malloc(n * sizeof(*ok));
+	if (!sorted || !todo || !ok) {
+		stopped = -1;
+		goto out;
+	}
+
+	for (i = 0; i < n; i += wave) {
+		wave = start_order_wave(sorted + i, n - i);
+		for (j = 0, ntodo = 0; j < wave; j++) {
+			if (sorted[i + j]->is_running(sorted[i + j]))
+				todo[ntodo++] = sorted[i + j];
+			else
+				stopped++;
+		}
+		if (!ntodo)
+			continue;
+		stopped += run_in_children(todo, ntodo, max_parallel, stop_one,
+					   ok, NULL);
+		for (j = 0; j < ntodo; j++)
+			if (!ok[j])
+				ERROR("Error killing container %s", todo[j]->name);
+	}
+
+out:
+	free(sorted);
+	free(todo);
+	free(ok);
+	return stopped;
+}
+
+static bool name_list_append(char ***list, size_t *cnt, size_t *cap,
+		const char *name)
+{
+	char *n;
+
+	if (lxc_grow_array((void ***)list, cap, *cnt + 1, 32) < 0)
+		return false;
+	n = strdup(name);
+	if (!n)
+		return false;
+	(*list)[(*cnt)++] = n;
+	return true;
 }
 
 /*
- * These next two could probably be done smarter with reusing a common function
- * with different iterators and tests...
+ * Collect the names of the containers which have a config under lxcpath.
+ * The result is sorted.
  */
-int list_defined_containers(const char *lxcpath, char ***names, struct lxc_container ***cret)
+static int defined_container_names(const char *lxcpath, char ***names)
 {
 	DIR *dir;
-	int i, cfound = 0, nfound = 0;
-	struct dirent dirent, *direntp;
-	struct lxc_container *c;
-
-	if (!lxcpath)
-		lxcpath = lxc_global_config_value("lxc.lxcpath");
+	struct dirent *direntp;
+	size_t cnt = 0, cap = 0;
 
+	*names = NULL;
 	dir = opendir(lxcpath);
 	if (!dir) {
 		SYSERROR("opendir on lxcpath");
 		return -1;
 	}
 
-	if (cret)
-		*cret = NULL;
-	if (names)
-		*names = NULL;
-
-	while (!readdir_r(dir, &dirent, &direntp)) {
-		if (!direntp)
-			break;
+	while ((direntp = readdir(dir))) {
 		if (!strcmp(direntp->d_name, "."))
 			continue;
 		if (!strcmp(direntp->d_name, ".."))
 			continue;
 
+		if (!strcmp(direntp->d_name, TRASH_DIR) ||
+				!strcmp(direntp->d_name, CACHE_DIR))
+			continue;
+
 		if (!config_file_exists(lxcpath, direntp->d_name))
 			continue;
 
-		if (names) {
-			if (!add_to_array(names, direntp->d_name, cfound))
-				goto free_bad;
+		if (!name_list_append(names, &cnt, &cap, direntp->d_name)) {
+			closedir(dir);
+			lxc_free_array((void **)*names, free);
+			*names = NULL;
+			return -1;
 		}
-		cfound++;
+	}
+	closedir(dir);
 
-		if (!cret) {
-			nfound++;
-			continue;
-		}
+	if (cnt)
+		qsort(*names, cnt, sizeof(char *),
+				(int (*)(const void *,const void *))string_cmp);
+	return cnt;
+}
+
+int list_defined_containers_flags(const char *lxcpath, char ***names,
+		struct lxc_container ***cret, int flags)
+{
+	struct lxc_container *c;
+	char **defined;
+	int i, ndefined, nfound = 0;
+
+	if (!lxcpath)
+		lxcpath = lxc_global_config_value("lxc.lxcpath");
+
+	if (cret)
+		*cret = NULL;
+	if (names)
+		*names = NULL;
+
+	ndefined = defined_container_names(lxcpath, &defined);
+	if (ndefined < 0)
+		return -1;
+
+	if (!cret) {
+		if (names)
+			*names = defined;
+		else
+			lxc_free_array((void **)defined, free);
+		return ndefined;
+	}
+
+	*cret = malloc((ndefined + 1) * sizeof(struct lxc_container *));
+	if (!*cret) {
+		ERROR("Out of memory");
+		lxc_free_array((void **)defined, free);
+		return -1;
+	}
+
+	/* the configs are read in parallel, into the slots of *cret */
+	if (!(flags & LXC_LIST_LAZY) &&
+	    lxc_container_new_many((const char **)defined, ndefined,
+				   lxcpath, *cret, 0) < 0) {
+		free(*cret);
+		*cret = NULL;
+		lxc_free_array((void **)defined, free);
+		return -1;
+	}
 
-		c = lxc_container_new(direntp->d_name, lxcpath);
+	for (i = 0; i < ndefined; i++) {
+		char *name = defined[i];
+
+		if (flags & LXC_LIST_LAZY)
+			c = container_new(name, lxcpath, true);
+		else
+			c = (*cret)[i];
 		if (!c) {
 			INFO("Container %s:%s has a config but could not be loaded",
-				lxcpath, direntp->d_name);
-			if (names)
-				if(!remove_from_array(names, direntp->d_name, cfound--))
-					goto free_bad;
+				lxcpath, name);
+			free(name);
 			continue;
 		}
-		if (!lxcapi_is_defined(c)) {
+		if (!(flags & LXC_LIST_LAZY) && !lxcapi_is_defined(c)) {
 			INFO("Container %s:%s has a config but is not defined",
-				lxcpath, direntp->d_name);
-			if (names)
-				if(!remove_from_array(names, direntp->d_name, cfound--))
-					goto free_bad;
+				lxcpath, name);
+			free(name);
 			lxc_container_put(c);
 			continue;
 		}
 
-		if (!add_to_clist(cret, c, nfound, true)) {
-			lxc_container_put(c);
-			goto free_bad;
-		}
-		nfound++;
+		/* defined is sorted, and so stays (*cret) */
+		(*cret)[nfound] = c;
+		defined[nfound++] = name;
+	}
+	(*cret)[nfound] = NULL;
+	if (!nfound) {
+		free(*cret);
+		*cret = NULL;
 	}
+	if (defined)
+		defined[nfound] = NULL;
 
-	closedir(dir);
+	if (names)
+		*names = defined;
+	else
+		lxc_free_array((void **)defined, free);
 	return nfound;
+}
 
-free_bad:
-	if (names && *names) {
-		for (i=0; i<cfound; i++)
-			free((*names)[i]);
-		free(*names);
-	}
-	if (cret && *cret) {
-		for (i=0; i<nfound; i++)
-			lxc_container_put((*cret)[i]);
-		free(*cret);
-	}
-	closedir(dir);
-	return -1;
+int list_defined_containers(const char *lxcpath, char ***names, struct lxc_container ***cret)
+{
+	return list_defined_containers_flags(lxcpath, names, cret, 0);
 }
 
-int list_active_containers(const char *lxcpath, char ***nret,
-			   struct lxc_container ***cret)
+/*
+ * Collect the names of the containers under lxcpath which have a command
+ * socket listening.  The result is sorted.
+ *
+ * The running registry (see state.c) is used when there is one and all its
+ * monitors unregistered properly.  Otherwise the abstract sockets of
+ * /proc/net/unix are scanned, which also shows containers started by a
+ * former version, but only those of our network namespace.
+ */
+static int active_container_names(const char *lxcpath, char ***names)
 {
-	int i, ret = -1, cret_cnt = 0, ct_name_cnt = 0;
-	int lxcpath_len;
+	int lxcpath_len, ret;
 	char *line = NULL;
-	char **ct_name = NULL;
-	size_t len = 0;
-	struct lxc_container *c;
+	size_t i, j, len = 0, cnt = 0, cap = 0;
+	bool stale;
+	FILE *f;
 
-	if (!lxcpath)
-		lxcpath = lxc_global_config_value("lxc.lxcpath");
-	lxcpath_len = strlen(lxcpath);
+	ret = lxc_running_list(lxcpath, names, &stale);
+	if (ret >= 0 && !stale) {
+		if (ret)
+			qsort(*names, ret, sizeof(char *),
+					(int (*)(const void *,const void *))string_cmp);
+		return ret;
+	}
+	if (ret >= 0)
+		lxc_free_array((void **)*names, free);
+	*names = NULL;
+	ret = 0;
 
-	if (cret)
-		*cret = NULL;
-	if (nret)
-		*nret = NULL;
+	lxcpath_len = strlen(lxcpath);
 
-	FILE *f = fopen("/proc/net/unix", "r");
+	f = fopen("/proc/net/unix", "re");
 	if (!f)
 		return -1;
 
@@ -3743,22 +7713,75 @@ int list_active_containers(const char *lxcpath, char ***nret,
 			continue;
 		*p2 = '\0';
 
-		if (array_contains(&ct_name, p, ct_name_cnt))
-			continue;
+		if (!name_list_append(names, &cnt, &cap, p)) {
+			ret = -1;
+			break;
+		}
+	}
 
-		if (!add_to_array(&ct_name, p, ct_name_cnt))
-			goto free_cret_list;
+	free(line);
+	fclose(f);
 
-		ct_name_cnt++;
+	if (ret < 0) {
+		lxc_free_array((void **)*names, free);
+		*names = NULL;
+		return -1;
+	}
+	if (!cnt)
+		return 0;
 
-		if (!cret)
+	qsort(*names, cnt, sizeof(char *),
+			(int (*)(const void *,const void *))string_cmp);
+	for (i = 1, j = 1; i < cnt; i++) {
+		if (strcmp((*names)[i], (*names)[j-1]) == 0) {
+			free((*names)[i]);
 			continue;
+		}
+		(*names)[j++] = (*names)[i];
+	}
+	(*names)[j] = NULL;
+	return j;
+}
+
+int list_active_containers(const char *lxcpath, char ***nret,
+			   struct lxc_container ***cret)
+{
+	int i, cnt, found = 0;
+	char **ct_name;
+	struct lxc_container *c;
+
+	if (!lxcpath)
+		lxcpath = lxc_global_config_value("lxc.lxcpath");
+
+	if (cret)
+		*cret = NULL;
+	if (nret)
+		*nret = NULL;
+
+	cnt = active_container_names(lxcpath, &ct_name);
+	if (cnt < 0)
+		return -1;
+
+	if (!cret) {
+		if (nret)
+			*nret = ct_name;
+		else
+			lxc_free_array((void **)ct_name, free);
+		return cnt;
+	}
 
-		c = lxc_container_new(p, lxcpath);
+	if (cnt && !(*cret = malloc((cnt + 1) * sizeof(struct lxc_container *)))) {
+		ERROR("Out of memory");
+		lxc_free_array((void **)ct_name, free);
+		return -1;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		c = lxc_container_new(ct_name[i], lxcpath);
 		if (!c) {
 			INFO("Container %s:%s is running but could not be loaded",
-				lxcpath, p);
-			remove_from_array(&ct_name, p, ct_name_cnt--);
+				lxcpath, ct_name[i]);
+			free(ct_name[i]);
 			continue;
 		}
 
@@ -3767,125 +7790,173 @@ int list_active_containers(const char *lxcpath, char ***nret,
 		 * return false.  So we don't do that check.  Count on the
 		 * fact that the command socket exists.
 		 */
-
-		if (!add_to_clist(cret, c, cret_cnt, true)) {
-			lxc_container_put(c);
-			goto free_cret_list;
-		}
-		cret_cnt++;
+		(*cret)[found] = c;
+		ct_name[found++] = ct_name[i];
+	}
+	if (cnt) {
+		(*cret)[found] = NULL;
+		ct_name[found] = NULL;
 	}
 
-	assert(!nret || !cret || cret_cnt == ct_name_cnt);
-	ret = ct_name_cnt;
 	if (nret)
 		*nret = ct_name;
 	else
-		goto free_ct_name;
-	goto out;
+		lxc_free_array((void **)ct_name, free);
+	return found;
+}
 
-free_cret_list:
-	if (cret && *cret) {
-		for (i = 0; i < cret_cnt; i++)
-			lxc_container_put((*cret)[i]);
-		free(*cret);
-	}
+struct lxc_container_iter {
+	char *lxcpath;
+	char **defined;
+	char **active;
+	size_t d, a;
+};
 
-free_ct_name:
-	if (ct_name) {
-		for (i = 0; i < ct_name_cnt; i++)
-			free(ct_name[i]);
-		free(ct_name);
+struct lxc_container_iter *lxc_container_iter_new(const char *lxcpath, int flags)
+{
+	struct lxc_container_iter *it;
+
+	if (!(flags & (LXC_LIST_DEFINED | LXC_LIST_ACTIVE)))
+		flags |= LXC_LIST_DEFINED | LXC_LIST_ACTIVE;
+	if (!lxcpath)
+		lxcpath = lxc_global_config_value("lxc.lxcpath");
+
+	it = malloc(sizeof(*it));
+	if (!it)
+		return NULL;
+	memset(it, 0, sizeof(*it));
+
+	it->lxcpath = strdup(lxcpath);
+	if (!it->lxcpath)
+		goto err;
+
+	if ((flags & LXC_LIST_DEFINED) &&
+			defined_container_names(lxcpath, &it->defined) < 0)
+		goto err;
+
+	if ((flags & LXC_LIST_ACTIVE) &&
+			active_container_names(lxcpath, &it->active) < 0)
+		goto err;
+
+	return it;
+
+err:
+	lxc_container_iter_free(it);
+	return NULL;
+}
+
+const char *lxc_container_iter_next(struct lxc_container_iter *it, int *what)
+{
+	const char *d, *a;
+	int cmp;
+
+	if (!it)
+		return NULL;
+
+	/* both lists are sorted, so merge them as we go */
+	d = it->defined ? it->defined[it->d] : NULL;
+	a = it->active ? it->active[it->a] : NULL;
+	if (!d && !a)
+		return NULL;
+
+	if (!d)
+		cmp = 1;
+	else if (!a)
+		cmp = -1;
+	else
+		cmp = strcmp(d, a);
+
+	if (what)
+		*what = 0;
+	if (cmp <= 0) {
+		it->d++;
+		if (what)
+			*what |= LXC_LIST_DEFINED;
 	}
+	if (cmp >= 0) {
+		it->a++;
+		if (what)
+			*what |= LXC_LIST_ACTIVE;
+	}
+	return cmp <= 0 ? d : a;
+}
 
-out:
-	if (line)
-		free(line);
+struct lxc_container *lxc_container_iter_get(struct lxc_container_iter *it,
+		const char *name)
+{
+	if (!it || !name)
+		return NULL;
+	return lxc_container_new(name, it->lxcpath);
+}
 
-	fclose(f);
-	return ret;
+void lxc_container_iter_free(struct lxc_container_iter *it)
+{
+	if (!it)
+		return;
+	free(it->lxcpath);
+	lxc_free_array((void **)it->defined, free);
+	lxc_free_array((void **)it->active, free);
+	free(it);
 }
 
 int list_all_containers(const char *lxcpath, char ***nret,
 			struct lxc_container ***cret)
 {
-	int i, ret, active_cnt, ct_cnt, ct_list_cnt;
-	char **active_name;
-	char **ct_name;
+	struct lxc_container_iter *it;
+	struct lxc_container *c;
+	const char *name;
+	char **ct_name = NULL;
 	struct lxc_container **ct_list = NULL;
+	size_t ct_cnt = 0, name_cap = 0, list_cap = 0;
 
-	ct_cnt = list_defined_containers(lxcpath, &ct_name, NULL);
-	if (ct_cnt < 0)
-		return ct_cnt;
+	if (cret)
+		*cret = NULL;
+	if (nret)
+		*nret = NULL;
 
-	active_cnt = list_active_containers(lxcpath, &active_name, NULL);
-	if (active_cnt < 0) {
-		ret = active_cnt;
-		goto free_ct_name;
-	}
+	it = lxc_container_iter_new(lxcpath, LXC_LIST_DEFINED | LXC_LIST_ACTIVE);
+	if (!it)
+		return -1;
 
-	for (i = 0; i < active_cnt; i++) {
-		if (!array_contains(&ct_name, active_name[i], ct_cnt)) {
-			if (!add_to_array(&ct_name, active_name[i], ct_cnt)) {
-				ret = -1;
-				goto free_active_name;
+	while ((name = lxc_container_iter_next(it, NULL))) {
+		c = NULL;
+		if (cret) {
+			c = lxc_container_iter_get(it, name);
+			if (!c) {
+				WARN("Container %s:%s could not be loaded", it->lxcpath, name);
+				continue;
 			}
-			ct_cnt++;
-		}
-		free(active_name[i]);
-		active_name[i] = NULL;
-	}
-	free(active_name);
-	active_name = NULL;
-	active_cnt = 0;
-
-	for (i = 0, ct_list_cnt = 0; i < ct_cnt && cret; i++) {
-		struct lxc_container *c;
-
-		c = lxc_container_new(ct_name[i], lxcpath);
-		if (!c) {
-			WARN("Container %s:%s could not be loaded", lxcpath, ct_name[i]);
-			remove_from_array(&ct_name, ct_name[i], ct_cnt--);
-			continue;
+			if (lxc_grow_array((void ***)&ct_list, &list_cap, ct_cnt + 1, 32) < 0)
+				goto err_put;
 		}
-
-		if (!add_to_clist(&ct_list, c, ct_list_cnt, false)) {
-			lxc_container_put(c);
-			ret = -1;
-			goto free_ct_list;
+		if (nret) {
+			if (lxc_grow_array((void ***)&ct_name, &name_cap, ct_cnt + 1, 32) < 0)
+				goto err_put;
+			if (!(ct_name[ct_cnt] = strdup(name)))
+				goto err_put;
 		}
-		ct_list_cnt++;
+		if (cret)
+			ct_list[ct_cnt] = c;
+		ct_cnt++;
 	}
+	lxc_container_iter_free(it);
 
 	if (cret)
 		*cret = ct_list;
-
 	if (nret)
 		*nret = ct_name;
-	else {
-		ret = ct_cnt;
-		goto free_ct_name;
-	}
 	return ct_cnt;
 
-free_ct_list:
-	for (i = 0; i < ct_list_cnt; i++) {
-		lxc_container_put(ct_list[i]);
-	}
-	if (ct_list)
+err_put:
+	if (c)
+		lxc_container_put(c);
+	ERROR("Out of memory");
+	lxc_container_iter_free(it);
+	if (ct_list) {
+		while (ct_cnt--)
+			lxc_container_put(ct_list[ct_cnt]);
 		free(ct_list);
-
-free_active_name:
-	for (i = 0; i < active_cnt; i++) {
-		if (active_name[i])
-			free(active_name[i]);
 	}
-	if (active_name)
-		free(active_name);
-
-free_ct_name:
-	for (i = 0; i < ct_cnt; i++) {
-		free(ct_name[i]);
-	}
-	free(ct_name);
-	return ret;
+	lxc_free_array((void **)ct_name, free);
+	return -1;
 }
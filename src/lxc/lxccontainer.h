@@ -39,9 +39,22 @@ extern "C" {
 #define LXC_CLONE_SNAPSHOT        (1 << 2) /*!< Snapshot the original filesystem(s) */
 #define LXC_CLONE_KEEPBDEVTYPE    (1 << 3) /*!< Use the same bdev type */
 #define LXC_CLONE_MAYBE_SNAPSHOT  (1 << 4) /*!< Snapshot only if bdev supports it, else copy */
-#define LXC_CLONE_MAXFLAGS        (1 << 5) /*!< Number of \c LXC_CLONE_* flags */
+#define LXC_CLONE_EPHEMERAL       (1 << 5) /*!< Overlay kept in the rundir, destroyed once stopped */
+#define LXC_CLONE_MAXFLAGS        (1 << 6) /*!< Number of \c LXC_CLONE_* flags */
 #define LXC_CREATE_QUIET          (1 << 0) /*!< Redirect \c stdin to \c /dev/zero and \c stdout and \c stderr to \c /dev/null */
 #define LXC_CREATE_MAXFLAGS       (1 << 1) /*!< Number of \c LXC_CREATE* flags */
+#define LXC_LIST_LAZY             (1 << 0) /*!< Do not load container configurations until needed */
+#define LXC_LIST_DEFINED          (1 << 1) /*!< Iterate over defined containers */
+#define LXC_LIST_ACTIVE           (1 << 2) /*!< Iterate over active containers */
+#define LXC_LIST_MAXFLAGS         (1 << 3) /*!< Number of \c LXC_LIST* flags */
+#define LXC_INVENTORY_STATE       (1 << 0) /*!< Fill in the state */
+#define LXC_INVENTORY_PID         (1 << 1) /*!< Fill in the init pid */
+#define LXC_INVENTORY_GROUPS      (1 << 2) /*!< Fill in \c lxc.group */
+#define LXC_INVENTORY_AUTOSTART   (1 << 3) /*!< Fill in \c lxc.start.auto */
+#define LXC_INVENTORY_IPV4        (1 << 4) /*!< Fill in the IPv4 addresses */
+#define LXC_INVENTORY_IPV6        (1 << 5) /*!< Fill in the IPv6 addresses */
+#define LXC_INVENTORY_INTERFACES  (1 << 6) /*!< Fill in the interfaces */
+#define LXC_INVENTORY_MAXFLAGS    (1 << 7) /*!< Number of \c LXC_INVENTORY* flags */
 
 struct bdev_specs;
 
@@ -49,6 +62,18 @@ struct lxc_snapshot;
 
 struct lxc_lock;
 
+struct lxc_container_iter;
+
+struct lxc_ns_cache;
+struct lxc_attach_cache;
+struct lxc_attach_helper;
+struct lxc_cgroup_stats;
+
+struct lxc_net_stats;
+
+struct lxc_state_watch;
+struct lxc_memory_watch;
+
 /*!
  * An LXC container.
  */
@@ -366,6 +391,12 @@ struct lxc_container {
 	 * \param newname New name to be used for the container.
 	 *
 	 * \return \c true on success, else \c false.
+	 *
+	 * \note The container's directory is renamed in place, as are lvm
+	 *  and zfs backing stores named after it, and the paths under that
+	 *  directory and the hostname updated in its configuration.  The
+	 *  container must be stopped and without snapshots.  \p c then no
+	 *  longer refers to a defined container.
 	 */
 	bool (*rename)(struct lxc_container *c, const char *newname);
 
@@ -563,6 +594,7 @@ struct lxc_container {
 	 *  - \ref LXC_CLONE_KEEPNAME
 	 *  - \ref LXC_CLONE_KEEPMACADDR
 	 *  - \ref LXC_CLONE_SNAPSHOT
+	 *  - \ref LXC_CLONE_EPHEMERAL
 	 * \param bdevtype Optionally force the cloned bdevtype to a specified plugin.
 	 *  By default the original is used (subject to snapshot requirements).
 	 * \param bdevdata Information about how to create the new storage
@@ -579,6 +611,12 @@ struct lxc_container {
 	 * \note If devtype was not specified, and \p flags contains \ref
 	 * LXC_CLONE_SNAPSHOT then use the native \p bdevtype if possible,
 	 * else use an overlayfs.
+	 *
+	 * \note With \ref LXC_CLONE_EPHEMERAL, the copy is an overlay of a
+	 * directory or overlayfs rootfs whose changes are kept in the run
+	 * directory rather than in \p lxcpath, and the container is
+	 * destroyed once it stops. \p bdevtype, \p bdevdata, \p newsize
+	 * and \p hookargs are ignored.
 	 */
 	struct lxc_container *(*clone)(struct lxc_container *c, const char *newname,
 			const char *lxcpath, int flags, const char *bdevtype,
@@ -770,6 +808,367 @@ struct lxc_container {
 	 * \return \c true on success, else \c false.
 	 */
 	bool (*remove_device_node)(struct lxc_container *c, const char *src_path, const char *dest_path);
+
+	/*!
+	 * \brief Keep the connection to the container's monitor open
+	 *  between commands.
+	 *
+	 * \param c Container.
+	 * \param keep \c true to reuse one connection for all commands
+	 *  sent to the running container, \c false to connect for each one.
+	 *
+	 * \return \c true on success, else \c false.
+	 *
+	 * \note Useful for callers which query the same container
+	 *  repeatedly, such as monitoring tools.
+	 * \note While kept, the connection to lxc-monitord used by \ref wait
+	 *  stays open between waits on the containers of its lxcpath too.
+	 */
+	bool (*keep_cmd_connection)(struct lxc_container *c, bool keep);
+
+	/*!
+	 * \brief Retrieve the values of several config items from the
+	 *  running container at once.
+	 *
+	 * \param c Container.
+	 * \param keys Names of the options to get.
+	 * \param n Number of entries in \p keys.
+	 * \param[out] values Array of \p n entries, set to the value of
+	 *  each item, or \c NULL if it is empty or unknown.
+	 *
+	 * \return \c true on success, else \c false.
+	 *
+	 * \note The values are fetched in a single request.
+	 * \note Strings returned in \p values must be freed by the caller.
+	 */
+	bool (*get_running_config_items)(struct lxc_container *c,
+			const char **keys, int n, char **values);
+
+	/*!
+	 * \brief Set several configuration items at once, optionally
+	 *  saving the configuration as well.
+	 *
+	 * \param c Container.
+	 * \param keys Names of the options to set.
+	 * \param values Values to set them to, \p n entries like \p keys.
+	 * \param n Number of entries in \p keys and \p values.
+	 * \param save \c true to also save the configuration to the
+	 *  container's configuration file.
+	 *
+	 * \return \c true on success, else \c false.
+	 *
+	 * \note The container is locked once for all the items and the
+	 *  save, if setting one item fails the ones before it stay set
+	 *  and nothing is saved.
+	 */
+	bool (*set_config_items)(struct lxc_container *c, const char **keys,
+			const char **values, int n, bool save);
+
+	/*!
+	 * \brief Retrieve the values of several cgroup items of the
+	 *  running container at once.
+	 *
+	 * \param c Container.
+	 * \param keys Names of the cgroup files to read, e.g.
+	 *  \c "memory.usage_in_bytes".
+	 * \param n Number of entries in \p keys.
+	 * \param[out] values Array of \p n entries, set to the contents of
+	 *  each file, or \c NULL if it could not be read.
+	 *
+	 * \return \c true on success, else \c false.
+	 *
+	 * \note The files stay open until a different set of keys is
+	 *  asked for, repeated calls only read them again.
+	 * \note Strings returned in \p values must be freed by the caller.
+	 */
+	bool (*get_cgroup_items)(struct lxc_container *c, const char **keys,
+			int n, char **values);
+
+	/*!
+	 * \brief Retrieve the traffic counters of the veth interfaces of
+	 *  the running container.
+	 *
+	 * \param c Container.
+	 * \param[out] stats Dynamically-allocated array of the counters of
+	 *  each veth interface.
+	 *
+	 * \return Number of entries in \p stats, or -1 on error.
+	 *
+	 * \note The counters are read from the host side of the veth pairs,
+	 *  without entering the container.
+	 * \note \p stats must be freed with \ref lxc_net_stats_free.
+	 */
+	int (*get_net_stats)(struct lxc_container *c, struct lxc_net_stats **stats);
+
+	/*!
+	 * \brief Run a program inside a container through a persistent
+	 *  attach helper and wait for it to exit.
+	 *
+	 * The helper is attached to the container with \p options on first
+	 * use, and runs the programs of the following calls without
+	 * attaching again.  It is replaced when the container's init
+	 * changes, and stopped when \p c is freed.
+	 *
+	 * \param c Container.
+	 * \param options See \ref attach options.  Only the stdio file
+	 *  descriptors are taken from it once the helper runs.
+	 * \param program Program to run, looked up in the helper's \c PATH.
+	 * \param argv Array of arguments to pass to \p program.
+	 *
+	 * \return \c waitpid(2) status of exited process that ran \p
+	 * program, or \c -1 on error.
+	 */
+	int (*attach_helper_run_wait)(struct lxc_container *c, lxc_attach_options_t *options, const char *program, const char * const argv[]);
+
+	/*!
+	 * \brief Read and/or clear the console history of a running
+	 * container, kept when \c lxc.console.buffer.size is set.
+	 *
+	 * \param c Container.
+	 * \param[out] data If not \c NULL, the last output of the console,
+	 *  oldest first, which must be freed by the caller.
+	 * \param[out] len Length of \p data.
+	 * \param clear Whether to empty the history (after reading it).
+	 *
+	 * \return \c 0 on success, \c -ENODATA if the container keeps no
+	 *  history, or another negative value on error.
+	 */
+	int (*console_log)(struct lxc_container *c, char **data, size_t *len, bool clear);
+
+	/*!
+	 * \brief Start the container daemonized without waiting for it
+	 *  to be running.
+	 *
+	 * \param c Container.
+	 * \param argv Array of arguments to pass to init (\c NULL for
+	 *  \c /sbin/init).
+	 *
+	 * \return \c true once the container's monitor has been forked,
+	 *  else \c false.
+	 *
+	 * \note Follow the start with a \ref lxc_state_watch, the state
+	 *  goes to \c STARTING and then \c RUNNING, or to \c ABORTING and
+	 *  \c STOPPED.  A start which fails before its monitor is set up
+	 *  sends no state at all, so the watch should be given a timeout.
+	 */
+	bool (*start_nowait)(struct lxc_container *c, char * const argv[]);
+
+	/*!
+	 * \brief Stop the container without waiting for it to be stopped.
+	 *
+	 * \param c Container.
+	 *
+	 * \return \c true once the container has been sent its stop
+	 *  signal, else \c false.
+	 *
+	 * \note Like \ref stop, but returns as soon as the monitor has
+	 *  signalled the container, \ref stop waits for the monitor to exit.
+	 */
+	bool (*stop_nowait)(struct lxc_container *c);
+
+	/*!
+	 * \brief Keep the state of the container in memory, up to date
+	 *  with the state changes the monitor reports.
+	 *
+	 * \param c Container.
+	 * \param cache \c true to cache the state, \c false to ask the
+	 *  running container for it each time.
+	 *
+	 * \return \c true on success, else \c false.
+	 *
+	 * \note With the cache \ref state, \ref is_running and
+	 *  \ref init_pid are answered from memory instead of connecting to
+	 *  the container, which suits long-lived callers polling them.
+	 *  Right after an operation of this object which changes the state
+	 *  they ask the container until the reported changes caught up.
+	 * \note Spawns \c lxc-monitord if it is not running.  If its
+	 *  connection breaks the cache is dropped.
+	 */
+	bool (*cache_state)(struct lxc_container *c, bool cache);
+
+	/*!
+	 * \brief Add several device nodes to a running container at once.
+	 *
+	 * \param c Container.
+	 * \param src_paths Full paths of the \p n devices.
+	 * \param dest_paths Alternate paths in the container (may be
+	 *  \c NULL, as may be any of its entries, to use \p src_paths).
+	 * \param n Number of devices.
+	 *
+	 * \return \c true if all of them were added, else \c false.
+	 *
+	 * \note Like \ref add_device_node for each device, but the nodes
+	 *  are made by a single helper process and the cgroup rules are
+	 *  written in one go.  Every device is checked before anything is
+	 *  done.
+	 */
+	bool (*add_device_nodes)(struct lxc_container *c, const char **src_paths,
+			const char **dest_paths, int n);
+
+	/*!
+	 * \brief Remove several device nodes from a running container at
+	 *  once.
+	 *
+	 * \param c Container.
+	 * \param src_paths Full paths of the \p n devices.
+	 * \param dest_paths Alternate paths in the container (may be
+	 *  \c NULL, as may be any of its entries, to use \p src_paths).
+	 * \param n Number of devices.
+	 *
+	 * \return \c true if all of them were removed, else \c false.
+	 */
+	bool (*remove_device_nodes)(struct lxc_container *c, const char **src_paths,
+			const char **dest_paths, int n);
+
+	/*!
+	 * \brief Checkpoint a running container with CRIU.
+	 *
+	 * \param c Container.
+	 * \param directory Directory the images are written to, created if
+	 *  need be.
+	 * \param stop Whether the container is stopped once checkpointed
+	 *  rather than left running.
+	 * \param verbose Whether \c criu logs verbosely, to \c dump.log in
+	 *  \p directory.
+	 *
+	 * \return \c true on success, else \c false.
+	 *
+	 * \note The container is frozen through its freezer cgroup while it
+	 *  is dumped.  With \c lxc.checkpoint.predump its memory is copied
+	 *  that many times beforehand while it runs, each time but the first
+	 *  only what changed, so that the freeze lasts for the last changes
+	 *  only.  With \c lxc.checkpoint.page_server the memory goes to a
+	 *  \c criu page server rather than to \p directory.
+	 * \note Needs root, \c lxc.tty of \c 0, \c lxc.console of \c none,
+	 *  and \c veth networks with an \c lxc.network.name, or \c empty ones.
+	 */
+	bool (*checkpoint)(struct lxc_container *c, char *directory, bool stop, bool verbose);
+
+	/*!
+	 * \brief Restore a container checkpointed by \ref checkpoint.
+	 *
+	 * \param c Container.
+	 * \param directory Directory of the images.
+	 * \param verbose Whether \c criu logs verbosely, to \c restore.log
+	 *  in \p directory.
+	 *
+	 * \return \c true once the container runs, else \c false.
+	 *
+	 * \note The container is always daemonized.  It gets a monitor, its
+	 *  cgroups with the limits of its configuration and its rootfs as a
+	 *  start would, then \c criu brings back its processes and
+	 *  namespaces.  The host ends of its veths are named after
+	 *  \c lxc.network.veth.pair, or anew, and attached to the bridge of
+	 *  \c lxc.network.link.
+	 */
+	bool (*restore)(struct lxc_container *c, char *directory, bool verbose);
+
+	/*!
+	 * \brief Make several copies of a stopped container at once.
+	 *
+	 * \param c Original container.
+	 * \param newnames Names of the new containers.
+	 * \param n Number of entries in \p newnames.
+	 * \param lxcpath lxcpath in which to create the new containers. If
+	 *  \c NULL, the original container's lxcpath will be used.
+	 * \param flags, bdevtype, bdevdata, newsize, hookargs As for \ref clone.
+	 * \param max_parallel Maximum number of copies being made at once
+	 *  (\c 0 for no limit).
+	 * \param[out] newcs Optional array of \p n entries, set to the new
+	 *  containers, or \c NULL for those which could not be made.
+	 *
+	 * \return Number of containers made, or \c -1 on error.
+	 *
+	 * \note The original's configuration is read and written out only
+	 *  once, and it stays locked for the whole batch rather than once
+	 *  per copy.
+	 */
+	int (*clone_many)(struct lxc_container *c, const char **newnames,
+			int n, const char *lxcpath, int flags,
+			const char *bdevtype, const char *bdevdata,
+			uint64_t newsize, char **hookargs, int max_parallel,
+			struct lxc_container **newcs);
+
+	/*!
+	 * \brief Delete the container, leaving the removal of its files to
+	 *  the background.
+	 *
+	 * \param c Container.
+	 *
+	 * \return \c true on success, else \c false.
+	 *
+	 * \note As for \ref destroy, but the container directory, along with
+	 *  a directory backed rootfs in it, is only moved to a trash
+	 *  directory of its lxcpath.  A detached process at idle I/O
+	 *  priority empties the trash.
+	 */
+	bool (*destroy_async)(struct lxc_container *c);
+
+	/*!
+	 * \private
+	 * Configuration has not been read yet, it will be the first time
+	 * an operation needs it (see \ref LXC_LIST_LAZY).
+	 */
+	bool lazy_config;
+
+	/*!
+	 * \private
+	 * Reading the configuration for \ref lazy_config failed.
+	 */
+	bool lazy_config_failed;
+
+	/*!
+	 * \private
+	 * Connection to the monitor is kept (see \ref keep_cmd_connection).
+	 */
+	bool cmd_conn_kept;
+
+	/*!
+	 * \private
+	 * /proc directory of the container's init, reused by operations
+	 * which enter its namespaces.
+	 */
+	struct lxc_ns_cache *ns_cache;
+
+	/*!
+	 * \private
+	 * Context of the container's init reused by \ref attach.
+	 */
+	struct lxc_attach_cache *attach_cache;
+
+	/*!
+	 * \private
+	 * Helper used by \ref attach_helper_run_wait.
+	 */
+	struct lxc_attach_helper *attach_helper;
+
+	/*!
+	 * \private
+	 * Cgroup files kept open by \ref get_cgroup_items.
+	 */
+	struct lxc_cgroup_stats *cgroup_stats;
+
+	/*!
+	 * \private
+	 * State cache of \ref cache_state: the monitor connection, the
+	 * process which set it up, the state and init pid (\c 0 until
+	 * asked for), and whether the state must be asked until the
+	 * reported one is \c state_expected.
+	 */
+	struct lxc_state_watch *state_watch;
+	pid_t state_watch_owner;
+	int cached_state;
+	pid_t cached_pid;
+	bool state_stale;
+	int state_expected;
+
+	/*!
+	 * \private
+	 * The file lxc_unexp_conf is yet to be read from.  It is only read
+	 * once the configuration is changed, saved or cloned, until then
+	 * only lxc_conf is held in memory.
+	 */
+	char *unexp_file;
 };
 
 /*!
@@ -788,6 +1187,60 @@ struct lxc_snapshot {
 	void (*free)(struct lxc_snapshot *s);
 };
 
+/*!
+ * \brief Traffic counters of a network interface of a container, from
+ *  the container's point of view.
+ */
+struct lxc_net_stats {
+	int netnr; /*!< Index of the interface in \c lxc.network */
+	char *ifname; /*!< Host side interface the counters were read from */
+	uint64_t rx_packets; /*!< Packets received by the container */
+	uint64_t tx_packets; /*!< Packets sent by the container */
+	uint64_t rx_bytes; /*!< Bytes received by the container */
+	uint64_t tx_bytes; /*!< Bytes sent by the container */
+	uint64_t rx_errors; /*!< Receive errors */
+	uint64_t tx_errors; /*!< Transmit errors */
+	uint64_t rx_dropped; /*!< Packets dropped on the way in */
+	uint64_t tx_dropped; /*!< Packets dropped on the way out */
+};
+
+/*!
+ * \brief What \ref lxc_get_inventory knows about a container.
+ *
+ * Only the fields asked for are filled in, the others are left \c NULL,
+ * \c false or \c -1.  The lists are \c NULL terminated, the network ones
+ * are \c NULL for containers which are not running and may be \c NULL
+ * when empty.
+ */
+struct lxc_inventory {
+	char *name; /*!< Name of the container */
+	const char *state; /*!< State, or \c NULL if it could not be determined */
+	pid_t init_pid; /*!< Init pid, or \c -1 if not running */
+	char **groups; /*!< Values of \c lxc.group */
+	bool autostart; /*!< Whether \c lxc.start.auto is set */
+	char **ipv4; /*!< IPv4 addresses, as \ref get_ips \c inet */
+	char **ipv6; /*!< IPv6 addresses, as \ref get_ips \c inet6 */
+	char **interfaces; /*!< Interfaces, as \ref get_interfaces */
+};
+
+#define LXC_STATS_BUCKETS 32 /*!< Number of latency buckets of \ref lxc_api_stat */
+
+/*!
+ * \brief Latency counters of a method or an internal operation, see
+ *  \ref lxc_get_stats.
+ */
+struct lxc_api_stat {
+	/*! Name of the \ref lxc_container method, or of the operation:
+	 * \c "cmd" (command round trips to containers), \c "fork",
+	 * \c "mem_lock" and \c "disk_lock" (waits for the container locks) */
+	const char *name;
+	uint64_t count; /*!< Number of calls */
+	uint64_t total_ns; /*!< Total time spent in them (not for \c "fork") */
+	uint64_t max_ns; /*!< Longest call */
+	/*! Calls by duration: under 1us in bucket 0, then in bucket \c i
+	 * from 2^(i-1) to under 2^i us, the last bucket takes all longer ones */
+	uint64_t buckets[LXC_STATS_BUCKETS];
+};
 
 /*!
  * \brief Specifications for how to create a new backing store
@@ -804,6 +1257,12 @@ struct bdev_specs {
         char *thinpool; /*!< LVM thin pool to use, if any */
     } lvm;
     char *dir; /*!< Directory path */
+    struct {
+        char *image; /*!< squashfs or erofs image, or rootfs tarball to import */
+    } squashfs;
+    struct {
+        char *image; /*!< Image the qcow2 overlay reads lazily from */
+    } nbd;
 };
 
 /*!
@@ -816,6 +1275,25 @@ struct bdev_specs {
  */
 struct lxc_container *lxc_container_new(const char *name, const char *configpath);
 
+/*!
+ * \brief Create new containers, reading their configurations in parallel.
+ *
+ * \param names Names of the containers.
+ * \param n Number of names in \p names.
+ * \param configpath Full path to the configuration files to use, or \c NULL
+ *  for the default.
+ * \param[out] cret Array of \p n, set to the new containers, \c NULL where
+ *  one could not be created.
+ * \param max_parallel Number of threads creating them, \c 0 for one per CPU.
+ *
+ * \return Number of containers created, or \c -1 on error.
+ *
+ * \note Each container is as \ref lxc_container_new would have returned.
+ *  The caller is a worker too, and at most 16 threads are used.
+ */
+int lxc_container_new_many(const char **names, int n, const char *configpath,
+		struct lxc_container **cret, int max_parallel);
+
 /*!
  * \brief Add a reference to the specified container.
  *
@@ -881,6 +1359,24 @@ const char *lxc_get_version(void);
  */
 int list_defined_containers(const char *lxcpath, char ***names, struct lxc_container ***cret);
 
+/*!
+ * \brief Get a list of defined containers in a lxcpath.
+ *
+ * \param lxcpath lxcpath under which to look.
+ * \param names If not \c NULL, then a list of container names will be returned here.
+ * \param cret If not \c NULL, then a list of lxc_containers will be returned here.
+ * \param flags \c LXC_LIST_* options.
+ *
+ * \return Number of containers found, or \c -1 on error.
+ *
+ * \note Identical to \ref list_defined_containers except for \p flags.
+ *  With \ref LXC_LIST_LAZY, the containers in \p cret do not read their
+ *  configuration until it is first needed, so a container with a broken
+ *  configuration is listed but its operations will fail.
+ */
+int list_defined_containers_flags(const char *lxcpath, char ***names,
+		struct lxc_container ***cret, int flags);
+
 /*!
  * \brief Get a list of active containers for a given lxcpath.
  *
@@ -913,6 +1409,451 @@ int list_active_containers(const char *lxcpath, char ***names, struct lxc_contai
  */
 int list_all_containers(const char *lxcpath, char ***names, struct lxc_container ***cret);
 
+/*!
+ * \brief Get the state and init pid of several containers in one call.
+ *
+ * \param lxcpath Full \c LXCPATH path to consider (\c NULL for the default).
+ * \param names Names of the containers.
+ * \param n Number of entries in \p names.
+ * \param[out] states Array of \p n entries, set to the state of each
+ *  container, or \c NULL if it could not be determined.
+ * \param[out] pids Array of \p n entries, set to the init pid of each
+ *  running container and \c -1 otherwise (may be \c NULL).
+ *
+ * \return Number of containers whose state was determined, or -1 on error.
+ *
+ * \note All containers are queried concurrently, which is considerably
+ *  faster than calling \ref state for each of them in turn.
+ * \note Strings returned in \p states must not be freed.
+ */
+int lxc_get_states(const char *lxcpath, const char **names, int n,
+		const char **states, pid_t *pids);
+
+/*!
+ * \brief Describe all the containers of a lxcpath in one call.
+ *
+ * \param lxcpath Full \c LXCPATH path to consider (\c NULL for the default).
+ * \param fields \c LXC_INVENTORY_* flags selecting what to fill in.
+ * \param[out] inv Dynamically-allocated array with an entry for each
+ *  container, sorted by name.
+ *
+ * \return Number of entries in \p inv, or -1 on error.
+ *
+ * \note States and pids come from \ref lxc_get_states, and addresses
+ *  and interfaces are read straight from the network namespace of each
+ *  init where possible, which is much cheaper than going through a
+ *  \ref lxc_container per container.
+ * \note \p inv must be freed with \ref lxc_inventory_free.
+ */
+int lxc_get_inventory(const char *lxcpath, int fields,
+		struct lxc_inventory **inv);
+
+/*!
+ * \brief Free an inventory returned by \ref lxc_get_inventory.
+ *
+ * \param inv Inventory.
+ * \param n Number of entries in \p inv.
+ */
+void lxc_inventory_free(struct lxc_inventory *inv, int n);
+
+/*!
+ * \brief Start a set of containers concurrently.
+ *
+ * \param list Containers to start.
+ * \param n Number of entries in \p list.
+ * \param max_parallel Maximum number of containers being started at
+ *  once (\c 0 for no limit).
+ *
+ * \return Number of containers which were started or already running,
+ *  or -1 on error.
+ *
+ * \note Containers are started daemonized, in waves of equal
+ *  \c lxc.start.order (highest first).  A container is up once it is
+ *  \c RUNNING and its \c lxc.start.delay has passed, or, if it sets
+ *  \c lxc.start.notify, once it is \c READY or that delay has passed;
+ *  the next wave is started when all containers of the current one are up.
+ */
+int lxc_containers_start(struct lxc_container **list, int n, int max_parallel);
+
+/*!
+ * \brief Stop (kill) a set of containers concurrently.
+ *
+ * \param list Containers to stop.
+ * \param n Number of entries in \p list.
+ * \param max_parallel Maximum number of containers being stopped at
+ *  once (\c 0 for no limit).
+ *
+ * \return Number of containers which were stopped or not running,
+ *  or -1 on error.
+ *
+ * \note Containers are stopped in waves of equal \c lxc.start.order,
+ *  lowest first, see \ref stop.
+ */
+int lxc_containers_stop(struct lxc_container **list, int n, int max_parallel);
+
+/*!
+ * \brief Shut down a set of containers concurrently.
+ *
+ * \param list Containers to shut down.
+ * \param n Number of entries in \p list.
+ * \param timeout Seconds to wait for each batch of containers to stop,
+ *  or \c -1 to wait forever.
+ * \param max_parallel Maximum number of containers being shut down at
+ *  once (\c 0 for no limit).
+ *
+ * \return Number of containers which are now stopped, or -1 on error.
+ *
+ * \note Containers are shut down in waves of equal \c lxc.start.order,
+ *  lowest first.  The halt signal is sent to all the containers of a
+ *  batch before waiting for any of them.
+ * \note Containers which did not stop in time are left running, see
+ *  \ref stop.
+ */
+int lxc_containers_shutdown(struct lxc_container **list, int n, int timeout,
+		int max_parallel);
+
+/*!
+ * \brief Run a program in a set of running containers concurrently and
+ *  wait for all of them.
+ *
+ * \param list Containers to run \p program in.
+ * \param n Number of entries in \p list.
+ * \param options See \ref attach options, used for all the containers
+ *  (\c NULL for the defaults).
+ * \param program Program to run.
+ * \param argv Array of arguments to pass to \p program.
+ * \param max_parallel Maximum number of containers running \p program
+ *  at once (\c 0 for no limit).
+ * \param[out] statuses Array of \p n entries, set to the \c waitpid(2)
+ *  status of \p program in each container, or \c -1 if it could not be
+ *  run.
+ * \param[out] outputs Array of \p n entries, set to the dynamically
+ *  allocated, nul-terminated standard output and error of \p program in
+ *  each container, or \c NULL to leave them on the stdio file
+ *  descriptors of \p options.
+ *
+ * \return Number of containers \p program was run in, or -1 on error.
+ *
+ * \note Each container reuses the attach context it keeps, see
+ *  \ref attach.
+ * \note Each entry of \p outputs must be freed by the caller.
+ */
+int lxc_containers_attach_run_wait(struct lxc_container **list, int n,
+		lxc_attach_options_t *options, const char *program,
+		const char * const argv[], int max_parallel, int *statuses,
+		char **outputs);
+
+/*!
+ * \brief Get the traffic counters of the veth interfaces of several
+ *  running containers at once.
+ *
+ * \param list Containers to query.
+ * \param n Number of entries in \p list.
+ * \param[out] stats Array of \p n entries, set to a dynamically-allocated
+ *  array of counters for each container (\c NULL if it has none).
+ * \param[out] counts Array of \p n entries, set to the number of entries
+ *  in each array of \p stats, \c -1 for containers which could not be
+ *  queried.
+ *
+ * \return Number of containers queried, or -1 on error.
+ *
+ * \note The counters of all the containers come from a single dump of
+ *  the host's interfaces.
+ * \note Each array of \p stats must be freed with \ref lxc_net_stats_free.
+ */
+int lxc_get_net_stats(struct lxc_container **list, int n,
+		struct lxc_net_stats **stats, int *counts);
+
+/*!
+ * \brief Free counters returned by \ref get_net_stats or
+ *  \ref lxc_get_net_stats.
+ *
+ * \param stats Array of counters.
+ * \param n Number of entries in \p stats.
+ */
+void lxc_net_stats_free(struct lxc_net_stats *stats, int n);
+
+/*!
+ * \brief Freeze a set of containers concurrently.
+ *
+ * \param list Containers to freeze.
+ * \param n Number of entries in \p list.
+ *
+ * \return Number of containers which are now frozen, or -1 on error.
+ *
+ * \note All containers are asked to freeze before waiting for any of
+ *  them, so the total time is that of the slowest container rather
+ *  than the sum of them all.
+ */
+int lxc_containers_freeze(struct lxc_container **list, int n);
+
+/*!
+ * \brief Thaw a set of containers concurrently.
+ *
+ * \param list Containers to thaw.
+ * \param n Number of entries in \p list.
+ *
+ * \return Number of containers which are now thawed, or -1 on error.
+ */
+int lxc_containers_unfreeze(struct lxc_container **list, int n);
+
+/*!
+ * \brief Prepare reading cgroup items of several containers repeatedly.
+ *
+ * \param cs Containers to read the items of.
+ * \param nc Number of entries in \p cs.
+ * \param keys Names of the cgroup files to read, e.g.
+ *  \c "cpuacct.usage".  For \ref lxc_cgroup_stats_sample, a key of the
+ *  form \c "file:field" selects the line starting with \c field, e.g.
+ *  \c "cpuacct.stat:user".
+ * \param nk Number of entries in \p keys.
+ *
+ * \return Newly-allocated sampler, or \c NULL on error.
+ *
+ * \note The containers must stay valid until the sampler is freed.
+ * \note The sampler must be freed with \ref lxc_cgroup_stats_free.
+ */
+struct lxc_cgroup_stats *lxc_cgroup_stats_new(struct lxc_container **cs,
+		int nc, const char **keys, int nk);
+
+/*!
+ * \brief Read the cgroup items of all the containers of a sampler.
+ *
+ * \param stats Sampler.
+ * \param[out] values Array of \c nc * \c nk entries, the value of key
+ *  \c j of container \c i being stored at \c i * \c nk + \c j, or
+ *  \c NULL if it could not be read.
+ *
+ * \return Number of containers which are running, or -1 on error.
+ *
+ * \note Paths are resolved and files opened once per run of a
+ *  container, each call then only reads the files again.
+ * \note Strings returned in \p values are owned by the sampler and are
+ *  valid until the next call.
+ */
+int lxc_cgroup_stats_read(struct lxc_cgroup_stats *stats, const char **values);
+
+/*!
+ * \brief A counter read by \ref lxc_cgroup_stats_sample.
+ */
+struct lxc_cgroup_sample {
+	bool valid; /*!< Whether the counter could be read */
+	uint64_t value; /*!< The counter */
+	/*! Change of the counter per second since the previous sample of
+	 * the same run of the container, \c 0 if there is none */
+	double rate;
+};
+
+/*!
+ * \brief Read the cgroup items of all the containers of a sampler as
+ *  numbers.
+ *
+ * \param stats Sampler.
+ * \param[out] samples Array of \c nc * \c nk entries, laid out like
+ *  the values of \ref lxc_cgroup_stats_read.
+ *
+ * \return Number of containers which are running, or -1 on error.
+ *
+ * \note Items which are not a number, or of a container which is not
+ *  running, are marked not valid.
+ */
+int lxc_cgroup_stats_sample(struct lxc_cgroup_stats *stats,
+		struct lxc_cgroup_sample *samples);
+
+/*!
+ * \brief Free a sampler, closing its files.
+ *
+ * \param stats Sampler.
+ */
+void lxc_cgroup_stats_free(struct lxc_cgroup_stats *stats);
+
+/*!
+ * \brief Start iterating over the containers of a lxcpath.
+ *
+ * \param lxcpath Full \c LXCPATH path to consider.
+ * \param flags \ref LXC_LIST_DEFINED and/or \ref LXC_LIST_ACTIVE to
+ *  select which containers to return (\c 0 means both).
+ *
+ * \return Newly-allocated iterator, or \c NULL on error.
+ *
+ * \note The iterator must be freed with \ref lxc_container_iter_free.
+ */
+struct lxc_container_iter *lxc_container_iter_new(const char *lxcpath, int flags);
+
+/*!
+ * \brief Get the next container name from an iterator.
+ *
+ * \param it Iterator.
+ * \param[out] what If not \c NULL, set to \ref LXC_LIST_DEFINED and/or
+ *  \ref LXC_LIST_ACTIVE according to what the container is.
+ *
+ * \return Container name, or \c NULL when there are no more containers.
+ *
+ * \note Names are returned sorted and each name is returned once.
+ * \note The returned string is owned by the iterator and must not be freed.
+ */
+const char *lxc_container_iter_next(struct lxc_container_iter *it, int *what);
+
+/*!
+ * \brief Get a container object for a name returned by an iterator.
+ *
+ * \param it Iterator.
+ * \param name Name returned by \ref lxc_container_iter_next.
+ *
+ * \return Newly-allocated container, or \c NULL on error.
+ */
+struct lxc_container *lxc_container_iter_get(struct lxc_container_iter *it,
+		const char *name);
+
+/*!
+ * \brief Free an iterator.
+ *
+ * \param it Iterator.
+ */
+void lxc_container_iter_free(struct lxc_container_iter *it);
+
+/*!
+ * \brief Watch the state of containers from an event loop.
+ *
+ * \param lxcpath Full \c LXCPATH path to consider (\c NULL for the default).
+ * \param names Names of the containers to watch.
+ * \param n Number of entries in \p names, \c 0 to watch all the
+ *  containers of \p lxcpath.
+ *
+ * \return Newly-allocated watch, or \c NULL on error.
+ *
+ * \note The current state of each container is reported first, then its
+ *  changes: read them with \ref lxc_state_watch_next whenever
+ *  \ref lxc_state_watch_fd is readable.  All the containers share one
+ *  connection to \c lxc-monitord.
+ * \note The watch must be freed with \ref lxc_state_watch_free.
+ */
+struct lxc_state_watch *lxc_state_watch_new(const char *lxcpath,
+		const char **names, int n);
+
+/*!
+ * \brief Get the file descriptor to poll for a state watch.
+ *
+ * \param w Watch.
+ *
+ * \return File descriptor, readable when \ref lxc_state_watch_next has
+ *  something to return, or \c -1.
+ */
+int lxc_state_watch_fd(struct lxc_state_watch *w);
+
+/*!
+ * \brief Get the next state of a state watch, without blocking.
+ *
+ * \param w Watch.
+ * \param[out] name Name of the container, valid until the next call.
+ * \param[out] state State the container is now in.
+ *
+ * \return \c 1 if a state was returned, \c 0 if there is none left for
+ *  now, or \c -1 on error (such as \c lxc-monitord exiting).
+ *
+ * \note Call it until it returns \c 0 each time the watch's file
+ *  descriptor is readable.
+ */
+int lxc_state_watch_next(struct lxc_state_watch *w, const char **name,
+		const char **state);
+
+/*!
+ * \brief Free a state watch.
+ *
+ * \param w Watch.
+ */
+void lxc_state_watch_free(struct lxc_state_watch *w);
+
+/*!
+ * \brief Watch the memory events of running containers from an event
+ *  loop.
+ *
+ * \param lxcpath Full \c LXCPATH path to consider (\c NULL for the default).
+ * \param names Names of the containers to watch.
+ * \param n Number of entries in \p names, \c 0 to watch all the
+ *  containers of \p lxcpath.
+ *
+ * \return Newly-allocated watch, or \c NULL on error.
+ *
+ * \note The monitor of each container is told by the kernel when its
+ *  memory cgroup runs out of memory or comes under pressure, and passes
+ *  it on through \c lxc-monitord: nothing is polled.  Read the events
+ *  with \ref lxc_memory_watch_next whenever \ref lxc_memory_watch_fd is
+ *  readable.
+ * \note The watch must be freed with \ref lxc_memory_watch_free.
+ */
+struct lxc_memory_watch *lxc_memory_watch_new(const char *lxcpath,
+		const char **names, int n);
+
+/*!
+ * \brief Get the file descriptor to poll for a memory watch.
+ *
+ * \param w Watch.
+ *
+ * \return File descriptor, readable when \ref lxc_memory_watch_next has
+ *  something to return, or \c -1.
+ */
+int lxc_memory_watch_fd(struct lxc_memory_watch *w);
+
+/*!
+ * \brief Get the next memory event of a memory watch, without blocking.
+ *
+ * \param w Watch.
+ * \param[out] name Name of the container, valid until the next call.
+ * \param[out] event \c "oom" (the cgroup hit its limit and could not
+ *  reclaim), \c "oom_kill" (a process was killed, cgroup v2 only),
+ *  \c "medium" or \c "critical" (memory pressure on cgroup v1, the
+ *  memory.high and memory.max limits being hit on cgroup v2).
+ * \param[out] count How many times it happened since the previous event
+ *  of the container (may be \c NULL).
+ *
+ * \return \c 1 if an event was returned, \c 0 if there is none left for
+ *  now, or \c -1 on error (such as \c lxc-monitord exiting).
+ *
+ * \note Call it until it returns \c 0 each time the watch's file
+ *  descriptor is readable.
+ */
+int lxc_memory_watch_next(struct lxc_memory_watch *w, const char **name,
+		const char **event, int *count);
+
+/*!
+ * \brief Free a memory watch.
+ *
+ * \param w Watch.
+ */
+void lxc_memory_watch_free(struct lxc_memory_watch *w);
+
+/*!
+ * \brief Enable or disable the latency counters of this process.
+ *
+ * \param enable Whether to count.
+ *
+ * \return Whether the counters were enabled.
+ *
+ * \note They are enabled from the start if \c LXC_STATS is set in the
+ *  environment.  Disabled, they cost next to nothing.
+ */
+bool lxc_stats_enable(bool enable);
+
+/*!
+ * \brief Get the latency counters of this process.
+ *
+ * \param[out] stats Dynamically-allocated array with an entry for each
+ *  method and operation counted.
+ *
+ * \return Number of entries in \p stats, or -1 on error.
+ *
+ * \note Only calls made by the caller are counted, a method called by
+ *  another one is part of the outer call.
+ * \note \p stats must be freed by the caller.
+ */
+int lxc_get_stats(struct lxc_api_stat **stats);
+
+/*!
+ * \brief Set all the latency counters of this process back to zero.
+ */
+void lxc_stats_reset(void);
+
 /*!
  * \brief Close log file.
  */
@@ -26,75 +26,23 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
-#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include <lxc/lxccontainer.h>
 
 #include "utils.h"
 #include "log.h"
+#include "apistats.h"
 
-#ifdef MUTEX_DEBUGGING
-#include <execinfo.h>
+#ifndef F_OFD_SETLKW
+#define F_OFD_GETLK	36
+#define F_OFD_SETLK	37
+#define F_OFD_SETLKW	38
 #endif
 
-#define MAX_STACKDEPTH 25
-
-#define OFLAG (O_CREAT | O_RDWR)
-#define SEMMODE 0660
-#define SEMVALUE 1
-#define SEMVALUE_LOCKED 0
-
 lxc_log_define(lxc_lock, lxc);
 
-#ifdef MUTEX_DEBUGGING
-static pthread_mutex_t thread_mutex = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
-
-static inline void dump_stacktrace(void)
-{
-	void *array[MAX_STACKDEPTH];
-	size_t size;
-	char **strings;
-	size_t i;
-
-	size = backtrace(array, MAX_STACKDEPTH);
-	strings = backtrace_symbols(array, size);
-
-	// Using fprintf here as our logging module is not thread safe
-	fprintf(stderr, "\tObtained %zd stack frames.\n", size);
-
-	for (i = 0; i < size; i++)
-		fprintf(stderr, "\t\t%s\n", strings[i]);
-
-	free (strings);
-}
-#else
-static pthread_mutex_t thread_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-static inline void dump_stacktrace(void) {;}
-#endif
-
-static void lock_mutex(pthread_mutex_t *l)
-{
-	int ret;
-
-	if ((ret = pthread_mutex_lock(l)) != 0) {
-		fprintf(stderr, "pthread_mutex_lock returned:%d %s\n", ret, strerror(ret));
-		dump_stacktrace();
-		exit(1);
-	}
-}
-
-static void unlock_mutex(pthread_mutex_t *l)
-{
-	int ret;
-
-	if ((ret = pthread_mutex_unlock(l)) != 0) {
-		fprintf(stderr, "pthread_mutex_unlock returned:%d %s\n", ret, strerror(ret));
-		dump_stacktrace();
-		exit(1);
-	}
-}
-
 static char *lxclock_name(const char *p, const char *n)
 {
 	int ret;
@@ -160,20 +108,90 @@ static char *lxclock_name(const char *p, const char *n)
 	return dest;
 }
 
-static sem_t *lxc_new_unnamed_sem(void)
+static int futex_wait(int *uaddr, int val, const struct timespec *timeout)
 {
-	sem_t *s;
-	int ret;
+	return syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, timeout,
+		       NULL, 0);
+}
 
-	s = malloc(sizeof(*s));
-	if (!s)
-		return NULL;
-	ret = sem_init(s, 0, 1);
-	if (ret) {
-		free(s);
-		return NULL;
+static int futex_wake(int *uaddr, int n)
+{
+	return syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/*
+ * The lock word goes from 0 to 1 without a system call when the lock is
+ * free; a waiter sets it to 2 so that the unlock knows it has to wake
+ * someone up.
+ */
+static int futex_lock(int *futex, int timeout)
+{
+	struct timespec deadline, now, rel;
+	int c;
+
+	c = __sync_val_compare_and_swap(futex, 0, 1);
+	if (c == 0)
+		return 0;
+
+	if (timeout) {
+		if (clock_gettime(CLOCK_MONOTONIC, &deadline) < 0)
+			return -2;
+		deadline.tv_sec += timeout;
+	}
+
+	if (c != 2)
+		c = __sync_lock_test_and_set(futex, 2);
+	while (c != 0) {
+		if (timeout) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			rel.tv_sec = deadline.tv_sec - now.tv_sec;
+			rel.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+			if (rel.tv_nsec < 0) {
+				rel.tv_sec--;
+				rel.tv_nsec += 1000000000;
+			}
+			if (rel.tv_sec < 0) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+		}
+		futex_wait(futex, 2, timeout ? &rel : NULL);
+		c = __sync_lock_test_and_set(futex, 2);
+	}
+	return 0;
+}
+
+static void futex_unlock(int *futex)
+{
+	if (__sync_fetch_and_sub(futex, 1) != 1) {
+		*futex = 0;
+		__sync_synchronize();
+		futex_wake(futex, 1);
+	}
+}
+
+/*
+ * Take or drop a write lock on the whole of @fd.  Open file description
+ * locks belong to the file opened and not to the process, so they also
+ * exclude the other threads; kernels older than 3.15 only have the
+ * process-wide ones.
+ */
+static int lockfile_lock(int fd, short type)
+{
+	static bool no_ofd;
+	struct flock lk = {
+		.l_type = type,
+		.l_whence = SEEK_SET,
+	};
+	int ret, cmd = type == F_UNLCK ? F_OFD_SETLK : F_OFD_SETLKW;
+
+	if (!no_ofd) {
+		ret = fcntl(fd, cmd, &lk);
+		if (ret == 0 || errno != EINVAL)
+			return ret;
+		no_ofd = true;
 	}
-	return s;
+	return fcntl(fd, type == F_UNLCK ? F_SETLK : F_SETLKW, &lk);
 }
 
 struct lxc_lock *lxc_newlock(const char *lxcpath, const char *name)
@@ -185,12 +203,8 @@ struct lxc_lock *lxc_newlock(const char *lxcpath, const char *name)
 		goto out;
 
 	if (!name) {
-		l->type = LXC_LOCK_ANON_SEM;
-		l->u.sem = lxc_new_unnamed_sem();
-		if (!l->u.sem) {
-			free(l);
-			l = NULL;
-		}
+		l->type = LXC_LOCK_FUTEX;
+		l->u.futex = 0;
 		goto out;
 	}
 
@@ -202,33 +216,21 @@ struct lxc_lock *lxc_newlock(const char *lxcpath, const char *name)
 		goto out;
 	}
 	l->u.f.fd = -1;
+	l->u.f.held = false;
 
 out:
 	return l;
 }
 
-int lxclock(struct lxc_lock *l, int timeout)
+static int do_lxclock(struct lxc_lock *l, int timeout, short type)
 {
 	int ret = -1, saved_errno = errno;
-	struct flock lk;
 
 	switch(l->type) {
-	case LXC_LOCK_ANON_SEM:
-		if (!timeout) {
-			ret = sem_wait(l->u.sem);
-			if (ret == -1)
-				saved_errno = errno;
-		} else {
-			struct timespec ts;
-			if (clock_gettime(CLOCK_REALTIME, &ts) == -1) {
-				ret = -2;
-				goto out;
-			}
-			ts.tv_sec += timeout;
-			ret = sem_timedwait(l->u.sem, &ts);
-			if (ret == -1)
-				saved_errno = errno;
-		}
+	case LXC_LOCK_FUTEX:
+		ret = futex_lock(&l->u.futex, timeout);
+		if (ret == -1)
+			saved_errno = errno;
 		break;
 	case LXC_LOCK_FLOCK:
 		ret = -2;
@@ -242,21 +244,29 @@ int lxclock(struct lxc_lock *l, int timeout)
 			ret = -2;
 			goto out;
 		}
+		/*
+		 * a child shares the open file description, and so the
+		 * lock, with its parent: it needs its own
+		 */
+		if (l->u.f.fd != -1 && l->u.f.pid != getpid()) {
+			close(l->u.f.fd);
+			l->u.f.fd = -1;
+			l->u.f.held = false;
+		}
 		if (l->u.f.fd == -1) {
-			l->u.f.fd = open(l->u.f.fname, O_RDWR|O_CREAT,
+			l->u.f.fd = open(l->u.f.fname, O_RDWR|O_CREAT|O_CLOEXEC,
 					S_IWUSR | S_IRUSR);
 			if (l->u.f.fd == -1) {
 				ERROR("Error opening %s", l->u.f.fname);
 				goto out;
 			}
+			l->u.f.pid = getpid();
 		}
-		lk.l_type = F_WRLCK;
-		lk.l_whence = SEEK_SET;
-		lk.l_start = 0;
-		lk.l_len = 0;
-		ret = fcntl(l->u.f.fd, F_SETLKW, &lk);
+		ret = lockfile_lock(l->u.f.fd, type);
 		if (ret == -1)
 			saved_errno = errno;
+		else
+			l->u.f.held = true;
 		break;
 	}
 
@@ -265,31 +275,31 @@ out:
 	return ret;
 }
 
+int lxclock(struct lxc_lock *l, int timeout)
+{
+	return do_lxclock(l, timeout, F_WRLCK);
+}
+
+int lxclock_shared(struct lxc_lock *l, int timeout)
+{
+	return do_lxclock(l, timeout, F_RDLCK);
+}
+
 int lxcunlock(struct lxc_lock *l)
 {
 	int ret = 0, saved_errno = errno;
-	struct flock lk;
 
 	switch(l->type) {
-	case LXC_LOCK_ANON_SEM:
-		if (!l->u.sem)
-			ret = -2;
-		else {
-			ret = sem_post(l->u.sem);
-			saved_errno = errno;
-		}
+	case LXC_LOCK_FUTEX:
+		futex_unlock(&l->u.futex);
 		break;
 	case LXC_LOCK_FLOCK:
-		if (l->u.f.fd != -1) {
-			lk.l_type = F_UNLCK;
-			lk.l_whence = SEEK_SET;
-			lk.l_start = 0;
-			lk.l_len = 0;
-			ret = fcntl(l->u.f.fd, F_SETLK, &lk);
+		if (l->u.f.fd != -1 && l->u.f.held &&
+		    l->u.f.pid == getpid()) {
+			ret = lockfile_lock(l->u.f.fd, F_UNLCK);
 			if (ret < 0)
 				saved_errno = errno;
-			close(l->u.f.fd);
-			l->u.f.fd = -1;
+			l->u.f.held = false;
 		} else
 			ret = -2;
 		break;
@@ -311,12 +321,7 @@ void lxc_putlock(struct lxc_lock *l)
 	if (!l)
 		return;
 	switch(l->type) {
-	case LXC_LOCK_ANON_SEM:
-		if (l->u.sem) {
-			sem_destroy(l->u.sem);
-			free(l->u.sem);
-			l->u.sem = NULL;
-		}
+	case LXC_LOCK_FUTEX:
 		break;
 	case LXC_LOCK_FLOCK:
 		if (l->u.f.fd != -1) {
@@ -332,35 +337,10 @@ void lxc_putlock(struct lxc_lock *l)
 	free(l);
 }
 
-void process_lock(void)
-{
-	lock_mutex(&thread_mutex);
-}
-
-void process_unlock(void)
-{
-	unlock_mutex(&thread_mutex);
-}
-
-/* One thread can do fork() while another one is holding a mutex.
- * There is only one thread in child just after the fork(), so noone will ever release that mutex.
- * We setup a "child" fork handler to unlock the mutex just after the fork().
- * For several mutex types, unlocking an unlocked mutex can lead to undefined behavior.
- * One way to deal with it is to setup "prepare" fork handler
- * to lock the mutex before fork() and both "parent" and "child" fork handlers
- * to unlock the mutex.
- * This forbids doing fork() while explicitly holding the lock.
- */
-#ifdef HAVE_PTHREAD_ATFORK
-__attribute__((constructor))
-static void process_lock_setup_atfork(void)
-{
-	pthread_atfork(process_lock, process_unlock, process_unlock);
-}
-#endif
-
 int container_mem_lock(struct lxc_container *c)
 {
+	LXC_STATS_TIMER(LXC_STAT_MEM_LOCK);
+
 	return lxclock(c->privlock, 0);
 }
 
@@ -371,6 +351,7 @@ void container_mem_unlock(struct lxc_container *c)
 
 int container_disk_lock(struct lxc_container *c)
 {
+	LXC_STATS_TIMER(LXC_STAT_DISK_LOCK);
 	int ret;
 
 	if ((ret = lxclock(c->privlock, 0)))
@@ -382,6 +363,19 @@ int container_disk_lock(struct lxc_container *c)
 	return 0;
 }
 
+int container_disk_rdlock(struct lxc_container *c)
+{
+	int ret;
+
+	if ((ret = lxclock(c->privlock, 0)))
+		return ret;
+	if ((ret = lxclock_shared(c->slock, 0))) {
+		lxcunlock(c->privlock);
+		return ret;
+	}
+	return 0;
+}
+
 void container_disk_unlock(struct lxc_container *c)
 {
 	lxcunlock(c->slock);
@@ -26,12 +26,13 @@
 #include <fcntl.h>           /* For O_* constants */
 #include <sys/stat.h>        /* For mode constants */
 #include <sys/file.h>
-#include <semaphore.h>
+#include <sys/types.h>
+#include <stdbool.h>
 #include <string.h>
 #include <time.h>
 
-#define LXC_LOCK_ANON_SEM 1 /*!< Anonymous semaphore lock */
-#define LXC_LOCK_FLOCK    2 /*!< flock(2) lock */
+#define LXC_LOCK_FUTEX    1 /*!< In-process futex lock */
+#define LXC_LOCK_FLOCK    2 /*!< fcntl(2) lock */
 
 // private
 /*!
@@ -41,10 +42,16 @@ struct lxc_lock {
 	short type; //!< Lock type
 
 	union {
-		sem_t *sem; //!< Anonymous semaphore (LXC_LOCK_ANON_SEM)
+		/*!
+		 * Lock word (LXC_LOCK_FUTEX): \c 0 if free, \c 1 if held,
+		 * \c 2 if held and waited for.
+		 */
+		int futex;
 		/*! LXC_LOCK_FLOCK details */
 		struct {
-			int   fd; //!< fd on which a lock is held (if not -1)
+			int   fd; //!< fd of the lock file, kept open (if not -1)
+			pid_t pid; //!< Process which opened \c fd
+			bool  held; //!< Whether the lock is held through \c fd
 			char *fname; //!< Name of lock
 		} f;
 	} u; //!< Container for lock type elements
@@ -58,14 +65,10 @@ struct lxc_lock {
  *
  * \return Newly-allocated lxclock on success, \c NULL on failure.
 
- * \note If \p name is not given, create an unnamed semaphore
- *  (used to protect against racing threads).
- *
- * \note Note that an unnamed sem was malloced by us and needs to be freed.
- *
- * \internal \ref sem is initialized to a value of \c 1.
- * A 'sem_t *' which can be passed to \ref lxclock() and \ref lxcunlock()
- * will be placed in \c l->u.sem.
+ * \note If \p name is not given, create an in-process lock
+ *  (used to protect against racing threads).  It is a futex, which
+ *  costs no system call unless it is contended, and may be released by
+ *  another thread than the one which took it.
  *
  * If \ref lxcpath and \ref name are given (both must be given if either is
  * given) then a lockfile is created as \c $lxcpath/$lxcname/locks/$name.
@@ -74,7 +77,11 @@ struct lxc_lock {
  * \internal This function allocates the pathname for the given lock in memory
  * such that it can be can quickly opened and locked by \ref lxclock().
  * \c l->u.f.fname will contain the malloc'ed name (which must be
- * freed when the container is freed), and \c u.f.fd = -1.
+ * freed when the container is freed), and \c u.f.fd = -1.  The file is
+ * opened by the first \ref lxclock() and stays open until
+ * \ref lxc_putlock(); it is locked with open file description locks
+ * where the kernel has them, so that two locks on the same file exclude
+ * each other even within a process.
  *
  */
 extern struct lxc_lock *lxc_newlock(const char *lxcpath, const char *name);
@@ -87,22 +94,35 @@ extern struct lxc_lock *lxc_newlock(const char *lxcpath, const char *name);
  * indefinite wait).
  *
  * \return \c 0 if lock obtained, \c -2 on failure to set timeout,
- *  or \c -1 on any other error (\c errno will be set by \c sem_wait(3)).
+ *  or \c -1 on any other error (\c errno will be set, to \c ETIMEDOUT
+ *  if the timeout expired).
  *
  * \note \p timeout is (currently?) only supported for privlock, not
- * for slock.  Since currently there is not a single use of the timeout
- * (except in the test case) I may remove the support for it in sem as
- * well.
+ * for slock.
  */
 extern int lxclock(struct lxc_lock *lock, int timeout);
 
+/*!
+ * \brief Take an existing lock in shared mode: it can be held by several
+ * shared holders at once, but not while it is held by \ref lxclock().
+ *
+ * \param lock Lock to operate on.
+ * \param timeout As for \ref lxclock().
+ *
+ * \return As for \ref lxclock().
+ *
+ * \note Only file locks have a shared mode, other locks are taken
+ * exclusively.  It is released by \ref lxcunlock().
+ */
+extern int lxclock_shared(struct lxc_lock *lock, int timeout);
+
 /*!
  * \brief Unlock specified lock previously locked using \ref lxclock().
  *
  * \param lock \ref lxc_lock.
  *
  * \return \c 0 on success, \c -2 if provided lock was not already held,
- * otherwise \c -1 with \c errno saved from \c flock(2) or sem_post function.
+ * otherwise \c -1 with \c errno saved from \c fcntl(2).
  */
 extern int lxcunlock(struct lxc_lock *lock);
 
@@ -113,16 +133,6 @@ extern int lxcunlock(struct lxc_lock *lock);
  */
 extern void lxc_putlock(struct lxc_lock *lock);
 
-/*!
- * \brief Lock the current process.
- */
-extern void process_lock(void);
-
-/*!
- * \brief Unlock the current process.
- */
-extern void process_unlock(void);
-
 struct lxc_container;
 
 /*!
@@ -151,6 +161,18 @@ extern void container_mem_unlock(struct lxc_container *c);
  */
 extern int container_disk_lock(struct lxc_container *c);
 
+/*!
+ * \brief Lock the containers disk data for reading only, which other
+ * readers may do at the same time.
+ *
+ * \param c Container.
+ *
+ * \return As for \ref container_disk_lock().
+ *
+ * \note The containers memory is still locked exclusively.
+ */
+extern int container_disk_rdlock(struct lxc_container *c);
+
 /*!
  * \brief Unlock the containers disk data.
  */
@@ -31,30 +31,6 @@
 #include <fcntl.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
-#ifdef HAVE_SYS_TIMERFD_H
-#include <sys/timerfd.h>
-#else
-#include <sys/syscall.h>
-#ifndef TFD_NONBLOCK
-#define TFD_NONBLOCK O_NONBLOCK
-#endif
-
-#ifndef TFD_CLOEXEC
-#define TFD_CLOEXEC O_CLOEXEC
-#endif
-static int timerfd_create (clockid_t __clock_id, int __flags) {
-	return syscall(__NR_timerfd_create, __clock_id, __flags);
-}
-
-static int timerfd_settime (int __ufd, int __flags,
-			    const struct itimerspec *__utmr,
-			    struct itimerspec *__otmr) {
-
-	return syscall(__NR_timerfd_settime, __ufd, __flags,
-			    __utmr, __otmr);
-}
-
-#endif
 
 #include "conf.h"
 #include "cgroup.h"
@@ -68,47 +44,12 @@ static int timerfd_settime (int __ufd, int __flags,
 #endif
 #ifdef HAVE_UTMPX_H
 #include <utmpx.h>
-#ifndef HAVE_UTMPXNAME
-#include <utmp.h>
-#endif
-
 #else
 #include <utmp.h>
 
 #ifndef RUN_LVL
 #define RUN_LVL 1
 #endif
-
-static void setutxent(void) {
-	return setutent();
-}
-
-static struct utmp * getutxent (void) {
-	return (struct utmp *) getutent();
-}
-
-static void endutxent (void) {
-#ifdef IS_BIONIC
-	/* bionic isn't exporting endutend */
-	return;
-#else
-	return endutent();
-#endif
-}
-#endif
-
-#ifndef HAVE_UTMPXNAME
-static int utmpxname(const char *file) {
-	int result;
-	result = utmpname(file);
-
-#ifdef IS_BIONIC
-	/* Yeah bionic is that weird */
-	result = result - 1;
-#endif
-
-	return result;
-}
 #endif
 
 #undef __USE_GNU
@@ -118,9 +59,11 @@ static int utmpxname(const char *file) {
  * We use inotify to put a watch on the /var/run directory for
  * create and modify events. These can trigger a read of the
  * utmp file looking for runlevel changes. If a runlevel change
- * to reboot or halt states is detected, we set up an itimer to
+ * to reboot or halt states is detected, we set up a mainloop timer to
  * regularly check for the container shutdown, and reboot or halt
  * as appropriate when we get down to 1 task remaining.
+ * Only that timer polls, and only while a shutdown is in progress; the
+ * utmp file itself is kept open and read directly when it changes.
  */
 
 lxc_log_define(lxc_utmp, lxc);
@@ -132,18 +75,17 @@ struct lxc_utmp {
 #define CONTAINER_HALTING   2
 #define CONTAINER_RUNNING   4
 	char container_state;
-	int timer_fd;
+	int timer_id;
 	int prev_runlevel, curr_runlevel;
+	int utmp_fd; /* -1 until utmp exists */
+	char utmp_path[MAXPATHLEN];
 };
 
-typedef void (*lxc_mainloop_timer_t) (void *data);
-
 static int utmp_get_runlevel(struct lxc_utmp *utmp_data);
 static int utmp_get_ntasks(struct lxc_handler *handler);
-static int utmp_shutdown_handler(int fd, uint32_t events, void *data,
-				 struct lxc_epoll_descr *descr);
+static int utmp_shutdown_handler(void *data, struct lxc_epoll_descr *descr);
 static int lxc_utmp_add_timer(struct lxc_epoll_descr *descr,
-			      lxc_mainloop_callback_t callback, void *data);
+			      lxc_mainloop_timer_cb_t callback, void *data);
 static int lxc_utmp_del_timer(struct lxc_epoll_descr *descr,
 			      struct lxc_utmp *utmp_data);
 
@@ -151,7 +93,8 @@ static int utmp_handler(int fd, uint32_t events, void *data,
 			struct lxc_epoll_descr *descr)
 {
 	struct inotify_event *ie;
-	int size, ret, length;
+	int size, ret, changed = 0;
+	char *p;
 
 	struct lxc_utmp *utmp_data = (struct lxc_utmp *)data;
 
@@ -166,39 +109,51 @@ static int utmp_handler(int fd, uint32_t events, void *data,
 		SYSERROR("cannot determine the size of this notification");
 		return -1;
 	}
+	if (size > sizeof(buffer))
+		size = sizeof(buffer);
 
-	if (read(fd, buffer, size) < size) {
+	size = read(fd, buffer, size);
+	if (size < 0) {
 		SYSERROR("failed to read notification");
 		return -1;
 	}
 
-	ie = (struct inotify_event *)buffer;
-
-	if (ie->len <= 0) {
-
-		if (ie->mask & IN_UNMOUNT) {
-			DEBUG("watched directory removed");
-			goto out;
+	/*
+	 * Everything written under /run is reported here; utmp is only
+	 * read once for all of its events in this batch.
+	 */
+	for (p = buffer; p + sizeof(*ie) <= buffer + size;
+	     p += sizeof(*ie) + ie->len) {
+		ie = (struct inotify_event *)p;
+
+		if (ie->len <= 0) {
+			if (ie->mask & IN_UNMOUNT) {
+				DEBUG("watched directory removed");
+				return 0;
+			}
+			SYSERROR("inotify event with no name (mask %d)", ie->mask);
+			return -1;
 		}
 
-		SYSERROR("inotify event with no name (mask %d)", ie->mask);
-		return -1;
-	}
-
-	ret = 0;
+		/* only care about utmp */
+		if (strcmp(ie->name, "utmp"))
+			continue;
 
-	DEBUG("got inotify event %d for %s", ie->mask, ie->name);
+		DEBUG("got inotify event %d for %s", ie->mask, ie->name);
 
-	length = (4 < ie->len) ? 4 : ie->len;
-
-	/* only care about utmp */
+		/* a new utmp file replaced the one we have open */
+		if ((ie->mask & (IN_CREATE | IN_MOVED_TO)) &&
+		    utmp_data->utmp_fd >= 0) {
+			close(utmp_data->utmp_fd);
+			utmp_data->utmp_fd = -1;
+		}
+		changed = 1;
+	}
 
-	if (strncmp(ie->name, "utmp", length))
+	if (!changed)
 		return 0;
 
-	if (ie->mask & (IN_MODIFY | IN_CREATE))
-		ret = utmp_get_runlevel(utmp_data);
-
+	ret = utmp_get_runlevel(utmp_data);
 	if (ret < 0)
 		goto out;
 
@@ -207,7 +162,7 @@ static int utmp_handler(int fd, uint32_t events, void *data,
 	    && ((utmp_data->container_state == CONTAINER_RUNNING)
 		|| (utmp_data->container_state == CONTAINER_STARTING))) {
 		utmp_data->container_state = CONTAINER_HALTING;
-		if (utmp_data->timer_fd == -1)
+		if (!utmp_data->timer_id)
 			lxc_utmp_add_timer(descr, utmp_shutdown_handler, data);
 		DEBUG("Container halting");
 		goto out;
@@ -218,7 +173,7 @@ static int utmp_handler(int fd, uint32_t events, void *data,
 	    && ((utmp_data->container_state == CONTAINER_RUNNING)
 		|| (utmp_data->container_state == CONTAINER_STARTING))) {
 		utmp_data->container_state = CONTAINER_REBOOTING;
-		if (utmp_data->timer_fd == -1)
+		if (!utmp_data->timer_id)
 			lxc_utmp_add_timer(descr, utmp_shutdown_handler, data);
 		DEBUG("Container rebooting");
 		goto out;
@@ -227,7 +182,7 @@ static int utmp_handler(int fd, uint32_t events, void *data,
 	/* normal operation, running, from starting state. */
 	if (utmp_data->curr_runlevel > '0' && utmp_data->curr_runlevel < '6') {
 		utmp_data->container_state = CONTAINER_RUNNING;
-		if (utmp_data->timer_fd > 0)
+		if (utmp_data->timer_id)
 			lxc_utmp_del_timer(descr, utmp_data);
 		DEBUG("Container running");
 		goto out;
@@ -237,53 +192,44 @@ out:
 	return 0;
 }
 
+/*
+ * Scan the records of the container's utmp for the runlevel.  The file is
+ * read through a descriptor kept open across changes, rather than through
+ * utmpxname() and getutxent(), which reopen it and are process-wide state.
+ */
 static int utmp_get_runlevel(struct lxc_utmp *utmp_data)
 {
 	#if HAVE_UTMPX_H
-	struct utmpx *utmpx;
+	struct utmpx utmpx;
 	#else
-	struct utmp *utmpx;
+	struct utmp utmpx;
 	#endif
-	char path[MAXPATHLEN];
-	struct lxc_handler *handler = utmp_data->handler;
-
-	if (snprintf(path, MAXPATHLEN, "/proc/%d/root/run/utmp",
-		     handler->pid) > MAXPATHLEN) {
-		ERROR("path is too long");
-		return -1;
-	}
-
-	if (!access(path, F_OK) && !utmpxname(path))
-		goto utmp_ok;
-
-	if (snprintf(path, MAXPATHLEN, "/proc/%d/root/var/run/utmp",
-		     handler->pid) > MAXPATHLEN) {
-		ERROR("path is too long");
-		return -1;
-	}
-
-	if (utmpxname(path)) {
-		SYSERROR("failed to 'utmpxname'");
-		return -1;
+	off_t off = 0;
+
+	if (utmp_data->utmp_fd < 0) {
+		utmp_data->utmp_fd = open(utmp_data->utmp_path,
+					  O_RDONLY | O_CLOEXEC);
+		if (utmp_data->utmp_fd < 0) {
+			if (errno == ENOENT)
+				return 0;
+			SYSERROR("failed to open '%s'", utmp_data->utmp_path);
+			return -1;
+		}
 	}
 
-utmp_ok:
-
-	setutxent();
-
-	while ((utmpx = getutxent())) {
+	while (pread(utmp_data->utmp_fd, &utmpx, sizeof(utmpx), off) ==
+	       sizeof(utmpx)) {
+		off += sizeof(utmpx);
 
-		if (utmpx->ut_type == RUN_LVL) {
-			utmp_data->prev_runlevel = utmpx->ut_pid / 256;
-			utmp_data->curr_runlevel = utmpx->ut_pid % 256;
+		if (utmpx.ut_type == RUN_LVL) {
+			utmp_data->prev_runlevel = utmpx.ut_pid / 256;
+			utmp_data->curr_runlevel = utmpx.ut_pid % 256;
 			DEBUG("utmp handler - run level is %c/%c",
 			      utmp_data->prev_runlevel,
 			      utmp_data->curr_runlevel);
 		}
 	}
 
-	endutxent();
-
 	return 0;
 }
 
@@ -362,7 +308,7 @@ run_ok:
 
 	}
 
-	wd = inotify_add_watch(fd, path, IN_MODIFY | IN_CREATE);
+	wd = inotify_add_watch(fd, path, IN_MODIFY | IN_CREATE | IN_MOVED_TO);
 	if (wd < 0) {
 		SYSERROR("failed to add watch for '%s'", path);
 		goto out_close;
@@ -370,9 +316,15 @@ run_ok:
 
 	utmp_data->handler = handler;
 	utmp_data->container_state = CONTAINER_STARTING;
-	utmp_data->timer_fd = -1;
+	utmp_data->timer_id = 0;
 	utmp_data->prev_runlevel = 'N';
 	utmp_data->curr_runlevel = 'N';
+	utmp_data->utmp_fd = -1;
+	if (snprintf(utmp_data->utmp_path, MAXPATHLEN, "%s/utmp", path) >=
+	    MAXPATHLEN) {
+		ERROR("path is too long");
+		goto out_close;
+	}
 
 	if (lxc_mainloop_add_handler
 	    (descr, fd, utmp_handler, (void *)utmp_data)) {
@@ -390,20 +342,12 @@ out:
 	return -1;
 }
 
-static int utmp_shutdown_handler(int fd, uint32_t events, void *data,
-				 struct lxc_epoll_descr *descr)
+static int utmp_shutdown_handler(void *data, struct lxc_epoll_descr *descr)
 {
 	int ntasks;
-	ssize_t nread;
 	struct lxc_utmp *utmp_data = (struct lxc_utmp *)data;
 	struct lxc_handler *handler = utmp_data->handler;
 	struct lxc_conf *conf = handler->conf;
-	uint64_t expirations;
-
-	/* read and clear notifications */
-	nread = read(fd, &expirations, sizeof(expirations));
-	if (nread < 0)
-		SYSERROR("Failed to read timer notification");
 
 	ntasks = utmp_get_ntasks(handler);
 
@@ -428,41 +372,21 @@ static int utmp_shutdown_handler(int fd, uint32_t events, void *data,
 }
 
 int lxc_utmp_add_timer(struct lxc_epoll_descr *descr,
-		       lxc_mainloop_callback_t callback, void *data)
+		       lxc_mainloop_timer_cb_t callback, void *data)
 {
-	int fd, result;
-	struct itimerspec timeout;
+	int id;
 	struct lxc_utmp *utmp_data = (struct lxc_utmp *)data;
 
-	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
-	if (fd < 0) {
-		SYSERROR("failed to create timer");
-		return -1;
-	}
-
 	DEBUG("Setting up utmp shutdown timer");
 
 	/* set a one second timeout. Repeated. */
-	timeout.it_value.tv_sec = 1;
-	timeout.it_value.tv_nsec = 0;
-
-	timeout.it_interval.tv_sec = 1;
-	timeout.it_interval.tv_nsec = 0;
-
-	result = timerfd_settime(fd, 0, &timeout, NULL);
-
-	if (result < 0) {
-		SYSERROR("timerfd_settime:");
-		return -1;
-	}
-
-	if (lxc_mainloop_add_handler(descr, fd, callback, utmp_data)) {
+	id = lxc_mainloop_add_timer(descr, 1000, 1000, callback, utmp_data);
+	if (id < 0) {
 		SYSERROR("failed to add utmp timer to mainloop");
-		close(fd);
 		return -1;
 	}
 
-	utmp_data->timer_fd = fd;
+	utmp_data->timer_id = id;
 
 	return 0;
 }
@@ -474,13 +398,11 @@ int lxc_utmp_del_timer(struct lxc_epoll_descr *descr,
 
 	DEBUG("Clearing utmp shutdown timer");
 
-	result = lxc_mainloop_del_handler(descr, utmp_data->timer_fd);
+	result = lxc_mainloop_del_timer(descr, utmp_data->timer_id);
 	if (result < 0)
 		SYSERROR("failed to del utmp timer from mainloop");
 
-	/* shutdown timer_fd */
-	close(utmp_data->timer_fd);
-	utmp_data->timer_fd = -1;
+	utmp_data->timer_id = 0;
 
 	if (result < 0)
 		return -1;
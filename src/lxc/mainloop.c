@@ -20,145 +20,604 @@
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
+#include "config.h"
+
 #include <stdio.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#else
+#include <sys/syscall.h>
+#ifndef TFD_NONBLOCK
+#define TFD_NONBLOCK O_NONBLOCK
+#endif
+
+#ifndef TFD_CLOEXEC
+#define TFD_CLOEXEC O_CLOEXEC
+#endif
+
+#ifndef TFD_TIMER_ABSTIME
+#define TFD_TIMER_ABSTIME 1
+#endif
+static int timerfd_create (clockid_t __clock_id, int __flags) {
+	return syscall(__NR_timerfd_create, __clock_id, __flags);
+}
+
+static int timerfd_settime (int __ufd, int __flags,
+			    const struct itimerspec *__utmr,
+			    struct itimerspec *__otmr) {
+
+	return syscall(__NR_timerfd_settime, __ufd, __flags,
+			    __utmr, __otmr);
+}
+
+#endif
 
 #include "mainloop.h"
 
+/*
+ * Handlers live in a slab, descr->handlers. The epoll data of a fd holds
+ * the index of its slot and the generation of the slot, so an event still
+ * pending for a handler deleted meanwhile is recognized and dropped.
+ */
 struct mainloop_handler {
 	lxc_mainloop_callback_t callback;
 	int fd;
 	void *data;
+	int flags;
+	uint32_t gen;
+	int next_free;
 };
 
-#define MAX_EVENTS 10
+/*
+ * Timers are kept in a binary min-heap on their expiry, descr->timers, and
+ * share a single timerfd armed for the earliest of them.
+ */
+struct mainloop_timer {
+	uint64_t expiry;	/* CLOCK_MONOTONIC ns */
+	int interval_ms;
+	int id;
+	lxc_mainloop_timer_cb_t callback;
+	void *data;
+};
 
-int lxc_mainloop(struct lxc_epoll_descr *descr, int timeout_ms)
+struct mainloop_deferred {
+	lxc_mainloop_timer_cb_t callback;
+	void *data;
+};
+
+/* the timerfd handler, not counted in handlers_cnt */
+#define MAINLOOP_INTERNAL 0x100
+
+#define HANDLERS_CHUNK 16
+#define TIMERS_CHUNK 16
+#define DEFAULT_EVENTS 16
+#define DEFAULT_MAX_EVENTS 256
+
+#define EV_DATA(idx, gen) (((uint64_t)(gen) << 32) | (uint32_t)(idx))
+
+static struct mainloop_handler *mainloop_handler_get(
+	struct lxc_epoll_descr *descr, uint64_t data)
 {
-	int i, nfds;
+	uint32_t idx = data & 0xffffffff;
 	struct mainloop_handler *handler;
-	struct epoll_event events[MAX_EVENTS];
+
+	if (idx >= descr->handlers_size)
+		return NULL;
+	handler = &descr->handlers[idx];
+	if (!handler->callback || handler->gen != data >> 32)
+		return NULL;
+	return handler;
+}
+
+static int mainloop_handler_find(struct lxc_epoll_descr *descr, int fd)
+{
+	int i;
+
+	for (i = 0; i < descr->handlers_size; i++) {
+		if (descr->handlers[i].callback && descr->handlers[i].fd == fd)
+			return i;
+	}
+	return -1;
+}
+
+/* all ready fds fitted in the last batch, allow for more next time */
+static void mainloop_grow_events(struct lxc_epoll_descr *descr)
+{
+	struct epoll_event *events;
+	int size;
+
+	if (descr->events_size >= descr->max_events)
+		return;
+
+	size = descr->events_size * 2;
+	if (size > descr->max_events)
+		size = descr->max_events;
+
+	events = realloc(descr->events, size * sizeof(*events));
+	if (!events)
+		return;
+	descr->events = events;
+	descr->events_size = size;
+}
+
+static uint64_t mainloop_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void mainloop_timer_swap(struct lxc_epoll_descr *descr, int a, int b)
+{
+	struct mainloop_timer tmp = descr->timers[a];
+
+	descr->timers[a] = descr->timers[b];
+	descr->timers[b] = tmp;
+}
+
+static void mainloop_timer_up(struct lxc_epoll_descr *descr, int i)
+{
+	while (i > 0 &&
+	       descr->timers[(i - 1) / 2].expiry > descr->timers[i].expiry) {
+		mainloop_timer_swap(descr, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void mainloop_timer_down(struct lxc_epoll_descr *descr, int i)
+{
+	int child;
 
 	for (;;) {
+		child = 2 * i + 1;
+		if (child >= descr->timers_cnt)
+			break;
+		if (child + 1 < descr->timers_cnt &&
+		    descr->timers[child + 1].expiry < descr->timers[child].expiry)
+			child++;
+		if (descr->timers[i].expiry <= descr->timers[child].expiry)
+			break;
+		mainloop_timer_swap(descr, i, child);
+		i = child;
+	}
+}
 
-		nfds = epoll_wait(descr->epfd, events, MAX_EVENTS, timeout_ms);
-		if (nfds < 0) {
-			if (errno == EINTR)
-				continue;
+static int mainloop_timer_push(struct lxc_epoll_descr *descr,
+			       struct mainloop_timer *timer)
+{
+	struct mainloop_timer *timers;
+
+	if (descr->timers_cnt + 1 > descr->timers_size) {
+		timers = realloc(descr->timers,
+				 (descr->timers_size + TIMERS_CHUNK) *
+				  sizeof(*timers));
+		if (!timers)
 			return -1;
+		descr->timers = timers;
+		descr->timers_size += TIMERS_CHUNK;
+	}
+
+	descr->timers[descr->timers_cnt] = *timer;
+	mainloop_timer_up(descr, descr->timers_cnt++);
+	return 0;
+}
+
+static void mainloop_timer_remove(struct lxc_epoll_descr *descr, int i)
+{
+	descr->timers_cnt--;
+	if (i == descr->timers_cnt)
+		return;
+	descr->timers[i] = descr->timers[descr->timers_cnt];
+	mainloop_timer_up(descr, i);
+	mainloop_timer_down(descr, i);
+}
+
+/* arm the timerfd for the earliest timer, or disarm it */
+static int mainloop_timer_arm(struct lxc_epoll_descr *descr)
+{
+	struct itimerspec its;
+	uint64_t expiry;
+
+	memset(&its, 0, sizeof(its));
+	if (descr->timers_cnt) {
+		/* 0 would disarm it, a timer which is already due fires now */
+		expiry = descr->timers[0].expiry ? descr->timers[0].expiry : 1;
+		its.it_value.tv_sec = expiry / 1000000000;
+		its.it_value.tv_nsec = expiry % 1000000000;
+	}
+	return timerfd_settime(descr->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static int mainloop_timer_handler(int fd, uint32_t events, void *data,
+				  struct lxc_epoll_descr *descr)
+{
+	struct mainloop_timer timer;
+	uint64_t expirations, now;
+	int ret = 0;
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		return -1;
+
+	now = mainloop_now();
+	while (descr->timers_cnt && descr->timers[0].expiry <= now) {
+		timer = descr->timers[0];
+		mainloop_timer_remove(descr, 0);
+
+		/* rescheduled first, so that the callback can delete it */
+		if (timer.interval_ms > 0) {
+			struct mainloop_timer next = timer;
+
+			next.expiry = now + (uint64_t)timer.interval_ms * 1000000;
+			if (mainloop_timer_push(descr, &next))
+				timer.interval_ms = 0;
 		}
 
+		if (timer.callback(timer.data, descr) > 0) {
+			ret = 1;
+			break;
+		}
+	}
+
+	mainloop_timer_arm(descr);
+	return ret;
+}
+
+/* run what was deferred before, what they defer runs in the next round */
+static int mainloop_run_deferred(struct lxc_epoll_descr *descr)
+{
+	struct mainloop_deferred *deferred;
+	int i, cnt, ret = 0;
+
+	deferred = descr->deferred;
+	cnt = descr->deferred_cnt;
+	descr->deferred = NULL;
+	descr->deferred_cnt = 0;
+
+	for (i = 0; i < cnt; i++) {
+		if (ret > 0)
+			continue;
+		ret = deferred[i].callback(deferred[i].data, descr);
+	}
+
+	free(deferred);
+	return ret > 0;
+}
+
+/*
+ * One epoll_wait() and the handlers of what it returned.  Returns the
+ * number of events, or -1, and sets *quit if a handler asked to exit.
+ */
+static int mainloop_batch(struct lxc_epoll_descr *descr, int timeout_ms,
+			  bool *quit)
+{
+	int i, nfds, urgent;
+	struct mainloop_handler *handler;
+	struct epoll_event *events;
+
+	events = descr->events;
+	nfds = epoll_wait(descr->epfd, events, descr->events_size, timeout_ms);
+	if (nfds < 0)
+		return -1;
+
+	/* urgent handlers go first, a busy fd can't delay them */
+	for (urgent = 1; urgent >= 0; urgent--) {
 		for (i = 0; i < nfds; i++) {
-			handler =
-				(struct mainloop_handler *) events[i].data.ptr;
+			handler = mainloop_handler_get(descr,
+						       events[i].data.u64);
+			if (!handler)
+				continue;
+			if (!!(handler->flags & LXC_MAINLOOP_URGENT) != urgent)
+				continue;
 
 			/* If the handler returns a positive value, exit
 			   the mainloop */
-			if (handler->callback(handler->fd, events[i].events,
-					      handler->data, descr) > 0)
-				return 0;
+			if (handler->callback(handler->fd,
+					      events[i].events,
+					      handler->data, descr) > 0) {
+				*quit = true;
+				return nfds;
+			}
 		}
+	}
+
+	if (nfds == descr->events_size)
+		mainloop_grow_events(descr);
+	return nfds;
+}
 
-		if (nfds == 0 && timeout_ms != 0)
+int lxc_mainloop(struct lxc_epoll_descr *descr, int timeout_ms)
+{
+	bool quit = false;
+	int nfds;
+
+	for (;;) {
+
+		if (descr->deferred_cnt && mainloop_run_deferred(descr))
 			return 0;
 
-		if (lxc_list_empty(&descr->handlers))
+		nfds = mainloop_batch(descr, descr->deferred_cnt ? 0 : timeout_ms,
+				      &quit);
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (quit)
+			return 0;
+
+		if (nfds == 0 && timeout_ms != 0 && !descr->deferred_cnt)
+			return 0;
+
+		if (!descr->handlers_cnt && !descr->timers_cnt &&
+		    !descr->deferred_cnt)
 			return 0;
 	}
 }
 
-int lxc_mainloop_add_handler(struct lxc_epoll_descr *descr, int fd,
-			     lxc_mainloop_callback_t callback, void *data)
+int lxc_mainloop_once(struct lxc_epoll_descr *descr)
+{
+	bool quit = false;
+
+	if (descr->deferred_cnt && mainloop_run_deferred(descr))
+		return 1;
+	if (mainloop_batch(descr, 0, &quit) < 0)
+		return errno == EINTR ? 0 : -1;
+	if (quit)
+		return 1;
+	/* nobody else would get to them before the epoll fd is ready again */
+	if (descr->deferred_cnt && mainloop_run_deferred(descr))
+		return 1;
+	return 0;
+}
+
+int lxc_mainloop_add_handler_flags(struct lxc_epoll_descr *descr, int fd,
+				   lxc_mainloop_callback_t callback,
+				   void *data, int flags)
 {
 	struct epoll_event ev;
-	struct mainloop_handler *handler;
-	struct lxc_list *item;
+	struct mainloop_handler *handler, *handlers;
+	int i, idx;
+
+	if (descr->free_slot < 0) {
+		handlers = realloc(descr->handlers,
+				   (descr->handlers_size + HANDLERS_CHUNK) *
+				    sizeof(*handlers));
+		if (!handlers)
+			return -1;
+
+		memset(&handlers[descr->handlers_size], 0,
+		       HANDLERS_CHUNK * sizeof(*handlers));
+		for (i = descr->handlers_size;
+		     i < descr->handlers_size + HANDLERS_CHUNK; i++)
+			handlers[i].next_free = i + 1;
+		handlers[i - 1].next_free = -1;
 
-	handler = malloc(sizeof(*handler));
-	if (!handler)
+		descr->free_slot = descr->handlers_size;
+		descr->handlers = handlers;
+		descr->handlers_size += HANDLERS_CHUNK;
+	}
+
+	idx = descr->free_slot;
+	handler = &descr->handlers[idx];
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = EV_DATA(idx, handler->gen);
+
+	if (epoll_ctl(descr->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
 		return -1;
 
+	descr->free_slot = handler->next_free;
 	handler->callback = callback;
 	handler->fd = fd;
 	handler->data = data;
+	handler->flags = flags;
+	if (!(flags & MAINLOOP_INTERNAL))
+		descr->handlers_cnt++;
+	return 0;
+}
 
-	ev.events = EPOLLIN;
-	ev.data.ptr = handler;
+int lxc_mainloop_add_handler(struct lxc_epoll_descr *descr, int fd,
+			     lxc_mainloop_callback_t callback, void *data)
+{
+	return lxc_mainloop_add_handler_flags(descr, fd, callback, data, 0);
+}
 
-	if (epoll_ctl(descr->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
-		goto out_free_handler;
+int lxc_mainloop_del_handler(struct lxc_epoll_descr *descr, int fd)
+{
+	struct mainloop_handler *handler;
+	int idx;
+
+	idx = mainloop_handler_find(descr, fd);
+	if (idx < 0)
+		return -1;
 
-	item = malloc(sizeof(*item));
-	if (!item)
-		goto out_free_handler;
+	if (epoll_ctl(descr->epfd, EPOLL_CTL_DEL, fd, NULL))
+		return -1;
 
-	item->elem = handler;
-	lxc_list_add(&descr->handlers, item);
+	handler = &descr->handlers[idx];
+	handler->callback = NULL;
+	handler->gen++;
+	handler->next_free = descr->free_slot;
+	descr->free_slot = idx;
+	if (!(handler->flags & MAINLOOP_INTERNAL))
+		descr->handlers_cnt--;
 	return 0;
+}
 
-out_free_handler:
-	free(handler);
-	return -1;
+void lxc_mainloop_for_each(struct lxc_epoll_descr *descr,
+			   lxc_mainloop_callback_t callback,
+			   lxc_mainloop_each_cb_t fn)
+{
+	int i;
+
+	/* fn may delete the handler, which only frees its slot */
+	for (i = 0; i < descr->handlers_size; i++)
+		if (descr->handlers[i].callback == callback)
+			fn(descr->handlers[i].fd, descr->handlers[i].data, descr);
 }
 
-int lxc_mainloop_del_handler(struct lxc_epoll_descr *descr, int fd)
+int lxc_mainloop_mod_events(struct lxc_epoll_descr *descr, int fd,
+			     uint32_t events)
 {
-	struct mainloop_handler *handler;
-	struct lxc_list *iterator;
+	struct epoll_event ev;
+	int idx;
 
-	lxc_list_for_each(iterator, &descr->handlers) {
-		handler = iterator->elem;
+	idx = mainloop_handler_find(descr, fd);
+	if (idx < 0)
+		return -1;
 
-		if (handler->fd == fd) {
-			/* found */
-			if (epoll_ctl(descr->epfd, EPOLL_CTL_DEL, fd, NULL))
-				return -1;
+	ev.events = events;
+	ev.data.u64 = EV_DATA(idx, descr->handlers[idx].gen);
+	return epoll_ctl(descr->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
 
-			lxc_list_del(iterator);
-			free(iterator->elem);
-			free(iterator);
-			return 0;
+int lxc_mainloop_add_timer(struct lxc_epoll_descr *descr, int timeout_ms,
+			   int interval_ms, lxc_mainloop_timer_cb_t callback,
+			   void *data)
+{
+	struct mainloop_timer timer;
+	int fd;
+
+	if (descr->timerfd < 0) {
+		fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (fd < 0)
+			return -1;
+
+		if (lxc_mainloop_add_handler_flags(descr, fd,
+						   mainloop_timer_handler, NULL,
+						   LXC_MAINLOOP_URGENT |
+						   MAINLOOP_INTERNAL)) {
+			close(fd);
+			return -1;
 		}
+		descr->timerfd = fd;
 	}
 
+	timer.expiry = mainloop_now() + (uint64_t)timeout_ms * 1000000;
+	timer.interval_ms = interval_ms;
+	timer.id = ++descr->timer_id;
+	if (timer.id <= 0)
+		timer.id = descr->timer_id = 1;
+	timer.callback = callback;
+	timer.data = data;
+
+	if (mainloop_timer_push(descr, &timer))
+		return -1;
+
+	if (descr->timers[0].id == timer.id && mainloop_timer_arm(descr)) {
+		lxc_mainloop_del_timer(descr, timer.id);
+		return -1;
+	}
+	return timer.id;
+}
+
+int lxc_mainloop_del_timer(struct lxc_epoll_descr *descr, int id)
+{
+	int i;
+
+	for (i = 0; i < descr->timers_cnt; i++) {
+		if (descr->timers[i].id == id) {
+			mainloop_timer_remove(descr, i);
+			/* an early wakeup finds nothing due and rearms */
+			return 0;
+		}
+	}
 	return -1;
 }
 
+int lxc_mainloop_defer(struct lxc_epoll_descr *descr,
+		       lxc_mainloop_timer_cb_t callback, void *data)
+{
+	struct mainloop_deferred *deferred;
+
+	deferred = realloc(descr->deferred,
+			   (descr->deferred_cnt + 1) * sizeof(*deferred));
+	if (!deferred)
+		return -1;
+
+	deferred[descr->deferred_cnt].callback = callback;
+	deferred[descr->deferred_cnt].data = data;
+	descr->deferred = deferred;
+	descr->deferred_cnt++;
+	return 0;
+}
+
+int lxc_mainloop_set_max_events(struct lxc_epoll_descr *descr, int max_events)
+{
+	struct epoll_event *events;
+
+	if (max_events <= 0)
+		return -1;
+
+	if (descr->events_size > max_events) {
+		events = realloc(descr->events, max_events * sizeof(*events));
+		if (!events)
+			return -1;
+		descr->events = events;
+		descr->events_size = max_events;
+	}
+	descr->max_events = max_events;
+	return 0;
+}
+
 int lxc_mainloop_open(struct lxc_epoll_descr *descr)
 {
+	memset(descr, 0, sizeof(*descr));
+	descr->free_slot = -1;
+	descr->timerfd = -1;
+	descr->max_events = DEFAULT_MAX_EVENTS;
+	descr->events_size = DEFAULT_EVENTS;
+	descr->events = malloc(descr->events_size * sizeof(*descr->events));
+	if (!descr->events)
+		return -1;
+
 	/* hint value passed to epoll create */
 	descr->epfd = epoll_create(2);
 	if (descr->epfd < 0)
-		return -1;
+		goto err;
 
 	if (fcntl(descr->epfd, F_SETFD, FD_CLOEXEC)) {
 		close(descr->epfd);
-		return -1;
+		goto err;
 	}
 
-	lxc_list_init(&descr->handlers);
 	return 0;
+
+err:
+	free(descr->events);
+	descr->events = NULL;
+	return -1;
 }
 
 int lxc_mainloop_close(struct lxc_epoll_descr *descr)
 {
-	struct lxc_list *iterator, *next;
+	free(descr->handlers);
+	descr->handlers = NULL;
+	descr->handlers_size = descr->handlers_cnt = 0;
+	descr->free_slot = -1;
 
-	iterator = descr->handlers.next;
-	while (iterator != &descr->handlers) {
-		next = iterator->next;
+	free(descr->events);
+	descr->events = NULL;
 
-		lxc_list_del(iterator);
-		free(iterator->elem);
-		free(iterator);
-		iterator = next;
-	}
+	if (descr->timerfd >= 0)
+		close(descr->timerfd);
+	descr->timerfd = -1;
+	free(descr->timers);
+	descr->timers = NULL;
+	descr->timers_size = descr->timers_cnt = 0;
+
+	free(descr->deferred);
+	descr->deferred = NULL;
+	descr->deferred_cnt = 0;
 
 	return close(descr->epfd);
 }
-
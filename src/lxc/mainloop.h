@@ -25,24 +25,105 @@
 #define __LXC_MAINLOOP_H
 
 #include <stdint.h>
-#include "list.h"
 
+struct mainloop_handler;
+struct mainloop_timer;
+struct mainloop_deferred;
+struct epoll_event;
+
+/*
+ * @handlers      : slab of the registered handlers
+ * @handlers_size : number of slots in handlers
+ * @handlers_cnt  : the count of slots in use
+ * @free_slot     : first free slot, -1 if none
+ * @events        : the events fetched by one epoll_wait()
+ * @events_size   : number of entries in events, grows while batches fill it
+ * @max_events    : up to which events_size may grow
+ * @timerfd       : fd armed for the earliest timer, -1 until one is added
+ * @timers        : heap of the pending timers
+ * @timers_size   : number of entries timers can hold
+ * @timers_cnt    : the count of pending timers
+ * @timer_id      : id given to the last timer added
+ * @deferred      : callbacks to run before waiting for events again
+ * @deferred_cnt  : the count of entries in deferred
+ */
 struct lxc_epoll_descr {
 	int epfd;
-	struct lxc_list handlers;
+	struct mainloop_handler *handlers;
+	int handlers_size;
+	int handlers_cnt;
+	int free_slot;
+	struct epoll_event *events;
+	int events_size;
+	int max_events;
+	int timerfd;
+	struct mainloop_timer *timers;
+	int timers_size;
+	int timers_cnt;
+	int timer_id;
+	struct mainloop_deferred *deferred;
+	int deferred_cnt;
 };
 
+/* ready urgent handlers are called before the others of the same batch */
+#define LXC_MAINLOOP_URGENT 0x1
+
 typedef int (*lxc_mainloop_callback_t)(int fd, uint32_t event, void *data,
 				       struct lxc_epoll_descr *descr);
 
+/* like handlers, return a positive value to exit the mainloop */
+typedef int (*lxc_mainloop_timer_cb_t)(void *data,
+				       struct lxc_epoll_descr *descr);
+
 extern int lxc_mainloop(struct lxc_epoll_descr *descr, int timeout_ms);
 
+/*
+ * Handles what is ready without waiting, for a loop nested in another one
+ * through its epfd.  Returns 1 if a handler asked to exit, -1 on error.
+ */
+extern int lxc_mainloop_once(struct lxc_epoll_descr *descr);
+
 extern int lxc_mainloop_add_handler(struct lxc_epoll_descr *descr, int fd,
 				    lxc_mainloop_callback_t callback,
 				    void *data);
 
+extern int lxc_mainloop_add_handler_flags(struct lxc_epoll_descr *descr,
+					  int fd,
+					  lxc_mainloop_callback_t callback,
+					  void *data, int flags);
+
 extern int lxc_mainloop_del_handler(struct lxc_epoll_descr *descr, int fd);
 
+typedef void (*lxc_mainloop_each_cb_t)(int fd, void *data,
+				       struct lxc_epoll_descr *descr);
+
+/* calls fn for each handler added with callback, which fn may delete */
+extern void lxc_mainloop_for_each(struct lxc_epoll_descr *descr,
+				  lxc_mainloop_callback_t callback,
+				  lxc_mainloop_each_cb_t fn);
+
+/* replace the epoll events (EPOLLIN by default) watched for fd */
+extern int lxc_mainloop_mod_events(struct lxc_epoll_descr *descr, int fd,
+				   uint32_t events);
+
+/*
+ * call back in timeout_ms, then every interval_ms if it is > 0. Returns
+ * the id of the timer (> 0) to delete it with, < 0 on failure
+ */
+extern int lxc_mainloop_add_timer(struct lxc_epoll_descr *descr,
+				  int timeout_ms, int interval_ms,
+				  lxc_mainloop_timer_cb_t callback, void *data);
+
+extern int lxc_mainloop_del_timer(struct lxc_epoll_descr *descr, int id);
+
+/* call back once the handlers of the current batch are done */
+extern int lxc_mainloop_defer(struct lxc_epoll_descr *descr,
+			      lxc_mainloop_timer_cb_t callback, void *data);
+
+/* bound the events fetched per epoll_wait(), 256 by default */
+extern int lxc_mainloop_set_max_events(struct lxc_epoll_descr *descr,
+				       int max_events);
+
 extern int lxc_mainloop_open(struct lxc_epoll_descr *descr);
 
 extern int lxc_mainloop_close(struct lxc_epoll_descr *descr);
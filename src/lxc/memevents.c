@@ -0,0 +1,380 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "lxc.h"
+#include "log.h"
+#include "cgroup.h"
+#include "start.h"
+#include "state.h"
+#include "monitor.h"
+#include "mainloop.h"
+#include "memevents.h"
+#include "utils.h"
+#include "lxccontainer.h"
+
+lxc_log_define(lxc_memevents, lxc);
+
+/*
+ * On cgroup v1 an eventfd is registered through cgroup.event_control for
+ * memory.oom_control and for the medium and critical levels of
+ * memory.pressure_level, each read gives how many times it fired.  On v2
+ * memory.events is polled for EPOLLPRI, which it raises whenever one of
+ * its counters changes, and the counters are compared with the previous
+ * read.  Either way nothing is polled by timer.
+ */
+struct memevent_fd {
+	struct lxc_memevents *mev;
+	int event;
+	int fd;
+};
+
+struct lxc_memevents {
+	struct lxc_handler *handler;
+	struct memevent_fd v1[LXC_MEMORY_MAX];
+	int events_fd;				/* v2 memory.events */
+	uint64_t counts[LXC_MEMORY_MAX];	/* v2 counters last read */
+};
+
+static const char *event_names[LXC_MEMORY_MAX] = {
+	[LXC_MEMORY_OOM]	= "oom",
+	[LXC_MEMORY_OOM_KILL]	= "oom_kill",
+	[LXC_MEMORY_MEDIUM]	= "medium",
+	[LXC_MEMORY_CRITICAL]	= "critical",
+};
+
+/* the memory.events keys, in lxc_memory_event order */
+static const char *v2_keys[LXC_MEMORY_MAX] = {
+	[LXC_MEMORY_OOM]	= "oom",
+	[LXC_MEMORY_OOM_KILL]	= "oom_kill",
+	[LXC_MEMORY_MEDIUM]	= "high",
+	[LXC_MEMORY_CRITICAL]	= "max",
+};
+
+const char *lxc_memory_event_name(int event)
+{
+	if (event < 0 || event >= LXC_MEMORY_MAX)
+		return "unknown";
+	return event_names[event];
+}
+
+static void memevent_send(struct lxc_memevents *mev, int event, uint64_t n)
+{
+	struct lxc_handler *handler = mev->handler;
+
+	INFO("'%s' memory event %s (%" PRIu64 ")", handler->name,
+	     event_names[event], n);
+	lxc_monitor_send_memory(handler->name, event, n, handler->lxcpath);
+}
+
+static int v1_handler(int fd, uint32_t events, void *data,
+		      struct lxc_epoll_descr *descr)
+{
+	struct memevent_fd *e = data;
+	uint64_t n;
+
+	if (read(fd, &n, sizeof(n)) != sizeof(n))
+		return 0;
+	memevent_send(e->mev, e->event, n);
+	return 0;
+}
+
+/* registers an eventfd for file of the cgroup at path, with args */
+static int v1_register(const char *path, const char *file, const char *args)
+{
+	char buf[PATH_MAX];
+	int efd, cfd = -1, ecfd = -1, len, ret = -1;
+
+	efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (efd < 0)
+		return -1;
+
+	snprintf(buf, sizeof(buf), "%s/%s", path, file);
+	cfd = open(buf, O_RDONLY | O_CLOEXEC);
+	if (cfd < 0)
+		goto out;
+	snprintf(buf, sizeof(buf), "%s/cgroup.event_control", path);
+	ecfd = open(buf, O_WRONLY | O_CLOEXEC);
+	if (ecfd < 0)
+		goto out;
+
+	len = snprintf(buf, sizeof(buf), "%d %d%s%s", efd, cfd,
+		       args ? " " : "", args ? args : "");
+	if (lxc_write_nointr(ecfd, buf, len) != len)
+		goto out;
+	ret = 0;
+
+out:
+	if (ret < 0)
+		INFO("failed to register for %s/%s: %s", path, file,
+		     strerror(errno));
+	if (cfd >= 0)
+		close(cfd);
+	if (ecfd >= 0)
+		close(ecfd);
+	if (ret < 0) {
+		close(efd);
+		return -1;
+	}
+	return efd;
+}
+
+static int v1_add(struct lxc_memevents *mev, struct lxc_epoll_descr *descr,
+		  const char *path)
+{
+	static const struct {
+		int event;
+		const char *file;
+		const char *args;
+	} regs[] = {
+		{ LXC_MEMORY_OOM,	"memory.oom_control",	  NULL },
+		{ LXC_MEMORY_MEDIUM,	"memory.pressure_level", "medium" },
+		{ LXC_MEMORY_CRITICAL,	"memory.pressure_level", "critical" },
+	};
+	struct memevent_fd *e;
+	int i, added = 0;
+
+	for (i = 0; i < sizeof(regs) / sizeof(regs[0]); i++) {
+		e = &mev->v1[regs[i].event];
+		e->fd = v1_register(path, regs[i].file, regs[i].args);
+		if (e->fd < 0)
+			continue;
+		if (lxc_mainloop_add_handler(descr, e->fd, v1_handler, e)) {
+			close(e->fd);
+			e->fd = -1;
+			continue;
+		}
+		added++;
+	}
+	return added;
+}
+
+/* reads memory.events, sending what went up since the last read */
+static int v2_read(struct lxc_memevents *mev, bool send)
+{
+	char buf[512], key[32], *line, *saveptr = NULL;
+	unsigned long long val;
+	ssize_t len;
+	int i;
+
+	len = pread(mev->events_fd, buf, sizeof(buf) - 1, 0);
+	if (len < 0)
+		return -1;
+	buf[len] = '\0';
+
+	for (line = strtok_r(buf, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		if (sscanf(line, "%31s %llu", key, &val) != 2)
+			continue;
+		for (i = 0; i < LXC_MEMORY_MAX; i++) {
+			if (strcmp(key, v2_keys[i]))
+				continue;
+			if (send && val > mev->counts[i])
+				memevent_send(mev, i, val - mev->counts[i]);
+			mev->counts[i] = val;
+		}
+	}
+	return 0;
+}
+
+static int v2_handler(int fd, uint32_t events, void *data,
+		      struct lxc_epoll_descr *descr)
+{
+	struct lxc_memevents *mev = data;
+
+	if (v2_read(mev, true) < 0) {
+		/* the cgroup went away, don't spin on it */
+		lxc_mainloop_del_handler(descr, fd);
+		close(mev->events_fd);
+		mev->events_fd = -1;
+	}
+	return 0;
+}
+
+static int v2_add(struct lxc_memevents *mev, struct lxc_epoll_descr *descr,
+		  const char *path)
+{
+	char buf[PATH_MAX];
+
+	snprintf(buf, sizeof(buf), "%s/memory.events", path);
+	mev->events_fd = open(buf, O_RDONLY | O_CLOEXEC);
+	if (mev->events_fd < 0)
+		return 0;
+
+	/* what happened before the container ran is not news */
+	if (v2_read(mev, false) < 0)
+		goto err;
+	/* memory.events is always readable, only a change raises EPOLLPRI */
+	if (lxc_mainloop_add_handler(descr, mev->events_fd, v2_handler, mev))
+		goto err;
+	if (lxc_mainloop_mod_events(descr, mev->events_fd, EPOLLPRI)) {
+		lxc_mainloop_del_handler(descr, mev->events_fd);
+		goto err;
+	}
+	return 1;
+
+err:
+	close(mev->events_fd);
+	mev->events_fd = -1;
+	return 0;
+}
+
+struct lxc_memevents *lxc_memevents_mainloop_add(struct lxc_epoll_descr *descr,
+						 struct lxc_handler *handler)
+{
+	struct lxc_memevents *mev;
+	char *path, buf[PATH_MAX];
+	int i, added;
+
+	path = cgroup_get_abs_path(handler, "memory");
+	if (!path) {
+		DEBUG("no memory cgroup to watch for '%s'", handler->name);
+		return NULL;
+	}
+
+	mev = calloc(1, sizeof(*mev));
+	if (!mev) {
+		free(path);
+		return NULL;
+	}
+	mev->handler = handler;
+	mev->events_fd = -1;
+	for (i = 0; i < LXC_MEMORY_MAX; i++) {
+		mev->v1[i].mev = mev;
+		mev->v1[i].event = i;
+		mev->v1[i].fd = -1;
+	}
+
+	snprintf(buf, sizeof(buf), "%s/cgroup.event_control", path);
+	if (!access(buf, F_OK))
+		added = v1_add(mev, descr, path);
+	else
+		added = v2_add(mev, descr, path);
+	free(path);
+
+	if (!added) {
+		INFO("no memory events to watch for '%s'", handler->name);
+		lxc_memevents_free(mev);
+		return NULL;
+	}
+	return mev;
+}
+
+void lxc_memevents_free(struct lxc_memevents *mev)
+{
+	int i;
+
+	if (!mev)
+		return;
+	for (i = 0; i < LXC_MEMORY_MAX; i++)
+		if (mev->v1[i].fd >= 0)
+			close(mev->v1[i].fd);
+	if (mev->events_fd >= 0)
+		close(mev->events_fd);
+	free(mev);
+}
+
+/* the public side, see lxc_memory_watch_new() */
+struct lxc_memory_watch {
+	struct lxc_monitor_stream stream;
+	char name[NAME_MAX+1];
+};
+
+struct lxc_memory_watch *lxc_memory_watch_new(const char *lxcpath,
+					      const char **names, int n)
+{
+	struct lxc_memory_watch *w;
+	int fd;
+
+	if (n < 0 || (n && !names))
+		return NULL;
+	if (!lxcpath)
+		lxcpath = lxc_global_config_value("lxc.lxcpath");
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+	w->stream.fd = -1;
+
+	if (lxc_monitord_spawn(lxcpath))
+		goto err;
+	fd = lxc_monitor_open(lxcpath);
+	if (fd < 0)
+		goto err;
+	lxc_monitor_stream_init(&w->stream, fd);
+
+	if (lxc_monitor_subscribe(&w->stream, names, n, 1 << lxc_msg_memory,
+				  LXC_MONITOR_SUB_EXACT |
+				  LXC_MONITOR_SUB_FRAMES))
+		goto err;
+	return w;
+
+err:
+	lxc_memory_watch_free(w);
+	return NULL;
+}
+
+int lxc_memory_watch_fd(struct lxc_memory_watch *w)
+{
+	return w ? w->stream.fd : -1;
+}
+
+int lxc_memory_watch_next(struct lxc_memory_watch *w, const char **name,
+			  const char **event, int *count)
+{
+	struct lxc_monitor_event ev;
+	int ret, e;
+
+	if (!w || !name || !event)
+		return -1;
+
+	for (;;) {
+		ret = lxc_monitor_stream_read(&w->stream, &ev, 0);
+		if (ret <= 0)
+			return ret < 0 ? -1 : 0;
+		if (ev.type != lxc_msg_memory)
+			continue;
+		e = LXC_MSG_MEMORY(ev.value);
+		if (e < 0 || e >= LXC_MEMORY_MAX)
+			continue;
+
+		strcpy(w->name, ev.name);
+		*name = w->name;
+		*event = event_names[e];
+		if (count)
+			*count = LXC_MSG_MEMORY_COUNT(ev.value);
+		return 1;
+	}
+}
+
+void lxc_memory_watch_free(struct lxc_memory_watch *w)
+{
+	if (!w)
+		return;
+	if (w->stream.fd >= 0)
+		lxc_monitor_close(w->stream.fd);
+	free(w);
+}
@@ -0,0 +1,36 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef __LXC_MEMEVENTS_H
+#define __LXC_MEMEVENTS_H
+
+struct lxc_handler;
+struct lxc_epoll_descr;
+struct lxc_memevents;
+
+/*
+ * Watches the memory cgroup of the container from its monitor, and sends
+ * its oom and pressure events as lxc_msg_memory messages.  Returns NULL
+ * if there is nothing to watch, which is not an error.
+ */
+extern struct lxc_memevents *lxc_memevents_mainloop_add(struct lxc_epoll_descr *descr,
+							struct lxc_handler *handler);
+extern void lxc_memevents_free(struct lxc_memevents *mev);
+
+extern const char *lxc_memory_event_name(int event);
+
+#endif
@@ -29,8 +29,12 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
 #include <inttypes.h>
 #include <stdint.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/param.h>
@@ -84,41 +88,136 @@ int lxc_monitor_fifo_name(const char *lxcpath, char *fifo_path, size_t fifo_path
 	return 0;
 }
 
-static void lxc_monitor_fifo_send(struct lxc_msg *msg, const char *lxcpath)
+/*
+ * The fifo is kept open between messages rather than opened for every one
+ * of them, a starting container sends several in a row.  It is reopened
+ * when lxc-monitord went away, and released by lxc_monitor_fifo_close().
+ */
+static struct {
+	int fd;
+	pid_t owner;
+	char *lxcpath;
+} monitor_fifo = { .fd = -1 };
+static pthread_mutex_t monitor_fifo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void monitor_fifo_reset(void)
 {
-	int fd,ret;
-	char fifo_path[PATH_MAX];
+	/* a copy inherited across fork() is still ours to close */
+	if (monitor_fifo.fd >= 0)
+		close(monitor_fifo.fd);
+	monitor_fifo.fd = -1;
+	free(monitor_fifo.lxcpath);
+	monitor_fifo.lxcpath = NULL;
+}
 
-	BUILD_BUG_ON(sizeof(*msg) > PIPE_BUF); /* write not guaranteed atomic */
+static int monitor_fifo_open(const char *lxcpath)
+{
+	char fifo_path[PATH_MAX];
+	int fd;
 
-	ret = lxc_monitor_fifo_name(lxcpath, fifo_path, sizeof(fifo_path), 0);
-	if (ret < 0)
-		return;
+	if (lxc_monitor_fifo_name(lxcpath, fifo_path, sizeof(fifo_path), 0) < 0)
+		return -1;
 
 	/* open the fifo nonblock in case the monitor is dead, we don't want
 	 * the open to wait for a reader since it may never come.
 	 */
-	fd = open(fifo_path, O_WRONLY|O_NONBLOCK);
+	fd = open(fifo_path, O_WRONLY|O_NONBLOCK|O_CLOEXEC);
 	if (fd < 0) {
 		/* it is normal for this open to fail ENXIO when there is no
 		 * monitor running, so we don't log it
 		 */
-		return;
+		return -1;
 	}
 
 	if (fcntl(fd, F_SETFL, O_WRONLY) < 0) {
 		close(fd);
-		return;
+		return -1;
 	}
 
-	ret = write(fd, msg, sizeof(*msg));
-	if (ret != sizeof(*msg)) {
+	monitor_fifo.lxcpath = strdup(lxcpath);
+	if (!monitor_fifo.lxcpath) {
 		close(fd);
-		SYSERROR("failed to write monitor fifo %s", fifo_path);
-		return;
+		return -1;
 	}
+	monitor_fifo.fd = fd;
+	monitor_fifo.owner = getpid();
+	return 0;
+}
 
-	close(fd);
+/*
+ * Write to the fifo without getting SIGPIPE if lxc-monitord closed it.  The
+ * container's monitor process has SIGPIPE blocked and would otherwise see it
+ * on its signalfd and pass it on to the container's init.
+ */
+static int monitor_fifo_write(struct lxc_msg *msg)
+{
+	struct timespec zero = { 0, 0 };
+	sigset_t mask, oldmask;
+	int ret, saved_errno;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+
+	ret = write(monitor_fifo.fd, msg, sizeof(*msg));
+	saved_errno = errno;
+	if (ret < 0 && errno == EPIPE)
+		sigtimedwait(&mask, NULL, &zero);
+
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+	errno = saved_errno;
+	return ret;
+}
+
+static void lxc_monitor_fifo_send(struct lxc_msg *msg, const char *lxcpath)
+{
+	int ret, retry;
+
+	BUILD_BUG_ON(sizeof(*msg) > PIPE_BUF); /* write not guaranteed atomic */
+
+	pthread_mutex_lock(&monitor_fifo_lock);
+	if (monitor_fifo.fd >= 0 && (monitor_fifo.owner != getpid() ||
+				     strcmp(monitor_fifo.lxcpath, lxcpath)))
+		monitor_fifo_reset();
+
+	for (retry = 0; retry < 2; retry++) {
+		if (monitor_fifo.fd < 0 && monitor_fifo_open(lxcpath) < 0)
+			break;
+
+		ret = monitor_fifo_write(msg);
+		if (ret == sizeof(*msg))
+			break;
+
+		monitor_fifo_reset();
+		/* lxc-monitord went away since we opened it, try a new one */
+		if (ret < 0 && errno == EPIPE)
+			continue;
+
+		SYSERROR("failed to write monitor fifo for %s", lxcpath);
+		break;
+	}
+	pthread_mutex_unlock(&monitor_fifo_lock);
+}
+
+void lxc_monitor_fifo_close(void)
+{
+	pthread_mutex_lock(&monitor_fifo_lock);
+	monitor_fifo_reset();
+	pthread_mutex_unlock(&monitor_fifo_lock);
+}
+
+/*
+ * Forget the cached fifo without closing it, for callers about to close
+ * every inherited fd: the number could otherwise be handed out again and
+ * the next message written to whatever file got it.
+ */
+void lxc_monitor_fifo_forget(void)
+{
+	pthread_mutex_lock(&monitor_fifo_lock);
+	monitor_fifo.fd = -1;
+	free(monitor_fifo.lxcpath);
+	monitor_fifo.lxcpath = NULL;
+	pthread_mutex_unlock(&monitor_fifo_lock);
 }
 
 void lxc_monitor_send_state(const char *name, lxc_state_t state, const char *lxcpath)
@@ -131,6 +230,33 @@ void lxc_monitor_send_state(const char *name, lxc_state_t state, const char *lxc
 	lxc_monitor_fifo_send(&msg, lxcpath);
 }
 
+void lxc_monitor_send_phase(const char *name, int phase, uint64_t usec,
+			    const char *lxcpath)
+{
+	struct lxc_msg msg = { .type = lxc_msg_phase };
+
+	if (usec > LXC_MSG_PHASE_USEC_MAX)
+		usec = LXC_MSG_PHASE_USEC_MAX;
+	msg.value = (int)(((unsigned int)phase << LXC_MSG_PHASE_SHIFT) | usec);
+	strncpy(msg.name, name, sizeof(msg.name));
+	msg.name[sizeof(msg.name) - 1] = 0;
+
+	lxc_monitor_fifo_send(&msg, lxcpath);
+}
+
+void lxc_monitor_send_memory(const char *name, int event, uint64_t count,
+			     const char *lxcpath)
+{
+	struct lxc_msg msg = { .type = lxc_msg_memory };
+
+	if (count > LXC_MSG_MEMORY_COUNT_MAX)
+		count = LXC_MSG_MEMORY_COUNT_MAX;
+	msg.value = (int)(((unsigned int)event << LXC_MSG_MEMORY_SHIFT) | count);
+	strncpy(msg.name, name, sizeof(msg.name));
+	msg.name[sizeof(msg.name) - 1] = 0;
+
+	lxc_monitor_fifo_send(&msg, lxcpath);
+}
 
 /* routines used by monitor subscribers (lxc-monitor) */
 int lxc_monitor_close(int fd)
@@ -176,7 +302,7 @@ int lxc_monitor_open(const char *lxcpath)
 	if (lxc_monitor_sock_name(lxcpath, &addr) < 0)
 		return -1;
 
-	fd = socket(PF_UNIX, SOCK_STREAM, 0);
+	fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	if (fd < 0) {
 		ERROR("socket : %s", strerror(errno));
 		return -1;
@@ -258,6 +384,181 @@ int lxc_monitor_read(int fd, struct lxc_msg *msg)
 	return lxc_monitor_read_timeout(fd, msg, -1);
 }
 
+void lxc_monitor_stream_init(struct lxc_monitor_stream *s, int fd)
+{
+	s->fd = fd;
+	s->frames = 0;
+	s->seq = 0;
+	s->len = s->off = 0;
+}
+
+/* 1 if a whole message was taken out of the buffer, 0 if more is needed */
+static int monitor_stream_parse(struct lxc_monitor_stream *s,
+				struct lxc_monitor_event *ev)
+{
+	struct lxc_monitor_frame frame;
+	struct lxc_msg msg;
+	size_t avail = s->len - s->off;
+
+	if (!s->frames) {
+		if (avail < sizeof(msg))
+			return 0;
+		memcpy(&msg, s->buf + s->off, sizeof(msg));
+		s->off += sizeof(msg);
+
+		memset(ev, 0, sizeof(*ev));
+		ev->type = msg.type;
+		ev->value = msg.value;
+		memcpy(ev->name, msg.name, sizeof(ev->name));
+		ev->name[NAME_MAX] = '\0';
+		return 1;
+	}
+
+	if (avail < sizeof(frame))
+		return 0;
+	memcpy(&frame, s->buf + s->off, sizeof(frame));
+	if (frame.version != LXC_MONITOR_FRAME_VERSION ||
+	    frame.len <= sizeof(frame) ||
+	    frame.len > LXC_MONITOR_FRAME_MAX) {
+		ERROR("invalid monitor frame (version %d, length %d)",
+		      frame.version, frame.len);
+		return -1;
+	}
+	if (avail < frame.len)
+		return 0;
+
+	ev->type = frame.type;
+	ev->value = frame.value;
+	ev->seq = frame.seq;
+	ev->timestamp = frame.timestamp;
+	ev->missed = s->seq && frame.seq > s->seq + 1 ?
+		     frame.seq - s->seq - 1 : 0;
+	memcpy(ev->name, s->buf + s->off + sizeof(frame),
+	       frame.len - sizeof(frame));
+	ev->name[frame.len - sizeof(frame) - 1] = '\0';
+	s->seq = frame.seq;
+	s->off += frame.len;
+	return 1;
+}
+
+/*
+ * lxc_monitor_stream_read: Read the next message from a monitor connection
+ *
+ * @s          : the connection's reader
+ * @ev         : out: the message
+ * @timeout_ms : how long to wait for it, -1 forever
+ *
+ * Messages already buffered are returned without any system call, else
+ * everything the socket holds is read at once.
+ *
+ * Returns 1 on success, 0 on timeout and < 0 on failure
+ */
+int lxc_monitor_stream_read(struct lxc_monitor_stream *s,
+			    struct lxc_monitor_event *ev, int timeout_ms)
+{
+	struct pollfd pfd;
+	ssize_t ret;
+
+	for (;;) {
+		ret = monitor_stream_parse(s, ev);
+		if (ret != 0)
+			return ret;
+
+		if (s->off) {
+			memmove(s->buf, s->buf + s->off, s->len - s->off);
+			s->len -= s->off;
+			s->off = 0;
+		}
+
+		pfd.fd = s->fd;
+		pfd.events = POLLIN;
+		ret = poll(&pfd, 1, timeout_ms);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			SYSERROR("failed to poll monitor");
+			return -1;
+		}
+		if (ret == 0)
+			return 0;
+
+		ret = recv(s->fd, s->buf + s->len, sizeof(s->buf) - s->len, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			SYSERROR("client failed to recv (monitord died?)");
+			return -1;
+		}
+		s->len += ret;
+	}
+}
+
+/*
+ * lxc_monitor_subscribe: Only receive some messages on a monitor connection
+ *
+ * @s     : reader of the connection, as returned by lxc_monitor_open()
+ * @names : container names or fnmatch(3) patterns, NULL/0 for all
+ * @n     : number of entries in @names
+ * @types : mask of 1 << lxc_msg_type_t to receive, 0 for all
+ * @flags : LXC_MONITOR_SUB_EXACT if @names are literal names,
+ *          LXC_MONITOR_SUB_FRAMES to read lxc_monitor_frame from now on,
+ *          LXC_MONITOR_SUB_REPLAY and LXC_MONITOR_SUB_SNAPSHOT to have
+ *          the replay and/or snapshot follow
+ *
+ * Replaces the connection's previous subscription. Messages @s returns
+ * after this matched the new subscription.
+ *
+ * Returns 0 on success, < 0 on failure or if lxc-monitord does not
+ * answer (the connection then still gets every message as lxc_msg)
+ */
+int lxc_monitor_subscribe(struct lxc_monitor_stream *s, const char **names,
+			  int n, int types, int flags)
+{
+	struct lxc_monitor_sub sub;
+	struct lxc_monitor_event ev;
+	int i, ret;
+
+	for (i = 0; i < n; i++) {
+		if (strlen(names[i]) >= sizeof(sub.name)) {
+			ERROR("name %s too long to subscribe to", names[i]);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < n || i == 0; i++) {
+		memset(&sub, 0, sizeof(sub));
+		memcpy(sub.magic, LXC_MONITOR_SUB_MAGIC, sizeof(sub.magic));
+		sub.types = types;
+		sub.flags = flags & ~LXC_MONITOR_SUB_MORE;
+		if (i < n - 1)
+			sub.flags |= LXC_MONITOR_SUB_MORE;
+		if (n > 0)
+			strcpy(sub.name, names[i]);
+		else {
+			strcpy(sub.name, "*");
+			sub.flags &= ~LXC_MONITOR_SUB_EXACT;
+		}
+
+		if (lxc_write_nointr(s->fd, &sub, sizeof(sub)) != sizeof(sub)) {
+			SYSERROR("failed to send monitor subscription");
+			return -1;
+		}
+	}
+
+	/* what arrives before the acknowledgement predates the subscription */
+	for (;;) {
+		ret = lxc_monitor_stream_read(s, &ev, 1000);
+		if (ret == 0)
+			WARN("lxc-monitord did not acknowledge the subscription");
+		if (ret <= 0)
+			return -1;
+		if (ev.type == lxc_msg_subscribed)
+			break;
+	}
+
+	s->frames = !!(flags & LXC_MONITOR_SUB_FRAMES);
+	return 0;
+}
 
 #define LXC_MONITORD_PATH LIBEXECDIR "/lxc/lxc-monitord"
 
@@ -265,13 +566,18 @@ int lxc_monitor_read(int fd, struct lxc_msg *msg)
  * lxc-monitor starts
  */
 int lxc_monitord_spawn(const char *lxcpath)
+{
+	return lxc_daemon_spawn(LXC_MONITORD_PATH, lxcpath);
+}
+
+int lxc_daemon_spawn(const char *path, const char *lxcpath)
 {
 	pid_t pid1,pid2;
 	int pipefd[2];
 	char pipefd_str[11];
 
 	char * const args[] = {
-		LXC_MONITORD_PATH,
+		(char *)path,
 		(char *)lxcpath,
 		pipefd_str,
 		NULL,
@@ -24,6 +24,7 @@
 #define __LXC_MONITOR_H
 
 #include <limits.h>
+#include <stdint.h>
 #include <sys/param.h>
 #include <sys/un.h>
 
@@ -32,20 +33,140 @@
 typedef enum {
 	lxc_msg_state,
 	lxc_msg_priority,
+	lxc_msg_subscribed,
+	lxc_msg_snapshot,
+	lxc_msg_phase,
+	lxc_msg_memory,
 } lxc_msg_type_t;
 
+/*
+ * The value of an lxc_msg_phase message, sent for each phase of a start
+ * once the container runs: the lxc_start_phase in the top byte, how long
+ * it took in microseconds below, LXC_MSG_PHASE_USEC_MAX if longer.
+ */
+#define LXC_MSG_PHASE_SHIFT	24
+#define LXC_MSG_PHASE_USEC_MAX	((1 << LXC_MSG_PHASE_SHIFT) - 1)
+#define LXC_MSG_PHASE(v)	((int)((unsigned int)(v) >> LXC_MSG_PHASE_SHIFT))
+#define LXC_MSG_PHASE_USEC(v)	((v) & LXC_MSG_PHASE_USEC_MAX)
+
+/*
+ * Memory events of a running container's cgroup, see memevents.c.  The
+ * value of an lxc_msg_memory message is the event in the top byte, how
+ * many times it happened since the previous message below.
+ */
+enum lxc_memory_event {
+	LXC_MEMORY_OOM,		/* v1 memory.oom_control, v2 oom */
+	LXC_MEMORY_OOM_KILL,	/* v2 oom_kill */
+	LXC_MEMORY_MEDIUM,	/* v1 medium pressure, v2 high */
+	LXC_MEMORY_CRITICAL,	/* v1 critical pressure, v2 max */
+	LXC_MEMORY_MAX,
+};
+
+#define LXC_MSG_MEMORY_SHIFT	24
+#define LXC_MSG_MEMORY_COUNT_MAX ((1 << LXC_MSG_MEMORY_SHIFT) - 1)
+#define LXC_MSG_MEMORY(v)	((int)((unsigned int)(v) >> LXC_MSG_MEMORY_SHIFT))
+#define LXC_MSG_MEMORY_COUNT(v)	((v) & LXC_MSG_MEMORY_COUNT_MAX)
+
 struct lxc_msg {
 	lxc_msg_type_t type;
 	char name[NAME_MAX+1];
 	int value;
 };
 
+/*
+ * Subscription request a client can write on the lxc-monitord socket, the
+ * daemon then only forwards it the messages matching one of its requests.
+ * Requests flagged LXC_MONITOR_SUB_MORE are collected until one without
+ * that flag arrives, the set then replaces the client's previous one and
+ * is acknowledged with an lxc_msg_subscribed message. The acknowledgement
+ * is the last message sent in the connection's former format, when the
+ * request set LXC_MONITOR_SUB_FRAMES everything after it is framed.
+ *
+ * With LXC_MONITOR_SUB_REPLAY the acknowledgement is followed by the last
+ * messages lxc-monitord passed on that match, with LXC_MONITOR_SUB_SNAPSHOT
+ * by an lxc_msg_snapshot message carrying the last state of each matching
+ * container it knows of. Containers it doesn't know of are not running.
+ * Either ends with an lxc_msg_snapshot message with an empty name.
+ */
+#define LXC_MONITOR_SUB_MAGIC "subs"
+#define LXC_MONITOR_SUB_MORE  0x1	/* more requests of the set follow */
+#define LXC_MONITOR_SUB_EXACT 0x2	/* name is a literal, not a glob */
+#define LXC_MONITOR_SUB_FRAMES 0x4	/* switch to lxc_monitor_frame */
+#define LXC_MONITOR_SUB_REPLAY 0x8	/* resend the recent messages */
+#define LXC_MONITOR_SUB_SNAPSHOT 0x10	/* send the last known states */
+
+struct lxc_monitor_sub {
+	char magic[4];
+	int flags;
+	int types;		/* mask of 1 << lxc_msg_type_t, 0 for all */
+	char name[NAME_MAX+1];	/* fnmatch(3) pattern for the container name */
+};
+
+/*
+ * Variable size message of the framed monitor protocol, followed by the
+ * nul-terminated container name. A burst of messages is written at once.
+ * seq is incremented for each frame sent on a connection, a gap means
+ * messages were lost.
+ */
+#define LXC_MONITOR_FRAME_VERSION 1
+
+struct lxc_monitor_frame {
+	uint16_t len;		/* size of the frame, name included */
+	uint8_t version;
+	uint8_t type;		/* lxc_msg_type_t */
+	int32_t value;
+	uint64_t seq;
+	uint64_t timestamp;	/* CLOCK_REALTIME ns when monitord got it */
+};
+
+/* the longest frame, the one of a NAME_MAX long container name */
+#define LXC_MONITOR_FRAME_MAX (sizeof(struct lxc_monitor_frame) + NAME_MAX + 1)
+
+/* a message read from either kind of connection */
+struct lxc_monitor_event {
+	lxc_msg_type_t type;
+	int value;
+	uint64_t seq;		/* 0 on lxc_msg connections */
+	uint64_t timestamp;	/* 0 on lxc_msg connections */
+	uint64_t missed;	/* messages lost right before this one */
+	char name[NAME_MAX+1];
+};
+
+/* buffered reader for a monitor connection */
+#define LXC_MONITOR_STREAM_BUF 4096
+
+struct lxc_monitor_stream {
+	int fd;
+	int frames;		/* the connection carries lxc_monitor_frame */
+	uint64_t seq;		/* sequence number of the last frame read */
+	size_t len;
+	size_t off;
+	char buf[LXC_MONITOR_STREAM_BUF];
+};
+
 extern int lxc_monitor_open(const char *lxcpath);
 extern int lxc_monitor_sock_name(const char *lxcpath, struct sockaddr_un *addr);
 extern int lxc_monitor_fifo_name(const char *lxcpath, char *fifo_path,
 				 size_t fifo_path_sz, int do_mkdirp);
 extern void lxc_monitor_send_state(const char *name, lxc_state_t state,
 			    const char *lxcpath);
+extern void lxc_monitor_send_phase(const char *name, int phase,
+				   uint64_t usec, const char *lxcpath);
+extern void lxc_monitor_send_memory(const char *name, int event,
+				    uint64_t count, const char *lxcpath);
+extern void lxc_monitor_fifo_close(void);
+extern void lxc_monitor_fifo_forget(void);
 extern int lxc_monitord_spawn(const char *lxcpath);
+/*
+ * Runs @path as a daemon with the arguments "lxcpath sync-pipe-fd", and
+ * returns once it wrote to the pipe or exited, as for lxc-monitord.
+ */
+extern int lxc_daemon_spawn(const char *path, const char *lxcpath);
+extern void lxc_monitor_stream_init(struct lxc_monitor_stream *s, int fd);
+extern int lxc_monitor_stream_read(struct lxc_monitor_stream *s,
+				   struct lxc_monitor_event *ev, int timeout_ms);
+extern int lxc_monitor_subscribe(struct lxc_monitor_stream *s,
+				 const char **names, int n, int types,
+				 int flags);
 
 #endif
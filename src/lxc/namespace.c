@@ -43,6 +43,9 @@ struct clone_arg {
 static int do_clone(void *arg)
 {
 	struct clone_arg *clone_arg = arg;
+
+	/* clone() runs no atfork handlers */
+	lxc_log_unbuffer_child();
 	return clone_arg->fn(clone_arg->arg);
 }
 
@@ -57,6 +60,7 @@ pid_t lxc_clone(int (*fn)(void *), void *arg, int flags)
 	void *stack = alloca(stack_size);
 	pid_t ret;
 
+	lxc_log_flush();
 #ifdef __ia64__
 	ret = __clone2(do_clone, stack,
 		       stack_size, flags | SIGCHLD, &clone_arg);
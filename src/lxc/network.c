@@ -30,12 +30,16 @@
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <time.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/param.h>
 #include <sys/ioctl.h>
+#include <sys/file.h>
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <net/if_arp.h>
@@ -48,12 +52,7 @@
 #include "nl.h"
 #include "network.h"
 #include "conf.h"
-
-#if HAVE_IFADDRS_H
-#include <ifaddrs.h>
-#else
-#include <../include/ifaddrs.h>
-#endif
+#include "utils.h"
 
 #ifndef IFLA_LINKMODE
 #  define IFLA_LINKMODE 17
@@ -67,6 +66,10 @@
 #  define IFLA_NET_NS_PID 19
 #endif
 
+#ifndef IFLA_STATS64
+#  define IFLA_STATS64 23
+#endif
+
 #ifndef IFLA_INFO_KIND
 # define IFLA_INFO_KIND 1
 #endif
@@ -87,6 +90,10 @@
 # define IFLA_MACVLAN_MODE 1
 #endif
 
+#ifndef IFLA_IPVLAN_MODE
+# define IFLA_IPVLAN_MODE 1
+#endif
+
 struct link_req {
 	struct nlmsg nlmsg;
 	struct ifinfomsg ifinfomsg;
@@ -102,14 +109,140 @@ struct rt_req {
 	struct rtmsg rt;
 };
 
+/*
+ * The rtnetlink socket of lxc_rtnl_hold(), per thread since it belongs to
+ * the network namespace of the thread which opened it
+ */
+static __thread struct {
+	struct nl_handler nlh;
+	int users;
+	struct nl_batch *batch;
+} shared_rtnl;
+
+int lxc_rtnl_hold(void)
+{
+	int err;
+
+	if (shared_rtnl.users) {
+		shared_rtnl.users++;
+		return 0;
+	}
+
+	err = netlink_open(&shared_rtnl.nlh, NETLINK_ROUTE);
+	if (err) {
+		netlink_close(&shared_rtnl.nlh);
+		return err;
+	}
+	shared_rtnl.users = 1;
+	return 0;
+}
+
+void lxc_rtnl_release(void)
+{
+	if (!shared_rtnl.users || --shared_rtnl.users)
+		return;
+	netlink_close(&shared_rtnl.nlh);
+}
+
+int lxc_rtnl_batch_begin(void)
+{
+	struct nl_batch *batch;
+	int err;
+
+	if (shared_rtnl.batch)
+		return -EBUSY;
+
+	batch = malloc(sizeof(*batch));
+	if (!batch)
+		return -ENOMEM;
+
+	err = lxc_rtnl_hold();
+	if (err)
+		goto out_free;
+
+	err = netlink_batch_init(batch, &shared_rtnl.nlh);
+	if (err) {
+		lxc_rtnl_release();
+		goto out_free;
+	}
+
+	shared_rtnl.batch = batch;
+	return 0;
+
+out_free:
+	free(batch);
+	return err;
+}
+
+int lxc_rtnl_batch_end(int *errs, int n)
+{
+	struct nl_batch *batch = shared_rtnl.batch;
+	int err, i;
+
+	if (!batch)
+		return -EINVAL;
+
+	err = netlink_batch_commit(batch);
+	for (i = 0; errs && i < n; i++)
+		errs[i] = netlink_batch_error(batch, i);
+
+	shared_rtnl.batch = NULL;
+	netlink_batch_free(batch);
+	free(batch);
+	lxc_rtnl_release();
+	return err;
+}
+
+/* the held socket if there is one, or @nlh opened for this request */
+static int rtnl_open(struct nl_handler *nlh, struct nl_handler **rtnl)
+{
+	int err;
+
+	if (shared_rtnl.users) {
+		*rtnl = &shared_rtnl.nlh;
+		return 0;
+	}
+
+	err = netlink_open(nlh, NETLINK_ROUTE);
+	if (err) {
+		netlink_close(nlh);
+		return err;
+	}
+	*rtnl = nlh;
+	return 0;
+}
+
+static void rtnl_close(struct nl_handler *nlh, struct nl_handler *rtnl)
+{
+	if (rtnl == nlh)
+		netlink_close(nlh);
+}
+
+/*
+ * Send a request which only waits for its ack, queued if a batch is
+ * going on
+ */
+static int rtnl_request(struct nl_handler *rtnl, struct nlmsg *request,
+			struct nlmsg *answer)
+{
+	int idx;
+
+	if (rtnl == &shared_rtnl.nlh && shared_rtnl.batch) {
+		idx = netlink_batch_add(shared_rtnl.batch, request);
+		return idx < 0 ? idx : 0;
+	}
+
+	return netlink_transaction(rtnl, request, answer);
+}
+
 int lxc_netdev_move_by_index(int ifindex, pid_t pid)
 {
-	struct nl_handler nlh;
+	struct nl_handler nlh, *rtnl;
 	struct nlmsg *nlmsg = NULL;
 	struct link_req *link_req;
 	int err;
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh, &rtnl);
 	if (err)
 		return err;
 
@@ -128,9 +261,9 @@ int lxc_netdev_move_by_index(int ifindex, pid_t pid)
 	if (nla_put_u32(nlmsg, IFLA_NET_NS_PID, pid))
 		goto out;
 
-	err = netlink_transaction(&nlh, nlmsg, nlmsg);
+	err = rtnl_request(rtnl, nlmsg, nlmsg);
 out:
-	netlink_close(&nlh);
+	rtnl_close(&nlh, rtnl);
 	nlmsg_free(nlmsg);
 	return err;
 }
@@ -149,12 +282,12 @@ int lxc_netdev_move_by_name(char *ifname, pid_t pid)
 
 int lxc_netdev_delete_by_index(int ifindex)
 {
-	struct nl_handler nlh;
+	struct nl_handler nlh, *rtnl;
 	struct nlmsg *nlmsg = NULL, *answer = NULL;
 	struct link_req *link_req;
 	int err;
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh, &rtnl);
 	if (err)
 		return err;
 
@@ -174,9 +307,9 @@ int lxc_netdev_delete_by_index(int ifindex)
 	nlmsg->nlmsghdr.nlmsg_flags = NLM_F_ACK|NLM_F_REQUEST;
 	nlmsg->nlmsghdr.nlmsg_type = RTM_DELLINK;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_request(rtnl, nlmsg, answer);
 out:
-	netlink_close(&nlh);
+	rtnl_close(&nlh, rtnl);
 	nlmsg_free(answer);
 	nlmsg_free(nlmsg);
 	return err;
@@ -195,12 +328,12 @@ int lxc_netdev_delete_by_name(const char *name)
 
 int lxc_netdev_rename_by_index(int ifindex, const char *newname)
 {
-	struct nl_handler nlh;
+	struct nl_handler nlh, *rtnl;
 	struct nlmsg *nlmsg = NULL, *answer = NULL;
 	struct link_req *link_req;
 	int len, err;
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh, &rtnl);
 	if (err)
 		return err;
 
@@ -227,9 +360,9 @@ int lxc_netdev_rename_by_index(int ifindex, const char *newname)
 	if (nla_put_string(nlmsg, IFLA_IFNAME, newname))
 		goto out;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_request(rtnl, nlmsg, answer);
 out:
-	netlink_close(&nlh);
+	rtnl_close(&nlh, rtnl);
 	nlmsg_free(answer);
 	nlmsg_free(nlmsg);
 	return err;
@@ -252,12 +385,12 @@ int lxc_netdev_rename_by_name(const char *oldname, const char *newname)
 
 int netdev_set_flag(const char *name, int flag)
 {
-	struct nl_handler nlh;
+	struct nl_handler nlh, *rtnl;
 	struct nlmsg *nlmsg = NULL, *answer = NULL;
 	struct link_req *link_req;
 	int index, len, err;
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh, &rtnl);
 	if (err)
 		return err;
 
@@ -289,132 +422,63 @@ int netdev_set_flag(const char *name, int flag)
 	nlmsg->nlmsghdr.nlmsg_flags = NLM_F_REQUEST|NLM_F_ACK;
 	nlmsg->nlmsghdr.nlmsg_type = RTM_NEWLINK;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_request(rtnl, nlmsg, answer);
 out:
-	netlink_close(&nlh);
+	rtnl_close(&nlh, rtnl);
 	nlmsg_free(nlmsg);
 	nlmsg_free(answer);
 	return err;
 }
 
+struct get_mtu_args {
+	int ifindex;
+	int mtu;
+};
+
+static int get_mtu_cb(struct nlmsghdr *msg, void *data)
+{
+	struct get_mtu_args *args = data;
+	struct ifinfomsg *ifi = NLMSG_DATA(msg);
+	struct rtattr *tb[IFLA_MTU + 1];
+
+	if (msg->nlmsg_type != RTM_NEWLINK || ifi->ifi_index != args->ifindex)
+		return 0;
+
+	netlink_parse_attrs(tb, IFLA_MTU, IFLA_RTA(ifi),
+			    msg->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi)));
+	if (tb[IFLA_MTU])
+		memcpy(&args->mtu, RTA_DATA(tb[IFLA_MTU]), sizeof(int));
+	return 0;
+}
+
 int netdev_get_mtu(int ifindex)
 {
 	struct nl_handler nlh;
-	struct nlmsg *nlmsg = NULL, *answer = NULL;
-	struct ip_req *ip_req;
-	struct nlmsghdr *msg;
-	int err, res;
-	int recv_len = 0, answer_len;
-	int readmore = 0;
+	struct get_mtu_args args = { .ifindex = ifindex, .mtu = -1 };
+	int err;
 
 	err = netlink_open(&nlh, NETLINK_ROUTE);
 	if (err)
 		return err;
 
-	err = -ENOMEM;
-	nlmsg = nlmsg_alloc(NLMSG_GOOD_SIZE);
-	if (!nlmsg)
-		goto out;
-
-	answer = nlmsg_alloc(NLMSG_GOOD_SIZE);
-	if (!answer)
-		goto out;
-
-	/* Save the answer buffer length, since it will be overwritten
-	 * on the first receive (and we might need to receive more than
-	 * once. */
-	answer_len = answer->nlmsghdr.nlmsg_len;
-
-	ip_req = (struct ip_req *)nlmsg;
-	ip_req->nlmsg.nlmsghdr.nlmsg_len =
-		NLMSG_LENGTH(sizeof(struct ifaddrmsg));
-	ip_req->nlmsg.nlmsghdr.nlmsg_flags = NLM_F_REQUEST|NLM_F_DUMP;
-	ip_req->nlmsg.nlmsghdr.nlmsg_type = RTM_GETLINK;
-	ip_req->ifa.ifa_family = AF_UNSPEC;
-
-	/* Send the request for addresses, which returns all addresses
-	 * on all interfaces. */
-	err = netlink_send(&nlh, nlmsg);
+	err = netlink_dump(&nlh, RTM_GETLINK, sizeof(struct ifinfomsg),
+			   AF_UNSPEC, get_mtu_cb, &args);
+	netlink_close(&nlh);
 	if (err < 0)
-		goto out;
-
-	do {
-		/* Restore the answer buffer length, it might have been
-		 * overwritten by a previous receive. */
-		answer->nlmsghdr.nlmsg_len = answer_len;
-
-		/* Get the (next) batch of reply messages */
-		err = netlink_rcv(&nlh, answer);
-		if (err < 0)
-			goto out;
-
-		recv_len = err;
-		err = 0;
-
-		/* Satisfy the typing for the netlink macros */
-		msg = &answer->nlmsghdr;
-
-		while (NLMSG_OK(msg, recv_len)) {
-
-			/* Stop reading if we see an error message */
-			if (msg->nlmsg_type == NLMSG_ERROR) {
-				struct nlmsgerr *errmsg = (struct nlmsgerr*)NLMSG_DATA(msg);
-				err = errmsg->error;
-				goto out;
-			}
-
-			/* Stop reading if we see a NLMSG_DONE message */
-			if (msg->nlmsg_type == NLMSG_DONE) {
-				readmore = 0;
-				break;
-			}
-
-			struct ifinfomsg *ifi = NLMSG_DATA(msg);
-			if (ifi->ifi_index == ifindex) {
-				struct rtattr *rta = IFLA_RTA(ifi);
-				int attr_len = msg->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
-				res = 0;
-				while(RTA_OK(rta, attr_len)) {
-					/* Found a local address for the requested interface,
-					 * return it. */
-					if (rta->rta_type == IFLA_MTU) {
-						memcpy(&res, RTA_DATA(rta), sizeof(int));
-						err = res;
-						goto out;
-					}
-					rta = RTA_NEXT(rta, attr_len);
-				}
-
-			}
-
-			/* Keep reading more data from the socket if the
-			 * last message had the NLF_F_MULTI flag set */
-			readmore = (msg->nlmsg_flags & NLM_F_MULTI);
-
-			/* Look at the next message received in this buffer */
-			msg = NLMSG_NEXT(msg, recv_len);
-		}
-	} while (readmore);
-
-	/* If we end up here, we didn't find any result, so signal an
-	 * error */
-	err = -1;
+		return err;
 
-out:
-	netlink_close(&nlh);
-	nlmsg_free(answer);
-	nlmsg_free(nlmsg);
-	return err;
+	/* If we end up here without a result, signal an error */
+	return args.mtu;
 }
 
 int lxc_netdev_set_mtu(const char *name, int mtu)
 {
-	struct nl_handler nlh;
+	struct nl_handler nlh, *rtnl;
 	struct nlmsg *nlmsg = NULL, *answer = NULL;
 	struct link_req *link_req;
 	int index, len, err;
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh, &rtnl);
 	if (err)
 		return err;
 
@@ -447,9 +511,9 @@ int lxc_netdev_set_mtu(const char *name, int mtu)
 	if (nla_put_u32(nlmsg, IFLA_MTU, mtu))
 		goto out;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_request(rtnl, nlmsg, answer);
 out:
-	netlink_close(&nlh);
+	rtnl_close(&nlh, rtnl);
 	nlmsg_free(nlmsg);
 	nlmsg_free(answer);
 	return err;
@@ -465,15 +529,46 @@ int lxc_netdev_down(const char *name)
 	return netdev_set_flag(name, 0);
 }
 
-int lxc_veth_create(const char *name1, const char *name2)
+/*
+ * A random, locally administered mac address whose high byte is 0xfe, like
+ * the one setup_private_host_hw_addr() leaves on the host side of a veth
+ */
+static void private_host_hw_addr(unsigned char *hwaddr)
 {
-	struct nl_handler nlh;
+	FILE *urandom;
+	int i;
+
+	urandom = fopen("/dev/urandom", "r");
+	if (!urandom || fread(hwaddr, ETH_ALEN, 1, urandom) != 1) {
+		for (i = 0; i < ETH_ALEN; i++)
+			hwaddr[i] = rand();
+	}
+	if (urandom)
+		fclose(urandom);
+
+	hwaddr[0] = 0xfe;
+}
+
+static int bridge_attach_index(int master, const char *ifname)
+{
+	char bridge[IFNAMSIZ];
+
+	if (!if_indextoname(master, bridge))
+		return -errno;
+
+	return lxc_bridge_attach(bridge, ifname);
+}
+
+static int veth_create(const char *name1, const char *name2, int master,
+		       int mtu, const unsigned char *hwaddr, int up)
+{
+	struct nl_handler nlh, *rtnl;
 	struct nlmsg *nlmsg = NULL, *answer = NULL;
 	struct link_req *link_req;
 	struct rtattr *nest1, *nest2, *nest3;
 	int len, err;
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh, &rtnl);
 	if (err)
 		return err;
 
@@ -497,6 +592,10 @@ int lxc_veth_create(const char *name1, const char *name2)
 
 	link_req = (struct link_req *)nlmsg;
 	link_req->ifinfomsg.ifi_family = AF_UNSPEC;
+	if (up) {
+		link_req->ifinfomsg.ifi_flags = IFF_UP;
+		link_req->ifinfomsg.ifi_change = IFF_UP;
+	}
 	nlmsg->nlmsghdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
 	nlmsg->nlmsghdr.nlmsg_flags =
 		NLM_F_REQUEST|NLM_F_CREATE|NLM_F_EXCL|NLM_F_ACK;
@@ -523,6 +622,9 @@ int lxc_veth_create(const char *name1, const char *name2)
 	if (nla_put_string(nlmsg, IFLA_IFNAME, name2))
 		goto out;
 
+	if (mtu && nla_put_u32(nlmsg, IFLA_MTU, mtu))
+		goto out;
+
 	nla_end_nested(nlmsg, nest3);
 
 	nla_end_nested(nlmsg, nest2);
@@ -532,24 +634,185 @@ int lxc_veth_create(const char *name1, const char *name2)
 	if (nla_put_string(nlmsg, IFLA_IFNAME, name1))
 		goto out;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	if (mtu && nla_put_u32(nlmsg, IFLA_MTU, mtu))
+		goto out;
+
+	if (hwaddr && nla_put_buffer(nlmsg, IFLA_ADDRESS, hwaddr, ETH_ALEN))
+		goto out;
+
+	if (master && nla_put_u32(nlmsg, IFLA_MASTER, master))
+		goto out;
+
+	err = rtnl_request(rtnl, nlmsg, answer);
 out:
-	netlink_close(&nlh);
+	rtnl_close(&nlh, rtnl);
 	nlmsg_free(answer);
 	nlmsg_free(nlmsg);
 	return err;
 }
 
+int lxc_veth_create(const char *name1, const char *name2)
+{
+	return veth_create(name1, name2, 0, 0, NULL, 0);
+}
+
+int lxc_veth_create_bridged(const char *name1, const char *name2,
+			    int master, int mtu, int up)
+{
+	unsigned char hwaddr[ETH_ALEN];
+	char path[MAXPATHLEN];
+	int err;
+
+	private_host_hw_addr(hwaddr);
+	err = veth_create(name1, name2, master, mtu, hwaddr, up);
+	if (err || !master)
+		return err;
+
+	/* older kernels ignore IFLA_MASTER on creation */
+	snprintf(path, sizeof(path), "/sys/class/net/%s/brport", name1);
+	if (!access(path, F_OK))
+		return 0;
+
+	return bridge_attach_index(master, name1);
+}
+
+/*
+ * The veth pool: spare pairs named VETH_POOL_HOST/VETH_POOL_PEER followed
+ * by the same suffix, created down with their host side attached to a
+ * bridge.  A pair is claimed by renaming its host side, under a lock in
+ * the rundir since a rename by index could otherwise take a pair another
+ * claimer renamed in between.
+ */
+#define VETH_POOL_HOST "lxcp"
+#define VETH_POOL_PEER "lxcq"
+#define VETH_POOL_NAME VETH_POOL_HOST "XXXXXX"
+
+static int veth_pool_lock(void)
+{
+	char *rundir, path[MAXPATHLEN];
+	int fd, ret;
+
+	rundir = get_rundir();
+	if (!rundir)
+		return -ENOMEM;
+	ret = snprintf(path, sizeof(path), "%s/lxc/", rundir);
+	free(rundir);
+	if (ret < 0 || ret >= sizeof(path))
+		return -ENAMETOOLONG;
+
+	if (mkdir_p(path, 0755))
+		return -errno;
+	strncat(path, "veth-pool.lock", sizeof(path) - ret - 1);
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+
+	if (flock(fd, LOCK_EX)) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
+/* the host sides of the pooled pairs attached to @bridge */
+static int veth_pool_list(const char *bridge, char (*names)[IFNAMSIZ], int max)
+{
+	char path[MAXPATHLEN];
+	struct dirent *direntp;
+	DIR *dir;
+	int n = 0;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/brif", bridge);
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+
+	while (n < max && (direntp = readdir(dir))) {
+		if (strncmp(direntp->d_name, VETH_POOL_HOST,
+			    strlen(VETH_POOL_HOST)) ||
+		    strlen(direntp->d_name) != strlen(VETH_POOL_NAME))
+			continue;
+		strcpy(names[n++], direntp->d_name);
+	}
+
+	closedir(dir);
+	return n;
+}
+
+int lxc_veth_pool_claim(const char *bridge, const char *name, char *peer)
+{
+	char names[LXC_VETH_POOL_MAX][IFNAMSIZ];
+	int i, n, fd, err = -ENOENT;
+
+	fd = veth_pool_lock();
+	if (fd < 0)
+		return fd;
+
+	n = veth_pool_list(bridge, names, LXC_VETH_POOL_MAX);
+	for (i = 0; i < n; i++) {
+		err = lxc_netdev_rename_by_name(names[i], name);
+		/* deleted since we listed it */
+		if (err == -EINVAL || err == -ENODEV) {
+			err = -ENOENT;
+			continue;
+		}
+		if (!err)
+			snprintf(peer, IFNAMSIZ, "%s%s", VETH_POOL_PEER,
+				 names[i] + strlen(VETH_POOL_HOST));
+		break;
+	}
+
+	close(fd);
+	return err;
+}
+
+int lxc_veth_pool_fill(const char *bridge, int size)
+{
+	char names[LXC_VETH_POOL_MAX][IFNAMSIZ];
+	char template[IFNAMSIZ], peer[IFNAMSIZ], *host;
+	int n, master, err;
+
+	if (size > LXC_VETH_POOL_MAX)
+		size = LXC_VETH_POOL_MAX;
+
+	master = if_nametoindex(bridge);
+	if (!master)
+		return -errno;
+
+	n = veth_pool_list(bridge, names, LXC_VETH_POOL_MAX);
+	for (; n < size; n++) {
+		strcpy(template, VETH_POOL_NAME);
+		host = lxc_mkifname(template);
+		if (!host)
+			return -ENOMEM;
+		snprintf(peer, sizeof(peer), "%s%s", VETH_POOL_PEER,
+			 host + strlen(VETH_POOL_HOST));
+
+		err = lxc_veth_create_bridged(host, peer, master, 0, 0);
+		if (err) {
+			lxc_netdev_delete_by_name(host);
+			free(host);
+			return err;
+		}
+		free(host);
+	}
+
+	return 0;
+}
+
 /* XXX: merge with lxc_macvlan_create */
 int lxc_vlan_create(const char *master, const char *name, unsigned short vlanid)
 {
-	struct nl_handler nlh;
+	struct nl_handler nlh, *rtnl;
 	struct nlmsg *nlmsg = NULL, *answer = NULL;
 	struct link_req *link_req;
 	struct rtattr *nest, *nest2;
 	int lindex, len, err;
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh, &rtnl);
 	if (err)
 		return err;
 
@@ -607,25 +870,31 @@ int lxc_vlan_create(const char *master, const char *name, unsigned short vlanid)
 	if (nla_put_string(nlmsg, IFLA_IFNAME, name))
 		goto err1;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_request(rtnl, nlmsg, answer);
 err1:
 	nlmsg_free(answer);
 err2:
 	nlmsg_free(nlmsg);
 err3:
-	netlink_close(&nlh);
+	rtnl_close(&nlh, rtnl);
 	return err;
 }
 
-int lxc_macvlan_create(const char *master, const char *name, int mode)
+/*
+ * Create the @kind link @name on top of @master, with the @size bytes of
+ * @mode as its IFLA_INFO_DATA @mode_attr attribute if any
+ */
+static int lower_link_create(const char *kind, const char *master,
+			     const char *name, int mode_attr,
+			     const void *mode, int size)
 {
-	struct nl_handler nlh;
+	struct nl_handler nlh, *rtnl;
 	struct nlmsg *nlmsg = NULL, *answer = NULL;
 	struct link_req *link_req;
 	struct rtattr *nest, *nest2;
 	int index, len, err;
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh, &rtnl);
 	if (err)
 		return err;
 
@@ -663,7 +932,7 @@ int lxc_macvlan_create(const char *master, const char *name, int mode)
 	if (!nest)
 		goto out;
 
-	if (nla_put_string(nlmsg, IFLA_INFO_KIND, "macvlan"))
+	if (nla_put_string(nlmsg, IFLA_INFO_KIND, kind))
 		goto out;
 
 	if (mode) {
@@ -671,7 +940,7 @@ int lxc_macvlan_create(const char *master, const char *name, int mode)
 		if (!nest2)
 			goto out;
 
-		if (nla_put_u32(nlmsg, IFLA_MACVLAN_MODE, mode))
+		if (nla_put_buffer(nlmsg, mode_attr, mode, size))
 			goto out;
 
 		nla_end_nested(nlmsg, nest2);
@@ -685,14 +954,30 @@ int lxc_macvlan_create(const char *master, const char *name, int mode)
 	if (nla_put_string(nlmsg, IFLA_IFNAME, name))
 		goto out;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_request(rtnl, nlmsg, answer);
 out:
-	netlink_close(&nlh);
+	rtnl_close(&nlh, rtnl);
 	nlmsg_free(answer);
 	nlmsg_free(nlmsg);
 	return err;
 }
 
+int lxc_macvlan_create(const char *master, const char *name, int mode)
+{
+	__u32 m = mode;
+
+	return lower_link_create("macvlan", master, name, IFLA_MACVLAN_MODE,
+				 mode ? &m : NULL, sizeof(m));
+}
+
+int lxc_ipvlan_create(const char *master, const char *name, int mode)
+{
+	__u16 m = mode;
+
+	return lower_link_create("ipvlan", master, name, IFLA_IPVLAN_MODE,
+				 &m, sizeof(m));
+}
+
 static int proc_sys_net_write(const char *path, const char *value)
 {
 	int fd, err = 0;
@@ -809,9 +1094,10 @@ int lxc_convert_mac(char *macaddr, struct sockaddr *sockaddr)
 }
 
 static int ip_addr_add(int family, int ifindex,
-		       void *addr, void *bcast, void *acast, int prefix)
+		       void *addr, void *bcast, void *acast, int prefix,
+		       int flags)
 {
-	struct nl_handler nlh;
+	struct nl_handler nlh, *rtnl;
 	struct nlmsg *nlmsg = NULL, *answer = NULL;
 	struct ip_req *ip_req;
 	int addrlen;
@@ -820,7 +1106,7 @@ static int ip_addr_add(int family, int ifindex,
 	addrlen = family == AF_INET ? sizeof(struct in_addr) :
 		sizeof(struct in6_addr);
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh, &rtnl);
 	if (err)
 		return err;
 
@@ -843,6 +1129,7 @@ static int ip_addr_add(int family, int ifindex,
         ip_req->ifa.ifa_index = ifindex;
         ip_req->ifa.ifa_family = family;
 	ip_req->ifa.ifa_scope = 0;
+	ip_req->ifa.ifa_flags = flags;
 	
 	err = -EINVAL;
 	if (nla_put_buffer(nlmsg, IFA_LOCAL, addr, addrlen))
@@ -861,9 +1148,9 @@ static int ip_addr_add(int family, int ifindex,
 	     memcmp(acast, &in6addr_any, sizeof(in6addr_any))))
 		goto out;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_request(rtnl, nlmsg, answer);
 out:
-	netlink_close(&nlh);
+	rtnl_close(&nlh, rtnl);
 	nlmsg_free(answer);
 	nlmsg_free(nlmsg);
 	return err;
@@ -871,15 +1158,16 @@ out:
 
 int lxc_ipv6_addr_add(int ifindex, struct in6_addr *addr,
 		      struct in6_addr *mcast,
-		      struct in6_addr *acast, int prefix)
+		      struct in6_addr *acast, int prefix, int flags)
 {
-	return ip_addr_add(AF_INET6, ifindex, addr, mcast, acast, prefix);
+	return ip_addr_add(AF_INET6, ifindex, addr, mcast, acast, prefix,
+			   flags);
 }
 
 int lxc_ipv4_addr_add(int ifindex, struct in_addr *addr,
 		      struct in_addr *bcast, int prefix)
 {
-	return ip_addr_add(AF_INET, ifindex, addr, bcast, NULL, prefix);
+	return ip_addr_add(AF_INET, ifindex, addr, bcast, NULL, prefix, 0);
 }
 
 /* Find an IFA_LOCAL (or IFA_ADDRESS if not IFA_LOCAL is present)
@@ -887,152 +1175,79 @@ int lxc_ipv4_addr_add(int ifindex, struct in_addr *addr,
  * address and stores that pointer in *res (so res should be an
  * in_addr** or in6_addr**).
  */
-static int ifa_get_local_ip(int family, struct ip_req *ip_info, void** res) {
-	struct rtattr *rta = IFA_RTA(&ip_info->ifa);
-	int attr_len = IFA_PAYLOAD(&ip_info->nlmsg.nlmsghdr);
+static int ifa_get_local_ip(int family, struct nlmsghdr *msg, void** res) {
+	struct ifaddrmsg *ifa = NLMSG_DATA(msg);
+	struct rtattr *tb[IFA_LOCAL + 1], *rta;
 	int addrlen;
 
-	if (ip_info->ifa.ifa_family != family)
+	if (ifa->ifa_family != family)
 		return 0;
 
 	addrlen = family == AF_INET ? sizeof(struct in_addr) :
 		sizeof(struct in6_addr);
 
-	/* Loop over the rtattr's in this message */
-	while(RTA_OK(rta, attr_len)) {
-		/* Found a local address for the requested interface,
-		 * return it. */
-		if (rta->rta_type == IFA_LOCAL || rta->rta_type == IFA_ADDRESS) {
-			/* Sanity check. The family check above should
-			 * make sure the address length is correct, but
-			 * check here just in case */
-			if (RTA_PAYLOAD(rta) != addrlen)
-				return -1;
-
-			/* We might have found an IFA_ADDRESS before,
-			 * which we now overwrite with an IFA_LOCAL. */
-			if (!*res) {
-				*res = malloc(addrlen);
-				if (!*res)
-					return -1;
-			}
-
-			memcpy(*res, RTA_DATA(rta), addrlen);
-
-			if (rta->rta_type == IFA_LOCAL)
-				break;
-		}
-		rta = RTA_NEXT(rta, attr_len);
-	}
+	netlink_parse_attrs(tb, IFA_LOCAL, IFA_RTA(ifa), IFA_PAYLOAD(msg));
+	rta = tb[IFA_LOCAL] ? tb[IFA_LOCAL] : tb[IFA_ADDRESS];
+	if (!rta)
+		return 0;
+
+	/* Sanity check. The family check above should make sure the
+	 * address length is correct, but check here just in case */
+	if (RTA_PAYLOAD(rta) != addrlen)
+		return -1;
+
+	*res = malloc(addrlen);
+	if (!*res)
+		return -1;
+
+	memcpy(*res, RTA_DATA(rta), addrlen);
 	return 0;
 }
 
+struct ip_addr_get_args {
+	int family;
+	int ifindex;
+	void **res;
+};
+
+static int ip_addr_get_cb(struct nlmsghdr *msg, void *data)
+{
+	struct ip_addr_get_args *args = data;
+	struct ifaddrmsg *ifa = NLMSG_DATA(msg);
+
+	if (msg->nlmsg_type != RTM_NEWADDR)
+		return -1;
+
+	/* the first address found wins, the rest of the dump is drained */
+	if (*args->res || ifa->ifa_index != args->ifindex)
+		return 0;
+
+	return ifa_get_local_ip(args->family, msg, args->res);
+}
+
 static int ip_addr_get(int family, int ifindex, void **res)
 {
 	struct nl_handler nlh;
-	struct nlmsg *nlmsg = NULL, *answer = NULL;
-	struct ip_req *ip_req, *ip_info;
-	struct nlmsghdr *msg;
+	struct ip_addr_get_args args = {
+		.family = family,
+		.ifindex = ifindex,
+		.res = res,
+	};
 	int err;
-	int recv_len = 0, answer_len;
-	int readmore = 0;
 
 	err = netlink_open(&nlh, NETLINK_ROUTE);
 	if (err)
 		return err;
 
-	err = -ENOMEM;
-	nlmsg = nlmsg_alloc(NLMSG_GOOD_SIZE);
-	if (!nlmsg)
-		goto out;
-
-	answer = nlmsg_alloc(NLMSG_GOOD_SIZE);
-	if (!answer)
-		goto out;
-
-	/* Save the answer buffer length, since it will be overwritten
-	 * on the first receive (and we might need to receive more than
-	 * once. */
-	answer_len = answer->nlmsghdr.nlmsg_len;
-
-	ip_req = (struct ip_req *)nlmsg;
-	ip_req->nlmsg.nlmsghdr.nlmsg_len =
-		NLMSG_LENGTH(sizeof(struct ifaddrmsg));
-	ip_req->nlmsg.nlmsghdr.nlmsg_flags = NLM_F_REQUEST|NLM_F_ROOT;
-	ip_req->nlmsg.nlmsghdr.nlmsg_type = RTM_GETADDR;
-	ip_req->ifa.ifa_family = family;
-
-	/* Send the request for addresses, which returns all addresses
-	 * on all interfaces. */
-	err = netlink_send(&nlh, nlmsg);
+	/* returns all addresses of @family on all interfaces */
+	err = netlink_dump(&nlh, RTM_GETADDR, sizeof(struct ifaddrmsg),
+			   family, ip_addr_get_cb, &args);
+	netlink_close(&nlh);
 	if (err < 0)
-		goto out;
-
-	do {
-		/* Restore the answer buffer length, it might have been
-		 * overwritten by a previous receive. */
-		answer->nlmsghdr.nlmsg_len = answer_len;
-
-		/* Get the (next) batch of reply messages */
-		err = netlink_rcv(&nlh, answer);
-		if (err < 0)
-			goto out;
-
-		recv_len = err;
-		err = 0;
-
-		/* Satisfy the typing for the netlink macros */
-		msg = &answer->nlmsghdr;
-
-		while (NLMSG_OK(msg, recv_len)) {
-			/* Stop reading if we see an error message */
-			if (msg->nlmsg_type == NLMSG_ERROR) {
-				struct nlmsgerr *errmsg = (struct nlmsgerr*)NLMSG_DATA(msg);
-				err = errmsg->error;
-				goto out;
-			}
-
-			/* Stop reading if we see a NLMSG_DONE message */
-			if (msg->nlmsg_type == NLMSG_DONE) {
-				readmore = 0;
-				break;
-			}
-
-			if (msg->nlmsg_type != RTM_NEWADDR) {
-				err = -1;
-				goto out;
-			}
-
-			ip_info = (struct ip_req *)msg;
-			if (ip_info->ifa.ifa_index == ifindex) {
-				if (ifa_get_local_ip(family, ip_info, res) < 0) {
-					err = -1;
-					goto out;
-				}
-
-				/* Found a result, stop searching */
-				if (*res)
-					goto out;
-			}
-
-			/* Keep reading more data from the socket if the
-			 * last message had the NLF_F_MULTI flag set */
-			readmore = (msg->nlmsg_flags & NLM_F_MULTI);
-
-			/* Look at the next message received in this buffer */
-			msg = NLMSG_NEXT(msg, recv_len);
-		}
-	} while (readmore);
-
-	/* If we end up here, we didn't find any result, so signal an
-	 * error */
-	err = -1;
+		return err;
 
-out:
-	netlink_close(&nlh);
-	nlmsg_free(answer);
-	nlmsg_free(nlmsg);
-	return err;
+	/* If we end up here without a result, signal an error */
+	return *res ? 0 : -1;
 }
 
 int lxc_ipv6_addr_get(int ifindex, struct in6_addr **res)
@@ -1047,7 +1262,7 @@ int lxc_ipv4_addr_get(int ifindex, struct in_addr** res)
 
 static int ip_gateway_add(int family, int ifindex, void *gw)
 {
-	struct nl_handler nlh;
+	struct nl_handler nlh, *rtnl;
 	struct nlmsg *nlmsg = NULL, *answer = NULL;
 	struct rt_req *rt_req;
 	int addrlen;
@@ -1056,7 +1271,7 @@ static int ip_gateway_add(int family, int ifindex, void *gw)
 	addrlen = family == AF_INET ? sizeof(struct in_addr) :
 		sizeof(struct in6_addr);
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh, &rtnl);
 	if (err)
 		return err;
 
@@ -1092,9 +1307,9 @@ static int ip_gateway_add(int family, int ifindex, void *gw)
 	if (nla_put_u32(nlmsg, RTA_OIF, ifindex))
 		goto out;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_request(rtnl, nlmsg, answer);
 out:
-	netlink_close(&nlh);
+	rtnl_close(&nlh, rtnl);
 	nlmsg_free(answer);
 	nlmsg_free(nlmsg);
 	return err;
@@ -1112,7 +1327,7 @@ int lxc_ipv6_gateway_add(int ifindex, struct in6_addr *gw)
 
 static int ip_route_dest_add(int family, int ifindex, void *dest)
 {
-	struct nl_handler nlh;
+	struct nl_handler nlh, *rtnl;
 	struct nlmsg *nlmsg = NULL, *answer = NULL;
 	struct rt_req *rt_req;
 	int addrlen;
@@ -1121,7 +1336,7 @@ static int ip_route_dest_add(int family, int ifindex, void *dest)
 	addrlen = family == AF_INET ? sizeof(struct in_addr) :
 		sizeof(struct in6_addr);
 	
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh, &rtnl);
 	if (err)
 		return err;
 	
@@ -1152,9 +1367,9 @@ static int ip_route_dest_add(int family, int ifindex, void *dest)
 		goto out;
 	if (nla_put_u32(nlmsg, RTA_OIF, ifindex))
 		goto out;
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_request(rtnl, nlmsg, answer);
 out:
-	netlink_close(&nlh);
+	rtnl_close(&nlh, rtnl);
 	nlmsg_free(answer);
 	nlmsg_free(nlmsg);
 	return err;
@@ -1201,6 +1416,7 @@ int lxc_bridge_attach(const char *bridge, const char *ifname)
 	return err;
 }
 
+
 static const char* const lxc_network_types[LXC_NET_MAXCONFTYPE + 1] = {
 	[LXC_NET_EMPTY]   = "empty",
 	[LXC_NET_VETH]    = "veth",
@@ -1208,6 +1424,7 @@ static const char* const lxc_network_types[LXC_NET_MAXCONFTYPE + 1] = {
 	[LXC_NET_PHYS]    = "phys",
 	[LXC_NET_VLAN]    = "vlan",
 	[LXC_NET_NONE]    = "none",
+	[LXC_NET_IPVLAN]  = "ipvlan",
 };
 
 const char *lxc_net_type_to_str(int type)
@@ -1220,65 +1437,64 @@ const char *lxc_net_type_to_str(int type)
 static const char padchar[] =
 "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 
-char *lxc_mkifname(char *template)
+/* seeded once per process, a forked child seeds its own */
+static __thread unsigned int mkifname_seed;
+static __thread pid_t mkifname_pid;
+
+static unsigned int mkifname_rand(void)
 {
-	char *name = NULL;
-	int i = 0;
 	FILE *urandom;
-	unsigned int seed;
-	struct ifaddrs *ifaddr, *ifa;
-	int ifexists = 0;
-
-	/* Get all the network interfaces */
-	getifaddrs(&ifaddr);
-
-	/* Initialize the random number generator */
-	urandom = fopen ("/dev/urandom", "r");
-	if (urandom != NULL) {
-		if (fread (&seed, sizeof(seed), 1, urandom) <= 0)
-			seed = time(0);
-		fclose(urandom);
-	}
-	else
-		seed = time(0);
 
+	if (mkifname_pid != getpid()) {
+		mkifname_pid = getpid();
+		urandom = fopen("/dev/urandom", "r");
+		if (!urandom || fread(&mkifname_seed, sizeof(mkifname_seed),
+				      1, urandom) != 1)
+			mkifname_seed = time(NULL) ^ mkifname_pid;
+		if (urandom)
+			fclose(urandom);
 #ifndef HAVE_RAND_R
-	srand(seed);
+		srand(mkifname_seed);
 #endif
+	}
 
-	/* Generate random names until we find one that doesn't exist */
-	while(1) {
-		ifexists = 0;
-		name = strdup(template);
-
-		if (name == NULL)
-			return NULL;
-
-		for (i = 0; i < strlen(name); i++) {
-			if (name[i] == 'X') {
 #ifdef HAVE_RAND_R
-				name[i] = padchar[rand_r(&seed) % (strlen(padchar) - 1)];
+	return rand_r(&mkifname_seed);
 #else
-				name[i] = padchar[rand() % (strlen(padchar) - 1)];
+	return rand();
 #endif
-			}
-		}
+}
 
-		for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
-			if (strcmp(ifa->ifa_name, name) == 0) {
-				ifexists = 1;
-				break;
-			}
-		}
+/*
+ * Candidates are checked one by one with a lookup by name rather than
+ * against a dump of all the interfaces.  That is still racy, whoever
+ * creates the interface gets -EEXIST if somebody was faster.
+ */
+#define MKIFNAME_TRIES 100
 
-		if (ifexists == 0)
-			break;
+char *lxc_mkifname(char *template)
+{
+	char *name;
+	size_t i, len = strlen(template);
+	int tries;
 
-		free(name);
+	name = strdup(template);
+	if (!name)
+		return NULL;
+
+	for (tries = 0; tries < MKIFNAME_TRIES; tries++) {
+		for (i = 0; i < len; i++) {
+			if (template[i] == 'X')
+				name[i] = padchar[mkifname_rand() % (strlen(padchar) - 1)];
+		}
+
+		if (!if_nametoindex(name) && errno == ENODEV)
+			return name;
 	}
 
-	freeifaddrs(ifaddr);
-	return name;
+	free(name);
+	errno = EEXIST;
+	return NULL;
 }
 
 int setup_private_host_hw_addr(char *veth1)
@@ -1306,3 +1522,350 @@ int setup_private_host_hw_addr(char *veth1)
 
 	return 0;
 }
+
+/*
+ * Querying the interfaces and addresses of another network namespace.
+ *
+ * A netlink socket belongs to the network namespace it was created in, so
+ * we create one from a short-lived thread which did setns() into the
+ * target namespace, and then send it dump requests from this thread.
+ * Neither the caller nor a forked child ever has to switch namespaces.
+ */
+struct netns_open_args {
+	int netns_fd;
+	struct nl_handler *nlh;
+	int err;
+};
+
+static void *netns_netlink_open_thread(void *data)
+{
+	struct netns_open_args *args = data;
+
+	if (setns(args->netns_fd, CLONE_NEWNET)) {
+		args->err = -errno;
+		return NULL;
+	}
+	args->err = netlink_open(args->nlh, NETLINK_ROUTE);
+	return NULL;
+}
+
+static int netlink_open_in_netns(struct nl_handler *nlh, int netns_fd)
+{
+	struct netns_open_args args = {
+		.netns_fd = netns_fd,
+		.nlh = nlh,
+		.err = -1,
+	};
+	pthread_t thread;
+	int ret;
+
+	nlh->fd = -1;
+	ret = pthread_create(&thread, NULL, netns_netlink_open_thread, &args);
+	if (ret)
+		return -ret;
+	pthread_join(thread, NULL);
+
+	if (args.err && nlh->fd >= 0)
+		netlink_close(nlh);
+	return args.err;
+}
+
+struct netns_list {
+	char **names;
+	int *ifindex;	/* for links only */
+	size_t count, capacity;
+};
+
+static int netns_list_add(struct netns_list *list, const char *name, int ifindex)
+{
+	size_t i, capacity = list->capacity;
+
+	if (ifindex <= 0) {
+		/* keep entries other than links unique */
+		for (i = 0; i < list->count; i++)
+			if (strcmp(list->names[i], name) == 0)
+				return 0;
+	}
+
+	if (lxc_grow_array((void ***)&list->names, &list->capacity,
+			   list->count + 1, 16))
+		return -ENOMEM;
+	if (capacity != list->capacity) {
+		int *tmp = realloc(list->ifindex, list->capacity * sizeof(int));
+
+		if (!tmp)
+			return -ENOMEM;
+		list->ifindex = tmp;
+	}
+
+	list->names[list->count] = strdup(name);
+	if (!list->names[list->count])
+		return -ENOMEM;
+	list->ifindex[list->count++] = ifindex;
+	return 0;
+}
+
+static void netns_list_free(struct netns_list *list)
+{
+	lxc_free_array((void **)list->names, free);
+	free(list->ifindex);
+}
+
+static const char *netns_list_find(struct netns_list *links, int ifindex)
+{
+	size_t i;
+
+	for (i = 0; i < links->count; i++)
+		if (links->ifindex[i] == ifindex)
+			return links->names[i];
+	return NULL;
+}
+
+static int netns_link_cb(struct nlmsghdr *msg, void *data)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(msg);
+	struct rtattr *tb[IFLA_IFNAME + 1];
+
+	if (msg->nlmsg_type != RTM_NEWLINK)
+		return 0;
+
+	netlink_parse_attrs(tb, IFLA_IFNAME, IFLA_RTA(ifi),
+			    msg->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi)));
+	if (!tb[IFLA_IFNAME])
+		return 0;
+	return netns_list_add(data, RTA_DATA(tb[IFLA_IFNAME]), ifi->ifi_index);
+}
+
+struct netns_addr_filter {
+	struct netns_list *links;
+	struct netns_list *result;
+	const char *interface;
+	const char *family;
+	int scope;
+	bool labels_only;	/* only collect ipv4 labels, as interfaces */
+};
+
+static int netns_addr_cb(struct nlmsghdr *msg, void *data)
+{
+	struct netns_addr_filter *f = data;
+	struct ifaddrmsg *ifa = NLMSG_DATA(msg);
+	struct rtattr *tb[IFA_LABEL + 1];
+	void *addr = NULL, *local = NULL;
+	const char *name, *label = NULL;
+	char buf[INET6_ADDRSTRLEN];
+
+	if (msg->nlmsg_type != RTM_NEWADDR)
+		return 0;
+	if (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6)
+		return 0;
+
+	netlink_parse_attrs(tb, IFA_LABEL, IFA_RTA(ifa), IFA_PAYLOAD(msg));
+	if (tb[IFA_ADDRESS])
+		addr = RTA_DATA(tb[IFA_ADDRESS]);
+	if (tb[IFA_LOCAL])
+		local = RTA_DATA(tb[IFA_LOCAL]);
+	if (tb[IFA_LABEL])
+		label = RTA_DATA(tb[IFA_LABEL]);
+
+	/* like getifaddrs(), ipv4 addresses are reported under their label */
+	name = ifa->ifa_family == AF_INET && label ? label :
+		netns_list_find(f->links, ifa->ifa_index);
+	if (!name)
+		return 0;
+
+	if (f->labels_only)
+		return ifa->ifa_family == AF_INET ? netns_list_add(f->result, name, 0) : 0;
+
+	if (local)
+		addr = local;
+	if (!addr)
+		return 0;
+
+	if (ifa->ifa_family == AF_INET) {
+		if (f->family && strcmp(f->family, "inet"))
+			return 0;
+	} else {
+		struct in6_addr *in6 = addr;
+		int scope_id = 0;
+
+		if (f->family && strcmp(f->family, "inet6"))
+			return 0;
+
+		/* the scope id getifaddrs() would give */
+		if (IN6_IS_ADDR_LINKLOCAL(in6) || IN6_IS_ADDR_MC_LINKLOCAL(in6))
+			scope_id = ifa->ifa_index;
+		if (scope_id != f->scope)
+			return 0;
+	}
+
+	if (f->interface && strcmp(f->interface, name))
+		return 0;
+	else if (!f->interface && strcmp("lo", name) == 0)
+		return 0;
+
+	if (!inet_ntop(ifa->ifa_family, addr, buf, sizeof(buf)))
+		return 0;
+
+	return netns_list_add(f->result, buf, -1);
+}
+
+static int cmp_names(const void *p1, const void *p2)
+{
+	return strcmp(*(char * const *)p1, *(char * const *)p2);
+}
+
+static int netns_query(int netns_fd, const char *interface, const char *family,
+		       int scope, bool interfaces, char ***res)
+{
+	struct nl_handler nlh;
+	struct netns_list links = { }, addrs = { };
+	struct netns_list *result = interfaces ? &links : &addrs;
+	struct netns_addr_filter filter = {
+		.links = &links,
+		.result = result,
+		.interface = interface,
+		.family = family,
+		.scope = scope,
+		.labels_only = interfaces,
+	};
+	int err;
+
+	err = netlink_open_in_netns(&nlh, netns_fd);
+	if (err)
+		return err;
+
+	err = netlink_dump(&nlh, RTM_GETLINK, sizeof(struct ifinfomsg),
+			   AF_UNSPEC, netns_link_cb, &links);
+	if (!err)
+		err = netlink_dump(&nlh, RTM_GETADDR, sizeof(struct ifaddrmsg),
+				   AF_UNSPEC, netns_addr_cb, &filter);
+	netlink_close(&nlh);
+
+	if (err < 0) {
+		netns_list_free(&links);
+		netns_list_free(&addrs);
+		return err;
+	}
+
+	if (result->count)
+		qsort(result->names, result->count, sizeof(char *), cmp_names);
+	*res = result->names;
+	result->names = NULL;
+	err = result->count;
+
+	netns_list_free(&links);
+	netns_list_free(&addrs);
+	return err;
+}
+
+int lxc_netns_get_interfaces(int netns_fd, char ***names)
+{
+	return netns_query(netns_fd, NULL, NULL, 0, true, names);
+}
+
+int lxc_netns_get_ips(int netns_fd, const char *interface, const char *family,
+		      int scope, char ***addresses)
+{
+	return netns_query(netns_fd, interface, family, scope, false, addresses);
+}
+
+struct netdev_stats_name {
+	const char *name;
+	int idx;
+};
+
+struct netdev_stats_args {
+	struct netdev_stats_name *sorted;
+	int n;
+	struct lxc_netdev_stats *stats;
+	int *found;
+	int count;
+};
+
+static int cmp_stats_name(const void *p1, const void *p2)
+{
+	const struct netdev_stats_name *n1 = p1, *n2 = p2;
+
+	return strcmp(n1->name, n2->name);
+}
+
+static int netdev_stats_cb(struct nlmsghdr *msg, void *data)
+{
+	struct netdev_stats_args *args = data;
+	struct ifinfomsg *ifi = NLMSG_DATA(msg);
+	struct rtattr *tb[IFLA_STATS64 + 1];
+	struct rtnl_link_stats64 s64;
+	struct netdev_stats_name key, *match;
+	struct lxc_netdev_stats *stats;
+
+	if (msg->nlmsg_type != RTM_NEWLINK)
+		return 0;
+
+	netlink_parse_attrs(tb, IFLA_STATS64, IFLA_RTA(ifi),
+			    msg->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi)));
+	if (!tb[IFLA_IFNAME] || !tb[IFLA_STATS64])
+		return 0;
+
+	key.name = RTA_DATA(tb[IFLA_IFNAME]);
+	match = bsearch(&key, args->sorted, args->n, sizeof(key),
+			cmp_stats_name);
+	if (!match)
+		return 0;
+
+	/* the attribute is not necessarily aligned for the u64s */
+	memset(&s64, 0, sizeof(s64));
+	memcpy(&s64, RTA_DATA(tb[IFLA_STATS64]),
+	       MIN(RTA_PAYLOAD(tb[IFLA_STATS64]), sizeof(s64)));
+
+	stats = &args->stats[match->idx];
+	stats->rx_packets = s64.rx_packets;
+	stats->tx_packets = s64.tx_packets;
+	stats->rx_bytes = s64.rx_bytes;
+	stats->tx_bytes = s64.tx_bytes;
+	stats->rx_errors = s64.rx_errors;
+	stats->tx_errors = s64.tx_errors;
+	stats->rx_dropped = s64.rx_dropped;
+	stats->tx_dropped = s64.tx_dropped;
+	if (!args->found[match->idx])
+		args->count++;
+	args->found[match->idx] = 1;
+	return 0;
+}
+
+int lxc_netdev_get_stats(const char **names, int n,
+			 struct lxc_netdev_stats *stats, int *found)
+{
+	struct nl_handler nlh;
+	struct netdev_stats_args args = {
+		.n = n,
+		.stats = stats,
+		.found = found,
+	};
+	int i, err;
+
+	memset(stats, 0, n * sizeof(*stats));
+	memset(found, 0, n * sizeof(*found));
+	if (!n)
+		return 0;
+
+	args.sorted = malloc(n * sizeof(*args.sorted));
+	if (!args.sorted)
+		return -ENOMEM;
+	for (i = 0; i < n; i++) {
+		args.sorted[i].name = names[i];
+		args.sorted[i].idx = i;
+	}
+	qsort(args.sorted, n, sizeof(*args.sorted), cmp_stats_name);
+
+	err = netlink_open(&nlh, NETLINK_ROUTE);
+	if (err)
+		goto out;
+
+	err = netlink_dump(&nlh, RTM_GETLINK, sizeof(struct ifinfomsg),
+			   AF_UNSPEC, netdev_stats_cb, &args);
+	netlink_close(&nlh);
+
+out:
+	free(args.sorted);
+	return err < 0 ? err : args.count;
+}
@@ -23,6 +23,25 @@
 #ifndef __LXC_NETWORK_H
 #define __LXC_NETWORK_H
 
+/*
+ * Between lxc_rtnl_hold() and lxc_rtnl_release(), the calls below which
+ * change a device, an address or a route go through one rtnetlink socket
+ * instead of opening their own.  The socket belongs to the network
+ * namespace of the calling thread at the time it is held.  Holds nest.
+ */
+extern int lxc_rtnl_hold(void);
+extern void lxc_rtnl_release(void);
+
+/*
+ * Between lxc_rtnl_batch_begin() and lxc_rtnl_batch_end() those calls are
+ * queued and return 0 at once, lxc_rtnl_batch_end() sends them together
+ * and returns the first error.  It fills @errs with the error of each of
+ * the first @n calls, in order.  Calls which need the effect of a queued
+ * one, like looking up a device it creates, must wait for the end.
+ */
+extern int lxc_rtnl_batch_begin(void);
+extern int lxc_rtnl_batch_end(int *errs, int n);
+
 /*
  * Convert a string mac address to a socket structure
  */
@@ -63,7 +82,32 @@ extern int lxc_netdev_set_mtu(const char *name, int mtu);
  * Create a virtual network devices
  */
 extern int lxc_veth_create(const char *name1, const char *name2);
+
+/*
+ * Create a veth pair with the mtu of both sides, and the host side @name1
+ * given a private mac address (see setup_private_host_hw_addr), attached
+ * to the bridge of index @master and set up if asked, in one request.
+ * @master and @mtu can be 0
+ */
+extern int lxc_veth_create_bridged(const char *name1, const char *name2,
+				   int master, int mtu, int up);
+
+/*
+ * A pool of spare veth pairs kept down and attached to a bridge.
+ * lxc_veth_pool_fill() tops the pool of @bridge up to @size pairs,
+ * lxc_veth_pool_claim() renames the host side of one of them to @name and
+ * returns the name of its peer in @peer (IFNAMSIZ), or -ENOENT if the
+ * pool is empty
+ */
+#define LXC_VETH_POOL_MAX 64
+extern int lxc_veth_pool_fill(const char *bridge, int size);
+extern int lxc_veth_pool_claim(const char *bridge, const char *name, char *peer);
 extern int lxc_macvlan_create(const char *master, const char *name, int mode);
+
+/*
+ * Create an ipvlan interface on top of @master, in l2, l3 or l3s @mode
+ */
+extern int lxc_ipvlan_create(const char *master, const char *name, int mode);
 extern int lxc_vlan_create(const char *master, const char *name, unsigned short vid);
 
 /*
@@ -77,11 +121,11 @@ extern int lxc_ip_forward_on(const char *name, int family);
 extern int lxc_ip_forward_off(const char *name, int family);
 
 /*
- * Set ip address
+ * Set ip address, @flags are IFA_F_* flags like IFA_F_NODAD
  */
 extern int lxc_ipv6_addr_add(int ifindex, struct in6_addr *addr,
 			     struct in6_addr *mcast,
-			     struct in6_addr *acast, int prefix);
+			     struct in6_addr *acast, int prefix, int flags);
 
 extern int lxc_ipv4_addr_add(int ifindex, struct in_addr *addr,
 			     struct in_addr *bcast, int prefix);
@@ -139,4 +183,31 @@ extern char *lxc_mkifname(char *template);
 extern const char *lxc_net_type_to_str(int type);
 extern int setup_private_host_hw_addr(char *veth1);
 extern int netdev_get_mtu(int ifindex);
+
+/*
+ * Get the interface names, or the addresses, of the network namespace
+ * netns_fd refers to, without entering it.  The results are sorted, NULL
+ * terminated arrays.  Returns the number of entries, < 0 on failure.
+ */
+extern int lxc_netns_get_interfaces(int netns_fd, char ***names);
+extern int lxc_netns_get_ips(int netns_fd, const char *interface,
+			     const char *family, int scope, char ***addresses);
+
+/*
+ * Traffic counters of an interface, as the kernel reports them
+ */
+struct lxc_netdev_stats {
+	unsigned long long rx_packets, tx_packets;
+	unsigned long long rx_bytes, tx_bytes;
+	unsigned long long rx_errors, tx_errors;
+	unsigned long long rx_dropped, tx_dropped;
+};
+
+/*
+ * Get the counters of the @n interfaces @names of this network namespace
+ * from a single dump.  @found[i] is set if @names[i] was there.  Returns
+ * the number of interfaces found, < 0 on failure.
+ */
+extern int lxc_netdev_get_stats(const char **names, int n,
+				struct lxc_netdev_stats *stats, int *found);
 #endif
@@ -163,6 +163,108 @@ again:
 	return ret;
 }
 
+extern int netlink_rcv_buf(struct nl_handler *handler, struct nlmsghdr **buf)
+{
+	char *tmp;
+	int ret;
+
+	if (!handler->rcvbuf) {
+		handler->rcvbuf = malloc(NLMSG_GOOD_SIZE);
+		if (!handler->rcvbuf)
+			return -ENOMEM;
+		handler->rcvbuf_size = NLMSG_GOOD_SIZE;
+	}
+
+	/* the size of the next datagram, without taking it */
+again:
+	ret = recv(handler->fd, handler->rcvbuf, handler->rcvbuf_size,
+		   MSG_PEEK | MSG_TRUNC);
+	if (ret < 0) {
+		if (errno == EINTR)
+			goto again;
+		return -errno;
+	}
+
+	if (ret > handler->rcvbuf_size) {
+		tmp = realloc(handler->rcvbuf, ret);
+		if (!tmp)
+			return -ENOMEM;
+		handler->rcvbuf = tmp;
+		handler->rcvbuf_size = ret;
+	}
+
+	do {
+		ret = recv(handler->fd, handler->rcvbuf, handler->rcvbuf_size, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+
+	*buf = (struct nlmsghdr *)handler->rcvbuf;
+	return ret;
+}
+
+extern int netlink_dump(struct nl_handler *handler, int type, size_t hdrlen,
+			unsigned char family,
+			int (*cb)(struct nlmsghdr *msg, void *data), void *data)
+{
+	struct nlmsg *nlmsg;
+	struct nlmsghdr *msg;
+	int err, len;
+
+	nlmsg = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	if (!nlmsg)
+		return -ENOMEM;
+
+	nlmsg->nlmsghdr.nlmsg_len = NLMSG_LENGTH(hdrlen);
+	nlmsg->nlmsghdr.nlmsg_flags = NLM_F_REQUEST|NLM_F_DUMP;
+	nlmsg->nlmsghdr.nlmsg_type = type;
+	nlmsg->nlmsghdr.nlmsg_seq = ++handler->seq;
+	/* ifinfomsg, ifaddrmsg and rtmsg all start with the family */
+	*(unsigned char *)NLMSG_DATA(&nlmsg->nlmsghdr) = family;
+
+	err = netlink_send(handler, nlmsg);
+	nlmsg_free(nlmsg);
+	if (err < 0)
+		return err;
+
+	for (;;) {
+		len = netlink_rcv_buf(handler, &msg);
+		if (len <= 0)
+			return len ? len : -EIO;
+
+		for (; NLMSG_OK(msg, len); msg = NLMSG_NEXT(msg, len)) {
+			if (msg->nlmsg_seq != handler->seq)
+				continue;
+
+			if (msg->nlmsg_type == NLMSG_DONE)
+				return 0;
+
+			if (msg->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *errmsg = NLMSG_DATA(msg);
+				return errmsg->error;
+			}
+
+			err = cb(msg, data);
+			if (err < 0)
+				return err;
+
+			/* a single answer, not a multipart one */
+			if (!(msg->nlmsg_flags & NLM_F_MULTI))
+				return 0;
+		}
+	}
+}
+
+extern void netlink_parse_attrs(struct rtattr *tb[], int max,
+				struct rtattr *rta, int len)
+{
+	memset(tb, 0, sizeof(*tb) * (max + 1));
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+		if (rta->rta_type <= max)
+			tb[rta->rta_type] = rta;
+}
+
 extern int netlink_send(struct nl_handler *handler, struct nlmsg *nlmsg)
 {
         struct sockaddr_nl nladdr;
@@ -214,6 +316,129 @@ extern int netlink_transaction(struct nl_handler *handler,
 	return 0;
 }
 
+/* stays below the socket's send buffer, see netlink_open() */
+#define NL_BATCH_SIZE NLMSG_GOOD_SIZE
+
+extern int netlink_batch_init(struct nl_batch *batch, struct nl_handler *handler)
+{
+	memset(batch, 0, sizeof(*batch));
+	batch->handler = handler;
+	batch->buf = malloc(NL_BATCH_SIZE);
+	if (!batch->buf)
+		return -ENOMEM;
+	batch->seq = handler->seq + 1;
+	return 0;
+}
+
+/* send what is queued and wait for its acks */
+static int netlink_batch_flush(struct nl_batch *batch)
+{
+	struct nlmsg *answer;
+	struct nlmsghdr *hdr;
+	struct nlmsgerr *err;
+	int ret, len, idx, acked = batch->sent;
+	int queued = batch->count;
+
+	if (batch->sent == queued)
+		return 0;
+
+	ret = send(batch->handler->fd, batch->buf, batch->len, 0);
+	if (ret < 0)
+		return -errno;
+
+	answer = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	if (!answer)
+		return -ENOMEM;
+
+	while (acked < queued) {
+		answer->nlmsghdr.nlmsg_len = NLMSG_GOOD_SIZE;
+		len = netlink_rcv(batch->handler, answer);
+		if (len <= 0) {
+			ret = len ? len : -EIO;
+			goto out;
+		}
+
+		for (hdr = &answer->nlmsghdr; NLMSG_OK(hdr, len);
+		     hdr = NLMSG_NEXT(hdr, len)) {
+			if (hdr->nlmsg_type != NLMSG_ERROR)
+				continue;
+			idx = (int)(hdr->nlmsg_seq - batch->seq);
+			if (idx < batch->sent || idx >= queued)
+				continue;
+			err = (struct nlmsgerr *)NLMSG_DATA(hdr);
+			batch->errs[idx] = err->error;
+			acked++;
+		}
+	}
+	ret = 0;
+
+out:
+	batch->sent = queued;
+	batch->len = 0;
+	nlmsg_free(answer);
+	return ret;
+}
+
+extern int netlink_batch_add(struct nl_batch *batch, struct nlmsg *nlmsg)
+{
+	size_t len = NLMSG_ALIGN(nlmsg->nlmsghdr.nlmsg_len);
+	int *errs, ret;
+
+	if (len > NL_BATCH_SIZE)
+		return -EMSGSIZE;
+
+	if (batch->len + len > NL_BATCH_SIZE) {
+		ret = netlink_batch_flush(batch);
+		if (ret < 0)
+			return ret;
+	}
+
+	errs = realloc(batch->errs, (batch->count + 1) * sizeof(int));
+	if (!errs)
+		return -ENOMEM;
+	batch->errs = errs;
+	batch->errs[batch->count] = -EIO;
+
+	nlmsg->nlmsghdr.nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+	nlmsg->nlmsghdr.nlmsg_seq = batch->seq + batch->count;
+	batch->handler->seq = nlmsg->nlmsghdr.nlmsg_seq;
+	memcpy(batch->buf + batch->len, nlmsg, nlmsg->nlmsghdr.nlmsg_len);
+	memset(batch->buf + batch->len + nlmsg->nlmsghdr.nlmsg_len, 0,
+	       len - nlmsg->nlmsghdr.nlmsg_len);
+	batch->len += len;
+
+	return batch->count++;
+}
+
+extern int netlink_batch_commit(struct nl_batch *batch)
+{
+	int i, ret;
+
+	ret = netlink_batch_flush(batch);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < batch->count; i++)
+		if (batch->errs[i])
+			return batch->errs[i];
+	return 0;
+}
+
+extern int netlink_batch_error(struct nl_batch *batch, int idx)
+{
+	if (idx < 0 || idx >= batch->sent)
+		return -EINVAL;
+	return batch->errs[idx];
+}
+
+extern void netlink_batch_free(struct nl_batch *batch)
+{
+	free(batch->buf);
+	free(batch->errs);
+	batch->buf = NULL;
+	batch->errs = NULL;
+}
+
 extern int netlink_open(struct nl_handler *handler, int protocol)
 {
 	socklen_t socklen;
@@ -262,6 +487,9 @@ extern int netlink_close(struct nl_handler *handler)
 {
 	close(handler->fd);
 	handler->fd = -1;
+	free(handler->rcvbuf);
+	handler->rcvbuf = NULL;
+	handler->rcvbuf_size = 0;
 	return 0;
 }
 
@@ -44,12 +44,16 @@
  * @seq: the sequence number of the netlink messages
  * @local: the bind address
  * @peer: the peer address
+ * @rcvbuf: the buffer of netlink_rcv_buf(), kept until netlink_close()
+ * @rcvbuf_size: the size of @rcvbuf
  */
 struct nl_handler {
         int fd;
 	int seq;
         struct sockaddr_nl local;
         struct sockaddr_nl peer;
+	char *rcvbuf;
+	size_t rcvbuf_size;
 };
 
 /*
@@ -98,6 +102,44 @@ int netlink_close(struct nl_handler *handler);
  */
 int netlink_rcv(struct nl_handler *handler, struct nlmsg *nlmsg);
 
+/*
+ * netlink_rcv_buf: receive the next datagram from the kernel in the
+ *  receive buffer of the handler, which is grown to fit it. The messages
+ *  in it stay valid until the next receive on the handler.
+ *
+ * @handler: a handler to the netlink socket
+ * @buf: where to return the received messages
+ *
+ * Returns the length received, < 0 otherwise
+ */
+int netlink_rcv_buf(struct nl_handler *handler, struct nlmsghdr **buf);
+
+/*
+ * netlink_dump: send a dump request and call @cb on each message of the
+ *  multipart answer, in place in the receive buffer, until @cb returns
+ *  < 0 or the dump is done.
+ *
+ * @handler: a handler to the netlink socket
+ * @type: the request, RTM_GETLINK, RTM_GETADDR...
+ * @hdrlen: size of the family specific header of the request
+ * @family: the family of the request, it starts the header
+ * @cb: called for each message of the answer
+ * @data: passed to @cb
+ *
+ * Returns 0 on success, < 0 otherwise
+ */
+int netlink_dump(struct nl_handler *handler, int type, size_t hdrlen,
+		 unsigned char family,
+		 int (*cb)(struct nlmsghdr *msg, void *data), void *data);
+
+/*
+ * netlink_parse_attrs: point @tb[type] at the attribute of each type up
+ *  to @max in the @len bytes at @rta, without copying them. Types not
+ *  present are NULL, and the last one of a type wins.
+ */
+void netlink_parse_attrs(struct rtattr *tb[], int max, struct rtattr *rta,
+			 int len);
+
 /*
  * netlink_send: send a netlink message to the kernel. It is up
  *  to the caller to manage the allocate of the netlink message
@@ -123,6 +165,66 @@ int netlink_send(struct nl_handler *handler, struct nlmsg *nlmsg);
 int netlink_transaction(struct nl_handler *handler,
 			struct nlmsg *request, struct nlmsg *anwser);
 
+/*
+ * struct nl_batch : requests queued to be sent to the kernel in a single
+ *  sendmsg(), each with its own sequence number and NLM_F_ACK. The kernel
+ *  handles them in order and acks each, one failing doesn't stop the
+ *  others.
+ *
+ * @handler: the netlink socket the requests go through
+ * @buf: the queued requests, back to back
+ * @len: bytes queued in @buf
+ * @count: requests queued, and sent since the last netlink_batch_commit()
+ * @sent: requests already sent, when @buf filled up
+ * @seq: sequence number of the first request
+ * @errs: the error of each request, once acked
+ */
+struct nl_batch {
+	struct nl_handler *handler;
+	char *buf;
+	size_t len;
+	int count;
+	int sent;
+	int seq;
+	int *errs;
+};
+
+/*
+ * netlink_batch_init: start an empty batch of requests on @handler
+ *
+ * Returns 0 on success, < 0 otherwise
+ */
+int netlink_batch_init(struct nl_batch *batch, struct nl_handler *handler);
+
+/*
+ * netlink_batch_add: queue a copy of the request @nlmsg. The queue is
+ *  sent when it fills up, so the request may be handled by the time
+ *  this returns, or not before netlink_batch_commit().
+ *
+ * Returns the index of the request in the batch, < 0 otherwise
+ */
+int netlink_batch_add(struct nl_batch *batch, struct nlmsg *nlmsg);
+
+/*
+ * netlink_batch_commit: send what is queued and collect the acks of all
+ *  the requests of the batch. netlink_batch_error() then tells how each
+ *  went.
+ *
+ * Returns 0 if every request succeeded, the first error otherwise
+ */
+int netlink_batch_commit(struct nl_batch *batch);
+
+/*
+ * netlink_batch_error: the error of request @idx, once committed
+ */
+int netlink_batch_error(struct nl_batch *batch, int idx);
+
+/*
+ * netlink_batch_free: release the queue, requests not committed are
+ *  dropped
+ */
+void netlink_batch_free(struct nl_batch *batch);
+
 /*
  * nla_put_string: copy a null terminated string to a netlink message
  *  attribute
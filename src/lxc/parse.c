@@ -27,6 +27,10 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "parse.h"
 #include "config.h"
@@ -65,6 +69,71 @@ int lxc_file_for_each_line(const char *file, lxc_file_cb callback, void *data)
 	return err;
 }
 
+/*
+ * Same as lxc_file_for_each_line() but without reading the file through a
+ * copy: it is mapped private and each line is terminated in place, in
+ * the callback's hands it has no trailing newline.  The mapping gets one
+ * more zeroed byte than the file so that the last line is terminated
+ * even if the file doesn't end with a newline.  Files which can't be
+ * mapped, like the ones in /proc, are read the usual way.
+ */
+int lxc_file_for_each_line_mmap(const char *file, lxc_file_cb callback,
+				void *data)
+{
+	struct stat st;
+	char *buf, *line, *eol, *end;
+	size_t len;
+	int fd, err = 0, lineno = 0;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		SYSERROR("failed to open %s", file);
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size) {
+		close(fd);
+		return lxc_file_for_each_line(file, callback, data);
+	}
+
+	len = st.st_size + 1;
+	buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf != MAP_FAILED &&
+	    mmap(buf, st.st_size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(buf, len);
+		buf = MAP_FAILED;
+	}
+	close(fd);
+	if (buf == MAP_FAILED) {
+		SYSERROR("failed to map %s", file);
+		return -1;
+	}
+
+	end = buf + st.st_size;
+	*end = '\0';
+	for (line = buf; line < end; line = eol + 1) {
+		lineno++;
+		eol = memchr(line, '\n', end - line);
+		if (!eol)
+			eol = end;
+		*eol = '\0';
+		err = callback(line, data);
+		if (err) {
+			// callback rv > 0 means stop here
+			// callback rv < 0 means error
+			if (err < 0)
+				ERROR("Failed to parse config %s at line %d",
+				      file, lineno);
+			break;
+		}
+	}
+
+	munmap(buf, len);
+	return err;
+}
+
 int lxc_char_left_gc(const char *buffer, size_t len)
 {
 	int i;
@@ -0,0 +1,326 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "log.h"
+#include "rmtree.h"
+
+lxc_log_define(lxc_rmtree, lxc);
+
+#define RM_MAX_THREADS	8
+
+/*
+ * A directory being emptied.  @pending counts its subdirectories not yet
+ * removed, plus one while it is still being read; whoever drops it to
+ * zero removes the directory and drops its parent's count in turn.  @fd
+ * stays open until then, its subdirectories are opened and removed
+ * relative to it.  @name is the whole path for the top directory.
+ */
+struct rm_dir {
+	struct rm_dir *parent;
+	char *name;
+	int fd;
+	int pending;
+};
+
+/*
+ * @dev    : the device of the directory being removed, entries on other
+ *           ones are left alone
+ * @exclude: an entry of the top directory only removed if empty
+ * @kept   : @exclude was not empty, so neither is the top directory
+ * @stack  : directories waiting to be read
+ * @busy   : workers reading a directory, which may queue more
+ */
+struct rm_tree {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	dev_t dev;
+	const char *exclude;
+	bool kept;
+	struct rm_dir **stack;
+	size_t n, size;
+	int busy;
+	bool failed;
+};
+
+static bool rm_push(struct rm_tree *rt, struct rm_dir *d)
+{
+	struct rm_dir **s;
+
+	if (rt->n == rt->size) {
+		s = realloc(rt->stack, (rt->size ? rt->size * 2 : 64) * sizeof(*s));
+		if (!s)
+			return false;
+		rt->stack = s;
+		rt->size = rt->size ? rt->size * 2 : 64;
+	}
+	rt->stack[rt->n++] = d;
+	pthread_cond_signal(&rt->cond);
+	return true;
+}
+
+/* called with rt->lock held */
+static void rm_done(struct rm_tree *rt, struct rm_dir *d)
+{
+	struct rm_dir *parent;
+
+	int ret;
+
+	while (d && --d->pending == 0) {
+		if (d->fd >= 0)
+			close(d->fd);
+		parent = d->parent;
+		if (parent)
+			ret = unlinkat(parent->fd, d->name, AT_REMOVEDIR);
+		else
+			ret = rmdir(d->name);
+		if (ret < 0 && errno != ENOENT && (parent || !rt->kept)) {
+			SYSERROR("failed to remove %s", d->name);
+			rt->failed = true;
+		}
+		free(d->name);
+		free(d);
+		d = parent;
+	}
+}
+
+/* unlink @name in @fd, unless it is mounted from another device */
+static int rm_unlink(struct rm_tree *rt, int fd, const char *name)
+{
+	struct stat st;
+
+	if (unlinkat(fd, name, 0) == 0)
+		return 0;
+	if (errno == EBUSY && fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+	    st.st_dev != rt->dev)
+		return 0;
+	return -1;
+}
+
+/* remove @exclude from the top directory if it is empty */
+static int rm_exclude(struct rm_tree *rt, int fd, const char *path)
+{
+	if (unlinkat(fd, rt->exclude, AT_REMOVEDIR) == 0)
+		return 0;
+
+	switch (errno) {
+	case ENOTEMPTY:
+	case EEXIST:
+		INFO("Not deleting %s/%s", path, rt->exclude);
+		pthread_mutex_lock(&rt->lock);
+		rt->kept = true;
+		pthread_mutex_unlock(&rt->lock);
+		return 0;
+	case ENOTDIR:
+		if (unlinkat(fd, rt->exclude, 0) < 0)
+			INFO("failed to remove %s/%s", path, rt->exclude);
+		return 0;
+	default:
+		SYSERROR("failed to remove %s/%s", path, rt->exclude);
+		return -1;
+	}
+}
+
+static void rm_dir_entries(struct rm_tree *rt, struct rm_dir *d)
+{
+	struct dirent *direntp;
+	struct rm_dir *sub;
+	struct stat st;
+	bool failed = false;
+	DIR *dir = NULL;
+	int fd;
+
+	/* our parent's fd is open as long as we are pending */
+	if (d->parent)
+		d->fd = openat(d->parent->fd, d->name,
+			       O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	else
+		d->fd = open(d->name,
+			     O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	/* the stream gets a copy, ours is kept for the *at() calls */
+	fd = d->fd >= 0 ? fcntl(d->fd, F_DUPFD_CLOEXEC, 0) : -1;
+	if (fd < 0 || !(dir = fdopendir(fd))) {
+		SYSERROR("failed to open %s", d->name);
+		if (fd >= 0)
+			close(fd);
+		pthread_mutex_lock(&rt->lock);
+		rt->failed = true;
+		pthread_mutex_unlock(&rt->lock);
+		return;
+	}
+
+	while ((direntp = readdir(dir))) {
+		if (!strcmp(direntp->d_name, ".") ||
+		    !strcmp(direntp->d_name, ".."))
+			continue;
+
+		if (!d->parent && rt->exclude &&
+		    !strcmp(direntp->d_name, rt->exclude)) {
+			if (rm_exclude(rt, d->fd, d->name) < 0)
+				failed = true;
+			continue;
+		}
+
+		if (direntp->d_type != DT_DIR && direntp->d_type != DT_UNKNOWN) {
+			if (rm_unlink(rt, d->fd, direntp->d_name) < 0) {
+				SYSERROR("failed to delete %s/%s", d->name,
+					direntp->d_name);
+				failed = true;
+			}
+			continue;
+		}
+
+		if (fstatat(d->fd, direntp->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			SYSERROR("failed to stat %s/%s", d->name, direntp->d_name);
+			failed = true;
+			continue;
+		}
+		if (st.st_dev != rt->dev)
+			continue;
+		if (!S_ISDIR(st.st_mode)) {
+			if (rm_unlink(rt, d->fd, direntp->d_name) < 0) {
+				SYSERROR("failed to delete %s/%s", d->name,
+					direntp->d_name);
+				failed = true;
+			}
+			continue;
+		}
+
+		sub = malloc(sizeof(*sub));
+		if (sub && !(sub->name = strdup(direntp->d_name))) {
+			free(sub);
+			sub = NULL;
+		}
+		if (!sub) {
+			ERROR("out of memory");
+			failed = true;
+			continue;
+		}
+		sub->parent = d;
+		sub->fd = -1;
+		sub->pending = 1;
+		pthread_mutex_lock(&rt->lock);
+		d->pending++;
+		if (!rm_push(rt, sub)) {
+			d->pending--;
+			failed = true;
+			free(sub->name);
+			free(sub);
+		}
+		pthread_mutex_unlock(&rt->lock);
+	}
+	closedir(dir);
+
+	if (failed) {
+		pthread_mutex_lock(&rt->lock);
+		rt->failed = true;
+		pthread_mutex_unlock(&rt->lock);
+	}
+}
+
+static void *rm_worker(void *arg)
+{
+	struct rm_tree *rt = arg;
+	struct rm_dir *d;
+
+	pthread_mutex_lock(&rt->lock);
+	for (;;) {
+		while (rt->n == 0 && rt->busy > 0)
+			pthread_cond_wait(&rt->cond, &rt->lock);
+		if (rt->n == 0)
+			break;
+		d = rt->stack[--rt->n];
+		rt->busy++;
+		pthread_mutex_unlock(&rt->lock);
+
+		rm_dir_entries(rt, d);
+
+		pthread_mutex_lock(&rt->lock);
+		rm_done(rt, d);
+		rt->busy--;
+		if (rt->n == 0 && rt->busy == 0)
+			pthread_cond_broadcast(&rt->cond);
+	}
+	pthread_mutex_unlock(&rt->lock);
+	return NULL;
+}
+
+int lxc_remove_tree(const char *path, const char *exclude)
+{
+	struct rm_tree rt;
+	struct rm_dir *root;
+	struct stat st;
+	pthread_t threads[RM_MAX_THREADS];
+	long ncpus;
+	int i, nthreads, started = 0;
+
+	if (lstat(path, &st) < 0) {
+		SYSERROR("failed to stat %s", path);
+		return -1;
+	}
+
+	memset(&rt, 0, sizeof(rt));
+	pthread_mutex_init(&rt.lock, NULL);
+	pthread_cond_init(&rt.cond, NULL);
+	rt.dev = st.st_dev;
+	rt.exclude = exclude;
+
+	root = malloc(sizeof(*root));
+	if (!root || !(root->name = strdup(path))) {
+		ERROR("out of memory");
+		free(root);
+		rt.failed = true;
+		goto out;
+	}
+	root->parent = NULL;
+	root->fd = -1;
+	root->pending = 1;
+	rm_push(&rt, root);
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpus > 0 ? MIN(ncpus, RM_MAX_THREADS) : 1;
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, rm_worker, &rt))
+			break;
+		started++;
+	}
+	/* the caller is a worker too */
+	rm_worker(&rt);
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+
+	DEBUG("removed %s with %d threads", path, started + 1);
+out:
+	free(rt.stack);
+	pthread_cond_destroy(&rt.cond);
+	pthread_mutex_destroy(&rt.lock);
+	return rt.failed ? -1 : 0;
+}
@@ -0,0 +1,30 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef __LXC_RMTREE_H
+#define __LXC_RMTREE_H
+
+/*
+ * Remove directory @path and everything under it which is on the same
+ * device, with several threads each emptying directories.  If set,
+ * @exclude names an entry of @path which is only removed if it is empty,
+ * in which case @path stays too.  Returns 0 on success, -1 if anything
+ * could not be removed.
+ */
+extern int lxc_remove_tree(const char *path, const char *exclude);
+
+#endif
@@ -26,12 +26,23 @@
 #include <stdlib.h>
 #include <seccomp.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
 #include <seccomp.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
+#include <linux/filter.h>
 
 #include "config.h"
 #include "lxcseccomp.h"
 #include "log.h"
+#include "utils.h"
+
+#ifndef SECCOMP_MODE_FILTER
+#define SECCOMP_MODE_FILTER 2
+#endif
 
 lxc_log_define(lxc_seccomp, lxc);
 
@@ -139,6 +150,25 @@ int get_hostarch(void)
 	return lxc_seccomp_arch_unknown;
 }
 
+/*
+ * Have libseccomp sort the syscalls of the policy into a binary tree
+ * instead of testing them one after the other, which makes each syscall
+ * of the container pay for the hundreds of rules of a large whitelist.
+ * Older libseccomp only know the linear chain.
+ */
+#if defined(SCMP_VER_MAJOR) && \
+    (SCMP_VER_MAJOR > 2 || (SCMP_VER_MAJOR == 2 && SCMP_VER_MINOR >= 5))
+static void optimize_ctx(scmp_filter_ctx ctx)
+{
+	if (seccomp_attr_set(ctx, SCMP_FLTATR_CTL_OPTIMIZE, 2))
+		WARN("failed to ask for a binary tree seccomp filter");
+}
+#else
+static void optimize_ctx(scmp_filter_ctx ctx)
+{
+}
+#endif
+
 scmp_filter_ctx get_new_ctx(enum lxc_hostarch_t n_arch, uint32_t default_policy_action)
 {
 	scmp_filter_ctx ctx;
@@ -161,6 +191,8 @@ scmp_filter_ctx get_new_ctx(enum lxc_hostarch_t n_arch, uint32_t default_policy_
 		seccomp_release(ctx);
 		return NULL;
 	}
+	/* seccomp_merge() wants the same attributes as the main ctx */
+	optimize_ctx(ctx);
 	ret = seccomp_arch_add(ctx, arch);
 	if (ret != 0) {
 		ERROR("Seccomp error %d (%s) adding arch: %d", ret,
@@ -274,6 +306,7 @@ static int parse_config_v2(FILE *f, char *line, struct lxc_conf *conf)
 			return -1;
 		}
 	}
+	optimize_ctx(conf->seccomp_ctx);
 
 	while (fgets(line, 1024, f)) {
 
@@ -487,16 +520,181 @@ static bool use_seccomp(void)
 	return true;
 }
 
-int lxc_read_seccomp_config(struct lxc_conf *conf)
+/*
+ * Compiling a policy means resolving every syscall it names for each
+ * architecture, which is most of the time spent starting or attaching to
+ * a container.  So the BPF program of each policy is kept in
+ * <rundir>/lxc/seccomp/<hash>-<machine>.bpf, behind this header, and
+ * loaded from there as is as long as the policy file, lxc and libseccomp
+ * do not change: @hash covers them all.
+ */
+#define LXC_SECCOMP_CACHE_MAGIC 0x6c786362 /* "lxcb" */
+
+struct lxc_seccomp_cache_hdr {
+	uint32_t magic;
+	uint32_t len;	/* number of instructions following */
+	uint64_t hash;
+};
+
+static char *seccomp_cache_path(uint64_t hash)
+{
+	struct utsname u;
+	char *rundir, *path;
+	size_t len;
+
+	if (uname(&u) < 0)
+		return NULL;
+	rundir = get_rundir();
+	if (!rundir)
+		return NULL;
+
+	len = strlen(rundir) + strlen(u.machine) + 40;
+	path = malloc(len);
+	if (path)
+		snprintf(path, len, "%s/lxc/seccomp/%016llx-%s.bpf", rundir,
+			 (unsigned long long)hash, u.machine);
+	free(rundir);
+	return path;
+}
+
+static int seccomp_cache_read(int fd, off_t off, uint64_t hash,
+			      struct lxc_conf *conf)
+{
+	struct lxc_seccomp_cache_hdr hdr;
+	struct sock_filter *bpf;
+	size_t size;
+
+	if (pread(fd, &hdr, sizeof(hdr), off) != sizeof(hdr))
+		return -1;
+	if (hdr.magic != LXC_SECCOMP_CACHE_MAGIC || hdr.hash != hash ||
+	    hdr.len == 0 || hdr.len > BPF_MAXINSNS)
+		return -1;
+
+	size = hdr.len * sizeof(*bpf);
+	bpf = malloc(size);
+	if (!bpf)
+		return -1;
+	if (pread(fd, bpf, size, off + sizeof(hdr)) != size) {
+		free(bpf);
+		return -1;
+	}
+
+	conf->seccomp_bpf = bpf;
+	conf->seccomp_bpf_len = hdr.len;
+	return 0;
+}
+
+static int seccomp_cache_lookup(const char *path, uint64_t hash,
+				struct lxc_conf *conf)
+{
+	int fd, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ret = seccomp_cache_read(fd, 0, hash, conf);
+	close(fd);
+	return ret;
+}
+
+/*
+ * Export the policy just compiled in conf->seccomp_ctx to the cache and
+ * use it from there.  Failing that, conf->seccomp_ctx is loaded as usual.
+ */
+static void seccomp_cache_store(const char *path, uint64_t hash,
+				struct lxc_conf *conf)
+{
+	struct lxc_seccomp_cache_hdr hdr = {
+		.magic = LXC_SECCOMP_CACHE_MAGIC,
+		.hash = hash,
+	};
+	char *dir, *tmp;
+	struct stat st;
+	int fd;
+
+	dir = strdup(path);
+	tmp = malloc(strlen(path) + 8);
+	if (!dir || !tmp)
+		goto out;
+	if (mkdir_p(dirname(dir), 0700) < 0)
+		goto out;
+
+	sprintf(tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto out;
+
+	if (lxc_write_nointr(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    seccomp_export_bpf(
+#if HAVE_SCMP_FILTER_CTX
+			conf->seccomp_ctx,
+#endif
+			fd) < 0 ||
+	    fstat(fd, &st) < 0)
+		goto bad;
+
+	hdr.len = (st.st_size - sizeof(hdr)) / sizeof(struct sock_filter);
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    seccomp_cache_read(fd, 0, hash, conf) < 0 ||
+	    rename(tmp, path) < 0)
+		goto bad;
+
+	close(fd);
+	INFO("cached the seccomp policy in %s", path);
+	goto out;
+
+bad:
+	WARN("failed to cache the seccomp policy in %s", path);
+	close(fd);
+	unlink(tmp);
+out:
+	free(dir);
+	free(tmp);
+}
+
+static char *read_policy(const char *path, size_t *len)
 {
+	char *buf = NULL, *tmp;
+	size_t size = 0;
 	FILE *f;
-	int ret;
 
-	if (!conf->seccomp)
-		return 0;
+	f = fopen(path, "r");
+	if (!f) {
+		SYSERROR("failed to open seccomp policy file %s", path);
+		return NULL;
+	}
+
+	*len = 0;
+	for (;;) {
+		if (*len == size) {
+			size += 4096;
+			tmp = realloc(buf, size);
+			if (!tmp)
+				goto err;
+			buf = tmp;
+		}
+		*len += fread(buf + *len, 1, size - *len, f);
+		if (*len < size)
+			break;
+	}
+	if (ferror(f)) {
+		SYSERROR("failed to read seccomp policy file %s", path);
+		goto err;
+	}
+	fclose(f);
+	return buf;
+
+err:
+	fclose(f);
+	free(buf);
+	return NULL;
+}
+
+static int lxc_seccomp_parse(struct lxc_conf *conf, char *policy, size_t len)
+{
+	FILE *f;
+	int ret;
 
-	if (!use_seccomp())
-		return 0;
 #if HAVE_SCMP_FILTER_CTX
 	/* XXX for debug, pass in SCMP_ACT_TRAP */
 	conf->seccomp_ctx = seccomp_init(SCMP_ACT_KILL);
@@ -520,9 +718,9 @@ int lxc_read_seccomp_config(struct lxc_conf *conf)
 		return -1;
 	}
 
-	f = fopen(conf->seccomp, "r");
+	f = fmemopen(policy, len, "r");
 	if (!f) {
-		SYSERROR("failed to open seccomp policy file %s", conf->seccomp);
+		SYSERROR("failed to read seccomp policy file %s", conf->seccomp);
 		return -1;
 	}
 	ret = parse_config(f, conf);
@@ -530,6 +728,55 @@ int lxc_read_seccomp_config(struct lxc_conf *conf)
 	return ret;
 }
 
+int lxc_read_seccomp_config(struct lxc_conf *conf)
+{
+	char *policy, *cache;
+	size_t len;
+	uint64_t hash;
+	int ret;
+
+	if (!conf->seccomp)
+		return 0;
+
+	if (!use_seccomp())
+		return 0;
+
+	policy = read_policy(conf->seccomp, &len);
+	if (!policy)
+		return -1;
+	if (len == 0) {
+		ERROR("empty seccomp policy file %s", conf->seccomp);
+		free(policy);
+		return -1;
+	}
+
+	hash = fnv_64a_buf(VERSION, strlen(VERSION), FNV1A_64_INIT);
+	hash = fnv_64a_buf(policy, len, hash);
+#ifdef SCMP_VER_MAJOR
+	{
+		unsigned int v[] = { SCMP_VER_MAJOR, SCMP_VER_MINOR, SCMP_VER_MICRO };
+
+		hash = fnv_64a_buf(v, sizeof(v), hash);
+	}
+#endif
+	free(conf->seccomp_bpf);
+	conf->seccomp_bpf = NULL;
+	cache = seccomp_cache_path(hash);
+	if (cache && seccomp_cache_lookup(cache, hash, conf) == 0) {
+		INFO("using the seccomp policy cached in %s", cache);
+		free(cache);
+		free(policy);
+		return 0;
+	}
+
+	ret = lxc_seccomp_parse(conf, policy, len);
+	if (ret == 0 && cache)
+		seccomp_cache_store(cache, hash, conf);
+	free(cache);
+	free(policy);
+	return ret;
+}
+
 int lxc_seccomp_load(struct lxc_conf *conf)
 {
 	int ret;
@@ -537,6 +784,18 @@ int lxc_seccomp_load(struct lxc_conf *conf)
 		return 0;
 	if (!use_seccomp())
 		return 0;
+	if (conf->seccomp_bpf) {
+		struct sock_fprog prog = {
+			.len = conf->seccomp_bpf_len,
+			.filter = conf->seccomp_bpf,
+		};
+
+		if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog, 0, 0) < 0) {
+			SYSERROR("Error loading the seccomp policy");
+			return -1;
+		}
+		return 0;
+	}
 	ret = seccomp_load(
 #if HAVE_SCMP_FILTER_CTX
 			conf->seccomp_ctx
@@ -560,4 +819,7 @@ void lxc_seccomp_free(struct lxc_conf *conf) {
 		conf->seccomp_ctx = NULL;
 	}
 #endif
+	free(conf->seccomp_bpf);
+	conf->seccomp_bpf = NULL;
+	conf->seccomp_bpf_len = 0;
 }
@@ -33,8 +33,11 @@
 #include <fcntl.h>
 #include <grp.h>
 #include <poll.h>
+#include <time.h>
+#include <inttypes.h>
 #include <sys/param.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -64,12 +67,16 @@
 #include "lxcutmp.h"
 #include "monitor.h"
 #include "commands.h"
+#include "status.h"
 #include "console.h"
 #include "sync.h"
+#include "memevents.h"
 #include "namespace.h"
 #include "lxcseccomp.h"
 #include "caps.h"
 #include "bdev.h"
+#include "cpuset.h"
+#include "lxccontainer.h"
 #include "lsm/lsm.h"
 
 lxc_log_define(lxc_start, lxc);
@@ -83,6 +90,80 @@ const struct ns_info ns_info[LXC_NS_MAX] = {
 	[LXC_NS_NET] = {"net", CLONE_NEWNET}
 };
 
+struct lxc_ns_cache *lxc_ns_cache_new(void)
+{
+	struct lxc_ns_cache *cache;
+
+	cache = malloc(sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	cache->pid = -1;
+	cache->procfd = -1;
+	return cache;
+}
+
+void lxc_ns_cache_clear(struct lxc_ns_cache *cache)
+{
+	if (cache->procfd >= 0)
+		close(cache->procfd);
+	cache->procfd = -1;
+	cache->pid = -1;
+}
+
+void lxc_ns_cache_free(struct lxc_ns_cache *cache)
+{
+	if (!cache)
+		return;
+	lxc_ns_cache_clear(cache);
+	free(cache);
+}
+
+/*
+ * lxc_ns_cache_get: Open namespace @ns of process @pid
+ *
+ * The fd belongs to the caller.  The cached /proc/<pid> directory is
+ * dropped when asked for another pid, or when the process it was opened
+ * for is gone: lookups below a /proc/<pid> directory fd fail once its
+ * process has exited, even if the pid has been reused since.
+ *
+ * Returns the fd, < 0 on failure
+ */
+int lxc_ns_cache_get(struct lxc_ns_cache *cache, pid_t pid, int ns)
+{
+	char path[MAXPATHLEN];
+	struct stat st;
+	int fd;
+
+	if (ns < 0 || ns >= LXC_NS_MAX)
+		return -1;
+
+	if (cache->pid == pid && fstatat(cache->procfd, "ns", &st, 0) < 0)
+		lxc_ns_cache_clear(cache);
+
+	if (cache->pid != pid) {
+		lxc_ns_cache_clear(cache);
+		snprintf(path, MAXPATHLEN, "/proc/%d", pid);
+		cache->procfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (cache->procfd < 0) {
+			SYSERROR("failed to open '%s'", path);
+			return -1;
+		}
+		cache->pid = pid;
+	}
+
+	snprintf(path, MAXPATHLEN, "ns/%s", ns_info[ns].proc_name);
+	fd = openat(cache->procfd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		/* a namespace this kernel lacks, up to the caller */
+		if (errno != ENOENT)
+			SYSERROR("failed to open '/proc/%d/%s'", pid, path);
+		return -1;
+	}
+
+	return fd;
+}
+
 static void print_top_failing_dir(const char *path)
 {
 	size_t len = strlen(path);
@@ -165,18 +246,88 @@ error:
 	return -1;
 }
 
-static int match_fd(int fd)
+static int lxc_close_range(unsigned int first, unsigned int last)
+{
+#ifdef __NR_close_range
+	return syscall(__NR_close_range, first, last, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int cmp_fd(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * Fill @keep with the fds lxc_check_inherited() leaves alone: stdio, the
+ * log and @fd_to_ignore, sorted and without duplicates.  Returns how many.
+ */
+static int inherited_keep_set(int keep[5], int fd_to_ignore)
+{
+	int i, n = 0, nkeep = 0;
+
+	keep[n++] = 0;
+	keep[n++] = 1;
+	keep[n++] = 2;
+	if (lxc_log_fd >= 0)
+		keep[n++] = lxc_log_fd;
+	if (fd_to_ignore >= 0)
+		keep[n++] = fd_to_ignore;
+
+	qsort(keep, n, sizeof(int), cmp_fd);
+	for (i = 0; i < n; i++)
+		if (!nkeep || keep[nkeep - 1] != keep[i])
+			keep[nkeep++] = keep[i];
+	return nkeep;
+}
+
+static bool inherited_keep(const int *keep, int nkeep, int fd)
 {
-	return (fd == 0 || fd == 1 || fd == 2);
+	return bsearch(&fd, keep, nkeep, sizeof(int), cmp_fd) != NULL;
+}
+
+/* close everything but @keep in one close_range() per gap */
+static int close_inherited_range(const int *keep, int nkeep)
+{
+	int i;
+
+	for (i = 0; i < nkeep; i++) {
+		unsigned int first = keep[i] + 1;
+		unsigned int last = i + 1 < nkeep ? keep[i + 1] - 1 : ~0U;
+
+		if (first > last)
+			continue;
+		if (lxc_close_range(first, last) < 0) {
+			/* the ones before were closed, the scan skips them */
+			if (errno != ENOSYS && errno != EINVAL)
+				SYSERROR("failed to close fds %u-%u", first, last);
+			return -1;
+		}
+	}
+
+	INFO("closed inherited fds");
+	return 0;
 }
 
 int lxc_check_inherited(struct lxc_conf *conf, int fd_to_ignore)
 {
 	struct dirent dirent, *direntp;
-	int fd, fddir;
+	int keep[5], nkeep, fd, fddir, i;
+	int *fds = NULL, *tmp, nfds = 0, size = 0;
 	DIR *dir;
 
-restart:
+	nkeep = inherited_keep_set(keep, fd_to_ignore);
+
+	/* the cached monitor fifo goes with the rest */
+	if (conf->close_all_fds)
+		lxc_monitor_fifo_forget();
+
+	if (conf->close_all_fds && close_inherited_range(keep, nkeep) == 0)
+		return 0;
+
 	dir = opendir("/proc/self/fd");
 	if (!dir) {
 		WARN("failed to open directory: %m");
@@ -197,22 +348,36 @@ restart:
 
 		fd = atoi(direntp->d_name);
 
-		if (fd == fddir || fd == lxc_log_fd || fd == fd_to_ignore)
+		if (fd == fddir || inherited_keep(keep, nkeep, fd))
 			continue;
 
-		if (match_fd(fd))
+		if (!conf->close_all_fds) {
+			WARN("inherited fd %d", fd);
 			continue;
+		}
 
-		if (conf->close_all_fds) {
-			close(fd);
-			closedir(dir);
-			INFO("closed inherited fd %d", fd);
-			goto restart;
+		/* closed once the walk is done, it doesn't have to restart */
+		if (nfds == size) {
+			size = size ? size * 2 : 64;
+			tmp = realloc(fds, size * sizeof(int));
+			if (!tmp) {
+				ERROR("failed to allocate memory");
+				free(fds);
+				closedir(dir);
+				return -1;
+			}
+			fds = tmp;
 		}
-		WARN("inherited fd %d", fd);
+		fds[nfds++] = fd;
 	}
 
 	closedir(dir); /* cannot fail */
+
+	for (i = 0; i < nfds; i++) {
+		close(fds[i]);
+		INFO("closed inherited fd %d", fds[i]);
+	}
+	free(fds);
 	return 0;
 }
 
@@ -252,22 +417,24 @@ static int setup_signal_fd(sigset_t *oldmask)
 static int signal_handler(int fd, uint32_t events, void *data,
 			   struct lxc_epoll_descr *descr)
 {
-	struct signalfd_siginfo siginfo;
+	/* take everything pending in one go rather than a loop turn each */
+	struct signalfd_siginfo siginfo[16];
 	siginfo_t info;
-	int ret;
+	int i, n, ret;
 	pid_t *pid = data;
 	bool init_died = false;
 
-	ret = read(fd, &siginfo, sizeof(siginfo));
+	ret = read(fd, siginfo, sizeof(siginfo));
 	if (ret < 0) {
 		ERROR("failed to read signal info");
 		return -1;
 	}
 
-	if (ret != sizeof(siginfo)) {
+	if (ret % sizeof(siginfo[0]) || !ret) {
 		ERROR("unexpected siginfo size");
 		return -1;
 	}
+	n = ret / sizeof(siginfo[0]);
 
 	// check whether init is running
 	info.si_pid = 0;
@@ -276,84 +443,321 @@ static int signal_handler(int fd, uint32_t events, void *data,
 		init_died = true;
 	}
 
-	if (siginfo.ssi_signo != SIGCHLD) {
-		kill(*pid, siginfo.ssi_signo);
-		INFO("forwarded signal %d to pid %d", siginfo.ssi_signo, *pid);
-		return init_died ? 1 : 0;
-	}
+	for (i = 0; i < n; i++) {
+		if (siginfo[i].ssi_signo != SIGCHLD) {
+			kill(*pid, siginfo[i].ssi_signo);
+			INFO("forwarded signal %d to pid %d",
+			     siginfo[i].ssi_signo, *pid);
+			continue;
+		}
 
-	if (siginfo.ssi_code == CLD_STOPPED ||
-	    siginfo.ssi_code == CLD_CONTINUED) {
-		INFO("container init process was stopped/continued");
-		return init_died ? 1 : 0;
-	}
+		if (siginfo[i].ssi_code == CLD_STOPPED ||
+		    siginfo[i].ssi_code == CLD_CONTINUED) {
+			INFO("container init process was stopped/continued");
+			continue;
+		}
 
-	/* more robustness, protect ourself from a SIGCHLD sent
-	 * by a process different from the container init
-	 */
-	if (siginfo.ssi_pid != *pid) {
-		WARN("invalid pid for SIGCHLD");
-		return init_died ? 1 : 0;
+		/* more robustness, protect ourself from a SIGCHLD sent
+		 * by a process different from the container init
+		 */
+		if (siginfo[i].ssi_pid != *pid) {
+			WARN("invalid pid for SIGCHLD");
+			continue;
+		}
+
+		DEBUG("container init process exited");
+		init_died = true;
 	}
 
-	DEBUG("container init process exited");
-	return 1;
+	return init_died ? 1 : 0;
 }
 
 static int lxc_set_state(const char *name, struct lxc_handler *handler, lxc_state_t state)
 {
 	handler->state = state;
+	/* the page is only a shortcut, readers fall back to the command */
+	lxc_status_publish(handler);
 	lxc_monitor_send_state(name, state, handler->lxcpath);
 	return 0;
 }
 
-static int lxc_poll(const char *name, struct lxc_handler *handler)
+/*
+ * Messages on the lxc.start.notify socket, in the sd_notify(3) format of
+ * newline separated VAR=value lines.  Only READY=1 is acted upon: it moves
+ * the running container to READY.
+ */
+static int notify_handler(int fd, uint32_t events, void *data,
+			  struct lxc_epoll_descr *descr)
 {
-	int sigfd = handler->sigfd;
-	int pid = handler->pid;
-	struct lxc_epoll_descr descr;
+	struct lxc_handler *handler = data;
+	char buf[4096], *line, *saveptr;
+	ssize_t len;
 
-	if (lxc_mainloop_open(&descr)) {
-		ERROR("failed to create mainloop");
-		goto out_sigfd;
+	for (;;) {
+		len = recv(fd, buf, sizeof(buf) - 1, 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		buf[len] = '\0';
+
+		for (line = strtok_r(buf, "\n", &saveptr); line;
+		     line = strtok_r(NULL, "\n", &saveptr)) {
+			if (strcmp(line, "READY=1") || handler->state != RUNNING)
+				continue;
+			INFO("'%s' is ready", handler->name);
+			lxc_set_state(handler->name, handler, READY);
+		}
 	}
 
-	if (lxc_mainloop_add_handler(&descr, sigfd, signal_handler, &pid)) {
+	return 0;
+}
+
+/* a supervised init has no signal fd, its pidfd gets readable on exit */
+static int pidfd_handler(int fd, uint32_t events, void *data,
+			 struct lxc_epoll_descr *descr)
+{
+	DEBUG("container init process exited");
+	return 1;
+}
+
+static int lxc_poll_add(struct lxc_epoll_descr *descr,
+			struct lxc_handler *handler)
+{
+	const char *name = handler->name;
+
+	/* a chatty console must not hold back the container's exit */
+	if (handler->supervised) {
+		if (lxc_mainloop_add_handler_flags(descr, handler->pidfd,
+						   pidfd_handler, handler,
+						   LXC_MAINLOOP_URGENT)) {
+			ERROR("failed to add handler for the init pidfd");
+			return -1;
+		}
+	} else if (lxc_mainloop_add_handler_flags(descr, handler->sigfd,
+						  signal_handler, &handler->pid,
+						  LXC_MAINLOOP_URGENT)) {
 		ERROR("failed to add handler for the signal");
-		goto out_mainloop_open;
+		return -1;
 	}
 
-	if (lxc_console_mainloop_add(&descr, handler)) {
+	if (lxc_console_mainloop_add(descr, handler)) {
 		ERROR("failed to add console handler to mainloop");
-		goto out_mainloop_open;
+		return -1;
 	}
 
-	if (lxc_cmd_mainloop_add(name, &descr, handler)) {
+	if (lxc_cmd_mainloop_add(name, descr, handler)) {
 		ERROR("failed to add command handler to mainloop");
-		goto out_mainloop_open;
+		return -1;
+	}
+
+	if (handler->notify_fd >= 0 &&
+	    lxc_mainloop_add_handler(descr, handler->notify_fd,
+				     notify_handler, handler)) {
+		ERROR("failed to add notify handler to mainloop");
+		return -1;
 	}
 
 	if (handler->conf->need_utmp_watch) {
 		#if HAVE_SYS_CAPABILITY_H
-		if (lxc_utmp_mainloop_add(&descr, handler)) {
+		if (lxc_utmp_mainloop_add(descr, handler)) {
 			ERROR("failed to add utmp handler to mainloop");
-			goto out_mainloop_open;
+			return -1;
 		}
 		#else
 			DEBUG("not starting utmp handler as cap_sys_boot cannot be dropped without capabilities support");
 		#endif
 	}
 
-	return lxc_mainloop(&descr, -1);
+	/* going without them is no reason not to run the container */
+	handler->memevents = lxc_memevents_mainloop_add(descr, handler);
+	return 0;
+}
+
+static int lxc_poll(const char *name, struct lxc_handler *handler)
+{
+	struct lxc_epoll_descr descr;
+	int ret;
+
+	if (lxc_mainloop_open(&descr)) {
+		ERROR("failed to create mainloop");
+		goto out_sigfd;
+	}
+
+	if (lxc_poll_add(&descr, handler))
+		goto out_mainloop_open;
+
+	ret = lxc_mainloop(&descr, -1);
+	lxc_memevents_free(handler->memevents);
+	handler->memevents = NULL;
+	return ret;
 
 out_mainloop_open:
 	lxc_mainloop_close(&descr);
 out_sigfd:
-	close(sigfd);
+	close(handler->sigfd);
 	return -1;
 }
 
-struct lxc_handler *lxc_init(const char *name, struct lxc_conf *conf, const char *lxcpath)
+static const char *phase_names[LXC_PHASE_MAX] = {
+	[LXC_PHASE_INIT]           = "init",
+	[LXC_PHASE_PREMOUNT]       = "premount",
+	[LXC_PHASE_NET_CREATE]     = "net-create",
+	[LXC_PHASE_CGROUP_CREATE]  = "cgroup-create",
+	[LXC_PHASE_CLONE]          = "clone",
+	[LXC_PHASE_CHILD_READY]    = "child-ready",
+	[LXC_PHASE_CGROUP_ENTER]   = "cgroup-enter",
+	[LXC_PHASE_NET_ASSIGN]     = "net-assign",
+	[LXC_PHASE_ID_MAP]         = "id-map",
+	[LXC_PHASE_ROOTFS]         = "rootfs",
+	[LXC_PHASE_NET_SETUP]      = "net-setup",
+	[LXC_PHASE_MOUNTS]         = "mounts",
+	[LXC_PHASE_MOUNT_HOOKS]    = "mount-hooks",
+	[LXC_PHASE_PIVOT]          = "pivot",
+	[LXC_PHASE_SETUP]          = "setup",
+	[LXC_PHASE_CGROUP_DEVICES] = "cgroup-devices",
+	[LXC_PHASE_START_HOOKS]    = "start-hooks",
+	[LXC_PHASE_RUNNING]        = "running",
+};
+
+const char *lxc_start_phase_name(int phase)
+{
+	if (phase < 0 || phase >= LXC_PHASE_MAX)
+		return "unknown";
+	return phase_names[phase];
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void lxc_start_mark(struct lxc_handler *handler, enum lxc_start_phase phase)
+{
+	if (handler->timing)
+		handler->timing->mark[phase] = monotonic_ns();
+}
+
+/* the monitor and the child run side by side, marks are not in order */
+static uint64_t phase_prev(struct lxc_start_timing *t, int phase)
+{
+	uint64_t prev = t->start;
+	int i;
+
+	for (i = 0; i < LXC_PHASE_MAX; i++)
+		if (t->mark[i] && t->mark[i] < t->mark[phase] &&
+		    t->mark[i] > prev)
+			prev = t->mark[i];
+	return prev;
+}
+
+int lxc_start_timing_get(struct lxc_handler *handler, char *retv, int inlen)
+{
+	struct lxc_start_timing *t = handler->timing;
+	int i, len, fulllen = 0;
+
+	if (!retv)
+		inlen = 0;
+	else
+		memset(retv, 0, inlen);
+
+	if (!t)
+		return 0;
+
+	/* a phase lasts from the previous point reached to its own */
+	for (i = 0; i < LXC_PHASE_MAX; i++) {
+		if (!t->mark[i])
+			continue;
+		len = snprintf(retv, inlen, "%s %" PRIu64 " %" PRIu64 "\n",
+			       phase_names[i], (t->mark[i] - t->start) / 1000,
+			       (t->mark[i] - phase_prev(t, i)) / 1000);
+		if (len < 0)
+			return -1;
+		fulllen += len;
+		if (inlen > 0) {
+			retv += len;
+			inlen -= len;
+			if (inlen < 0)
+				inlen = 0;
+		}
+	}
+
+	return fulllen;
+}
+
+static void lxc_start_timing_report(struct lxc_handler *handler)
+{
+	struct lxc_start_timing *t = handler->timing;
+	uint64_t usec;
+	int i;
+
+	if (!t)
+		return;
+
+	for (i = 0; i < LXC_PHASE_MAX; i++) {
+		if (!t->mark[i])
+			continue;
+		usec = (t->mark[i] - phase_prev(t, i)) / 1000;
+		INFO("start phase %s took %" PRIu64 "us", phase_names[i], usec);
+		lxc_monitor_send_phase(handler->name, i, usec, handler->lxcpath);
+	}
+	INFO("'%s' started in %" PRIu64 "us", handler->name,
+	     (t->mark[LXC_PHASE_RUNNING] - t->start) / 1000);
+}
+
+static struct lxc_start_timing *lxc_start_timing_new(void)
+{
+	struct lxc_start_timing *t;
+
+	/* shared, so that the child's marks show up here */
+	t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (t == MAP_FAILED) {
+		WARN("failed to map the start timing record: %s",
+		     strerror(errno));
+		return NULL;
+	}
+	t->start = monotonic_ns();
+	return t;
+}
+
+static void lxc_start_timing_free(struct lxc_handler *handler)
+{
+	if (handler->timing)
+		munmap(handler->timing, sizeof(*handler->timing));
+	handler->timing = NULL;
+}
+
+/* the environment of the hooks */
+static void lxc_set_hook_env(const char *name, struct lxc_conf *conf)
+{
+	if (setenv("LXC_NAME", name, 1)) {
+		SYSERROR("failed to set environment variable for container name");
+	}
+	if (setenv("LXC_CONFIG_FILE", conf->rcfile, 1)) {
+		SYSERROR("failed to set environment variable for config path");
+	}
+	if (setenv("LXC_ROOTFS_MOUNT", conf->rootfs.mount, 1)) {
+		SYSERROR("failed to set environment variable for rootfs mount");
+	}
+	if (setenv("LXC_ROOTFS_PATH", conf->rootfs.path, 1)) {
+		SYSERROR("failed to set environment variable for rootfs mount");
+	}
+	if (conf->console.path && setenv("LXC_CONSOLE", conf->console.path, 1)) {
+		SYSERROR("failed to set environment variable for console path");
+	}
+	if (conf->console.log_path && setenv("LXC_CONSOLE_LOGPATH", conf->console.log_path, 1)) {
+		SYSERROR("failed to set environment variable for console log");
+	}
+}
+
+static struct lxc_handler *__lxc_init(const char *name, struct lxc_conf *conf,
+				      const char *lxcpath, bool supervised)
 {
 	struct lxc_handler *handler;
 
@@ -366,6 +770,12 @@ struct lxc_handler *lxc_init(const char *name, struct lxc_conf *conf, const char
 	handler->conf = conf;
 	handler->lxcpath = lxcpath;
 	handler->pinfd = -1;
+	handler->claimfd = -1;
+	handler->notify_fd = -1;
+	handler->sigfd = -1;
+	handler->pidfd = -1;
+	handler->supervised = supervised;
+	handler->timing = lxc_start_timing_new();
 
 	lsm_init();
 
@@ -378,6 +788,9 @@ struct lxc_handler *lxc_init(const char *name, struct lxc_conf *conf, const char
 	if (lxc_cmd_init(name, handler, lxcpath))
 		goto out_free_name;
 
+	/* the command socket is up, list_active_containers() may report us */
+	lxc_running_register(name, lxcpath);
+
 	if (lxc_read_seccomp_config(conf) != 0) {
 		ERROR("failed loading seccomp policy");
 		goto out_close_maincmd_fd;
@@ -389,26 +802,7 @@ struct lxc_handler *lxc_init(const char *name, struct lxc_conf *conf, const char
 		goto out_close_maincmd_fd;
 	}
 
-	/* Start of environment variable setup for hooks */
-	if (setenv("LXC_NAME", name, 1)) {
-		SYSERROR("failed to set environment variable for container name");
-	}
-	if (setenv("LXC_CONFIG_FILE", conf->rcfile, 1)) {
-		SYSERROR("failed to set environment variable for config path");
-	}
-	if (setenv("LXC_ROOTFS_MOUNT", conf->rootfs.mount, 1)) {
-		SYSERROR("failed to set environment variable for rootfs mount");
-	}
-	if (setenv("LXC_ROOTFS_PATH", conf->rootfs.path, 1)) {
-		SYSERROR("failed to set environment variable for rootfs mount");
-	}
-	if (conf->console.path && setenv("LXC_CONSOLE", conf->console.path, 1)) {
-		SYSERROR("failed to set environment variable for console path");
-	}
-	if (conf->console.log_path && setenv("LXC_CONSOLE_LOGPATH", conf->console.log_path, 1)) {
-		SYSERROR("failed to set environment variable for console log");
-	}
-	/* End of environment variable setup for hooks */
+	lxc_set_hook_env(name, conf);
 
 	if (run_lxc_hooks(name, "pre-start", conf, handler->lxcpath, NULL)) {
 		ERROR("failed to run pre-start hooks for container '%s'.", name);
@@ -422,11 +816,14 @@ struct lxc_handler *lxc_init(const char *name, struct lxc_conf *conf, const char
 
 	/* the signal fd has to be created before forking otherwise
 	 * if the child process exits before we setup the signal fd,
-	 * the event will be lost and the command will be stuck */
-	handler->sigfd = setup_signal_fd(&handler->oldmask);
-	if (handler->sigfd < 0) {
-		ERROR("failed to set sigchild fd handler");
-		goto out_delete_tty;
+	 * the event will be lost and the command will be stuck.  A
+	 * supervisor blocked the signals once for all its containers. */
+	if (!supervised) {
+		handler->sigfd = setup_signal_fd(&handler->oldmask);
+		if (handler->sigfd < 0) {
+			ERROR("failed to set sigchild fd handler");
+			goto out_delete_tty;
+		}
 	}
 
 	/* do this after setting up signals since it might unblock SIGWINCH */
@@ -440,11 +837,13 @@ struct lxc_handler *lxc_init(const char *name, struct lxc_conf *conf, const char
 		goto out_restore_sigmask;
 	}
 
+	lxc_start_mark(handler, LXC_PHASE_INIT);
 	INFO("'%s' is initialized", name);
 	return handler;
 
 out_restore_sigmask:
-	sigprocmask(SIG_SETMASK, &handler->oldmask, NULL);
+	if (!supervised)
+		sigprocmask(SIG_SETMASK, &handler->oldmask, NULL);
 out_delete_tty:
 	lxc_delete_tty(&conf->tty_info);
 out_aborting:
@@ -452,14 +851,47 @@ out_aborting:
 out_close_maincmd_fd:
 	close(conf->maincmd_fd);
 	conf->maincmd_fd = -1;
+	lxc_running_unregister(name, lxcpath);
+	lxc_status_unpublish(handler);
+	lxc_monitor_fifo_close();
 out_free_name:
 	free(handler->name);
 	handler->name = NULL;
 out_free:
+	lxc_start_timing_free(handler);
 	free(handler);
 	return NULL;
 }
 
+struct lxc_handler *lxc_init(const char *name, struct lxc_conf *conf, const char *lxcpath)
+{
+	return __lxc_init(name, conf, lxcpath, false);
+}
+
+/*
+ * An ephemeral container goes once stopped, rather than rebooted, as
+ * lxc-destroy would remove it and with the run directory its rootfs
+ * changes were kept in.
+ */
+static void lxc_destroy_ephemeral(const char *name, struct lxc_handler *handler)
+{
+	struct lxc_container *c;
+	char *dir;
+
+	if (!handler->conf->ephemeral || handler->conf->reboot)
+		return;
+
+	c = lxc_container_new(name, handler->lxcpath);
+	if (!c || !c->destroy(c))
+		ERROR("failed to destroy ephemeral container '%s'", name);
+	lxc_container_put(c);
+
+	dir = lxc_ephemeral_dir(handler->lxcpath, name);
+	if (dir && rmdir(dir) < 0 && errno != ENOENT)
+		WARN("failed to remove %s: %s", dir, strerror(errno));
+	free(dir);
+}
+
 static void lxc_fini(const char *name, struct lxc_handler *handler)
 {
 	/* The STOPPING state is there for future cleanup code
@@ -468,19 +900,37 @@ static void lxc_fini(const char *name, struct lxc_handler *handler)
 	lxc_set_state(name, handler, STOPPING);
 	lxc_set_state(name, handler, STOPPED);
 
+	/* other containers of the supervisor set it meanwhile */
+	if (handler->supervised)
+		lxc_set_hook_env(name, handler->conf);
 	if (run_lxc_hooks(name, "post-stop", handler->conf, handler->lxcpath, NULL))
 		ERROR("failed to run post-stop hooks for container '%s'.", name);
 
 	/* reset mask set by setup_signal_fd */
-	if (sigprocmask(SIG_SETMASK, &handler->oldmask, NULL))
+	if (!handler->supervised &&
+	    sigprocmask(SIG_SETMASK, &handler->oldmask, NULL))
 		WARN("failed to restore sigprocmask");
+	if (handler->pidfd >= 0)
+		close(handler->pidfd);
 
 	lxc_console_delete(&handler->conf->console);
 	lxc_delete_tty(&handler->conf->tty_info);
+	if (handler->notify_fd >= 0)
+		close(handler->notify_fd);
 	close(handler->conf->maincmd_fd);
 	handler->conf->maincmd_fd = -1;
+	lxc_running_unregister(name, handler->lxcpath);
+	lxc_status_unpublish(handler);
+	lxc_monitor_fifo_close();
+	lxc_destroy_ephemeral(name, handler);
+	/* what the exit of a monitor of its own would close */
+	if (handler->descr) {
+		lxc_cmd_mainloop_release(handler->descr);
+		lxc_memevents_free(handler->memevents);
+	}
 	free(handler->name);
 	cgroup_destroy(handler);
+	lxc_start_timing_free(handler);
 	free(handler);
 }
 
@@ -491,6 +941,13 @@ static void lxc_abort(const char *name, struct lxc_handler *handler)
 	lxc_set_state(name, handler, ABORTING);
 	if (handler->pid > 0)
 		kill(handler->pid, SIGKILL);
+	/* the other children of a supervisor are other containers */
+	if (handler->supervised) {
+		if (handler->pid > 0)
+			while (waitpid(handler->pid, &status, 0) < 0 && errno == EINTR)
+				;
+		return;
+	}
 	while ((ret = waitpid(-1, &status, 0)) > 0) ;
 }
 
@@ -513,14 +970,165 @@ static int container_reboot_supported(void *arg)
 	return 0;
 }
 
+/*
+ * Results of kernel probes which need a throwaway child are kept in
+ * $rundir/lxc/kernel-probes, "key=value" lines after the boot id of the
+ * kernel which gave them.  A new boot makes the whole file stale.
+ */
+#define KERNEL_PROBES_MAX 1024
+
+static char *kernel_probes_path(void)
+{
+	char *rundir, *path;
+	int len;
+
+	rundir = get_rundir();
+	if (!rundir)
+		return NULL;
+
+	/* $rundir + "/lxc/kernel-probes" + '\0' */
+	len = strlen(rundir) + 19;
+	path = malloc(len);
+	if (path)
+		snprintf(path, len, "%s/lxc/kernel-probes", rundir);
+	free(rundir);
+	return path;
+}
+
+static bool get_boot_id(char *boot_id, size_t len)
+{
+	FILE *f;
+	bool ret = false;
+
+	f = fopen("/proc/sys/kernel/random/boot_id", "r");
+	if (!f)
+		return false;
+	if (fgets(boot_id, len, f) && boot_id[0] != '\n')
+		ret = true;
+	fclose(f);
+	return ret;
+}
+
+/*
+ * Read the probes cached during this boot into @buf, lines without the
+ * boot id.  Returns false if there are none.
+ */
+static bool kernel_probes_read(const char *path, const char *boot_id,
+			       char *buf, size_t len)
+{
+	char line[128];
+	FILE *f;
+	size_t used = 0;
+	bool ret = false;
+
+	buf[0] = '\0';
+	f = fopen(path, "r");
+	if (!f)
+		return false;
+
+	if (!fgets(line, sizeof(line), f) || strcmp(line, boot_id))
+		goto out;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (used + strlen(line) >= len)
+			break;
+		strcpy(buf + used, line);
+		used += strlen(line);
+	}
+	ret = true;
+out:
+	fclose(f);
+	return ret;
+}
+
+/* Returns the cached value of probe @key, -1 if it has to be probed */
+static int kernel_probe_get(const char *key)
+{
+	char boot_id[64], buf[KERNEL_PROBES_MAX], *path, *p;
+	size_t keylen = strlen(key);
+	int v = -1;
+
+	if (!get_boot_id(boot_id, sizeof(boot_id)))
+		return -1;
+
+	path = kernel_probes_path();
+	if (!path)
+		return -1;
+
+	if (kernel_probes_read(path, boot_id, buf, sizeof(buf))) {
+		p = buf;
+		while (*p) {
+			if (strncmp(p, key, keylen) == 0 && p[keylen] == '=') {
+				v = atoi(p + keylen + 1);
+				break;
+			}
+			p = strchr(p, '\n');
+			if (!p)
+				break;
+			p++;
+		}
+	}
+
+	free(path);
+	return v;
+}
+
+/*
+ * Add probe @key to the cache.  Concurrent starts may race to store the
+ * same results, the rename makes sure readers see one whole file.
+ */
+static void kernel_probe_set(const char *key, int v)
+{
+	char boot_id[64], buf[KERNEL_PROBES_MAX], *path, *tmp, *slash;
+	FILE *f;
+	int len;
+
+	if (!get_boot_id(boot_id, sizeof(boot_id)))
+		return;
+
+	path = kernel_probes_path();
+	if (!path)
+		return;
+
+	len = strlen(path) + 22;
+	tmp = malloc(len);
+	if (!tmp)
+		goto out;
+	snprintf(tmp, len, "%s.%d", path, getpid());
+
+	slash = strrchr(path, '/');
+	*slash = '\0';
+	len = mkdir_p(path, 0755);
+	*slash = '/';
+	if (len < 0)
+		goto out;
+
+	/* keep what's there from this boot, this key is new */
+	kernel_probes_read(path, boot_id, buf, sizeof(buf));
+
+	f = fopen(tmp, "w");
+	if (!f)
+		goto out;
+	len = fprintf(f, "%s%s%s=%d\n", boot_id, buf, key, v);
+	if (fclose(f) || len < 0 || rename(tmp, path) < 0) {
+		DEBUG("failed to cache kernel probe %s", key);
+		unlink(tmp);
+	}
+
+out:
+	free(tmp);
+	free(path);
+}
+
 static int must_drop_cap_sys_boot(struct lxc_conf *conf)
 {
 	FILE *f;
 	int ret, cmd, v, flags;
         long stack_size = 4096;
-        void *stack = alloca(stack_size);
+        void *stack;
         int status;
         pid_t pid;
+	const char *probe;
 
 	f = fopen("/proc/sys/kernel/ctrl-alt-del", "r");
 	if (!f) {
@@ -537,9 +1145,20 @@ static int must_drop_cap_sys_boot(struct lxc_conf *conf)
 	cmd = v ? LINUX_REBOOT_CMD_CAD_ON : LINUX_REBOOT_CMD_CAD_OFF;
 
 	flags = CLONE_NEWPID | SIGCHLD;
-	if (!lxc_list_empty(&conf->id_map))
+	probe = "reboot_pidns";
+	if (!lxc_list_empty(&conf->id_map)) {
 		flags |= CLONE_NEWUSER;
+		probe = "reboot_userns";
+	}
 
+	/* whether reboot() works in a pid namespace is up to the kernel */
+	v = kernel_probe_get(probe);
+	if (v >= 0) {
+		DEBUG("%s %s supported, as probed before", probe, v ? "is" : "is not");
+		return !v;
+	}
+
+	stack = alloca(stack_size);
 #ifdef __ia64__
 	pid = __clone2(container_reboot_supported, stack, stack_size, flags,  &cmd);
 #else
@@ -555,10 +1174,10 @@ static int must_drop_cap_sys_boot(struct lxc_conf *conf)
 		return -1;
 	}
 
-	if (WEXITSTATUS(status) != 1)
-		return 1;
+	v = WIFEXITED(status) && WEXITSTATUS(status) == 1;
+	kernel_probe_set(probe, v);
 
-	return 0;
+	return !v;
 }
 
 /*
@@ -607,6 +1226,44 @@ static int read_unpriv_netifindex(struct lxc_list *network)
 	return 0;
 }
 
+/*
+ * Bind the socket created by the parent on lxc.start.notify, in the
+ * container's root.  The parent keeps the same socket and so receives
+ * what is sent to that path.
+ */
+static int notify_socket_bind(struct lxc_handler *handler)
+{
+	struct sockaddr_un addr;
+	const char *path = handler->conf->start_notify;
+	char *dir;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		ERROR("lxc.start.notify path '%s' is too long", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	dir = alloca(strlen(path) + 1);
+	strcpy(dir, path);
+	*strrchr(dir, '/') = '\0';
+	if (*dir && mkdir_p(dir, 0755) < 0) {
+		SYSERROR("failed to create '%s'", dir);
+		return -1;
+	}
+
+	if (unlink(path) < 0 && errno != ENOENT) {
+		SYSERROR("failed to remove '%s'", path);
+		return -1;
+	}
+	if (bind(handler->notify_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		SYSERROR("failed to bind the notify socket on '%s'", path);
+		return -1;
+	}
+	return 0;
+}
+
 static int do_start(void *data)
 {
 	struct lxc_handler *handler = data;
@@ -635,10 +1292,11 @@ static int do_start(void *data)
 		close(handler->pinfd);
 	}
 
-	/* Tell the parent task it can begin to configure the
-	 * container and wait for it to finish
+	/* Wait for the parent to put us in our cgroup and map our ids, the
+	 * network comes later (see lxc_setup())
 	 */
-	if (lxc_sync_barrier_parent(handler, LXC_SYNC_CONFIGURE))
+	lxc_start_mark(handler, LXC_PHASE_CHILD_READY);
+	if (lxc_sync_wait_parent(handler, LXC_SYNC_CONFIGURE))
 		return -1;
 
 	if (read_unpriv_netifindex(&handler->conf->network) < 0)
@@ -684,6 +1342,10 @@ static int do_start(void *data)
 		ERROR("failed to setup the container");
 		goto out_warn_father;
 	}
+	lxc_start_mark(handler, LXC_PHASE_SETUP);
+
+	if (handler->notify_fd >= 0 && notify_socket_bind(handler) < 0)
+		goto out_warn_father;
 
 	/* ask father to setup cgroups and wait for him to finish */
 	if (lxc_sync_barrier_parent(handler, LXC_SYNC_CGROUP))
@@ -709,6 +1371,11 @@ static int do_start(void *data)
 	/* If we mounted a temporary proc, then unmount it now */
 	tmp_proc_unmount(handler->conf);
 
+	/* inherited by whatever init forks, before seccomp may forbid it */
+	if (handler->conf->cpuset_mempolicy &&
+	    lxc_mempolicy_apply(handler->conf->cpuset_mempolicy) < 0)
+		goto out_warn_father;
+
 	if (lxc_seccomp_load(handler->conf) != 0)
 		goto out_warn_father;
 
@@ -716,6 +1383,7 @@ static int do_start(void *data)
 		ERROR("failed to run start hooks for container '%s'.", handler->name);
 		goto out_warn_father;
 	}
+	lxc_start_mark(handler, LXC_PHASE_START_HOOKS);
 
 	/* The clearenv() and putenv() calls have been moved here
 	 * to allow us to use enviroment variables passed to the various
@@ -732,6 +1400,12 @@ static int do_start(void *data)
 		goto out_warn_father;
 	}
 
+	if (handler->conf->start_notify &&
+	    setenv("NOTIFY_SOCKET", handler->conf->start_notify, 1)) {
+		SYSERROR("failed to set environment variable");
+		goto out_warn_father;
+	}
+
 	close(handler->sigfd);
 
 	/* after this call, we are in error because this
@@ -741,7 +1415,7 @@ static int do_start(void *data)
 out_warn_father:
 	/* we want the parent to know something went wrong, so any
 	 * value other than what it expects is ok. */
-	lxc_sync_wake_parent(handler, LXC_SYNC_POST_CONFIGURE);
+	lxc_sync_wake_parent(handler, LXC_SYNC_ERROR);
 	return -1;
 }
 
@@ -777,7 +1451,6 @@ static int save_phys_nics(struct lxc_conf *conf)
 
 static int lxc_spawn(struct lxc_handler *handler)
 {
-	int failed_before_rename = 0;
 	const char *name = handler->name;
 	bool cgroups_connected = false;
 	int saved_ns_fd[LXC_NS_MAX];
@@ -823,6 +1496,7 @@ static int lxc_spawn(struct lxc_handler *handler)
 				lxc_sync_fini(handler);
 				return -1;
 			}
+			lxc_start_mark(handler, LXC_PHASE_NET_CREATE);
 		}
 
 		if (save_phys_nics(handler->conf)) {
@@ -857,6 +1531,7 @@ static int lxc_spawn(struct lxc_handler *handler)
 		ERROR("failed creating cgroups");
 		goto out_delete_net;
 	}
+	lxc_start_mark(handler, LXC_PHASE_CGROUP_CREATE);
 
 	/*
 	 * if the rootfs is not a blockdev, prevent the container from
@@ -884,37 +1559,67 @@ static int lxc_spawn(struct lxc_handler *handler)
 		netpipe = netpipepair[0];
 	}
 
+	/* the child binds it in the container, we read READY=1 from it */
+	if (handler->conf->start_notify) {
+		handler->notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC |
+					    SOCK_NONBLOCK, 0);
+		if (handler->notify_fd < 0) {
+			SYSERROR("failed to create the notify socket");
+			goto out_delete_net;
+		}
+	}
+
 	/* Create a process in a new set of namespaces */
 	handler->pid = lxc_clone(do_start, handler, handler->clone_flags);
 	if (handler->pid < 0) {
 		SYSERROR("failed to fork into a new namespace");
 		goto out_delete_net;
 	}
+	lxc_start_mark(handler, LXC_PHASE_CLONE);
+
+	/*
+	 * Opened before the init can be reaped, so it names no other process.
+	 * Clients get it through LXC_CMD_GET_INIT_PIDFD.
+	 */
+	handler->pidfd = lxc_pidfd_open(handler->pid);
+	if (handler->pidfd < 0)
+		INFO("no pidfd for the init of '%s': %s", name, strerror(errno));
 
 	if (attach_ns(saved_ns_fd))
 		WARN("failed to restore saved namespaces");
 
 	lxc_sync_fini_child(handler);
 
-	if (lxc_sync_wait_child(handler, LXC_SYNC_CONFIGURE))
-		failed_before_rename = 1;
-
+	/*
+	 * The child waits for what it needs of ours as it sets itself up: its
+	 * cgroup and ids first, then its network.  The cgroup limits but the
+	 * devices ones are set while it sets up its rootfs, the devices are
+	 * only restricted once it is done with its /dev.
+	 */
 	if (!cgroup_create_legacy(handler)) {
 		ERROR("failed to setup the legacy cgroups for %s", name);
 		goto out_delete_net;
 	}
-	if (!cgroup_setup_limits(handler, false)) {
-		ERROR("failed to setup the cgroup limits for '%s'", name);
-		goto out_delete_net;
-	}
 
 	if (!cgroup_enter(handler))
 		goto out_delete_net;
 
 	if (!cgroup_chown(handler))
 		goto out_delete_net;
+	lxc_start_mark(handler, LXC_PHASE_CGROUP_ENTER);
+
+	/* map the container uids - the container became an invalid
+	 * userid the moment it was cloned with CLONE_NEWUSER - this
+	 * call doesn't change anything immediately, but allows the
+	 * container to setuid(0) (0 being mapped to something else on
+	 * the host) later to become a valid uid again */
+	if (lxc_map_ids(&handler->conf->id_map, handler->pid)) {
+		ERROR("failed to set up id mapping");
+		goto out_delete_net;
+	}
+	lxc_start_mark(handler, LXC_PHASE_ID_MAP);
 
-	if (failed_before_rename)
+	if (lxc_sync_wake_child(handler, LXC_SYNC_CONFIGURE))
 		goto out_delete_net;
 
 	/* Create the network configuration */
@@ -923,6 +1628,7 @@ static int lxc_spawn(struct lxc_handler *handler)
 			ERROR("failed to create the configured network");
 			goto out_delete_net;
 		}
+		lxc_start_mark(handler, LXC_PHASE_NET_ASSIGN);
 	}
 
 	if (netpipe != -1) {
@@ -942,26 +1648,23 @@ static int lxc_spawn(struct lxc_handler *handler)
 		close(netpipepair[1]);
 	}
 
-	/* map the container uids - the container became an invalid
-	 * userid the moment it was cloned with CLONE_NEWUSER - this
-	 * call doesn't change anything immediately, but allows the
-	 * container to setuid(0) (0 being mapped to something else on
-	 * the host) later to become a valid uid again */
-	if (lxc_map_ids(&handler->conf->id_map, handler->pid)) {
-		ERROR("failed to set up id mapping");
+	if (lxc_sync_wake_child(handler, LXC_SYNC_NETWORK))
+		goto out_delete_net;
+
+	if (!cgroup_setup_limits(handler, false)) {
+		ERROR("failed to setup the cgroup limits for '%s'", name);
 		goto out_delete_net;
 	}
 
-	/* Tell the child to continue its initialization.  we'll get
-	 * LXC_SYNC_CGROUP when it is ready for us to setup cgroups
-	 */
-	if (lxc_sync_barrier_child(handler, LXC_SYNC_POST_CONFIGURE))
+	/* we'll get LXC_SYNC_CGROUP when it is ready for the devices cgroup */
+	if (lxc_sync_wait_child(handler, LXC_SYNC_CGROUP))
 		goto out_delete_net;
 
 	if (!cgroup_setup_limits(handler, true)) {
 		ERROR("failed to setup the devices cgroup for '%s'", name);
 		goto out_delete_net;
 	}
+	lxc_start_mark(handler, LXC_PHASE_CGROUP_DEVICES);
 
 	cgroup_disconnect();
 	cgroups_connected = false;
@@ -981,12 +1684,14 @@ static int lxc_spawn(struct lxc_handler *handler)
 
 	if (handler->ops->post_start(handler, handler->data))
 		goto out_abort;
+	lxc_start_mark(handler, LXC_PHASE_RUNNING);
 
 	if (lxc_set_state(name, handler, RUNNING)) {
 		ERROR("failed to set state to %s",
 			      lxc_state2str(RUNNING));
 		goto out_abort;
 	}
+	lxc_start_timing_report(handler);
 
 	lxc_sync_fini(handler);
 
@@ -1028,21 +1733,28 @@ int get_netns_fd(int pid)
 	return fd;
 }
 
-int __lxc_start(const char *name, struct lxc_conf *conf,
-		struct lxc_operations* ops, void *data, const char *lxcpath)
+/*
+ * Everything up to the running container.  Returns NULL, with the
+ * handler freed, on failure.
+ */
+static struct lxc_handler *lxc_start_prepare(const char *name,
+		struct lxc_conf *conf, struct lxc_operations *ops, void *data,
+		const char *lxcpath, bool supervised)
 {
 	struct lxc_handler *handler;
-	int err = -1;
-	int status;
-	int netnsfd = -1;
+	bool unsupported = false;
 
-	handler = lxc_init(name, conf, lxcpath);
+	/* for the ttys and the cgroups to be chowned */
+	userns_hold(conf);
+	handler = __lxc_init(name, conf, lxcpath, supervised);
 	if (!handler) {
 		ERROR("failed to initialize the container");
-		return -1;
+		userns_release(conf);
+		return NULL;
 	}
 	handler->ops = ops;
 	handler->data = data;
+	handler->netnsfd = -1;
 
 	if (must_drop_cap_sys_boot(handler->conf)) {
 		#if HAVE_SYS_CAPABILITY_H
@@ -1061,34 +1773,70 @@ int __lxc_start(const char *name, struct lxc_conf *conf,
 	}
 
 	if (geteuid() == 0 && !lxc_list_empty(&conf->id_map)) {
-		/* if the backing store is a device, mount it here and now */
-		if (rootfs_is_blockdev(conf)) {
+		bool idmapped = conf->rootfs.path && conf->rootfs.idmapped;
+
+		/*
+		 * if the backing store is a device, or is to be id-mapped,
+		 * mount it here and now
+		 */
+		if (rootfs_is_blockdev(conf) || idmapped) {
+			/* that would be the mounts of all of them */
+			if (supervised) {
+				INFO("'%s' needs a monitor of its own", name);
+				unsupported = true;
+				goto out_detach_blockdev;
+			}
 			if (unshare(CLONE_NEWNS) < 0) {
 				ERROR("Error unsharing mounts");
-				goto out_fini_nonet;
+				goto out_detach_blockdev;
 			}
 			if (do_rootfs_setup(conf, name, lxcpath) < 0) {
 				ERROR("Error setting up rootfs mount as root before spawn");
-				goto out_fini_nonet;
+				goto out_detach_blockdev;
+			}
+			if (idmapped && lxc_idmap_rootfs(conf) < 0) {
+				ERROR("Error id-mapping the rootfs");
+				goto out_detach_blockdev;
 			}
 			INFO("Set up container rootfs as host root");
 		}
 	}
+	lxc_start_mark(handler, LXC_PHASE_PREMOUNT);
 
-	err = lxc_spawn(handler);
-	if (err) {
+	if (lxc_spawn(handler)) {
 		ERROR("failed to spawn '%s'", name);
 		goto out_detach_blockdev;
 	}
 
-	netnsfd = get_netns_fd(handler->pid);
+	handler->netnsfd = get_netns_fd(handler->pid);
+	userns_release(conf);
+	return handler;
 
-	err = lxc_poll(name, handler);
-	if (err) {
-		ERROR("mainloop exited with an error");
-		if (netnsfd >= 0)
-			close(netnsfd);
-		goto out_abort;
+out_detach_blockdev:
+	detach_block_device(handler->conf);
+out_fini_nonet:
+	lxc_fini(name, handler);
+	userns_release(conf);
+	if (unsupported)
+		errno = EOPNOTSUPP;
+	return NULL;
+}
+
+/*
+ * Reaps the init, or kills it if aborted, and cleans up after it.
+ * Returns the exit status as lxc_error_set_and_log() does.
+ */
+static int lxc_start_finish(struct lxc_handler *handler, bool aborted)
+{
+	const char *name = handler->name;
+	int err = -1;
+	int status;
+
+	if (aborted) {
+		if (handler->netnsfd >= 0)
+			close(handler->netnsfd);
+		lxc_abort(name, handler);
+		goto out_fini;
 	}
 
 	while (waitpid(handler->pid, &status, 0) < 0 && errno == EINTR)
@@ -1118,9 +1866,9 @@ int __lxc_start(const char *name, struct lxc_conf *conf,
 		}
         }
 
-	lxc_rename_phys_nics_on_shutdown(netnsfd, handler->conf);
-	if (netnsfd >= 0)
-		close(netnsfd);
+	lxc_rename_phys_nics_on_shutdown(handler->netnsfd, handler->conf);
+	if (handler->netnsfd >= 0)
+		close(handler->netnsfd);
 
 	if (handler->pinfd >= 0) {
 		close(handler->pinfd);
@@ -1130,17 +1878,116 @@ int __lxc_start(const char *name, struct lxc_conf *conf,
 	err =  lxc_error_set_and_log(handler->pid, status);
 out_fini:
 	lxc_delete_network(handler);
-
-out_detach_blockdev:
 	detach_block_device(handler->conf);
-
-out_fini_nonet:
 	lxc_fini(name, handler);
 	return err;
+}
+
+int __lxc_start(const char *name, struct lxc_conf *conf,
+		struct lxc_operations* ops, void *data, const char *lxcpath)
+{
+	struct lxc_handler *handler;
+	int err;
+
+	handler = lxc_start_prepare(name, conf, ops, data, lxcpath, false);
+	if (!handler)
+		return -1;
+
+	err = lxc_poll(name, handler);
+	if (err)
+		ERROR("mainloop exited with an error");
+	return lxc_start_finish(handler, err != 0);
+}
+
+/*
+ * Restoring a checkpoint: the container is set up as for a start but
+ * for its init, which ops->start() brings back instead.
+ */
+int lxc_restore_start(const char *name, struct lxc_conf *conf,
+		      const char *lxcpath, struct lxc_operations *ops,
+		      void *data)
+{
+	struct lxc_handler *handler;
+	bool cgroups_connected = false;
+	pid_t pid;
+	int err;
+
+	handler = __lxc_init(name, conf, lxcpath, false);
+	if (!handler) {
+		ERROR("failed to initialize the container");
+		return -1;
+	}
+	handler->ops = ops;
+	handler->data = data;
+	handler->netnsfd = -1;
+
+	/* the namespaces come back with the init */
+	handler->clone_flags = CLONE_NEWPID | CLONE_NEWNS | CLONE_NEWIPC |
+			       CLONE_NEWUTS;
+	if (!lxc_requests_empty_network(handler))
+		handler->clone_flags |= CLONE_NEWNET;
+
+	if (!attach_block_device(handler->conf)) {
+		ERROR("Failure attaching block device");
+		lxc_fini(name, handler);
+		return -1;
+	}
+
+	if (!cgroup_init(handler)) {
+		ERROR("failed initializing cgroup support");
+		goto out_abort;
+	}
+	cgroups_connected = true;
+	if (!cgroup_create(handler)) {
+		ERROR("failed creating cgroups");
+		goto out_abort;
+	}
+	if (!cgroup_setup_limits(handler, false)) {
+		ERROR("failed to setup the cgroup limits for '%s'", name);
+		goto out_abort;
+	}
+
+	/* the rootfs, where the mounts of the init are restored */
+	if (unshare(CLONE_NEWNS) < 0) {
+		SYSERROR("Error unsharing mounts");
+		goto out_abort;
+	}
+	if (do_rootfs_setup(conf, name, lxcpath) < 0) {
+		ERROR("Error setting up the rootfs of '%s'", name);
+		goto out_abort;
+	}
+
+	pid = ops->start(handler, data);
+	if (pid <= 0)
+		goto out_abort;
+	handler->pid = pid;
+	handler->pidfd = lxc_pidfd_open(pid);
+	handler->netnsfd = get_netns_fd(pid);
+
+	if (!cgroup_setup_limits(handler, true)) {
+		ERROR("failed to setup the devices cgroup for '%s'", name);
+		goto out_abort;
+	}
+	cgroup_disconnect();
+	cgroups_connected = false;
+
+	if (lxc_set_state(name, handler, RUNNING)) {
+		ERROR("failed to set state to %s", lxc_state2str(RUNNING));
+		goto out_abort;
+	}
+	if (ops->post_start(handler, data))
+		goto out_abort;
+
+	err = lxc_poll(name, handler);
+	if (err)
+		ERROR("mainloop exited with an error");
+	return lxc_start_finish(handler, err != 0);
 
 out_abort:
-	lxc_abort(name, handler);
-	goto out_fini;
+	if (cgroups_connected)
+		cgroup_disconnect();
+	lxc_start_finish(handler, true);
+	return -1;
 }
 
 struct start_args {
@@ -1184,3 +2031,60 @@ int lxc_start(const char *name, char *const argv[], struct lxc_conf *conf,
 	conf->need_utmp_watch = 1;
 	return __lxc_start(name, conf, &start_ops, &start_arg, lxcpath);
 }
+
+struct lxc_handler *lxc_start_supervised(const char *name, char *const argv[],
+					 struct lxc_conf *conf,
+					 const char *lxcpath,
+					 struct lxc_epoll_descr *descr)
+{
+	struct start_args start_arg = {
+		.argv = argv,
+	};
+	struct lxc_handler *handler;
+	int saved_errno;
+
+	/*
+	 * No lxc_check_inherited(), the fds of the supervisor are its own
+	 * and close-on-exec, and the init only gets what do_start() sets up.
+	 */
+	if (lxc_mainloop_open(descr)) {
+		ERROR("failed to create mainloop");
+		return NULL;
+	}
+
+	conf->need_utmp_watch = 1;
+	handler = lxc_start_prepare(name, conf, &start_ops, &start_arg,
+				    lxcpath, true);
+	if (!handler)
+		goto out_close;
+	handler->data = NULL;
+	handler->descr = descr;
+
+	/* its exit is only seen through the pidfd lxc_spawn() opened */
+	if (handler->pidfd < 0) {
+		ERROR("no pidfd for the init of '%s'", name);
+		goto out_abort;
+	}
+
+	if (lxc_poll_add(descr, handler))
+		goto out_abort;
+	return handler;
+
+out_abort:
+	lxc_start_finish(handler, true);
+out_close:
+	saved_errno = errno;
+	lxc_mainloop_close(descr);
+	errno = saved_errno;
+	return NULL;
+}
+
+int lxc_start_supervised_end(struct lxc_handler *handler,
+			     struct lxc_epoll_descr *descr, bool aborted)
+{
+	int err;
+
+	err = lxc_start_finish(handler, aborted);
+	lxc_mainloop_close(descr);
+	return err;
+}
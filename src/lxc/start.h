@@ -24,6 +24,8 @@
 #define __LXC_START_H
 
 #include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/param.h>
 
 #include "config.h"
@@ -58,6 +60,64 @@ struct ns_info {
 
 extern const struct ns_info ns_info[LXC_NS_MAX];
 
+/*
+ * Cache of the /proc directory of a process, so that entering the same
+ * process' namespaces again does not have to look it up again.  Only the
+ * directory is kept, namespace fds would keep the namespaces alive after
+ * the process is gone.
+ */
+struct lxc_ns_cache {
+	pid_t pid;
+	int procfd;
+};
+
+extern struct lxc_ns_cache *lxc_ns_cache_new(void);
+extern int lxc_ns_cache_get(struct lxc_ns_cache *cache, pid_t pid, int ns);
+extern void lxc_ns_cache_clear(struct lxc_ns_cache *cache);
+extern void lxc_ns_cache_free(struct lxc_ns_cache *cache);
+
+/*
+ * Points of a container start: __lxc_start() and lxc_spawn() in the
+ * monitor, do_start() and lxc_setup() in the child.  Once the child is
+ * cloned both go on side by side, so the points are not reached in this
+ * order.  A phase lasts from the last point reached before it to its own.
+ */
+enum lxc_start_phase {
+	LXC_PHASE_INIT,		/* lxc_init(): command socket, hooks, ttys */
+	LXC_PHASE_PREMOUNT,	/* block device, rootfs mounted as host root */
+	LXC_PHASE_NET_CREATE,	/* lxc_create_network() */
+	LXC_PHASE_CGROUP_CREATE,/* cgroup_init(), cgroup_create() */
+	LXC_PHASE_CLONE,	/* lxc_clone() of the child */
+	LXC_PHASE_CHILD_READY,	/* child waits for its configuration */
+	LXC_PHASE_CGROUP_ENTER,	/* legacy cgroups, cgroup_enter() */
+	LXC_PHASE_NET_ASSIGN,	/* lxc_assign_network() */
+	LXC_PHASE_ID_MAP,	/* lxc_map_ids() */
+	LXC_PHASE_ROOTFS,	/* child: do_rootfs_setup() */
+	LXC_PHASE_NET_SETUP,	/* child: setup_network() */
+	LXC_PHASE_MOUNTS,	/* child: auto mounts, fstab, mount entries */
+	LXC_PHASE_MOUNT_HOOKS,	/* child: mount and autodev hooks */
+	LXC_PHASE_PIVOT,	/* child: console, ttys, setup_pivot_root() */
+	LXC_PHASE_SETUP,	/* child: rest of lxc_setup() */
+	LXC_PHASE_CGROUP_DEVICES,/* devices cgroup */
+	LXC_PHASE_START_HOOKS,	/* child: LSM label, seccomp, start hooks */
+	LXC_PHASE_RUNNING,	/* the child exec'ed, post_start() done */
+	LXC_PHASE_MAX
+};
+
+/*
+ * CLOCK_MONOTONIC ns at which each phase ended, 0 if it was not reached.
+ * The monitor maps it shared before cloning so the child marks it too.
+ */
+struct lxc_start_timing {
+	uint64_t start;
+	uint64_t mark[LXC_PHASE_MAX];
+};
+
+struct lxc_cmd_workers;
+struct lxc_status_page;
+struct lxc_memevents;
+struct lxc_epoll_descr;
+
 struct lxc_handler {
 	pid_t pid;
 	char *name;
@@ -72,13 +132,58 @@ struct lxc_handler {
 	int pinfd;
 	const char *lxcpath;
 	void *cgroup_data;
+	struct lxc_status_page *status;
+	int claimfd; /* where to send a claimer to lxc-init, if parked */
+	int notify_fd; /* lxc.start.notify socket, bound by the child */
+	struct lxc_start_timing *timing;
+	struct lxc_memevents *memevents;
+	int netnsfd;
+	bool supervised; /* run by lxc-supervisord, see lxc_start_supervised() */
+	int pidfd; /* of the init, in place of sigfd when supervised */
+	struct lxc_epoll_descr *descr; /* the container's loop when supervised */
 };
 
 extern struct lxc_handler *lxc_init(const char *name, struct lxc_conf *, const char *);
 
+extern void lxc_start_mark(struct lxc_handler *handler,
+			   enum lxc_start_phase phase);
+extern const char *lxc_start_phase_name(int phase);
+/*
+ * "phase offset_us duration_us" lines for the phases reached so far, the
+ * value of the lxc.start.timing item of a running container.  Same return
+ * convention as lxc_get_config_item().
+ */
+extern int lxc_start_timing_get(struct lxc_handler *handler, char *retv,
+				int inlen);
+
 extern int lxc_check_inherited(struct lxc_conf *conf, int fd_to_ignore);
 int __lxc_start(const char *, struct lxc_conf *, struct lxc_operations *,
 		void *, const char *);
 
+/*
+ * Restores the container from a checkpoint: as __lxc_start(), but rather
+ * than spawning the init it calls ops->start() with the cgroups created,
+ * without the devices limits yet, and the rootfs mounted in a mount
+ * namespace of this process.  It returns the pid of the init it brought
+ * back, a child of this process, or -1.
+ */
+extern int lxc_restore_start(const char *name, struct lxc_conf *conf,
+			     const char *lxcpath, struct lxc_operations *ops,
+			     void *data);
+
+/*
+ * For lxc-supervisord: starts the container as lxc_start() does, but
+ * returns once it runs, leaving it to a mainloop of its own, @descr.
+ * The caller nests descr->epfd in its loop, calls lxc_mainloop_once()
+ * when it is ready, and once that returns non-zero, the init exited,
+ * lxc_start_supervised_end().  NULL with errno set to EOPNOTSUPP if
+ * the container has to have a monitor process of its own.
+ */
+extern struct lxc_handler *lxc_start_supervised(const char *name,
+		char *const argv[], struct lxc_conf *conf, const char *lxcpath,
+		struct lxc_epoll_descr *descr);
+extern int lxc_start_supervised_end(struct lxc_handler *handler,
+				    struct lxc_epoll_descr *descr, bool aborted);
+
 #endif
 
@@ -31,6 +31,11 @@
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <dirent.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "lxc.h"
 #include "log.h"
@@ -38,13 +43,16 @@
 #include "cgroup.h"
 #include "monitor.h"
 #include "commands.h"
+#include "status.h"
+#include "utils.h"
 #include "config.h"
+#include "lxccontainer.h"
 
 lxc_log_define(lxc_state, lxc);
 
 static const char * const strstate[] = {
 	"STOPPED", "STARTING", "RUNNING", "STOPPING",
-	"ABORTING", "FREEZING", "FROZEN", "THAWED",
+	"ABORTING", "FREEZING", "FROZEN", "THAWED", "READY",
 };
 
 const char *lxc_state2str(lxc_state_t state)
@@ -71,9 +79,14 @@ lxc_state_t lxc_getstate(const char *name, const char *lxcpath)
 {
 	extern lxc_state_t freezer_state(const char *name, const char *lxcpath);
 
+	struct lxc_status status;
+
 	lxc_state_t state = freezer_state(name, lxcpath);
-	if (state != FROZEN && state != FREEZING)
+	if (state != FROZEN && state != FREEZING) {
+		if (!lxc_status_get(name, lxcpath, &status))
+			return status.state;
 		state = lxc_cmd_get_state(name, lxcpath);
+	}
 	return state;
 }
 
@@ -96,6 +109,9 @@ static int fillwaitedstates(const char *strstates, int *states)
 		}
 
 		states[state] = 1;
+		/* a ready container is running as well */
+		if (state == RUNNING)
+			states[READY] = 1;
 
 		token = strtok_r(NULL, "|", &saveptr);
 	}
@@ -103,95 +119,849 @@ static int fillwaitedstates(const char *strstates, int *states)
 	return 0;
 }
 
-extern int lxc_wait(const char *lxcname, const char *states, int timeout, const char *lxcpath)
+/*
+ * Monitor connections used by lxc_wait_many(), one per lxcpath.  While
+ * someone holds the lxcpath (see lxc_wait_monitor_hold()), a connection is
+ * kept for the next wait once a wait is over, so that waiters don't each
+ * pay for checking on lxc-monitord and connecting to it.  Otherwise it is
+ * closed with its last wait.  A connection is used by one waiter at a
+ * time, concurrent waiters open their own.
+ */
+struct wait_monitor {
+	char *lxcpath;
+	struct lxc_monitor_stream *stream;
+	pid_t owner;
+	bool busy;
+	int holders;
+	struct wait_monitor *next;
+};
+
+static struct wait_monitor *wait_monitors;
+static pthread_mutex_t wait_monitors_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* drop what was queued while nobody was waiting, < 0 if monitord is gone */
+static int wait_monitor_drain(struct lxc_monitor_stream *stream)
 {
-	struct lxc_msg msg;
-	int state, ret;
-	int s[MAX_STATE] = { }, fd;
+	struct lxc_monitor_event ev;
+	int ret;
 
-	if (fillwaitedstates(states, s))
-		return -1;
+	while ((ret = lxc_monitor_stream_read(stream, &ev, 0)) > 0)
+		;
+	return ret;
+}
+
+static void wait_monitor_close(struct lxc_monitor_stream *stream)
+{
+	lxc_monitor_close(stream->fd);
+	free(stream);
+}
+
+/* called with wait_monitors_lock held */
+static struct wait_monitor *wait_monitor_find(const char *lxcpath)
+{
+	struct wait_monitor *m;
+
+	for (m = wait_monitors; m; m = m->next)
+		if (strcmp(m->lxcpath, lxcpath) == 0)
+			break;
+
+	/* a connection inherited across fork() belongs to the parent */
+	if (m && m->owner != getpid()) {
+		if (m->stream)
+			wait_monitor_close(m->stream);
+		m->stream = NULL;
+		m->owner = getpid();
+		m->busy = false;
+	}
+	return m;
+}
+
+/* called with wait_monitors_lock held, once nobody uses @m any more */
+static void wait_monitor_free(struct wait_monitor *m)
+{
+	struct wait_monitor **pp;
+
+	for (pp = &wait_monitors; *pp; pp = &(*pp)->next)
+		if (*pp == m) {
+			*pp = m->next;
+			break;
+		}
+	if (m->stream)
+		wait_monitor_close(m->stream);
+	free(m->lxcpath);
+	free(m);
+}
+
+int lxc_wait_monitor_hold(const char *lxcpath)
+{
+	struct wait_monitor *m;
+
+	pthread_mutex_lock(&wait_monitors_lock);
+	m = wait_monitor_find(lxcpath);
+	if (!m) {
+		m = malloc(sizeof(*m));
+		if (m && !(m->lxcpath = strdup(lxcpath))) {
+			free(m);
+			m = NULL;
+		}
+		if (m) {
+			m->stream = NULL;
+			m->owner = getpid();
+			m->busy = false;
+			m->holders = 0;
+			m->next = wait_monitors;
+			wait_monitors = m;
+		}
+	}
+	if (m)
+		m->holders++;
+	pthread_mutex_unlock(&wait_monitors_lock);
+	return m ? 0 : -1;
+}
+
+void lxc_wait_monitor_release(const char *lxcpath)
+{
+	struct wait_monitor *m;
+
+	pthread_mutex_lock(&wait_monitors_lock);
+	m = wait_monitor_find(lxcpath);
+	if (m && m->holders > 0 && --m->holders == 0 && !m->busy)
+		wait_monitor_free(m);
+	pthread_mutex_unlock(&wait_monitors_lock);
+}
+
+static struct lxc_monitor_stream *wait_monitor_get(const char *lxcpath,
+						   struct wait_monitor **mp)
+{
+	struct lxc_monitor_stream *stream;
+	struct wait_monitor *m;
+	int fd;
+
+	*mp = NULL;
+
+	pthread_mutex_lock(&wait_monitors_lock);
+	m = wait_monitor_find(lxcpath);
+	if (m && !m->busy && m->stream) {
+		if (wait_monitor_drain(m->stream) == 0) {
+			m->busy = true;
+			*mp = m;
+			pthread_mutex_unlock(&wait_monitors_lock);
+			return m->stream;
+		}
+		wait_monitor_close(m->stream);
+		m->stream = NULL;
+	}
+	pthread_mutex_unlock(&wait_monitors_lock);
 
 	if (lxc_monitord_spawn(lxcpath))
-		return -1;
+		return NULL;
 
 	fd = lxc_monitor_open(lxcpath);
 	if (fd < 0)
+		return NULL;
+
+	stream = malloc(sizeof(*stream));
+	if (!stream) {
+		lxc_monitor_close(fd);
+		return NULL;
+	}
+	lxc_monitor_stream_init(stream, fd);
+
+	/* the lxcpath may have been held or released meanwhile */
+	pthread_mutex_lock(&wait_monitors_lock);
+	m = wait_monitor_find(lxcpath);
+	if (m && !m->busy && !m->stream) {
+		m->stream = stream;
+		m->busy = true;
+		*mp = m;
+	}
+	pthread_mutex_unlock(&wait_monitors_lock);
+	return stream;
+}
+
+static void wait_monitor_put(struct wait_monitor *m,
+			     struct lxc_monitor_stream *stream, bool broken)
+{
+	if (!m) {
+		wait_monitor_close(stream);
+		return;
+	}
+
+	pthread_mutex_lock(&wait_monitors_lock);
+	m->busy = false;
+	if (m->holders == 0) {
+		wait_monitor_free(m);
+	} else if (broken) {
+		wait_monitor_close(m->stream);
+		m->stream = NULL;
+	}
+	pthread_mutex_unlock(&wait_monitors_lock);
+}
+
+/*
+ * Update the containers still waited for (done[i] == 0) from their states
+ * @cur, returns how many of them are not in one of the states flagged in @s.
+ */
+static int wait_check(int n, const int *s, const lxc_state_t *cur, int *done)
+{
+	int i, left = 0;
+
+	for (i = 0; i < n; i++) {
+		if (done[i] != 0)
+			continue;
+		if ((int)cur[i] < 0)
+			done[i] = -1;
+		else if (s[cur[i]])
+			done[i] = 1;
+		else
+			left++;
+	}
+	return left;
+}
+
+/*
+ * Ask the containers of @names their states over the command sockets, -1
+ * in @cur for those which could not tell.  Only those still waited for if
+ * @done is given.
+ */
+static int wait_query(const char *lxcpath, const char **names, int n,
+		      lxc_state_t *cur, const int *done)
+{
+	extern lxc_state_t freezer_state(const char *name, const char *lxcpath);
+
+	lxc_state_t fs;
+	int i;
+
+	if (lxc_cmd_get_states(lxcpath, names, n, cur, NULL) < 0)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		if ((!done || done[i] == 0) &&
+		    (cur[i] == RUNNING || cur[i] == READY)) {
+			fs = freezer_state(names[i], lxcpath);
+			if (fs == FROZEN || fs == FREEZING)
+				cur[i] = fs;
+		}
+	}
+	return 0;
+}
+
+/* sample the states over the command sockets, see wait_check() */
+static int wait_sample(const char *lxcpath, const char **names, int n,
+		       const int *s, lxc_state_t *cur, int *done)
+{
+	if (wait_query(lxcpath, names, n, cur, done))
 		return -1;
+	return wait_check(n, s, cur, done);
+}
+
+/*
+ * Read the snapshot lxc-monitord sends after a LXC_MONITOR_SUB_SNAPSHOT
+ * subscription, see wait_check()
+ */
+static int wait_snapshot(struct lxc_monitor_stream *stream, const char *lxcpath,
+			 const char **names, int n, const int *s,
+			 lxc_state_t *cur, int *done)
+{
+	struct lxc_monitor_event ev;
+	const char **missing;
+	lxc_state_t *mcur;
+	int i, j, m, ret;
+
+	for (i = 0; i < n; i++)
+		cur[i] = -1;
+
+	for (;;) {
+		ret = lxc_monitor_stream_read(stream, &ev, 1000);
+		if (ret <= 0)
+			return -1;
+		if (ev.type != lxc_msg_snapshot)
+			continue;
+		if (!ev.name[0])
+			break;
+		if (ev.value < 0 || ev.value >= MAX_STATE)
+			continue;
+		for (i = 0; i < n; i++) {
+			if (strcmp(names[i], ev.name) == 0)
+				cur[i] = ev.value;
+		}
+	}
 
 	/*
-	 * if container present,
-	 * then check if already in requested state
+	 * monitord only knows of the containers it heard of, one missing
+	 * from the snapshot is not necessarily stopped: ask it directly.
 	 */
-	ret = -1;
-	state = lxc_getstate(lxcname, lxcpath);
-	if (state < 0) {
-		goto out_close;
-	} else if ((state >= 0) && (s[state])) {
-		ret = 0;
-		goto out_close;
+	for (i = m = 0; i < n; i++)
+		if ((int)cur[i] < 0)
+			m++;
+	if (!m)
+		return wait_check(n, s, cur, done);
+
+	missing = malloc(m * sizeof(*missing));
+	mcur = malloc(m * sizeof(*mcur));
+	if (!missing || !mcur) {
+		free(missing);
+		free(mcur);
+		return wait_check(n, s, cur, done);
 	}
+	for (i = j = 0; i < n; i++)
+		if ((int)cur[i] < 0)
+			missing[j++] = names[i];
+	if (wait_query(lxcpath, missing, m, mcur, NULL) == 0) {
+		for (i = j = 0; i < n; i++)
+			if ((int)cur[i] < 0)
+				cur[i] = mcur[j++];
+	}
+	free(missing);
+	free(mcur);
+	return wait_check(n, s, cur, done);
+}
 
-	for (;;) {
-		int elapsed_time, curtime = 0;
-		struct timeval tv;
-		int stop = 0;
-		int retval;
-
-		if (timeout != -1) {
-			retval = gettimeofday(&tv, NULL);
-			if (retval)
-				goto out_close;
-			curtime = tv.tv_sec;
-		}
-		if (lxc_monitor_read_timeout(fd, &msg, timeout) < 0) {
-			/* try again if select interrupted by signal */
-			if (errno != EINTR)
-				goto out_close;
-		}
-
-		if (timeout != -1) {
-			retval = gettimeofday(&tv, NULL);
-			if (retval)
-				goto out_close;
-			elapsed_time = tv.tv_sec - curtime;
-			if (timeout - elapsed_time <= 0)
-				stop = 1;
-			timeout -= elapsed_time;
-		}
-
-		if (strcmp(lxcname, msg.name)) {
-			if (stop) {
-				ret = -2;
-				goto out_close;
+/* milliseconds left until the CLOCK_MONOTONIC @deadline, 0 if it is past */
+int lxc_wait_time_left(const struct timespec *deadline)
+{
+	struct timespec now;
+	long ms;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		return 0;
+	ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+	     (deadline->tv_nsec - now.tv_nsec) / 1000000;
+	return ms > 0 ? ms : 0;
+}
+
+/*
+ * lxc_wait_many: Wait for several containers to reach one of some states
+ *
+ * @lxcpath    : the lxcpath in which the containers are
+ * @names      : names of the containers
+ * @n          : number of entries in @names
+ * @states     : '|' separated list of states to wait for
+ * @timeout_ms : how long to wait in milliseconds, -1 to wait forever
+ * @reached    : out: for each container 1 if it reached one of @states, 0
+ *               if it did not in time and -1 if its state is unknown (may
+ *               be NULL)
+ *
+ * All containers are watched through a single monitor connection, which
+ * lxc-monitord is asked to only send the states and state changes of
+ * @names to.
+ *
+ * Returns the number of containers which reached one of @states, < 0 on
+ * failure
+ */
+int lxc_wait_many(const char *lxcpath, const char **names, int n,
+		  const char *states, int timeout_ms, int *reached)
+{
+	int s[MAX_STATE] = { };
+	struct wait_monitor *m = NULL;
+	struct lxc_monitor_stream *stream;
+	struct lxc_monitor_event ev;
+	struct timespec deadline;
+	lxc_state_t *cur = NULL;
+	int *done = reached;
+	int i, left, ret = -1;
+	bool broken = false;
+
+	if (fillwaitedstates(states, s))
+		return -1;
+	if (n <= 0)
+		return 0;
+
+	if (!lxcpath)
+		lxcpath = lxc_global_config_value("lxc.lxcpath");
+
+	if (timeout_ms >= 0) {
+		if (clock_gettime(CLOCK_MONOTONIC, &deadline))
+			return -1;
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	cur = malloc(n * sizeof(*cur));
+	if (!done)
+		done = malloc(n * sizeof(*done));
+	if (!cur || !done)
+		goto out_free;
+
+	stream = wait_monitor_get(lxcpath, &m);
+	if (!stream)
+		goto out_free;
+
+	/*
+	 * With a subscription lxc-monitord tells the states along, else
+	 * they are asked for over the command sockets. Not fatal as the
+	 * messages are filtered below in any case but, as a late
+	 * acknowledgement would change the format under us, the connection
+	 * is not kept for the next waiter then.
+	 */
+	memset(done, 0, n * sizeof(*done));
+	if (lxc_monitor_subscribe(stream, names, n, 1 << lxc_msg_state,
+				  LXC_MONITOR_SUB_EXACT |
+				  LXC_MONITOR_SUB_FRAMES |
+				  LXC_MONITOR_SUB_SNAPSHOT) == 0) {
+		left = wait_snapshot(stream, lxcpath, names, n, s, cur,
+				     done);
+		if (left < 0) {
+			broken = true;
+			goto out;
+		}
+	} else {
+		DEBUG("waiting without a monitor subscription");
+		broken = true;
+
+		/* the monitor is open, no state change can be missed now */
+		left = wait_sample(lxcpath, names, n, s, cur, done);
+		if (left < 0)
+			goto out;
+	}
+
+	while (left > 0) {
+		int wait = -1;
+
+		if (timeout_ms >= 0) {
+			wait = lxc_wait_time_left(&deadline);
+			if (!wait)
+				break;
+		}
+
+		ret = lxc_monitor_stream_read(stream, &ev, wait);
+		if (ret == 0)
+			break;
+		if (ret < 0) {
+			ERROR("failed to read from monitor (monitord died?)");
+			broken = true;
+			goto out;
+		}
+
+		/* whatever was lost may have been one of ours, look again */
+		if (ev.missed) {
+			WARN("missed %llu monitor messages, resampling states",
+			     (unsigned long long)ev.missed);
+			left = wait_sample(lxcpath, names, n, s, cur, done);
+			if (left < 0) {
+				ret = -1;
+				goto out;
 			}
+		}
+
+		if (ev.type != lxc_msg_state)
+			continue;
+		if (ev.value < 0 || ev.value >= MAX_STATE) {
+			ERROR("Receive an invalid state number '%d'", ev.value);
 			continue;
 		}
+		if (!s[ev.value])
+			continue;
 
-		switch (msg.type) {
-		case lxc_msg_state:
-			if (msg.value < 0 || msg.value >= MAX_STATE) {
-				ERROR("Receive an invalid state number '%d'",
-					msg.value);
-				goto out_close;
+		for (i = 0; i < n; i++) {
+			if (done[i] == 0 && strcmp(names[i], ev.name) == 0) {
+				done[i] = 1;
+				left--;
 			}
+		}
+	}
 
-			if (s[msg.value]) {
-				ret = 0;
-				goto out_close;
-			}
-			break;
-		default:
-			if (stop) {
-				ret = -2;
-				goto out_close;
-			}
-			/* just ignore garbage */
+	ret = 0;
+	for (i = 0; i < n; i++)
+		if (done[i] == 1)
+			ret++;
+
+out:
+	wait_monitor_put(m, stream, broken);
+out_free:
+	if (done != reached)
+		free(done);
+	free(cur);
+	return ret;
+}
+
+extern int lxc_wait(const char *lxcname, const char *states, int timeout, const char *lxcpath)
+{
+	int reached, ret;
+
+	ret = lxc_wait_many(lxcpath, &lxcname, 1, states,
+			    timeout < 0 ? -1 : timeout * 1000, &reached);
+	if (ret < 0 || reached < 0)
+		return -1;
+
+	return reached ? 0 : -2;
+}
+
+/*
+ * State watch: the wait above turned inside out for callers with their own
+ * event loop.  The states the containers are in when the watch is created
+ * are queued first, then come the changes the monitor connection gets.
+ */
+struct lxc_state_watch {
+	struct lxc_monitor_stream stream;
+	char **names;		/* sorted, NULL to watch all the containers */
+	int n;
+	struct {
+		char *name;
+		lxc_state_t state;
+	} *queued;
+	int nqueued;
+	int next;
+	char name[NAME_MAX+1];
+};
+
+static int watch_cmp_name(const void *p1, const void *p2)
+{
+	return strcmp(*(char * const *)p1, *(char * const *)p2);
+}
+
+static int watch_index(struct lxc_state_watch *w, const char *name)
+{
+	char **p;
+
+	p = bsearch(&name, w->names, w->n, sizeof(*w->names), watch_cmp_name);
+	return p ? p - w->names : -1;
+}
+
+static int watch_queue(struct lxc_state_watch *w, const char *name,
+		       lxc_state_t state)
+{
+	void *tmp;
+
+	if (state < 0 || state >= MAX_STATE)
+		return 0;
+	tmp = realloc(w->queued, (w->nqueued + 1) * sizeof(*w->queued));
+	if (!tmp)
+		return -1;
+	w->queued = tmp;
+	w->queued[w->nqueued].name = strdup(name);
+	if (!w->queued[w->nqueued].name)
+		return -1;
+	w->queued[w->nqueued++].state = state;
+	return 0;
+}
+
+/* queue the states lxc-monitord sends after a snapshot subscription */
+static int watch_snapshot(struct lxc_state_watch *w, lxc_state_t *cur)
+{
+	struct lxc_monitor_event ev;
+	int i, ret;
+
+	for (i = 0; i < w->n; i++)
+		cur[i] = STOPPED;
+
+	for (;;) {
+		ret = lxc_monitor_stream_read(&w->stream, &ev, 1000);
+		if (ret <= 0)
+			return -1;
+		if (ev.type != lxc_msg_snapshot)
+			continue;
+		if (!ev.name[0])
 			break;
+		if (!w->n) {
+			if (watch_queue(w, ev.name, ev.value) < 0)
+				return -1;
+			continue;
+		}
+		i = watch_index(w, ev.name);
+		if (i >= 0 && ev.value >= 0 && ev.value < MAX_STATE)
+			cur[i] = ev.value;
+	}
+	return 0;
+}
+
+/* without lxc-monitord, ask the containers over their command sockets */
+static int watch_sample(struct lxc_state_watch *w, const char *lxcpath,
+			lxc_state_t *cur)
+{
+	char **names = w->names;
+	int i, n = w->n, ret;
+
+	if (!w->n) {
+		n = list_active_containers(lxcpath, &names, NULL);
+		if (n <= 0)
+			return n;
+		cur = malloc(n * sizeof(*cur));
+		if (!cur) {
+			lxc_free_array((void **)names, free);
+			return -1;
+		}
+	}
+
+	ret = lxc_cmd_get_states(lxcpath, (const char **)names, n, cur, NULL);
+	if (ret >= 0 && !w->n) {
+		for (i = 0; i < n; i++)
+			if (watch_queue(w, names[i], cur[i]) < 0)
+				ret = -1;
+	}
+
+	if (!w->n) {
+		lxc_free_array((void **)names, free);
+		free(cur);
+	}
+	return ret < 0 ? -1 : 0;
+}
+
+struct lxc_state_watch *lxc_state_watch_new(const char *lxcpath,
+					    const char **names, int n)
+{
+	struct lxc_state_watch *w;
+	lxc_state_t *cur = NULL;
+	int i, fd, ret;
+
+	if (n < 0 || (n && !names))
+		return NULL;
+	if (!lxcpath)
+		lxcpath = lxc_global_config_value("lxc.lxcpath");
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+	w->stream.fd = -1;
+
+	if (n) {
+		w->names = calloc(n, sizeof(*w->names));
+		cur = malloc(n * sizeof(*cur));
+		if (!w->names || !cur)
+			goto err;
+		for (i = 0; i < n; i++) {
+			if (!(w->names[i] = strdup(names[i])))
+				goto err;
+			w->n++;
 		}
+		qsort(w->names, n, sizeof(*w->names), watch_cmp_name);
 	}
 
-out_close:
-	lxc_monitor_close(fd);
+	if (lxc_monitord_spawn(lxcpath))
+		goto err;
+	fd = lxc_monitor_open(lxcpath);
+	if (fd < 0)
+		goto err;
+	lxc_monitor_stream_init(&w->stream, fd);
+
+	/* the connection is up first so that no change can be missed */
+	if (lxc_monitor_subscribe(&w->stream, (const char **)w->names, w->n,
+				  1 << lxc_msg_state,
+				  LXC_MONITOR_SUB_EXACT |
+				  LXC_MONITOR_SUB_FRAMES |
+				  LXC_MONITOR_SUB_SNAPSHOT) == 0)
+		ret = watch_snapshot(w, cur);
+	else
+		ret = watch_sample(w, lxcpath, cur);
+	if (ret < 0)
+		goto err;
+
+	for (i = 0; i < w->n; i++)
+		if (watch_queue(w, w->names[i], cur[i]) < 0)
+			goto err;
+
+	free(cur);
+	return w;
+
+err:
+	free(cur);
+	lxc_state_watch_free(w);
+	return NULL;
+}
+
+int lxc_state_watch_fd(struct lxc_state_watch *w)
+{
+	return w ? w->stream.fd : -1;
+}
+
+int lxc_state_watch_next(struct lxc_state_watch *w, const char **name,
+			 const char **state)
+{
+	struct lxc_monitor_event ev;
+	int ret;
+
+	if (!w || !name || !state)
+		return -1;
+
+	if (w->next < w->nqueued) {
+		*name = w->queued[w->next].name;
+		*state = lxc_state2str(w->queued[w->next].state);
+		w->next++;
+		return 1;
+	}
+
+	for (;;) {
+		ret = lxc_monitor_stream_read(&w->stream, &ev, 0);
+		if (ret <= 0)
+			return ret < 0 ? -1 : 0;
+		if (ev.type != lxc_msg_state ||
+		    ev.value < 0 || ev.value >= MAX_STATE)
+			continue;
+		if (w->n && watch_index(w, ev.name) < 0)
+			continue;
+
+		strcpy(w->name, ev.name);
+		*name = w->name;
+		*state = lxc_state2str(ev.value);
+		return 1;
+	}
+}
+
+void lxc_state_watch_free(struct lxc_state_watch *w)
+{
+	int i;
+
+	if (!w)
+		return;
+	if (w->stream.fd >= 0)
+		lxc_monitor_close(w->stream.fd);
+	for (i = 0; i < w->n; i++)
+		free(w->names[i]);
+	for (i = 0; i < w->nqueued; i++)
+		free(w->queued[i].name);
+	free(w->names);
+	free(w->queued);
+	free(w);
+}
+
+/*
+ * Registry of running containers.
+ *
+ * Every container monitor, between lxc_init() and lxc_fini(), keeps a file
+ * $rundir/lxc/running/$lxcpath/$name holding its pid and start time (see
+ * lxc_proc_start_time()).  It lists the containers whose command socket
+ * can't be seen from our network namespace, or any other namespace.
+ */
+static char *running_path(const char *lxcpath, const char *name, bool create)
+{
+	char *rundir, *path;
+	int ret, len;
+
+	rundir = get_rundir();
+	if (!rundir)
+		return NULL;
+
+	/* $rundir + "/lxc/running/" + $lxcpath + "/" + $name + '\0' */
+	len = strlen(rundir) + strlen(lxcpath) + (name ? strlen(name) : 0) + 16;
+	path = malloc(len);
+	if (!path) {
+		free(rundir);
+		return NULL;
+	}
+	ret = snprintf(path, len, "%s/lxc/running/%s", rundir, lxcpath);
+	free(rundir);
+	if (ret < 0 || ret >= len)
+		goto err;
+	if (create && mkdir_p(path, 0755) < 0)
+		goto err;
+	if (name) {
+		strcat(path, "/");
+		strcat(path, name);
+	}
+	return path;
+
+err:
+	free(path);
+	return NULL;
+}
+
+int lxc_running_register(const char *name, const char *lxcpath)
+{
+	char *path, buf[32];
+	int ret;
+
+	path = running_path(lxcpath, name, true);
+	if (!path)
+		return -1;
+
+	snprintf(buf, sizeof(buf), "%d %llu", getpid(),
+		 lxc_proc_start_time(getpid()));
+	ret = lxc_write_to_file(path, buf, strlen(buf), true);
+	if (ret < 0)
+		WARN("failed to register %s as running in %s", name, path);
+	free(path);
 	return ret;
 }
+
+void lxc_running_unregister(const char *name, const char *lxcpath)
+{
+	char *path;
+
+	path = running_path(lxcpath, name, false);
+	if (!path)
+		return;
+	if (unlink(path) < 0 && errno != ENOENT)
+		WARN("failed to unregister %s: %s", path, strerror(errno));
+	free(path);
+}
+
+/*
+ * A monitor which was killed cannot have removed its entry, so only count
+ * the entries whose monitor is still alive and reap the others.  The pid
+ * may have been reused since, the start time has to match as well; an
+ * entry of a former version has none, its pid has to do.
+ */
+static bool running_entry_alive(const char *dirpath, const char *name)
+{
+	char path[MAXPATHLEN], buf[64];
+	unsigned long long start;
+	int ret;
+	pid_t pid;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/%s", dirpath, name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return false;
+	ret = lxc_read_from_file(path, buf, sizeof(buf) - 1);
+	if (ret <= 0)
+		return false;
+	buf[ret] = '\0';
+
+	ret = sscanf(buf, "%d %llu", &pid, &start);
+	if (ret == 2 && pid > 0 && start && lxc_proc_start_time(pid) == start)
+		return true;
+	if (ret == 1 && pid > 0 && (kill(pid, 0) == 0 || errno == EPERM))
+		return true;
+
+	INFO("removing stale running entry %s", path);
+	unlink(path);
+	return false;
+}
+
+int lxc_running_list(const char *lxcpath, char ***names, bool *stale)
+{
+	DIR *dir;
+	struct dirent *direntp;
+	char *path;
+	size_t cnt = 0, cap = 0;
+
+	*names = NULL;
+	*stale = false;
+	path = running_path(lxcpath, NULL, false);
+	if (!path)
+		return -1;
+
+	dir = opendir(path);
+	if (!dir) {
+		free(path);
+		return -1;
+	}
+
+	while ((direntp = readdir(dir))) {
+		if (direntp->d_name[0] == '.')
+			continue;
+		if (!running_entry_alive(path, direntp->d_name)) {
+			*stale = true;
+			continue;
+		}
+		if (lxc_grow_array((void ***)names, &cap, cnt + 1, 32) < 0)
+			goto err;
+		if (!((*names)[cnt] = strdup(direntp->d_name)))
+			goto err;
+		cnt++;
+	}
+
+	closedir(dir);
+	free(path);
+	return cnt;
+
+err:
+	closedir(dir);
+	free(path);
+	lxc_free_array((void **)*names, free);
+	*names = NULL;
+	return -1;
+}
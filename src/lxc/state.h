@@ -23,9 +23,13 @@
 #ifndef __LXC_STATE_H
 #define __LXC_STATE_H
 
+#include <stdbool.h>
+
+struct timespec;
+
 typedef enum {
 	STOPPED, STARTING, RUNNING, STOPPING,
-	ABORTING, FREEZING, FROZEN, THAWED, MAX_STATE,
+	ABORTING, FREEZING, FROZEN, THAWED, READY, MAX_STATE,
 } lxc_state_t;
 
 extern int lxc_rmstate(const char *name);
@@ -34,5 +38,25 @@ extern lxc_state_t lxc_getstate(const char *name, const char *lxcpath);
 extern lxc_state_t lxc_str2state(const char *state);
 extern const char *lxc_state2str(lxc_state_t state);
 extern int lxc_wait(const char *lxcname, const char *states, int timeout, const char *lxcpath);
+extern int lxc_wait_many(const char *lxcpath, const char **names, int n,
+			 const char *states, int timeout_ms, int *reached);
+extern int lxc_wait_time_left(const struct timespec *deadline);
+
+/*
+ * While an lxcpath is held, lxc_wait() and lxc_wait_many() keep their
+ * connection to lxc-monitord open for the next wait.
+ */
+extern int lxc_wait_monitor_hold(const char *lxcpath);
+extern void lxc_wait_monitor_release(const char *lxcpath);
+
+/*
+ * Registry of running containers, see state.c.  lxc_running_list() returns
+ * the number of names stored in a NULL terminated array, or -1 if there is
+ * no registry for lxcpath.  @stale is set when entries of monitors which
+ * died without unregistering had to be removed.
+ */
+extern int lxc_running_register(const char *name, const char *lxcpath);
+extern void lxc_running_unregister(const char *name, const char *lxcpath);
+extern int lxc_running_list(const char *lxcpath, char ***names, bool *stale);
 
 #endif
@@ -0,0 +1,446 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "start.h"
+#include "cgroup.h"
+#include "status.h"
+#include "utils.h"
+
+lxc_log_define(lxc_status, lxc);
+
+/* spins of a reader on an odd seq before it gives up on the page */
+#define STATUS_READ_SPINS	1000
+/* and how often it checks meanwhile whether the monitor is still there */
+#define STATUS_LIVE_CHECK	100
+
+/*
+ * The page is updated under a sequence lock: the monitor makes seq odd,
+ * writes the fields and makes it even again, a reader retries its copy
+ * until it read the same even seq before and after it.
+ */
+static inline void status_write_begin(struct lxc_status_page *page)
+{
+	page->seq++;
+	__sync_synchronize();
+}
+
+static inline void status_write_end(struct lxc_status_page *page)
+{
+	__sync_synchronize();
+	page->generation++;
+	page->seq++;
+}
+
+static char *status_path(const char *lxcpath, const char *name, bool create)
+{
+	char *rundir, *path;
+	int ret, len;
+
+	rundir = get_rundir();
+	if (!rundir)
+		return NULL;
+
+	/* $rundir + "/lxc/status/" + $lxcpath + "/" + $name + '\0' */
+	len = strlen(rundir) + strlen(lxcpath) + strlen(name) + 15;
+	path = malloc(len);
+	if (!path) {
+		free(rundir);
+		return NULL;
+	}
+	ret = snprintf(path, len, "%s/lxc/status/%s", rundir, lxcpath);
+	free(rundir);
+	if (ret < 0 || ret >= len)
+		goto err;
+	if (create && mkdir_p(path, 0755) < 0)
+		goto err;
+	strcat(path, "/");
+	strcat(path, name);
+	return path;
+
+err:
+	free(path);
+	return NULL;
+}
+
+static struct lxc_status_page *status_create(const char *name,
+					     const char *lxcpath)
+{
+	struct lxc_status_page *page;
+	char *path;
+	int fd;
+
+	path = status_path(lxcpath, name, true);
+	if (!path)
+		return NULL;
+
+	/*
+	 * Never reuse the page of a previous run, readers which still map
+	 * it have to see it stopped rather than the new run's updates.
+	 */
+	if (unlink(path) < 0 && errno != ENOENT)
+		WARN("failed to remove stale status page %s", path);
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		SYSERROR("failed to create status page %s", path);
+		free(path);
+		return NULL;
+	}
+
+	page = MAP_FAILED;
+	if (ftruncate(fd, LXC_STATUS_SIZE) < 0)
+		SYSERROR("failed to size status page %s", path);
+	else
+		page = mmap(NULL, LXC_STATUS_SIZE, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED) {
+		ERROR("failed to map status page %s", path);
+		unlink(path);
+		free(path);
+		return NULL;
+	}
+	free(path);
+
+	page->version = LXC_STATUS_VERSION;
+	page->monitor_pid = getpid();
+	page->monitor_start = lxc_proc_start_time(getpid());
+	__sync_synchronize();
+	page->magic = LXC_STATUS_MAGIC;
+	return page;
+}
+
+/* write the "subsystem:path" lines of the container, as far as they fit */
+static void status_fill_cgroups(struct lxc_handler *handler, char *buf,
+				size_t len)
+{
+	char line[MAXPATHLEN], subsys[64];
+	const char *path;
+	size_t off = 0;
+	int ret, enabled;
+	FILE *f;
+
+	buf[0] = '\0';
+	if (!handler->cgroup_data)
+		return;
+
+	f = fopen("/proc/cgroups", "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%63s %*d %*d %d", subsys, &enabled) != 2 ||
+		    !enabled)
+			continue;
+		path = cgroup_get_cgroup(handler, subsys);
+		if (!path)
+			continue;
+		ret = snprintf(buf + off, len - off, "%s:%s\n", subsys, path);
+		if (ret < 0 || ret >= len - off) {
+			buf[off] = '\0';
+			break;
+		}
+		off += ret;
+	}
+	fclose(f);
+}
+
+int lxc_status_publish(struct lxc_handler *handler)
+{
+	struct lxc_status_page *page = handler->status;
+	char cgroups[LXC_STATUS_CGROUP_LEN];
+
+	if (!page) {
+		page = status_create(handler->name, handler->lxcpath);
+		if (!page)
+			return -1;
+		handler->status = page;
+	}
+
+	status_fill_cgroups(handler, cgroups, sizeof(cgroups));
+
+	status_write_begin(page);
+	page->state = handler->state;
+	page->init_pid = handler->pid;
+	page->clone_flags = handler->clone_flags;
+	memcpy(page->cgroups, cgroups, sizeof(cgroups));
+	status_write_end(page);
+	return 0;
+}
+
+void lxc_status_unpublish(struct lxc_handler *handler)
+{
+	char *path;
+
+	if (!handler->status)
+		return;
+
+	/* whoever still maps it must see it stopped */
+	status_write_begin(handler->status);
+	handler->status->state = STOPPED;
+	handler->status->init_pid = 0;
+	handler->status->cgroups[0] = '\0';
+	status_write_end(handler->status);
+	munmap(handler->status, LXC_STATUS_SIZE);
+	handler->status = NULL;
+
+	path = status_path(handler->lxcpath, handler->name, false);
+	if (!path)
+		return;
+	if (unlink(path) < 0 && errno != ENOENT)
+		WARN("failed to remove status page %s: %s", path,
+		     strerror(errno));
+	free(path);
+}
+
+/*
+ * Pages mapped by this process, looked up by name and lxcpath.  An entry
+ * is dropped as soon as its page shows the container stopped or its
+ * monitor gone, the next lookup then maps the page of the next run.
+ * @pidfd refers to the monitor, found by its pid and start time when the
+ * page was mapped, -1 if the kernel has no pidfds.
+ */
+struct status_map {
+	char *name;
+	char *lxcpath;
+	const struct lxc_status_page *page;
+	int pidfd;
+	struct status_map *next;
+};
+
+static pthread_mutex_t status_maps_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct status_map *status_maps;
+
+static const struct lxc_status_page *status_map_open(const char *name,
+						     const char *lxcpath)
+{
+	struct lxc_status_page *page;
+	struct stat st;
+	char *path;
+	int fd;
+
+	path = status_path(lxcpath, name, false);
+	if (!path)
+		return NULL;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd < 0)
+		return NULL;
+
+	page = MAP_FAILED;
+	if (!fstat(fd, &st) && st.st_size >= LXC_STATUS_SIZE)
+		page = mmap(NULL, LXC_STATUS_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED)
+		return NULL;
+
+	if (page->magic != LXC_STATUS_MAGIC ||
+	    page->version != LXC_STATUS_VERSION) {
+		munmap(page, LXC_STATUS_SIZE);
+		return NULL;
+	}
+	return page;
+}
+
+/*
+ * Whether the monitor which published @m's page is still there.  A pid
+ * alone may have been reused since, its start time has to match too.
+ */
+static bool status_monitor_alive(struct status_map *m)
+{
+	pid_t pid = m->page->monitor_pid;
+
+	if (m->pidfd >= 0)
+		return lxc_pidfd_send_signal(m->pidfd, 0) == 0 || errno != ESRCH;
+	if (kill(pid, 0) < 0 && errno == ESRCH)
+		return false;
+	return lxc_proc_start_time(pid) == m->page->monitor_start;
+}
+
+/*
+ * Pin the monitor of a freshly mapped page: its start time is checked
+ * once the pidfd is open, so that the pidfd can't be of another process.
+ */
+static bool status_monitor_pin(struct status_map *m)
+{
+	pid_t pid = m->page->monitor_pid;
+
+	m->pidfd = lxc_pidfd_open(pid);
+	if (lxc_proc_start_time(pid) != m->page->monitor_start) {
+		if (m->pidfd >= 0)
+			close(m->pidfd);
+		m->pidfd = -1;
+		return false;
+	}
+	return true;
+}
+
+/* called with status_maps_lock held */
+static struct status_map **status_map_find(const char *name,
+					   const char *lxcpath)
+{
+	struct status_map **p;
+
+	for (p = &status_maps; *p; p = &(*p)->next)
+		if (!strcmp((*p)->name, name) && !strcmp((*p)->lxcpath, lxcpath))
+			return p;
+	return NULL;
+}
+
+/* called with status_maps_lock held */
+static void status_map_drop(struct status_map **p)
+{
+	struct status_map *m = *p;
+
+	*p = m->next;
+	if (m->pidfd >= 0)
+		close(m->pidfd);
+	munmap((void *)m->page, LXC_STATUS_SIZE);
+	free(m->name);
+	free(m->lxcpath);
+	free(m);
+}
+
+/*
+ * Copy the page into status and, if cgroups isn't NULL, its cgroups.
+ * Returns 0 if the container runs, -1 if the entry was dropped or the
+ * page stayed mid-update for too long.  The monitor may have died there,
+ * or be stuck, a reader never waits for it.
+ */
+static int status_map_read(struct status_map **p, struct lxc_status *status,
+			   char *cgroups)
+{
+	const struct lxc_status_page *page = (*p)->page;
+	uint32_t seq;
+	int spins = 0;
+
+	do {
+		while ((seq = page->seq) & 1) {
+			if (++spins >= STATUS_READ_SPINS) {
+				if (!status_monitor_alive(*p))
+					status_map_drop(p);
+				return -1;
+			}
+			if (spins % STATUS_LIVE_CHECK == 0 &&
+			    !status_monitor_alive(*p)) {
+				status_map_drop(p);
+				return -1;
+			}
+			sched_yield();
+		}
+		__sync_synchronize();
+		status->generation = page->generation;
+		status->state = page->state;
+		status->init_pid = page->init_pid;
+		status->monitor_pid = page->monitor_pid;
+		status->clone_flags = page->clone_flags;
+		if (cgroups)
+			memcpy(cgroups, page->cgroups, LXC_STATUS_CGROUP_LEN);
+		__sync_synchronize();
+	} while (page->seq != seq && ++spins < STATUS_READ_SPINS);
+	if (page->seq != seq)
+		return -1;
+
+	if (status->state == STOPPED || !status_monitor_alive(*p)) {
+		status_map_drop(p);
+		return -1;
+	}
+	if (cgroups)
+		cgroups[LXC_STATUS_CGROUP_LEN - 1] = '\0';
+	return 0;
+}
+
+static int status_read(const char *name, const char *lxcpath,
+		       struct lxc_status *status, char *cgroups)
+{
+	const struct lxc_status_page *page;
+	struct status_map **p, *m;
+	int ret = -1;
+
+	if (!name || !lxcpath)
+		return -1;
+
+	pthread_mutex_lock(&status_maps_lock);
+	p = status_map_find(name, lxcpath);
+	if (!p) {
+		page = status_map_open(name, lxcpath);
+		if (!page)
+			goto out;
+		m = malloc(sizeof(*m));
+		if (!m) {
+			munmap((void *)page, LXC_STATUS_SIZE);
+			goto out;
+		}
+		m->name = strdup(name);
+		m->lxcpath = strdup(lxcpath);
+		m->page = page;
+		m->pidfd = -1;
+		m->next = status_maps;
+		status_maps = m;
+		p = &status_maps;
+		if (!m->name || !m->lxcpath || !status_monitor_pin(m)) {
+			status_map_drop(p);
+			goto out;
+		}
+	}
+	ret = status_map_read(p, status, cgroups);
+out:
+	pthread_mutex_unlock(&status_maps_lock);
+	return ret;
+}
+
+int lxc_status_get(const char *name, const char *lxcpath,
+		   struct lxc_status *status)
+{
+	return status_read(name, lxcpath, status, NULL);
+}
+
+char *lxc_status_get_cgroup(const char *name, const char *lxcpath,
+			    const char *subsystem)
+{
+	char cgroups[LXC_STATUS_CGROUP_LEN], *line, *eol, *sep;
+	struct lxc_status status;
+
+	if (status_read(name, lxcpath, &status, cgroups) < 0)
+		return NULL;
+
+	for (line = cgroups; *line; line = eol + 1) {
+		eol = strchr(line, '\n');
+		if (!eol)
+			break;
+		*eol = '\0';
+		sep = strchr(line, ':');
+		if (sep && sep - line == strlen(subsystem) &&
+		    !strncmp(line, subsystem, sep - line))
+			return strdup(sep + 1);
+	}
+	return NULL;
+}
@@ -0,0 +1,91 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef __LXC_STATUS_H
+#define __LXC_STATUS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "state.h"
+
+#define LXC_STATUS_MAGIC	0x6c786373	/* "lxcs" */
+#define LXC_STATUS_VERSION	2
+#define LXC_STATUS_SIZE		4096
+#define LXC_STATUS_CGROUP_LEN	(LXC_STATUS_SIZE - 10 * sizeof(uint32_t))
+
+/*
+ * Status page of a running container, $rundir/lxc/status/$lxcpath/$name.
+ * The container's monitor maps it shared and updates it on every state
+ * change, everyone else maps it read only to learn what they would
+ * otherwise ask through the command socket.
+ *
+ * @magic       : LXC_STATUS_MAGIC
+ * @version     : LXC_STATUS_VERSION
+ * @seq         : odd while the monitor is updating the page
+ * @generation  : number of updates published
+ * @state       : the lxc_state_t of the container
+ * @init_pid    : pid of the container's init, 0 until it runs
+ * @monitor_pid : pid of the monitor, the page is stale if it is gone
+ * @clone_flags : namespaces the container was cloned with
+ * @monitor_start : start time of the monitor (field 22 of /proc/pid/stat),
+ *                  to tell it from a process which got its pid since
+ * @cgroups     : "subsystem:path\n" lines of the container's cgroups
+ */
+struct lxc_status_page {
+	uint32_t magic;
+	uint32_t version;
+	volatile uint32_t seq;
+	uint32_t generation;
+	int32_t state;
+	int32_t init_pid;
+	int32_t monitor_pid;
+	int32_t clone_flags;
+	uint64_t monitor_start;
+	char cgroups[LXC_STATUS_CGROUP_LEN];
+};
+
+/* a consistent copy of the fields of the page, without the cgroups */
+struct lxc_status {
+	uint32_t generation;
+	lxc_state_t state;
+	pid_t init_pid;
+	pid_t monitor_pid;
+	int clone_flags;
+};
+
+struct lxc_handler;
+
+/*
+ * Monitor side. lxc_status_publish() creates the page on first use,
+ * lxc_status_unpublish() removes it when the container is gone.
+ */
+extern int lxc_status_publish(struct lxc_handler *handler);
+extern void lxc_status_unpublish(struct lxc_handler *handler);
+
+/*
+ * Reader side. The page is mapped on the first call for a container and
+ * kept mapped while the container runs. They return -1 when there is no
+ * usable page, or it could not be read consistently, the caller then has
+ * to ask the container's monitor.
+ */
+extern int lxc_status_get(const char *name, const char *lxcpath,
+			  struct lxc_status *status);
+extern char *lxc_status_get_cgroup(const char *name, const char *lxcpath,
+				   const char *subsystem);
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "af_unix.h"
+#include "log.h"
+#include "monitor.h"
+#include "supervisor.h"
+#include "utils.h"
+
+lxc_log_define(lxc_supervisor, lxc);
+
+#define LXC_SUPERVISORD_PATH LIBEXECDIR "/lxc/lxc-supervisord"
+
+int lxc_supervisor_sock_name(const char *lxcpath,
+			     char path[sizeof(((struct sockaddr_un *)0)->sun_path)])
+{
+	char buf[PATH_MAX + 32];
+	uint64_t hash;
+	int ret;
+
+	ret = snprintf(buf, sizeof(buf), "lxc/%s/supervisor-sock", lxcpath);
+	if (ret < 0 || ret >= sizeof(buf)) {
+		ERROR("lxcpath %s too long for the supervisor socket", lxcpath);
+		return -1;
+	}
+
+	/* like the monitor socket, a hash keeps it short enough */
+	hash = fnv_64a_buf(buf, ret, FNV1A_64_INIT);
+	memset(path, 0, sizeof(((struct sockaddr_un *)0)->sun_path));
+	snprintf(&path[1], sizeof(((struct sockaddr_un *)0)->sun_path) - 1,
+		 "lxc/%016" PRIx64 "/supervisor", hash);
+	return 0;
+}
+
+static int supervisor_connect(const char *lxcpath)
+{
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+	if (lxc_supervisor_sock_name(lxcpath, path))
+		return -1;
+	return lxc_abstract_unix_connect(path, SOCK_SEQPACKET);
+}
+
+int lxc_supervisor_start(const char *name, const char *lxcpath)
+{
+	struct lxc_supervisor_req req;
+	struct lxc_supervisor_rsp rsp;
+	ssize_t ret;
+	int fd;
+
+	if (strlen(name) >= sizeof(req.name))
+		return -ENAMETOOLONG;
+
+	fd = supervisor_connect(lxcpath);
+	if (fd < 0) {
+		lxc_daemon_spawn(LXC_SUPERVISORD_PATH, lxcpath);
+		fd = supervisor_connect(lxcpath);
+	}
+	if (fd < 0) {
+		WARN("no lxc-supervisord for %s: %s", lxcpath, strerror(errno));
+		return -EOPNOTSUPP;
+	}
+
+	memset(&req, 0, sizeof(req));
+	strcpy(req.name, name);
+	if (lxc_write_nointr(fd, &req, sizeof(req)) != sizeof(req)) {
+		ret = -errno;
+		goto out;
+	}
+
+	/* the start runs its course, this is no command to time out */
+	ret = lxc_read_nointr(fd, &rsp, sizeof(rsp));
+	if (ret != sizeof(rsp)) {
+		ERROR("lxc-supervisord did not answer for '%s'", name);
+		ret = ret < 0 ? -errno : -EPROTO;
+		goto out;
+	}
+	ret = rsp.ret;
+	if (!ret)
+		INFO("'%s' is supervised, its init is %d", name, rsp.pid);
+
+out:
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,52 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef __LXC_SUPERVISOR_H
+#define __LXC_SUPERVISOR_H
+
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * lxc-supervisord is the monitor of the containers of an lxcpath which
+ * set lxc.start.supervised, all in a single process and epoll loop
+ * instead of an lxc-start each.  It is asked to start a container over
+ * the SOCK_SEQPACKET socket named by lxc_supervisor_sock_name(), and
+ * answers once the container runs.
+ */
+struct lxc_supervisor_req {
+	char name[NAME_MAX + 1];
+};
+
+struct lxc_supervisor_rsp {
+	int ret;	/* 0 or -errno */
+	pid_t pid;	/* of the init */
+};
+
+/* the abstract socket name, with its leading '\0' */
+extern int lxc_supervisor_sock_name(const char *lxcpath,
+				    char path[sizeof(((struct sockaddr_un *)0)->sun_path)]);
+
+/*
+ * Has lxc-supervisord start the container, spawning it if need be.
+ * Returns 0 once it runs, -EOPNOTSUPP if it has to be started by a
+ * monitor of its own instead, or another -errno if it failed.
+ */
+extern int lxc_supervisor_start(const char *name, const char *lxcpath);
+
+#endif
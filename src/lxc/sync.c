@@ -32,7 +32,7 @@
 
 lxc_log_define(lxc_sync, lxc);
 
-static int __sync_wait(int fd, int sequence)
+static int __sync_wait(int fd, int sequence, int eof_ok)
 {
 	int sync = -1;
 	int ret;
@@ -43,8 +43,12 @@ static int __sync_wait(int fd, int sequence)
 		return -1;
 	}
 
-	if (!ret)
-		return 0;
+	if (!ret) {
+		if (eof_ok)
+			return 0;
+		ERROR("sync wait failure : peer went away");
+		return -1;
+	}
 
 	if (sync != sequence) {
 		ERROR("invalid sequence number %d. expected %d",
@@ -58,7 +62,7 @@ static int __sync_wake(int fd, int sequence)
 {
 	int sync = sequence;
 
-	if (write(fd, &sync, sizeof(sync)) < 0) {
+	if (send(fd, &sync, sizeof(sync), MSG_NOSIGNAL) < 0) {
 		ERROR("sync wake failure : %m");
 		return -1;
 	}
@@ -69,7 +73,7 @@ static int __sync_barrier(int fd, int sequence)
 {
 	if (__sync_wake(fd, sequence))
 		return -1;
-	return __sync_wait(fd, sequence+1);
+	return __sync_wait(fd, sequence+1, 1);
 }
 
 int lxc_sync_barrier_parent(struct lxc_handler *handler, int sequence)
@@ -89,7 +93,12 @@ int lxc_sync_wake_parent(struct lxc_handler *handler, int sequence)
 
 int lxc_sync_wait_child(struct lxc_handler *handler, int sequence)
 {
-	return __sync_wait(handler->sv[1], sequence);
+	return __sync_wait(handler->sv[1], sequence, 0);
+}
+
+int lxc_sync_wait_parent(struct lxc_handler *handler, int sequence)
+{
+	return __sync_wait(handler->sv[0], sequence, 0);
 }
 
 int lxc_sync_wake_child(struct lxc_handler *handler, int sequence)
@@ -25,9 +25,22 @@
 
 struct lxc_handler;
 
+/*
+ * The start protocol.  The parent tells the child as soon as each thing
+ * it depends on is ready instead of waiting for it in between, so that
+ * they work side by side:
+ *
+ * LXC_SYNC_CONFIGURE    parent: in its cgroup, ids mapped, set yourself up
+ * LXC_SYNC_NETWORK      parent: network devices moved in, set them up
+ * LXC_SYNC_CGROUP       child:  set up, waiting for the devices cgroup
+ * LXC_SYNC_POST_CGROUP  parent: all done, exec the container's init
+ *
+ * The child sends LXC_SYNC_ERROR when it fails.
+ */
 enum {
 	LXC_SYNC_CONFIGURE,
-	LXC_SYNC_POST_CONFIGURE,
+	LXC_SYNC_NETWORK,
+	LXC_SYNC_ERROR,
 	LXC_SYNC_CGROUP,
 	LXC_SYNC_POST_CGROUP,
 	LXC_SYNC_RESTART,
@@ -39,7 +52,9 @@ void lxc_sync_fini(struct lxc_handler *);
 void lxc_sync_fini_parent(struct lxc_handler *);
 void lxc_sync_fini_child(struct lxc_handler *);
 int lxc_sync_wake_child(struct lxc_handler *, int);
+/* unlike the barriers, these fail if the other side went away */
 int lxc_sync_wait_child(struct lxc_handler *, int);
+int lxc_sync_wait_parent(struct lxc_handler *, int);
 int lxc_sync_wake_parent(struct lxc_handler *, int);
 int lxc_sync_barrier_parent(struct lxc_handler *, int);
 int lxc_sync_barrier_child(struct lxc_handler *, int);
@@ -41,112 +41,16 @@
 #include <assert.h>
 
 #include "utils.h"
+#include "rmtree.h"
 #include "log.h"
 #include "lxclock.h"
 
 lxc_log_define(lxc_utils, lxc);
 
-static int _recursive_rmdir_onedev(char *dirname, dev_t pdev,
-				   const char *exclude, int level)
-{
-	struct dirent dirent, *direntp;
-	DIR *dir;
-	int ret, failed=0;
-	char pathname[MAXPATHLEN];
-	bool hadexclude = false;
-
-	dir = opendir(dirname);
-	if (!dir) {
-		ERROR("%s: failed to open %s", __func__, dirname);
-		return -1;
-	}
-
-	while (!readdir_r(dir, &dirent, &direntp)) {
-		struct stat mystat;
-		int rc;
-
-		if (!direntp)
-			break;
-
-		if (!strcmp(direntp->d_name, ".") ||
-		    !strcmp(direntp->d_name, ".."))
-			continue;
-
-		rc = snprintf(pathname, MAXPATHLEN, "%s/%s", dirname, direntp->d_name);
-		if (rc < 0 || rc >= MAXPATHLEN) {
-			ERROR("pathname too long");
-			failed=1;
-			continue;
-		}
-
-		if (!level && exclude && !strcmp(direntp->d_name, exclude)) {
-			ret = rmdir(pathname);
-			if (ret < 0) {
-				switch(errno) {
-				case ENOTEMPTY:
-					INFO("Not deleting snapshots");
-					hadexclude = true;
-					break;
-				case ENOTDIR:
-					ret = unlink(pathname);
-					if (ret)
-						INFO("%s: failed to remove %s", __func__, pathname);
-					break;
-				default:
-					SYSERROR("%s: failed to rmdir %s", __func__, pathname);
-					failed = 1;
-					break;
-				}
-			}
-			continue;
-		}
-
-		ret = lstat(pathname, &mystat);
-		if (ret) {
-			ERROR("%s: failed to stat %s", __func__, pathname);
-			failed=1;
-			continue;
-		}
-		if (mystat.st_dev != pdev)
-			continue;
-		if (S_ISDIR(mystat.st_mode)) {
-			if (_recursive_rmdir_onedev(pathname, pdev, exclude, level+1) < 0)
-				failed=1;
-		} else {
-			if (unlink(pathname) < 0) {
-				ERROR("%s: failed to delete %s", __func__, pathname);
-				failed=1;
-			}
-		}
-	}
-
-	if (rmdir(dirname) < 0) {
-		if (!hadexclude) {
-			ERROR("%s: failed to delete %s", __func__, dirname);
-			failed=1;
-		}
-	}
-
-	ret = closedir(dir);
-	if (ret) {
-		ERROR("%s: failed to close directory %s", __func__, dirname);
-		failed=1;
-	}
-
-	return failed ? -1 : 0;
-}
-
 /* returns 0 on success, -1 if there were any failures */
 extern int lxc_rmdir_onedev(char *path, const char *exclude)
 {
-	struct stat mystat;
-
-	if (lstat(path, &mystat) < 0) {
-		ERROR("%s: failed to stat %s", __func__, path);
-		return -1;
-	}
-
-	return _recursive_rmdir_onedev(path, mystat.st_dev, exclude, 0);
+	return lxc_remove_tree(path, exclude);
 }
 
 static int mount_fs(const char *source, const char *target, const char *type)
@@ -263,10 +167,20 @@ const char *lxc_global_config_value(const char *option_name)
 		{ "lxc.bdev.lvm.vg",        DEFAULT_VG      },
 		{ "lxc.bdev.lvm.thin_pool", DEFAULT_THIN_POOL },
 		{ "lxc.bdev.zfs.root",      DEFAULT_ZFSROOT },
+		{ "lxc.bdev.loop.prealloc", NULL            },
+		{ "lxc.bdev.overlayfs.layers", NULL         },
+		{ "lxc.bdev.nbd.prefetch",  NULL            },
+		{ "lxc.bdev.io.priority",   NULL            },
+		{ "lxc.bdev.io.cgroup",     NULL            },
+		{ "lxc.bdev.io.bwlimit",    NULL            },
 		{ "lxc.lxcpath",            NULL            },
+		{ "lxc.create.cache",       NULL            },
 		{ "lxc.default_config",     NULL            },
 		{ "lxc.cgroup.pattern",     DEFAULT_CGROUP_PATTERN },
 		{ "lxc.cgroup.use",         NULL            },
+		{ "lxc.cgroup.pool",        NULL            },
+		{ "lxc.veth.pool",          NULL            },
+		{ "lxc.logcollector",       NULL            },
 		{ NULL, NULL },
 	};
 
@@ -430,6 +344,21 @@ char *get_rundir()
 	return rundir;
 }
 
+char *lxc_ephemeral_dir(const char *lxcpath, const char *name)
+{
+	char *rundir, *path;
+	int ret;
+
+	rundir = get_rundir();
+	if (!rundir)
+		return NULL;
+	ret = asprintf(&path, "%s/lxc/ephemeral/%s/%s", rundir, lxcpath, name);
+	free(rundir);
+	if (ret < 0)
+		return NULL;
+	return path;
+}
+
 int wait_for_pid(pid_t pid)
 {
 	int status, ret;
@@ -606,6 +535,72 @@ const char** lxc_va_arg_list_to_argv_const(va_list ap, size_t skip)
 	return (const char**)lxc_va_arg_list_to_argv(ap, skip, 0);
 }
 
+static bool io_throttle_wanted(void)
+{
+	const char *prio = lxc_global_config_value("lxc.bdev.io.priority");
+	const char *cg = lxc_global_config_value("lxc.bdev.io.cgroup");
+
+	return (prio && *prio && strcmp(prio, "none")) || (cg && *cg);
+}
+
+void lxc_io_throttle(void)
+{
+	const char *prio = lxc_global_config_value("lxc.bdev.io.priority");
+	const char *cg = lxc_global_config_value("lxc.bdev.io.cgroup");
+	int class = -1, level = 4;
+	char *end, *path;
+
+	if (!prio || !*prio || strcmp(prio, "none") == 0)
+		;
+	else if (strcmp(prio, "idle") == 0) {
+		class = IOPRIO_CLASS_IDLE;
+		level = 0;
+	} else if (strncmp(prio, "be", 2) == 0 && (!prio[2] || prio[2] == ':')) {
+		class = IOPRIO_CLASS_BE;
+		if (prio[2]) {
+			errno = 0;
+			level = strtol(prio + 3, &end, 10);
+			if (errno || end == prio + 3 || *end || level < 0 || level > 7)
+				class = -1;
+		}
+		if (class < 0)
+			WARN("invalid lxc.bdev.io.priority '%s'", prio);
+	} else {
+		WARN("invalid lxc.bdev.io.priority '%s'", prio);
+	}
+	if (class >= 0 && syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+				  class << IOPRIO_CLASS_SHIFT | level) < 0)
+		WARN("failed to set the I/O priority to %s: %s", prio,
+		     strerror(errno));
+
+	if (!cg || !*cg)
+		return;
+	path = alloca(strlen(cg) + sizeof("/cgroup.procs"));
+	sprintf(path, "%s/cgroup.procs", cg);
+	/* 0 is the writer itself */
+	if (lxc_write_to_file(path, "0", 1, false) < 0)
+		WARN("failed to move to the cgroup %s: %s", cg, strerror(errno));
+}
+
+int lxc_io_throttled(int (*fn)(void *), void *data)
+{
+	pid_t pid;
+
+	if (!io_throttle_wanted())
+		return fn(data);
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("failed to fork");
+		return -1;
+	}
+	if (pid == 0) {
+		lxc_io_throttle();
+		_exit(fn(data) ? 1 : 0);
+	}
+	return wait_for_pid(pid);
+}
+
 FILE *fopen_cloexec(const char *path, const char *mode)
 {
 	int open_mode = 0;
@@ -650,7 +645,36 @@ FILE *fopen_cloexec(const char *path, const char *mode)
 	return ret;
 }
 
-extern struct lxc_popen_FILE *lxc_popen(const char *command)
+int lxc_openpty(int *master, int *slave, char *name)
+{
+	char path[MAXPATHLEN];
+	int saved_errno;
+
+	*master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (*master < 0)
+		return -1;
+
+	if (grantpt(*master) < 0 || unlockpt(*master) < 0 ||
+	    ptsname_r(*master, path, sizeof(path)) != 0)
+		goto err;
+
+	*slave = open(path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (*slave < 0)
+		goto err;
+
+	if (name)
+		strcpy(name, path);
+	return 0;
+
+err:
+	saved_errno = errno;
+	close(*master);
+	errno = saved_errno;
+	return -1;
+}
+
+static struct lxc_popen_FILE *do_lxc_popen(const char *command,
+		char * const argv[])
 {
 	struct lxc_popen_FILE *fp = NULL;
 	int parent_end = -1, child_end = -1;
@@ -688,7 +712,7 @@ extern struct lxc_popen_FILE *lxc_popen(const char *command)
 			 */
 			if (fcntl(child_end, F_SETFD, 0) != 0) {
 				SYSERROR("Failed to remove FD_CLOEXEC from fd.");
-				exit(127);
+				_exit(127);
 			}
 		}
 
@@ -703,8 +727,11 @@ extern struct lxc_popen_FILE *lxc_popen(const char *command)
 			sigprocmask(SIG_UNBLOCK, &mask, NULL);
 		}
 
-		execl("/bin/sh", "sh", "-c", command, (char *) NULL);
-		exit(127);
+		if (argv)
+			execvp(argv[0], argv);
+		else
+			execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+		_exit(127);
 	}
 
 	/* parent */
@@ -750,6 +777,16 @@ error:
 	return NULL;
 }
 
+extern struct lxc_popen_FILE *lxc_popen(const char *command)
+{
+	return do_lxc_popen(command, NULL);
+}
+
+extern struct lxc_popen_FILE *lxc_popenv(char * const argv[])
+{
+	return do_lxc_popen(NULL, argv);
+}
+
 extern int lxc_pclose(struct lxc_popen_FILE *fp)
 {
 	FILE *f = NULL;
@@ -882,13 +919,10 @@ char **lxc_normalize_path(const char *path)
 	for (pos = 0; pos < components_len; ) {
 		if (!strcmp(components[pos], ".") || (!strcmp(components[pos], "..") && pos == 0)) {
 			/* eat this element */
-			free(components[pos]);
 			memmove(&components[pos], &components[pos+1], sizeof(char *) * (components_len - pos));
 			components_len--;
 		} else if (!strcmp(components[pos], "..")) {
 			/* eat this and the previous element */
-			free(components[pos - 1]);
-			free(components[pos]);
 			memmove(&components[pos-1], &components[pos+1], sizeof(char *) * (components_len - pos));
 			components_len -= 2;
 			pos--;
@@ -937,78 +971,96 @@ bool lxc_string_in_list(const char *needle, const char *haystack, char _sep)
 	return 0;
 }
 
-char **lxc_string_split(const char *string, char _sep)
+int lxc_strv_add(struct lxc_strv *sv, const char *s, size_t len)
 {
-	char *token, *str, *saveptr = NULL;
-	char sep[2] = { _sep, '\0' };
-	char **result = NULL;
-	size_t result_capacity = 0;
-	size_t result_count = 0;
-	int r, saved_errno;
+	size_t need = sv->len + len + 1, size;
+	char *buf;
 
-	if (!string)
-		return calloc(1, sizeof(char *));
+	if (need > sv->size) {
+		size = sv->size ? sv->size : 64;
+		while (size < need)
+			size *= 2;
+		buf = realloc(sv->buf, size);
+		if (!buf)
+			return -1;
+		sv->buf = buf;
+		sv->size = size;
+	}
+	memcpy(sv->buf + sv->len, s, len);
+	sv->buf[sv->len + len] = '\0';
+	sv->len = need;
+	sv->count++;
+	return 0;
+}
 
-	str = alloca(strlen(string)+1);
-	strcpy(str, string);
-	for (; (token = strtok_r(str, sep, &saveptr)); str = NULL) {
-		r = lxc_grow_array((void ***)&result, &result_capacity, result_count + 1, 16);
-		if (r < 0)
-			goto error_out;
-		result[result_count] = strdup(token);
-		if (!result[result_count])
-			goto error_out;
-		result_count++;
-	}
-
-	/* if we allocated too much, reduce it */
-	return realloc(result, (result_count + 1) * sizeof(char *));
-error_out:
-	saved_errno = errno;
-	lxc_free_array((void **)result, free);
-	errno = saved_errno;
-	return NULL;
+char **lxc_strv_finish(struct lxc_strv *sv)
+{
+	char **result, *p;
+	size_t i;
+
+	result = malloc((sv->count + 1) * sizeof(char *) + sv->len);
+	if (result) {
+		p = (char *)(result + sv->count + 1);
+		if (sv->len)
+			memcpy(p, sv->buf, sv->len);
+		for (i = 0; i < sv->count; i++) {
+			result[i] = p;
+			p += strlen(p) + 1;
+		}
+		result[sv->count] = NULL;
+	}
+	lxc_strv_free(sv);
+	return result;
 }
 
-char **lxc_string_split_and_trim(const char *string, char _sep)
+void lxc_strv_free(struct lxc_strv *sv)
 {
-	char *token, *str, *saveptr = NULL;
-	char sep[2] = { _sep, '\0' };
-	char **result = NULL;
-	size_t result_capacity = 0;
-	size_t result_count = 0;
-	int r, saved_errno;
-	size_t i = 0;
+	free(sv->buf);
+	memset(sv, 0, sizeof(*sv));
+}
+
+static char **string_split(const char *string, char sep, bool trim)
+{
+	struct lxc_strv sv = LXC_STRV_INIT;
+	const char *p, *end;
+	size_t len;
 
 	if (!string)
 		return calloc(1, sizeof(char *));
 
-	str = alloca(strlen(string)+1);
-	strcpy(str, string);
-	for (; (token = strtok_r(str, sep, &saveptr)); str = NULL) {
-		while (token[0] == ' ' || token[0] == '\t')
-			token++;
-		i = strlen(token);
-		while (i > 0 && (token[i - 1] == ' ' || token[i - 1] == '\t')) {
-			token[i - 1] = '\0';
-			i--;
+	for (p = string; *p; p = end) {
+		/* like strtok(), never return empty elements */
+		while (*p == sep)
+			p++;
+		if (!*p)
+			break;
+		end = strchrnul(p, sep);
+		len = end - p;
+		if (trim) {
+			while (len && (*p == ' ' || *p == '\t')) {
+				p++;
+				len--;
+			}
+			while (len && (p[len - 1] == ' ' || p[len - 1] == '\t'))
+				len--;
 		}
-		r = lxc_grow_array((void ***)&result, &result_capacity, result_count + 1, 16);
-		if (r < 0)
-			goto error_out;
-		result[result_count] = strdup(token);
-		if (!result[result_count])
-			goto error_out;
-		result_count++;
-	}
-
-	/* if we allocated too much, reduce it */
-	return realloc(result, (result_count + 1) * sizeof(char *));
-error_out:
-	saved_errno = errno;
-	lxc_free_array((void **)result, free);
-	errno = saved_errno;
-	return NULL;
+		if (lxc_strv_add(&sv, p, len) < 0) {
+			lxc_strv_free(&sv);
+			return NULL;
+		}
+	}
+
+	return lxc_strv_finish(&sv);
+}
+
+char **lxc_string_split(const char *string, char sep)
+{
+	return string_split(string, sep, false);
+}
+
+char **lxc_string_split_and_trim(const char *string, char sep)
+{
+	return string_split(string, sep, true);
 }
 
 void lxc_free_array(void **array, lxc_free_fn element_free_fn)
@@ -1031,9 +1083,15 @@ int lxc_grow_array(void ***array, size_t* capacity, size_t new_size, size_t capa
 		*capacity = 0;
 	}
 
+	/* grow geometrically once past the first increment, so that filling
+	 * a long array does not reallocate it every few elements */
 	new_capacity = *capacity;
-	while (new_size + 1 > new_capacity)
-		new_capacity += capacity_increment;
+	while (new_size + 1 > new_capacity) {
+		if (new_capacity > capacity_increment)
+			new_capacity *= 2;
+		else
+			new_capacity += capacity_increment;
+	}
 	if (new_capacity != *capacity) {
 		/* we have to reallocate */
 		new_array = realloc(*array, new_capacity * sizeof(void *));
@@ -1117,6 +1175,65 @@ int lxc_read_from_file(const char *filename, void* buf, size_t count)
 	return ret;
 }
 
+int lxc_readat(int dirfd, const char *path, char *buf, size_t count)
+{
+	int fd, saved_errno;
+	ssize_t ret;
+
+	if (!count) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ret = lxc_read_nointr(fd, buf, count - 1);
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	if (ret < 0)
+		return -1;
+	buf[ret] = '\0';
+	return ret;
+}
+
+int lxc_writeat(int dirfd, const char *path, const void *buf, size_t count)
+{
+	int fd, saved_errno;
+	ssize_t ret;
+
+	fd = openat(dirfd, path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ret = lxc_write_nointr(fd, buf, count);
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	if (ret < 0 || (size_t)ret != count)
+		return -1;
+	return 0;
+}
+
+unsigned long long lxc_proc_start_time(pid_t pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long long start;
+	int ret;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	ret = lxc_readat(AT_FDCWD, path, buf, sizeof(buf));
+	if (ret <= 0)
+		return 0;
+
+	/* the command name may hold anything, fields go on after its ')' */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+			 "%*u %*u %*d %*d %*d %*d %*d %*d %llu", &start) != 1)
+		return 0;
+	return start;
+}
+
 void **lxc_append_null_to_array(void **array, size_t count)
 {
 	void **temp;
@@ -1446,3 +1563,63 @@ out1:
 	free(retv);
 	return NULL;
 }
+
+static bool probe_bytes(int fd, off_t off, const char *magic, size_t len)
+{
+	char buf[16];
+
+	return pread(fd, buf, len, off) == len && memcmp(buf, magic, len) == 0;
+}
+
+static uint32_t probe_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Recognize the filesystem on @path from its superblock, the way blkid
+ * does, for the filesystems containers are usually kept on.  Returns
+ * NULL when it is none of those.
+ */
+const char *lxc_probe_fstype(const char *path)
+{
+	unsigned char sb[0x68];
+	const char *type = NULL;
+	uint32_t compat, incompat, ro_compat;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (pread(fd, sb, sizeof(sb), 1024) == sizeof(sb) &&
+	    sb[0x38] == 0x53 && sb[0x39] == 0xef) {
+		compat = probe_le32(sb + 0x5c);
+		incompat = probe_le32(sb + 0x60);
+		ro_compat = probe_le32(sb + 0x64);
+		/* anything beyond filetype, recover and meta_bg is ext4's */
+		if (incompat & 0x0008)
+			type = NULL; /* external journal */
+		else if ((incompat & ~0x0016) || (ro_compat & ~0x0007))
+			type = "ext4";
+		else if (compat & 0x0004)
+			type = "ext3";
+		else
+			type = "ext2";
+	} else if (probe_bytes(fd, 0, "XFSB", 4)) {
+		type = "xfs";
+	} else if (probe_bytes(fd, 0x10040, "_BHRfS_M", 8)) {
+		type = "btrfs";
+	} else if (probe_bytes(fd, 0, "hsqs", 4)) {
+		type = "squashfs";
+	} else if (probe_bytes(fd, 1024, "\x10\x20\xf5\xf2", 4)) {
+		type = "f2fs";
+	} else if (probe_bytes(fd, 1024, "\xe2\xe1\xf5\xe0", 4)) {
+		type = "erofs";
+	} else if (probe_bytes(fd, 32769, "CD001", 5)) {
+		type = "iso9660";
+	}
+
+	close(fd);
+	return type;
+}
@@ -40,6 +40,8 @@ extern int get_u16(unsigned short *val, const char *arg, int base);
 extern int mkdir_p(const char *dir, mode_t mode);
 extern void remove_trailing_slashes(char *p);
 extern char *get_rundir(void);
+/* where the rootfs changes of an ephemeral container are kept */
+extern char *lxc_ephemeral_dir(const char *lxcpath, const char *name);
 
 extern const char *lxc_global_config_value(const char *option_name);
 
@@ -148,9 +150,61 @@ static inline int signalfd(int fd, const sigset_t *mask, int flags)
 }
 #endif
 
+/* pidfds, the numbers are the same on all architectures but alpha */
+#ifndef __NR_pidfd_send_signal
+#  define __NR_pidfd_send_signal 424
+#endif
+#ifndef __NR_pidfd_open
+#  define __NR_pidfd_open 434
+#endif
+
+/*
+ * A pidfd keeps naming the process it was opened for: it polls readable
+ * once it exits and it can be signalled without the pid being reused
+ * under our feet.  Both fail with ENOSYS on kernels older than 5.3.
+ */
+static inline int lxc_pidfd_open(pid_t pid)
+{
+	return syscall(__NR_pidfd_open, pid, 0);
+}
+
+static inline int lxc_pidfd_send_signal(int pidfd, int sig)
+{
+	return syscall(__NR_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
+
+#ifndef __NR_ioprio_set
+#  define __NR_ioprio_set 251
+#endif
+#ifndef IOPRIO_CLASS_IDLE
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#endif
+
+/*
+ * Bulk copies, mkfs and deletes of container storage are run with the
+ * I/O priority of lxc.bdev.io.priority and in the cgroup of
+ * lxc.bdev.io.cgroup, so as not to starve the running containers.
+ * lxc_io_throttle() applies both to the calling process, meant to be
+ * one forked for the purpose.  lxc_io_throttled() runs @fn in such a
+ * process, or directly when nothing is configured, and returns 0 if
+ * it did.
+ */
+extern void lxc_io_throttle(void);
+extern int lxc_io_throttled(int (*fn)(void *), void *data);
+
 /* open a file with O_CLOEXEC */
 FILE *fopen_cloexec(const char *path, const char *mode);
 
+/*
+ * openpty() whose two fds are close-on-exec from the start, so that a
+ * fork in another thread can't leak them.  @name, if not NULL, receives
+ * the path of the slave.
+ */
+extern int lxc_openpty(int *master, int *slave, char *name);
+
 
 /* Struct to carry child pid from lxc_popen() to lxc_pclose().
  * Not an opaque struct to allow direct access to the underlying FILE *
@@ -171,8 +225,13 @@ struct lxc_popen_FILE {
  */
 extern struct lxc_popen_FILE *lxc_popen(const char *command);
 
+/* Same as lxc_popen(), but runs argv[0] (looked up in PATH) with the
+ * arguments argv directly instead of going through /bin/sh.
+ */
+extern struct lxc_popen_FILE *lxc_popenv(char * const argv[]);
+
 /* pclose() replacement to be used on struct lxc_popen_FILE *,
- * returned by lxc_popen().
+ * returned by lxc_popen() or lxc_popenv().
  * Waits for associated process to terminate, returns its exit status and
  * frees resources, pointed to by struct lxc_popen_FILE *.
  */
@@ -223,6 +282,20 @@ extern int sha1sum_file(char *fnam, unsigned char *md_value);
 extern int lxc_write_to_file(const char *filename, const void* buf, size_t count, bool add_newline);
 extern int lxc_read_from_file(const char *filename, void* buf, size_t count);
 
+/* read and write small files, e.g. of /proc or cgroups, relative to an open
+ * directory.  lxc_readat() reads up to count - 1 bytes and NUL-terminates
+ * them, returning their number; lxc_writeat() neither creates nor
+ * truncates the file.  Both return -1 on error.
+ */
+extern int lxc_readat(int dirfd, const char *path, char *buf, size_t count);
+extern int lxc_writeat(int dirfd, const char *path, const void *buf, size_t count);
+
+/* start time of @pid in clock ticks since boot, from field 22 of
+ * /proc/pid/stat, or 0 if there is no such process.  With the pid, it
+ * tells a process from another which got the same pid since.
+ */
+extern unsigned long long lxc_proc_start_time(pid_t pid);
+
 /* convert variadic argument lists to arrays (for execl type argument lists) */
 extern char** lxc_va_arg_list_to_argv(va_list ap, size_t skip, int do_strdup);
 extern const char** lxc_va_arg_list_to_argv_const(va_list ap, size_t skip);
@@ -243,14 +316,33 @@ extern char *lxc_string_join(const char *sep, const char **parts, bool use_as_pr
  */
 extern char **lxc_normalize_path(const char *path);
 extern char *lxc_append_paths(const char *first, const char *second);
-/* Note: the following two functions use strtok(), so they will never
- *       consider an empty element, even if two delimiters are next to
- *       each other.
+/* Note: the following functions will never consider an empty element,
+ *       even if two delimiters are next to each other.
+ *       lxc_string_split(), lxc_string_split_and_trim() and
+ *       lxc_normalize_path() return their result in a single allocation
+ *       (see lxc_strv_finish()), to be freed with free().
  */
 extern bool lxc_string_in_list(const char *needle, const char *haystack, char sep);
 extern char **lxc_string_split(const char *string, char sep);
 extern char **lxc_string_split_and_trim(const char *string, char sep);
 
+/* Builder for NULL-terminated string arrays: the strings are appended to
+ * one buffer, growing geometrically, and lxc_strv_finish() returns them as
+ * an array whose pointers and characters share a single allocation, freed
+ * with free().  Start from LXC_STRV_INIT.
+ */
+struct lxc_strv {
+	char *buf;
+	size_t len;
+	size_t size;
+	size_t count;
+};
+#define LXC_STRV_INIT { NULL, 0, 0, 0 }
+extern int lxc_strv_add(struct lxc_strv *sv, const char *s, size_t len);
+/* returns NULL on error; the builder is reset in any case */
+extern char **lxc_strv_finish(struct lxc_strv *sv);
+extern void lxc_strv_free(struct lxc_strv *sv);
+
 /* some simple array manipulation utilities */
 typedef void (*lxc_free_fn)(void *);
 typedef void *(*lxc_dup_fn)(void *);
@@ -281,4 +373,5 @@ int detect_shared_rootfs(void);
 int detect_ramfs_rootfs(void);
 char *on_path(char *cmd, const char *rootfs);
 bool file_exists(const char *f);
+const char *lxc_probe_fstype(const char *path);
 char *choose_init(const char *rootfs);
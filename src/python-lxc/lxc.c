@@ -351,6 +351,217 @@ LXC_get_version(PyObject *self, PyObject *args)
     return PyUnicode_FromString(lxc_get_version());
 }
 
+static const struct {
+    const char *name;
+    int flag;
+} inventory_fields[] = {
+    {"state", LXC_INVENTORY_STATE},
+    {"pid", LXC_INVENTORY_PID},
+    {"groups", LXC_INVENTORY_GROUPS},
+    {"autostart", LXC_INVENTORY_AUTOSTART},
+    {"ipv4", LXC_INVENTORY_IPV4},
+    {"ipv6", LXC_INVENTORY_IPV6},
+    {"interfaces", LXC_INVENTORY_INTERFACES},
+};
+
+static PyObject *
+inventory_list(char **values, int as_tuple)
+{
+    PyObject *ret, *item;
+    int i, n = 0;
+
+    while (values && values[n])
+        n++;
+
+    ret = as_tuple ? PyTuple_New(n) : PyList_New(n);
+    if (!ret)
+        return NULL;
+    for (i = 0; i < n; i++) {
+        item = PyUnicode_FromString(values[i]);
+        if (!item) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+        if (as_tuple)
+            PyTuple_SET_ITEM(ret, i, item);
+        else
+            PyList_SET_ITEM(ret, i, item);
+    }
+    return ret;
+}
+
+static int
+inventory_set(PyObject *dict, const char *key, PyObject *value)
+{
+    int ret;
+
+    if (!value)
+        return -1;
+    ret = PyDict_SetItemString(dict, key, value);
+    Py_DECREF(value);
+    return ret;
+}
+
+static PyObject *
+inventory_entry(struct lxc_inventory *e, int fields)
+{
+    PyObject *entry;
+    int ret = 0;
+
+    entry = PyDict_New();
+    if (!entry)
+        return NULL;
+
+    ret |= inventory_set(entry, "name", PyUnicode_FromString(e->name));
+    if (fields & LXC_INVENTORY_STATE) {
+        if (e->state)
+            ret |= inventory_set(entry, "state",
+                                 PyUnicode_FromString(e->state));
+        else
+            ret |= PyDict_SetItemString(entry, "state", Py_None);
+    }
+    if (fields & LXC_INVENTORY_PID)
+        ret |= inventory_set(entry, "pid", PyLong_FromLong(e->init_pid));
+    if (fields & LXC_INVENTORY_GROUPS)
+        ret |= inventory_set(entry, "groups", inventory_list(e->groups, 0));
+    if (fields & LXC_INVENTORY_AUTOSTART)
+        ret |= PyDict_SetItemString(entry, "autostart",
+                                    e->autostart ? Py_True : Py_False);
+    if (fields & LXC_INVENTORY_IPV4)
+        ret |= inventory_set(entry, "ipv4", inventory_list(e->ipv4, 1));
+    if (fields & LXC_INVENTORY_IPV6)
+        ret |= inventory_set(entry, "ipv6", inventory_list(e->ipv6, 1));
+    if (fields & LXC_INVENTORY_INTERFACES)
+        ret |= inventory_set(entry, "interfaces",
+                             inventory_list(e->interfaces, 1));
+
+    if (ret) {
+        Py_DECREF(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+static PyObject *
+LXC_inventory(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"config_path", "fields", NULL};
+    char *config_path = NULL;
+    PyObject *py_fields = NULL, *seq, *list, *entry;
+    struct lxc_inventory *inv;
+    int fields = LXC_INVENTORY_MAXFLAGS - 1;
+    int i, j, n;
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|zO", kwlist,
+                                      &config_path, &py_fields))
+        return NULL;
+
+    if (py_fields && py_fields != Py_None) {
+        seq = PySequence_Fast(py_fields, "fields needs to be a sequence");
+        if (!seq)
+            return NULL;
+
+        fields = 0;
+        for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+            const char *name;
+
+            name = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i));
+            if (!name) {
+                Py_DECREF(seq);
+                return NULL;
+            }
+            if (!strcmp(name, "name"))
+                continue;
+            for (j = 0; j < sizeof(inventory_fields) /
+                            sizeof(inventory_fields[0]); j++)
+                if (!strcmp(name, inventory_fields[j].name))
+                    break;
+            if (j == sizeof(inventory_fields) / sizeof(inventory_fields[0])) {
+                PyErr_Format(PyExc_ValueError, "unknown field '%s'", name);
+                Py_DECREF(seq);
+                return NULL;
+            }
+            fields |= inventory_fields[j].flag;
+        }
+        Py_DECREF(seq);
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    n = lxc_get_inventory(config_path, fields, &inv);
+    Py_END_ALLOW_THREADS
+
+    if (n < 0) {
+        PyErr_SetString(PyExc_ValueError, "failure to list containers");
+        return NULL;
+    }
+
+    list = PyList_New(n);
+    for (i = 0; list && i < n; i++) {
+        entry = inventory_entry(&inv[i], fields);
+        if (!entry) {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, i, entry);
+    }
+    lxc_inventory_free(inv, n);
+
+    return list;
+}
+
+static PyObject *
+LXC_get_stats(PyObject *self, PyObject *args)
+{
+    struct lxc_api_stat *stats;
+    PyObject *dict, *entry, *buckets;
+    int i, j, n;
+
+    n = lxc_get_stats(&stats);
+    if (n < 0)
+        return PyErr_NoMemory();
+
+    dict = PyDict_New();
+    for (i = 0; dict && i < n; i++) {
+        buckets = PyList_New(LXC_STATS_BUCKETS);
+        for (j = 0; buckets && j < LXC_STATS_BUCKETS; j++)
+            PyList_SET_ITEM(buckets, j,
+                            PyLong_FromUnsignedLongLong(stats[i].buckets[j]));
+        entry = buckets ? Py_BuildValue("{s:K,s:K,s:K,s:N}",
+                                        "count", stats[i].count,
+                                        "total_ns", stats[i].total_ns,
+                                        "max_ns", stats[i].max_ns,
+                                        "buckets", buckets) : NULL;
+        if (!entry || PyDict_SetItemString(dict, stats[i].name, entry)) {
+            Py_XDECREF(entry);
+            Py_CLEAR(dict);
+            break;
+        }
+        Py_DECREF(entry);
+    }
+    free(stats);
+
+    return dict;
+}
+
+static PyObject *
+LXC_stats_enable(PyObject *self, PyObject *arg)
+{
+    int enable = PyObject_IsTrue(arg);
+
+    if (enable < 0)
+        return NULL;
+
+    return PyBool_FromLong(lxc_stats_enable(enable));
+}
+
+static PyObject *
+LXC_stats_reset(PyObject *self, PyObject *args)
+{
+    lxc_stats_reset();
+
+    Py_RETURN_NONE;
+}
+
 static PyObject *
 LXC_list_containers(PyObject *self, PyObject *args, PyObject *kwds)
 {
@@ -386,12 +597,14 @@ LXC_list_containers(PyObject *self, PyObject *args, PyObject *kwds)
     }
 
     /* Call the right API function based on filters */
+    Py_BEGIN_ALLOW_THREADS
     if (list_active == 1 && list_defined == 1)
         list_count = list_all_containers(config_path, &names, NULL);
     else if (list_active == 1)
         list_count = list_active_containers(config_path, &names, NULL);
     else if (list_defined == 1)
         list_count = list_defined_containers(config_path, &names, NULL);
+    Py_END_ALLOW_THREADS
 
     /* Handle failure */
     if (list_count < 0) {
@@ -527,6 +740,7 @@ Container_add_device_node(Container *self, PyObject *args, PyObject *kwds)
     char *dst_path = NULL;
     PyObject *py_src_path = NULL;
     PyObject *py_dst_path = NULL;
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "O&|O&", kwlist,
                                       PyUnicode_FSConverter, &py_src_path,
@@ -543,8 +757,12 @@ Container_add_device_node(Container *self, PyObject *args, PyObject *kwds)
         assert(dst_path != NULL);
     }
 
-    if (self->container->add_device_node(self->container, src_path,
-                                         dst_path)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->add_device_node(self->container, src_path,
+                                           dst_path);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_XDECREF(py_src_path);
         Py_XDECREF(py_dst_path);
         Py_RETURN_TRUE;
@@ -608,6 +826,54 @@ Container_attach_wait(Container *self, PyObject *args, PyObject *kwds)
     return Container_attach_and_possibly_wait(self, args, kwds, 1);
 }
 
+static PyObject *
+Container_cache_state(Container *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"cache", NULL};
+    PyObject *py_cache = NULL;
+    bool ret;
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist,
+                                      &py_cache))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->cache_state(self->container,
+                                       !py_cache || py_cache == Py_True);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
+        Py_RETURN_TRUE;
+    }
+
+    Py_RETURN_FALSE;
+}
+
+static PyObject *
+Container_checkpoint(Container *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"directory", "stop", "verbose", NULL};
+    char *directory = NULL;
+    PyObject *py_stop = NULL, *py_verbose = NULL;
+    bool ret;
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "s|OO", kwlist,
+                                      &directory, &py_stop, &py_verbose))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->checkpoint(self->container, directory,
+                                      py_stop == Py_True,
+                                      py_verbose == Py_True);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
+        Py_RETURN_TRUE;
+    }
+
+    Py_RETURN_FALSE;
+}
+
 static PyObject *
 Container_clear_config(Container *self, PyObject *args, PyObject *kwds)
 {
@@ -676,9 +942,11 @@ Container_clone(Container *self, PyObject *args, PyObject *kwds)
         assert(config_path != NULL);
     }
 
+    Py_BEGIN_ALLOW_THREADS
     new_container = self->container->clone(self->container, newname,
                                            config_path, flags, bdevtype,
                                            bdevdata, newsize, hookargs);
+    Py_END_ALLOW_THREADS
 
     Py_XDECREF(py_config_path);
 
@@ -703,14 +971,19 @@ Container_console(Container *self, PyObject *args, PyObject *kwds)
     static char *kwlist[] = {"ttynum", "stdinfd", "stdoutfd", "stderrfd",
                              "escape", NULL};
     int ttynum = -1, stdinfd = 0, stdoutfd = 1, stderrfd = 2, escape = 1;
+    int ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "|iiiii", kwlist,
                                       &ttynum, &stdinfd, &stdoutfd, &stderrfd,
                                       &escape))
         return NULL;
 
-    if (self->container->console(self->container, ttynum,
-            stdinfd, stdoutfd, stderrfd, escape) == 0) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->console(self->container, ttynum,
+            stdinfd, stdoutfd, stderrfd, escape);
+    Py_END_ALLOW_THREADS
+
+    if (ret == 0) {
         Py_RETURN_TRUE;
     }
     Py_RETURN_FALSE;
@@ -743,6 +1016,7 @@ Container_create(Container *self, PyObject *args, PyObject *kwds)
     PyObject *vargs = NULL;
     int i = 0;
     static char *kwlist[] = {"template", "flags", "args", NULL};
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "|siO", kwlist,
                                       &template_name, &flags, &vargs))
@@ -761,8 +1035,12 @@ Container_create(Container *self, PyObject *args, PyObject *kwds)
         }
     }
 
-    if (self->container->create(self->container, template_name, NULL, NULL,
-                                flags, create_args))
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->create(self->container, template_name, NULL, NULL,
+                                  flags, create_args);
+    Py_END_ALLOW_THREADS
+
+    if (ret)
         retval = Py_True;
     else
         retval = Py_False;
@@ -783,7 +1061,13 @@ Container_create(Container *self, PyObject *args, PyObject *kwds)
 static PyObject *
 Container_destroy(Container *self, PyObject *args, PyObject *kwds)
 {
-    if (self->container->destroy(self->container)) {
+    bool ret;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->destroy(self->container);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -793,7 +1077,13 @@ Container_destroy(Container *self, PyObject *args, PyObject *kwds)
 static PyObject *
 Container_freeze(Container *self, PyObject *args, PyObject *kwds)
 {
-    if (self->container->freeze(self->container)) {
+    bool ret;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->freeze(self->container);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -805,14 +1095,16 @@ Container_get_cgroup_item(Container *self, PyObject *args, PyObject *kwds)
 {
     static char *kwlist[] = {"key", NULL};
     char* key = NULL;
-    int len = 0;
+    int len = 0, ret_len;
     PyObject *ret = NULL;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist,
                                       &key))
         return NULL;
 
+    Py_BEGIN_ALLOW_THREADS
     len = self->container->get_cgroup_item(self->container, key, NULL, 0);
+    Py_END_ALLOW_THREADS
 
     if (len < 0) {
         PyErr_SetString(PyExc_KeyError, "Invalid cgroup entry");
@@ -823,8 +1115,12 @@ Container_get_cgroup_item(Container *self, PyObject *args, PyObject *kwds)
     if (value == NULL)
         return PyErr_NoMemory();
 
-    if (self->container->get_cgroup_item(self->container,
-                                            key, value, len + 1) != len) {
+    Py_BEGIN_ALLOW_THREADS
+    ret_len = self->container->get_cgroup_item(self->container,
+                                               key, value, len + 1);
+    Py_END_ALLOW_THREADS
+
+    if (ret_len != len) {
         PyErr_SetString(PyExc_ValueError, "Unable to read config value");
         free(value);
         return NULL;
@@ -925,7 +1221,9 @@ Container_get_interfaces(Container *self)
     PyObject* ret;
 
     /* Get the interfaces */
+    Py_BEGIN_ALLOW_THREADS
     interfaces = self->container->get_interfaces(self->container);
+    Py_END_ALLOW_THREADS
     if (!interfaces)
         return PyTuple_New(0);
 
@@ -980,7 +1278,9 @@ Container_get_ips(Container *self, PyObject *args, PyObject *kwds)
         return NULL;
 
     /* Get the IPs */
+    Py_BEGIN_ALLOW_THREADS
     ips = self->container->get_ips(self->container, interface, family, scope);
+    Py_END_ALLOW_THREADS
     if (!ips)
         return PyTuple_New(0);
 
@@ -1030,7 +1330,9 @@ Container_get_running_config_item(Container *self, PyObject *args,
                                       &key))
         return NULL;
 
+    Py_BEGIN_ALLOW_THREADS
     value = self->container->get_running_config_item(self->container, key);
+    Py_END_ALLOW_THREADS
 
     if (!value)
         Py_RETURN_NONE;
@@ -1069,7 +1371,13 @@ Container_load_config(Container *self, PyObject *args, PyObject *kwds)
 static PyObject *
 Container_reboot(Container *self, PyObject *args, PyObject *kwds)
 {
-    if (self->container->reboot(self->container)) {
+    bool ret;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->reboot(self->container);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -1081,12 +1389,17 @@ Container_rename(Container *self, PyObject *args, PyObject *kwds)
 {
     char *new_name = NULL;
     static char *kwlist[] = {"new_name", NULL};
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "s|", kwlist,
                                       &new_name))
         return NULL;
 
-    if (self->container->rename(self->container, new_name)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->rename(self->container, new_name);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -1101,6 +1414,7 @@ Container_remove_device_node(Container *self, PyObject *args, PyObject *kwds)
     char *dst_path = NULL;
     PyObject *py_src_path = NULL;
     PyObject *py_dst_path = NULL;
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "O&|O&", kwlist,
                                       PyUnicode_FSConverter, &py_src_path,
@@ -1117,8 +1431,12 @@ Container_remove_device_node(Container *self, PyObject *args, PyObject *kwds)
         assert(dst_path != NULL);
     }
 
-    if (self->container->remove_device_node(self->container, src_path,
-                                            dst_path)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->remove_device_node(self->container, src_path,
+                                              dst_path);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_XDECREF(py_src_path);
         Py_XDECREF(py_dst_path);
         Py_RETURN_TRUE;
@@ -1129,6 +1447,30 @@ Container_remove_device_node(Container *self, PyObject *args, PyObject *kwds)
     Py_RETURN_FALSE;
 }
 
+static PyObject *
+Container_restore(Container *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"directory", "verbose", NULL};
+    char *directory = NULL;
+    PyObject *py_verbose = NULL;
+    bool ret;
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "s|O", kwlist,
+                                      &directory, &py_verbose))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->restore(self->container, directory,
+                                   py_verbose == Py_True);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
+        Py_RETURN_TRUE;
+    }
+
+    Py_RETURN_FALSE;
+}
+
 static PyObject *
 Container_save_config(Container *self, PyObject *args, PyObject *kwds)
 {
@@ -1160,12 +1502,17 @@ Container_set_cgroup_item(Container *self, PyObject *args, PyObject *kwds)
     static char *kwlist[] = {"key", "value", NULL};
     char *key = NULL;
     char *value = NULL;
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "ss", kwlist,
                                       &key, &value))
         return NULL;
 
-    if (self->container->set_cgroup_item(self->container, key, value)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->set_cgroup_item(self->container, key, value);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -1212,12 +1559,17 @@ Container_shutdown(Container *self, PyObject *args, PyObject *kwds)
 {
     static char *kwlist[] = {"timeout", NULL};
     int timeout = -1;
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist,
                                       &timeout))
         return NULL;
 
-    if (self->container->shutdown(self->container, timeout)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->shutdown(self->container, timeout);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -1243,7 +1595,9 @@ Container_snapshot(Container *self, PyObject *args, PyObject *kwds)
         assert(comment_path != NULL);
     }
 
+    Py_BEGIN_ALLOW_THREADS
     retval = self->container->snapshot(self->container, comment_path);
+    Py_END_ALLOW_THREADS
 
     Py_XDECREF(py_comment_path);
 
@@ -1264,12 +1618,17 @@ Container_snapshot_destroy(Container *self, PyObject *args, PyObject *kwds)
 {
     char *name = NULL;
     static char *kwlist[] = {"name", NULL};
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "s|", kwlist,
                                       &name))
         return NULL;
 
-    if (self->container->snapshot_destroy(self->container, name)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->snapshot_destroy(self->container, name);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -1284,7 +1643,9 @@ Container_snapshot_list(Container *self, PyObject *args, PyObject *kwds)
     PyObject *list = NULL;
     int i = 0;
 
+    Py_BEGIN_ALLOW_THREADS
     snap_count = self->container->snapshot_list(self->container, &snap);
+    Py_END_ALLOW_THREADS
 
     if (snap_count < 0) {
         PyErr_SetString(PyExc_KeyError, "Unable to list snapshots");
@@ -1320,12 +1681,17 @@ Container_snapshot_restore(Container *self, PyObject *args, PyObject *kwds)
     char *name = NULL;
     char *newname = NULL;
     static char *kwlist[] = {"name", "newname", NULL};
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "s|s", kwlist,
                                       &name, &newname))
         return NULL;
 
-    if (self->container->snapshot_restore(self->container, name, newname)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->snapshot_restore(self->container, name, newname);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -1344,6 +1710,7 @@ Container_start(Container *self, PyObject *args, PyObject *kwds)
 
     PyObject *retval = NULL;
     int init_useinit = 0, i = 0;
+    bool ret;
     static char *kwlist[] = {"useinit", "daemonize", "close_fds",
                              "cmd", NULL};
 
@@ -1377,7 +1744,11 @@ Container_start(Container *self, PyObject *args, PyObject *kwds)
         self->container->want_daemonize(self->container, false);
     }
 
-    if (self->container->start(self->container, init_useinit, init_args))
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->start(self->container, init_useinit, init_args);
+    Py_END_ALLOW_THREADS
+
+    if (ret)
         retval = Py_True;
     else
         retval = Py_False;
@@ -1395,10 +1766,68 @@ Container_start(Container *self, PyObject *args, PyObject *kwds)
     return retval;
 }
 
+static PyObject *
+Container_start_nowait(Container *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *vargs = NULL;
+    char** init_args = NULL;
+    int i = 0;
+    bool ret;
+    static char *kwlist[] = {"cmd", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &vargs))
+        return NULL;
+
+    if (vargs && PyTuple_Check(vargs)) {
+        init_args = convert_tuple_to_char_pointer_array(vargs);
+        if (!init_args) {
+            return NULL;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->start_nowait(self->container, init_args);
+    Py_END_ALLOW_THREADS
+
+    if (init_args) {
+        for (i = 0; init_args[i]; i++)
+            free(init_args[i]);
+        free(init_args);
+    }
+
+    if (ret) {
+        Py_RETURN_TRUE;
+    }
+
+    Py_RETURN_FALSE;
+}
+
 static PyObject *
 Container_stop(Container *self, PyObject *args, PyObject *kwds)
 {
-    if (self->container->stop(self->container)) {
+    bool ret;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->stop(self->container);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
+        Py_RETURN_TRUE;
+    }
+
+    Py_RETURN_FALSE;
+}
+
+static PyObject *
+Container_stop_nowait(Container *self, PyObject *args, PyObject *kwds)
+{
+    bool ret;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->stop_nowait(self->container);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -1408,7 +1837,13 @@ Container_stop(Container *self, PyObject *args, PyObject *kwds)
 static PyObject *
 Container_unfreeze(Container *self, PyObject *args, PyObject *kwds)
 {
-    if (self->container->unfreeze(self->container)) {
+    bool ret;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->unfreeze(self->container);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -1421,12 +1856,17 @@ Container_wait(Container *self, PyObject *args, PyObject *kwds)
     static char *kwlist[] = {"state", "timeout", NULL};
     char *state = NULL;
     int timeout = -1;
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "s|i", kwlist,
                                       &state, &timeout))
         return NULL;
 
-    if (self->container->wait(self->container, state, timeout)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->wait(self->container, state, timeout);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -1485,6 +1925,21 @@ static PyMethodDef Container_methods[] = {
      "\n"
      "Attach to the container. Returns the exit code of the process."
     },
+    {"cache_state", (PyCFunction)Container_cache_state,
+     METH_VARARGS|METH_KEYWORDS,
+     "cache_state(cache=True) -> boolean\n"
+     "\n"
+     "Keep the state of the container in memory, updated by the\n"
+     "monitor, so that state, running and init_pid don't connect to\n"
+     "the container each time."
+    },
+    {"checkpoint", (PyCFunction)Container_checkpoint,
+     METH_VARARGS|METH_KEYWORDS,
+     "checkpoint(directory, stop=False, verbose=False) -> boolean\n"
+     "\n"
+     "Checkpoint the running container with criu to directory,\n"
+     "stopping it once done if stop is True."
+    },
     {"clear_config", (PyCFunction)Container_clear_config,
      METH_NOARGS,
      "clear_config()\n"
@@ -1603,6 +2058,12 @@ static PyMethodDef Container_methods[] = {
      "\n"
      "Remove a device from the container."
     },
+    {"restore", (PyCFunction)Container_restore,
+     METH_VARARGS|METH_KEYWORDS,
+     "restore(directory, verbose=False) -> boolean\n"
+     "\n"
+     "Restore the container from a checkpoint in directory."
+    },
     {"save_config", (PyCFunction)Container_save_config,
      METH_VARARGS|METH_KEYWORDS,
      "save_config(path = DEFAULT) -> boolean\n"
@@ -1672,12 +2133,26 @@ static PyMethodDef Container_methods[] = {
      "The container can be started in the foreground with daemonize=False.\n"
      "All fds may also be closed by passing close_fds=True."
     },
+    {"start_nowait", (PyCFunction)Container_start_nowait,
+     METH_VARARGS|METH_KEYWORDS,
+     "start_nowait(cmd = (,)) -> boolean\n"
+     "\n"
+     "Start the container daemonized, return True once its monitor is\n"
+     "forked, without waiting for it to be RUNNING (see StateWatch)."
+    },
     {"stop", (PyCFunction)Container_stop,
      METH_NOARGS,
      "stop() -> boolean\n"
      "\n"
      "Stop the container and returns its return code."
     },
+    {"stop_nowait", (PyCFunction)Container_stop_nowait,
+     METH_NOARGS,
+     "stop_nowait() -> boolean\n"
+     "\n"
+     "Signal the container to stop, return True once it is signalled,\n"
+     "without waiting for it to be STOPPED (see StateWatch)."
+    },
     {"unfreeze", (PyCFunction)Container_unfreeze,
      METH_NOARGS,
      "unfreeze() -> boolean\n"
@@ -1735,6 +2210,390 @@ PyVarObject_HEAD_INIT(NULL, 0)
     Container_new,                  /* tp_new */
 };
 
+/* Base type and functions for CgroupSampler */
+typedef struct {
+    PyObject_HEAD
+    struct lxc_cgroup_stats *stats;
+    struct lxc_container **containers;
+    int container_count;
+    char **keys;
+    int key_count;
+    struct lxc_cgroup_sample *samples;
+} CgroupSampler;
+
+static void
+CgroupSampler_dealloc(CgroupSampler* self)
+{
+    int i;
+
+    lxc_cgroup_stats_free(self->stats);
+    for (i = 0; i < self->container_count; i++)
+        lxc_container_put(self->containers[i]);
+    for (i = 0; self->keys && self->keys[i]; i++)
+        free(self->keys[i]);
+    free(self->containers);
+    free(self->keys);
+    free(self->samples);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int
+CgroupSampler_init(CgroupSampler *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"containers", "keys", NULL};
+    PyObject *containers = NULL;
+    PyObject *keys = NULL;
+    PyObject *pyobj;
+    int i, count;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO", kwlist,
+                                     &containers, &keys))
+        return -1;
+
+    if (self->stats) {
+        PyErr_SetString(PyExc_RuntimeError, "Sampler already initialized");
+        return -1;
+    }
+
+    self->keys = convert_tuple_to_char_pointer_array(keys);
+    if (!self->keys)
+        return -1;
+    for (self->key_count = 0; self->keys[self->key_count]; self->key_count++);
+
+    containers = PySequence_Fast(containers, "Expected a list of containers");
+    if (!containers)
+        return -1;
+    count = PySequence_Fast_GET_SIZE(containers);
+
+    self->containers = calloc(count + 1, sizeof(*self->containers));
+    self->samples = calloc(count * self->key_count + 1,
+                           sizeof(*self->samples));
+    if (!self->containers || !self->samples) {
+        Py_DECREF(containers);
+        PyErr_SetNone(PyExc_MemoryError);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        pyobj = PySequence_Fast_GET_ITEM(containers, i);
+        if (!PyObject_TypeCheck(pyobj, &_lxc_ContainerType)) {
+            Py_DECREF(containers);
+            PyErr_SetString(PyExc_TypeError, "Expected a list of containers");
+            return -1;
+        }
+        self->containers[i] = ((Container *)pyobj)->container;
+        lxc_container_get(self->containers[i]);
+        self->container_count++;
+    }
+    Py_DECREF(containers);
+
+    self->stats = lxc_cgroup_stats_new(self->containers, count,
+                                       (const char **)self->keys,
+                                       self->key_count);
+    if (!self->stats) {
+        PyErr_SetString(PyExc_ValueError, "Unable to create the sampler");
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject *
+CgroupSampler_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    CgroupSampler *self;
+
+    self = (CgroupSampler *)type->tp_alloc(type, 0);
+
+    return (PyObject *)self;
+}
+
+static PyObject *
+CgroupSampler_sample(CgroupSampler *self, PyObject *args)
+{
+    struct lxc_cgroup_sample *sample;
+    PyObject *list, *dict, *entry;
+    int i, j;
+
+    if (!self->stats) {
+        PyErr_SetString(PyExc_RuntimeError, "Sampler not initialized");
+        return NULL;
+    }
+
+    if (lxc_cgroup_stats_sample(self->stats, self->samples) < 0) {
+        PyErr_SetString(PyExc_ValueError, "Unable to sample");
+        return NULL;
+    }
+
+    list = PyList_New(self->container_count);
+    if (!list)
+        return NULL;
+
+    for (i = 0; i < self->container_count; i++) {
+        sample = &self->samples[i * self->key_count];
+        for (j = 0; j < self->key_count; j++)
+            if (sample[j].valid)
+                break;
+        if (j == self->key_count) {
+            Py_INCREF(Py_None);
+            PyList_SET_ITEM(list, i, Py_None);
+            continue;
+        }
+
+        dict = PyDict_New();
+        if (!dict)
+            goto error;
+        PyList_SET_ITEM(list, i, dict);
+        for (j = 0; j < self->key_count; j++) {
+            if (!sample[j].valid)
+                continue;
+            entry = Py_BuildValue("(Kd)",
+                                  (unsigned long long)sample[j].value,
+                                  sample[j].rate);
+            if (!entry)
+                goto error;
+            if (PyDict_SetItemString(dict, self->keys[j], entry) < 0) {
+                Py_DECREF(entry);
+                goto error;
+            }
+            Py_DECREF(entry);
+        }
+    }
+
+    return list;
+
+error:
+    Py_DECREF(list);
+    return NULL;
+}
+
+static PyMethodDef CgroupSampler_methods[] = {
+    {"sample", (PyCFunction)CgroupSampler_sample,
+     METH_NOARGS,
+     "sample() -> list\n"
+     "\n"
+     "Read the cgroup keys of all the containers. Returns a list with an\n"
+     "entry for each container, None if none of its keys could be read\n"
+     "(e.g. it's not running), otherwise a dict of (value, rate) tuples\n"
+     "by key, rate being the change per second since the previous call."
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject _lxc_CgroupSamplerType = {
+PyVarObject_HEAD_INIT(NULL, 0)
+    "lxc.CgroupSampler",            /* tp_name */
+    sizeof(CgroupSampler),          /* tp_basicsize */
+    0,                              /* tp_itemsize */
+    (destructor)CgroupSampler_dealloc, /* tp_dealloc */
+    0,                              /* tp_print */
+    0,                              /* tp_getattr */
+    0,                              /* tp_setattr */
+    0,                              /* tp_reserved */
+    0,                              /* tp_repr */
+    0,                              /* tp_as_number */
+    0,                              /* tp_as_sequence */
+    0,                              /* tp_as_mapping */
+    0,                              /* tp_hash  */
+    0,                              /* tp_call */
+    0,                              /* tp_str */
+    0,                              /* tp_getattro */
+    0,                              /* tp_setattro */
+    0,                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,             /* tp_flags */
+    "Reads cgroup keys of a set of containers repeatedly. Keys are cgroup\n"
+    "file names, or file:field to read the line starting with field.",
+                                    /* tp_doc */
+    0,                              /* tp_traverse */
+    0,                              /* tp_clear */
+    0,                              /* tp_richcompare */
+    0,                              /* tp_weaklistoffset */
+    0,                              /* tp_iter */
+    0,                              /* tp_iternext */
+    CgroupSampler_methods,          /* tp_methods */
+    0,                              /* tp_members */
+    0,                              /* tp_getset */
+    0,                              /* tp_base */
+    0,                              /* tp_dict */
+    0,                              /* tp_descr_get */
+    0,                              /* tp_descr_set */
+    0,                              /* tp_dictoffset */
+    (initproc)CgroupSampler_init,   /* tp_init */
+    0,                              /* tp_alloc */
+    CgroupSampler_new,              /* tp_new */
+};
+
+/* Base type and functions for StateWatch */
+typedef struct {
+    PyObject_HEAD
+    struct lxc_state_watch *watch;
+} StateWatch;
+
+static void
+StateWatch_dealloc(StateWatch* self)
+{
+    lxc_state_watch_free(self->watch);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int
+StateWatch_init(StateWatch *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"config_path", "names", NULL};
+    char *config_path = NULL;
+    PyObject *py_names = NULL;
+    char **names = NULL;
+    int i, n = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|zO", kwlist,
+                                     &config_path, &py_names))
+        return -1;
+
+    if (self->watch) {
+        PyErr_SetString(PyExc_RuntimeError, "StateWatch already initialized");
+        return -1;
+    }
+
+    if (py_names && py_names != Py_None) {
+        names = convert_tuple_to_char_pointer_array(py_names);
+        if (!names)
+            return -1;
+        for (n = 0; names[n]; n++);
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    self->watch = lxc_state_watch_new(config_path, (const char **)names, n);
+    Py_END_ALLOW_THREADS
+
+    for (i = 0; i < n; i++)
+        free(names[i]);
+    free(names);
+
+    if (!self->watch) {
+        PyErr_SetString(PyExc_ValueError, "Unable to watch the states");
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject *
+StateWatch_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    StateWatch *self;
+
+    self = (StateWatch *)type->tp_alloc(type, 0);
+
+    return (PyObject *)self;
+}
+
+static PyObject *
+StateWatch_fileno(StateWatch *self, PyObject *args)
+{
+    if (!self->watch) {
+        PyErr_SetString(PyExc_RuntimeError, "StateWatch not initialized");
+        return NULL;
+    }
+
+    return PyLong_FromLong(lxc_state_watch_fd(self->watch));
+}
+
+static PyObject *
+StateWatch_read(StateWatch *self, PyObject *args)
+{
+    const char *name, *state;
+    PyObject *list, *entry;
+    int ret;
+
+    if (!self->watch) {
+        PyErr_SetString(PyExc_RuntimeError, "StateWatch not initialized");
+        return NULL;
+    }
+
+    list = PyList_New(0);
+    if (!list)
+        return NULL;
+
+    while ((ret = lxc_state_watch_next(self->watch, &name, &state)) > 0) {
+        entry = Py_BuildValue("(ss)", name, state);
+        if (!entry || PyList_Append(list, entry) < 0) {
+            Py_XDECREF(entry);
+            Py_DECREF(list);
+            return NULL;
+        }
+        Py_DECREF(entry);
+    }
+
+    if (ret < 0 && PyList_GET_SIZE(list) == 0) {
+        Py_DECREF(list);
+        PyErr_SetString(PyExc_EOFError, "Lost the monitor connection");
+        return NULL;
+    }
+
+    return list;
+}
+
+static PyMethodDef StateWatch_methods[] = {
+    {"fileno", (PyCFunction)StateWatch_fileno,
+     METH_NOARGS,
+     "fileno() -> int\n"
+     "\n"
+     "File descriptor which is readable when read() has states to return."
+    },
+    {"read", (PyCFunction)StateWatch_read,
+     METH_NOARGS,
+     "read() -> list\n"
+     "\n"
+     "Return the (name, state) tuples available without blocking, the\n"
+     "current state of each container first, then the changes. Raises\n"
+     "EOFError once lxc-monitord is gone."
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject _lxc_StateWatchType = {
+PyVarObject_HEAD_INIT(NULL, 0)
+    "lxc.StateWatch",               /* tp_name */
+    sizeof(StateWatch),             /* tp_basicsize */
+    0,                              /* tp_itemsize */
+    (destructor)StateWatch_dealloc, /* tp_dealloc */
+    0,                              /* tp_print */
+    0,                              /* tp_getattr */
+    0,                              /* tp_setattr */
+    0,                              /* tp_reserved */
+    0,                              /* tp_repr */
+    0,                              /* tp_as_number */
+    0,                              /* tp_as_sequence */
+    0,                              /* tp_as_mapping */
+    0,                              /* tp_hash  */
+    0,                              /* tp_call */
+    0,                              /* tp_str */
+    0,                              /* tp_getattro */
+    0,                              /* tp_setattro */
+    0,                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,             /* tp_flags */
+    "Watches the states of the containers of a config path (or only of\n"
+    "names) through one pollable file descriptor.",
+                                    /* tp_doc */
+    0,                              /* tp_traverse */
+    0,                              /* tp_clear */
+    0,                              /* tp_richcompare */
+    0,                              /* tp_weaklistoffset */
+    0,                              /* tp_iter */
+    0,                              /* tp_iternext */
+    StateWatch_methods,             /* tp_methods */
+    0,                              /* tp_members */
+    0,                              /* tp_getset */
+    0,                              /* tp_base */
+    0,                              /* tp_dict */
+    0,                              /* tp_descr_get */
+    0,                              /* tp_descr_set */
+    0,                              /* tp_dictoffset */
+    (initproc)StateWatch_init,      /* tp_init */
+    0,                              /* tp_alloc */
+    StateWatch_new,                 /* tp_new */
+};
+
 static PyMethodDef LXC_methods[] = {
     {"arch_to_personality", (PyCFunction)LXC_arch_to_personality, METH_O,
      "Returns the process personality of the corresponding architecture"},
@@ -1744,11 +2603,21 @@ static PyMethodDef LXC_methods[] = {
     {"attach_run_shell", (PyCFunction)LXC_attach_run_shell, METH_O,
      "Starts up a shell when attaching, to use as the run parameter for "
      "attach or attach_wait"},
+    {"get_stats", (PyCFunction)LXC_get_stats, METH_NOARGS,
+     "Returns the latency counters of this process"},
     {"get_global_config_item", (PyCFunction)LXC_get_global_config_item,
      METH_VARARGS|METH_KEYWORDS,
      "Returns the current LXC config path"},
     {"get_version", (PyCFunction)LXC_get_version, METH_NOARGS,
      "Returns the current LXC library version"},
+    {"stats_enable", (PyCFunction)LXC_stats_enable, METH_O,
+     "Enables or disables the latency counters, returns whether they were "
+     "enabled"},
+    {"stats_reset", (PyCFunction)LXC_stats_reset, METH_NOARGS,
+     "Sets all the latency counters back to zero"},
+    {"inventory", (PyCFunction)LXC_inventory,
+     METH_VARARGS|METH_KEYWORDS,
+     "Returns a list of dicts describing the containers"},
     {"list_containers", (PyCFunction)LXC_list_containers,
      METH_VARARGS|METH_KEYWORDS,
      "Returns a list of container names or objects"},
@@ -1772,6 +2641,12 @@ PyInit__lxc(void)
     if (PyType_Ready(&_lxc_ContainerType) < 0)
         return NULL;
 
+    if (PyType_Ready(&_lxc_CgroupSamplerType) < 0)
+        return NULL;
+
+    if (PyType_Ready(&_lxc_StateWatchType) < 0)
+        return NULL;
+
     m = PyModule_Create(&_lxcmodule);
     if (m == NULL)
         return NULL;
@@ -1779,6 +2654,14 @@ PyInit__lxc(void)
     Py_INCREF(&_lxc_ContainerType);
     PyModule_AddObject(m, "Container", (PyObject *)&_lxc_ContainerType);
 
+    Py_INCREF(&_lxc_CgroupSamplerType);
+    PyModule_AddObject(m, "CgroupSampler",
+                       (PyObject *)&_lxc_CgroupSamplerType);
+
+    Py_INCREF(&_lxc_StateWatchType);
+    PyModule_AddObject(m, "StateWatch",
+                       (PyObject *)&_lxc_StateWatchType);
+
     /* add constants */
     d = PyModule_GetDict(m);
 
@@ -1807,6 +2690,7 @@ PyInit__lxc(void)
     PYLXC_EXPORT_CONST(LXC_ATTACH_SET_PERSONALITY);
 
     /* clone: clone flags */
+    PYLXC_EXPORT_CONST(LXC_CLONE_EPHEMERAL);
     PYLXC_EXPORT_CONST(LXC_CLONE_KEEPBDEVTYPE);
     PYLXC_EXPORT_CONST(LXC_CLONE_KEEPMACADDR);
     PYLXC_EXPORT_CONST(LXC_CLONE_KEEPNAME);
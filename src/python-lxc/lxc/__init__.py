@@ -30,6 +30,8 @@ import time
 
 default_config_path = _lxc.get_global_config_item("lxc.lxcpath")
 get_global_config_item = _lxc.get_global_config_item
+CgroupSampler = _lxc.CgroupSampler
+StateWatch = _lxc.StateWatch
 version = _lxc.get_version()
 
 
@@ -441,6 +443,39 @@ def list_containers(active=True, defined=True,
         return entries
 
 
+def inventory(config_path=None, fields=None):
+    """
+        Describe all the containers of a config path in one call.
+
+        Returns a list of dicts, one per container sorted by name, with
+        the "name" key and those of fields among "state", "pid",
+        "groups", "autostart", "ipv4", "ipv6" and "interfaces" (all of
+        them by default).
+    """
+
+    if config_path and not os.path.exists(config_path):
+        return []
+
+    return _lxc.inventory(config_path=config_path, fields=fields)
+
+
+def get_stats():
+    """
+        Returns the latency counters of this process, a dict of dicts
+        with "count", "total_ns", "max_ns" and "buckets" (calls under
+        1us, then from 2^(i-1) to under 2^i us) for each container
+        method and for "cmd", "fork", "mem_lock" and "disk_lock".
+
+        They are only kept once enabled with stats_enable(True), or if
+        LXC_STATS is set in the environment.
+    """
+    return _lxc.get_stats()
+
+
+stats_enable = _lxc.stats_enable
+stats_reset = _lxc.stats_reset
+
+
 def attach_run_command(cmd):
     """
         Run a command when attaching
@@ -498,6 +533,7 @@ LXC_ATTACH_REMOUNT_PROC_SYS = _lxc.LXC_ATTACH_REMOUNT_PROC_SYS
 LXC_ATTACH_SET_PERSONALITY = _lxc.LXC_ATTACH_SET_PERSONALITY
 
 # clone: clone flags
+LXC_CLONE_EPHEMERAL = _lxc.LXC_CLONE_EPHEMERAL
 LXC_CLONE_KEEPBDEVTYPE = _lxc.LXC_CLONE_KEEPBDEVTYPE
 LXC_CLONE_KEEPMACADDR = _lxc.LXC_CLONE_KEEPMACADDR
 LXC_CLONE_KEEPNAME = _lxc.LXC_CLONE_KEEPNAME
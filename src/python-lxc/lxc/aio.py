@@ -0,0 +1,169 @@
+#
+# -*- coding: utf-8 -*-
+# python-lxc: Python bindings for LXC
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+# USA
+#
+
+"""
+    asyncio flavour of start, stop and wait.
+
+    The states of all the containers of a config path come through a
+    single StateWatch registered with the event loop, so no thread is
+    tied up per container. Requires Python 3.5.
+"""
+
+import asyncio
+import lxc
+
+_watchers = {}
+
+
+class StateWatcher(object):
+    """
+        Follows the states of the containers of a config path from an
+        event loop and wakes up the coroutines waiting for them.
+    """
+
+    def __init__(self, config_path=None, loop=None):
+        self.config_path = config_path or lxc.default_config_path
+        self.loop = loop or asyncio.get_event_loop()
+        self.states = {}
+        self.waiters = {}
+        self.watch = lxc.StateWatch(config_path=self.config_path)
+        self.fd = self.watch.fileno()
+        self.loop.add_reader(self.fd, self._read)
+        self._read()
+
+    def close(self):
+        if self.watch is None:
+            return
+
+        self.loop.remove_reader(self.fd)
+        self.watch = None
+        for waiters in self.waiters.values():
+            for states, future in waiters:
+                if not future.done():
+                    future.cancel()
+        self.waiters = {}
+
+    def state(self, name):
+        # lxc-monitord reports the containers it knows of, which are
+        # all the running ones
+        return self.states.get(name, "STOPPED")
+
+    def _read(self):
+        try:
+            changes = self.watch.read()
+        except EOFError as e:
+            self.loop.remove_reader(self.fd)
+            for waiters in self.waiters.values():
+                for states, future in waiters:
+                    if not future.done():
+                        future.set_exception(e)
+            self.waiters = {}
+            return
+
+        for name, state in changes:
+            self.states[name] = state
+            for entry in list(self.waiters.get(name, [])):
+                states, future = entry
+                if state in states:
+                    self.waiters[name].remove(entry)
+                    if not future.done():
+                        future.set_result(state)
+
+    async def wait(self, name, state, timeout=None):
+        """
+            Wait for container name to be in one of the '|' separated
+            states, return the state or None on timeout.
+        """
+
+        states = set(state.split("|"))
+        if "RUNNING" in states:
+            states.add("READY")
+
+        if self.state(name) in states:
+            return self.state(name)
+
+        future = self.loop.create_future()
+        entry = (states, future)
+        self.waiters.setdefault(name, []).append(entry)
+        try:
+            return await asyncio.wait_for(future, timeout)
+        except asyncio.TimeoutError:
+            return None
+        finally:
+            if entry in self.waiters.get(name, []):
+                self.waiters[name].remove(entry)
+
+
+def watcher(config_path=None, loop=None):
+    """
+        Return the StateWatcher shared by the callers of config_path on
+        loop (the current event loop by default).
+    """
+
+    config_path = config_path or lxc.default_config_path
+    loop = loop or asyncio.get_event_loop()
+
+    key = (config_path, loop)
+    if key not in _watchers or _watchers[key].watch is None:
+        _watchers[key] = StateWatcher(config_path, loop)
+    return _watchers[key]
+
+
+async def start(container, cmd=None, timeout=5):
+    """
+        Start container daemonized, return True once it is RUNNING,
+        False if it failed to start or did not run within timeout
+        seconds (None to wait forever).
+    """
+
+    w = watcher(container.get_config_path())
+    if w.state(container.name) in ("RUNNING", "READY"):
+        return True
+
+    if cmd is not None:
+        cmd = tuple(cmd)
+    if not container.start_nowait(cmd=cmd):
+        return False
+
+    state = await w.wait(container.name, "RUNNING|ABORTING", timeout)
+    return state in ("RUNNING", "READY")
+
+
+async def stop(container, timeout=None):
+    """
+        Stop container, return True once it is STOPPED, False if it
+        could not be signalled or did not stop within timeout seconds.
+    """
+
+    w = watcher(container.get_config_path())
+    if not container.stop_nowait():
+        return False
+
+    return await w.wait(container.name, "STOPPED", timeout) is not None
+
+
+async def wait(container, state, timeout=None):
+    """
+        Wait for container to be in one of the '|' separated states,
+        return True if it is, False on timeout.
+    """
+
+    w = watcher(container.get_config_path())
+    return await w.wait(container.name, state, timeout) is not None
@@ -0,0 +1,152 @@
+/* config_trie.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * lxc_getconfig() walks the key through a trie of the config[] names.  A
+ * key belongs to the first entry in table order whose name it starts
+ * with, so a key longer than a name still finds it and a key cut short
+ * finds nothing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "lxc/confile.h"
+
+#define TSTERR(fmt, ...) do { \
+	fprintf(stderr, "%d: " fmt "\n", __LINE__, ##__VA_ARGS__); \
+} while (0)
+
+static const struct {
+	const char *key;
+	const char *name;	/* NULL if the key must not be found */
+} lookups[] = {
+	{ "lxc.utsname",			"lxc.utsname" },
+	{ "lxc.tty",				"lxc.tty" },
+	{ "lxc.tty.max",			"lxc.tty" },
+	/* the longer names come first in the table */
+	{ "lxc.rootfs",				"lxc.rootfs" },
+	{ "lxc.rootfs.mount",			"lxc.rootfs.mount" },
+	{ "lxc.rootfs.backend",			"lxc.rootfs" },
+	{ "lxc.network.ipv4",			"lxc.network.ipv4" },
+	{ "lxc.network.ipv4.gateway",		"lxc.network.ipv4.gateway" },
+	{ "lxc.network.ipv6.dad",		"lxc.network.ipv6.dad" },
+	{ "lxc.console",			"lxc.console" },
+	{ "lxc.console.logfile",		"lxc.console.logfile" },
+	{ "lxc.console.path",			"lxc.console" },
+	/* prefix entries */
+	{ "lxc.cgroup.memory.limit_in_bytes",	"lxc.cgroup" },
+	{ "lxc.mount.entry",			"lxc.mount" },
+	{ "lxc.network.0.type",			"lxc.network." },
+	{ "lxc.network.",			"lxc.network." },
+	/* cut short, or not a key at all */
+	{ "",					NULL },
+	{ "l",					NULL },
+	{ "lxc",				NULL },
+	{ "lxc.",				NULL },
+	{ "lxc.network",			NULL },
+	{ "lxc.hook.",				NULL },
+	{ "lxc.hook.pre",			NULL },
+	{ "lxc.utsnam",				NULL },
+	{ "LXC.UTSNAME",			NULL },
+	{ " lxc.tty",				NULL },
+	{ "xlc.tty",				NULL },
+	{ "\xff\xfe",				NULL },
+};
+
+static int check_lookup(const char *key, const char *name)
+{
+	struct lxc_config_t *c = lxc_getconfig(key);
+
+	if (!name && c) {
+		TSTERR("'%s' found as '%s'", key, c->name);
+		return -1;
+	}
+	if (name && (!c || strcmp(c->name, name))) {
+		TSTERR("'%s' found as '%s', expected '%s'", key,
+		       c ? c->name : "(null)", name);
+		return -1;
+	}
+	return 0;
+}
+
+static void *first_lookup(void *arg)
+{
+	/* all of them race to build the trie */
+	return (void *)(long)check_lookup("lxc.network.0.link", "lxc.network.");
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t threads[4];
+	char *names, *name, *saveptr, *key;
+	void *tret;
+	size_t i;
+	int len, ret = EXIT_FAILURE;
+
+	for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++)
+		if (pthread_create(&threads[i], NULL, first_lookup, NULL)) {
+			TSTERR("failed to start thread");
+			exit(EXIT_FAILURE);
+		}
+	for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+		pthread_join(threads[i], &tret);
+		if (tret)
+			exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < sizeof(lookups) / sizeof(lookups[0]); i++)
+		if (check_lookup(lookups[i].key, lookups[i].name))
+			exit(EXIT_FAILURE);
+
+	/* every listed key is its own entry */
+	len = lxc_listconfigs(NULL, 0);
+	names = malloc(len + 1);
+	if (!names) {
+		TSTERR("out of memory");
+		exit(EXIT_FAILURE);
+	}
+	lxc_listconfigs(names, len + 1);
+	for (name = strtok_r(names, "\n", &saveptr); name;
+	     name = strtok_r(NULL, "\n", &saveptr))
+		if (check_lookup(name, name))
+			goto out;
+
+	/* long keys stop at the last node they match */
+	key = malloc(8192);
+	if (!key) {
+		TSTERR("out of memory");
+		goto out;
+	}
+	strcpy(key, "lxc.cgroup.");
+	memset(key + 11, 'a', 8180);
+	key[8191] = '\0';
+	if (check_lookup(key, "lxc.cgroup"))
+		goto out_key;
+	memset(key, 'a', 8191);
+	if (check_lookup(key, NULL))
+		goto out_key;
+
+	printf("All config trie tests passed\n");
+	ret = EXIT_SUCCESS;
+out_key:
+	free(key);
+out:
+	free(names);
+	exit(ret);
+}
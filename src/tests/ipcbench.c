@@ -0,0 +1,499 @@
+/* ipcbench.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Latency and throughput of the command and monitor paths.  Fake
+ * containers, which only run the command server, answer get_state and
+ * get_init_pid; monitor events are sent through lxc-monitord to an
+ * increasing number of subscribers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#define _GNU_SOURCE
+#include <getopt.h>
+
+#include "lxc/conf.h"
+#include "lxc/start.h"
+#include "lxc/state.h"
+#include "lxc/commands.h"
+#include "lxc/mainloop.h"
+#include "lxc/monitor.h"
+
+#define MAX_CLIENTS 1024
+#define LATENCY_ROUNDS 200
+
+static const char *lxcpath;
+static int ncontainers = 4;
+static int iterations = 1000;
+static int nevents = 1000;
+static const char *clients_list = "1,4,16,64";
+static int quiet = 0;
+
+static pid_t *servers;
+static char (*names)[NAME_MAX+1];
+
+static const struct option options[] = {
+    { "containers",  required_argument, NULL, 'n' },
+    { "clients",     required_argument, NULL, 'c' },
+    { "iterations",  required_argument, NULL, 'i' },
+    { "events",      required_argument, NULL, 'e' },
+    { "lxcpath",     required_argument, NULL, 'P' },
+    { "quiet",       no_argument,       NULL, 'q' },
+    { "help",        no_argument,       NULL, '?' },
+    { 0, 0, 0, 0 },
+};
+
+static void usage(void) {
+    fprintf(stderr, "Usage: lxc-test-ipcbench [OPTION]...\n\n"
+        "Common options :\n"
+        "  -n, --containers=N           Fake containers to serve commands (default: 4)\n"
+        "  -c, --clients=N,N,...        Client counts to run with (default: 1,4,16,64)\n"
+        "  -i, --iterations=N           Commands per client (default: 1000)\n"
+        "  -e, --events=N               Monitor events per flood (default: 1000)\n"
+        "  -P, --lxcpath=dir            lxcpath to use (default: a new temporary dir)\n"
+        "  -q, --quiet                  Only print the results\n"
+        "  -?, --help                   Give this help list\n"
+        "\n"
+        "Mandatory or optional arguments to long options are also mandatory or optional\n"
+        "for any corresponding short options.\n\n");
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* sorts samples, and prints their p50 and p99 in microseconds */
+static void report(const char *what, int clients, uint64_t *samples, int n,
+		   uint64_t elapsed, int errors)
+{
+	double p50 = 0, p99 = 0;
+
+	if (n > 0) {
+		qsort(samples, n, sizeof(*samples), cmp_u64);
+		p50 = samples[n / 2] / 1000.0;
+		p99 = samples[(n * 99) / 100] / 1000.0;
+	}
+	printf("%-14s clients %4d samples %7d p50 %9.1fus p99 %9.1fus "
+	       "%10.0f/s errors %d\n", what, clients, n, p50, p99,
+	       elapsed ? n * 1e9 / elapsed : 0, errors);
+}
+
+/* a container which only answers commands, until it is killed */
+static pid_t fake_container(const char *name)
+{
+	struct lxc_epoll_descr descr;
+	struct lxc_handler handler;
+	int p[2];
+	pid_t pid;
+	char c;
+
+	if (pipe(p))
+		return -1;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid) {
+		close(p[1]);
+		if (read(p[0], &c, 1) != 1) {
+			waitpid(pid, NULL, 0);
+			pid = -1;
+		}
+		close(p[0]);
+		return pid;
+	}
+
+	close(p[0]);
+	memset(&handler, 0, sizeof(handler));
+	handler.conf = lxc_conf_init();
+	handler.name = (char *)name;
+	handler.lxcpath = lxcpath;
+	handler.state = RUNNING;
+	handler.pid = getpid();
+	if (!handler.conf || lxc_cmd_init(name, &handler, lxcpath))
+		_exit(1);
+	if (lxc_mainloop_open(&descr) ||
+	    lxc_cmd_mainloop_add(name, &descr, &handler))
+		_exit(1);
+	if (write(p[1], "", 1) != 1)
+		_exit(1);
+	close(p[1]);
+	lxc_mainloop(&descr, -1);
+	_exit(0);
+}
+
+enum { CMD_GET_STATE, CMD_GET_INIT_PID };
+
+struct cmd_args {
+	pthread_t thread;
+	int id;
+	int op;
+	uint64_t *samples;
+	int errors;
+};
+
+static void *cmd_client(void *arg)
+{
+	struct cmd_args *args = arg;
+	const char *name;
+	uint64_t t0;
+	int i, ret;
+
+	for (i = 0; i < iterations; i++) {
+		name = names[(args->id + i) % ncontainers];
+		t0 = now_ns();
+		if (args->op == CMD_GET_STATE)
+			ret = lxc_cmd_get_state(name, lxcpath) == RUNNING;
+		else
+			ret = lxc_cmd_get_init_pid(name, lxcpath) > 0;
+		args->samples[i] = now_ns() - t0;
+		if (!ret)
+			args->errors++;
+	}
+	return NULL;
+}
+
+static int bench_cmd(int op, int clients)
+{
+	struct cmd_args *args;
+	uint64_t *samples, t0, elapsed;
+	int i, errors = 0, started;
+
+	args = calloc(clients, sizeof(*args));
+	samples = malloc(sizeof(*samples) * clients * iterations);
+	if (!args || !samples) {
+		free(args);
+		free(samples);
+		return -1;
+	}
+
+	t0 = now_ns();
+	for (started = 0; started < clients; started++) {
+		args[started].id = started;
+		args[started].op = op;
+		args[started].samples = samples + started * iterations;
+		if (pthread_create(&args[started].thread, NULL, cmd_client,
+				   &args[started]))
+			break;
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(args[i].thread, NULL);
+		errors += args[i].errors;
+	}
+	elapsed = now_ns() - t0;
+
+	report(op == CMD_GET_STATE ? "get_state" : "get_init_pid", started,
+	       samples, started * iterations, elapsed, errors);
+	free(args);
+	free(samples);
+	return started == clients ? 0 : -1;
+}
+
+/*
+ * Monitor fan-out.  A latency round is one event, sent once every
+ * subscriber has seen the previous one; a flood is nevents sent back to
+ * back, it ends when every subscriber has seen the last one.
+ */
+static pthread_mutex_t mon_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mon_cond = PTHREAD_COND_INITIALIZER;
+static int mon_ready, mon_seen, mon_done;
+static volatile uint64_t mon_t0;
+static volatile int mon_stop;
+
+struct mon_args {
+	pthread_t thread;
+	uint64_t samples[LATENCY_ROUNDS];
+	int nsamples;
+	int flood;
+	int done;
+	uint64_t missed;
+};
+
+static void mon_signal(int *counter)
+{
+	pthread_mutex_lock(&mon_lock);
+	(*counter)++;
+	pthread_cond_broadcast(&mon_cond);
+	pthread_mutex_unlock(&mon_lock);
+}
+
+static void *mon_client(void *arg)
+{
+	struct mon_args *args = arg;
+	struct lxc_monitor_stream stream;
+	struct lxc_monitor_event ev;
+	const char *pattern = "ipcbench-*";
+	int fd, ret;
+
+	fd = lxc_monitor_open(lxcpath);
+	if (fd < 0)
+		goto out;
+	lxc_monitor_stream_init(&stream, fd);
+	if (lxc_monitor_subscribe(&stream, &pattern, 1, 1 << lxc_msg_state,
+				  LXC_MONITOR_SUB_FRAMES)) {
+		close(fd);
+		goto out;
+	}
+	mon_signal(&mon_ready);
+
+	while (!mon_stop) {
+		ret = lxc_monitor_stream_read(&stream, &ev, 100);
+		if (ret < 0)
+			break;
+		if (!ret)
+			continue;
+		args->missed += ev.missed;
+		if (!strcmp(ev.name, "ipcbench-latency")) {
+			if (args->nsamples < LATENCY_ROUNDS)
+				args->samples[args->nsamples++] = now_ns() - mon_t0;
+			mon_signal(&mon_seen);
+		} else if (!strcmp(ev.name, "ipcbench-flood")) {
+			args->flood++;
+			if (ev.value == STOPPED && !args->done++)
+				mon_signal(&mon_done);
+		}
+	}
+	/* dropped by lxc-monitord, don't leave the flood waiting */
+	if (!args->done)
+		mon_signal(&mon_done);
+	close(fd);
+	return NULL;
+
+out:
+	/* count as ready and done so that the run doesn't wait for us */
+	mon_signal(&mon_ready);
+	mon_signal(&mon_done);
+	return NULL;
+}
+
+/* wait for counter to reach n, for at most timeout_ms */
+static int mon_wait(int *counter, int n, int timeout_ms)
+{
+	struct timespec ts;
+	int ret = 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&mon_lock);
+	while (*counter < n && ret != ETIMEDOUT)
+		ret = pthread_cond_timedwait(&mon_cond, &mon_lock, &ts);
+	ret = *counter >= n ? 0 : -1;
+	pthread_mutex_unlock(&mon_lock);
+	return ret;
+}
+
+static int bench_monitor(int clients)
+{
+	struct mon_args *args;
+	uint64_t *samples, t0, elapsed, missed = 0;
+	int i, n = 0, started, errors = 0, delivered = 0;
+
+	args = calloc(clients, sizeof(*args));
+	samples = malloc(sizeof(*samples) * clients * LATENCY_ROUNDS);
+	if (!args || !samples) {
+		free(args);
+		free(samples);
+		return -1;
+	}
+
+	mon_ready = mon_seen = mon_done = 0;
+	mon_stop = 0;
+	for (started = 0; started < clients; started++)
+		if (pthread_create(&args[started].thread, NULL, mon_client,
+				   &args[started]))
+			break;
+	if (mon_wait(&mon_ready, started, 5000))
+		fprintf(stderr, "not all monitor clients subscribed\n");
+
+	t0 = now_ns();
+	for (i = 0; i < LATENCY_ROUNDS; i++) {
+		mon_t0 = now_ns();
+		lxc_monitor_send_state("ipcbench-latency", RUNNING, lxcpath);
+		if (mon_wait(&mon_seen, started * (i + 1), 1000)) {
+			errors++;
+			pthread_mutex_lock(&mon_lock);
+			mon_seen = started * (i + 1);
+			pthread_mutex_unlock(&mon_lock);
+		}
+	}
+	elapsed = now_ns() - t0;
+	for (i = 0; i < started; i++) {
+		memcpy(samples + n, args[i].samples,
+		       args[i].nsamples * sizeof(*samples));
+		n += args[i].nsamples;
+	}
+	report("event_latency", started, samples, n, elapsed, errors);
+
+	t0 = now_ns();
+	for (i = 0; i < nevents; i++)
+		lxc_monitor_send_state("ipcbench-flood",
+				       i == nevents - 1 ? STOPPED : RUNNING,
+				       lxcpath);
+	errors = mon_wait(&mon_done, started, 10000) ? 1 : 0;
+	elapsed = now_ns() - t0;
+
+	mon_stop = 1;
+	for (i = 0; i < started; i++) {
+		pthread_join(args[i].thread, NULL);
+		delivered += args[i].flood;
+		missed += args[i].missed;
+	}
+	printf("%-14s clients %4d events %8d delivered %8d missed %6llu "
+	       "%10.0f/s errors %d\n", "event_flood", started, nevents,
+	       delivered, (unsigned long long)missed,
+	       elapsed ? delivered * 1e9 / elapsed : 0, errors);
+
+	free(args);
+	free(samples);
+	return started == clients ? 0 : -1;
+}
+
+static void stop_servers(void)
+{
+	int i;
+
+	for (i = 0; i < ncontainers; i++) {
+		if (servers[i] <= 0)
+			continue;
+		kill(servers[i], SIGKILL);
+		waitpid(servers[i], NULL, 0);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	char tmpdir[] = "/tmp/lxc-ipcbench-XXXXXX";
+	char *list, *tok, *saveptr = NULL;
+	int i, opt, clients, ret = EXIT_FAILURE;
+
+	while ((opt = getopt_long(argc, argv, "n:c:i:e:P:q", options, NULL)) != -1) {
+		switch(opt) {
+		case 'n':
+			ncontainers = atoi(optarg);
+			break;
+		case 'c':
+			clients_list = optarg;
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'e':
+			nevents = atoi(optarg);
+			break;
+		case 'P':
+			lxcpath = optarg;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default: /* '?' */
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (ncontainers < 1 || iterations < 1 || nevents < 1) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	if (!lxcpath) {
+		if (!mkdtemp(tmpdir)) {
+			perror("mkdtemp");
+			exit(EXIT_FAILURE);
+		}
+		lxcpath = tmpdir;
+	}
+
+	/* a client whose server went away must not kill us */
+	signal(SIGPIPE, SIG_IGN);
+
+	servers = calloc(ncontainers, sizeof(*servers));
+	names = calloc(ncontainers, sizeof(*names));
+	if (!servers || !names)
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < ncontainers; i++) {
+		snprintf(names[i], sizeof(names[i]), "ipcbench-%d", i);
+		servers[i] = fake_container(names[i]);
+		if (servers[i] < 0) {
+			fprintf(stderr, "failed to start fake container %s\n",
+				names[i]);
+			goto out;
+		}
+	}
+	if (!quiet)
+		printf("lxcpath %s, %d fake containers\n", lxcpath, ncontainers);
+	/* the spawned monitord must not inherit what is buffered */
+	fflush(stdout);
+
+	if (lxc_monitord_spawn(lxcpath)) {
+		fprintf(stderr, "failed to spawn lxc-monitord\n");
+		goto out;
+	}
+
+	list = strdup(clients_list);
+	if (!list)
+		goto out;
+	for (tok = strtok_r(list, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		clients = atoi(tok);
+		if (clients < 1 || clients > MAX_CLIENTS) {
+			fprintf(stderr, "bad client count %s\n", tok);
+			free(list);
+			goto out;
+		}
+		if (bench_cmd(CMD_GET_STATE, clients) ||
+		    bench_cmd(CMD_GET_INIT_PID, clients) ||
+		    bench_monitor(clients)) {
+			free(list);
+			goto out;
+		}
+	}
+	free(list);
+	ret = EXIT_SUCCESS;
+
+out:
+	stop_servers();
+	exit(ret);
+}
@@ -0,0 +1,397 @@
+/* lifecyclebench.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Latency and throughput of the container lifecycle.  Each iteration runs
+ * create, start, attach, stop, clone and destroy of the clone for each
+ * backing store type, then destroy, every phase on all threads at once,
+ * each thread with its own container.  The results are printed as JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#define _GNU_SOURCE
+#include <getopt.h>
+
+#include <lxc/lxccontainer.h>
+#include <lxc/attach_options.h>
+
+#define MAX_BDEVS 16
+
+static int nthreads = 1;
+static int iterations = 5;
+static const char *template = "busybox";
+static const char *lxcpath;
+static const char *output;
+static int snapshot = 0;
+static int quiet = 0;
+
+static char *bdevs[MAX_BDEVS];
+static int nbdevs;
+
+static const struct option options[] = {
+    { "threads",     required_argument, NULL, 'j' },
+    { "iterations",  required_argument, NULL, 'i' },
+    { "template",    required_argument, NULL, 't' },
+    { "bdevs",       required_argument, NULL, 'B' },
+    { "snapshot",    no_argument,       NULL, 's' },
+    { "lxcpath",     required_argument, NULL, 'P' },
+    { "output",      required_argument, NULL, 'o' },
+    { "quiet",       no_argument,       NULL, 'q' },
+    { "help",        no_argument,       NULL, '?' },
+    { 0, 0, 0, 0 },
+};
+
+static void usage(void) {
+    fprintf(stderr, "Usage: lxc-test-lifecyclebench [OPTION]...\n\n"
+        "Common options :\n"
+        "  -j, --threads=N              Containers to run concurrently (default: 1)\n"
+        "  -i, --iterations=N           Number of lifecycles per container (default: 5)\n"
+        "  -t, --template=t             Template to use (default: busybox)\n"
+        "  -B, --bdevs=<type,type,...>  Backing stores to clone to (default: dir)\n"
+        "  -s, --snapshot               Clone as snapshots (implied for overlayfs\n"
+        "                               and aufs)\n"
+        "  -P, --lxcpath=dir            lxcpath to use (default: the system one)\n"
+        "  -o, --output=file            Write the JSON results to file (default: stdout)\n"
+        "  -q, --quiet                  Don't print progress\n"
+        "  -?, --help                   Give this help list\n"
+        "\n"
+        "Mandatory or optional arguments to long options are also mandatory or optional\n"
+        "for any corresponding short options.\n\n");
+}
+
+enum {
+	PHASE_CREATE,
+	PHASE_START,
+	PHASE_ATTACH,
+	PHASE_STOP,
+	PHASE_CLONE,	/* and PHASE_CLONE_DESTROY, for each bdev */
+	PHASE_CLONE_DESTROY,
+	PHASE_DESTROY,
+};
+
+/* what runs, in order, in an iteration */
+struct phase {
+	char name[64];
+	int op;
+	const char *bdev;
+	uint64_t *samples;
+	int nsamples;
+	int errors;
+	uint64_t elapsed;
+};
+
+static struct phase *phases;
+static int nphases;
+
+struct thread_args {
+	pthread_t thread;
+	int id;
+	struct phase *phase;
+	int failed;	/* skip what needs the container for this iteration */
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int run_op(struct thread_args *args, struct lxc_container *c)
+{
+	lxc_attach_options_t attach_options = LXC_ATTACH_OPTIONS_DEFAULT;
+	const char *argv[] = { "true", NULL };
+	struct phase *p = args->phase;
+	struct lxc_container *c2;
+	char name[NAME_MAX+1];
+	int flags = 0;
+
+	switch (p->op) {
+	case PHASE_CREATE:
+		return c->create(c, template, NULL, NULL, LXC_CREATE_QUIET,
+				 NULL) ? 0 : -1;
+	case PHASE_START:
+		c->want_daemonize(c, true);
+		if (!c->start(c, false, NULL))
+			return -1;
+		return c->wait(c, "RUNNING", 30) ? 0 : -1;
+	case PHASE_ATTACH:
+		return c->attach_run_wait(c, &attach_options, "true", argv) ?
+			-1 : 0;
+	case PHASE_STOP:
+		if (!c->stop(c))
+			return -1;
+		return c->wait(c, "STOPPED", 30) ? 0 : -1;
+	case PHASE_CLONE:
+		snprintf(name, sizeof(name), "%s-%s", c->name, p->bdev);
+		if (snapshot || !strcmp(p->bdev, "overlayfs") ||
+		    !strcmp(p->bdev, "aufs"))
+			flags |= LXC_CLONE_SNAPSHOT;
+		c2 = c->clone(c, name, lxcpath, flags, p->bdev, NULL, 0, NULL);
+		if (!c2)
+			return -1;
+		lxc_container_put(c2);
+		return 0;
+	case PHASE_CLONE_DESTROY:
+		snprintf(name, sizeof(name), "%s-%s", c->name, p->bdev);
+		c2 = lxc_container_new(name, lxcpath);
+		if (!c2)
+			return -1;
+		if (!c2->is_defined(c2) || !c2->destroy(c2)) {
+			lxc_container_put(c2);
+			return -1;
+		}
+		lxc_container_put(c2);
+		return 0;
+	case PHASE_DESTROY:
+		return c->destroy(c) ? 0 : -1;
+	}
+	return -1;
+}
+
+static void *bench_thread(void *arg)
+{
+	struct thread_args *args = arg;
+	struct phase *p = args->phase;
+	struct lxc_container *c;
+	char name[NAME_MAX+1];
+	uint64_t t0;
+
+	snprintf(name, sizeof(name), "lxc-bench-%d", args->id);
+
+	/* destroy is always tried, not to leave the container behind */
+	if (args->failed && p->op != PHASE_DESTROY)
+		return NULL;
+
+	c = lxc_container_new(name, lxcpath);
+	if (!c) {
+		args->failed = 1;
+		return NULL;
+	}
+	if (p->op == PHASE_DESTROY && !c->is_defined(c)) {
+		lxc_container_put(c);
+		return NULL;
+	}
+
+	t0 = now_ns();
+	if (run_op(args, c)) {
+		fprintf(stderr, "%s failed for %s\n", p->name, name);
+		/* clones are independent of each other */
+		if (p->op != PHASE_CLONE && p->op != PHASE_CLONE_DESTROY)
+			args->failed = 1;
+		__sync_fetch_and_add(&p->errors, 1);
+	} else {
+		p->samples[__sync_fetch_and_add(&p->nsamples, 1)] =
+			now_ns() - t0;
+	}
+	lxc_container_put(c);
+	return NULL;
+}
+
+static int add_phase(int op, const char *name, const char *bdev)
+{
+	struct phase *p;
+
+	p = realloc(phases, sizeof(*phases) * (nphases + 1));
+	if (!p)
+		return -1;
+	phases = p;
+	p = &phases[nphases];
+	memset(p, 0, sizeof(*p));
+	snprintf(p->name, sizeof(p->name), "%s%s%s", name, bdev ? "-" : "",
+		 bdev ? bdev : "");
+	p->op = op;
+	p->bdev = bdev;
+	p->samples = malloc(sizeof(*p->samples) * nthreads * iterations);
+	if (!p->samples)
+		return -1;
+	nphases++;
+	return 0;
+}
+
+static int init_phases(void)
+{
+	int i;
+
+	if (add_phase(PHASE_CREATE, "create", NULL) ||
+	    add_phase(PHASE_START, "start", NULL) ||
+	    add_phase(PHASE_ATTACH, "attach", NULL) ||
+	    add_phase(PHASE_STOP, "stop", NULL))
+		return -1;
+	for (i = 0; i < nbdevs; i++)
+		if (add_phase(PHASE_CLONE, "clone", bdevs[i]) ||
+		    add_phase(PHASE_CLONE_DESTROY, "destroy", bdevs[i]))
+			return -1;
+	return add_phase(PHASE_DESTROY, "destroy", NULL);
+}
+
+/* runs one phase on every thread's container, and waits for all of them */
+static int run_phase(struct phase *p, struct thread_args *args)
+{
+	uint64_t t0;
+	int i, started;
+
+	t0 = now_ns();
+	for (started = 0; started < nthreads; started++) {
+		args[started].phase = p;
+		if (pthread_create(&args[started].thread, NULL, bench_thread,
+				   &args[started])) {
+			perror("pthread_create");
+			break;
+		}
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(args[i].thread, NULL);
+	p->elapsed += now_ns() - t0;
+	return started == nthreads ? 0 : -1;
+}
+
+static double percentile(struct phase *p, int pct)
+{
+	if (!p->nsamples)
+		return 0;
+	return p->samples[((p->nsamples - 1) * pct) / 100] / 1000000.0;
+}
+
+static void report(FILE *f)
+{
+	struct phase *p;
+	int i;
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"version\": \"%s\",\n", lxc_get_version());
+	fprintf(f, "  \"template\": \"%s\",\n", template);
+	fprintf(f, "  \"threads\": %d,\n", nthreads);
+	fprintf(f, "  \"iterations\": %d,\n", iterations);
+	fprintf(f, "  \"phases\": [\n");
+	for (i = 0; i < nphases; i++) {
+		p = &phases[i];
+		qsort(p->samples, p->nsamples, sizeof(*p->samples), cmp_u64);
+		fprintf(f, "    { \"name\": \"%s\", \"samples\": %d, "
+			"\"errors\": %d, \"p50_ms\": %.3f, \"p95_ms\": %.3f, "
+			"\"p99_ms\": %.3f, \"ops_per_sec\": %.3f }%s\n",
+			p->name, p->nsamples, p->errors, percentile(p, 50),
+			percentile(p, 95), percentile(p, 99),
+			p->elapsed ? p->nsamples * 1e9 / p->elapsed : 0,
+			i < nphases - 1 ? "," : "");
+	}
+	fprintf(f, "  ]\n");
+	fprintf(f, "}\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct thread_args *args;
+	char *tok, *saveptr = NULL;
+	FILE *f = stdout;
+	int i, iter, opt, errors = 0;
+
+	while ((opt = getopt_long(argc, argv, "j:i:t:B:sP:o:q", options, NULL)) != -1) {
+		switch(opt) {
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 't':
+			template = optarg;
+			break;
+		case 'B':
+			nbdevs = 0;
+			for (tok = strtok_r(optarg, ",", &saveptr); tok;
+			     tok = strtok_r(NULL, ",", &saveptr)) {
+				if (nbdevs == MAX_BDEVS) {
+					fprintf(stderr, "too many backing stores\n");
+					exit(EXIT_FAILURE);
+				}
+				bdevs[nbdevs++] = tok;
+			}
+			break;
+		case 's':
+			snapshot = 1;
+			break;
+		case 'P':
+			lxcpath = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default: /* '?' */
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (nthreads < 1 || iterations < 1) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+	if (!nbdevs)
+		bdevs[nbdevs++] = "dir";
+
+	args = calloc(nthreads, sizeof(*args));
+	if (!args || init_phases()) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < nthreads; i++)
+		args[i].id = i;
+
+	for (iter = 1; iter <= iterations; iter++) {
+		if (!quiet)
+			fprintf(stderr, "Iteration %d/%d, %d containers\n",
+				iter, iterations, nthreads);
+		for (i = 0; i < nthreads; i++)
+			args[i].failed = 0;
+		for (i = 0; i < nphases; i++)
+			if (run_phase(&phases[i], args))
+				exit(EXIT_FAILURE);
+	}
+
+	if (output) {
+		f = fopen(output, "w");
+		if (!f) {
+			perror(output);
+			exit(EXIT_FAILURE);
+		}
+	}
+	report(f);
+	if (f != stdout)
+		fclose(f);
+
+	for (i = 0; i < nphases; i++)
+		errors += phases[i].errors;
+	exit(errors ? EXIT_FAILURE : EXIT_SUCCESS);
+}
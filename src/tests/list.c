@@ -78,6 +78,12 @@ static void test_list_func(const char *lxcpath, const char *type,
 	}
 }
 
+static int list_defined_lazy(const char *path, char ***names,
+			     struct lxc_container ***cret)
+{
+	return list_defined_containers_flags(path, names, cret, LXC_LIST_LAZY);
+}
+
 int main(int argc, char *argv[])
 {
 	const char *lxcpath = NULL;
@@ -86,6 +92,7 @@ int main(int argc, char *argv[])
 		lxcpath = argv[1];
 
 	test_list_func(lxcpath, "Defined:", list_defined_containers);
+	test_list_func(lxcpath, "Lazy:", list_defined_lazy);
 	test_list_func(lxcpath, "Active:", list_active_containers);
 	test_list_func(lxcpath, "All:", list_all_containers);
 
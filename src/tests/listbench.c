@@ -0,0 +1,473 @@
+/* listbench.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Enumeration, bulk state queries and config loads over many containers.
+ * For each size, an lxcpath is filled with that many config-only
+ * containers, some of which are made to look running by a process
+ * serving their command sockets.  The cost per container is printed for
+ * each size, and compared between the smallest and the largest to catch
+ * operations which grow faster than the number of containers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#define _GNU_SOURCE
+#include <getopt.h>
+
+#include "lxc/lxccontainer.h"
+#include "lxc/conf.h"
+#include "lxc/start.h"
+#include "lxc/state.h"
+#include "lxc/commands.h"
+#include "lxc/mainloop.h"
+
+#define MAX_SIZES 16
+
+static const char *basepath;
+static const char *sizes_list = "1000,10000";
+static int nrunning = 100;
+static int iterations = 3;
+static int keep = 0;
+static int quiet = 0;
+
+static const struct option options[] = {
+    { "containers",  required_argument, NULL, 'n' },
+    { "running",     required_argument, NULL, 'r' },
+    { "iterations",  required_argument, NULL, 'i' },
+    { "lxcpath",     required_argument, NULL, 'P' },
+    { "keep",        no_argument,       NULL, 'k' },
+    { "quiet",       no_argument,       NULL, 'q' },
+    { "help",        no_argument,       NULL, '?' },
+    { 0, 0, 0, 0 },
+};
+
+static void usage(void) {
+    fprintf(stderr, "Usage: lxc-test-listbench [OPTION]...\n\n"
+        "Common options :\n"
+        "  -n, --containers=N,N,...     Numbers of containers to run with\n"
+        "                               (default: 1000,10000)\n"
+        "  -r, --running=N              Containers which look running (default: 100)\n"
+        "  -i, --iterations=N           Runs of each operation (default: 3)\n"
+        "  -P, --lxcpath=dir            Directory for the lxcpaths (default: a new\n"
+        "                               temporary dir)\n"
+        "  -k, --keep                   Don't remove the containers afterwards\n"
+        "  -q, --quiet                  Only print the results\n"
+        "  -?, --help                   Give this help list\n"
+        "\n"
+        "Mandatory or optional arguments to long options are also mandatory or optional\n"
+        "for any corresponding short options.\n\n");
+}
+
+enum {
+	OP_LIST_DEFINED,
+	OP_LIST_DEFINED_LOAD,
+	OP_LIST_DEFINED_LAZY,
+	OP_LIST_ACTIVE,
+	OP_LIST_ALL,
+	OP_GET_STATES,
+	OP_INVENTORY,
+	OP_STATE_EACH,
+	OP_MAX,
+};
+
+static const char *op_names[OP_MAX] = {
+	[OP_LIST_DEFINED]	= "list_defined",
+	[OP_LIST_DEFINED_LOAD]	= "list_defined+cfg",
+	[OP_LIST_DEFINED_LAZY]	= "list_defined_lazy",
+	[OP_LIST_ACTIVE]	= "list_active",
+	[OP_LIST_ALL]		= "list_all",
+	[OP_GET_STATES]		= "get_states",
+	[OP_INVENTORY]		= "inventory",
+	[OP_STATE_EACH]		= "state_each",
+};
+
+/* best time per container, in ns, for each size */
+static double results[MAX_SIZES][OP_MAX];
+static int sizes[MAX_SIZES];
+static int nsizes;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void container_name(char *buf, size_t len, int i)
+{
+	snprintf(buf, len, "listbench-%06d", i);
+}
+
+static int write_config(const char *lxcpath, int i)
+{
+	char path[PATH_MAX], name[NAME_MAX+1];
+	FILE *f;
+	int ret;
+
+	container_name(name, sizeof(name), i);
+	ret = snprintf(path, sizeof(path), "%s/%s", lxcpath, name);
+	if (ret < 0 || ret >= sizeof(path))
+		return -1;
+	if (mkdir(path, 0755) && errno != EEXIST)
+		return -1;
+	ret = snprintf(path, sizeof(path), "%s/%s/config", lxcpath, name);
+	if (ret < 0 || ret >= sizeof(path))
+		return -1;
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+	fprintf(f, "lxc.utsname = %s\n"
+		"lxc.rootfs = %s/%s/rootfs\n"
+		"lxc.network.type = empty\n"
+		"lxc.group = listbench\n"
+		"lxc.group = group%d\n"
+		"lxc.start.auto = %d\n"
+		"lxc.cgroup.memory.limit_in_bytes = 256M\n"
+		"lxc.mount.entry = proc proc proc nodev,noexec,nosuid 0 0\n"
+		"lxc.mount.entry = sysfs sys sysfs defaults 0 0\n",
+		name, lxcpath, name, i % 10, i % 2);
+	return fclose(f);
+}
+
+static void remove_containers(const char *lxcpath, int n)
+{
+	char path[PATH_MAX], name[NAME_MAX+1];
+	int i, ret;
+
+	for (i = 0; i < n; i++) {
+		container_name(name, sizeof(name), i);
+		ret = snprintf(path, sizeof(path), "%s/%s/config", lxcpath, name);
+		if (ret < 0 || ret >= sizeof(path))
+			continue;
+		unlink(path);
+		ret = snprintf(path, sizeof(path), "%s/%s", lxcpath, name);
+		if (ret < 0 || ret >= sizeof(path))
+			continue;
+		rmdir(path);
+	}
+	rmdir(lxcpath);
+}
+
+/*
+ * Serves the command sockets of the first n containers from a single
+ * process, until it is killed: they look running to the clients.
+ */
+static pid_t fake_running(const char *lxcpath, int n)
+{
+	struct lxc_epoll_descr descr;
+	struct lxc_handler *handlers;
+	char name[NAME_MAX+1];
+	int p[2], i;
+	pid_t pid;
+	char c;
+
+	if (pipe(p))
+		return -1;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid) {
+		close(p[1]);
+		if (read(p[0], &c, 1) != 1) {
+			waitpid(pid, NULL, 0);
+			pid = -1;
+		}
+		close(p[0]);
+		return pid;
+	}
+
+	close(p[0]);
+	handlers = calloc(n, sizeof(*handlers));
+	if (!handlers || lxc_mainloop_open(&descr))
+		_exit(1);
+	for (i = 0; i < n; i++) {
+		struct lxc_handler *h = &handlers[i];
+
+		container_name(name, sizeof(name), i);
+		h->conf = lxc_conf_init();
+		h->name = strdup(name);
+		h->lxcpath = lxcpath;
+		h->state = RUNNING;
+		h->pid = getpid();
+		if (!h->conf || !h->name || lxc_cmd_init(name, h, lxcpath) ||
+		    lxc_cmd_mainloop_add(name, &descr, h))
+			_exit(1);
+	}
+	if (write(p[1], "", 1) != 1)
+		_exit(1);
+	close(p[1]);
+	lxc_mainloop(&descr, -1);
+	_exit(0);
+}
+
+static void free_list(char **names, struct lxc_container **cret, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (names)
+			free(names[i]);
+		if (cret)
+			lxc_container_put(cret[i]);
+	}
+	free(names);
+	free(cret);
+}
+
+/* runs op once, returns how many containers it saw, or -1 */
+static int run_op(int op, const char *lxcpath, int n)
+{
+	struct lxc_container **cret = NULL, *c;
+	struct lxc_inventory *inv;
+	char **names = NULL, name[NAME_MAX+1];
+	const char **states, **cnames;
+	int i, ret = -1;
+
+	switch (op) {
+	case OP_LIST_DEFINED:
+		ret = list_defined_containers(lxcpath, &names, NULL);
+		free_list(names, NULL, ret);
+		break;
+	case OP_LIST_DEFINED_LOAD:
+		ret = list_defined_containers(lxcpath, NULL, &cret);
+		free_list(NULL, cret, ret);
+		break;
+	case OP_LIST_DEFINED_LAZY:
+		ret = list_defined_containers_flags(lxcpath, NULL, &cret,
+						    LXC_LIST_LAZY);
+		free_list(NULL, cret, ret);
+		break;
+	case OP_LIST_ACTIVE:
+		ret = list_active_containers(lxcpath, &names, NULL);
+		free_list(names, NULL, ret);
+		break;
+	case OP_LIST_ALL:
+		ret = list_all_containers(lxcpath, &names, NULL);
+		free_list(names, NULL, ret);
+		break;
+	case OP_GET_STATES:
+		cnames = calloc(n, sizeof(*cnames));
+		states = calloc(n, sizeof(*states));
+		names = calloc(n, sizeof(*names));
+		if (cnames && states && names) {
+			for (i = 0; i < n; i++) {
+				container_name(name, sizeof(name), i);
+				cnames[i] = names[i] = strdup(name);
+			}
+			ret = lxc_get_states(lxcpath, cnames, n, states, NULL);
+		}
+		free_list(names, NULL, n);
+		free(cnames);
+		free(states);
+		break;
+	case OP_INVENTORY:
+		ret = lxc_get_inventory(lxcpath, LXC_INVENTORY_STATE |
+					LXC_INVENTORY_PID |
+					LXC_INVENTORY_GROUPS |
+					LXC_INVENTORY_AUTOSTART, &inv);
+		if (ret > 0)
+			lxc_inventory_free(inv, ret);
+		break;
+	case OP_STATE_EACH:
+		for (i = 0, ret = 0; i < n; i++) {
+			container_name(name, sizeof(name), i);
+			c = lxc_container_new(name, lxcpath);
+			if (!c)
+				return -1;
+			if (c->state(c))
+				ret++;
+			lxc_container_put(c);
+		}
+		break;
+	}
+	return ret;
+}
+
+static int bench_size(int sidx)
+{
+	char lxcpath[PATH_MAX];
+	int i, op, n = sizes[sidx], running, expect, ret = -1;
+	uint64_t t0, t, best;
+	pid_t server = -1;
+
+	ret = snprintf(lxcpath, sizeof(lxcpath), "%s/%d", basepath, n);
+	if (ret < 0 || ret >= sizeof(lxcpath)) {
+		fprintf(stderr, "%s: path too long\n", basepath);
+		return -1;
+	}
+	ret = -1;
+	if (mkdir(lxcpath, 0755) && errno != EEXIST) {
+		perror(lxcpath);
+		return -1;
+	}
+
+	t0 = now_ns();
+	for (i = 0; i < n; i++)
+		if (write_config(lxcpath, i)) {
+			fprintf(stderr, "failed to write config %d\n", i);
+			goto out;
+		}
+	running = nrunning < n ? nrunning : n;
+	if (running) {
+		server = fake_running(lxcpath, running);
+		if (server < 0) {
+			fprintf(stderr, "failed to serve %d containers\n",
+				running);
+			goto out;
+		}
+	}
+	if (!quiet)
+		printf("%s: %d containers, %d running, set up in %.1fms\n",
+		       lxcpath, n, running, (now_ns() - t0) / 1e6);
+
+	for (op = 0; op < OP_MAX; op++) {
+		expect = op == OP_LIST_ACTIVE ? running : n;
+		for (i = 0, best = UINT64_MAX; i < iterations; i++) {
+			t0 = now_ns();
+			ret = run_op(op, lxcpath, n);
+			t = now_ns() - t0;
+			if (ret != expect)
+				fprintf(stderr, "%s saw %d containers, expected %d\n",
+					op_names[op], ret, expect);
+			if (t < best)
+				best = t;
+		}
+		results[sidx][op] = (double)best / n;
+		printf("%-18s containers %6d running %5d total %10.2fms "
+		       "per container %8.2fus\n", op_names[op], n, running,
+		       best / 1e6, results[sidx][op] / 1000);
+	}
+	ret = 0;
+
+out:
+	if (server > 0) {
+		kill(server, SIGKILL);
+		waitpid(server, NULL, 0);
+	}
+	if (!keep)
+		remove_containers(lxcpath, n);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	char tmpdir[] = "/tmp/lxc-listbench-XXXXXX";
+	char *list, *tok, *saveptr = NULL;
+	struct rlimit rl;
+	double growth, ratio;
+	int i, opt, ret = EXIT_SUCCESS;
+
+	while ((opt = getopt_long(argc, argv, "n:r:i:P:kq", options, NULL)) != -1) {
+		switch(opt) {
+		case 'n':
+			sizes_list = optarg;
+			break;
+		case 'r':
+			nrunning = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'P':
+			basepath = optarg;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default: /* '?' */
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	list = strdup(sizes_list);
+	if (!list)
+		exit(EXIT_FAILURE);
+	for (tok = strtok_r(list, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		if (nsizes == MAX_SIZES || atoi(tok) < 1) {
+			usage();
+			exit(EXIT_FAILURE);
+		}
+		sizes[nsizes++] = atoi(tok);
+	}
+	free(list);
+	if (!nsizes || nrunning < 0 || iterations < 1) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	if (!basepath) {
+		if (!mkdtemp(tmpdir)) {
+			perror("mkdtemp");
+			exit(EXIT_FAILURE);
+		}
+		basepath = tmpdir;
+	}
+
+	/* the fake containers need a socket each, the bulk queries too */
+	if (!getrlimit(RLIMIT_NOFILE, &rl)) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	/* a client whose server went away must not kill us */
+	signal(SIGPIPE, SIG_IGN);
+	/* the fake containers must not inherit what is buffered */
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	for (i = 0; i < nsizes; i++)
+		if (bench_size(i)) {
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+
+	/*
+	 * With linear operations the cost per container stays about the
+	 * same as the number of containers grows.
+	 */
+	if (nsizes > 1) {
+		ratio = (double)sizes[nsizes - 1] / sizes[0];
+		for (i = 0; i < OP_MAX; i++) {
+			growth = results[0][i] > 0 ?
+				results[nsizes - 1][i] / results[0][i] : 0;
+			printf("%-18s %dx the containers, %.2fx the cost per "
+			       "container%s\n", op_names[i], (int)ratio, growth,
+			       ratio >= 4 && growth > ratio / 2 ?
+			       " (superlinear?)" : "");
+		}
+	}
+
+out:
+	if (!keep && basepath == tmpdir)
+		rmdir(tmpdir);
+	exit(ret);
+}
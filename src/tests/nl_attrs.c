@@ -0,0 +1,297 @@
+/* nl_attrs.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * netlink_parse_attrs() on hand-made attribute lists, well formed or not,
+ * then netlink_dump() against the kernel, starting from a receive buffer
+ * too small for any answer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "lxc/nl.h"
+#include "lxc/network.h"
+
+#define TSTERR(fmt, ...) do { \
+	fprintf(stderr, "%d: " fmt "\n", __LINE__, ##__VA_ARGS__); \
+} while (0)
+
+#define MAXTYPE 5
+
+/* room for the attributes, kept aligned for struct rtattr */
+static union {
+	struct rtattr rta;
+	char buf[256];
+} attrs;
+static int attrs_len;
+
+/* append an attribute, returns its offset */
+static int add_attr(unsigned short type, const void *data, int len)
+{
+	struct rtattr *rta = (struct rtattr *)(attrs.buf + attrs_len);
+	int off = attrs_len;
+
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	attrs_len += RTA_SPACE(len);
+	return off;
+}
+
+static struct rtattr *at(int off)
+{
+	return (struct rtattr *)(attrs.buf + off);
+}
+
+/*
+ * Parse @len bytes of the attributes, tb is filled with garbage first
+ * and the slot past @max must be left alone.
+ */
+static void parse(struct rtattr *tb[], int max, int len)
+{
+	memset(tb, 0x5a, sizeof(*tb) * (max + 2));
+	netlink_parse_attrs(tb, max, &attrs.rta, len);
+}
+
+static bool check_tb(const char *what, struct rtattr *tb[], int max,
+		     struct rtattr **expected)
+{
+	struct rtattr *garbage;
+	int i;
+
+	memset(&garbage, 0x5a, sizeof(garbage));
+	for (i = 0; i <= max; i++) {
+		if (tb[i] != expected[i]) {
+			TSTERR("%s: attribute %d is %p, expected %p", what, i,
+			       (void *)tb[i], (void *)expected[i]);
+			return false;
+		}
+	}
+	if (tb[max + 1] != garbage) {
+		TSTERR("%s: written past the table", what);
+		return false;
+	}
+	return true;
+}
+
+static bool test_parse(void)
+{
+	struct rtattr *tb[MAXTYPE + 2], *expected[MAXTYPE + 1];
+	int one = 1, two = 2, o1, o3, o3b, o5, full;
+	char c = 'x';
+
+	attrs_len = 0;
+	o1 = add_attr(1, &one, sizeof(one));
+	o3 = add_attr(3, &c, 1);		/* padded */
+	add_attr(MAXTYPE + 1, &one, sizeof(one));	/* above max */
+	o5 = add_attr(5, "lo", 3);
+	full = attrs_len;
+
+	memset(expected, 0, sizeof(expected));
+	expected[1] = at(o1);
+	expected[3] = at(o3);
+	expected[5] = at(o5);
+	parse(tb, MAXTYPE, full);
+	if (!check_tb("well formed", tb, MAXTYPE, expected))
+		return false;
+	if (*(int *)RTA_DATA(tb[1]) != 1 || strcmp(RTA_DATA(tb[5]), "lo")) {
+		TSTERR("attributes are not parsed in place");
+		return false;
+	}
+
+	/* a smaller table only gets what fits */
+	expected[3] = expected[5] = NULL;
+	parse(tb, 1, full);
+	if (!check_tb("max 1", tb, 1, expected))
+		return false;
+	expected[1] = NULL;
+	parse(tb, 0, full);
+	if (!check_tb("max 0", tb, 0, expected))
+		return false;
+
+	/* the last one of a type wins */
+	o3b = add_attr(3, &two, sizeof(two));
+	full = attrs_len;
+	expected[1] = at(o1);
+	expected[3] = at(o3b);
+	expected[5] = at(o5);
+	parse(tb, MAXTYPE, full);
+	if (!check_tb("duplicate", tb, MAXTYPE, expected))
+		return false;
+
+	/* cut in the middle of the last attribute */
+	expected[3] = at(o3);
+	parse(tb, MAXTYPE, full - 2);
+	if (!check_tb("truncated", tb, MAXTYPE, expected))
+		return false;
+
+	/* an attribute claiming more than what is left stops the walk */
+	at(o5)->rta_len = 200;
+	expected[5] = NULL;
+	parse(tb, MAXTYPE, full);
+	if (!check_tb("too long", tb, MAXTYPE, expected))
+		return false;
+
+	/* so does one shorter than its own header, rather than looping */
+	at(o5)->rta_len = 2;
+	parse(tb, MAXTYPE, full);
+	if (!check_tb("too short", tb, MAXTYPE, expected))
+		return false;
+	at(o5)->rta_len = 0;
+	parse(tb, MAXTYPE, full);
+	if (!check_tb("zero length", tb, MAXTYPE, expected))
+		return false;
+
+	/* nothing to parse at all */
+	memset(expected, 0, sizeof(expected));
+	parse(tb, MAXTYPE, 0);
+	if (!check_tb("empty", tb, MAXTYPE, expected))
+		return false;
+	parse(tb, MAXTYPE, -8);
+	if (!check_tb("negative length", tb, MAXTYPE, expected))
+		return false;
+	parse(tb, MAXTYPE, sizeof(struct rtattr) - 1);
+	if (!check_tb("partial header", tb, MAXTYPE, expected))
+		return false;
+
+	return true;
+}
+
+struct dump_args {
+	int links;
+	int lo_index;
+	int lo_mtu;
+	int stop;
+};
+
+static int link_cb(struct nlmsghdr *msg, void *data)
+{
+	struct dump_args *args = data;
+	struct ifinfomsg *ifi = NLMSG_DATA(msg);
+	struct rtattr *tb[IFLA_MTU + 1];
+
+	if (args->stop)
+		return -args->stop;
+	if (msg->nlmsg_type != RTM_NEWLINK)
+		return 0;
+
+	args->links++;
+	netlink_parse_attrs(tb, IFLA_MTU, IFLA_RTA(ifi),
+			    msg->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi)));
+	if (tb[IFLA_IFNAME] && !strcmp(RTA_DATA(tb[IFLA_IFNAME]), "lo")) {
+		args->lo_index = ifi->ifi_index;
+		if (tb[IFLA_MTU] && RTA_PAYLOAD(tb[IFLA_MTU]) >= sizeof(int))
+			memcpy(&args->lo_mtu, RTA_DATA(tb[IFLA_MTU]),
+			       sizeof(int));
+	}
+	return 0;
+}
+
+static bool test_dump(void)
+{
+	struct nl_handler nlh;
+	struct dump_args args;
+	struct if_nameindex *ifs;
+	int err, nifs;
+	bool ok = false;
+
+	ifs = if_nameindex();
+	if (!ifs) {
+		TSTERR("failed to list the interfaces");
+		return false;
+	}
+	for (nifs = 0; ifs[nifs].if_index; nifs++)
+		;
+	if_freenameindex(ifs);
+
+	err = netlink_open(&nlh, NETLINK_ROUTE);
+	if (err) {
+		TSTERR("failed to open a netlink socket: %s", strerror(-err));
+		return false;
+	}
+
+	/* every answer has to grow it */
+	free(nlh.rcvbuf);
+	nlh.rcvbuf = malloc(16);
+	nlh.rcvbuf_size = 16;
+	if (!nlh.rcvbuf)
+		goto out;
+
+	/* a callback error ends the dump, its answers are left behind */
+	memset(&args, 0, sizeof(args));
+	args.stop = 42;
+	err = netlink_dump(&nlh, RTM_GETLINK, sizeof(struct ifinfomsg),
+			   AF_UNSPEC, link_cb, &args);
+	if (err != -42) {
+		TSTERR("aborted dump returned %d", err);
+		goto out;
+	}
+
+	/* and skipped by the next one, which has another sequence number */
+	memset(&args, 0, sizeof(args));
+	err = netlink_dump(&nlh, RTM_GETLINK, sizeof(struct ifinfomsg),
+			   AF_UNSPEC, link_cb, &args);
+	if (err) {
+		TSTERR("link dump failed: %s", strerror(-err));
+		goto out;
+	}
+	if (args.links != nifs) {
+		TSTERR("dump saw %d links, there are %d", args.links, nifs);
+		goto out;
+	}
+	if (args.lo_index != if_nametoindex("lo") || args.lo_mtu <= 0) {
+		TSTERR("lo not found in the dump");
+		goto out;
+	}
+	if (nlh.rcvbuf_size <= 16) {
+		TSTERR("the receive buffer did not grow");
+		goto out;
+	}
+
+	if (netdev_get_mtu(args.lo_index) != args.lo_mtu) {
+		TSTERR("netdev_get_mtu() disagrees with the dump");
+		goto out;
+	}
+	if (netdev_get_mtu(0x7ffffff0) != -1) {
+		TSTERR("netdev_get_mtu() found a missing interface");
+		goto out;
+	}
+	ok = true;
+
+out:
+	netlink_close(&nlh);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	if (!test_parse())
+		exit(EXIT_FAILURE);
+	if (!test_dump())
+		exit(EXIT_FAILURE);
+
+	printf("All netlink attribute tests passed\n");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,243 @@
+/* seccomp_policy.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * v2 seccomp policies are compiled into a binary tree of syscall numbers
+ * when libseccomp can.  A blacklist gives each of its syscalls its own
+ * errno, a child loads the policy and checks every syscall lands on its
+ * own rule, once compiled and once from the policy cache.  Malformed
+ * policies must be refused.  Must run as root, and not already under a
+ * seccomp filter.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <seccomp.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "lxc/conf.h"
+#include "lxc/lxcseccomp.h"
+
+#define TSTERR(fmt, ...) do { \
+	fprintf(stderr, "%d: " fmt "\n", __LINE__, ##__VA_ARGS__); \
+} while (0)
+
+/*
+ * None of these does anything when called with null arguments, should
+ * the filter not be there.
+ */
+#define RULE(name) { #name, SYS_##name }
+static const struct {
+	const char *name;
+	long nr;
+} rules[] = {
+	RULE(chroot),
+	RULE(mount),
+	RULE(umount2),
+	RULE(swapon),
+	RULE(swapoff),
+	RULE(pivot_root),
+	RULE(init_module),
+	RULE(delete_module),
+	RULE(quotactl),
+	RULE(syslog),
+	RULE(kexec_load),
+	RULE(settimeofday),
+	RULE(adjtimex),
+	RULE(mknod),
+	RULE(unshare),
+	RULE(setns),
+	RULE(personality),
+	RULE(ptrace),
+};
+#define NRULES (sizeof(rules) / sizeof(rules[0]))
+#define RULE_ERRNO(i) (20 + (int)(i))
+
+static const char *bad_policies[] = {
+	"",
+	"3\nblacklist\n",
+	"1\nblacklist\nmount\n",
+	"2\ngraylist\n",
+	"2\nblacklist errno\n",
+	"2\nblacklist\n[sparc]\nmount\n",
+	"2\nblacklist\nmount errno x\n",
+	"2\nblacklist debug\n",
+};
+
+static bool already_confined(void)
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	char line[1024];
+	int v = 0;
+
+	if (!f)
+		return false;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "Seccomp: %d", &v) == 1)
+			break;
+	fclose(f);
+	return v != 0;
+}
+
+static bool write_policy(const char *path, const char *policy)
+{
+	FILE *f = fopen(path, "w");
+
+	if (!f) {
+		TSTERR("failed to create %s", path);
+		return false;
+	}
+	fputs(policy, f);
+	return fclose(f) == 0;
+}
+
+/* read the policy through a fresh conf, -1 if lxc refused it */
+static int read_policy(const char *path, struct lxc_conf **confp)
+{
+	struct lxc_conf *conf;
+	int ret;
+
+	conf = lxc_conf_init();
+	if (!conf) {
+		TSTERR("failed to allocate a conf");
+		return -2;
+	}
+	conf->seccomp = strdup(path);
+	if (!conf->seccomp) {
+		lxc_conf_free(conf);
+		return -2;
+	}
+	ret = lxc_read_seccomp_config(conf);
+	if (ret < 0 || !confp)
+		lxc_conf_free(conf);
+	else
+		*confp = conf;
+	return ret;
+}
+
+/* load the policy in a child, which tries each syscall */
+static bool check_rules(struct lxc_conf *conf, const char *what)
+{
+	pid_t pid;
+	int status;
+	size_t i;
+
+	pid = fork();
+	if (pid < 0) {
+		TSTERR("fork failed");
+		return false;
+	}
+	if (!pid) {
+		if (lxc_seccomp_load(conf))
+			_exit(100);
+		for (i = 0; i < NRULES; i++) {
+			errno = 0;
+			if (syscall(rules[i].nr, 0, 0, 0, 0, 0, 0) != -1 ||
+			    errno != RULE_ERRNO(i))
+				_exit(1 + i);
+		}
+		/* and what has no rule goes through */
+		if (syscall(SYS_getppid) != getppid() || getpid() <= 0)
+			_exit(99);
+		_exit(0);
+	}
+
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+		TSTERR("%s: the child died", what);
+		return false;
+	}
+	status = WEXITSTATUS(status);
+	if (status == 100)
+		TSTERR("%s: failed to load the policy", what);
+	else if (status == 99)
+		TSTERR("%s: a syscall without rule was caught", what);
+	else if (status)
+		TSTERR("%s: %s did not fail with errno %d", what,
+		       rules[status - 1].name, RULE_ERRNO(status - 1));
+	return status == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char path[] = "/tmp/lxc-test-seccomp-XXXXXX";
+	char *policy, *p;
+	struct lxc_conf *conf;
+	size_t i;
+	int fd, ret = EXIT_FAILURE;
+
+	if (geteuid() != 0 || already_confined()) {
+		printf("Must run as root, outside of any seccomp filter\n");
+		exit(EXIT_SUCCESS);
+	}
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		TSTERR("failed to create a policy file");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	for (i = 0; i < sizeof(bad_policies) / sizeof(bad_policies[0]); i++) {
+		if (!write_policy(path, bad_policies[i]))
+			goto out;
+		if (read_policy(path, NULL) != -1) {
+			TSTERR("policy '%s' was not refused", bad_policies[i]);
+			goto out;
+		}
+	}
+
+	/* the comment makes the policy new to the cache */
+	policy = malloc(4096);
+	if (!policy)
+		goto out;
+	p = policy + sprintf(policy, "2\nblacklist\n# %ld %d\n\n[all]\n",
+			     (long)time(NULL), getpid());
+	p += sprintf(p, "not_a_syscall\n");
+	for (i = 0; i < NRULES; i++)
+		p += sprintf(p, "%s errno %d\n", rules[i].name, RULE_ERRNO(i));
+	if (!write_policy(path, policy)) {
+		free(policy);
+		goto out;
+	}
+	free(policy);
+
+	/* compiled, then from the cache when the rundir is writable */
+	for (i = 0; i < 2; i++) {
+		conf = NULL;
+		if (read_policy(path, &conf)) {
+			TSTERR("the policy was refused");
+			goto out;
+		}
+		if (!check_rules(conf, i ? "cached" : "compiled")) {
+			lxc_conf_free(conf);
+			goto out;
+		}
+		lxc_conf_free(conf);
+	}
+
+	printf("All seccomp policy tests passed\n");
+	ret = EXIT_SUCCESS;
+out:
+	unlink(path);
+	exit(ret);
+}
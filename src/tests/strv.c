@@ -0,0 +1,291 @@
+/* strv.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Packed string arrays: lxc_strv_finish() puts the pointers and the
+ * characters in one allocation, the strings right after the NULL which
+ * ends the array.  The split helpers return such arrays.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "lxc/utils.h"
+
+#define TSTERR(fmt, ...) do { \
+	fprintf(stderr, "%d: " fmt "\n", __LINE__, ##__VA_ARGS__); \
+} while (0)
+
+/* @expected is NULL-terminated; also checks the array is packed */
+static bool check_array(const char *what, char **array,
+			const char * const *expected)
+{
+	char *p;
+	size_t i, n;
+
+	if (!array) {
+		TSTERR("%s: no array", what);
+		return false;
+	}
+	for (n = 0; expected[n]; n++)
+		;
+	p = (char *)(array + n + 1);
+	for (i = 0; i <= n; i++) {
+		if (!expected[i]) {
+			if (array[i]) {
+				TSTERR("%s: extra element '%s'", what, array[i]);
+				return false;
+			}
+			break;
+		}
+		if (!array[i] || strcmp(array[i], expected[i])) {
+			TSTERR("%s: element %zu is '%s', expected '%s'", what,
+			       i, array[i] ? array[i] : "(null)", expected[i]);
+			return false;
+		}
+		if (array[i] != p) {
+			TSTERR("%s: element %zu is not packed", what, i);
+			return false;
+		}
+		p += strlen(p) + 1;
+	}
+	return true;
+}
+
+static const struct {
+	const char *string;
+	char sep;
+	bool trim;
+	const char *expected[5];
+} splits[] = {
+	{ "a,b,c", ',', false, { "a", "b", "c", NULL } },
+	{ ",,a,,b,,", ',', false, { "a", "b", NULL } },
+	{ "", ',', false, { NULL } },
+	{ ",,,", ',', false, { NULL } },
+	{ "abc", ',', false, { "abc", NULL } },
+	{ " a , b ,c", ',', false, { " a ", " b ", "c", NULL } },
+	{ " a , b ,\tc\t", ',', true, { "a", "b", "c", NULL } },
+	/* trimmed down to nothing, as it always was */
+	{ "a, ,b", ',', true, { "a", "", "b", NULL } },
+	{ "cpu,cpuacct", ',', true, { "cpu", "cpuacct", NULL } },
+};
+
+static const struct {
+	const char *path;
+	const char *expected[4];
+} paths[] = {
+	{ "/", { NULL } },
+	{ "foo/../bar", { "bar", NULL } },
+	{ "../../", { NULL } },
+	{ "./bar/baz/..", { "bar", NULL } },
+	{ "foo//bar", { "foo", "bar", NULL } },
+	{ "/a/b/../../c/", { "c", NULL } },
+};
+
+static bool test_builder(void)
+{
+	struct lxc_strv sv = LXC_STRV_INIT;
+	const char *none[] = { NULL };
+	const char *expected[4];
+	char **array, s[200];
+	size_t i, len;
+
+	/* nothing added still gives an empty array */
+	array = lxc_strv_finish(&sv);
+	if (!check_array("empty builder", array, none))
+		return false;
+	free(array);
+
+	/* around the first buffer size, and the builder is reset */
+	for (len = 60; len < 70; len++) {
+		memset(s, 'x', len);
+		s[len] = '\0';
+		if (lxc_strv_add(&sv, "", 0) || lxc_strv_add(&sv, s, len) ||
+		    lxc_strv_add(&sv, "abcdef", 3)) {
+			TSTERR("failed to add strings");
+			return false;
+		}
+		array = lxc_strv_finish(&sv);
+		expected[0] = "";
+		expected[1] = s;
+		expected[2] = "abc";
+		expected[3] = NULL;
+		if (!check_array("small builder", array, expected))
+			return false;
+		free(array);
+		if (sv.buf || sv.len || sv.count) {
+			TSTERR("builder not reset by lxc_strv_finish()");
+			return false;
+		}
+	}
+
+	/* many strings, growing the buffer several times */
+	for (i = 0; i < 10000; i++) {
+		snprintf(s, sizeof(s), "%zu", i);
+		if (lxc_strv_add(&sv, s, strlen(s))) {
+			TSTERR("failed to add string %zu", i);
+			lxc_strv_free(&sv);
+			return false;
+		}
+	}
+	array = lxc_strv_finish(&sv);
+	if (!array) {
+		TSTERR("failed to finish the large array");
+		return false;
+	}
+	for (i = 0; i < 10000; i++) {
+		snprintf(s, sizeof(s), "%zu", i);
+		if (!array[i] || strcmp(array[i], s)) {
+			TSTERR("element %zu of the large array is wrong", i);
+			free(array);
+			return false;
+		}
+	}
+	if (array[10000]) {
+		TSTERR("large array not NULL-terminated");
+		free(array);
+		return false;
+	}
+	free(array);
+
+	/* dropped halfway */
+	if (lxc_strv_add(&sv, "a", 1)) {
+		TSTERR("failed to add a string");
+		return false;
+	}
+	lxc_strv_free(&sv);
+	if (sv.buf || sv.count) {
+		TSTERR("builder not reset by lxc_strv_free()");
+		return false;
+	}
+	return true;
+}
+
+static bool test_readat(void)
+{
+	char dir[] = "/tmp/lxc-test-strv-XXXXXX", buf[8];
+	int dfd, ret;
+	bool ok = false;
+
+	if (!mkdtemp(dir)) {
+		TSTERR("failed to create a temporary directory");
+		return false;
+	}
+	dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0) {
+		TSTERR("failed to open %s", dir);
+		goto out;
+	}
+
+	/* lxc_writeat() does not create the file */
+	if (lxc_writeat(dfd, "f", "x", 1) == 0) {
+		TSTERR("lxc_writeat() created a file");
+		goto out;
+	}
+	close(openat(dfd, "f", O_CREAT | O_WRONLY | O_CLOEXEC, 0600));
+	if (lxc_writeat(dfd, "f", "0123456789", 10)) {
+		TSTERR("lxc_writeat() failed");
+		goto out;
+	}
+
+	/* count - 1 bytes at most, always terminated */
+	ret = lxc_readat(dfd, "f", buf, sizeof(buf));
+	if (ret != sizeof(buf) - 1 || strcmp(buf, "0123456")) {
+		TSTERR("lxc_readat() returned %d '%s'", ret, buf);
+		goto out;
+	}
+	ret = lxc_readat(dfd, "f", buf, 1);
+	if (ret != 0 || buf[0]) {
+		TSTERR("lxc_readat() into one byte returned %d", ret);
+		goto out;
+	}
+	if (lxc_readat(dfd, "f", buf, 0) >= 0) {
+		TSTERR("lxc_readat() into no buffer succeeded");
+		goto out;
+	}
+	if (lxc_readat(dfd, "missing", buf, sizeof(buf)) >= 0) {
+		TSTERR("lxc_readat() of a missing file succeeded");
+		goto out;
+	}
+	ok = true;
+
+out:
+	if (dfd >= 0) {
+		unlinkat(dfd, "f", 0);
+		close(dfd);
+	}
+	rmdir(dir);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	char **array;
+	size_t i;
+
+	if (!test_builder())
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < sizeof(splits) / sizeof(splits[0]); i++) {
+		if (splits[i].trim)
+			array = lxc_string_split_and_trim(splits[i].string,
+							  splits[i].sep);
+		else
+			array = lxc_string_split(splits[i].string,
+						 splits[i].sep);
+		if (!check_array(splits[i].string, array, splits[i].expected))
+			exit(EXIT_FAILURE);
+		free(array);
+	}
+
+	/* a NULL string splits into an empty array */
+	array = lxc_string_split(NULL, ',');
+	if (!array || array[0]) {
+		TSTERR("NULL string did not give an empty array");
+		exit(EXIT_FAILURE);
+	}
+	free(array);
+
+	/* the components are moved around, not the characters */
+	for (i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+		const char * const *e = paths[i].expected;
+		size_t j;
+
+		array = lxc_normalize_path(paths[i].path);
+		if (!array) {
+			TSTERR("failed to normalize '%s'", paths[i].path);
+			exit(EXIT_FAILURE);
+		}
+		for (j = 0; e[j]; j++)
+			if (!array[j] || strcmp(array[j], e[j]))
+				break;
+		if (e[j] || array[j]) {
+			TSTERR("'%s' normalized wrongly", paths[i].path);
+			exit(EXIT_FAILURE);
+		}
+		free(array);
+	}
+
+	if (!test_readat())
+		exit(EXIT_FAILURE);
+
+	printf("All packed array tests passed\n");
+	exit(EXIT_SUCCESS);
+}